@@ -14,8 +14,13 @@ document.addEventListener('DOMContentLoaded', function() {
     checkConnection();
     setInterval(checkConnection, 2000);
 
-    // Monitor stream for FPS
-    monitorStreamFPS();
+    // ?ws=1 shows the camera over the WebSocket channel instead of /stream
+    if (new URLSearchParams(location.search).get('ws') === '1') {
+        startWebSocketStream();
+    } else {
+        // Monitor stream for FPS
+        monitorStreamFPS();
+    }
 });
 
 async function checkConnection() {
@@ -74,4 +79,76 @@ async function monitorStreamFPS() {
     }
 }
 
+// WebSocket video (/ws/video): one binary message per frame, a 16-byte
+// header (sequence, capture ms, x, y, w, h; little-endian) then the JPEG.
+// Each frame is acknowledged once drawn, which lets the camera send the next.
+function startWebSocketStream() {
+    const img = document.getElementById('camera-stream');
+    const canvas = document.getElementById('camera-canvas');
+    const ctx = canvas.getContext('2d');
+    img.removeAttribute('src');
+    img.hidden = true;
+    canvas.hidden = false;
+
+    const mode = document.getElementById('stream-mode');
+    mode.textContent = 'WebSocket';
+    mode.href = location.pathname;
+
+    // Cycle: from an ack to the next frame on screen (capture, transfer,
+    // decode and draw)
+    let frames = 0;
+    let cycleTotal = 0;
+    let ackAt = 0;
+    let ws = null;
+    setInterval(() => {
+        document.getElementById('info-fps').textContent = frames + ' fps';
+        document.getElementById('info-latency').textContent = frames ? Math.round(cycleTotal / frames) + ' ms' : '--';
+        frames = 0;
+        cycleTotal = 0;
+    }, 1000);
+    document.addEventListener('visibilitychange', () => {
+        if (ws && ws.readyState === WebSocket.OPEN) ws.send(JSON.stringify({pause: document.hidden}));
+    });
+
+    function connect() {
+        ackAt = 0;
+        const socket = new WebSocket((location.protocol === 'https:' ? 'wss://' : 'ws://') + location.host + '/ws/video');
+        ws = socket;
+        socket.binaryType = 'arraybuffer';
+        socket.onmessage = async (event) => {
+            if (typeof event.data === 'string') {
+                console.warn('WebSocket video:', event.data);
+                return;
+            }
+            const header = new DataView(event.data, 0, 16);
+            const sequence = header.getUint32(0, true);
+            const width = header.getUint16(12, true);
+            const height = header.getUint16(14, true);
+            try {
+                const bitmap = await createImageBitmap(new Blob([new Uint8Array(event.data, 16)], {type: 'image/jpeg'}));
+                if (canvas.width !== bitmap.width || canvas.height !== bitmap.height) {
+                    canvas.width = bitmap.width;
+                    canvas.height = bitmap.height;
+                }
+                ctx.drawImage(bitmap, 0, 0);
+                bitmap.close();
+                document.getElementById('info-resolution').textContent = width + 'x' + height;
+            } catch (error) {
+                console.error('Frame decode failed', error);
+            }
+            const now = performance.now();
+            if (ackAt) {
+                frames++;
+                cycleTotal += now - ackAt;
+            }
+            if (socket.readyState === WebSocket.OPEN) {
+                socket.send(JSON.stringify({ack: sequence}));
+                ackAt = now;
+            }
+        };
+        socket.onclose = () => setTimeout(connect, 2000);
+    }
+    connect();
+}
+
 console.log('ESP32-CAM Stream Ready');
@@ -1,5 +1,8 @@
 let currentPath = '/';
 let currentFiles = []; // Store current directory files for duplicate check
+const THUMB_EXTENSIONS = /\.(jpe?g|avi|mjpe?g)$/i;
+const THUMB_MAX_ATTEMPTS = 10;
+const CLIP_EXTENSIONS = /\.(avi|mjpe?g)$/i;
 
 async function refreshFiles() {
     try {
@@ -46,6 +49,7 @@ function createFileItem(name, size, isDir, isUp = false) {
             ${!isUp && !isDir ? `<button class="action-btn btn-success" onclick="editFile('${name}', event)">✏️ Editar</button>` : ''}
             ${!isUp && !isDir ? `<button class="action-btn btn-primary" onclick="downloadFile('${name}', event)">⬇️ Download</button>` : ''}
             ${!isUp && !isDir ? `<button class="action-btn btn-primary" onclick="viewFile('${name}', event)">👁️ Ver</button>` : ''}
+            ${!isUp && !isDir && CLIP_EXTENSIONS.test(name) ? `<button class="action-btn btn-primary" onclick="playFile('${name}', event)">▶️ Reproduzir</button>` : ''}
             ${!isUp ? `<button class="action-btn btn-danger" onclick="deleteFile('${name}', ${isDir}, event)">🗑️ Deletar</button>` : ''}
         </div>
     `;
@@ -54,9 +58,41 @@ function createFileItem(name, size, isDir, isUp = false) {
         item.onclick = () => navigateTo(isUp ? '..' : name);
     }
 
+    if (!isDir && !isUp && THUMB_EXTENSIONS.test(name)) {
+        const filepath = (currentPath + '/' + name).replace('//', '/');
+        loadThumbnail(item.querySelector('.file-icon'), filepath);
+    }
+
     return item;
 }
 
+// Thumbnails are generated on the device in the background: 202 (or 503
+// while busy) means "ask again after Retry-After seconds"
+async function loadThumbnail(icon, filepath, attempt = 0) {
+    try {
+        const response = await fetch('/api/files/thumb?file=' + encodeURIComponent(filepath));
+        if (response.status === 202 || response.status === 503) {
+            if (attempt + 1 >= THUMB_MAX_ATTEMPTS) return;
+            const wait = parseInt(response.headers.get('Retry-After') || '1', 10) * 1000;
+            setTimeout(() => {
+                if (icon.isConnected) loadThumbnail(icon, filepath, attempt + 1);
+            }, wait);
+            return;
+        }
+        if (!response.ok) return;
+
+        const img = document.createElement('img');
+        img.className = 'file-thumb';
+        img.alt = '';
+        img.src = URL.createObjectURL(await response.blob());
+        img.onload = () => URL.revokeObjectURL(img.src);
+        icon.classList.add('has-thumb');
+        icon.replaceChildren(img);
+    } catch (error) {
+        // Keep the generic icon
+    }
+}
+
 function navigateTo(name) {
     if (name === '..') {
         // Navigate to parent directory
@@ -99,6 +135,15 @@ async function viewFile(name, event) {
     window.open('/api/files/view?file=' + encodeURIComponent(filepath), '_blank');
 }
 
+// Streamed by the device at the chosen speed (no download first)
+async function playFile(name, event) {
+    event.stopPropagation();
+    const filepath = (currentPath + '/' + name).replace('//', '/');
+    const speed = prompt('Velocidade (0.25 a 16):', '1');
+    if (speed === null) return;
+    window.open('/stream/playback?file=' + encodeURIComponent(filepath) + '&speed=' + encodeURIComponent(speed), '_blank');
+}
+
 async function deleteFile(name, isDir, event) {
     event.stopPropagation();
     const type = isDir ? 'pasta' : 'arquivo';
@@ -48,8 +48,9 @@ function handleFileSelection(file) {
     console.log('File selected:', file.name);
 
     // Client-side validation: check file extension
-    if (!file.name.toLowerCase().endsWith('.bin')) {
-        showError('Arquivo inválido: apenas arquivos .bin são aceitos');
+    // .bin (raw), .gz / .hs (compressed) and .odlt (delta) images from tools/ota_image.py
+    if (!/\.(bin|gz|hs|odlt)$/i.test(file.name)) {
+        showError('Arquivo inválido: apenas arquivos .bin, .gz, .hs ou .odlt são aceitos');
         return;
     }
 
@@ -78,9 +79,14 @@ function handleFileSelection(file) {
 }
 
 // Upload firmware
+// The image is staged on the SD card in slices (the camera keeps running),
+// verified by the device and then flashed by a background task. A failed
+// slice is resumed from the byte count the device reports.
+const SLICE_SIZE = 64 * 1024;
+const SLICE_RETRIES = 5;
+
 async function uploadFirmware(file) {
     uploadInProgress = true;
-    let uploadCompleted = false; // Track if upload reached 100%
 
     // Update UI
     document.getElementById('uploadZone').classList.add('uploading');
@@ -97,96 +103,130 @@ async function uploadFirmware(file) {
     // Prevent navigation during upload
     window.addEventListener('beforeunload', preventNavigation);
 
-    const formData = new FormData();
-    formData.append('file', file);
+    try {
+        await stageImage(file);
+
+        updateProgress(100, '🔍 Verificando imagem no cartão SD...');
+        const verified = await waitForStagedState(['ready'], ['invalid']);
+        console.log(`Image verified: sha256 ${verified.sha256}, signature ${verified.signature}, ${verified.hash_kbps} KB/s`);
 
-    const xhr = new XMLHttpRequest();
+        updateProgress(100, '⚡ Gravando firmware na flash...');
+        const applyResponse = await fetch('/api/firmware/apply', { method: 'POST' });
+        if (!applyResponse.ok) {
+            const result = await applyResponse.json().catch(() => ({}));
+            throw new Error(result.error || `Erro ao gravar: ${applyResponse.status}`);
+        }
 
-    // Progress tracking
-    xhr.upload.addEventListener('progress', function(e) {
-        if (e.lengthComputable) {
-            const percent = Math.round((e.loaded / e.total) * 100);
-            updateProgress(percent);
+        await waitForFlash();
+        handleUploadSuccess();
+    } catch (error) {
+        console.error('Staged upload failed:', error);
+        handleUploadError(error.message);
+    }
+}
 
-            // Mark as completed when upload reaches 100%
-            if (percent >= 100) {
-                uploadCompleted = true;
-                console.log('Upload data transmission completed (100%)');
+// Upload the image slice by slice, resuming from the device's staged size
+async function stageImage(file) {
+    let offset = 0;
+
+    // Resume a previous partial upload of the same size
+    const status = await fetchStagedStatus();
+    if (status && status.state === 'uploading' && status.total_bytes === file.size) {
+        offset = status.staged_bytes;
+        console.log('Resuming staged upload at', offset);
+    }
+
+    let retries = 0;
+    while (offset < file.size) {
+        const slice = file.slice(offset, Math.min(offset + SLICE_SIZE, file.size));
+        try {
+            await postSlice(slice, offset, file.size, file.name, (sent) => {
+                updateProgress(Math.round(((offset + sent) / file.size) * 100));
+            });
+            offset += slice.size;
+            retries = 0;
+        } catch (error) {
+            if (++retries > SLICE_RETRIES) {
+                throw error;
+            }
+            console.warn(`Slice at ${offset} failed (${error.message}), retry ${retries}`);
+            await sleep(1000 * retries);
+            const current = await fetchStagedStatus();
+            if (current && current.total_bytes === file.size) {
+                offset = current.staged_bytes;
             }
         }
-    });
-
-    // Upload complete
-    xhr.addEventListener('load', function() {
-        console.log('Upload complete - Status:', xhr.status);
-        console.log('Response text:', xhr.responseText);
+    }
+}
 
-        if (xhr.status === 200) {
-            // Parse response
+function postSlice(slice, offset, total, name, onProgress) {
+    return new Promise((resolve, reject) => {
+        const formData = new FormData();
+        formData.append('file', slice, name);
+
+        const xhr = new XMLHttpRequest();
+        xhr.upload.addEventListener('progress', (e) => {
+            if (e.lengthComputable) onProgress(e.loaded);
+        });
+        xhr.addEventListener('load', () => {
+            let response = {};
             try {
-                const response = JSON.parse(xhr.responseText);
-                console.log('Parsed response:', response);
-
-                if (response.error) {
-                    handleUploadError(response.error);
-                } else {
-                    handleUploadSuccess();
-                }
+                response = JSON.parse(xhr.responseText);
             } catch (e) {
-                console.error('Failed to parse response:', e);
-                console.error('Response was:', xhr.responseText);
-                handleUploadError('Erro ao processar resposta do servidor');
+                // Non-JSON body, fall through to the status check
             }
-        } else {
-            let errorMsg = 'Erro no upload';
-            try {
-                const response = JSON.parse(xhr.responseText);
-                if (response.error) {
-                    errorMsg = response.error;
-                }
-            } catch (e) {
-                errorMsg = `Erro no upload: ${xhr.status}`;
+            if (xhr.status === 200 && !response.error) {
+                resolve(response);
+            } else {
+                reject(new Error(response.error || `Erro no upload: ${xhr.status}`));
             }
-            console.error('Upload failed with status:', xhr.status, 'Message:', errorMsg);
-            handleUploadError(errorMsg);
-        }
-    });
+        });
+        xhr.addEventListener('error', () => reject(new Error('Erro de conexão durante o upload')));
+        xhr.addEventListener('timeout', () => reject(new Error('Timeout no envio do bloco')));
 
-    // Upload error
-    xhr.addEventListener('error', function(e) {
-        console.error('XHR error event:', e);
-        console.error('XHR state:', xhr.readyState);
-        console.error('XHR status:', xhr.status);
-        console.log('Upload completed flag:', uploadCompleted);
-
-        // If upload was completed (100%), treat connection error as success
-        // This happens because ESP32 reboots immediately after sending response
-        if (uploadCompleted) {
-            console.log('Upload was completed before connection closed - treating as success');
-            handleUploadSuccess();
-        } else {
-            handleUploadError('Erro de conexão durante o upload. Verifique a conexão com o dispositivo.');
-        }
+        xhr.open('POST', `/api/firmware/stage?offset=${offset}&total=${total}`);
+        xhr.timeout = 60000;
+        xhr.send(formData);
     });
+}
 
-    // Upload timeout
-    xhr.addEventListener('timeout', function() {
-        console.error('XHR timeout - upload took too long');
-        handleUploadError('Timeout: o upload demorou muito tempo');
-    });
+async function fetchStagedStatus() {
+    try {
+        const response = await fetch('/api/firmware/staged', { cache: 'no-cache' });
+        return response.ok ? await response.json() : null;
+    } catch (e) {
+        return null;
+    }
+}
 
-    // Upload abort
-    xhr.addEventListener('abort', function() {
-        console.error('XHR aborted');
-        handleUploadError('Upload cancelado');
-    });
+async function waitForStagedState(okStates, failStates) {
+    for (let i = 0; i < 120; i++) {
+        const status = await fetchStagedStatus();
+        if (status && okStates.includes(status.state)) return status;
+        if (status && failStates.includes(status.state)) {
+            throw new Error(status.error || 'Imagem de firmware inválida');
+        }
+        await sleep(500);
+    }
+    throw new Error('Timeout aguardando verificação do firmware');
+}
+
+// Poll flash progress; the device stops answering once it reboots
+async function waitForFlash() {
+    for (let i = 0; i < 240; i++) {
+        const status = await fetchStagedStatus();
+        if (!status || status.state === 'rebooting') return;
+        if (status.state === 'flashing' && status.flash_percent !== undefined) {
+            updateProgress(Math.round(status.flash_percent), '⚡ Gravando firmware na flash...');
+        } else if (status.error) {
+            throw new Error(status.error);
+        }
+        await sleep(500);
+    }
+}
 
-    // Send request
-    console.log('Sending firmware to /api/firmware/upload');
-    console.log('File size:', file.size, 'bytes');
-    xhr.open('POST', '/api/firmware/upload');
-    xhr.timeout = 300000; // Increased to 5 minutes timeout for large files
-    xhr.send(formData);
+function sleep(ms) {
+    return new Promise(resolve => setTimeout(resolve, ms));
 }
 
 // Update progress bar
@@ -61,6 +61,24 @@ async function refreshHealth() {
         console.error('Error fetching health data:', error);
         showError('Erro ao carregar dados de saúde: ' + error.message);
     }
+
+    refreshTasks();
+}
+
+// Fetch and display task profiling data
+async function refreshTasks() {
+    try {
+        const response = await fetch('/api/health/tasks');
+
+        if (!response.ok) {
+            throw new Error(`HTTP error! status: ${response.status}`);
+        }
+
+        updateTasks(await response.json());
+
+    } catch (error) {
+        console.error('Error fetching task data:', error);
+    }
 }
 
 // Update all display elements
@@ -181,7 +199,11 @@ function updateHardware(cpu, flash) {
         document.getElementById('cpu-model').textContent = cpu.chip_model || '--';
         document.getElementById('cpu-revision').textContent = cpu.chip_revision || '--';
         document.getElementById('cpu-freq').textContent = cpu.frequency_mhz ? `${cpu.frequency_mhz} MHz` : '--';
-        document.getElementById('cpu-cores').textContent = cpu.cores || '--';
+        let cores = cpu.cores || '--';
+        if (Array.isArray(cpu.usage_percent) && cpu.usage_percent.some(value => value !== null)) {
+            cores += ` (${cpu.usage_percent.map(value => value === null ? '--' : `${value}%`).join(' / ')})`;
+        }
+        document.getElementById('cpu-cores').textContent = cores;
         document.getElementById('sdk-version').textContent = cpu.sdk_version || '--';
     }
 
@@ -192,6 +214,80 @@ function updateHardware(cpu, flash) {
 
 // Update application status (removed - no tracking functionality)
 
+// Update task table, per-core usage and timeline
+function updateTasks(data) {
+    const cores = data.cores || [];
+    for (let core = 0; core < 2; core++) {
+        const value = cores[core];
+        document.getElementById(`core${core}-usage`).textContent =
+            value === undefined || value === null ? 'N/A' : `${value}%`;
+    }
+    document.getElementById('cpu-window').textContent =
+        data.run_time_stats ? `${data.window_s} s` : 'sem run-time stats no firmware';
+
+    const tasks = (data.tasks || []).slice().sort((a, b) =>
+        (b.cpu_percent || 0) - (a.cpu_percent || 0) || a.name.localeCompare(b.name));
+    const body = document.getElementById('tasks-body');
+    body.replaceChildren(...tasks.map(task => {
+        const row = document.createElement('tr');
+        if (task.stack_low) row.classList.add('stack-low');
+        const cells = [
+            task.name,
+            task.core === null ? 'qualquer' : task.core,
+            task.priority,
+            task.state,
+            task.cpu_percent === undefined ? '--' : `${task.cpu_percent}%`,
+            formatBytes(task.stack_free_min)
+        ];
+        for (const value of cells) {
+            const cell = document.createElement('td');
+            cell.textContent = value;
+            row.appendChild(cell);
+        }
+        return row;
+    }));
+
+    drawTimeline(data.timeline);
+}
+
+// Per-core usage over the last samples, one line per core (0-100%)
+function drawTimeline(timeline) {
+    const canvas = document.getElementById('cpu-timeline');
+    const context = canvas.getContext('2d');
+    context.clearRect(0, 0, canvas.width, canvas.height);
+    if (!timeline || !timeline.cores) return;
+
+    const styles = getComputedStyle(document.documentElement);
+    const colors = [styles.getPropertyValue('--primary-color'), styles.getPropertyValue('--warning-color')];
+
+    context.strokeStyle = styles.getPropertyValue('--border-color');
+    context.lineWidth = 1;
+    for (const level of [25, 50, 75]) {
+        const y = canvas.height - level * canvas.height / 100;
+        context.beginPath();
+        context.moveTo(0, y);
+        context.lineTo(canvas.width, y);
+        context.stroke();
+    }
+
+    const capacity = 60;
+    const step = canvas.width / (capacity - 1);
+    timeline.cores.forEach((series, core) => {
+        if (series.length < 2) return;
+        const offset = capacity - series.length;
+        context.strokeStyle = colors[core % colors.length].trim();
+        context.lineWidth = 2;
+        context.beginPath();
+        series.forEach((value, i) => {
+            const x = (offset + i) * step;
+            const y = canvas.height - value * canvas.height / 100;
+            if (i === 0) context.moveTo(x, y);
+            else context.lineTo(x, y);
+        });
+        context.stroke();
+    });
+}
+
 // Update progress bar
 function updateProgressBar(elementId, percentage) {
     const progressBar = document.getElementById(elementId);
@@ -0,0 +1,97 @@
+/**
+ * Static Tensor Arena Planner Implementation
+ */
+
+#include "arena_planner.h"
+
+static inline bool overlaps(const ArenaBuffer &a, const ArenaBuffer &b) {
+  return a.firstUse <= b.lastUse && b.firstUse <= a.lastUse;
+}
+
+// Placed in the same region while both are live
+static inline bool conflicts(const ArenaBuffer &buffer, const ArenaBuffer &other, uint8_t region) {
+  return &other != &buffer && other.offset != ARENA_UNPLACED && other.region == region && overlaps(buffer, other);
+}
+
+static inline uint32_t alignUp(uint32_t value, uint32_t align) {
+  return (value + align - 1) & ~(align - 1);
+}
+
+void arenaOrderBySize(const ArenaBuffer *buffers, uint16_t *order, uint16_t count) {
+  for (uint16_t i = 0; i < count; i++) order[i] = i;
+  // Insertion sort: stable and small (at most a few hundred tensors)
+  for (uint16_t i = 1; i < count; i++) {
+    uint16_t index = order[i];
+    uint16_t j = i;
+    while (j > 0 && buffers[order[j - 1]].size < buffers[index].size) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = index;
+  }
+}
+
+uint16_t arenaPlace(ArenaBuffer *buffers, uint16_t count, const uint16_t *order, uint16_t orderCount,
+                    uint8_t region, uint32_t capacity, uint32_t align) {
+  uint16_t placed = 0;
+  for (uint16_t i = 0; i < orderCount; i++) {
+    ArenaBuffer &buffer = buffers[order[i]];
+    if (buffer.offset != ARENA_UNPLACED || buffer.size == 0) continue;
+
+    // Candidate offsets: 0 and the end of every conflicting placement; the
+    // lowest one that collides with nothing wins
+    uint32_t offset = UINT32_MAX;
+    for (int32_t c = -1; c < (int32_t)count; c++) {
+      uint32_t candidate = 0;
+      if (c >= 0) {
+        const ArenaBuffer &other = buffers[c];
+        if (!conflicts(buffer, other, region)) continue;
+        candidate = alignUp(other.offset + other.size, align);
+      }
+      if (candidate >= offset) continue;
+      bool free = true;
+      for (uint16_t j = 0; j < count && free; j++) {
+        const ArenaBuffer &other = buffers[j];
+        free = !conflicts(buffer, other, region) || candidate + buffer.size <= (uint32_t)other.offset ||
+               (uint32_t)other.offset + other.size <= candidate;
+      }
+      if (free) offset = candidate;
+    }
+
+    if (capacity && offset + buffer.size > capacity) continue;
+    buffer.offset = (int32_t)offset;
+    buffer.region = region;
+    placed++;
+  }
+  return placed;
+}
+
+uint32_t arenaPeak(const ArenaBuffer *buffers, uint16_t count, uint8_t region) {
+  uint32_t peak = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    const ArenaBuffer &b = buffers[i];
+    if (b.offset == ARENA_UNPLACED || b.region != region) continue;
+    if (b.offset + b.size > peak) peak = b.offset + b.size;
+  }
+  return peak;
+}
+
+uint32_t arenaLiveMax(const ArenaBuffer *buffers, uint16_t count, uint8_t region) {
+  int16_t first = 0;
+  int16_t last = -1;
+  for (uint16_t i = 0; i < count; i++) {
+    if (buffers[i].offset == ARENA_UNPLACED || buffers[i].region != region) continue;
+    if (last < first || buffers[i].firstUse < first) first = buffers[i].firstUse;
+    if (buffers[i].lastUse > last) last = buffers[i].lastUse;
+  }
+  uint32_t best = 0;
+  for (int16_t step = first; step <= last; step++) {
+    uint32_t live = 0;
+    for (uint16_t i = 0; i < count; i++) {
+      const ArenaBuffer &b = buffers[i];
+      if (b.offset != ARENA_UNPLACED && b.region == region && b.firstUse <= step && step <= b.lastUse) live += b.size;
+    }
+    if (live > best) best = live;
+  }
+  return best;
+}
@@ -0,0 +1,47 @@
+/**
+ * Static Tensor Arena Planner
+ *
+ * Packs buffers with known lifetimes (first and last operator that touches
+ * them) into shared arenas: two buffers may share bytes only when their
+ * lifetimes do not overlap. Placement is greedy, as in TFLite Micro's
+ * GreedyMemoryPlanner: each buffer, in the order given (normally largest
+ * first), goes to the lowest aligned offset that does not collide with a
+ * live buffer already placed in the same region.
+ *
+ * A capacity turns a region into a budget (internal SRAM): buffers that
+ * would end above it stay unplaced for the caller to put elsewhere.
+ *
+ * No Arduino dependencies, so plans can be checked on a host.
+ */
+
+#ifndef ARENA_PLANNER_H
+#define ARENA_PLANNER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARENA_UNPLACED  (-1)
+
+struct ArenaBuffer {
+  uint32_t size;
+  int16_t firstUse;
+  int16_t lastUse;      // inclusive
+  int32_t offset;       // ARENA_UNPLACED until placed
+  uint8_t region;
+};
+
+// Sorts indices by buffer size, largest first (ties keep index order)
+void arenaOrderBySize(const ArenaBuffer *buffers, uint16_t *order, uint16_t count);
+
+// Places buffers[order[i]] into region. capacity 0 means unlimited. Returns
+// the number of buffers placed.
+uint16_t arenaPlace(ArenaBuffer *buffers, uint16_t count, const uint16_t *order, uint16_t orderCount,
+                    uint8_t region, uint32_t capacity, uint32_t align);
+
+// Bytes a region needs (end of the highest placed buffer)
+uint32_t arenaPeak(const ArenaBuffer *buffers, uint16_t count, uint8_t region);
+
+// Lower bound for any plan: the most bytes live at one time in region
+uint32_t arenaLiveMax(const ArenaBuffer *buffers, uint16_t count, uint8_t region);
+
+#endif // ARENA_PLANNER_H
@@ -0,0 +1,173 @@
+/**
+ * Boot Orchestrator Implementation
+ */
+
+#include "boot_sequence.h"
+#include "logger.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+
+BootSequence bootSequence;
+
+static const char *MILESTONE_NAMES[BOOT_MILESTONE_COUNT] = {
+  "http_ready_us", "wifi_connected_us", "first_frame_us", "ready_us"
+};
+
+BootSequence::BootSequence()
+  : stepCount(0), doneMask(0), doneQueue(NULL) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  for (uint8_t i = 0; i < BOOT_MILESTONE_COUNT; i++) milestones[i] = 0;
+}
+
+int BootSequence::addStep(const char *name, BootStepFn fn, void *ctx, uint32_t dependsOn,
+                          int core, uint8_t flags) {
+  if (stepCount >= BOOT_MAX_STEPS) {
+    LOGE_S(TAG_SYSTEM, "Boot: no room for step %s", name);
+    return -1;
+  }
+  Step &step = steps[stepCount];
+  step.name = name;
+  step.fn = fn;
+  step.ctx = ctx;
+  step.dependsOn = dependsOn;
+  step.core = core;
+  step.flags = flags;
+  step.state = STEP_PENDING;
+  step.ok = false;
+  step.ranOnCore = -1;
+  step.startMicros = 0;
+  step.endMicros = 0;
+  return stepCount++;
+}
+
+void BootSequence::execute(uint8_t index) {
+  Step &step = steps[index];
+  step.ranOnCore = xPortGetCoreID();
+  step.startMicros = esp_timer_get_time();
+  step.state = STEP_RUNNING;
+
+  step.ok = step.fn(step.ctx);
+
+  step.endMicros = esp_timer_get_time();
+  step.state = STEP_DONE;
+
+  uint32_t durationMs = (uint32_t)((step.endMicros - step.startMicros) / 1000);
+  if (step.ok) {
+    LOGI(TAG_SYSTEM, "Boot step %s done in %u ms (core %d)", step.name, durationMs, step.ranOnCore);
+  } else {
+    LOGE(TAG_SYSTEM, "Boot step %s failed after %u ms", step.name, durationMs);
+  }
+}
+
+void BootSequence::taskEntry(void *param) {
+  TaskArg *arg = (TaskArg *)param;
+  BootSequence *self = arg->self;
+  uint8_t index = arg->index;
+
+  self->execute(index);
+  if (!(self->steps[index].flags & BOOT_STEP_DETACHED)) {
+    xQueueSend((QueueHandle_t)self->doneQueue, &index, portMAX_DELAY);
+  }
+  vTaskDelete(NULL);
+}
+
+bool BootSequence::start(uint8_t index) {
+  Step &step = steps[index];
+  taskArgs[index].self = this;
+  taskArgs[index].index = index;
+  step.state = STEP_RUNNING;
+  BaseType_t core = step.core == BOOT_CORE_ANY ? tskNO_AFFINITY : step.core;
+  return xTaskCreatePinnedToCore(taskEntry, step.name, BOOT_STEP_STACK_SIZE, &taskArgs[index],
+                                 2, NULL, core) == pdPASS;
+}
+
+/**
+ * Starts every step whose dependencies are done, then waits for any running
+ * step to finish and repeats. Inline steps run here as soon as they are ready.
+ */
+void BootSequence::run() {
+  doneQueue = xQueueCreate(BOOT_MAX_STEPS, sizeof(uint8_t));
+  if (doneQueue == NULL) {
+    LOGE(TAG_SYSTEM, "Boot queue allocation failed - running steps in order");
+  }
+
+  uint8_t waiting = 0;   // spawned, non-detached steps not yet reported done
+  while (true) {
+    bool progressed = false;
+    uint8_t pending = 0;
+
+    for (uint8_t i = 0; i < stepCount; i++) {
+      Step &step = steps[i];
+      if (step.state != STEP_PENDING) continue;
+      if (step.dependsOn & ~doneMask) {
+        pending++;
+        continue;
+      }
+
+      if ((step.flags & BOOT_STEP_INLINE) || doneQueue == NULL || !start(i)) {
+        execute(i);
+        doneMask |= 1u << i;
+        progressed = true;
+        break;  // rescan: the inline step may have unblocked earlier entries
+      }
+      if (!(step.flags & BOOT_STEP_DETACHED)) waiting++;
+    }
+    if (progressed) continue;
+
+    if (waiting == 0) {
+      if (pending == 0) break;
+      // Only reachable when a step depends on a detached or unknown step
+      LOGW(TAG_SYSTEM, "Boot steps with unmet dependencies - running them now");
+      doneMask = 0xFFFFFFFF;
+      continue;
+    }
+
+    uint8_t index;
+    if (xQueueReceive((QueueHandle_t)doneQueue, &index, portMAX_DELAY) == pdTRUE) {
+      doneMask |= 1u << index;
+      waiting--;
+    }
+  }
+
+  if (doneQueue) {
+    vQueueDelete((QueueHandle_t)doneQueue);
+    doneQueue = NULL;
+  }
+  mark(BOOT_MILESTONE_READY);
+}
+
+void BootSequence::mark(BootMilestone milestone) {
+  if (milestones[milestone]) return;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&lock);
+  if (milestones[milestone] == 0) milestones[milestone] = now;
+  portEXIT_CRITICAL(&lock);
+}
+
+void BootSequence::reportStatus(JsonObject out) const {
+  static const char *STATE_NAMES[] = {"pending", "running", "done"};
+
+  JsonArray list = out["steps"].to<JsonArray>();
+  for (uint8_t i = 0; i < stepCount; i++) {
+    const Step &step = steps[i];
+    JsonObject entry = list.add<JsonObject>();
+    entry["name"] = step.name;
+    entry["state"] = STATE_NAMES[step.state];
+    if (step.state == STEP_PENDING) continue;
+    entry["core"] = step.ranOnCore;
+    entry["start_us"] = step.startMicros;
+    if (step.state == STEP_DONE) {
+      entry["end_us"] = step.endMicros;
+      entry["duration_us"] = step.endMicros - step.startMicros;
+      entry["ok"] = step.ok;
+    }
+    if (step.flags & BOOT_STEP_DETACHED) entry["background"] = true;
+  }
+
+  JsonObject marks = out["milestones"].to<JsonObject>();
+  for (uint8_t i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+    if (milestones[i]) marks[MILESTONE_NAMES[i]] = milestones[i];
+  }
+}
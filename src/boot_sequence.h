@@ -0,0 +1,98 @@
+/**
+ * Boot Orchestrator
+ *
+ * setup() registers its initialization steps with their dependencies and the
+ * core they should run on. Steps whose dependencies are met start at once in
+ * their own task, so independent work (camera init on the app core, WiFi and
+ * the web server on the protocol core) overlaps instead of running in series.
+ *
+ * Every step's start/end time, core and result is kept as a boot timeline,
+ * together with milestones such as the HTTP server being up, WiFi being
+ * associated and the first camera frame, for /api/health/boot.
+ */
+
+#ifndef BOOT_SEQUENCE_H
+#define BOOT_SEQUENCE_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define BOOT_MAX_STEPS        24      // at most 32: dependencies are a uint32_t mask
+#define BOOT_STEP_STACK_SIZE  8192
+
+// Step flags
+#define BOOT_STEP_INLINE    0x01   // run on the caller's task (no task spawned)
+#define BOOT_STEP_DETACHED  0x02   // run() does not wait for it; nothing may depend on it
+
+#define BOOT_CORE_ANY       -1
+
+enum BootMilestone : uint8_t {
+  BOOT_MILESTONE_HTTP_READY = 0,
+  BOOT_MILESTONE_WIFI_CONNECTED,
+  BOOT_MILESTONE_FIRST_FRAME,
+  BOOT_MILESTONE_READY,          // all non-detached steps done
+  BOOT_MILESTONE_COUNT
+};
+
+// Returns false when the step failed; dependents still run
+typedef bool (*BootStepFn)(void *ctx);
+
+class BootSequence {
+public:
+  BootSequence();
+
+  // Returns the step id (used in dependency masks as 1 << id), or -1
+  int addStep(const char *name, BootStepFn fn, void *ctx, uint32_t dependsOn,
+              int core = BOOT_CORE_ANY, uint8_t flags = 0);
+
+  // Runs every step, returning when all non-detached steps have finished
+  void run();
+
+  // Records the first time a milestone is reached (later calls are ignored)
+  void mark(BootMilestone milestone);
+  bool reached(BootMilestone milestone) const { return milestones[milestone] != 0; }
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  enum StepState : uint8_t {
+    STEP_PENDING = 0,
+    STEP_RUNNING,
+    STEP_DONE
+  };
+
+  struct Step {
+    const char *name;
+    BootStepFn fn;
+    void *ctx;
+    uint32_t dependsOn;
+    int8_t core;
+    uint8_t flags;
+    volatile StepState state;
+    bool ok;
+    int8_t ranOnCore;
+    int64_t startMicros;
+    volatile int64_t endMicros;
+  };
+
+  struct TaskArg {
+    BootSequence *self;
+    uint8_t index;
+  };
+
+  Step steps[BOOT_MAX_STEPS];
+  TaskArg taskArgs[BOOT_MAX_STEPS];
+  uint8_t stepCount;
+  uint32_t doneMask;
+  void *doneQueue;
+  volatile int64_t milestones[BOOT_MILESTONE_COUNT];
+  portMUX_TYPE lock;
+
+  void execute(uint8_t index);
+  bool start(uint8_t index);
+  static void taskEntry(void *param);
+};
+
+extern BootSequence bootSequence;
+
+#endif // BOOT_SEQUENCE_H
@@ -0,0 +1,239 @@
+/**
+ * Clip Index Implementation
+ */
+
+#include "clip_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_FRAME      0xFFFFFFFFu
+#define IDX1_ENTRY    16
+
+static inline uint32_t getU32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// "00dc" (compressed) or "00db" (uncompressed) stream chunk
+static inline bool isVideoChunk(const uint8_t *id) {
+  return id[2] == 'd' && (id[3] == 'c' || id[3] == 'b');
+}
+
+ClipIndex::ClipIndex()
+  : reader(NULL), format(CLIP_AVI), frames(NULL), count(0), capacity(0), frameUs(CLIP_MJPEG_INTERVAL_US),
+    fileSize(0), scanDone(false), dropped(false), lastError(NULL), scanOffset(0), frameStart(NO_FRAME),
+    scratch(NULL) {
+}
+
+ClipIndex::~ClipIndex() {
+  close();
+}
+
+void ClipIndex::close() {
+  free(frames);
+  free(scratch);
+  frames = NULL;
+  scratch = NULL;
+  count = 0;
+  capacity = 0;
+  scanDone = false;
+  dropped = false;
+}
+
+bool ClipIndex::fail(const char *message) {
+  lastError = message;
+  return false;
+}
+
+bool ClipIndex::open(ClipReader *clipReader, ClipFormat clipFormat) {
+  close();
+  reader = clipReader;
+  format = clipFormat;
+  frameUs = CLIP_MJPEG_INTERVAL_US;
+  lastError = NULL;
+  scanOffset = 0;
+  frameStart = NO_FRAME;
+  fileSize = reader->clipSize();
+  scratch = (uint8_t *)malloc(CLIP_SCAN_CHUNK);
+  if (scratch == NULL) return fail("Out of memory");
+  if (format == CLIP_MJPEG) return true;
+
+  bool ok = openAvi();
+  scanDone = true;
+  // The scratch buffer is only needed while scanning
+  free(scratch);
+  scratch = NULL;
+  if (ok && count == 0) return fail("No frames in clip");
+  return ok;
+}
+
+bool ClipIndex::push(uint32_t offset, uint32_t size) {
+  if (count == capacity) {
+    uint32_t grown = capacity ? capacity * 2 : CLIP_INITIAL_FRAMES;
+    if (grown > CLIP_MAX_FRAMES) grown = CLIP_MAX_FRAMES;
+    ClipFrame *table = grown > capacity ? (ClipFrame *)realloc(frames, sizeof(ClipFrame) * grown) : NULL;
+    if (table == NULL) {
+      dropped = true;
+      return false;
+    }
+    frames = table;
+    capacity = grown;
+  }
+  frames[count].offset = offset;
+  frames[count].size = size;
+  count++;
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// AVI
+
+bool ClipIndex::openAvi() {
+  uint8_t head[12];
+  if (reader->clipRead(0, head, sizeof(head)) != sizeof(head) || memcmp(head, "RIFF", 4) != 0 ||
+      memcmp(head + 8, "AVI ", 4) != 0) {
+    return fail("Not an AVI file");
+  }
+
+  uint32_t moviStart = 0;     // position of the "movi" list type
+  uint32_t moviEnd = 0;
+  uint32_t idx1Offset = 0;
+  uint32_t idx1Size = 0;
+  uint32_t pos = 12;
+  while (pos + 8 <= fileSize) {
+    uint8_t chunk[12];
+    size_t got = reader->clipRead(pos, chunk, sizeof(chunk));
+    if (got < 8) break;
+    uint32_t size = getU32(chunk + 4);
+    bool list = memcmp(chunk, "LIST", 4) == 0 && got == sizeof(chunk);
+
+    if (list && memcmp(chunk + 8, "hdrl", 4) == 0) {
+      // avih is the first chunk of hdrl; microseconds per frame at +8
+      size_t len = reader->clipRead(pos + 12, scratch, 64);
+      if (len >= 12 && memcmp(scratch, "avih", 4) == 0) {
+        uint32_t us = getU32(scratch + 8);
+        if (us >= CLIP_MIN_INTERVAL_US && us <= CLIP_MAX_INTERVAL_US) frameUs = us;
+      }
+    } else if (list && memcmp(chunk + 8, "movi", 4) == 0) {
+      moviStart = pos + 8;
+      // A recording cut short by a reset never got its sizes written
+      if (size < 4 || size > fileSize - moviStart) {
+        moviEnd = fileSize;
+        break;
+      }
+      moviEnd = moviStart + size;
+    } else if (memcmp(chunk, "idx1", 4) == 0) {
+      idx1Offset = pos + 8;
+      idx1Size = size <= fileSize - idx1Offset ? size : fileSize - idx1Offset;
+    }
+    if (size > fileSize - pos - 8) break;
+    pos += 8 + size + (size & 1);
+  }
+
+  if (moviStart == 0) return fail("No movi list");
+  if (idx1Size == 0 || !readIdx1(idx1Offset, idx1Size, moviStart)) walkMovi(moviStart + 4, moviEnd);
+  return true;
+}
+
+// idx1 entries: chunk id, flags, offset of the chunk header, data size.
+// The offset counts from the "movi" list type in most writers and from the
+// start of the file in some; the first video entry decides which.
+bool ClipIndex::readIdx1(uint32_t offset, uint32_t size, uint32_t moviStart) {
+  uint32_t base = NO_FRAME;
+  uint32_t entries = size / IDX1_ENTRY;
+  for (uint32_t done = 0; done < entries && !dropped;) {
+    uint32_t batch = entries - done;
+    if (batch > CLIP_SCAN_CHUNK / IDX1_ENTRY) batch = CLIP_SCAN_CHUNK / IDX1_ENTRY;
+    if (reader->clipRead(offset + done * IDX1_ENTRY, scratch, batch * IDX1_ENTRY) != batch * IDX1_ENTRY) break;
+
+    for (uint32_t i = 0; i < batch && !dropped; i++) {
+      const uint8_t *entry = scratch + i * IDX1_ENTRY;
+      if (!isVideoChunk(entry)) continue;
+      uint32_t chunkOffset = getU32(entry + 8);
+      uint32_t dataSize = getU32(entry + 12);
+
+      if (base == NO_FRAME) {
+        uint8_t id[4];
+        uint32_t candidates[2] = {moviStart, 0};
+        for (uint8_t c = 0; c < 2 && base == NO_FRAME; c++) {
+          uint32_t at = candidates[c] + chunkOffset;
+          if (at >= candidates[c] && reader->clipRead(at, id, 4) == 4 && memcmp(id, entry, 4) == 0) {
+            base = candidates[c];
+          }
+        }
+        if (base == NO_FRAME) return false;   // walk the movi list instead
+      }
+
+      if (dataSize == 0) {
+        // An empty chunk repeats the previous frame (keeps the timing)
+        if (count) push(frames[count - 1].offset, frames[count - 1].size);
+        continue;
+      }
+      uint32_t dataOffset = base + chunkOffset + 8;
+      if (dataOffset < base || dataOffset > fileSize || dataSize > fileSize - dataOffset) continue;
+      push(dataOffset, dataSize);
+    }
+    done += batch;
+  }
+  return count > 0;
+}
+
+// Without idx1: every chunk header in movi, descending into "rec " lists.
+// Stops at a chunk cut short or at bytes that are not a chunk.
+void ClipIndex::walkMovi(uint32_t start, uint32_t end) {
+  uint32_t pos = start;
+  while (pos + 8 <= end && !dropped) {
+    uint8_t chunk[8];
+    if (reader->clipRead(pos, chunk, sizeof(chunk)) != sizeof(chunk)) break;
+    uint32_t size = getU32(chunk + 4);
+    if (memcmp(chunk, "LIST", 4) == 0) {
+      pos += 12;
+      continue;
+    }
+    bool printable = true;
+    for (uint8_t i = 0; i < 4; i++) printable = printable && chunk[i] >= 0x20 && chunk[i] < 0x7F;
+    if (!printable || size > end - pos - 8) break;
+    if (isVideoChunk(chunk)) {
+      if (size) push(pos + 8, size);
+      else if (count) push(frames[count - 1].offset, frames[count - 1].size);
+    }
+    pos += 8 + size + (size & 1);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Raw MJPEG
+
+// FF D8 starts a frame and FF D9 ends it. Entropy-coded data never holds
+// either (a data FF is followed by 00 or a restart marker), so an SOI
+// before the EOI means the previous frame was cut short; it is dropped.
+void ClipIndex::extend(uint32_t wanted) {
+  if (format != CLIP_MJPEG || scratch == NULL) return;
+  while (!scanDone && count < wanted) {
+    size_t got = reader->clipRead(scanOffset, scratch, CLIP_SCAN_CHUNK);
+    if (got < 2) {
+      scanDone = true;        // a frame without its EOI is left out
+      break;
+    }
+    for (size_t i = 0; i + 1 < got; i++) {
+      if (scratch[i] != 0xFF) continue;
+      if (scratch[i + 1] == 0xD8) {
+        frameStart = scanOffset + i;
+      } else if (scratch[i + 1] == 0xD9 && frameStart != NO_FRAME) {
+        uint32_t end = scanOffset + i + 2;
+        push(frameStart, end - frameStart);
+        frameStart = NO_FRAME;
+        if (dropped) {
+          scanDone = true;
+          break;
+        }
+        i++;
+      }
+    }
+    // The last byte may start a marker: the next read begins with it
+    scanOffset += got - 1;
+  }
+  if (scanDone) {
+    free(scratch);
+    scratch = NULL;
+  }
+}
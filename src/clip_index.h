@@ -0,0 +1,104 @@
+/**
+ * Clip Index
+ *
+ * Frame table of a recorded clip: where each JPEG frame sits in the file
+ * and how long a frame lasts, so playback can seek to a time and read
+ * frames straight from the card without parsing the container again.
+ *
+ * AVI (MJPEG in RIFF): the frame interval comes from the avih header and
+ * the frames from the idx1 chunk (offsets relative to the movi list or
+ * absolute; both are accepted). A clip cut short by a reset has no idx1;
+ * its movi chunks are then walked header by header.
+ *
+ * Raw MJPEG (.mjpeg/.mjpg, concatenated JPEGs) has no index or timing:
+ * frames are found by scanning for SOI/EOI markers, incrementally through
+ * extend() as playback needs them, at CLIP_MJPEG_INTERVAL_US per frame.
+ *
+ * The file is reached through ClipReader so the parser runs (and is
+ * checked) on a host. Not thread safe: the caller serializes all calls.
+ */
+
+#ifndef CLIP_INDEX_H
+#define CLIP_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CLIP_MAX_FRAMES          65536        // 512 KB of table; later frames are left out
+#define CLIP_INITIAL_FRAMES      1024
+#define CLIP_SCAN_CHUNK          16384        // bytes per read while scanning
+#define CLIP_MJPEG_INTERVAL_US   100000       // raw MJPEG carries no frame rate
+#define CLIP_MIN_INTERVAL_US     1000
+#define CLIP_MAX_INTERVAL_US     10000000
+
+enum ClipFormat : uint8_t {
+  CLIP_AVI = 0,
+  CLIP_MJPEG
+};
+
+struct ClipFrame {
+  uint32_t offset;            // first byte of the JPEG
+  uint32_t size;
+};
+
+// The clip file
+class ClipReader {
+public:
+  virtual ~ClipReader() {}
+  virtual uint32_t clipSize() = 0;
+  // Returns the bytes read (short at the end of the file)
+  virtual size_t clipRead(uint32_t offset, uint8_t *dst, size_t len) = 0;
+};
+
+class ClipIndex {
+public:
+  ClipIndex();
+  ~ClipIndex();
+
+  // Reads the container headers (and the whole idx1 of an AVI); false with
+  // error() set when the file is not a clip this index understands
+  bool open(ClipReader *reader, ClipFormat format);
+  void close();
+
+  // Raw MJPEG: scans on until at least frames are known or the file ends.
+  // Does nothing for an AVI, which is fully indexed by open().
+  void extend(uint32_t frames);
+
+  uint32_t frameCount() const { return count; }
+  const ClipFrame &frame(uint32_t i) const { return frames[i]; }
+  // True once every frame of the file is in the table
+  bool complete() const { return scanDone; }
+  bool truncated() const { return dropped; }   // past CLIP_MAX_FRAMES
+  uint32_t intervalUs() const { return frameUs; }
+  // Frame shown at a time from the start of the clip
+  uint32_t frameAt(uint32_t ms) const { return (uint32_t)((uint64_t)ms * 1000 / frameUs); }
+  // Start of a frame from the start of the clip
+  uint32_t timeOf(uint32_t frame) const { return (uint32_t)((uint64_t)frame * frameUs / 1000); }
+  uint32_t durationMs() const { return timeOf(count); }
+  const char *error() const { return lastError; }
+
+private:
+  ClipReader *reader;
+  ClipFormat format;
+  ClipFrame *frames;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t frameUs;
+  uint32_t fileSize;
+  bool scanDone;
+  bool dropped;
+  const char *lastError;
+
+  // Raw MJPEG scan position
+  uint32_t scanOffset;
+  uint32_t frameStart;        // SOI of the frame being scanned, or NO_FRAME
+  uint8_t *scratch;           // CLIP_SCAN_CHUNK bytes
+
+  bool push(uint32_t offset, uint32_t size);
+  bool openAvi();
+  bool readIdx1(uint32_t offset, uint32_t size, uint32_t moviStart);
+  void walkMovi(uint32_t start, uint32_t end);
+  bool fail(const char *message);
+};
+
+#endif // CLIP_INDEX_H
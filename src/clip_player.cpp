@@ -0,0 +1,426 @@
+/**
+ * Clip Player Implementation
+ */
+
+#include "clip_player.h"
+#include "logger.h"
+#include <ESPAsyncWebServer.h>
+#include <SD_MMC.h>
+#include <esp_heap_caps.h>
+#include <lwip/tcpip.h>
+#include <lwip/priv/tcp_priv.h>
+
+#define PLAYBACK_OPEN_WAIT_MS   200   // web server task: sdCardMutex wait
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+ClipPlayer clipPlayer;
+
+PlaybackSession::PlaybackSession()
+  : state(FREE), format(CLIP_AVI), fromMs(0), speed(100), firstFrame(0), step(1), intervalUs(0), pcb(NULL),
+    pcbArg(NULL), ring(NULL), written(0), consumed(0), pushed(0), popped(0), ended(false), released(0),
+    waiting(false), nextFrame(0), readOffset(0), readLeft(0), reading(false), clockRunning(false), clockStart(0),
+    headerSent(false), sent(0), framesSent(0) {
+  path[0] = '\0';
+}
+
+// ClipReader for the index (task only)
+uint32_t PlaybackSession::clipSize() {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return 0;
+  uint32_t size = file.size();
+  xSemaphoreGive(sdCardMutex);
+  return size;
+}
+
+size_t PlaybackSession::clipRead(uint32_t offset, uint8_t *dst, size_t len) {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return 0;
+  size_t got = file.seek(offset) ? file.read(dst, len) : 0;
+  xSemaphoreGive(sdCardMutex);
+  return got;
+}
+
+ClipPlayer::ClipPlayer()
+  : task(NULL), running(false), opened(0), failed(0), busy(0), framesSent(0), bytesSent(0), underruns(0),
+    wakes(0), resyncs(0), readErrors(0), lastIndexMs(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+bool ClipPlayer::begin(bool sdReady) {
+  if (!sdReady) return false;
+  running = true;
+  if (xTaskCreatePinnedToCore(taskEntry, "playback", PLAYBACK_STACK_SIZE, this, 1, &task, 0) != pdPASS) {
+    running = false;
+    LOGW(TAG_SD, "Playback: failed to start task");
+    return false;
+  }
+  return true;
+}
+
+static const char *extension(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  return dot && (!slash || dot > slash) ? dot + 1 : "";
+}
+
+bool ClipPlayer::supported(const char *path) {
+  const char *ext = extension(path);
+  return strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "mjpeg") == 0 || strcasecmp(ext, "mjpg") == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Sessions (web server task)
+
+PlaybackResult ClipPlayer::open(const char *path, uint32_t fromMs, uint16_t speed, PlaybackSession *&session) {
+  session = NULL;
+  if (!supported(path) || strlen(path) >= PLAYBACK_PATH_LEN) return PLAYBACK_UNSUPPORTED;
+  if (!running) return PLAYBACK_BUSY;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(PLAYBACK_OPEN_WAIT_MS)) != pdTRUE) return PLAYBACK_BUSY;
+  bool found = SD_MMC.exists(path);
+  xSemaphoreGive(sdCardMutex);
+  if (!found) return PLAYBACK_NOT_FOUND;
+
+  portENTER_CRITICAL(&lock);
+  for (uint8_t i = 0; i < PLAYBACK_MAX_SESSIONS && session == NULL; i++) {
+    if (sessions[i].state == PlaybackSession::FREE) {
+      session = &sessions[i];
+      session->state = PlaybackSession::OPENING;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+  if (session == NULL) {
+    busy++;
+    return PLAYBACK_BUSY;
+  }
+
+  strlcpy(session->path, path, sizeof(session->path));
+  session->format = strcasecmp(extension(path), "avi") == 0 ? CLIP_AVI : CLIP_MJPEG;
+  session->fromMs = fromMs;
+  if (speed < PLAYBACK_MIN_SPEED) speed = PLAYBACK_MIN_SPEED;
+  if (speed > PLAYBACK_MAX_SPEED) speed = PLAYBACK_MAX_SPEED;
+  session->speed = speed;
+  session->pcb = NULL;
+  session->pcbArg = NULL;
+  session->headerSent = false;
+  session->sent = 0;
+  session->framesSent = 0;
+  opened++;
+  xTaskNotifyGive(task);
+  return PLAYBACK_OK;
+}
+
+void ClipPlayer::attach(PlaybackSession *session, AsyncClient *client) {
+  if (session == NULL || client == NULL) return;
+  session->pcb = client->pcb();
+  session->pcbArg = client;
+}
+
+void ClipPlayer::close(PlaybackSession *session) {
+  if (session == NULL) return;
+  portENTER_CRITICAL(&lock);
+  session->state = PlaybackSession::CLOSING;
+  portEXIT_CRITICAL(&lock);
+  xTaskNotifyGive(task);
+}
+
+// Time a frame is due, from the moment the first frame was released
+uint32_t ClipPlayer::dueMs(const PlaybackSession &session, uint32_t frame) {
+  uint64_t clipUs = (uint64_t)(frame - session.firstFrame) * session.intervalUs;
+  return session.clockStart + (uint32_t)(clipUs * 100 / session.speed / 1000);
+}
+
+size_t ClipPlayer::fill(PlaybackSession *s, uint8_t *buffer, size_t maxLen) {
+  // Set before looking, cleared once something goes out: the task reads it
+  // after queueing data, so a wake is not lost between the two
+  s->waiting = true;
+  if (s->state == PlaybackSession::OPENING) return RESPONSE_TRY_AGAIN;
+  if (s->state != PlaybackSession::PLAYING) return 0;
+
+  // Next queued frame; ended is read first so a frame pushed before it
+  // was set is not missed
+  bool ended = s->ended;
+  if (s->pushed == s->popped) return ended ? 0 : RESPONSE_TRY_AGAIN;
+  if (s->released == s->popped) return RESPONSE_TRY_AGAIN;   // not due yet
+  const PlaybackSession::Queued &frame = s->queued[s->popped % PLAYBACK_QUEUE_FRAMES];
+  size_t written = 0;
+
+  if (!s->headerSent) {
+    uint32_t clipMs = (uint32_t)((uint64_t)frame.frame * s->intervalUs / 1000);
+    char header[128];
+    int len = snprintf(header, sizeof(header),
+                       "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\nX-Frame: %lu\r\n"
+                       "X-Clip-Time: %lu\r\n\r\n",
+                       (unsigned long)frame.size, (unsigned long)frame.frame, (unsigned long)clipMs);
+    if (len <= 0 || (size_t)len > maxLen) return 0;
+    memcpy(buffer, header, len);
+    written = len;
+    s->headerSent = true;
+    s->sent = 0;
+  }
+
+  // Frame bytes already read ahead, straight from the ring
+  uint32_t available = s->written - s->consumed;
+  if (available == 0 && s->sent < frame.size) {
+    if (written == 0) {
+      underruns++;
+      return RESPONSE_TRY_AGAIN;
+    }
+    s->waiting = false;
+    return written;
+  }
+  size_t take = frame.size - s->sent;
+  if (take > available) take = available;
+  if (take > maxLen - written) take = maxLen - written;
+  uint32_t at = s->consumed % PLAYBACK_BUFFER_BYTES;
+  size_t first = PLAYBACK_BUFFER_BYTES - at < take ? PLAYBACK_BUFFER_BYTES - at : take;
+  memcpy(buffer + written, s->ring + at, first);
+  memcpy(buffer + written + first, s->ring, take - first);
+  written += take;
+  s->sent += take;
+  s->consumed += take;
+  bytesSent += take;
+
+  // The part ends with CRLF; it waits for the next call when out of room
+  if (s->sent == frame.size && written + 2 <= maxLen) {
+    buffer[written++] = '\r';
+    buffer[written++] = '\n';
+    s->headerSent = false;
+    s->popped++;
+    s->framesSent++;
+    framesSent++;
+  }
+  if (written) s->waiting = false;
+  if (take) xTaskNotifyGive(task);   // room for more read-ahead, or the next frame to pace
+  return written;
+}
+
+// Runs on the tcpip thread: calls the connection's lwIP poll callback, as
+// the 500 ms timer does, so AsyncTCP delivers a poll event and the web
+// server calls the filler again. The pcb is looked up first, and must
+// still belong to the same AsyncClient (its callback argument), since the
+// connection may have closed since the session noted it.
+static void pollConnection(void *arg) {
+  PlaybackSession *s = (PlaybackSession *)arg;
+  void *target = s->pcb;
+  void *client = s->pcbArg;
+  for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+    if (pcb == target) {
+      if (pcb->callback_arg == client && client != NULL && pcb->poll) pcb->poll(pcb->callback_arg, pcb);
+      return;
+    }
+  }
+}
+
+// A response with nothing in flight is only called again on an ACK or a
+// poll: ask for the poll now
+void ClipPlayer::wake(PlaybackSession &s) {
+  if (!s.waiting || s.pcb == NULL) return;
+  s.waiting = false;
+  if (tcpip_try_callback(pollConnection, &s) == ERR_OK) wakes++;
+}
+
+// ---------------------------------------------------------------------------
+// Task
+
+void ClipPlayer::taskEntry(void *param) {
+  static_cast<ClipPlayer *>(param)->run();
+}
+
+void ClipPlayer::run() {
+  for (;;) {
+    bool active = false;
+    uint32_t sleepMs = PLAYBACK_IDLE_MS;
+    for (uint8_t i = 0; i < PLAYBACK_MAX_SESSIONS; i++) {
+      PlaybackSession &session = sessions[i];
+      switch (session.state) {
+        case PlaybackSession::OPENING:
+          start(session);
+          active = true;
+          break;
+        case PlaybackSession::PLAYING: {
+          active = readAhead(session) || active;
+          uint32_t dueIn = pace(session);
+          if (dueIn < sleepMs) sleepMs = dueIn;
+          break;
+        }
+        case PlaybackSession::CLOSING:
+          release(session);
+          break;
+        default:
+          break;
+      }
+    }
+    if (!active) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(sleepMs));
+  }
+}
+
+// Opens the file, builds the frame table and seeks
+void ClipPlayer::start(PlaybackSession &s) {
+  uint32_t startMs = millis();
+  const char *error = NULL;
+  if (s.ring == NULL) s.ring = (uint8_t *)heap_caps_malloc(PLAYBACK_BUFFER_BYTES, MALLOC_CAP_SPIRAM);
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+    s.file = SD_MMC.open(s.path, FILE_READ);
+    xSemaphoreGive(sdCardMutex);
+  }
+
+  if (s.ring == NULL) {
+    error = "Out of memory";
+  } else if (!s.file || s.file.isDirectory()) {
+    error = "Cannot open clip";
+  } else if (!s.index.open(&s, s.format)) {
+    error = s.index.error();
+  } else {
+    uint32_t first = s.index.frameAt(s.fromMs);
+    s.index.extend(first + PLAYBACK_QUEUE_FRAMES);
+    if (s.index.frameCount() == 0) {
+      error = "No frames in clip";
+    } else {
+      s.firstFrame = first < s.index.frameCount() ? first : s.index.frameCount() - 1;
+    }
+  }
+
+  if (error) {
+    failed++;
+    LOGW_S(TAG_SD, "Playback of %s failed", s.path);
+    LOGW_S(TAG_SD, "Playback: %s", error);
+    portENTER_CRITICAL(&lock);
+    if (s.state == PlaybackSession::OPENING) s.state = PlaybackSession::FAILED;
+    portEXIT_CRITICAL(&lock);
+    wake(s);
+    return;
+  }
+
+  // Frames sent at most every PLAYBACK_MIN_FRAME_MS; the rest are skipped
+  s.intervalUs = s.index.intervalUs();
+  uint32_t outUs = (uint32_t)((uint64_t)s.intervalUs * 100 / s.speed);
+  if (outUs == 0) outUs = 1;
+  s.step = outUs >= PLAYBACK_MIN_FRAME_MS * 1000u ? 1 : (PLAYBACK_MIN_FRAME_MS * 1000u + outUs - 1) / outUs;
+  s.nextFrame = s.firstFrame;
+  s.reading = false;
+  s.written = 0;
+  s.consumed = 0;
+  s.pushed = 0;
+  s.popped = 0;
+  s.ended = false;
+  s.released = 0;
+  s.clockRunning = false;
+  lastIndexMs = millis() - startMs;
+  LOGI(TAG_SD, "Playback: %u frames indexed in %u ms, step %u", s.index.frameCount(), lastIndexMs, s.step);
+
+  portENTER_CRITICAL(&lock);
+  if (s.state == PlaybackSession::OPENING) s.state = PlaybackSession::PLAYING;
+  portEXIT_CRITICAL(&lock);
+  wake(s);
+}
+
+// Reads up to PLAYBACK_READ_CHUNK of the next frame into the ring; false
+// when there is nothing to do until fill() makes room
+bool ClipPlayer::readAhead(PlaybackSession &s) {
+  if (s.ended) return false;
+  if (!s.reading) {
+    if (s.pushed - s.popped >= PLAYBACK_QUEUE_FRAMES) return false;
+    if (s.nextFrame >= s.index.frameCount()) s.index.extend(s.nextFrame + PLAYBACK_QUEUE_FRAMES);
+    if (s.nextFrame >= s.index.frameCount()) {
+      s.ended = true;
+      wake(s);
+      return false;
+    }
+    const ClipFrame &frame = s.index.frame(s.nextFrame);
+    PlaybackSession::Queued &queued = s.queued[s.pushed % PLAYBACK_QUEUE_FRAMES];
+    queued.frame = s.nextFrame;
+    queued.size = frame.size;
+    s.readOffset = frame.offset;
+    s.readLeft = frame.size;
+    s.reading = true;
+    s.pushed++;
+  }
+
+  uint32_t room = PLAYBACK_BUFFER_BYTES - (s.written - s.consumed);
+  uint32_t at = s.written % PLAYBACK_BUFFER_BYTES;
+  size_t len = s.readLeft;
+  if (len > room) len = room;
+  if (len > PLAYBACK_BUFFER_BYTES - at) len = PLAYBACK_BUFFER_BYTES - at;
+  if (len > PLAYBACK_READ_CHUNK) len = PLAYBACK_READ_CHUNK;
+  if (len == 0) return false;
+
+  if (s.clipRead(s.readOffset, s.ring + at, len) != len) {
+    // The response has promised the frame's length: end it
+    readErrors++;
+    LOGW_S(TAG_SD, "Playback: read failed in %s", s.path);
+    portENTER_CRITICAL(&lock);
+    if (s.state == PlaybackSession::PLAYING) s.state = PlaybackSession::FAILED;
+    portEXIT_CRITICAL(&lock);
+    wake(s);
+    return false;
+  }
+  s.written += len;
+  s.readOffset += len;
+  s.readLeft -= len;
+  if (s.readLeft == 0) {
+    s.reading = false;
+    s.nextFrame += s.step;
+  }
+  if (s.released != s.popped) wake(s);   // the frame being sent was starved
+  return true;
+}
+
+// Releases the next queued frame to fill() once the previous one is out
+// and it is due; returns the ms until then (PLAYBACK_IDLE_MS when waiting
+// on fill() or the card). The clock starts with the first frame.
+uint32_t ClipPlayer::pace(PlaybackSession &s) {
+  if (s.released != s.popped || s.pushed == s.popped) return PLAYBACK_IDLE_MS;
+  const PlaybackSession::Queued &frame = s.queued[s.popped % PLAYBACK_QUEUE_FRAMES];
+  uint32_t now = millis();
+  if (!s.clockRunning) {
+    s.clockRunning = true;
+    s.clockStart = now;
+  }
+  int32_t early = (int32_t)(dueMs(s, frame.frame) - now);
+  if (early > 0) return (uint32_t)early;
+  if (-early > PLAYBACK_RESYNC_MS) {
+    s.clockStart += -early;
+    resyncs++;
+  }
+  s.released++;
+  wake(s);
+  return PLAYBACK_IDLE_MS;
+}
+
+void ClipPlayer::release(PlaybackSession &s) {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;   // retried on the next pass
+  if (s.file) s.file.close();
+  xSemaphoreGive(sdCardMutex);
+  s.index.close();
+  free(s.ring);
+  s.ring = NULL;
+  portENTER_CRITICAL(&lock);
+  s.state = PlaybackSession::FREE;
+  portEXIT_CRITICAL(&lock);
+}
+
+void ClipPlayer::reportStatus(JsonObject out) const {
+  out["running"] = running;
+  out["opened"] = opened;
+  out["failed"] = failed;
+  out["busy"] = busy;
+  out["frames_sent"] = framesSent;
+  out["bytes_sent"] = bytesSent;
+  out["underruns"] = underruns;
+  out["wakes"] = wakes;
+  out["resyncs"] = resyncs;
+  out["read_errors"] = readErrors;
+  out["last_index_ms"] = lastIndexMs;
+  JsonArray active = out["sessions"].to<JsonArray>();
+  for (uint8_t i = 0; i < PLAYBACK_MAX_SESSIONS; i++) {
+    const PlaybackSession &s = sessions[i];
+    if (s.state != PlaybackSession::PLAYING) continue;
+    JsonObject item = active.add<JsonObject>();
+    item["file"] = s.path;
+    item["speed"] = s.speed / 100.0f;
+    item["step"] = s.step;
+    item["frames"] = s.index.frameCount();
+    item["sent"] = s.framesSent;
+    item["buffered"] = s.written - s.consumed;
+  }
+}
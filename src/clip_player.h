@@ -0,0 +1,167 @@
+/**
+ * Clip Player
+ *
+ * Plays recorded MJPEG/AVI clips as /stream/playback?file=&speed=&from=,
+ * the same multipart/x-mixed-replace response as the live /stream. Frames
+ * are never decoded: the clip's frame table (clip_index.h) gives where each
+ * JPEG sits in the file, and its bytes go from the card into a read-ahead
+ * ring and from there into the TCP buffer.
+ *
+ * A task on core 0 reads ahead for every session (up to
+ * PLAYBACK_BUFFER_BYTES and PLAYBACK_QUEUE_FRAMES) and keeps its clock:
+ * each queued frame is released to fill(), the response filler, when it is
+ * due by its place in the clip at 0.25x-16x. Above 25 fps out frames are
+ * skipped (every frame of an MJPEG clip is a key frame). A frame released
+ * more than PLAYBACK_RESYNC_MS late moves the clock instead of starting a
+ * burst. fill() never waits: with nothing to send it returns at once, and
+ * the task wakes the response when a frame comes due or its bytes arrive
+ * (otherwise the filler would only run again on lwIP's 500 ms poll).
+ *
+ * Indexing a clip (reading the AVI idx1, or scanning raw MJPEG) also runs
+ * on the task; until it is done the response waits with no data.
+ */
+
+#ifndef CLIP_PLAYER_H
+#define CLIP_PLAYER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+#include "clip_index.h"
+
+class AsyncClient;
+
+#define PLAYBACK_MAX_SESSIONS    2
+#define PLAYBACK_PATH_LEN        96
+#define PLAYBACK_BUFFER_BYTES    (128 * 1024) // read-ahead per session (PSRAM), a power of two
+#define PLAYBACK_QUEUE_FRAMES    16
+#define PLAYBACK_READ_CHUNK      16384        // sdCardMutex is released between reads
+#define PLAYBACK_MIN_SPEED       25           // percent
+#define PLAYBACK_MAX_SPEED       1600
+#define PLAYBACK_MIN_FRAME_MS    40           // faster playback skips frames
+#define PLAYBACK_RESYNC_MS       500
+#define PLAYBACK_IDLE_MS         50
+#define PLAYBACK_STACK_SIZE      4096
+
+enum PlaybackResult : uint8_t {
+  PLAYBACK_OK = 0,
+  PLAYBACK_UNSUPPORTED,       // not an AVI or MJPEG file
+  PLAYBACK_NOT_FOUND,
+  PLAYBACK_BUSY               // every session in use, or the card busy
+};
+
+// One playback; owned by the player, handed out by open()
+class PlaybackSession : public ClipReader {
+public:
+  PlaybackSession();
+
+  uint32_t clipSize() override;
+  size_t clipRead(uint32_t offset, uint8_t *dst, size_t len) override;
+
+private:
+  friend class ClipPlayer;
+
+  enum State : uint8_t { FREE = 0, OPENING, PLAYING, FAILED, CLOSING };
+
+  struct Queued {
+    uint32_t frame;
+    uint32_t size;
+  };
+
+  volatile State state;
+  char path[PLAYBACK_PATH_LEN];
+  ClipFormat format;
+  uint32_t fromMs;
+  uint16_t speed;             // percent
+  File file;
+  ClipIndex index;
+
+  // Set when PLAYING starts, read by fill()
+  uint32_t firstFrame;
+  uint16_t step;              // frames advanced per frame sent
+  uint32_t intervalUs;
+
+  // The response's connection, for wake()
+  void *pcb;
+  void *pcbArg;
+
+  // Read-ahead (the task writes, fill() consumes)
+  uint8_t *ring;
+  volatile uint32_t written;  // byte counters; position = counter % size
+  volatile uint32_t consumed;
+  Queued queued[PLAYBACK_QUEUE_FRAMES];
+  volatile uint32_t pushed;   // frame counters, as above
+  volatile uint32_t popped;
+  volatile bool ended;        // every frame is queued
+  volatile uint32_t released; // frames due, that fill() may send
+  volatile bool waiting;      // fill() has nothing in flight
+
+  // Task only
+  uint32_t nextFrame;
+  uint32_t readOffset;
+  uint32_t readLeft;
+  bool reading;
+  bool clockRunning;
+  uint32_t clockStart;
+
+  // fill() only
+  bool headerSent;
+  uint32_t sent;
+
+  uint32_t framesSent;
+};
+
+class ClipPlayer {
+public:
+  ClipPlayer();
+
+  bool begin(bool sdReady);
+
+  // Reserves a session for a clip (checked to exist) and queues its
+  // indexing; start from fromMs into the clip at speed percent
+  PlaybackResult open(const char *path, uint32_t fromMs, uint16_t speed, PlaybackSession *&session);
+  // Ends a session (when its response is freed)
+  void close(PlaybackSession *session);
+  // The connection the session's response goes out on (web server task)
+  void attach(PlaybackSession *session, AsyncClient *client);
+
+  // Multipart response filler: bytes written, RESPONSE_TRY_AGAIN until the
+  // next frame is due or buffered, 0 at the end of the clip or on error.
+  // Never waits.
+  size_t fill(PlaybackSession *session, uint8_t *buffer, size_t maxLen);
+
+  static bool supported(const char *path);
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  PlaybackSession sessions[PLAYBACK_MAX_SESSIONS];
+  mutable portMUX_TYPE lock;
+  TaskHandle_t task;
+  volatile bool running;
+
+  // Counters for reportStatus()
+  uint32_t opened;
+  uint32_t failed;
+  uint32_t busy;
+  uint32_t framesSent;
+  uint64_t bytesSent;
+  uint32_t underruns;         // a frame due but not yet read
+  uint32_t wakes;
+  uint32_t resyncs;
+  uint32_t readErrors;
+  uint32_t lastIndexMs;
+
+  static void taskEntry(void *param);
+  void run();
+  void start(PlaybackSession &session);
+  bool readAhead(PlaybackSession &session);
+  uint32_t pace(PlaybackSession &session);
+  void wake(PlaybackSession &session);
+  void release(PlaybackSession &session);
+  static uint32_t dueMs(const PlaybackSession &session, uint32_t frame);
+};
+
+extern ClipPlayer clipPlayer;
+
+#endif // CLIP_PLAYER_H
@@ -0,0 +1,678 @@
+/**
+ * Runtime Configuration Store Implementation
+ */
+
+#include "config_store.h"
+#include "logger.h"
+#include <SD_MMC.h>
+#include <Preferences.h>
+#include <esp32/rom/crc.h>
+#include <stddef.h>
+
+// Shared with the HTTP handlers in main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+ConfigStore configStore;
+
+static const uint32_t SNAPSHOT_MAGIC = 0x53474643;  // "CFGS"
+
+struct ConfigSnapshot {
+  uint32_t magic;
+  uint32_t schemaHash;
+  uint32_t fileSize;     // /config.json fingerprint when the snapshot was taken
+  uint32_t fileTime;
+  uint32_t crc;          // of config
+  AppConfig config;
+};
+
+static const char *SECTION_NAMES[CFG_SECTION_COUNT] = {
+  "wifi", "camera", "stream", "storage", "detection", "system", "mqtt", "pan_tilt"
+};
+
+// Indexed by framesize_t (esp32-camera)
+static const char *const FRAME_SIZE_NAMES[] = {
+  "96X96", "QQVGA", "QCIF", "HQVGA", "240X240", "QVGA", "CIF", "HVGA",
+  "VGA", "SVGA", "XGA", "HD", "SXGA", "UXGA"
+};
+
+static const char *const GAIN_CEILING_NAMES[] = {
+  "2X", "4X", "8X", "16X", "32X", "64X", "128X"
+};
+
+// Indexed by CameraPixelMode
+static const char *const PIXEL_FORMAT_NAMES[] = {
+  "jpeg", "yuv422", "grayscale"
+};
+
+static const char *const WB_MODE_NAMES[] = {
+  "auto", "sunny", "cloudy", "office", "home"
+};
+
+static const char *const SPECIAL_EFFECT_NAMES[] = {
+  "none", "negative", "grayscale", "red", "green", "blue", "sepia"
+};
+
+// Indexed by RateControlMode
+static const char *const RATE_CONTROL_NAMES[] = {
+  "off", "bitrate", "fps"
+};
+
+// Indexed by ModelInputRange
+static const char *const INPUT_RANGE_NAMES[] = {
+  "unit", "byte", "signed"
+};
+
+// Indexed by ModelWeightSource
+static const char *const WEIGHT_SOURCE_NAMES[] = {
+  "auto", "psram", "sd"
+};
+
+// Indexed by LogLevel
+static const char *const LOG_LEVEL_NAMES[] = {
+  "error", "warn", "info", "debug"
+};
+
+#define FIELD(section, key, type, member, minValue, maxValue, def, defString, names, flags) \
+  { section, key, type, (uint16_t)offsetof(AppConfig, member), \
+    (uint16_t)sizeof(((AppConfig *)0)->member), minValue, maxValue, def, defString, names, flags }
+#define BOOL_FIELD(section, key, member, def, flags) \
+  FIELD(section, key, CFG_TYPE_BOOL, member, 0, 1, def, NULL, NULL, flags)
+#define INT_FIELD(section, key, member, minValue, maxValue, def, flags) \
+  FIELD(section, key, CFG_TYPE_INT, member, minValue, maxValue, def, NULL, NULL, flags)
+#define ENUM_FIELD(section, key, member, names, def, flags) \
+  FIELD(section, key, CFG_TYPE_ENUM, member, 0, (int32_t)(sizeof(names) / sizeof(names[0])) - 1, def, NULL, names, flags)
+#define STRING_FIELD(section, key, member, def, flags) \
+  FIELD(section, key, CFG_TYPE_STRING, member, 0, 0, 0, def, NULL, flags)
+
+static const ConfigField FIELDS[] = {
+  STRING_FIELD(CFG_SECTION_WIFI, "ssid", wifi.ssid, "ESP32-CAM", CFG_FLAG_RESTART),
+  STRING_FIELD(CFG_SECTION_WIFI, "password", wifi.password, "12345678", CFG_FLAG_SECRET | CFG_FLAG_RESTART),
+  BOOL_FIELD(CFG_SECTION_WIFI, "ap_mode", wifi.apMode, true, CFG_FLAG_RESTART),
+
+  ENUM_FIELD(CFG_SECTION_CAMERA, "frame_size", camera.frameSize, FRAME_SIZE_NAMES, 5, 0),  // QVGA
+  INT_FIELD(CFG_SECTION_CAMERA, "quality", camera.quality, 4, 63, 12, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "brightness", camera.brightness, -2, 2, 0, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "contrast", camera.contrast, -2, 2, 0, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "saturation", camera.saturation, -2, 2, 0, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "hmirror", camera.hmirror, false, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "vflip", camera.vflip, false, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "fb_count", camera.fbCount, 1, 3, 2, CFG_FLAG_RESTART),
+  INT_FIELD(CFG_SECTION_CAMERA, "xclk_mhz", camera.xclkMhz, 8, 20, 20, CFG_FLAG_RESTART),
+  ENUM_FIELD(CFG_SECTION_CAMERA, "pixel_format", camera.pixelFormat, PIXEL_FORMAT_NAMES, CAMERA_PIXELS_JPEG, CFG_FLAG_RESTART),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "aec", camera.aec, true, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "aec2", camera.aec2, false, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "ae_level", camera.aeLevel, -2, 2, 0, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "aec_value", camera.aecValue, 0, 1200, 300, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "agc", camera.agc, true, 0),
+  INT_FIELD(CFG_SECTION_CAMERA, "agc_gain", camera.agcGain, 0, 30, 0, 0),
+  ENUM_FIELD(CFG_SECTION_CAMERA, "gainceiling", camera.gainCeiling, GAIN_CEILING_NAMES, 0, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "awb", camera.awb, true, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "awb_gain", camera.awbGain, true, 0),
+  ENUM_FIELD(CFG_SECTION_CAMERA, "wb_mode", camera.wbMode, WB_MODE_NAMES, 0, 0),
+  ENUM_FIELD(CFG_SECTION_CAMERA, "special_effect", camera.specialEffect, SPECIAL_EFFECT_NAMES, 0, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "bpc", camera.bpc, false, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "wpc", camera.wpc, true, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "raw_gma", camera.rawGma, true, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "lenc", camera.lenc, true, 0),
+  BOOL_FIELD(CFG_SECTION_CAMERA, "dcw", camera.dcw, true, 0),
+
+  INT_FIELD(CFG_SECTION_STREAM, "frame_interval_ms", stream.frameIntervalMs, 10, 2000, 60, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "retry_delay_ms", stream.retryDelayMs, 10, 1000, 100, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "yield_every_chunks", stream.yieldEveryChunks, 0, 100, 10, 0),
+  ENUM_FIELD(CFG_SECTION_STREAM, "rate_control", stream.rateControl, RATE_CONTROL_NAMES, 0, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "target_kbps", stream.targetKbps, 100, 20000, 2000, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "target_fps", stream.targetFps, 1, 30, 10, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "quality_min", stream.qualityMin, 4, 63, 10, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "quality_max", stream.qualityMax, 4, 63, 40, 0),
+  BOOL_FIELD(CFG_SECTION_STREAM, "rtp_enabled", stream.rtpEnabled, false, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "rtp_fps", stream.rtpFps, 1, 30, 15, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "rtp_packet_bytes", stream.rtpPacketBytes, 576, 1472, 1400, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "rtp_timeout_s", stream.rtpTimeoutS, 0, 3600, 60, 0),
+  INT_FIELD(CFG_SECTION_STREAM, "rtp_max_late_ms", stream.rtpMaxLateMs, 20, 1000, 100, 0),
+
+  BOOL_FIELD(CFG_SECTION_STORAGE, "log_to_sd", storage.logToSD, true, 0),
+  INT_FIELD(CFG_SECTION_STORAGE, "max_usage_percent", storage.maxUsagePercent, 50, 100, 100, 0),
+  STRING_FIELD(CFG_SECTION_STORAGE, "recordings_dir", storage.recordingsDir, "/recordings",
+               CFG_FLAG_PATH | CFG_FLAG_RESTART),
+  INT_FIELD(CFG_SECTION_STORAGE, "recordings_mb", storage.recordingsMb, 0, 65535, 0, 0),
+  INT_FIELD(CFG_SECTION_STORAGE, "recording_retention_days", storage.recordingRetentionDays, 0, 3650, 0, 0),
+  INT_FIELD(CFG_SECTION_STORAGE, "event_log_kb", storage.eventLogKb, 256, 32768, 4096, 0),
+  INT_FIELD(CFG_SECTION_STORAGE, "event_retention_days", storage.eventRetentionDays, 0, 3650, 0, 0),
+
+  BOOL_FIELD(CFG_SECTION_DETECTION, "enabled", detection.enabled, false, 0),
+  INT_FIELD(CFG_SECTION_DETECTION, "motion_threshold", detection.motionThreshold, 1, 255, 25, 0),
+  INT_FIELD(CFG_SECTION_DETECTION, "min_changed_percent", detection.minChangedPercent, 0, 100, 2, 0),
+  INT_FIELD(CFG_SECTION_DETECTION, "cooldown_ms", detection.cooldownMs, 0, 60000, 5000, 0),
+  BOOL_FIELD(CFG_SECTION_DETECTION, "snapshot_on_event", detection.snapshotOnEvent, true, 0),
+  BOOL_FIELD(CFG_SECTION_DETECTION, "model_enabled", detection.modelEnabled, false, 0),
+  STRING_FIELD(CFG_SECTION_DETECTION, "model_path", detection.modelPath, "/models/detect.tflite", CFG_FLAG_PATH),
+  STRING_FIELD(CFG_SECTION_DETECTION, "labels_path", detection.labelsPath, "/models/labels.txt", CFG_FLAG_PATH),
+  INT_FIELD(CFG_SECTION_DETECTION, "score_threshold", detection.scoreThreshold, 1, 100, 60, 0),
+  INT_FIELD(CFG_SECTION_DETECTION, "model_interval_ms", detection.modelIntervalMs, 0, 60000, 1000, 0),
+  ENUM_FIELD(CFG_SECTION_DETECTION, "input_range", detection.inputRange, INPUT_RANGE_NAMES, MODEL_INPUT_UNIT, 0),
+  INT_FIELD(CFG_SECTION_DETECTION, "fast_ram_kb", detection.fastRamKb, 0, 200, 96, 0),
+  ENUM_FIELD(CFG_SECTION_DETECTION, "weight_source", detection.weightSource, WEIGHT_SOURCE_NAMES, MODEL_WEIGHTS_AUTO, 0),
+
+  ENUM_FIELD(CFG_SECTION_SYSTEM, "log_level", system.logLevel, LOG_LEVEL_NAMES, LOG_LEVEL_INFO, 0),
+
+  BOOL_FIELD(CFG_SECTION_MQTT, "enabled", mqtt.enabled, false, 0),
+  STRING_FIELD(CFG_SECTION_MQTT, "host", mqtt.host, "", 0),
+  INT_FIELD(CFG_SECTION_MQTT, "port", mqtt.port, 1, 65535, 1883, 0),
+  STRING_FIELD(CFG_SECTION_MQTT, "client_id", mqtt.clientId, "esp32cam", 0),
+  STRING_FIELD(CFG_SECTION_MQTT, "username", mqtt.username, "", 0),
+  STRING_FIELD(CFG_SECTION_MQTT, "password", mqtt.password, "", CFG_FLAG_SECRET),
+  STRING_FIELD(CFG_SECTION_MQTT, "base_topic", mqtt.baseTopic, "esp32cam", 0),
+  INT_FIELD(CFG_SECTION_MQTT, "qos", mqtt.qos, 0, 1, 1, 0),
+  INT_FIELD(CFG_SECTION_MQTT, "keepalive_s", mqtt.keepAliveS, 10, 600, 60, 0),
+  INT_FIELD(CFG_SECTION_MQTT, "batch_ms", mqtt.batchMs, 0, 5000, 250, 0),
+  INT_FIELD(CFG_SECTION_MQTT, "drain_per_s", mqtt.drainPerSecond, 1, 200, 20, 0),
+  INT_FIELD(CFG_SECTION_MQTT, "health_interval_s", mqtt.healthIntervalS, 0, 3600, 60, 0),
+  INT_FIELD(CFG_SECTION_MQTT, "queue_kb", mqtt.queueKb, 16, 8192, 512, 0),
+
+  BOOL_FIELD(CFG_SECTION_PAN_TILT, "enabled", panTilt.enabled, false, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "pan_pin", panTilt.panPin, 0, 33, 12, CFG_FLAG_RESTART),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "tilt_pin", panTilt.tiltPin, 0, 33, 13, CFG_FLAG_RESTART),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "rate_hz", panTilt.rateHz, 10, 200, 50, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "class_id", panTilt.classId, -1, 15, -1, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "capture_latency_ms", panTilt.captureLatencyMs, 0, 1000, 60, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "servo_lag_ms", panTilt.servoLagMs, 0, 500, 50, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "hfov_deg", panTilt.hfovDeg, 10, 170, 54, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "vfov_deg", panTilt.vfovDeg, 10, 170, 41, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "kp", panTilt.kp, 0, 5000, 400, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "ki", panTilt.ki, 0, 5000, 50, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "kd", panTilt.kd, 0, 1000, 0, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "max_speed_dps", panTilt.maxSpeed, 1, 1000, 120, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "max_accel_dps2", panTilt.maxAccel, 10, 10000, 600, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "kalman_accel_dps2", panTilt.kalmanAccel, 1, 2000, 80, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "kalman_noise_tenths", panTilt.kalmanNoise, 1, 100, 5, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "pan_min", panTilt.panMin, 0, 180, 0, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "pan_max", panTilt.panMax, 0, 180, 180, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "pan_home", panTilt.panHome, 0, 180, 90, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "tilt_min", panTilt.tiltMin, 0, 180, 30, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "tilt_max", panTilt.tiltMax, 0, 180, 150, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "tilt_home", panTilt.tiltHome, 0, 180, 90, 0),
+  BOOL_FIELD(CFG_SECTION_PAN_TILT, "invert_pan", panTilt.invertPan, false, 0),
+  BOOL_FIELD(CFG_SECTION_PAN_TILT, "invert_tilt", panTilt.invertTilt, false, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "pulse_min_us", panTilt.pulseMinUs, 400, 1500, 500, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "pulse_max_us", panTilt.pulseMaxUs, 1500, 2600, 2500, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "lost_ms", panTilt.lostMs, 100, 10000, 1000, 0),
+  INT_FIELD(CFG_SECTION_PAN_TILT, "home_after_s", panTilt.homeAfterS, 0, 3600, 10, 0),
+};
+
+static const size_t FIELD_COUNT = sizeof(FIELDS) / sizeof(FIELDS[0]);
+
+// ---------------------------------------------------------------------------
+// Field access
+
+static int32_t readInt(const AppConfig &config, const ConfigField &field) {
+  const uint8_t *p = (const uint8_t *)&config + field.offset;
+  bool isSigned = field.minValue < 0;
+  switch (field.size) {
+    case 1: return isSigned ? (int32_t)*(const int8_t *)p : (int32_t)*p;
+    case 2: return isSigned ? (int32_t)*(const int16_t *)p : (int32_t)*(const uint16_t *)p;
+    default: return *(const int32_t *)p;
+  }
+}
+
+static void writeInt(AppConfig &config, const ConfigField &field, int32_t value) {
+  uint8_t *p = (uint8_t *)&config + field.offset;
+  switch (field.size) {
+    case 1: *p = (uint8_t)value; break;
+    case 2: *(uint16_t *)p = (uint16_t)value; break;
+    default: *(int32_t *)p = value; break;
+  }
+}
+
+static const ConfigField *findField(int section, const char *key) {
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    if (FIELDS[i].section == section && strcmp(FIELDS[i].key, key) == 0) return &FIELDS[i];
+  }
+  return NULL;
+}
+
+static int findSection(const char *name) {
+  for (int i = 0; i < CFG_SECTION_COUNT; i++) {
+    if (strcmp(SECTION_NAMES[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+static String fieldName(const ConfigField &field) {
+  return String(SECTION_NAMES[field.section]) + "." + field.key;
+}
+
+static bool setField(AppConfig &config, const ConfigField &field, JsonVariantConst value, String &error) {
+  switch (field.type) {
+    case CFG_TYPE_BOOL:
+      if (!value.is<bool>()) {
+        error = fieldName(field) + ": must be true or false";
+        return false;
+      }
+      *((bool *)((uint8_t *)&config + field.offset)) = value.as<bool>();
+      return true;
+
+    case CFG_TYPE_INT: {
+      if (!value.is<long>()) {
+        error = fieldName(field) + ": must be an integer";
+        return false;
+      }
+      long v = value.as<long>();
+      if (v < field.minValue || v > field.maxValue) {
+        error = fieldName(field) + ": must be between " + String(field.minValue) + " and " + String(field.maxValue);
+        return false;
+      }
+      writeInt(config, field, (int32_t)v);
+      return true;
+    }
+
+    case CFG_TYPE_ENUM: {
+      int32_t index = -1;
+      if (value.is<const char *>()) {
+        const char *name = value.as<const char *>();
+        for (int32_t i = 0; i <= field.maxValue; i++) {
+          if (strcasecmp(field.names[i], name) == 0) index = i;
+        }
+      } else if (value.is<long>() && value.as<long>() >= 0 && value.as<long>() <= field.maxValue) {
+        index = value.as<long>();
+      }
+      if (index < 0) {
+        error = fieldName(field) + ": must be one of";
+        for (int32_t i = 0; i <= field.maxValue; i++) {
+          error += i ? ", " : " ";
+          error += field.names[i];
+        }
+        return false;
+      }
+      writeInt(config, field, index);
+      return true;
+    }
+
+    case CFG_TYPE_STRING: {
+      if (!value.is<const char *>()) {
+        error = fieldName(field) + ": must be a string";
+        return false;
+      }
+      const char *str = value.as<const char *>();
+      if (strlen(str) >= field.size) {
+        error = fieldName(field) + ": longer than " + String(field.size - 1) + " characters";
+        return false;
+      }
+      if ((field.flags & CFG_FLAG_PATH) && str[0] != '/') {
+        error = fieldName(field) + ": must be an absolute path";
+        return false;
+      }
+      strlcpy((char *)&config + field.offset, str, field.size);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void getField(const AppConfig &config, const ConfigField &field, JsonObject out, bool includeSecrets) {
+  switch (field.type) {
+    case CFG_TYPE_BOOL:
+      out[field.key] = *((const bool *)((const uint8_t *)&config + field.offset));
+      break;
+    case CFG_TYPE_INT:
+      out[field.key] = readInt(config, field);
+      break;
+    case CFG_TYPE_ENUM: {
+      int32_t index = readInt(config, field);
+      out[field.key] = index <= field.maxValue ? field.names[index] : "?";
+      break;
+    }
+    case CFG_TYPE_STRING: {
+      const char *str = (const char *)&config + field.offset;
+      if ((field.flags & CFG_FLAG_SECRET) && !includeSecrets) {
+        out[field.key] = str[0] ? "********" : "";
+      } else {
+        out[field.key] = str;
+      }
+      break;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+ConfigStore::ConfigStore()
+  : configVersion(0), source(CFG_SOURCE_DEFAULTS), loadMicros(0), schemaHash(0), subscriberCount(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  setDefaults(current);
+}
+
+const char *ConfigStore::sectionName(ConfigSection section) {
+  return section < CFG_SECTION_COUNT ? SECTION_NAMES[section] : "?";
+}
+
+bool ConfigStore::hasKey(ConfigSection section, const char *key) {
+  return findField(section, key) != NULL;
+}
+
+void ConfigStore::setDefaults(AppConfig &config) const {
+  memset(&config, 0, sizeof(config));
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    const ConfigField &field = FIELDS[i];
+    if (field.type == CFG_TYPE_STRING) {
+      strlcpy((char *)&config + field.offset, field.defaultString, field.size);
+    } else if (field.type == CFG_TYPE_BOOL) {
+      *((bool *)((uint8_t *)&config + field.offset)) = field.defaultValue != 0;
+    } else {
+      writeInt(config, field, field.defaultValue);
+    }
+  }
+}
+
+/**
+ * Boot order: NVS snapshot when it matches the schema and the current
+ * /config.json fingerprint, else parse the file (and refresh the snapshot),
+ * else the last snapshot if the card or the file is missing, else defaults.
+ */
+void ConfigStore::begin(bool sdReady) {
+  unsigned long start = micros();
+
+  schemaHash = crc32_le(0, (const uint8_t *)&FIELD_COUNT, sizeof(FIELD_COUNT));
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    const ConfigField &field = FIELDS[i];
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)field.key, strlen(field.key));
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)&field.section, sizeof(field.section));
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)&field.type, sizeof(field.type));
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)&field.offset, sizeof(field.offset));
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)&field.size, sizeof(field.size));
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)&field.minValue, sizeof(field.minValue));
+    schemaHash = crc32_le(schemaHash, (const uint8_t *)&field.maxValue, sizeof(field.maxValue));
+  }
+
+  AppConfig loaded;
+  uint32_t fileSize = 0;
+  uint32_t fileTime = 0;
+  if (sdReady) recoverFile();
+  bool haveFile = sdReady && fileFingerprint(fileSize, fileTime);
+  String error;
+
+  if (haveFile && loadSnapshot(loaded, true, fileSize, fileTime)) {
+    source = CFG_SOURCE_NVS;
+  } else if (haveFile && parseFile(loaded, error)) {
+    source = CFG_SOURCE_JSON;
+    saveSnapshot(loaded);
+  } else if (!haveFile && loadSnapshot(loaded, false, 0, 0)) {
+    source = CFG_SOURCE_NVS;  // last known settings while the card or file is missing
+  } else {
+    setDefaults(loaded);
+    source = CFG_SOURCE_DEFAULTS;
+    if (error.length()) lastError = error;
+  }
+
+  memcpy(&current, &loaded, sizeof(current));
+  configVersion = 1;
+  loadMicros = micros() - start;
+
+  static const char *SOURCE_NAMES[] = {"defaults", "nvs", "json"};
+  LOGI(TAG_CONFIG, "Configuration loaded from %s in %u us", SOURCE_NAMES[source], loadMicros);
+}
+
+bool ConfigStore::subscribe(uint32_t sectionMask, ConfigListener listener, void *ctx) {
+  if (subscriberCount >= CONFIG_MAX_SUBSCRIBERS) return false;
+  subscribers[subscriberCount].mask = sectionMask;
+  subscribers[subscriberCount].listener = listener;
+  subscribers[subscriberCount].ctx = ctx;
+  subscriberCount++;
+  return true;
+}
+
+bool ConfigStore::applyJson(AppConfig &config, JsonVariantConst doc, bool strict, String &error) const {
+  JsonObjectConst root = doc.as<JsonObjectConst>();
+  if (root.isNull()) {
+    error = "Expected a JSON object of sections";
+    return false;
+  }
+
+  for (JsonPairConst section : root) {
+    int index = findSection(section.key().c_str());
+    if (index < 0) {
+      if (!strict) continue;
+      error = String("Unknown section: ") + section.key().c_str();
+      return false;
+    }
+    JsonObjectConst values = section.value().as<JsonObjectConst>();
+    if (values.isNull()) {
+      error = String(section.key().c_str()) + ": must be an object";
+      if (strict) return false;
+      continue;
+    }
+
+    for (JsonPairConst pair : values) {
+      const ConfigField *field = findField(index, pair.key().c_str());
+      if (!field) {
+        if (!strict) continue;
+        error = String("Unknown key: ") + section.key().c_str() + "." + pair.key().c_str();
+        return false;
+      }
+      if (!setField(config, *field, pair.value(), error)) {
+        if (strict) return false;
+        LOGW_S(TAG_CONFIG, "%s - keeping default", error.c_str());
+      }
+    }
+  }
+  return true;
+}
+
+bool ConfigStore::fileFingerprint(uint32_t &fileSize, uint32_t &fileTime) const {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  File file = SD_MMC.open(CONFIG_FILE, FILE_READ);
+  bool ok = file && !file.isDirectory();
+  if (ok) {
+    fileSize = file.size();
+    fileTime = (uint32_t)file.getLastWrite();
+  }
+  if (file) file.close();
+  xSemaphoreGive(sdCardMutex);
+  return ok;
+}
+
+bool ConfigStore::parseFile(AppConfig &config, String &error) const {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    error = "SD card busy";
+    return false;
+  }
+  File file = SD_MMC.open(CONFIG_FILE, FILE_READ);
+  if (!file) {
+    xSemaphoreGive(sdCardMutex);
+    error = "Config file not found";
+    return false;
+  }
+  JsonDocument doc;
+  DeserializationError parseError = deserializeJson(doc, file);
+  file.close();
+  xSemaphoreGive(sdCardMutex);
+
+  if (parseError) {
+    error = String("Failed to parse config file: ") + parseError.c_str();
+    return false;
+  }
+
+  setDefaults(config);
+  // Older files only had wifi credentials; those meant station mode
+  if (doc["wifi"]["ssid"].is<const char *>() && !doc["wifi"]["ap_mode"].is<bool>()) {
+    config.wifi.apMode = false;
+  }
+  return applyJson(config, doc, false, error);
+}
+
+// Written to a temporary file first so a power cut never leaves half a
+// config; FAT cannot rename over a file, so a cut between the remove and the
+// rename leaves only the temporary file, which recoverFile() puts back
+bool ConfigStore::saveFile(const AppConfig &config) {
+  JsonDocument doc;
+  writeConfig(doc.to<JsonObject>(), true);
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  File file = SD_MMC.open(CONFIG_TEMP_FILE, FILE_WRITE);
+  bool ok = file && serializeJsonPretty(doc, file) > 0;
+  if (file) file.close();
+  if (ok) {
+    SD_MMC.remove(CONFIG_FILE);
+    ok = SD_MMC.rename(CONFIG_TEMP_FILE, CONFIG_FILE);
+  }
+  xSemaphoreGive(sdCardMutex);
+  return ok;
+}
+
+// A temporary file next to /config.json is an interrupted write (the old file
+// is intact); without /config.json it is the complete new one, because the
+// old file is only removed after the temporary file was closed
+void ConfigStore::recoverFile() {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+  if (SD_MMC.exists(CONFIG_TEMP_FILE)) {
+    if (SD_MMC.exists(CONFIG_FILE)) {
+      SD_MMC.remove(CONFIG_TEMP_FILE);
+    } else if (SD_MMC.rename(CONFIG_TEMP_FILE, CONFIG_FILE)) {
+      LOGW(TAG_CONFIG, "Recovered " CONFIG_FILE " from an interrupted save");
+    }
+  }
+  xSemaphoreGive(sdCardMutex);
+}
+
+bool ConfigStore::loadSnapshot(AppConfig &config, bool checkFingerprint, uint32_t fileSize, uint32_t fileTime) const {
+  Preferences prefs;
+  if (!prefs.begin(CONFIG_NVS_NAMESPACE, true)) return false;
+
+  ConfigSnapshot snapshot;
+  bool ok = prefs.getBytesLength(CONFIG_NVS_KEY) == sizeof(snapshot) &&
+            prefs.getBytes(CONFIG_NVS_KEY, &snapshot, sizeof(snapshot)) == sizeof(snapshot);
+  prefs.end();
+
+  ok = ok && snapshot.magic == SNAPSHOT_MAGIC && snapshot.schemaHash == schemaHash &&
+       snapshot.crc == crc32_le(0, (const uint8_t *)&snapshot.config, sizeof(snapshot.config));
+  if (ok && checkFingerprint) {
+    ok = snapshot.fileSize == fileSize && snapshot.fileTime == fileTime;
+  }
+  if (ok) memcpy(&config, &snapshot.config, sizeof(config));
+  return ok;
+}
+
+bool ConfigStore::saveSnapshot(const AppConfig &config) {
+  ConfigSnapshot snapshot;
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.magic = SNAPSHOT_MAGIC;
+  snapshot.schemaHash = schemaHash;
+  fileFingerprint(snapshot.fileSize, snapshot.fileTime);
+  memcpy(&snapshot.config, &config, sizeof(config));
+  snapshot.crc = crc32_le(0, (const uint8_t *)&snapshot.config, sizeof(snapshot.config));
+
+  Preferences prefs;
+  if (!prefs.begin(CONFIG_NVS_NAMESPACE, false)) return false;
+  bool ok = prefs.putBytes(CONFIG_NVS_KEY, &snapshot, sizeof(snapshot)) == sizeof(snapshot);
+  prefs.end();
+  return ok;
+}
+
+void ConfigStore::commit(const AppConfig &next, ConfigChange &change) {
+  change.sections = 0;
+  change.restartRequired = false;
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    const ConfigField &field = FIELDS[i];
+    if (memcmp((const uint8_t *)&current + field.offset, (const uint8_t *)&next + field.offset, field.size) != 0) {
+      change.sections |= CONFIG_MASK(field.section);
+      if (field.flags & CFG_FLAG_RESTART) change.restartRequired = true;
+    }
+  }
+  // Raw frame buffers are allocated at the boot frame size, so in the raw
+  // pixel formats a new size is only applied live when it is smaller
+  if (next.camera.frameSize != current.camera.frameSize &&
+      (next.camera.pixelFormat != CAMERA_PIXELS_JPEG || current.camera.pixelFormat != CAMERA_PIXELS_JPEG)) {
+    change.restartRequired = true;
+  }
+  if (!change.sections) return;
+
+  portENTER_CRITICAL(&lock);
+  memcpy(&current, &next, sizeof(current));
+  configVersion++;
+  portEXIT_CRITICAL(&lock);
+
+  for (uint8_t i = 0; i < subscriberCount; i++) {
+    uint32_t relevant = subscribers[i].mask & change.sections;
+    if (relevant) subscribers[i].listener(subscribers[i].ctx, current, relevant);
+  }
+}
+
+bool ConfigStore::update(JsonVariantConst patch, ConfigChange &change, String &error, bool persist) {
+  AppConfig next;
+  memcpy(&next, &current, sizeof(next));
+  change.persisted = false;
+  if (!applyJson(next, patch, true, error)) return false;
+
+  commit(next, change);
+  if (change.sections) {
+    if (persist) {
+      change.persisted = saveFile(current) && saveSnapshot(current);
+      if (!change.persisted) LOGW(TAG_CONFIG, "Configuration applied but not persisted");
+    }
+    LOGI(TAG_CONFIG, "Configuration updated (sections 0x%02x, version %u)", change.sections, configVersion);
+  }
+  return true;
+}
+
+bool ConfigStore::reload(ConfigChange &change, String &error) {
+  AppConfig next;
+  change.persisted = false;
+  if (!parseFile(next, error)) return false;
+
+  commit(next, change);
+  source = CFG_SOURCE_JSON;
+  change.persisted = saveSnapshot(current);
+  LOGI(TAG_CONFIG, "Configuration reloaded from file (sections 0x%02x)", change.sections);
+  return true;
+}
+
+void ConfigStore::writeConfig(JsonObject out, bool includeSecrets, uint32_t sectionMask) const {
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    const ConfigField &field = FIELDS[i];
+    if (!(sectionMask & CONFIG_MASK(field.section))) continue;
+    JsonObject section = out[SECTION_NAMES[field.section]].as<JsonObject>();
+    if (section.isNull()) section = out[SECTION_NAMES[field.section]].to<JsonObject>();
+    getField(current, field, section, includeSecrets);
+  }
+}
+
+void ConfigStore::writeSchema(JsonArray out) const {
+  static const char *TYPE_NAMES[] = {"bool", "int", "enum", "string"};
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    const ConfigField &field = FIELDS[i];
+    JsonObject entry = out.add<JsonObject>();
+    entry["section"] = SECTION_NAMES[field.section];
+    entry["key"] = field.key;
+    entry["type"] = TYPE_NAMES[field.type];
+    switch (field.type) {
+      case CFG_TYPE_BOOL:
+        entry["default"] = field.defaultValue != 0;
+        break;
+      case CFG_TYPE_INT:
+        entry["min"] = field.minValue;
+        entry["max"] = field.maxValue;
+        entry["default"] = field.defaultValue;
+        break;
+      case CFG_TYPE_ENUM: {
+        JsonArray options = entry["options"].to<JsonArray>();
+        for (int32_t v = 0; v <= field.maxValue; v++) options.add(field.names[v]);
+        entry["default"] = field.names[field.defaultValue];
+        break;
+      }
+      case CFG_TYPE_STRING:
+        entry["max_length"] = field.size - 1;
+        entry["default"] = field.defaultString;
+        break;
+    }
+    if (field.flags & CFG_FLAG_SECRET) entry["secret"] = true;
+    if (field.flags & CFG_FLAG_RESTART) entry["restart"] = true;
+  }
+}
+
+void ConfigStore::reportStatus(JsonObject out) const {
+  static const char *SOURCE_NAMES[] = {"defaults", "nvs", "json"};
+  out["source"] = SOURCE_NAMES[source];
+  out["version"] = configVersion;
+  out["load_us"] = loadMicros;
+  out["schema_hash"] = schemaHash;
+  if (lastError.length()) out["error"] = lastError;
+}
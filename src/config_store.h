@@ -0,0 +1,305 @@
+/**
+ * Runtime Configuration Store
+ *
+ * Every tunable lives in one AppConfig struct described by a field table
+ * (section, key, type, range, default). /config.json on the SD card stays the
+ * editable source; after a successful parse the validated struct is saved as
+ * a binary snapshot in NVS, so later boots copy the snapshot instead of
+ * parsing JSON unless the file changed (size/mtime) or the schema did.
+ *
+ * Updates through /api/config are validated against the schema and applied
+ * all-or-nothing, persisted to both stores, and pushed to the modules that
+ * subscribed to the affected sections, without a reboot.
+ */
+
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define CONFIG_FILE            "/config.json"
+#define CONFIG_TEMP_FILE       CONFIG_FILE ".tmp"
+#define CONFIG_NVS_NAMESPACE   "appcfg"
+#define CONFIG_NVS_KEY         "snapshot"
+#define CONFIG_MAX_SUBSCRIBERS 8
+#define CONFIG_MAX_BODY        4096
+
+enum ConfigSection : uint8_t {
+  CFG_SECTION_WIFI = 0,
+  CFG_SECTION_CAMERA,
+  CFG_SECTION_STREAM,
+  CFG_SECTION_STORAGE,
+  CFG_SECTION_DETECTION,
+  CFG_SECTION_SYSTEM,
+  CFG_SECTION_MQTT,
+  CFG_SECTION_PAN_TILT,
+  CFG_SECTION_COUNT
+};
+
+#define CONFIG_MASK(section) (1u << (section))
+#define CONFIG_MASK_ALL      ((1u << CFG_SECTION_COUNT) - 1)
+
+struct WifiSettings {
+  char ssid[33];
+  char password[65];
+  bool apMode;
+};
+
+// What the sensor delivers: JPEG, or raw pixels that analysis reads directly
+// and the stream encodes with jpeg_encoder
+enum CameraPixelMode : uint8_t {
+  CAMERA_PIXELS_JPEG = 0,
+  CAMERA_PIXELS_YUV422,
+  CAMERA_PIXELS_GRAYSCALE
+};
+
+struct CameraSettings {
+  uint8_t frameSize;      // framesize_t
+  uint8_t quality;        // JPEG quality, lower is better
+  int8_t brightness;
+  int8_t contrast;
+  int8_t saturation;
+  bool hmirror;
+  bool vflip;
+  uint8_t fbCount;
+  uint8_t xclkMhz;
+  uint8_t pixelFormat;    // CameraPixelMode
+  // Exposure / gain / white balance (OV2640 register controls)
+  bool aec;
+  bool aec2;              // night mode (DSP exposure)
+  int8_t aeLevel;
+  uint16_t aecValue;      // manual exposure when aec is off
+  bool agc;
+  uint8_t agcGain;        // manual gain when agc is off
+  uint8_t gainCeiling;    // gainceiling_t
+  bool awb;
+  bool awbGain;
+  uint8_t wbMode;
+  uint8_t specialEffect;
+  bool bpc;
+  bool wpc;
+  bool rawGma;
+  bool lenc;
+  bool dcw;
+};
+
+struct StreamSettings {
+  uint16_t frameIntervalMs;   // minimum time between frames
+  uint16_t retryDelayMs;      // wait after a failed capture
+  uint8_t yieldEveryChunks;   // delay(1) every N chunks (0 = never)
+  uint8_t rateControl;        // RateControlMode (quality_controller.h)
+  uint16_t targetKbps;
+  uint8_t targetFps;
+  uint8_t qualityMin;         // best quality the controller may use
+  uint8_t qualityMax;         // worst quality the controller may use
+  bool rtpEnabled;            // RTP/UDP sessions may be started (rtp_streamer.h)
+  uint8_t rtpFps;
+  uint16_t rtpPacketBytes;    // UDP payload per packet, IP and UDP headers excluded
+  uint16_t rtpTimeoutS;       // a session not renewed for this long stops (0 = never)
+  uint16_t rtpMaxLateMs;      // the rest of a frame is dropped this long after capture
+};
+
+struct StorageSettings {
+  bool logToSD;
+  uint8_t maxUsagePercent;    // SD usage above this deletes the oldest recordings
+  char recordingsDir[32];
+  uint16_t recordingsMb;      // oldest recordings are deleted above this (0 = no limit)
+  uint16_t recordingRetentionDays;  // 0 = no age limit
+  uint16_t eventLogKb;        // oldest event segments are deleted above this
+  uint16_t eventRetentionDays;  // 0 = no age limit
+};
+
+// How a model expects its input pixels scaled before quantization
+enum ModelInputRange : uint8_t {
+  MODEL_INPUT_UNIT = 0,       // 0..1
+  MODEL_INPUT_BYTE,           // 0..255
+  MODEL_INPUT_SIGNED          // -1..1
+};
+
+// Where model weights live while the model runs
+enum ModelWeightSource : uint8_t {
+  MODEL_WEIGHTS_AUTO = 0,     // PSRAM when the model fits, else the SD card
+  MODEL_WEIGHTS_PSRAM,
+  MODEL_WEIGHTS_SD            // only the model's metadata is kept in memory
+};
+
+struct DetectionSettings {
+  bool enabled;
+  uint8_t motionThreshold;    // per-pixel luma delta
+  uint8_t minChangedPercent;  // changed pixels needed to trigger
+  uint16_t cooldownMs;
+  bool snapshotOnEvent;
+  // Int8 model run on camera frames (detector.h)
+  bool modelEnabled;
+  char modelPath[64];
+  char labelsPath[64];
+  uint8_t scoreThreshold;     // percent
+  uint16_t modelIntervalMs;   // minimum time between inferences
+  uint8_t inputRange;         // ModelInputRange
+  uint16_t fastRamKb;         // internal RAM for activations and weight pages
+  uint8_t weightSource;       // ModelWeightSource
+};
+
+struct SystemSettings {
+  uint8_t logLevel;           // LogLevel
+};
+
+struct MqttSettings {
+  bool enabled;
+  char host[64];
+  uint16_t port;
+  char clientId[33];
+  char username[33];
+  char password[65];
+  char baseTopic[48];
+  uint8_t qos;                // 0 or 1
+  uint16_t keepAliveS;
+  uint16_t batchMs;           // wait for more events before publishing
+  uint16_t drainPerSecond;    // messages per second
+  uint16_t healthIntervalS;   // 0 = no health messages
+  uint16_t queueKb;           // spill file limit
+};
+
+// Servos that keep the detector's target centred (pan_tilt.h)
+struct PanTiltSettings {
+  bool enabled;
+  uint8_t panPin;
+  uint8_t tiltPin;
+  uint16_t rateHz;            // control loop
+  int8_t classId;             // class followed, -1 = any
+  uint16_t captureLatencyMs;  // exposure until the detector has the frame
+  uint16_t servoLagMs;        // command until the servo is there
+  uint8_t hfovDeg;
+  uint8_t vfovDeg;
+  uint16_t kp;                // gains in hundredths
+  uint16_t ki;
+  uint16_t kd;
+  uint16_t maxSpeed;          // deg/s
+  uint16_t maxAccel;          // deg/s^2
+  uint16_t kalmanAccel;       // expected target acceleration, deg/s^2
+  uint8_t kalmanNoise;        // detection noise, tenths of a degree
+  uint8_t panMin;             // degrees
+  uint8_t panMax;
+  uint8_t panHome;
+  uint8_t tiltMin;
+  uint8_t tiltMax;
+  uint8_t tiltHome;
+  bool invertPan;
+  bool invertTilt;
+  uint16_t pulseMinUs;        // at 0 degrees
+  uint16_t pulseMaxUs;        // at 180 degrees
+  uint16_t lostMs;
+  uint16_t homeAfterS;        // 0 = stay where the target was lost
+};
+
+struct AppConfig {
+  WifiSettings wifi;
+  CameraSettings camera;
+  StreamSettings stream;
+  StorageSettings storage;
+  DetectionSettings detection;
+  SystemSettings system;
+  MqttSettings mqtt;
+  PanTiltSettings panTilt;
+};
+
+enum ConfigFieldType : uint8_t {
+  CFG_TYPE_BOOL = 0,
+  CFG_TYPE_INT,
+  CFG_TYPE_ENUM,      // stored as uint8_t, named in JSON
+  CFG_TYPE_STRING
+};
+
+// Field flags
+#define CFG_FLAG_SECRET   0x01   // masked in GET /api/config
+#define CFG_FLAG_RESTART  0x02   // only takes effect after a restart
+#define CFG_FLAG_PATH     0x04   // absolute SD path
+
+struct ConfigField {
+  ConfigSection section;
+  const char *key;
+  ConfigFieldType type;
+  uint16_t offset;
+  uint16_t size;
+  int32_t minValue;
+  int32_t maxValue;
+  int32_t defaultValue;
+  const char *defaultString;
+  const char *const *names;   // CFG_TYPE_ENUM value names
+  uint8_t flags;
+};
+
+enum ConfigSource : uint8_t {
+  CFG_SOURCE_DEFAULTS = 0,
+  CFG_SOURCE_NVS,
+  CFG_SOURCE_JSON
+};
+
+struct ConfigChange {
+  uint32_t sections;       // CONFIG_MASK() bits of the sections that changed
+  bool restartRequired;    // a CFG_FLAG_RESTART field changed
+  bool persisted;          // written to /config.json and NVS
+};
+
+// Called after a change is committed, with the mask of changed sections
+typedef void (*ConfigListener)(void *ctx, const AppConfig &config, uint32_t changedSections);
+
+class ConfigStore {
+public:
+  ConfigStore();
+
+  // Loads the NVS snapshot or /config.json (sdReady) or defaults
+  void begin(bool sdReady);
+
+  const AppConfig &settings() const { return current; }
+  uint32_t version() const { return configVersion; }
+
+  bool subscribe(uint32_t sectionMask, ConfigListener listener, void *ctx);
+
+  // Validates and applies a partial {"section": {"key": value}} document.
+  // Nothing is applied when any field fails validation.
+  // persist=false applies the change for this session only.
+  bool update(JsonVariantConst patch, ConfigChange &change, String &error, bool persist = true);
+
+  // Re-reads /config.json (e.g. after editing it in the file manager)
+  bool reload(ConfigChange &change, String &error);
+
+  void writeConfig(JsonObject out, bool includeSecrets, uint32_t sectionMask = CONFIG_MASK_ALL) const;
+  void writeSchema(JsonArray out) const;
+  void reportStatus(JsonObject out) const;
+
+  static const char *sectionName(ConfigSection section);
+  static bool hasKey(ConfigSection section, const char *key);
+
+private:
+  struct Subscriber {
+    uint32_t mask;
+    ConfigListener listener;
+    void *ctx;
+  };
+
+  AppConfig current;
+  uint32_t configVersion;
+  ConfigSource source;
+  uint32_t loadMicros;
+  uint32_t schemaHash;
+  String lastError;
+  Subscriber subscribers[CONFIG_MAX_SUBSCRIBERS];
+  uint8_t subscriberCount;
+  portMUX_TYPE lock;
+
+  void setDefaults(AppConfig &config) const;
+  bool applyJson(AppConfig &config, JsonVariantConst doc, bool strict, String &error) const;
+  bool parseFile(AppConfig &config, String &error) const;
+  bool saveFile(const AppConfig &config);
+  bool loadSnapshot(AppConfig &config, bool checkFingerprint, uint32_t fileSize, uint32_t fileTime) const;
+  bool saveSnapshot(const AppConfig &config);
+  bool fileFingerprint(uint32_t &fileSize, uint32_t &fileTime) const;
+  void recoverFile();
+  void commit(const AppConfig &next, ConfigChange &change);
+};
+
+extern ConfigStore configStore;
+
+#endif // CONFIG_STORE_H
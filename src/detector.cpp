@@ -0,0 +1,833 @@
+/**
+ * On-Device Object Detection Implementation
+ */
+
+#include "detector.h"
+#include "logger.h"
+#include "event_log.h"
+#include "mqtt_publisher.h"
+#include <SD_MMC.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <img_converters.h>
+#include <new>
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+extern bool cameraActive;
+
+Detector detector;
+
+static const char *STATE_NAMES[] = {"disabled", "loading", "running", "error"};
+static const char *OUTPUT_NAMES[] = {"classes", "grid"};
+static const char *REGION_NAMES[] = {"fast", "slow"};
+
+static uint32_t clockMicros() {
+  return (uint32_t)micros();
+}
+
+static uint8_t *alignArena(uint8_t *buffer) {
+  return (uint8_t *)(((uintptr_t)buffer + INFER_ARENA_ALIGN - 1) & ~(uintptr_t)(INFER_ARENA_ALIGN - 1));
+}
+
+// PSRAM first: models and activations are far larger than internal RAM
+static uint8_t *allocLarge(size_t size) {
+  uint8_t *buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  return buffer ? buffer : (uint8_t *)malloc(size);
+}
+
+static uint8_t *allocInternal(size_t size) {
+  return (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+// Internal RAM the detector may take without starving WiFi and the server
+static size_t internalAvailable() {
+  size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  return largest > DETECTOR_SRAM_RESERVE ? largest - DETECTOR_SRAM_RESERVE : 0;
+}
+
+static inline uint8_t clampByte(int32_t v) {
+  return v < 0 ? 0 : (v > 255 ? 255 : (uint8_t)v);
+}
+
+Detector::Detector()
+  : engine(NULL), task(NULL), reloadRequested(false), state(DETECTOR_DISABLED), lastError(NULL),
+    modelBuffer(NULL), fastArena(NULL), slowArena(NULL), pageBytes(0), fastBudget(0), decodeBuffer(NULL), decodeCapacity(0),
+    gridClass(NULL), gridScore(NULL), gridStack(NULL), outputKind(DETECTOR_OUTPUT_CLASSES), maskVersion(0),
+    skippedFrames(0), trackCount(0), nextTrackId(0), loggedClass(0xFF),
+    labelCount(0), resultCount(0), frameCounter(0), resultsCapturedUs(0),
+    resultsWidth(0), resultsHeight(0), inferences(0), failures(0), lastRunMs(0),
+    preprocessMicros(0), avgInvokeMicros(0), frameWidth(0), frameHeight(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(&config, 0, sizeof(config));
+  memset(quantize, 0, sizeof(quantize));
+  pageBuffers[0] = NULL;
+  pageBuffers[1] = NULL;
+}
+
+bool Detector::begin(const DetectionSettings &settings) {
+  // The engine's tensor and operator tables are ~25KB: keep them off the heap
+  void *memory = heap_caps_malloc(sizeof(InferenceEngine), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (memory == NULL) memory = malloc(sizeof(InferenceEngine));
+  if (memory == NULL) {
+    LOGE(TAG_CAMERA, "Detector: no memory for the inference engine");
+    return false;
+  }
+  engine = new (memory) InferenceEngine();
+  if (!pager.begin()) return false;
+  config = settings;
+  reloadRequested = true;
+
+  if (xTaskCreatePinnedToCore(detectTaskEntry, "detector", DETECTOR_STACK_SIZE, this, 1, &task, 1) != pdPASS) {
+    LOGE(TAG_CAMERA, "Detector: failed to start task");
+    task = NULL;
+    return false;
+  }
+  return true;
+}
+
+void Detector::configure(const DetectionSettings &settings) {
+  portENTER_CRITICAL(&lock);
+  // Threshold and interval are read per inference; the rest needs a reload
+  bool reload = settings.modelEnabled != config.modelEnabled || settings.inputRange != config.inputRange ||
+                settings.fastRamKb != config.fastRamKb || settings.weightSource != config.weightSource ||
+                strcmp(settings.modelPath, config.modelPath) != 0 ||
+                strcmp(settings.labelsPath, config.labelsPath) != 0;
+  config = settings;
+  if (reload) reloadRequested = true;
+  portEXIT_CRITICAL(&lock);
+  if (reload && task) xTaskNotifyGive(task);
+}
+
+void Detector::detectTaskEntry(void *param) {
+  ((Detector *)param)->run();
+}
+
+void Detector::run() {
+  for (;;) {
+    if (reloadRequested) {
+      reloadRequested = false;
+      unloadModel();
+      if (config.modelEnabled) loadModel();
+    }
+
+    if (state != DETECTOR_RUNNING || !cameraActive) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DETECTOR_IDLE_MS));
+      continue;
+    }
+
+    portENTER_CRITICAL(&lock);
+    uint16_t interval = config.modelIntervalMs;
+    uint8_t threshold = config.scoreThreshold;
+    portEXIT_CRITICAL(&lock);
+
+    uint32_t elapsed = millis() - lastRunMs;
+    if (lastRunMs && elapsed < interval) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(interval - elapsed));
+      continue;
+    }
+    lastRunMs = millis();
+
+    if (zoneMap.version() != maskVersion) compileMasks();
+    if (inputMask.compiled() && inputMask.activePixels() == 0) {
+      // Everything excluded: nothing to look at
+      portENTER_CRITICAL(&lock);
+      resultCount = 0;
+      skippedFrames++;
+      portEXIT_CRITICAL(&lock);
+      continue;
+    }
+
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (!fb) {
+      failures++;
+      continue;
+    }
+    int64_t capturedUs = esp_timer_get_time();
+    uint32_t start = micros();
+    bool ready = prepareInput(fb);
+    frameWidth = fb->width;
+    frameHeight = fb->height;
+    esp_camera_fb_return(fb);
+    preprocessMicros = micros() - start;
+
+    if (!ready || !engine->invoke(clockMicros)) {
+      if (++failures % 20 == 1) {
+        LOGW(TAG_CAMERA, "Detector: inference failed (%s)", ready ? engine->error() : "input");
+      }
+      continue;
+    }
+
+    Detection found[DETECTOR_MAX_RESULTS];
+    uint8_t count = decodeOutput(found, threshold);
+    if (outputKind == DETECTOR_OUTPUT_GRID) {
+      trackZones(found, count);
+    } else if ((count ? found[0].classId : 0xFF) != loggedClass) {
+      loggedClass = count ? found[0].classId : 0xFF;
+      if (count) logDetection(found[0]);
+    }
+    uint32_t invokeMicros = engine->lastInvokeMicros();
+
+    portENTER_CRITICAL(&lock);
+    memcpy(results, found, sizeof(Detection) * count);
+    resultCount = count;
+    frameCounter++;
+    resultsCapturedUs = capturedUs;
+    resultsWidth = frameWidth;
+    resultsHeight = frameHeight;
+    inferences++;
+    avgInvokeMicros = avgInvokeMicros ? (avgInvokeMicros * 7 + invokeMicros) / 8 : invokeMicros;
+    portEXIT_CRITICAL(&lock);
+  }
+}
+
+// Load failures release everything loaded so far
+void Detector::fail(const char *message) {
+  unloadModel();
+  lastError = message;
+  state = DETECTOR_ERROR;
+  LOGW(TAG_CAMERA, "Detector: %s", message);
+}
+
+bool Detector::loadModel() {
+  state = DETECTOR_LOADING;
+  char path[sizeof(config.modelPath)];
+  char labelsPath[sizeof(config.labelsPath)];
+  portENTER_CRITICAL(&lock);
+  memcpy(path, config.modelPath, sizeof(path));
+  memcpy(labelsPath, config.labelsPath, sizeof(labelsPath));
+  uint8_t inputRange = config.inputRange;
+  uint16_t fastRamKb = config.fastRamKb;
+  uint8_t weightSource = config.weightSource;
+  portEXIT_CRITICAL(&lock);
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    fail("SD card busy");
+    return false;
+  }
+  File file = SD_MMC.open(path, FILE_READ);
+  if (!file || file.isDirectory()) {
+    if (file) file.close();
+    xSemaphoreGive(sdCardMutex);
+    fail("Model file not found");
+    return false;
+  }
+  size_t size = file.size();
+  bool fromSD = weightSource == MODEL_WEIGHTS_SD ||
+                (weightSource == MODEL_WEIGHTS_AUTO && size > DETECTOR_MAX_MODEL_BYTES);
+  if (size == 0 || (!fromSD && size > DETECTOR_MAX_MODEL_BYTES)) {
+    file.close();
+    xSemaphoreGive(sdCardMutex);
+    fail("Model file too large or empty");
+    return false;
+  }
+
+  uint32_t start = millis();
+  if (fromSD) {
+    // The pager owns the file from here and takes the mutex per read
+    xSemaphoreGive(sdCardMutex);
+    pager.attach(file);
+    if (!loadPrefix(size)) return false;
+  } else {
+    // Flatbuffer buffers are aligned relative to the file start
+    modelBuffer = allocLarge(size + INFER_ARENA_ALIGN);
+    size_t got = modelBuffer ? file.read(alignArena(modelBuffer), size) : 0;
+    file.close();
+    xSemaphoreGive(sdCardMutex);
+    if (modelBuffer == NULL) {
+      fail("No memory for the model");
+      return false;
+    }
+    if (got != size) {
+      fail("Model read failed");
+      return false;
+    }
+    pager.setResident(alignArena(modelBuffer), size);
+    if (!engine->load(alignArena(modelBuffer), size, size, &pager)) {
+      fail(engine->error());
+      return false;
+    }
+  }
+
+  const InferTensor &input = engine->input();
+  if (input.dimCount != 4 || (input.dims[3] != 1 && input.dims[3] != 3)) {
+    fail("Model input must be [1, H, W, 1 or 3]");
+    return false;
+  }
+
+  if (!planMemory(fastRamKb)) {
+    fail(engine->error() ? engine->error() : "No memory for the tensor arena");
+    return false;
+  }
+
+  const InferTensor &output = engine->output();
+  outputKind = output.dimCount == 4 ? DETECTOR_OUTPUT_GRID : DETECTOR_OUTPUT_CLASSES;
+  if (outputKind == DETECTOR_OUTPUT_GRID) {
+    size_t cells = (size_t)output.dims[1] * output.dims[2];
+    gridClass = allocLarge(cells);
+    gridScore = allocLarge(cells);
+    gridStack = (uint16_t *)allocLarge(cells * sizeof(uint16_t));
+    if (!gridClass || !gridScore || !gridStack || cells > 65535) {
+      fail("Output grid too large");
+      return false;
+    }
+  }
+
+  buildQuantizeTable(inputRange);
+  loadLabels(labelsPath);
+  lastError = NULL;
+  state = DETECTOR_RUNNING;
+  LOGI_S(TAG_CAMERA, "Detector: loaded %s (%u ops, %u ms, weights from %s)", path,
+         engine->opCount(), (unsigned)(millis() - start), fromSD ? "SD" : "PSRAM");
+  LOGI(TAG_CAMERA, "Detector: arena %u KB SRAM + %u KB PSRAM, %u ops paged through 2x%u bytes",
+       (unsigned)(engine->arenaSize(INFER_REGION_FAST) / 1024), (unsigned)(engine->arenaSize(INFER_REGION_SLOW) / 1024),
+       engine->pagedOps(), (unsigned)pageBytes);
+  return true;
+}
+
+// SD mode keeps only a prefix holding the model's metadata in memory. How
+// long that is isn't known up front, so the prefix grows until it parses.
+bool Detector::loadPrefix(size_t size) {
+  size_t resident = size < DETECTOR_PREFIX_BYTES ? size : DETECTOR_PREFIX_BYTES;
+  for (;;) {
+    pager.setResident(NULL, 0);
+    free(modelBuffer);
+    modelBuffer = allocLarge(resident + INFER_ARENA_ALIGN);
+    if (modelBuffer == NULL) {
+      fail("No memory for the model");
+      return false;
+    }
+    uint8_t *image = alignArena(modelBuffer);
+    if (!pager.beginRead(0, image, resident) || !pager.waitRead()) {
+      fail("Model read failed");
+      return false;
+    }
+    pager.setResident(image, resident);
+    if (engine->load(image, resident, size, &pager)) return true;
+    if (!engine->needsLongerPrefix() || resident == size) {
+      fail(engine->error());
+      return false;
+    }
+    resident = resident * 2 < size ? resident * 2 : size;
+  }
+}
+
+// Internal SRAM within the budget goes to the weight page buffers first
+// (every layer's weights when each buffer needs at most a quarter of the
+// budget), then to the most heavily read activations
+bool Detector::planMemory(uint16_t fastRamKb) {
+  size_t budget = (size_t)fastRamKb * 1024;
+  size_t available = internalAvailable();
+  if (budget > available) budget = available;
+
+  // Weights outside memory can only be used through the page buffers, so
+  // those are sized for them even past the budget (in PSRAM if need be)
+  pageBytes = engine->largestWeights();
+  if (pageBytes > budget / 4) pageBytes = budget / 4;
+  if (pageBytes < engine->largestExternalWeights()) pageBytes = engine->largestExternalWeights();
+  if (pageBytes) {
+    for (int i = 0; i < 2; i++) {
+      pageBuffers[i] = allocInternal(pageBytes);
+      if (pageBuffers[i] == NULL) pageBuffers[i] = allocLarge(pageBytes);
+      if (pageBuffers[i] == NULL) return false;
+    }
+  }
+  if (!engine->setWeightPaging(pageBuffers[0], pageBuffers[1], pageBytes)) return false;
+
+  fastBudget = budget > 2 * pageBytes ? budget - 2 * pageBytes : 0;
+  available = internalAvailable();
+  if (fastBudget > available) fastBudget = available;
+  if (!engine->plan(fastBudget)) return false;
+  size_t fastSize = engine->arenaSize(INFER_REGION_FAST);
+  if (fastSize) {
+    fastArena = allocInternal(fastSize + INFER_ARENA_ALIGN);
+    if (fastArena == NULL) {
+      // Fragmented since the check: everything to PSRAM
+      fastBudget = 0;
+      if (!engine->plan(0)) return false;
+      fastSize = 0;
+    }
+  }
+  size_t slowSize = engine->arenaSize(INFER_REGION_SLOW);
+  if (slowSize) {
+    slowArena = allocLarge(slowSize + INFER_ARENA_ALIGN);
+    if (slowArena == NULL) return false;
+  }
+  return engine->setArena(fastArena ? alignArena(fastArena) : NULL, fastSize,
+                          slowArena ? alignArena(slowArena) : NULL, slowSize);
+}
+
+void Detector::unloadModel() {
+  if (engine) engine->unload();
+  pager.detach();
+  free(modelBuffer);
+  free(fastArena);
+  free(slowArena);
+  free(pageBuffers[0]);
+  free(pageBuffers[1]);
+  free(gridClass);
+  free(gridScore);
+  free(gridStack);
+  modelBuffer = NULL;
+  fastArena = NULL;
+  slowArena = NULL;
+  pageBuffers[0] = NULL;
+  pageBuffers[1] = NULL;
+  pageBytes = 0;
+  fastBudget = 0;
+  gridClass = NULL;
+  gridScore = NULL;
+  gridStack = NULL;
+  inputMask.clear();
+  gridMask.clear();
+  maskVersion = 0;
+  trackCount = 0;
+  labelCount = 0;
+  state = DETECTOR_DISABLED;
+  portENTER_CRITICAL(&lock);
+  resultCount = 0;
+  portEXIT_CRITICAL(&lock);
+}
+
+// One label per line; missing file just leaves classes unnamed
+void Detector::loadLabels(const char *path) {
+  labelCount = 0;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+  File file = SD_MMC.open(path, FILE_READ);
+  if (file) {
+    while (file.available() && labelCount < DETECTOR_MAX_LABELS) {
+      String line = file.readStringUntil('\n');
+      line.trim();
+      strncpy(labels[labelCount], line.c_str(), DETECTOR_LABEL_LEN - 1);
+      labels[labelCount][DETECTOR_LABEL_LEN - 1] = '\0';
+      labelCount++;
+    }
+    file.close();
+  }
+  xSemaphoreGive(sdCardMutex);
+}
+
+const char *Detector::label(uint8_t classId) const {
+  return classId < labelCount && labels[classId][0] ? labels[classId] : NULL;
+}
+
+void Detector::buildQuantizeTable(uint8_t inputRange) {
+  const InferTensor &input = engine->input();
+  float scale = input.scale > 0.0f ? input.scale : 1.0f;
+  for (int v = 0; v < 256; v++) {
+    float real = inputRange == MODEL_INPUT_BYTE ? (float)v
+               : inputRange == MODEL_INPUT_SIGNED ? v / 127.5f - 1.0f
+               : v / 255.0f;
+    int32_t q = (int32_t)lroundf(real / scale) + input.zeroPoint;
+    quantize[v] = (int8_t)(q < -128 ? -128 : (q > 127 ? 127 : q));
+  }
+}
+
+// Decodes at the largest JPEG scale-down that still covers the model input
+bool Detector::decodeJpeg(const camera_fb_t *fb, const uint8_t *&pixels, uint16_t &width, uint16_t &height) {
+  const InferTensor &input = engine->input();
+  int scale = 3;
+  while (scale > 0 && ((int32_t)(fb->width >> scale) < input.dims[2] || (int32_t)(fb->height >> scale) < input.dims[1])) {
+    scale--;
+  }
+  width = (fb->width + (1 << scale) - 1) >> scale;
+  height = (fb->height + (1 << scale) - 1) >> scale;
+  size_t needed = (size_t)width * height * 2;
+  if (needed > decodeCapacity) {
+    free(decodeBuffer);
+    decodeBuffer = allocLarge(needed);
+    decodeCapacity = decodeBuffer ? needed : 0;
+    if (!decodeBuffer) return false;
+  }
+  if (!jpg2rgb565(fb->buf, fb->len, decodeBuffer, (jpg_scale_t)scale)) return false;
+  width = fb->width >> scale;
+  height = fb->height >> scale;
+  pixels = decodeBuffer;
+  return true;
+}
+
+// Nearest-neighbour resize of the frame into the quantized input tensor
+bool Detector::prepareInput(const camera_fb_t *fb) {
+  const InferTensor &input = engine->input();
+  const int32_t inH = input.dims[1];
+  const int32_t inW = input.dims[2];
+  const bool color = input.dims[3] == 3;
+  const int32_t channels = color ? 3 : 1;
+  int8_t *dst = engine->inputData();
+
+  const uint8_t *pixels = fb->buf;
+  uint16_t width = fb->width;
+  uint16_t height = fb->height;
+  if (fb->format == PIXFORMAT_JPEG) {
+    if (!decodeJpeg(fb, pixels, width, height)) return false;
+  } else if (fb->format != PIXFORMAT_GRAYSCALE && fb->format != PIXFORMAT_YUV422) {
+    return false;
+  }
+  if (width == 0 || height == 0) return false;
+
+  // Excluded pixels read as black and are never sampled
+  const bool masked = inputMask.compiled() && !inputMask.full();
+  if (masked) memset(dst, quantize[0], (size_t)inH * inW * channels);
+  const ZoneSpan fullRow = {0, (uint16_t)inW};
+
+  const uint32_t stepX = ((uint32_t)width << 16) / inW;
+  const uint32_t stepY = ((uint32_t)height << 16) / inH;
+  for (int32_t y = 0; y < inH; y++) {
+    const uint32_t sy = (y * stepY) >> 16;
+    uint16_t spanCount = 1;
+    const ZoneSpan *spans = masked ? inputMask.rowSpans(y, spanCount) : &fullRow;
+    for (uint16_t s = 0; s < spanCount; s++) {
+      int8_t *out = dst + ((size_t)y * inW + spans[s].x0) * channels;
+      for (int32_t x = spans[s].x0; x < spans[s].x1; x++) {
+        const uint32_t sx = (x * stepX) >> 16;
+        uint8_t r, g, b;
+        if (fb->format == PIXFORMAT_GRAYSCALE) {
+          r = g = b = pixels[sy * width + sx];
+        } else if (fb->format == PIXFORMAT_YUV422) {
+          // YUYV: luma per pixel, chroma shared by each pixel pair
+          const uint8_t *pair = pixels + ((size_t)sy * width + (sx & ~1u)) * 2;
+          int32_t luma = pair[(sx & 1) * 2];
+          if (!color) {
+            *out++ = quantize[luma];
+            continue;
+          }
+          int32_t u = pair[1] - 128;
+          int32_t v = pair[3] - 128;
+          r = clampByte(luma + ((359 * v) >> 8));
+          g = clampByte(luma - ((88 * u + 183 * v) >> 8));
+          b = clampByte(luma + ((454 * u) >> 8));
+        } else {
+          // RGB565, high byte first
+          const uint8_t *p = pixels + ((size_t)sy * width + sx) * 2;
+          r = p[0] & 0xF8;
+          g = (uint8_t)(((p[0] & 0x07) << 5) | ((p[1] >> 3) & 0x1C));
+          b = (uint8_t)(p[1] << 3);
+        }
+        if (color) {
+          *out++ = quantize[r];
+          *out++ = quantize[g];
+          *out++ = quantize[b];
+        } else {
+          *out++ = quantize[(77 * r + 150 * g + 29 * b) >> 8];
+        }
+      }
+    }
+  }
+  return true;
+}
+
+uint8_t Detector::scorePercent(int8_t value) const {
+  const InferTensor &output = engine->output();
+  int32_t percent = (int32_t)lroundf((value - output.zeroPoint) * output.scale * 100.0f);
+  return percent < 0 ? 0 : (percent > 100 ? 100 : (uint8_t)percent);
+}
+
+uint8_t Detector::decodeOutput(Detection *out, uint8_t threshold) {
+  const InferTensor &output = engine->output();
+  const int8_t *scores = output.data;
+  const int32_t classes = output.dims[output.dimCount - 1];
+  uint8_t count = 0;
+
+  if (outputKind == DETECTOR_OUTPUT_CLASSES) {
+    for (int32_t c = 0; c < classes && c < 256; c++) {
+      uint8_t score = scorePercent(scores[c]);
+      if (score < threshold) continue;
+      // Keep the best DETECTOR_MAX_RESULTS, highest score first
+      int pos = count < DETECTOR_MAX_RESULTS ? count : DETECTOR_MAX_RESULTS - 1;
+      if (count == DETECTOR_MAX_RESULTS && out[pos].score >= score) continue;
+      while (pos > 0 && out[pos - 1].score < score) {
+        out[pos] = out[pos - 1];
+        pos--;
+      }
+      Detection d = {(uint8_t)c, score, 0, 0, frameWidth, frameHeight};
+      out[pos] = d;
+      if (count < DETECTOR_MAX_RESULTS) count++;
+    }
+    return count;
+  }
+
+  // Grid: best non-background class per cell, then 4-connected regions of
+  // the same class become one box
+  const int32_t gh = output.dims[1];
+  const int32_t gw = output.dims[2];
+  const int32_t firstClass = classes > 1 ? 1 : 0;
+  // Only cells inside the zones are decoded
+  const bool masked = gridMask.compiled() && !gridMask.full();
+  if (masked) memset(gridClass, 0, (size_t)gh * gw);
+  const ZoneSpan fullRow = {0, (uint16_t)gw};
+  for (int32_t y = 0; y < gh; y++) {
+    uint16_t spanCount = 1;
+    const ZoneSpan *spans = masked ? gridMask.rowSpans(y, spanCount) : &fullRow;
+    for (uint16_t s = 0; s < spanCount; s++) {
+      for (int32_t i = y * gw + spans[s].x0; i < y * gw + spans[s].x1; i++) {
+        const int8_t *cell = scores + (size_t)i * classes;
+        uint8_t best = 0;
+        uint8_t bestClass = 0;
+        for (int32_t c = firstClass; c < classes; c++) {
+          uint8_t score = scorePercent(cell[c]);
+          if (score >= threshold && score > best) {
+            best = score;
+            bestClass = (uint8_t)(c + 1);   // 0 marks an empty cell
+          }
+        }
+        gridClass[i] = bestClass;
+        gridScore[i] = best;
+      }
+    }
+  }
+
+  for (int32_t i = 0; i < gh * gw && count < DETECTOR_MAX_RESULTS; i++) {
+    uint8_t cls = gridClass[i];
+    if (cls == 0) continue;
+    int32_t minX = gw, minY = gh, maxX = -1, maxY = -1;
+    uint8_t best = 0;
+    int32_t top = 0;
+    gridStack[top++] = (uint16_t)i;
+    gridClass[i] = 0;
+    while (top > 0) {
+      int32_t cell = gridStack[--top];
+      int32_t cx = cell % gw;
+      int32_t cy = cell / gw;
+      if (cx < minX) minX = cx;
+      if (cx > maxX) maxX = cx;
+      if (cy < minY) minY = cy;
+      if (cy > maxY) maxY = cy;
+      if (gridScore[cell] > best) best = gridScore[cell];
+      const int32_t neighbours[4] = {cx > 0 ? cell - 1 : -1, cx < gw - 1 ? cell + 1 : -1,
+                                     cy > 0 ? cell - gw : -1, cy < gh - 1 ? cell + gw : -1};
+      for (int n = 0; n < 4; n++) {
+        if (neighbours[n] >= 0 && gridClass[neighbours[n]] == cls) {
+          gridClass[neighbours[n]] = 0;
+          gridStack[top++] = (uint16_t)neighbours[n];
+        }
+      }
+    }
+    Detection &d = out[count++];
+    d.classId = cls - 1;
+    d.score = best;
+    d.x = (uint16_t)(minX * frameWidth / gw);
+    d.y = (uint16_t)(minY * frameHeight / gh);
+    d.width = (uint16_t)((maxX + 1) * frameWidth / gw - d.x);
+    d.height = (uint16_t)((maxY + 1) * frameHeight / gh - d.y);
+    d.track = 0;
+  }
+  return count;
+}
+
+// Masks follow zone edits; tracks keep their ids but take the new zones
+// without crossing events
+void Detector::compileMasks() {
+  ZonePolygon zones[ZONE_MAX_ZONES];
+  uint32_t version;
+  uint8_t count = zoneMap.snapshot(zones, version);
+  const InferTensor &input = engine->input();
+  bool ok = inputMask.compile(zones, count, (uint16_t)input.dims[2], (uint16_t)input.dims[1]);
+  if (ok && outputKind == DETECTOR_OUTPUT_GRID) {
+    const InferTensor &output = engine->output();
+    ok = gridMask.compile(zones, count, (uint16_t)output.dims[2], (uint16_t)output.dims[1]);
+  }
+  if (!ok) {
+    // Out of memory: analyse the whole frame rather than nothing
+    inputMask.clear();
+    gridMask.clear();
+    LOGW(TAG_CAMERA, "Detector: no memory for zone masks");
+  }
+  for (uint8_t t = 0; t < trackCount; t++) {
+    tracks[t].zones = zoneMap.zonesAt(tracks[t].x, tracks[t].y, frameWidth, frameHeight);
+  }
+  maskVersion = version;
+}
+
+// Greedy nearest-centre matching within the same class, up to a box size
+// away; unmatched tracks end after DETECTOR_TRACK_MISSES frames
+void Detector::trackZones(Detection *found, uint8_t count) {
+  bool matched[DETECTOR_MAX_TRACKS] = {false};
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < count; i++) {
+    Detection &d = found[i];
+    int32_t cx = d.x + d.width / 2;
+    int32_t cy = d.y + d.height / 2;
+    int32_t reach = d.width > d.height ? d.width : d.height;
+    int best = -1;
+    int32_t bestDistance = reach * reach;
+    for (uint8_t t = 0; t < trackCount; t++) {
+      if (matched[t] || tracks[t].classId != d.classId) continue;
+      int32_t dx = cx - tracks[t].x;
+      int32_t dy = cy - tracks[t].y;
+      if (dx * dx + dy * dy <= bestDistance) {
+        bestDistance = dx * dx + dy * dy;
+        best = t;
+      }
+    }
+    bool created = best < 0;
+    if (created) {
+      if (trackCount == DETECTOR_MAX_TRACKS) {
+        d.track = 0;
+        continue;
+      }
+      best = trackCount++;
+      if (++nextTrackId == 0) nextTrackId = 1;
+      Track fresh = {nextTrackId, d.classId, 0, 0, 0, 0};
+      tracks[best] = fresh;
+    }
+    Track &track = tracks[best];
+    matched[best] = true;
+    track.x = (uint16_t)cx;
+    track.y = (uint16_t)cy;
+    track.missed = 0;
+    d.track = track.id;
+    if (created) {
+      logDetection(d);
+      mqttPublisher.publishTrack("start", track.id, track.classId, label(track.classId), NULL, eventLog.now());
+    }
+    updateZones(track, zoneMap.zonesAt(track.x, track.y, frameWidth, frameHeight), now);
+  }
+
+  for (uint8_t t = 0; t < trackCount;) {
+    if (matched[t] || ++tracks[t].missed <= DETECTOR_TRACK_MISSES) {
+      t++;
+      continue;
+    }
+    updateZones(tracks[t], 0, now);
+    mqttPublisher.publishTrack("end", tracks[t].id, tracks[t].classId, label(tracks[t].classId), NULL,
+                               eventLog.now());
+    trackCount--;
+    tracks[t] = tracks[trackCount];
+    matched[t] = matched[trackCount];
+  }
+}
+
+// One crossing event per zone the track entered or left
+void Detector::updateZones(Track &track, uint32_t zones, uint32_t now) {
+  uint32_t changed = track.zones ^ zones;
+  for (uint8_t z = 0; z < ZONE_MAX_ZONES && changed; z++) {
+    if (!(changed & (1u << z))) continue;
+    bool entered = (zones & (1u << z)) != 0;
+    ZoneEvent event = {now, track.id, z, track.classId, (uint8_t)(entered ? ZONE_EVENT_ENTER : ZONE_EVENT_EXIT)};
+    zoneMap.recordEvent(event);
+    EventZone logged = {track.id, z, track.classId, ""};
+    zoneMap.nameOf(z, logged.name);
+    eventLog.record(entered ? EVENT_ZONE_ENTER : EVENT_ZONE_EXIT, &logged, sizeof(logged));
+    mqttPublisher.publishTrack(entered ? "enter" : "exit", track.id, track.classId, label(track.classId),
+                               logged.name, eventLog.now());
+    changed &= ~(1u << z);
+  }
+  track.zones = zones;
+}
+
+void Detector::logDetection(const Detection &d) {
+  EventDetection logged = {d.classId, d.score, d.track, d.x, d.y, d.width, d.height};
+  eventLog.record(EVENT_DETECTION, &logged, sizeof(logged));
+  mqttPublisher.publishDetection(logged, label(d.classId), eventLog.now());
+}
+
+uint8_t Detector::latest(Detection *out, uint8_t maxResults, uint32_t &frameId) const {
+  portENTER_CRITICAL((portMUX_TYPE *)&lock);
+  uint8_t count = resultCount < maxResults ? resultCount : maxResults;
+  memcpy(out, results, sizeof(Detection) * count);
+  frameId = frameCounter;
+  portEXIT_CRITICAL((portMUX_TYPE *)&lock);
+  return count;
+}
+
+uint8_t Detector::latest(Detection *out, uint8_t maxResults, DetectionFrame &frame) const {
+  portENTER_CRITICAL((portMUX_TYPE *)&lock);
+  uint8_t count = resultCount < maxResults ? resultCount : maxResults;
+  memcpy(out, results, sizeof(Detection) * count);
+  frame.id = frameCounter;
+  frame.capturedUs = resultsCapturedUs;
+  frame.width = resultsWidth;
+  frame.height = resultsHeight;
+  portEXIT_CRITICAL((portMUX_TYPE *)&lock);
+  return count;
+}
+
+void Detector::reportStatus(JsonObject out, bool includeLayers, bool includePlan) const {
+  Detection found[DETECTOR_MAX_RESULTS];
+  uint32_t frameId;
+  uint8_t count = latest(found, DETECTOR_MAX_RESULTS, frameId);
+
+  out["enabled"] = config.modelEnabled;
+  out["state"] = STATE_NAMES[state];
+  if (state == DETECTOR_ERROR && lastError) out["error"] = lastError;
+  out["inferences"] = inferences;
+  out["failures"] = failures;
+  if (state != DETECTOR_RUNNING) return;
+
+  JsonObject model = out["model"].to<JsonObject>();
+  model["path"] = config.modelPath;
+  model["bytes"] = engine->modelBytes();
+  model["arena_bytes"] = engine->arenaSize(INFER_REGION_FAST) + engine->arenaSize(INFER_REGION_SLOW);
+  model["ops"] = engine->opCount();
+  JsonArray input = model["input"].to<JsonArray>();
+  for (uint8_t i = 0; i < engine->input().dimCount; i++) input.add(engine->input().dims[i]);
+  model["output"] = OUTPUT_NAMES[outputKind];
+  model["labels"] = labelCount;
+
+  JsonObject zones = out["zones"].to<JsonObject>();
+  zones["version"] = maskVersion;
+  if (inputMask.compiled()) {
+    zones["input_active_percent"] = inputMask.activePixels() * 100 / ((uint32_t)inputMask.width() * inputMask.height());
+  }
+  if (gridMask.compiled()) {
+    zones["grid_active_percent"] = gridMask.activePixels() * 100 / ((uint32_t)gridMask.width() * gridMask.height());
+  }
+  zones["tracks"] = trackCount;
+  zones["skipped_frames"] = skippedFrames;
+
+  JsonObject plan = model["plan"].to<JsonObject>();
+  plan["fast_budget"] = fastBudget;
+  plan["fast_bytes"] = engine->arenaSize(INFER_REGION_FAST);
+  plan["slow_bytes"] = engine->arenaSize(INFER_REGION_SLOW);
+  plan["unplanned_bytes"] = engine->unplannedArenaSize();
+  plan["page_bytes"] = pageBytes;
+  plan["paged_ops"] = engine->pagedOps();
+  pager.reportStatus(plan["weights"].to<JsonObject>());
+  if (includePlan) {
+    JsonArray tensors = plan["tensors"].to<JsonArray>();
+    for (uint16_t i = 0; i < engine->tensorTotal(); i++) {
+      const InferTensor &t = engine->tensor(i);
+      if (t.constant || t.arenaOffset == ARENA_UNPLACED) continue;
+      JsonObject entry = tensors.add<JsonObject>();
+      entry["index"] = i;
+      entry["bytes"] = t.bytes;
+      entry["region"] = REGION_NAMES[t.region];
+      entry["offset"] = t.arenaOffset;
+      entry["first"] = t.firstOp;
+      entry["last"] = t.lastOp;
+    }
+  }
+
+  out["frame"] = frameId;
+  out["age_ms"] = lastRunMs ? millis() - lastRunMs : 0;
+  out["frame_width"] = frameWidth;
+  out["frame_height"] = frameHeight;
+  out["preprocess_us"] = preprocessMicros;
+  out["invoke_us"] = engine->lastInvokeMicros();
+  out["avg_invoke_us"] = avgInvokeMicros;
+
+  JsonArray list = out["detections"].to<JsonArray>();
+  for (uint8_t i = 0; i < count; i++) {
+    JsonObject d = list.add<JsonObject>();
+    d["class"] = found[i].classId;
+    const char *name = label(found[i].classId);
+    if (name) d["label"] = name;
+    d["score"] = found[i].score;
+    d["x"] = found[i].x;
+    d["y"] = found[i].y;
+    d["w"] = found[i].width;
+    d["h"] = found[i].height;
+    if (found[i].track) d["track"] = found[i].track;
+  }
+
+  if (!includeLayers) return;
+  JsonArray layers = out["layers"].to<JsonArray>();
+  for (uint16_t i = 0; i < engine->opCount(); i++) {
+    const InferOp &op = engine->op(i);
+    JsonObject layer = layers.add<JsonObject>();
+    layer["op"] = InferenceEngine::opName(op.code);
+    layer["us"] = op.lastMicros;
+    layer["avg_us"] = op.avgMicros;
+    if (op.paged) layer["stall_us"] = op.stallMicros;
+  }
+}
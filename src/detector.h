@@ -0,0 +1,187 @@
+/**
+ * On-Device Object Detection
+ *
+ * Runs an int8 TFLite model (inference_engine.h) from the SD card on camera
+ * frames in a low-priority task. Frames are taken from the same camera
+ * pipeline as the streams: grayscale and YUV422 frames are read directly,
+ * JPEG frames are decoded at the smallest scale that still covers the model
+ * input. The frame is resized (nearest neighbour) to the model input and
+ * quantized through a lookup table built from the input tensor's scale.
+ *
+ * Two output layouts are understood:
+ * - [1, N] scores: image classification, one result per class above the
+ *   score threshold, covering the whole frame
+ * - [1, H, W, C] score grid (FOMO-style, class 0 = background): cells above
+ *   the threshold are merged per class into boxes in frame coordinates
+ *
+ * Memory: activations are planned (arena_planner.h) so the most heavily
+ * read ones sit in internal SRAM, up to detection.fast_ram_kb, and the rest
+ * in PSRAM. Conv / FC weights are paged into two SRAM buffers just ahead of
+ * use by weight_pager.h. A model too large for PSRAM (or with
+ * weight_source "sd") keeps only its metadata in memory and streams the
+ * weights from the SD card every inference.
+ *
+ * Zones (zones.h) are compiled into masks at the model input and output
+ * grid resolutions: excluded input pixels are not sampled, excluded grid
+ * cells are not decoded, and a frame with no active pixel is not captured
+ * or run at all. The layers in between still run over the whole tensor;
+ * zones save the sampling and decoding, not the convolutions. Grid detections are tracked from frame to frame, and a
+ * track's centre entering or leaving a zone is recorded as a crossing event.
+ *
+ * Results, model information, the memory plan and per-layer timing are
+ * served at /api/detections.
+ */
+
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "esp_camera.h"
+#include "config_store.h"
+#include "inference_engine.h"
+#include "weight_pager.h"
+#include "zones.h"
+
+#define DETECTOR_MAX_RESULTS     16
+#define DETECTOR_MAX_LABELS      16
+#define DETECTOR_LABEL_LEN       24
+#define DETECTOR_MAX_MODEL_BYTES (3 * 1024 * 1024)
+#define DETECTOR_PREFIX_BYTES    (32 * 1024)    // first model read in SD mode, doubled as needed
+#define DETECTOR_SRAM_RESERVE    (48 * 1024)    // internal RAM left for WiFi and the web server
+#define DETECTOR_STACK_SIZE      6144
+#define DETECTOR_IDLE_MS         1000   // poll interval while disabled or paused
+#define DETECTOR_MAX_TRACKS      16
+#define DETECTOR_TRACK_MISSES    3      // frames a track survives unmatched
+
+enum DetectorState : uint8_t {
+  DETECTOR_DISABLED = 0,
+  DETECTOR_LOADING,
+  DETECTOR_RUNNING,
+  DETECTOR_ERROR
+};
+
+enum DetectorOutput : uint8_t {
+  DETECTOR_OUTPUT_CLASSES = 0,
+  DETECTOR_OUTPUT_GRID
+};
+
+struct Detection {
+  uint8_t classId;
+  uint8_t score;          // percent
+  uint16_t x;             // box in frame pixels
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint16_t track;         // grid outputs: track id, 0 = untracked
+};
+
+// The frame the latest results came from
+struct DetectionFrame {
+  uint32_t id;            // changes with every inference
+  int64_t capturedUs;     // esp_timer_get_time() when the detector got the frame
+  uint16_t width;
+  uint16_t height;
+};
+
+class Detector {
+public:
+  Detector();
+
+  // Allocates the engine and starts the task; the model loads in the task
+  bool begin(const DetectionSettings &settings);
+
+  // New settings; the model is reloaded on the task
+  void configure(const DetectionSettings &settings);
+
+  // Copies the latest results; returns their count. frameId changes with
+  // every inference, so callers can tell new results from old ones.
+  uint8_t latest(Detection *out, uint8_t maxResults, uint32_t &frameId) const;
+  // ... with the frame's capture time and size (pan/tilt latency compensation)
+  uint8_t latest(Detection *out, uint8_t maxResults, DetectionFrame &frame) const;
+  const char *label(uint8_t classId) const;
+
+  void reportStatus(JsonObject out, bool includeLayers, bool includePlan) const;
+
+private:
+  struct Track {
+    uint16_t id;
+    uint8_t classId;
+    uint8_t missed;
+    uint16_t x;             // centre in frame pixels
+    uint16_t y;
+    uint32_t zones;         // zones the centre is in
+  };
+
+  InferenceEngine *engine;
+  WeightPager pager;
+  TaskHandle_t task;
+  portMUX_TYPE lock;
+
+  DetectionSettings config;
+  volatile bool reloadRequested;
+  DetectorState state;
+  const char *lastError;
+
+  uint8_t *modelBuffer;      // whole model, or its metadata prefix in SD mode
+  uint8_t *fastArena;        // internal SRAM
+  uint8_t *slowArena;        // PSRAM
+  uint8_t *pageBuffers[2];
+  size_t pageBytes;
+  size_t fastBudget;
+  uint8_t *decodeBuffer;     // RGB565 frame for JPEG input
+  size_t decodeCapacity;
+  uint8_t *gridClass;        // per grid cell: best class (0 = none)
+  uint8_t *gridScore;
+  uint16_t *gridStack;
+  int8_t quantize[256];      // 8-bit pixel -> input tensor value
+  DetectorOutput outputKind;
+
+  ZoneMask inputMask;        // at the model input resolution
+  ZoneMask gridMask;         // at the output grid resolution
+  uint32_t maskVersion;      // zoneMap.version() the masks were built from
+  uint32_t skippedFrames;    // every pixel excluded
+  Track tracks[DETECTOR_MAX_TRACKS];
+  uint8_t trackCount;
+  uint16_t nextTrackId;
+  uint8_t loggedClass;       // classifiers: top class last written to the event log
+
+  char labels[DETECTOR_MAX_LABELS][DETECTOR_LABEL_LEN];
+  uint8_t labelCount;
+
+  Detection results[DETECTOR_MAX_RESULTS];
+  uint8_t resultCount;
+  uint32_t frameCounter;
+  int64_t resultsCapturedUs;
+  uint16_t resultsWidth;
+  uint16_t resultsHeight;
+  uint32_t inferences;
+  uint32_t failures;
+  uint32_t lastRunMs;
+  uint32_t preprocessMicros;
+  uint32_t avgInvokeMicros;  // EWMA
+  uint16_t frameWidth;
+  uint16_t frameHeight;
+
+  static void detectTaskEntry(void *param);
+  void run();
+  bool loadModel();
+  bool loadPrefix(size_t size);
+  bool planMemory(uint16_t fastRamKb);
+  void unloadModel();
+  void loadLabels(const char *path);
+  void buildQuantizeTable(uint8_t inputRange);
+  bool prepareInput(const camera_fb_t *fb);
+  bool decodeJpeg(const camera_fb_t *fb, const uint8_t *&pixels, uint16_t &width, uint16_t &height);
+  uint8_t decodeOutput(Detection *out, uint8_t threshold);
+  void compileMasks();
+  void trackZones(Detection *found, uint8_t count);
+  void updateZones(Track &track, uint32_t zones, uint32_t now);
+  void logDetection(const Detection &d);
+  uint8_t scorePercent(int8_t value) const;
+  void fail(const char *message);
+};
+
+extern Detector detector;
+
+#endif // DETECTOR_H
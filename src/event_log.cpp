@@ -0,0 +1,291 @@
+/**
+ * Persistent Event Log Implementation
+ */
+
+#include "event_log.h"
+#include "logger.h"
+#include <SD_MMC.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <sys/time.h>
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+EventLog eventLog;
+
+// Indexed by EventType
+static const char *EVENT_TYPE_NAMES[] = {"", "boot", "detection", "zone_enter", "zone_exit", "ota", "error"};
+
+EventLog::EventLog()
+  : queue(NULL), writerTask(NULL), running(false), timeBase(0), maxKb(4096), retentionDays(0), queueDrops(0),
+    segmentCount(0), logBytes(0), firstTime(0) {
+}
+
+bool EventLog::begin(bool sdReady, const StorageSettings &settings) {
+  if (!sdReady) return false;
+  configure(settings);
+  queue = xQueueCreate(EVENT_LOG_QUEUE_LEN, sizeof(QueuedEvent));
+  if (!queue) {
+    LOGW(TAG_SD, "Event log: no memory for queue");
+    return false;
+  }
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    LOGW(TAG_SD, "Event log: SD card busy");
+    return false;
+  }
+  if (!SD_MMC.exists(EVENT_LOG_DIR)) SD_MMC.mkdir(EVENT_LOG_DIR);
+  bool opened = store.begin(this, EVENT_LOG_MAX_SEGMENTS);
+  if (opened) trim();
+  xSemaphoreGive(sdCardMutex);
+  if (!opened) {
+    LOGW(TAG_SD, "Event log: no memory for the segment table");
+    return false;
+  }
+
+  // Until the clock is set, times continue from the newest event
+  timeBase = store.lastTime() + 1;
+  const EventStoreStats &stats = store.stats();
+  if (stats.tornTails) LOGW(TAG_SD, "Event log: torn write found, continuing in a new segment");
+  if (stats.removedSegments) LOGW(TAG_SD, "Event log: removed %u unreadable segments", stats.removedSegments);
+  LOGI(TAG_SD, "Event log: %u segments, next sequence %u", store.segmentCount(), store.nextSequence());
+
+  if (xTaskCreatePinnedToCore(writerTaskEntry, "events", EVENT_LOG_STACK_SIZE, this, 1, &writerTask, 0) != pdPASS) {
+    LOGW(TAG_SD, "Event log: failed to start task");
+    return false;
+  }
+  running = true;
+  logger.setErrorSink(logError, this);
+
+  EventBoot boot = {(uint8_t)esp_reset_reason()};
+  record(EVENT_BOOT, &boot, sizeof(boot));
+  return true;
+}
+
+void EventLog::configure(const StorageSettings &settings) {
+  maxKb = settings.eventLogKb;
+  retentionDays = settings.eventRetentionDays;
+}
+
+uint64_t EventLog::now() const {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec > EVENT_LOG_EPOCH_VALID) {
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+  return timeBase + (uint64_t)(esp_timer_get_time() / 1000);
+}
+
+bool EventLog::record(EventType type, const void *payload, uint8_t length) {
+  if (!running || length > EVENT_MAX_PAYLOAD) return false;
+  QueuedEvent event;
+  event.timeMs = now();
+  event.type = type;
+  event.length = length;
+  memcpy(event.payload, payload, length);
+  if (xQueueSend(queue, &event, 0) != pdTRUE) {
+    queueDrops++;
+    return false;
+  }
+  // OTA and boot events are written right away (a reboot may follow); a
+  // filling queue is written early
+  if (type == EVENT_OTA || type == EVENT_BOOT || uxQueueMessagesWaiting(queue) >= EVENT_LOG_QUEUE_LEN / 2) {
+    xTaskNotifyGive(writerTask);
+  }
+  return true;
+}
+
+bool EventLog::recordText(EventType type, uint8_t code, const char *text) {
+  uint8_t payload[EVENT_MAX_PAYLOAD];
+  payload[0] = code;
+  size_t len = strnlen(text, EVENT_MAX_PAYLOAD - 1);
+  memcpy(payload + 1, text, len);
+  return record(type, payload, (uint8_t)(len + 1));
+}
+
+void EventLog::logError(void *ctx, uint8_t tag, const char *message) {
+  ((EventLog *)ctx)->recordText(EVENT_ERROR, tag, message);
+}
+
+void EventLog::writerTaskEntry(void *param) {
+  ((EventLog *)param)->run();
+}
+
+void EventLog::run() {
+  QueuedEvent first;
+  for (;;) {
+    // Wait for an event, then give others the flush interval to join it
+    if (xQueuePeek(queue, &first, portMAX_DELAY) != pdTRUE) continue;
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(EVENT_LOG_FLUSH_MS));
+    writePending();
+  }
+}
+
+// Events stay queued while the card is busy
+void EventLog::writePending() {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+  QueuedEvent event;
+  while (xQueueReceive(queue, &event, 0) == pdTRUE) {
+    store.append(event.type, event.timeMs, event.payload, event.length);
+  }
+  if (!store.flush()) {
+    // Not LOGE: error events would feed back into the log
+    LOGW(TAG_SD, "Event log: append failed (%u records dropped so far)", store.stats().dropped);
+  }
+  trim();
+  xSemaphoreGive(sdCardMutex);
+}
+
+// Caller holds sdCardMutex
+void EventLog::trim() {
+  uint64_t cutoff = 0;
+  uint64_t age = (uint64_t)retentionDays * 86400000ull;
+  uint64_t current = now();
+  if (age && current > age) cutoff = current - age;
+  store.trim((uint64_t)maxKb * 1024, cutoff);
+  segmentCount = store.segmentCount();
+  logBytes = (uint32_t)store.totalBytes();
+  firstTime = store.firstTime();
+}
+
+void EventLog::query(EventCursor &cursor, uint64_t fromMs, uint64_t toMs, uint32_t types) {
+  store.query(cursor, fromMs, toMs, types);
+}
+
+bool EventLog::next(EventCursor &cursor, EventRecord &record) {
+  return store.next(cursor, record);
+}
+
+bool EventLog::parseTypes(const String &list, uint32_t &types) {
+  types = 0;
+  int start = 0;
+  while (start < (int)list.length()) {
+    int comma = list.indexOf(',', start);
+    if (comma < 0) comma = list.length();
+    String name = list.substring(start, comma);
+    name.trim();
+    int type = 1;
+    while (type < EVENT_TYPE_COUNT && name != EVENT_TYPE_NAMES[type]) type++;
+    if (type == EVENT_TYPE_COUNT) return false;
+    types |= 1u << type;
+    start = comma + 1;
+  }
+  return true;
+}
+
+void EventLog::writeJson(JsonObject out, const EventRecord &record) {
+  out["seq"] = record.sequence;
+  out["t"] = record.timeMs;
+  out["type"] = record.type < EVENT_TYPE_COUNT ? EVENT_TYPE_NAMES[record.type] : "unknown";
+  const uint8_t *p = record.payload;
+  switch (record.type) {
+    case EVENT_BOOT:
+      if (record.length >= sizeof(EventBoot)) out["reset_reason"] = p[0];
+      break;
+    case EVENT_DETECTION:
+      if (record.length >= sizeof(EventDetection)) {
+        EventDetection d;
+        memcpy(&d, p, sizeof(d));
+        out["class"] = d.classId;
+        out["score"] = d.score;
+        if (d.track) out["track"] = d.track;
+        JsonArray box = out["box"].to<JsonArray>();
+        box.add(d.x);
+        box.add(d.y);
+        box.add(d.width);
+        box.add(d.height);
+      }
+      break;
+    case EVENT_ZONE_ENTER:
+    case EVENT_ZONE_EXIT:
+      if (record.length >= sizeof(EventZone)) {
+        EventZone z;
+        memcpy(&z, p, sizeof(z));
+        z.name[ZONE_NAME_LEN - 1] = '\0';
+        out["track"] = z.track;
+        out["zone"] = z.name;
+        out["class"] = z.classId;
+      }
+      break;
+    case EVENT_OTA:
+    case EVENT_ERROR:
+      if (record.length >= 1) {
+        char text[EVENT_MAX_PAYLOAD];
+        memcpy(text, p + 1, record.length - 1);
+        text[record.length - 1] = '\0';
+        if (record.type == EVENT_OTA) out["ok"] = p[0] != 0;
+        else out["tag"] = Logger::tagName(p[0]);
+        out["message"] = text;
+      }
+      break;
+  }
+}
+
+void EventLog::reportStatus(JsonObject out) const {
+  out["running"] = running;
+  if (!running) return;
+  const EventStoreStats &stats = store.stats();
+  out["segments"] = segmentCount;
+  out["bytes"] = logBytes;
+  out["limit_kb"] = maxKb;
+  out["retention_days"] = retentionDays;
+  out["first_time"] = firstTime;
+  out["now"] = now();
+  out["next_seq"] = store.nextSequence();
+  out["appended"] = stats.appended;
+  out["dropped"] = stats.dropped + queueDrops;
+  out["write_errors"] = stats.writeErrors;
+  out["torn_tails"] = stats.tornTails;
+  out["expired_segments"] = stats.expiredSegments;
+}
+
+// ---------------------------------------------------------------------------
+// EventStorage (caller holds sdCardMutex)
+
+String EventLog::segmentPath(uint32_t segment) {
+  char name[32];
+  snprintf(name, sizeof(name), EVENT_LOG_DIR "/%08lu.evl", (unsigned long)segment);
+  return String(name);
+}
+
+void EventLog::list(void (*found)(void *ctx, uint32_t segment), void *ctx) {
+  File dir = SD_MMC.open(EVENT_LOG_DIR);
+  if (!dir || !dir.isDirectory()) return;
+  File file = dir.openNextFile();
+  while (file) {
+    const char *name = file.name();
+    char *end = NULL;
+    unsigned long number = strtoul(name, &end, 10);
+    if (!file.isDirectory() && end != name && strcmp(end, ".evl") == 0) found(ctx, (uint32_t)number);
+    file = dir.openNextFile();
+  }
+}
+
+uint32_t EventLog::size(uint32_t segment) {
+  File file = SD_MMC.open(segmentPath(segment), FILE_READ);
+  if (!file) return 0;
+  uint32_t bytes = file.size();
+  file.close();
+  return bytes;
+}
+
+size_t EventLog::read(uint32_t segment, uint32_t offset, uint8_t *dst, size_t len) {
+  File file = SD_MMC.open(segmentPath(segment), FILE_READ);
+  if (!file) return 0;
+  size_t got = file.seek(offset) ? file.read(dst, len) : 0;
+  file.close();
+  return got;
+}
+
+size_t EventLog::append(uint32_t segment, const uint8_t *data, size_t len) {
+  File file = SD_MMC.open(segmentPath(segment), FILE_APPEND);
+  if (!file) return 0;
+  size_t written = file.write(data, len);
+  file.close();
+  return written;
+}
+
+bool EventLog::remove(uint32_t segment) {
+  return SD_MMC.remove(segmentPath(segment));
+}
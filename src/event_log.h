@@ -0,0 +1,135 @@
+/**
+ * Persistent Event Log
+ *
+ * Boot, detection, zone-crossing, OTA and error events kept on the SD card
+ * in the append-only event store (event_store.h), one segment file per
+ * 64 KB under /events. record() may be called from any task: events are
+ * queued to a writer task that appends them in batches, every
+ * EVENT_LOG_FLUSH_MS or as soon as an OTA or boot event arrives, and then
+ * applies retention (storage.event_log_kb, storage.event_retention_days).
+ *
+ * Event times are ms since the epoch once the system clock is set. Until
+ * then they continue from the newest event on the card, so they keep
+ * increasing across reboots (without counting time powered off).
+ *
+ * All store calls, including queries from the web server, are made while
+ * holding sdCardMutex.
+ */
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config_store.h"
+#include "event_store.h"
+#include "zones.h"
+
+#define EVENT_LOG_DIR            "/events"
+#define EVENT_LOG_QUEUE_LEN      32
+#define EVENT_LOG_FLUSH_MS       2000
+#define EVENT_LOG_STACK_SIZE     4096
+#define EVENT_LOG_MAX_SEGMENTS   512          // storage.event_log_kb up to 32 MB
+#define EVENT_LOG_EPOCH_VALID    1700000000   // clock counts as set after 2023-11
+
+enum EventType : uint8_t {
+  EVENT_BOOT = 1,
+  EVENT_DETECTION,
+  EVENT_ZONE_ENTER,
+  EVENT_ZONE_EXIT,
+  EVENT_OTA,
+  EVENT_ERROR,
+  EVENT_TYPE_COUNT
+};
+
+struct EventBoot {
+  uint8_t resetReason;        // esp_reset_reason_t
+};
+
+// A new track (grid models) or a new top class (classifiers)
+struct EventDetection {
+  uint8_t classId;
+  uint8_t score;
+  uint16_t track;
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+};
+
+struct EventZone {
+  uint16_t track;
+  uint8_t zone;
+  uint8_t classId;
+  char name[ZONE_NAME_LEN];
+};
+
+// OTA and error events carry a code byte and text (see recordText)
+
+class EventLog : public EventStorage {
+public:
+  EventLog();
+
+  // Opens the log and starts the writer task
+  bool begin(bool sdReady, const StorageSettings &settings);
+  // Retention limits
+  void configure(const StorageSettings &settings);
+
+  // Queues one event; false when the log is not running or the queue is full
+  bool record(EventType type, const void *payload, uint8_t length);
+  // code, then the first EVENT_MAX_PAYLOAD - 1 characters of text
+  bool recordText(EventType type, uint8_t code, const char *text);
+
+  // Current event time
+  uint64_t now() const;
+  bool ready() const { return running; }
+
+  // Range queries; caller holds sdCardMutex
+  void query(EventCursor &cursor, uint64_t fromMs, uint64_t toMs, uint32_t types);
+  bool next(EventCursor &cursor, EventRecord &record);
+
+  // Comma-separated type names to a type mask; false on an unknown name
+  static bool parseTypes(const String &list, uint32_t &types);
+  static void writeJson(JsonObject out, const EventRecord &record);
+  void reportStatus(JsonObject out) const;
+
+  // EventStorage: segment files under EVENT_LOG_DIR
+  void list(void (*found)(void *ctx, uint32_t segment), void *ctx) override;
+  uint32_t size(uint32_t segment) override;
+  size_t read(uint32_t segment, uint32_t offset, uint8_t *dst, size_t len) override;
+  size_t append(uint32_t segment, const uint8_t *data, size_t len) override;
+  bool remove(uint32_t segment) override;
+
+private:
+  struct QueuedEvent {
+    uint64_t timeMs;
+    uint8_t type;
+    uint8_t length;
+    uint8_t payload[EVENT_MAX_PAYLOAD];
+  };
+
+  EventStore store;
+  QueueHandle_t queue;
+  TaskHandle_t writerTask;
+  volatile bool running;
+  uint64_t timeBase;          // added to uptime until the clock is set
+  volatile uint32_t maxKb;
+  volatile uint16_t retentionDays;
+  volatile uint32_t queueDrops;
+
+  // Refreshed after every write, for reportStatus()
+  volatile uint16_t segmentCount;
+  volatile uint32_t logBytes;
+  uint64_t firstTime;
+
+  static void logError(void *ctx, uint8_t tag, const char *message);
+  static void writerTaskEntry(void *param);
+  void run();
+  void writePending();
+  void trim();
+  static String segmentPath(uint32_t segment);
+};
+
+extern EventLog eventLog;
+
+#endif // EVENT_LOG_H
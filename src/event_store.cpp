@@ -0,0 +1,443 @@
+/**
+ * Append-Only Event Store Implementation
+ */
+
+#include "event_store.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum RecordStatus {
+  RECORD_OK = 0,
+  RECORD_END,
+  RECORD_BAD
+};
+
+static const uint32_t CRC_TABLE[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+// Nibble-wide table: records are a few dozen bytes
+uint32_t eventCrc32(uint32_t crc, const uint8_t *data, size_t len) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = CRC_TABLE[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = CRC_TABLE[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t get32(const uint8_t *p) { return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static uint64_t get64(const uint8_t *p) { return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32); }
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+static void put64(uint8_t *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t blockEnd(uint32_t offset) {
+  return (offset / EVENT_BLOCK_SIZE + 1) * EVENT_BLOCK_SIZE;
+}
+
+// Record CRC: header without the CRC field, then the payload
+static uint32_t recordCrc(const uint8_t *record, uint8_t length) {
+  uint32_t crc = eventCrc32(0, record, 16);
+  return eventCrc32(crc, record + EVENT_HEADER_SIZE, length);
+}
+
+EventStore::EventStore()
+  : storage(NULL), segments(NULL), segmentTotal(0), segmentCapacity(0),
+    pending(NULL), pendingLen(0), pendingRecords(0), pendingNewSegment(false), pendingFirstSequence(0),
+    pendingFirstTime(0), writeOpen(false), writeSegment(0), writeOffset(0), sequence(0), latestTime(0) {
+  memset(&counters, 0, sizeof(counters));
+}
+
+EventStore::~EventStore() {
+  end();
+}
+
+void EventStore::end() {
+  free(segments);
+  free(pending);
+  segments = NULL;
+  pending = NULL;
+  storage = NULL;
+  segmentTotal = 0;
+  segmentCapacity = 0;
+  pendingLen = 0;
+  pendingRecords = 0;
+  pendingNewSegment = false;
+  writeOpen = false;
+  writeSegment = 0;
+  writeOffset = 0;
+  sequence = 0;
+  latestTime = 0;
+}
+
+bool EventStore::begin(EventStorage *source, uint16_t maxSegments) {
+  end();
+  memset(&counters, 0, sizeof(counters));
+  if (!source || maxSegments < 2) return false;
+  segments = (EventSegment *)malloc(sizeof(EventSegment) * maxSegments);
+  pending = (uint8_t *)malloc(EVENT_WRITE_BUFFER);
+  EventCursor *scan = (EventCursor *)malloc(sizeof(EventCursor));
+  if (!segments || !pending || !scan) {
+    free(scan);
+    end();
+    return false;
+  }
+  storage = source;
+  segmentCapacity = maxSegments;
+  storage->list(foundSegment, this);
+
+  // Segments without a readable header and first record have nothing to
+  // index (a reset during their first write)
+  uint16_t kept = 0;
+  for (uint16_t i = 0; i < segmentTotal; i++) {
+    EventSegment segment = segments[i];
+    segment.size = storage->size(segment.number);
+    scan->bufferLen = 0;
+    if (readSegmentHead(*scan, segment)) {
+      segments[kept++] = segment;
+    } else {
+      storage->remove(segment.number);
+      counters.removedSegments++;
+    }
+  }
+  segmentTotal = kept;
+  if (segmentTotal) recover(*scan, segments[segmentTotal - 1]);
+  free(scan);
+  return true;
+}
+
+// Keeps the table sorted, and only the newest segments when there are
+// more than it holds
+void EventStore::foundSegment(void *ctx, uint32_t number) {
+  EventStore *self = (EventStore *)ctx;
+  if (number > self->writeSegment) self->writeSegment = number;
+  if (self->segmentTotal == self->segmentCapacity) {
+    if (number < self->segments[0].number) return;
+    memmove(self->segments, self->segments + 1, sizeof(EventSegment) * (self->segmentTotal - 1));
+    self->segmentTotal--;
+  }
+  uint16_t i = self->segmentTotal++;
+  while (i > 0 && self->segments[i - 1].number > number) {
+    self->segments[i] = self->segments[i - 1];
+    i--;
+  }
+  memset(&self->segments[i], 0, sizeof(EventSegment));
+  self->segments[i].number = number;
+}
+
+bool EventStore::readSegmentHead(EventCursor &cursor, EventSegment &segment) {
+  if (!fill(cursor, segment.number, 0, EVENT_SEGMENT_HEADER_SIZE, segment.size)) return false;
+  const uint8_t *h = cursor.buffer;
+  if (get32(h) != EVENT_SEGMENT_MAGIC || get16(h + 4) != EVENT_FORMAT_VERSION ||
+      get32(h + 8) != segment.number || get32(h + 12) != eventCrc32(0, h, 12)) {
+    return false;
+  }
+  uint32_t offset = EVENT_SEGMENT_HEADER_SIZE;
+  EventRecord first;
+  if (readRecord(cursor, segment.number, segment.size, offset, first) != RECORD_OK) return false;
+  segment.firstSequence = first.sequence;
+  segment.firstTime = first.timeMs;
+  return true;
+}
+
+// Checks every record of the newest segment. Appending continues there
+// only when it ends exactly after its last good record.
+void EventStore::recover(EventCursor &cursor, const EventSegment &segment) {
+  uint32_t offset = EVENT_SEGMENT_HEADER_SIZE;
+  uint32_t validEnd = offset;
+  EventRecord record;
+  int status;
+  while ((status = readRecord(cursor, segment.number, segment.size, offset, record)) == RECORD_OK) {
+    validEnd = offset;
+    latestTime = record.timeMs;
+    sequence = record.sequence + 1;
+  }
+  writeSegment = segment.number;
+  writeOffset = segment.size;
+  writeOpen = status == RECORD_END && validEnd == segment.size;
+  if (!writeOpen) counters.tornTails++;
+}
+
+bool EventStore::fill(EventCursor &cursor, uint32_t segment, uint32_t offset, size_t len, uint32_t limit) {
+  if (cursor.bufferLen && cursor.bufferSegment == segment && offset >= cursor.bufferOffset &&
+      offset + len <= cursor.bufferOffset + cursor.bufferLen) {
+    return true;
+  }
+  if (offset + len > limit) return false;
+  size_t want = limit - offset;
+  if (want > EVENT_READ_BUFFER) want = EVENT_READ_BUFFER;
+  size_t got = storage->read(segment, offset, cursor.buffer, want);
+  cursor.bufferSegment = segment;
+  cursor.bufferOffset = offset;
+  cursor.bufferLen = (uint16_t)got;
+  return got >= len;
+}
+
+// Reads the record at offset (skipping block padding) and moves offset past
+// it. On RECORD_BAD offset is left at the damaged record.
+int EventStore::readRecord(EventCursor &cursor, uint32_t segment, uint32_t segmentSize, uint32_t &offset,
+                           EventRecord &record) {
+  for (;;) {
+    if (offset >= segmentSize) return RECORD_END;
+    uint32_t end = blockEnd(offset);
+    if (end - offset < EVENT_HEADER_SIZE) {
+      offset = end;
+      continue;
+    }
+    uint32_t limit = end < segmentSize ? end : segmentSize;
+    if (!fill(cursor, segment, offset, EVENT_HEADER_SIZE, limit)) return RECORD_BAD;
+    const uint8_t *h = cursor.buffer + (offset - cursor.bufferOffset);
+    uint16_t magic = get16(h);
+    if (magic == 0) {
+      offset = end;
+      continue;
+    }
+    uint8_t length = h[3];
+    if (magic != EVENT_RECORD_MAGIC || length > EVENT_MAX_PAYLOAD) return RECORD_BAD;
+    if (!fill(cursor, segment, offset, EVENT_HEADER_SIZE + length, limit)) return RECORD_BAD;
+    h = cursor.buffer + (offset - cursor.bufferOffset);
+    if (get32(h + 16) != recordCrc(h, length)) return RECORD_BAD;
+
+    record.type = h[2];
+    record.length = length;
+    record.sequence = get32(h + 4);
+    record.timeMs = get64(h + 8);
+    memcpy(record.payload, h + EVENT_HEADER_SIZE, length);
+    offset += EVENT_HEADER_SIZE + length;
+    return RECORD_OK;
+  }
+}
+
+bool EventStore::startSegment() {
+  // The buffer belongs to the previous segment
+  if (pendingLen && !flush()) return false;
+  writeSegment++;
+  uint8_t *h = pending;
+  put32(h, EVENT_SEGMENT_MAGIC);
+  put16(h + 4, EVENT_FORMAT_VERSION);
+  put16(h + 6, 0);
+  put32(h + 8, writeSegment);
+  put32(h + 12, eventCrc32(0, h, 12));
+  pendingLen = EVENT_SEGMENT_HEADER_SIZE;
+  pendingNewSegment = true;
+  writeOffset = EVENT_SEGMENT_HEADER_SIZE;
+  writeOpen = true;
+  return true;
+}
+
+bool EventStore::append(uint8_t type, uint64_t timeMs, const void *payload, uint8_t length) {
+  if (!pending || length > EVENT_MAX_PAYLOAD || (length && !payload)) {
+    counters.dropped++;
+    return false;
+  }
+  if (timeMs < latestTime) timeMs = latestTime;
+
+  // Records never straddle a block: pad to the next one, or start a new
+  // segment when this one is full
+  uint32_t recordLen = EVENT_HEADER_SIZE + length;
+  uint32_t pad = 0;
+  if (writeOpen && blockEnd(writeOffset) - writeOffset < recordLen) {
+    pad = blockEnd(writeOffset) - writeOffset;
+    if (writeOffset + pad + recordLen > EVENT_SEGMENT_SIZE) writeOpen = false;
+  }
+  if (!writeOpen) {
+    if (!startSegment()) {
+      counters.dropped++;
+      return false;
+    }
+    pad = 0;
+  }
+  if (pendingLen + pad + recordLen > EVENT_WRITE_BUFFER && (!flush() || !writeOpen)) {
+    counters.dropped++;
+    return false;
+  }
+
+  memset(pending + pendingLen, 0, pad);
+  pendingLen += pad;
+  if (pendingNewSegment && pendingLen == EVENT_SEGMENT_HEADER_SIZE) {
+    pendingFirstSequence = sequence;
+    pendingFirstTime = timeMs;
+  }
+  uint8_t *r = pending + pendingLen;
+  put16(r, EVENT_RECORD_MAGIC);
+  r[2] = type;
+  r[3] = length;
+  put32(r + 4, sequence);
+  put64(r + 8, timeMs);
+  if (length) memcpy(r + EVENT_HEADER_SIZE, payload, length);  // payload may be NULL when empty
+  put32(r + 16, recordCrc(r, length));
+
+  pendingLen += recordLen;
+  pendingRecords++;
+  writeOffset += pad + recordLen;
+  sequence++;
+  latestTime = timeMs;
+  counters.appended++;
+  return true;
+}
+
+bool EventStore::flush() {
+  if (!pendingLen) return true;
+  size_t written = storage->append(writeSegment, pending, pendingLen);
+  if (written == 0) {
+    counters.writeErrors++;
+    return false;   // nothing reached the card: kept for the next flush
+  }
+
+  if (pendingNewSegment) {
+    if (segmentTotal == segmentCapacity) removeOldest();
+    EventSegment &segment = segments[segmentTotal++];
+    segment.number = writeSegment;
+    segment.size = written;
+    segment.firstSequence = pendingFirstSequence;
+    segment.firstTime = pendingFirstTime;
+    pendingNewSegment = false;
+  } else {
+    segments[segmentTotal - 1].size += written;
+  }
+
+  bool complete = written == pendingLen;
+  if (!complete) {
+    // Torn: never append after the damaged bytes
+    counters.writeErrors++;
+    counters.dropped += pendingRecords;
+    writeOpen = false;
+  }
+  pendingLen = 0;
+  pendingRecords = 0;
+  return complete;
+}
+
+void EventStore::removeOldest() {
+  storage->remove(segments[0].number);
+  segmentTotal--;
+  memmove(segments, segments + 1, sizeof(EventSegment) * segmentTotal);
+  counters.expiredSegments++;
+}
+
+uint16_t EventStore::trim(uint64_t maxBytes, uint64_t cutoffMs) {
+  uint16_t removed = 0;
+  while (segmentTotal > 1) {
+    bool overSize = maxBytes && totalBytes() > maxBytes;
+    // Every record of segment 0 is at or before segment 1's first record
+    bool expired = cutoffMs && segments[1].firstTime < cutoffMs;
+    if (!overSize && !expired) break;
+    removeOldest();
+    removed++;
+  }
+  return removed;
+}
+
+uint64_t EventStore::totalBytes() const {
+  uint64_t total = 0;
+  for (uint16_t i = 0; i < segmentTotal; i++) total += segments[i].size;
+  return total;
+}
+
+// Index of a segment number, or with after set of the first segment past it
+int EventStore::findSegment(uint32_t number, bool after) const {
+  int lo = 0;
+  int hi = segmentTotal;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (segments[mid].number < number || (after && segments[mid].number == number)) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == segmentTotal) return -1;
+  if (!after && segments[lo].number != number) return -1;
+  return lo;
+}
+
+void EventStore::query(EventCursor &cursor, uint64_t fromMs, uint64_t toMs, uint32_t types) {
+  cursor.fromMs = fromMs;
+  cursor.toMs = toMs;
+  cursor.types = types;
+  cursor.bufferLen = 0;
+  cursor.done = !segmentTotal || fromMs > toMs;
+  if (cursor.done) return;
+
+  // Records at fromMs can start in the segment before the first one that
+  // begins at or after it
+  int lo = 0;
+  int hi = segmentTotal;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (segments[mid].firstTime < fromMs) lo = mid + 1;
+    else hi = mid;
+  }
+  const EventSegment &segment = segments[lo > 0 ? lo - 1 : 0];
+  cursor.segment = segment.number;
+  cursor.offset = EVENT_SEGMENT_HEADER_SIZE;
+
+  // Same within the segment, by the first record of each block. A block
+  // whose head does not read counts as late, so the scan may start early
+  // but never too late.
+  uint32_t blocks = (segment.size + EVENT_BLOCK_SIZE - 1) / EVENT_BLOCK_SIZE;
+  lo = 1;
+  hi = blocks;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    uint32_t offset = (uint32_t)mid * EVENT_BLOCK_SIZE;
+    EventRecord head;
+    if (readRecord(cursor, segment.number, segment.size, offset, head) == RECORD_OK && head.timeMs < fromMs) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo > 1) cursor.offset = (uint32_t)(lo - 1) * EVENT_BLOCK_SIZE;
+}
+
+bool EventStore::next(EventCursor &cursor, EventRecord &record) {
+  uint16_t scanned = 0;
+  while (!cursor.done) {
+    if (scanned++ == EVENT_SCAN_BUDGET) return false;
+    int index = findSegment(cursor.segment, false);
+    if (index < 0) {
+      // Deleted by retention since the last call
+      index = findSegment(cursor.segment, true);
+      if (index < 0) {
+        cursor.done = true;
+        break;
+      }
+      cursor.segment = segments[index].number;
+      cursor.offset = EVENT_SEGMENT_HEADER_SIZE;
+    }
+
+    int status = readRecord(cursor, cursor.segment, segments[index].size, cursor.offset, record);
+    if (status == RECORD_BAD) {
+      cursor.offset = blockEnd(cursor.offset);
+      continue;
+    }
+    if (status == RECORD_END) {
+      if (index + 1 >= segmentTotal) {
+        cursor.done = true;
+        break;
+      }
+      cursor.segment = segments[index + 1].number;
+      cursor.offset = EVENT_SEGMENT_HEADER_SIZE;
+      continue;
+    }
+    if (record.timeMs < cursor.fromMs) continue;
+    if (record.timeMs > cursor.toMs) {
+      cursor.done = true;
+      break;
+    }
+    if (cursor.types && (record.type >= 32 || !(cursor.types & (1u << record.type)))) continue;
+    return true;
+  }
+  return false;
+}
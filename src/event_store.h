@@ -0,0 +1,173 @@
+/**
+ * Append-Only Event Store
+ *
+ * Events are small binary records appended to numbered segment files and
+ * never rewritten. A segment starts with a 16-byte header and is divided
+ * into 4 KB blocks; a record never straddles a block (the block tail is
+ * zero-padded instead), so the first record of every block is found
+ * without scanning from the segment start. Record times never decrease,
+ * which makes those block heads a sparse time index: a range query binary
+ * searches the segment table (kept in RAM), then the blocks of one segment,
+ * and scans forward from there.
+ *
+ * Record layout (little endian):
+ *   0  magic     u16  EVENT_RECORD_MAGIC (0 = block padding)
+ *   2  type      u8
+ *   3  length    u8   payload bytes
+ *   4  sequence  u32
+ *   8  time      u64  ms
+ *   16 crc       u32  CRC-32 of bytes 0..15 and the payload
+ *   20 payload
+ *
+ * Writes are batched in RAM and appended in one call. A write cut short by
+ * a reset leaves a torn tail; begin() finds it by checking every record of
+ * the last segment and continues in a new segment, so nothing is appended
+ * after damaged bytes. Readers stop at the first bad record of a block and
+ * carry on at the next block.
+ *
+ * Files are reached through EventStorage, so the store runs (and is
+ * checked) on a host. Not thread safe: the caller serializes all calls.
+ */
+
+#ifndef EVENT_STORE_H
+#define EVENT_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EVENT_SEGMENT_SIZE        (64 * 1024)
+#define EVENT_BLOCK_SIZE          4096
+#define EVENT_SEGMENT_HEADER_SIZE 16
+#define EVENT_HEADER_SIZE         20
+#define EVENT_MAX_PAYLOAD         44
+#define EVENT_RECORD_MAGIC        0x5645        // "EV"
+#define EVENT_SEGMENT_MAGIC       0x474C5645u   // "EVLG"
+#define EVENT_FORMAT_VERSION      1
+#define EVENT_WRITE_BUFFER        2048
+#define EVENT_READ_BUFFER         512
+#define EVENT_SCAN_BUDGET         256           // records examined per next() call
+#define EVENT_TIME_MAX            0xFFFFFFFFFFFFFFFFull
+
+struct EventRecord {
+  uint8_t type;
+  uint8_t length;
+  uint32_t sequence;
+  uint64_t timeMs;
+  uint8_t payload[EVENT_MAX_PAYLOAD];
+};
+
+// Segment files, addressed by number
+class EventStorage {
+public:
+  virtual ~EventStorage() {}
+  // Calls found() once per segment, in any order
+  virtual void list(void (*found)(void *ctx, uint32_t segment), void *ctx) = 0;
+  virtual uint32_t size(uint32_t segment) = 0;
+  virtual size_t read(uint32_t segment, uint32_t offset, uint8_t *dst, size_t len) = 0;
+  // Appends to the end of a segment, creating it when missing; returns the
+  // bytes written (0 = nothing written, try again later)
+  virtual size_t append(uint32_t segment, const uint8_t *data, size_t len) = 0;
+  virtual bool remove(uint32_t segment) = 0;
+};
+
+struct EventSegment {
+  uint32_t number;
+  uint32_t size;
+  uint32_t firstSequence;
+  uint64_t firstTime;
+};
+
+// Read position of a range query
+struct EventCursor {
+  uint64_t fromMs;
+  uint64_t toMs;
+  uint32_t types;             // bit per record type, 0 = all
+  uint32_t segment;
+  uint32_t offset;
+  bool done;
+  uint32_t bufferSegment;
+  uint32_t bufferOffset;
+  uint16_t bufferLen;
+  uint8_t buffer[EVENT_READ_BUFFER];
+};
+
+struct EventStoreStats {
+  uint32_t appended;          // records since begin()
+  uint32_t dropped;           // records lost to full buffers or failed writes
+  uint32_t writeErrors;
+  uint32_t tornTails;         // segments closed early at a damaged tail
+  uint32_t removedSegments;   // unreadable segments deleted by begin()
+  uint32_t expiredSegments;   // segments deleted by retention
+};
+
+class EventStore {
+public:
+  EventStore();
+  ~EventStore();
+
+  // Loads the segment table (the newest maxSegments segments) and recovers
+  // the write position; false when out of memory
+  bool begin(EventStorage *storage, uint16_t maxSegments);
+  void end();
+
+  // Buffers one record (appending the buffer first when it is full).
+  // timeMs is raised to the previous record's time when it is older.
+  bool append(uint8_t type, uint64_t timeMs, const void *payload, uint8_t length);
+  // Appends the buffered records to the current segment
+  bool flush();
+  size_t pendingBytes() const { return pendingLen; }
+
+  // Deletes the oldest segments while the log is over maxBytes, or while a
+  // whole segment is older than cutoffMs (0 = no age limit). The segment
+  // being written is kept. Returns the segments deleted.
+  uint16_t trim(uint64_t maxBytes, uint64_t cutoffMs);
+
+  // Starts a query for records with fromMs <= time <= toMs whose type bit
+  // is set in types (0 = every type)
+  void query(EventCursor &cursor, uint64_t fromMs, uint64_t toMs, uint32_t types);
+  // Next matching record. false with cursor.done unset means the scan
+  // budget ran out: call again.
+  bool next(EventCursor &cursor, EventRecord &record);
+
+  uint16_t segmentCount() const { return segmentTotal; }
+  uint64_t totalBytes() const;
+  uint64_t firstTime() const { return segmentTotal ? segments[0].firstTime : 0; }
+  uint64_t lastTime() const { return latestTime; }
+  uint32_t nextSequence() const { return sequence; }
+  const EventStoreStats &stats() const { return counters; }
+
+private:
+  EventStorage *storage;
+  EventSegment *segments;     // ascending by number (and time)
+  uint16_t segmentTotal;
+  uint16_t segmentCapacity;
+
+  uint8_t *pending;
+  size_t pendingLen;
+  uint16_t pendingRecords;
+  bool pendingNewSegment;     // pending starts with a segment header
+  uint32_t pendingFirstSequence;
+  uint64_t pendingFirstTime;
+  bool writeOpen;             // writeSegment accepts appends
+  uint32_t writeSegment;
+  uint32_t writeOffset;       // segment size once pending is written
+
+  uint32_t sequence;
+  uint64_t latestTime;
+  EventStoreStats counters;
+
+  static void foundSegment(void *ctx, uint32_t number);
+  bool readSegmentHead(EventCursor &cursor, EventSegment &segment);
+  void recover(EventCursor &cursor, const EventSegment &segment);
+  bool startSegment();
+  void removeOldest();
+  int findSegment(uint32_t number, bool after) const;
+  bool fill(EventCursor &cursor, uint32_t segment, uint32_t offset, size_t len, uint32_t limit);
+  int readRecord(EventCursor &cursor, uint32_t segment, uint32_t segmentSize, uint32_t &offset,
+                 EventRecord &record);
+};
+
+// CRC-32 (IEEE, as zlib)
+uint32_t eventCrc32(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif // EVENT_STORE_H
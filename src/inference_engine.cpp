@@ -0,0 +1,929 @@
+/**
+ * Int8 Inference Engine Implementation
+ */
+
+#include "inference_engine.h"
+#include <stdlib.h>
+#include <string.h>
+
+// TFLite BuiltinOperator codes
+#define OP_ADD                0
+#define OP_AVERAGE_POOL_2D    1
+#define OP_CONV_2D            3
+#define OP_DEPTHWISE_CONV_2D  4
+#define OP_FULLY_CONNECTED    9
+#define OP_LOGISTIC           14
+#define OP_MAX_POOL_2D        17
+#define OP_RESHAPE            22
+#define OP_SOFTMAX            25
+#define OP_PAD                34
+#define OP_QUANTIZE           114
+
+#define MAX_OPCODES           64
+#define UNUSED_OP             (-2)
+
+// ---------------------------------------------------------------------------
+// Minimal bounds-checked flatbuffer reader (tables, vectors, scalars)
+
+struct FlatBuffer {
+  const uint8_t *buf;
+  size_t len;                 // resident bytes
+  size_t total;               // model bytes
+  bool *truncated;            // set when a read falls past the resident prefix
+
+  bool in(size_t pos, size_t n) const {
+    if (pos <= len && n <= len - pos) return true;
+    if (pos <= total && n <= total - pos) *truncated = true;
+    return false;
+  }
+  uint8_t u8(size_t pos) const { return buf[pos]; }
+  uint16_t u16(size_t pos) const { return (uint16_t)(buf[pos] | (buf[pos + 1] << 8)); }
+  uint32_t u32(size_t pos) const {
+    uint32_t v;
+    memcpy(&v, buf + pos, 4);
+    return v;
+  }
+};
+
+struct FbTable {
+  size_t pos;
+  size_t vtable;
+  uint16_t vtableSize;
+};
+
+static bool fbTableAt(const FlatBuffer &fb, size_t pos, FbTable &table) {
+  if (!fb.in(pos, 4)) return false;
+  int64_t vtable = (int64_t)pos - (int32_t)fb.u32(pos);
+  if (vtable < 0 || !fb.in((size_t)vtable, 4)) return false;
+  table.pos = pos;
+  table.vtable = (size_t)vtable;
+  table.vtableSize = fb.u16(table.vtable);
+  return table.vtableSize >= 4 && fb.in(table.vtable, table.vtableSize);
+}
+
+// Absolute position of field index, or 0 when absent
+static size_t fbField(const FlatBuffer &fb, const FbTable &table, int index, size_t size) {
+  size_t entry = 4 + 2 * (size_t)index;
+  if (entry + 2 > table.vtableSize) return 0;
+  uint16_t offset = fb.u16(table.vtable + entry);
+  if (offset == 0 || !fb.in(table.pos + offset, size)) return 0;
+  return table.pos + offset;
+}
+
+static int32_t fbInt(const FlatBuffer &fb, const FbTable &table, int index, size_t size, int32_t def) {
+  size_t pos = fbField(fb, table, index, size);
+  if (!pos) return def;
+  if (size == 1) return (int8_t)fb.u8(pos);
+  return (int32_t)fb.u32(pos);
+}
+
+static float fbFloat(const FlatBuffer &fb, const FbTable &table, int index, float def) {
+  size_t pos = fbField(fb, table, index, 4);
+  if (!pos) return def;
+  float v;
+  memcpy(&v, fb.buf + pos, 4);
+  return v;
+}
+
+static bool fbRef(const FlatBuffer &fb, size_t fieldPos, size_t &target) {
+  if (!fieldPos) return false;
+  target = fieldPos + fb.u32(fieldPos);
+  return fb.in(target, 4);
+}
+
+static bool fbSubTable(const FlatBuffer &fb, const FbTable &table, int index, FbTable &out) {
+  size_t target;
+  return fbRef(fb, fbField(fb, table, index, 4), target) && fbTableAt(fb, target, out);
+}
+
+// Vector field: position of the first element and element count
+static bool fbVector(const FlatBuffer &fb, const FbTable &table, int index, size_t elemSize,
+                     size_t &elems, uint32_t &count) {
+  size_t target;
+  count = 0;
+  if (!fbRef(fb, fbField(fb, table, index, 4), target)) return false;
+  count = fb.u32(target);
+  elems = target + 4;
+  return fb.in(elems, (size_t)count * elemSize);
+}
+
+static bool fbVectorTable(const FlatBuffer &fb, size_t elems, uint32_t i, FbTable &out) {
+  size_t target;
+  return fbRef(fb, elems + 4 * (size_t)i, target) && fbTableAt(fb, target, out);
+}
+
+// ---------------------------------------------------------------------------
+
+static Int8Shape shapeOf(const InferTensor &t) {
+  Int8Shape s = {1, 1, 1};
+  if (t.dimCount == 4) {
+    s.h = t.dims[1];
+    s.w = t.dims[2];
+    s.c = t.dims[3];
+  } else if (t.dimCount == 3) {
+    s.h = t.dims[0];
+    s.w = t.dims[1];
+    s.c = t.dims[2];
+  } else if (t.dimCount >= 1) {
+    s.c = t.dims[t.dimCount - 1];
+  }
+  return s;
+}
+
+static size_t elementCount(const InferTensor &t) {
+  size_t n = 1;
+  for (uint8_t i = 0; i < t.dimCount; i++) n *= (size_t)t.dims[i];
+  return n;
+}
+
+static inline size_t alignArena(size_t bytes) {
+  return (bytes + INFER_ARENA_ALIGN - 1) & ~(size_t)(INFER_ARENA_ALIGN - 1);
+}
+
+// Multiply-accumulates (or element reads) of one op, to rank tensors by how
+// often their bytes are read
+static float opWork(const InferOp &op, const Int8Shape &in, const Int8Shape &out, size_t outElements) {
+  switch (op.code) {
+    case OP_CONV_2D:
+      return (float)out.h * out.w * out.c * op.filterH * op.filterW * in.c;
+    case OP_DEPTHWISE_CONV_2D:
+    case OP_AVERAGE_POOL_2D:
+    case OP_MAX_POOL_2D:
+      return (float)out.h * out.w * out.c * op.filterH * op.filterW;
+    case OP_FULLY_CONNECTED:
+      return (float)in.h * in.w * in.c * out.c;
+    default:
+      return (float)outElements;
+  }
+}
+
+static int32_t computePadding(int32_t in, int32_t out, int32_t filter, int32_t stride, int32_t dilation) {
+  int32_t effective = (filter - 1) * dilation + 1;
+  int32_t pad = ((out - 1) * stride + effective - in) / 2;
+  return pad > 0 ? pad : 0;
+}
+
+static int32_t expectedOutput(int32_t in, int32_t filter, int32_t stride, int32_t dilation, uint8_t padding) {
+  int32_t effective = (filter - 1) * dilation + 1;
+  return padding == 0 ? (in + stride - 1) / stride : (in - effective + stride) / stride;
+}
+
+const char *InferenceEngine::opName(int32_t code) {
+  switch (code) {
+    case OP_ADD: return "ADD";
+    case OP_AVERAGE_POOL_2D: return "AVERAGE_POOL_2D";
+    case OP_CONV_2D: return "CONV_2D";
+    case OP_DEPTHWISE_CONV_2D: return "DEPTHWISE_CONV_2D";
+    case OP_FULLY_CONNECTED: return "FULLY_CONNECTED";
+    case OP_LOGISTIC: return "LOGISTIC";
+    case OP_MAX_POOL_2D: return "MAX_POOL_2D";
+    case OP_RESHAPE: return "RESHAPE";
+    case OP_SOFTMAX: return "SOFTMAX";
+    case OP_PAD: return "PAD";
+    case OP_QUANTIZE: return "QUANTIZE";
+    default: return "UNSUPPORTED";
+  }
+}
+
+InferenceEngine::InferenceEngine()
+  : ready(false), arenaSet(false), truncated(false), errorMessage(NULL), modelLen(0), residentBytes(0),
+    weightSource(NULL), tensorCount(0), opTotal(0), inputIndex(-1), outputIndex(-1), constants(NULL),
+    unplannedBytes(0), invokeMicros(0), weightBytesMax(0), externalWeightBytesMax(0), pagedCount(0),
+    firstPaged(-1), pendingOp(-1), pendingBuffer(0) {
+  arenaBytes[INFER_REGION_FAST] = 0;
+  arenaBytes[INFER_REGION_SLOW] = 0;
+  pageBuffers[0] = NULL;
+  pageBuffers[1] = NULL;
+  pageOp[0] = -1;
+  pageOp[1] = -1;
+}
+
+InferenceEngine::~InferenceEngine() {
+  unload();
+}
+
+bool InferenceEngine::fail(const char *message) {
+  errorMessage = message;
+  return false;
+}
+
+void InferenceEngine::unload() {
+  finishRead();
+  free(constants);
+  constants = NULL;
+  ready = false;
+  arenaSet = false;
+  tensorCount = 0;
+  opTotal = 0;
+  arenaBytes[INFER_REGION_FAST] = 0;
+  arenaBytes[INFER_REGION_SLOW] = 0;
+  unplannedBytes = 0;
+  modelLen = 0;
+  weightSource = NULL;
+  weightBytesMax = 0;
+  externalWeightBytesMax = 0;
+  pagedCount = 0;
+  firstPaged = -1;
+  pageOp[0] = -1;
+  pageOp[1] = -1;
+  pageBuffers[0] = NULL;
+  pageBuffers[1] = NULL;
+}
+
+bool InferenceEngine::load(const uint8_t *model, size_t residentLen, size_t totalLen, InferWeightSource *source) {
+  unload();
+  errorMessage = NULL;
+  truncated = false;
+  residentBytes = residentLen;
+  modelLen = totalLen > residentLen ? totalLen : residentLen;
+  weightSource = source;
+  if (!parse(model, residentLen) || !prepare()) {
+    unload();
+    return false;
+  }
+  ready = true;
+  return true;
+}
+
+// Model bytes of a constant: in place when resident, else read into scratch
+// (caller frees it)
+const uint8_t *InferenceEngine::constantData(const InferTensor &tensor, uint8_t *&scratch) {
+  scratch = NULL;
+  if (tensor.constData) return tensor.constData;
+  if (!weightSource) return NULL;
+  scratch = (uint8_t *)malloc(tensor.bytes);
+  if (scratch && weightSource->beginRead(tensor.modelOffset, scratch, tensor.bytes) && weightSource->waitRead()) {
+    return scratch;
+  }
+  free(scratch);
+  scratch = NULL;
+  return NULL;
+}
+
+float InferenceEngine::channelScale(const InferTensor &tensor, uint32_t channel) const {
+  if (tensor.channelCount <= 1 || tensor.channelScales == NULL) return tensor.scale;
+  float v;
+  memcpy(&v, tensor.channelScales + 4 * (size_t)(channel < tensor.channelCount ? channel : 0), 4);
+  return v;
+}
+
+bool InferenceEngine::parse(const uint8_t *model, size_t len) {
+  FlatBuffer fb = {model, len, modelLen, &truncated};
+  FbTable root;
+  if (len < 8 || !fbTableAt(fb, fb.u32(0), root)) return fail("Not a flatbuffer");
+  if (fbInt(fb, root, 0, 4, 0) != 3) return fail("Unsupported TFLite schema version");
+
+  // Operator codes: the effective code is the larger of the two fields
+  size_t codeElems;
+  uint32_t codeCount;
+  if (!fbVector(fb, root, 1, 4, codeElems, codeCount) || codeCount > MAX_OPCODES) return fail("Bad operator codes");
+  int32_t codes[MAX_OPCODES];
+  for (uint32_t i = 0; i < codeCount; i++) {
+    FbTable code;
+    if (!fbVectorTable(fb, codeElems, i, code)) return fail("Bad operator code");
+    int32_t deprecated = fbInt(fb, code, 0, 1, 0);
+    int32_t builtin = fbInt(fb, code, 3, 4, 0);
+    codes[i] = builtin > deprecated ? builtin : deprecated;
+  }
+
+  size_t bufferElems;
+  uint32_t bufferCount;
+  if (!fbVector(fb, root, 4, 4, bufferElems, bufferCount)) return fail("Missing buffers");
+
+  size_t graphElems;
+  uint32_t graphCount;
+  FbTable graph;
+  if (!fbVector(fb, root, 2, 4, graphElems, graphCount) || graphCount < 1 ||
+      !fbVectorTable(fb, graphElems, 0, graph)) {
+    return fail("Missing subgraph");
+  }
+
+  // Tensors
+  size_t tensorElems;
+  uint32_t count;
+  if (!fbVector(fb, graph, 0, 4, tensorElems, count)) return fail("Missing tensors");
+  if (count > INFER_MAX_TENSORS) return fail("Too many tensors");
+  tensorCount = (uint16_t)count;
+  for (uint16_t i = 0; i < tensorCount; i++) {
+    InferTensor &t = tensors[i];
+    memset(&t, 0, sizeof(t));
+    FbTable tt;
+    if (!fbVectorTable(fb, tensorElems, i, tt)) return fail("Bad tensor");
+
+    size_t shapeElems;
+    uint32_t dimCount;
+    if (fbVector(fb, tt, 0, 4, shapeElems, dimCount)) {
+      if (dimCount > 4) return fail("Tensor rank above 4");
+      t.dimCount = (uint8_t)dimCount;
+      for (uint32_t d = 0; d < dimCount; d++) t.dims[d] = (int32_t)fb.u32(shapeElems + 4 * d);
+    }
+    t.type = (uint8_t)fbInt(fb, tt, 1, 1, 0);
+    size_t typeSize = t.type == INFER_TYPE_INT8 ? 1 : 4;
+    t.bytes = elementCount(t) * typeSize;
+
+    // Buffer data may lie past the resident prefix: only its length is read
+    uint32_t buffer = (uint32_t)fbInt(fb, tt, 2, 4, 0);
+    FbTable bt;
+    size_t dataField;
+    if (buffer > 0 && buffer < bufferCount && fbVectorTable(fb, bufferElems, buffer, bt) &&
+        (dataField = fbField(fb, bt, 0, 4)) != 0) {
+      size_t vector = dataField + fb.u32(dataField);
+      uint32_t dataLen = 0;
+      if (vector + 4 <= len) {
+        dataLen = fb.u32(vector);
+      } else if (vector + 4 > modelLen || !weightSource || !weightSource->beginRead(vector, (uint8_t *)&dataLen, 4) ||
+                 !weightSource->waitRead()) {
+        return fail("Buffer outside the model");
+      }
+      if (dataLen) {
+        if (dataLen < t.bytes || vector + 4 + (size_t)dataLen > modelLen) return fail("Truncated tensor buffer");
+        t.constant = true;
+        t.modelOffset = (uint32_t)(vector + 4);
+        if (vector + 4 + (size_t)dataLen <= len) t.constData = model + vector + 4;
+      }
+    }
+
+    FbTable qt;
+    if (fbSubTable(fb, tt, 4, qt)) {
+      size_t scaleElems, zeroElems;
+      uint32_t scaleCount, zeroCount;
+      if (fbVector(fb, qt, 2, 4, scaleElems, scaleCount) && scaleCount) {
+        memcpy(&t.scale, model + scaleElems, 4);
+        t.channelScales = model + scaleElems;
+        t.channelCount = scaleCount;
+      }
+      if (fbVector(fb, qt, 3, 8, zeroElems, zeroCount) && zeroCount) {
+        t.zeroPoint = (int32_t)fb.u32(zeroElems);  // int64, low word
+      }
+    }
+  }
+
+  // Graph input and output
+  size_t ioElems;
+  uint32_t ioCount;
+  if (!fbVector(fb, graph, 1, 4, ioElems, ioCount) || ioCount != 1) return fail("Model must have one input");
+  inputIndex = (int16_t)fb.u32(ioElems);
+  if (!fbVector(fb, graph, 2, 4, ioElems, ioCount) || ioCount < 1) return fail("Model has no output");
+  outputIndex = (int16_t)fb.u32(ioElems);
+  if (inputIndex < 0 || inputIndex >= tensorCount || outputIndex < 0 || outputIndex >= tensorCount) {
+    return fail("Bad input/output tensor");
+  }
+
+  // Operators
+  size_t opElems;
+  if (!fbVector(fb, graph, 3, 4, opElems, count)) return fail("Missing operators");
+  if (count > INFER_MAX_OPS) return fail("Too many operators");
+  opTotal = (uint16_t)count;
+  for (uint16_t i = 0; i < opTotal; i++) {
+    InferOp &op = ops[i];
+    memset(&op, 0, sizeof(op));
+    FbTable ot;
+    if (!fbVectorTable(fb, opElems, i, ot)) return fail("Bad operator");
+    uint32_t codeIndex = (uint32_t)fbInt(fb, ot, 0, 4, 0);
+    if (codeIndex >= codeCount) return fail("Bad opcode index");
+    op.code = codes[codeIndex];
+
+    size_t inElems, outElems;
+    uint32_t inCount, outCount;
+    if (!fbVector(fb, ot, 1, 4, inElems, inCount) || inCount < 1) return fail("Operator without inputs");
+    if (!fbVector(fb, ot, 2, 4, outElems, outCount) || outCount != 1) return fail("Operator must have one output");
+    op.inputCount = (uint8_t)(inCount < INFER_MAX_INPUTS ? inCount : INFER_MAX_INPUTS);
+    for (uint8_t k = 0; k < op.inputCount; k++) {
+      int32_t index = (int32_t)fb.u32(inElems + 4 * k);
+      if (index >= tensorCount) return fail("Bad operator input");
+      op.inputs[k] = (int16_t)index;   // -1: optional input left out
+    }
+    int32_t output = (int32_t)fb.u32(outElems);
+    if (output < 0 || output >= tensorCount) return fail("Bad operator output");
+    op.output = (int16_t)output;
+
+    // Options (layout depends on the operator)
+    op.strideW = op.strideH = op.dilationW = op.dilationH = op.depthMultiplier = 1;
+    op.beta = 1.0f;
+    FbTable opt;
+    if (!fbSubTable(fb, ot, 4, opt)) continue;
+    switch (op.code) {
+      case OP_CONV_2D:
+        op.padding = (uint8_t)fbInt(fb, opt, 0, 1, 0);
+        op.strideW = fbInt(fb, opt, 1, 4, 1);
+        op.strideH = fbInt(fb, opt, 2, 4, 1);
+        op.activation = (uint8_t)fbInt(fb, opt, 3, 1, 0);
+        op.dilationW = fbInt(fb, opt, 4, 4, 1);
+        op.dilationH = fbInt(fb, opt, 5, 4, 1);
+        break;
+      case OP_DEPTHWISE_CONV_2D:
+        op.padding = (uint8_t)fbInt(fb, opt, 0, 1, 0);
+        op.strideW = fbInt(fb, opt, 1, 4, 1);
+        op.strideH = fbInt(fb, opt, 2, 4, 1);
+        op.depthMultiplier = fbInt(fb, opt, 3, 4, 1);
+        op.activation = (uint8_t)fbInt(fb, opt, 4, 1, 0);
+        op.dilationW = fbInt(fb, opt, 5, 4, 1);
+        op.dilationH = fbInt(fb, opt, 6, 4, 1);
+        break;
+      case OP_AVERAGE_POOL_2D:
+      case OP_MAX_POOL_2D:
+        op.padding = (uint8_t)fbInt(fb, opt, 0, 1, 0);
+        op.strideW = fbInt(fb, opt, 1, 4, 1);
+        op.strideH = fbInt(fb, opt, 2, 4, 1);
+        op.filterW = fbInt(fb, opt, 3, 4, 1);
+        op.filterH = fbInt(fb, opt, 4, 4, 1);
+        op.activation = (uint8_t)fbInt(fb, opt, 5, 1, 0);
+        break;
+      case OP_FULLY_CONNECTED:
+      case OP_ADD:
+        op.activation = (uint8_t)fbInt(fb, opt, 0, 1, 0);
+        break;
+      case OP_SOFTMAX:
+        op.beta = fbFloat(fb, opt, 0, 1.0f);
+        break;
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+bool InferenceEngine::prepare() {
+  const InferTensor &in = tensors[inputIndex];
+  const InferTensor &out = tensors[outputIndex];
+  if (in.type != INFER_TYPE_INT8 || out.type != INFER_TYPE_INT8) return fail("Model input and output must be int8");
+
+  // Size the constant pool, then fill it
+  size_t words = 0;
+  int32_t *pool = NULL;
+  for (uint16_t i = 0; i < opTotal; i++) {
+    if (!prepareOp(ops[i], pool, true, words)) return false;
+  }
+  constants = (int32_t *)malloc(words * sizeof(int32_t) + 4);
+  if (constants == NULL) return fail("Out of memory for layer constants");
+  pool = constants;
+  for (uint16_t i = 0; i < opTotal; i++) {
+    if (!prepareOp(ops[i], pool, false, words)) return false;
+  }
+
+  // Activation lifetimes: from the op that writes a tensor to the last op
+  // that reads it; the graph input is live before op 0, the output after
+  // the last op
+  for (uint16_t i = 0; i < tensorCount; i++) {
+    tensors[i].firstOp = UNUSED_OP;
+    tensors[i].lastOp = UNUSED_OP;
+    tensors[i].arenaOffset = ARENA_UNPLACED;
+  }
+  tensors[inputIndex].firstOp = -1;
+  tensors[inputIndex].lastOp = -1;
+  for (uint16_t i = 0; i < opTotal; i++) {
+    const InferOp &op = ops[i];
+    for (uint8_t k = 0; k < op.inputCount; k++) {
+      if (op.inputs[k] < 0 || tensors[op.inputs[k]].constant) continue;
+      InferTensor &t = tensors[op.inputs[k]];
+      if (t.firstOp == UNUSED_OP) return fail("Operator reads a tensor before it is written");
+      t.lastOp = i;
+    }
+    InferTensor &o = tensors[op.output];
+    if (o.firstOp != UNUSED_OP) return fail("Tensor written twice");
+    o.firstOp = i;
+    o.lastOp = i;
+  }
+  tensors[outputIndex].lastOp = opTotal;
+
+  unplannedBytes = 0;
+  for (uint16_t i = 0; i < tensorCount; i++) {
+    if (tensors[i].firstOp != UNUSED_OP) unplannedBytes += alignArena(tensors[i].bytes);
+  }
+  return plan(0);
+}
+
+// Hot tensors (most reads per byte) go to the fast region first, then the
+// chosen set is repacked largest-first, which usually lowers its peak; the
+// rest is packed largest-first into the slow region
+bool InferenceEngine::plan(size_t fastBudget) {
+  ArenaBuffer *buffers = (ArenaBuffer *)malloc(sizeof(ArenaBuffer) * tensorCount);
+  uint16_t *order = (uint16_t *)malloc(sizeof(uint16_t) * tensorCount);
+  float *heat = (float *)malloc(sizeof(float) * tensorCount);
+  if (!buffers || !order || !heat) {
+    free(buffers);
+    free(order);
+    free(heat);
+    return fail("Out of memory for the arena plan");
+  }
+
+  for (uint16_t i = 0; i < tensorCount; i++) {
+    const InferTensor &t = tensors[i];
+    ArenaBuffer b = {t.firstOp == UNUSED_OP ? 0 : (uint32_t)alignArena(t.bytes), t.firstOp, t.lastOp,
+                     ARENA_UNPLACED, INFER_REGION_SLOW};
+    buffers[i] = b;
+    heat[i] = 1.0f;
+  }
+
+  if (fastBudget > 0) {
+    for (uint16_t i = 0; i < opTotal; i++) {
+      const InferOp &op = ops[i];
+      const InferTensor &out = tensors[op.output];
+      float work = opWork(op, shapeOf(tensors[op.inputs[0]]), shapeOf(out), elementCount(out));
+      for (uint8_t k = 0; k < op.inputCount; k++) {
+        if (op.inputs[k] >= 0 && buffers[op.inputs[k]].size) heat[op.inputs[k]] += work / buffers[op.inputs[k]].size;
+      }
+    }
+    for (uint16_t i = 0; i < tensorCount; i++) order[i] = i;
+    for (uint16_t i = 1; i < tensorCount; i++) {
+      uint16_t index = order[i];
+      uint16_t j = i;
+      while (j > 0 && heat[order[j - 1]] < heat[index]) {
+        order[j] = order[j - 1];
+        j--;
+      }
+      order[j] = index;
+    }
+    arenaPlace(buffers, tensorCount, order, tensorCount, INFER_REGION_FAST, fastBudget, INFER_ARENA_ALIGN);
+
+    // Repack the chosen set; keep the first placement if that does not fit
+    uint32_t firstPeak = arenaPeak(buffers, tensorCount, INFER_REGION_FAST);
+    int32_t *saved = (int32_t *)heat;   // heat is no longer needed
+    uint16_t chosen = 0;
+    arenaOrderBySize(buffers, order, tensorCount);
+    for (uint16_t i = 0; i < tensorCount; i++) {
+      saved[i] = buffers[i].offset;
+      if (buffers[order[i]].offset != ARENA_UNPLACED) order[chosen++] = order[i];
+    }
+    for (uint16_t i = 0; i < chosen; i++) buffers[order[i]].offset = ARENA_UNPLACED;
+    if (arenaPlace(buffers, tensorCount, order, chosen, INFER_REGION_FAST, fastBudget, INFER_ARENA_ALIGN) != chosen ||
+        arenaPeak(buffers, tensorCount, INFER_REGION_FAST) > firstPeak) {
+      for (uint16_t i = 0; i < tensorCount; i++) buffers[i].offset = saved[i];
+    }
+  }
+
+  arenaOrderBySize(buffers, order, tensorCount);
+  arenaPlace(buffers, tensorCount, order, tensorCount, INFER_REGION_SLOW, 0, INFER_ARENA_ALIGN);
+
+  for (uint16_t i = 0; i < tensorCount; i++) {
+    tensors[i].region = buffers[i].region;
+    tensors[i].arenaOffset = buffers[i].offset;
+    tensors[i].data = NULL;
+  }
+  arenaBytes[INFER_REGION_FAST] = arenaPeak(buffers, tensorCount, INFER_REGION_FAST);
+  arenaBytes[INFER_REGION_SLOW] = arenaPeak(buffers, tensorCount, INFER_REGION_SLOW);
+  arenaSet = false;
+  free(buffers);
+  free(order);
+  free(heat);
+  return true;
+}
+
+bool InferenceEngine::prepareOp(InferOp &op, int32_t *&pool, bool measureOnly, size_t &words) {
+  const InferTensor &in = tensors[op.inputs[0]];
+  const InferTensor &out = tensors[op.output];
+  if (in.type != INFER_TYPE_INT8 || out.type != INFER_TYPE_INT8) return fail("Only int8 activations are supported");
+  if (in.constant) return fail("Constant operator input");
+  Int8Shape is = shapeOf(in);
+  Int8Shape os = shapeOf(out);
+  int32_t outChannels = 0;
+  int32_t taps = 0;
+  op.weights = -1;
+
+  switch (op.code) {
+    case OP_CONV_2D:
+    case OP_DEPTHWISE_CONV_2D: {
+      if (op.inputCount < 2 || op.inputs[1] < 0) return fail("Convolution without filter");
+      const InferTensor &filter = tensors[op.inputs[1]];
+      if (filter.type != INFER_TYPE_INT8 || !filter.constant || filter.dimCount != 4) return fail("Bad filter");
+      if (op.inputCount > 2 && op.inputs[2] >= 0 &&
+          (tensors[op.inputs[2]].type != INFER_TYPE_INT32 || !tensors[op.inputs[2]].constant)) {
+        return fail("Bad bias");
+      }
+      bool depthwise = op.code == OP_DEPTHWISE_CONV_2D;
+      int32_t kh = filter.dims[1];
+      int32_t kw = filter.dims[2];
+      outChannels = depthwise ? filter.dims[3] : filter.dims[0];
+      if (outChannels != os.c || (!depthwise && filter.dims[3] != is.c) ||
+          (depthwise && is.c * op.depthMultiplier != os.c)) {
+        return fail("Filter does not match tensors");
+      }
+      if (os.h != expectedOutput(is.h, kh, op.strideH, op.dilationH, op.padding) ||
+          os.w != expectedOutput(is.w, kw, op.strideW, op.dilationW, op.padding)) {
+        return fail("Unexpected convolution output size");
+      }
+      op.filterH = kh;
+      op.filterW = kw;
+      taps = depthwise ? 0 : kh * kw;
+      op.conv.strideW = op.strideW;
+      op.conv.strideH = op.strideH;
+      op.conv.dilationW = op.dilationW;
+      op.conv.dilationH = op.dilationH;
+      op.conv.depthMultiplier = op.depthMultiplier;
+      op.conv.padW = op.padding == 0 ? computePadding(is.w, os.w, kw, op.strideW, op.dilationW) : 0;
+      op.conv.padH = op.padding == 0 ? computePadding(is.h, os.h, kh, op.strideH, op.dilationH) : 0;
+      op.conv.inputZeroPoint = in.zeroPoint;
+      break;
+    }
+    case OP_FULLY_CONNECTED: {
+      if (op.inputCount < 2 || op.inputs[1] < 0) return fail("Fully connected without weights");
+      const InferTensor &weights = tensors[op.inputs[1]];
+      if (weights.type != INFER_TYPE_INT8 || !weights.constant || weights.dimCount != 2) return fail("Bad weights");
+      if (elementCount(in) % weights.dims[1] != 0) return fail("Weights do not match input");
+      outChannels = weights.dims[0];
+      break;
+    }
+    case OP_AVERAGE_POOL_2D:
+    case OP_MAX_POOL_2D:
+      if (os.h != expectedOutput(is.h, op.filterH, op.strideH, 1, op.padding) ||
+          os.w != expectedOutput(is.w, op.filterW, op.strideW, 1, op.padding) || os.c != is.c) {
+        return fail("Unexpected pooling output size");
+      }
+      op.conv.strideW = op.strideW;
+      op.conv.strideH = op.strideH;
+      op.conv.padW = op.padding == 0 ? computePadding(is.w, os.w, op.filterW, op.strideW, 1) : 0;
+      op.conv.padH = op.padding == 0 ? computePadding(is.h, os.h, op.filterH, op.strideH, 1) : 0;
+      int8ActivationRange((Int8Activation)op.activation, out.scale, out.zeroPoint,
+                          op.requant.actMin, op.requant.actMax);
+      break;
+    case OP_ADD: {
+      if (op.inputCount < 2 || op.inputs[1] < 0) return fail("ADD needs two inputs");
+      const InferTensor &b = tensors[op.inputs[1]];
+      if (b.type != INFER_TYPE_INT8 || b.constant) return fail("ADD operands must be int8 activations");
+      if (elementCount(b) != elementCount(in) || elementCount(out) != elementCount(in)) {
+        return fail("ADD broadcasting is not supported");
+      }
+      int8PrepareAdd(in.scale, in.zeroPoint, b.scale, b.zeroPoint, out.scale, out.zeroPoint,
+                     (Int8Activation)op.activation, op.add);
+      break;
+    }
+    case OP_PAD: {
+      if (op.inputCount < 2 || op.inputs[1] < 0) return fail("PAD without paddings");
+      const InferTensor &pads = tensors[op.inputs[1]];
+      if (pads.type != INFER_TYPE_INT32 || !pads.constant || elementCount(pads) != 8) return fail("Bad paddings");
+      uint8_t *scratch;
+      const uint8_t *data = constantData(pads, scratch);
+      if (!data) return fail("Paddings read failed");
+      int32_t p[8];
+      memcpy(p, data, sizeof(p));
+      free(scratch);
+      if (p[0] || p[1] || p[6] || p[7]) return fail("Only H/W padding is supported");
+      if (os.h != is.h + p[2] + p[3] || os.w != is.w + p[4] + p[5] || os.c != is.c) return fail("Bad PAD output");
+      op.conv.padH = p[2];
+      op.conv.padW = p[4];
+      op.filterH = p[3];   // bottom / right, kept for the kernel call
+      op.filterW = p[5];
+      break;
+    }
+    case OP_RESHAPE:
+      if (elementCount(in) != elementCount(out)) return fail("Bad RESHAPE");
+      break;
+    case OP_QUANTIZE:
+      if (elementCount(in) != elementCount(out)) return fail("Bad QUANTIZE");
+      outChannels = 1;
+      break;
+    case OP_SOFTMAX:
+    case OP_LOGISTIC:
+      if (elementCount(in) != elementCount(out)) return fail("Bad activation shape");
+      break;
+    default:
+      return fail("Unsupported operator");
+  }
+
+  // Weights used at run time: resident ones in place, the rest once paged
+  if (op.code == OP_CONV_2D || op.code == OP_DEPTHWISE_CONV_2D || op.code == OP_FULLY_CONNECTED) {
+    const InferTensor &weights = tensors[op.inputs[1]];
+    op.weights = op.inputs[1];
+    op.weightData = (const int8_t *)weights.constData;
+    if (weights.bytes > weightBytesMax) weightBytesMax = weights.bytes;
+    if (!weights.constData && weights.bytes > externalWeightBytesMax) externalWeightBytesMax = weights.bytes;
+  }
+
+  // Requantization multipliers (and conv caches): outChannels each
+  if (outChannels == 0) return true;
+  size_t need = (size_t)outChannels * 3 + (size_t)outChannels * taps;
+  words += measureOnly ? need : 0;
+  if (measureOnly) return true;
+
+  int32_t *multiplier = pool;
+  int32_t *shift = pool + outChannels;
+  op.requant.multiplier = multiplier;
+  op.requant.shift = shift;
+  op.cache.foldedBias = pool + 2 * outChannels;
+  op.cache.tapSums = taps ? pool + 3 * outChannels : NULL;
+  pool += need;
+
+  op.requant.outputZeroPoint = out.zeroPoint;
+  int8ActivationRange((Int8Activation)op.activation, out.scale, out.zeroPoint, op.requant.actMin, op.requant.actMax);
+
+  if (op.code == OP_QUANTIZE) {
+    int8QuantizeMultiplier((double)in.scale / out.scale, multiplier[0], shift[0]);
+    return true;
+  }
+
+  const InferTensor &weights = tensors[op.inputs[1]];
+  uint8_t *biasScratch = NULL;
+  uint8_t *weightScratch = NULL;
+  const int32_t *bias = NULL;
+  if (op.inputCount > 2 && op.inputs[2] >= 0) {
+    bias = (const int32_t *)constantData(tensors[op.inputs[2]], biasScratch);
+    if (!bias) return fail("Bias read failed");
+  }
+  const int8_t *w = (const int8_t *)constantData(weights, weightScratch);
+  if (!w) {
+    free(biasScratch);
+    return fail("Weights read failed");
+  }
+  for (int32_t oc = 0; oc < outChannels; oc++) {
+    int8QuantizeMultiplier((double)in.scale * channelScale(weights, oc) / out.scale,
+                           multiplier[oc], shift[oc]);
+  }
+
+  if (op.code == OP_CONV_2D) {
+    int8PrepareConv(w, bias, outChannels, op.filterH, op.filterW, is.c, in.zeroPoint, op.cache);
+  } else if (op.code == OP_DEPTHWISE_CONV_2D) {
+    int8PrepareDepthwise(w, bias, outChannels, op.filterH, op.filterW, in.zeroPoint, op.cache);
+  } else {
+    int8PrepareConv(w, bias, outChannels, 1, 1, weights.dims[1], in.zeroPoint, op.cache);
+  }
+  free(weightScratch);
+  free(biasScratch);
+  return true;
+}
+
+bool InferenceEngine::setArena(uint8_t *fast, size_t fastSize, uint8_t *slow, size_t slowSize) {
+  if (!ready) return fail("No model loaded");
+  uint8_t *base[INFER_REGION_COUNT] = {fast, slow};
+  size_t size[INFER_REGION_COUNT] = {fastSize, slowSize};
+  for (uint8_t r = 0; r < INFER_REGION_COUNT; r++) {
+    if (arenaBytes[r] == 0) continue;
+    if (!base[r] || size[r] < arenaBytes[r] || ((uintptr_t)base[r] & (INFER_ARENA_ALIGN - 1))) {
+      return fail("Arena too small or unaligned");
+    }
+  }
+  for (uint16_t i = 0; i < tensorCount; i++) {
+    InferTensor &t = tensors[i];
+    t.data = t.arenaOffset == ARENA_UNPLACED ? NULL : (int8_t *)(base[t.region] + t.arenaOffset);
+  }
+  arenaSet = true;
+  return true;
+}
+
+bool InferenceEngine::setWeightPaging(uint8_t *buffer0, uint8_t *buffer1, size_t bufferSize) {
+  if (!ready) return fail("No model loaded");
+  finishRead();
+  pageOp[0] = -1;
+  pageOp[1] = -1;
+  pagedCount = 0;
+  firstPaged = -1;
+  bool paging = buffer0 && buffer1 && bufferSize > 0;
+  pageBuffers[0] = paging ? buffer0 : NULL;
+  pageBuffers[1] = paging ? buffer1 : NULL;
+
+  int16_t last = -1;
+  for (uint16_t i = 0; i < opTotal; i++) {
+    InferOp &op = ops[i];
+    op.paged = false;
+    op.nextPaged = -1;
+    op.stallMicros = 0;
+    if (op.weights < 0) continue;
+    const InferTensor &weights = tensors[op.weights];
+    op.weightData = (const int8_t *)weights.constData;
+    if (paging && weights.bytes <= bufferSize && (weightSource || weights.constData)) {
+      op.paged = true;
+      if (last >= 0) ops[last].nextPaged = i;
+      else firstPaged = i;
+      last = i;
+      pagedCount++;
+    } else if (!weights.constData) {
+      pagedCount = 0;
+      firstPaged = -1;
+      return fail("Page buffers too small for weights that are not resident");
+    }
+  }
+  if (last >= 0) ops[last].nextPaged = firstPaged;
+  return true;
+}
+
+// Starts filling a page buffer with an op's weights: through the source
+// when there is one (it may copy in the background), else copied now
+bool InferenceEngine::startRead(int16_t index, uint8_t buffer) {
+  const InferTensor &weights = tensors[ops[index].weights];
+  pageOp[buffer] = -1;
+  if (weightSource) {
+    if (!weightSource->beginRead(weights.modelOffset, pageBuffers[buffer], weights.bytes)) return false;
+  } else {
+    memcpy(pageBuffers[buffer], weights.constData, weights.bytes);
+  }
+  pendingOp = index;
+  pendingBuffer = buffer;
+  return true;
+}
+
+void InferenceEngine::finishRead() {
+  if (pendingOp < 0) return;
+  if (weightSource) weightSource->waitRead();
+  pendingOp = -1;
+}
+
+// Makes op's weights available in a page buffer (normally already read
+// while the previous paged op ran) and starts reading the next paged op's
+// weights into the other buffer
+bool InferenceEngine::nextWeights(InferOp &op, InferClock clock) {
+  int16_t index = (int16_t)(&op - ops);
+  uint32_t t0 = clock();
+  uint8_t buffer;
+  if (pageOp[0] == index || pageOp[1] == index) {
+    buffer = pageOp[0] == index ? 0 : 1;
+  } else {
+    if (pendingOp != index) {
+      finishRead();
+      if (!startRead(index, 0)) return fail("Weight read failed");
+    }
+    buffer = pendingBuffer;
+    pendingOp = -1;
+    if (weightSource && !weightSource->waitRead()) return fail("Weight read failed");
+    pageOp[buffer] = index;
+  }
+  op.stallMicros = clock() - t0;
+  op.weightData = (const int8_t *)pageBuffers[buffer];
+
+  uint8_t other = buffer ^ 1;
+  if (pendingOp < 0 && op.nextPaged >= 0 && op.nextPaged != index && pageOp[other] != op.nextPaged) {
+    startRead(op.nextPaged, other);   // retried synchronously when the op runs
+  }
+  return true;
+}
+
+bool InferenceEngine::runOp(InferOp &op) {
+  const InferTensor &in = tensors[op.inputs[0]];
+  InferTensor &out = tensors[op.output];
+  Int8Shape is = shapeOf(in);
+  Int8Shape os = shapeOf(out);
+
+  switch (op.code) {
+    case OP_CONV_2D:
+      int8Conv2d(in.data, is, op.weightData, op.filterH, op.filterW,
+                 op.cache, op.conv, op.requant, out.data, os);
+      break;
+    case OP_DEPTHWISE_CONV_2D:
+      int8DepthwiseConv2d(in.data, is, op.weightData, op.filterH, op.filterW,
+                          op.cache, op.conv, op.requant, out.data, os);
+      break;
+    case OP_FULLY_CONNECTED: {
+      const InferTensor &weights = tensors[op.inputs[1]];
+      int32_t depth = weights.dims[1];
+      int32_t batches = (int32_t)(elementCount(in) / depth);
+      int8FullyConnected(in.data, batches, depth, op.weightData, op.cache.foldedBias,
+                         weights.dims[0], op.requant, out.data);
+      break;
+    }
+    case OP_AVERAGE_POOL_2D:
+      int8AveragePool(in.data, is, op.filterH, op.filterW, op.conv, op.requant.actMin, op.requant.actMax,
+                      out.data, os);
+      break;
+    case OP_MAX_POOL_2D:
+      int8MaxPool(in.data, is, op.filterH, op.filterW, op.conv, op.requant.actMin, op.requant.actMax,
+                  out.data, os);
+      break;
+    case OP_ADD:
+      int8Add(in.data, tensors[op.inputs[1]].data, elementCount(out), op.add, out.data);
+      break;
+    case OP_PAD: {
+      int32_t paddings[4] = {op.conv.padH, op.filterH, op.conv.padW, op.filterW};
+      int8Pad(in.data, is, paddings, (int8_t)out.zeroPoint, out.data, os);
+      break;
+    }
+    case OP_RESHAPE:
+      if (out.data != in.data) memcpy(out.data, in.data, out.bytes);
+      break;
+    case OP_QUANTIZE: {
+      size_t n = elementCount(out);
+      for (size_t i = 0; i < n; i++) {
+        int32_t v = int8MultiplyByQuantizedMultiplier(in.data[i] - in.zeroPoint, op.requant.multiplier[0],
+                                                      op.requant.shift[0]) + out.zeroPoint;
+        out.data[i] = (int8_t)(v < -128 ? -128 : (v > 127 ? 127 : v));
+      }
+      break;
+    }
+    case OP_SOFTMAX:
+      int8Softmax(in.data, (int32_t)(elementCount(in) / is.c), is.c, in.scale, in.zeroPoint, op.beta,
+                  out.scale, out.zeroPoint, out.data);
+      break;
+    case OP_LOGISTIC:
+      int8Logistic(in.data, elementCount(in), in.scale, in.zeroPoint, out.scale, out.zeroPoint, out.data);
+      break;
+    default:
+      return fail("Unsupported operator");
+  }
+  return true;
+}
+
+bool InferenceEngine::invoke(InferClock clock) {
+  if (!ready || !arenaSet) return fail("Model not ready");
+  uint32_t start = clock();
+  for (uint16_t i = 0; i < opTotal; i++) {
+    InferOp &op = ops[i];
+    if (op.paged) {
+      if (!nextWeights(op, clock)) return false;
+    } else if (op.weights >= 0 && !op.weightData) {
+      return fail("Weights not resident and not paged");
+    }
+    uint32_t t0 = clock();
+    if (!runOp(op)) return false;
+    op.lastMicros = clock() - t0;
+    op.avgMicros = op.avgMicros ? (op.avgMicros * 7 + op.lastMicros) / 8 : op.lastMicros;
+  }
+  invokeMicros = clock() - start;
+  return true;
+}
@@ -0,0 +1,207 @@
+/**
+ * Int8 Inference Engine
+ *
+ * Runs fully int8-quantized TFLite models (int8 input and output) with the
+ * kernels in int8_kernels.h. The .tflite flatbuffer is read in place: weight
+ * and bias buffers are used straight from the model image, and only the
+ * per-layer constants the kernels need (folded biases, requantization
+ * multipliers) are computed at load time.
+ *
+ * Supported operators: CONV_2D, DEPTHWISE_CONV_2D, FULLY_CONNECTED,
+ * AVERAGE_POOL_2D, MAX_POOL_2D, ADD, PAD, RESHAPE, QUANTIZE (int8 -> int8),
+ * SOFTMAX and LOGISTIC. Batch size 1, NHWC.
+ *
+ * Memory:
+ * - Activations are packed by a static plan (arena_planner.h) from their
+ *   lifetimes. plan() puts the most heavily read tensors in a "fast" region
+ *   up to a budget (internal SRAM) and the rest in a "slow" one (PSRAM).
+ * - Only a prefix of the model has to be in memory: buffer data past it is
+ *   read through an InferWeightSource (e.g. from the SD card).
+ * - With setWeightPaging(), conv / depthwise / fully connected weights are
+ *   copied into two small buffers just ahead of use: while one layer runs,
+ *   the source fills the other buffer with the next layer's weights.
+ *
+ * Every operator is timed with the clock passed to invoke(). No Arduino
+ * dependencies, so it can be built on a host.
+ */
+
+#ifndef INFERENCE_ENGINE_H
+#define INFERENCE_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "int8_kernels.h"
+#include "arena_planner.h"
+
+#define INFER_MAX_TENSORS  192
+#define INFER_MAX_OPS      96
+#define INFER_MAX_INPUTS   3
+#define INFER_ARENA_ALIGN  16
+
+enum InferRegion : uint8_t {
+  INFER_REGION_FAST = 0,          // internal SRAM
+  INFER_REGION_SLOW,              // PSRAM
+  INFER_REGION_COUNT
+};
+
+// TFLite TensorType values used here
+#define INFER_TYPE_FLOAT32  0
+#define INFER_TYPE_INT32    2
+#define INFER_TYPE_INT8     9
+
+struct InferTensor {
+  uint8_t type;
+  uint8_t dimCount;
+  int32_t dims[4];
+  size_t bytes;
+  bool constant;                  // backed by a model buffer
+  const uint8_t *constData;       // constants in the resident prefix, else NULL
+  uint32_t modelOffset;           // constants: position of the data in the model
+  int8_t *data;                   // activations: placed in the arena
+  float scale;
+  int32_t zeroPoint;
+  const uint8_t *channelScales;   // per-channel float scales (may be unaligned)
+  uint32_t channelCount;
+
+  // Plan (activations only)
+  int16_t firstOp;                // -1: graph input
+  int16_t lastOp;                 // opCount(): graph output
+  uint8_t region;                 // InferRegion
+  int32_t arenaOffset;            // ARENA_UNPLACED when unused
+};
+
+struct InferOp {
+  int32_t code;                   // TFLite BuiltinOperator
+  int16_t inputs[INFER_MAX_INPUTS];
+  uint8_t inputCount;
+  int16_t output;
+
+  // Options
+  uint8_t padding;                // 0 = SAME, 1 = VALID
+  uint8_t activation;             // Int8Activation
+  int32_t strideW;
+  int32_t strideH;
+  int32_t dilationW;
+  int32_t dilationH;
+  int32_t depthMultiplier;
+  int32_t filterW;
+  int32_t filterH;
+  float beta;
+
+  // Prepared at load time
+  int16_t weights;                // conv / depthwise / FC filter tensor, or -1
+  bool paged;
+  int16_t nextPaged;              // next paged op (wraps to the first), or -1
+  const int8_t *weightData;       // resident weights or the page buffer in use
+  Int8ConvParams conv;
+  Int8ConvCache cache;
+  Int8Requant requant;
+  Int8AddParams add;
+
+  uint32_t lastMicros;
+  uint32_t avgMicros;             // EWMA over invocations
+  uint32_t stallMicros;           // last wait for this op's weights
+};
+
+typedef uint32_t (*InferClock)();
+
+// Reads model bytes that are not resident, and fills page buffers. One read
+// is outstanding at a time; beginRead() may return before the copy is done.
+class InferWeightSource {
+public:
+  virtual ~InferWeightSource() {}
+  virtual bool beginRead(uint32_t modelOffset, uint8_t *dst, size_t len) = 0;
+  virtual bool waitRead() = 0;
+};
+
+class InferenceEngine {
+public:
+  InferenceEngine();
+  ~InferenceEngine();
+
+  // Parses and prepares a model. The first residentLen bytes of the model
+  // are in memory and must stay valid while it is loaded; the rest of a
+  // totalLen-byte model is read through source. Plans everything slow.
+  bool load(const uint8_t *model, size_t residentLen, size_t totalLen = 0, InferWeightSource *source = NULL);
+  void unload();
+  bool loaded() const { return ready; }
+  // load() failed because the model's metadata is not all resident
+  bool needsLongerPrefix() const { return truncated; }
+
+  // Re-plans activations with up to fastBudget bytes in the fast region;
+  // setArena() must be called again afterwards
+  bool plan(size_t fastBudget);
+  size_t arenaSize(InferRegion region) const { return arenaBytes[region]; }
+  // What one arena per tensor would need
+  size_t unplannedArenaSize() const { return unplannedBytes; }
+  // Arenas must be INFER_ARENA_ALIGN aligned; fast may be NULL when unused
+  bool setArena(uint8_t *fast, size_t fastSize, uint8_t *slow, size_t slowSize);
+
+  // Largest weight tensor of a conv / depthwise / FC op (page buffer size
+  // that pages every layer), and the largest one that must be paged
+  size_t largestWeights() const { return weightBytesMax; }
+  size_t largestExternalWeights() const { return externalWeightBytesMax; }
+  // Pages the weights of every op whose weights fit in bufferSize (buffers
+  // NULL: no paging, all weights must be resident)
+  bool setWeightPaging(uint8_t *buffer0, uint8_t *buffer1, size_t bufferSize);
+  uint16_t pagedOps() const { return pagedCount; }
+
+  bool invoke(InferClock clock);
+
+  const InferTensor &input() const { return tensors[inputIndex]; }
+  const InferTensor &output() const { return tensors[outputIndex]; }
+  int8_t *inputData() { return tensors[inputIndex].data; }
+  const InferTensor &tensor(int16_t index) const { return tensors[index]; }
+  uint16_t tensorTotal() const { return tensorCount; }
+
+  uint16_t opCount() const { return opTotal; }
+  const InferOp &op(uint16_t index) const { return ops[index]; }
+  static const char *opName(int32_t code);
+  uint32_t lastInvokeMicros() const { return invokeMicros; }
+  size_t modelBytes() const { return modelLen; }
+
+  const char *error() const { return errorMessage; }
+
+private:
+  bool ready;
+  bool arenaSet;
+  bool truncated;
+  const char *errorMessage;
+  size_t modelLen;
+  size_t residentBytes;
+  InferWeightSource *weightSource;
+
+  InferTensor tensors[INFER_MAX_TENSORS];
+  uint16_t tensorCount;
+  InferOp ops[INFER_MAX_OPS];
+  uint16_t opTotal;
+  int16_t inputIndex;
+  int16_t outputIndex;
+
+  int32_t *constants;             // folded biases, tap sums, multipliers
+  size_t arenaBytes[INFER_REGION_COUNT];
+  size_t unplannedBytes;
+  uint32_t invokeMicros;
+
+  size_t weightBytesMax;
+  size_t externalWeightBytesMax;
+  uint8_t *pageBuffers[2];
+  uint16_t pagedCount;
+  int16_t firstPaged;
+  int16_t pendingOp;              // op whose weights are being read, or -1
+  uint8_t pendingBuffer;
+  int16_t pageOp[2];              // op whose weights each buffer holds, or -1
+
+  bool fail(const char *message);
+  bool parse(const uint8_t *model, size_t len);
+  bool prepare();
+  bool prepareOp(InferOp &op, int32_t *&pool, bool measureOnly, size_t &words);
+  bool runOp(InferOp &op);
+  bool startRead(int16_t index, uint8_t buffer);
+  bool nextWeights(InferOp &op, InferClock clock);
+  void finishRead();
+  const uint8_t *constantData(const InferTensor &tensor, uint8_t *&scratch);
+  float channelScale(const InferTensor &tensor, uint32_t channel) const;
+};
+
+#endif // INFERENCE_ENGINE_H
@@ -0,0 +1,449 @@
+/**
+ * Int8 Inference Kernels Implementation
+ */
+
+#include "int8_kernels.h"
+#include <math.h>
+#include <string.h>
+
+// 32-bit loads of int8 data; only used on 4-byte aligned pointers
+typedef uint32_t __attribute__((may_alias)) PackedInt8x4;
+
+static inline int32_t lane0(uint32_t v) { return (int8_t)v; }
+static inline int32_t lane1(uint32_t v) { return (int8_t)(v >> 8); }
+static inline int32_t lane2(uint32_t v) { return (int8_t)(v >> 16); }
+static inline int32_t lane3(uint32_t v) { return (int32_t)v >> 24; }
+
+static inline bool aligned4(const void *p) {
+  return ((uintptr_t)p & 3) == 0;
+}
+
+static inline int32_t clampInt8(int32_t v, int32_t lo, int32_t hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// ---------------------------------------------------------------------------
+// Fixed-point requantization (gemmlowp / TFLite reference semantics)
+
+static inline int32_t saturatingRoundingDoublingHighMul(int32_t a, int32_t b) {
+  if (a == b && a == INT32_MIN) return INT32_MAX;
+  int64_t ab = (int64_t)a * b;
+  int32_t nudge = ab >= 0 ? (1 << 30) : (1 - (1 << 30));
+  return (int32_t)((ab + nudge) / (1LL << 31));
+}
+
+static inline int32_t roundingDivideByPOT(int32_t x, int32_t exponent) {
+  int32_t mask = (int32_t)((1LL << exponent) - 1);
+  int32_t remainder = x & mask;
+  int32_t threshold = (mask >> 1) + (x < 0 ? 1 : 0);
+  return (x >> exponent) + (remainder > threshold ? 1 : 0);
+}
+
+int32_t int8MultiplyByQuantizedMultiplier(int32_t x, int32_t multiplier, int32_t shift) {
+  int32_t leftShift = shift > 0 ? shift : 0;
+  int32_t rightShift = shift > 0 ? 0 : -shift;
+  return roundingDivideByPOT(saturatingRoundingDoublingHighMul(x * (1 << leftShift), multiplier), rightShift);
+}
+
+void int8QuantizeMultiplier(double real, int32_t &multiplier, int32_t &shift) {
+  if (real == 0.0) {
+    multiplier = 0;
+    shift = 0;
+    return;
+  }
+  int exponent;
+  double q = frexp(real, &exponent);
+  int64_t qFixed = (int64_t)llround(q * (1LL << 31));
+  if (qFixed == (1LL << 31)) {
+    qFixed /= 2;
+    exponent++;
+  }
+  if (exponent < -31) {
+    exponent = 0;
+    qFixed = 0;
+  }
+  multiplier = (int32_t)qFixed;
+  shift = exponent;
+}
+
+static inline int32_t quantizeValue(float real, float scale, int32_t zeroPoint) {
+  return zeroPoint + (int32_t)lroundf(real / scale);
+}
+
+void int8ActivationRange(Int8Activation act, float scale, int32_t zeroPoint, int32_t &actMin, int32_t &actMax) {
+  actMin = -128;
+  actMax = 127;
+  if (act == INT8_ACT_RELU) {
+    actMin = clampInt8(quantizeValue(0.0f, scale, zeroPoint), -128, 127);
+  } else if (act == INT8_ACT_RELU6) {
+    actMin = clampInt8(quantizeValue(0.0f, scale, zeroPoint), -128, 127);
+    actMax = clampInt8(quantizeValue(6.0f, scale, zeroPoint), -128, 127);
+  } else if (act == INT8_ACT_RELU_N1_TO_1) {
+    actMin = clampInt8(quantizeValue(-1.0f, scale, zeroPoint), -128, 127);
+    actMax = clampInt8(quantizeValue(1.0f, scale, zeroPoint), -128, 127);
+  }
+}
+
+static inline int8_t requantize(int32_t acc, const Int8Requant &rq, int32_t channel) {
+  int32_t v = int8MultiplyByQuantizedMultiplier(acc, rq.multiplier[channel], rq.shift[channel]) + rq.outputZeroPoint;
+  return (int8_t)clampInt8(v, rq.actMin, rq.actMax);
+}
+
+// ---------------------------------------------------------------------------
+// Dot products
+
+// acc += dot(x, w) over n int8 values
+static inline int32_t dot1(const int8_t *x, const int8_t *w, int32_t n, bool packed) {
+  int32_t acc = 0;
+  int32_t i = 0;
+  if (packed) {
+    for (; i + 4 <= n; i += 4) {
+      uint32_t xv = *(const PackedInt8x4 *)(x + i);
+      uint32_t wv = *(const PackedInt8x4 *)(w + i);
+      acc += lane0(xv) * lane0(wv) + lane1(xv) * lane1(wv) + lane2(xv) * lane2(wv) + lane3(xv) * lane3(wv);
+    }
+  }
+  for (; i < n; i++) acc += x[i] * w[i];
+  return acc;
+}
+
+// Four filters against one input vector: each input word is loaded once
+static inline void dot4(const int8_t *x, const int8_t *w0, const int8_t *w1, const int8_t *w2, const int8_t *w3,
+                        int32_t n, bool packed, int32_t *acc) {
+  int32_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+  int32_t i = 0;
+  if (packed) {
+    for (; i + 4 <= n; i += 4) {
+      uint32_t xv = *(const PackedInt8x4 *)(x + i);
+      int32_t x0 = lane0(xv), x1 = lane1(xv), x2 = lane2(xv), x3 = lane3(xv);
+      uint32_t v = *(const PackedInt8x4 *)(w0 + i);
+      a0 += x0 * lane0(v) + x1 * lane1(v) + x2 * lane2(v) + x3 * lane3(v);
+      v = *(const PackedInt8x4 *)(w1 + i);
+      a1 += x0 * lane0(v) + x1 * lane1(v) + x2 * lane2(v) + x3 * lane3(v);
+      v = *(const PackedInt8x4 *)(w2 + i);
+      a2 += x0 * lane0(v) + x1 * lane1(v) + x2 * lane2(v) + x3 * lane3(v);
+      v = *(const PackedInt8x4 *)(w3 + i);
+      a3 += x0 * lane0(v) + x1 * lane1(v) + x2 * lane2(v) + x3 * lane3(v);
+    }
+  }
+  for (; i < n; i++) {
+    int32_t xv = x[i];
+    a0 += xv * w0[i];
+    a1 += xv * w1[i];
+    a2 += xv * w2[i];
+    a3 += xv * w3[i];
+  }
+  acc[0] += a0;
+  acc[1] += a1;
+  acc[2] += a2;
+  acc[3] += a3;
+}
+
+// ---------------------------------------------------------------------------
+// Convolutions
+
+size_t int8ConvCacheTaps(int32_t outChannels, int32_t kh, int32_t kw) {
+  return (size_t)outChannels * kh * kw;
+}
+
+void int8PrepareConv(const int8_t *filter, const int32_t *bias, int32_t outChannels, int32_t kh, int32_t kw,
+                     int32_t inChannels, int32_t inputZeroPoint, Int8ConvCache &cache) {
+  int32_t taps = kh * kw;
+  for (int32_t oc = 0; oc < outChannels; oc++) {
+    int32_t total = 0;
+    for (int32_t t = 0; t < taps; t++) {
+      const int8_t *w = filter + ((size_t)oc * taps + t) * inChannels;
+      int32_t sum = 0;
+      for (int32_t ic = 0; ic < inChannels; ic++) sum += w[ic];
+      if (cache.tapSums) cache.tapSums[(size_t)oc * taps + t] = sum;
+      total += sum;
+    }
+    cache.foldedBias[oc] = (bias ? bias[oc] : 0) - inputZeroPoint * total;
+  }
+}
+
+void int8PrepareDepthwise(const int8_t *filter, const int32_t *bias, int32_t outChannels, int32_t kh, int32_t kw,
+                          int32_t inputZeroPoint, Int8ConvCache &cache) {
+  int32_t taps = kh * kw;
+  for (int32_t oc = 0; oc < outChannels; oc++) {
+    int32_t total = 0;
+    for (int32_t t = 0; t < taps; t++) total += filter[(size_t)t * outChannels + oc];
+    cache.foldedBias[oc] = (bias ? bias[oc] : 0) - inputZeroPoint * total;
+  }
+}
+
+void int8Conv2d(const int8_t *input, const Int8Shape &in, const int8_t *filter, int32_t kh, int32_t kw,
+                const Int8ConvCache &cache, const Int8ConvParams &params, const Int8Requant &rq,
+                int8_t *output, const Int8Shape &out) {
+  const int32_t taps = kh * kw;
+  const int32_t inC = in.c;
+  const int32_t outC = out.c;
+  const int32_t zp = params.inputZeroPoint;
+  const bool packed = (inC & 3) == 0 && aligned4(input) && aligned4(filter);
+  const size_t filterStride = (size_t)taps * inC;
+
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    const int32_t iy0 = oy * params.strideH - params.padH;
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      const int32_t ix0 = ox * params.strideW - params.padW;
+      const bool interior = iy0 >= 0 && ix0 >= 0 &&
+                            iy0 + (kh - 1) * params.dilationH < in.h &&
+                            ix0 + (kw - 1) * params.dilationW < in.w;
+      int8_t *o = output + ((size_t)oy * out.w + ox) * outC;
+
+      int32_t oc = 0;
+      for (; oc + 4 <= outC; oc += 4) {
+        int32_t acc[4] = {cache.foldedBias[oc], cache.foldedBias[oc + 1],
+                          cache.foldedBias[oc + 2], cache.foldedBias[oc + 3]};
+        const int8_t *w = filter + (size_t)oc * filterStride;
+        for (int32_t ky = 0; ky < kh; ky++) {
+          const int32_t iy = iy0 + ky * params.dilationH;
+          for (int32_t kx = 0; kx < kw; kx++) {
+            const int32_t ix = ix0 + kx * params.dilationW;
+            const int32_t t = ky * kw + kx;
+            if (!interior && (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w)) {
+              // Padding holds the zero point: undo its share of the folded bias
+              for (int j = 0; j < 4; j++) acc[j] += zp * cache.tapSums[(size_t)(oc + j) * taps + t];
+              continue;
+            }
+            const int8_t *x = input + ((size_t)iy * in.w + ix) * inC;
+            const int8_t *wt = w + (size_t)t * inC;
+            dot4(x, wt, wt + filterStride, wt + 2 * filterStride, wt + 3 * filterStride, inC, packed, acc);
+          }
+        }
+        for (int j = 0; j < 4; j++) o[oc + j] = requantize(acc[j], rq, oc + j);
+      }
+
+      for (; oc < outC; oc++) {
+        int32_t acc = cache.foldedBias[oc];
+        const int8_t *w = filter + (size_t)oc * filterStride;
+        for (int32_t ky = 0; ky < kh; ky++) {
+          const int32_t iy = iy0 + ky * params.dilationH;
+          for (int32_t kx = 0; kx < kw; kx++) {
+            const int32_t ix = ix0 + kx * params.dilationW;
+            const int32_t t = ky * kw + kx;
+            if (!interior && (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w)) {
+              acc += zp * cache.tapSums[(size_t)oc * taps + t];
+              continue;
+            }
+            acc += dot1(input + ((size_t)iy * in.w + ix) * inC, w + (size_t)t * inC, inC, packed);
+          }
+        }
+        o[oc] = requantize(acc, rq, oc);
+      }
+    }
+  }
+}
+
+void int8DepthwiseConv2d(const int8_t *input, const Int8Shape &in, const int8_t *filter, int32_t kh, int32_t kw,
+                         const Int8ConvCache &cache, const Int8ConvParams &params, const Int8Requant &rq,
+                         int8_t *output, const Int8Shape &out) {
+  const int32_t outC = out.c;
+  const int32_t zp = params.inputZeroPoint;
+  const int32_t dm = params.depthMultiplier;
+  // With depth multiplier 1, input and filter channels line up: 4 channels per load
+  const bool packed = dm == 1 && (outC & 3) == 0 && aligned4(input) && aligned4(filter);
+
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    const int32_t iy0 = oy * params.strideH - params.padH;
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      const int32_t ix0 = ox * params.strideW - params.padW;
+      int8_t *o = output + ((size_t)oy * out.w + ox) * outC;
+
+      int32_t oc = 0;
+      if (packed) {
+        for (; oc + 4 <= outC; oc += 4) {
+          int32_t a0 = cache.foldedBias[oc], a1 = cache.foldedBias[oc + 1];
+          int32_t a2 = cache.foldedBias[oc + 2], a3 = cache.foldedBias[oc + 3];
+          for (int32_t ky = 0; ky < kh; ky++) {
+            const int32_t iy = iy0 + ky * params.dilationH;
+            for (int32_t kx = 0; kx < kw; kx++) {
+              const int32_t ix = ix0 + kx * params.dilationW;
+              uint32_t wv = *(const PackedInt8x4 *)(filter + (size_t)(ky * kw + kx) * outC + oc);
+              if (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w) {
+                a0 += zp * lane0(wv);
+                a1 += zp * lane1(wv);
+                a2 += zp * lane2(wv);
+                a3 += zp * lane3(wv);
+                continue;
+              }
+              uint32_t xv = *(const PackedInt8x4 *)(input + ((size_t)iy * in.w + ix) * in.c + oc);
+              a0 += lane0(xv) * lane0(wv);
+              a1 += lane1(xv) * lane1(wv);
+              a2 += lane2(xv) * lane2(wv);
+              a3 += lane3(xv) * lane3(wv);
+            }
+          }
+          o[oc] = requantize(a0, rq, oc);
+          o[oc + 1] = requantize(a1, rq, oc + 1);
+          o[oc + 2] = requantize(a2, rq, oc + 2);
+          o[oc + 3] = requantize(a3, rq, oc + 3);
+        }
+      }
+
+      for (; oc < outC; oc++) {
+        const int32_t ic = oc / dm;
+        int32_t acc = cache.foldedBias[oc];
+        for (int32_t ky = 0; ky < kh; ky++) {
+          const int32_t iy = iy0 + ky * params.dilationH;
+          for (int32_t kx = 0; kx < kw; kx++) {
+            const int32_t ix = ix0 + kx * params.dilationW;
+            int32_t w = filter[(size_t)(ky * kw + kx) * outC + oc];
+            if (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w) {
+              acc += zp * w;
+            } else {
+              acc += input[((size_t)iy * in.w + ix) * in.c + ic] * w;
+            }
+          }
+        }
+        o[oc] = requantize(acc, rq, oc);
+      }
+    }
+  }
+}
+
+void int8FullyConnected(const int8_t *input, int32_t batches, int32_t depth, const int8_t *weights,
+                        const int32_t *foldedBias, int32_t outputs, const Int8Requant &rq, int8_t *output) {
+  const bool packed = (depth & 3) == 0 && aligned4(input) && aligned4(weights);
+  for (int32_t b = 0; b < batches; b++) {
+    const int8_t *x = input + (size_t)b * depth;
+    int8_t *o = output + (size_t)b * outputs;
+    int32_t oc = 0;
+    for (; oc + 4 <= outputs; oc += 4) {
+      int32_t acc[4] = {foldedBias[oc], foldedBias[oc + 1], foldedBias[oc + 2], foldedBias[oc + 3]};
+      const int8_t *w = weights + (size_t)oc * depth;
+      dot4(x, w, w + depth, w + 2 * depth, w + 3 * depth, depth, packed, acc);
+      for (int j = 0; j < 4; j++) o[oc + j] = requantize(acc[j], rq, oc + j);
+    }
+    for (; oc < outputs; oc++) {
+      int32_t acc = foldedBias[oc] + dot1(x, weights + (size_t)oc * depth, depth, packed);
+      o[oc] = requantize(acc, rq, oc);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Pooling
+
+void int8AveragePool(const int8_t *input, const Int8Shape &in, int32_t fh, int32_t fw, const Int8ConvParams &params,
+                     int32_t actMin, int32_t actMax, int8_t *output, const Int8Shape &out) {
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    const int32_t iy0 = oy * params.strideH - params.padH;
+    const int32_t y0 = iy0 < 0 ? 0 : iy0;
+    const int32_t y1 = iy0 + fh > in.h ? in.h : iy0 + fh;
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      const int32_t ix0 = ox * params.strideW - params.padW;
+      const int32_t x0 = ix0 < 0 ? 0 : ix0;
+      const int32_t x1 = ix0 + fw > in.w ? in.w : ix0 + fw;
+      const int32_t count = (y1 - y0) * (x1 - x0);
+      int8_t *o = output + ((size_t)oy * out.w + ox) * out.c;
+      for (int32_t c = 0; c < in.c; c++) {
+        int32_t acc = 0;
+        for (int32_t y = y0; y < y1; y++) {
+          const int8_t *row = input + ((size_t)y * in.w) * in.c + c;
+          for (int32_t x = x0; x < x1; x++) acc += row[(size_t)x * in.c];
+        }
+        if (count > 0) acc = acc > 0 ? (acc + count / 2) / count : (acc - count / 2) / count;
+        o[c] = (int8_t)clampInt8(acc, actMin, actMax);
+      }
+    }
+  }
+}
+
+void int8MaxPool(const int8_t *input, const Int8Shape &in, int32_t fh, int32_t fw, const Int8ConvParams &params,
+                 int32_t actMin, int32_t actMax, int8_t *output, const Int8Shape &out) {
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    const int32_t iy0 = oy * params.strideH - params.padH;
+    const int32_t y0 = iy0 < 0 ? 0 : iy0;
+    const int32_t y1 = iy0 + fh > in.h ? in.h : iy0 + fh;
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      const int32_t ix0 = ox * params.strideW - params.padW;
+      const int32_t x0 = ix0 < 0 ? 0 : ix0;
+      const int32_t x1 = ix0 + fw > in.w ? in.w : ix0 + fw;
+      int8_t *o = output + ((size_t)oy * out.w + ox) * out.c;
+      for (int32_t c = 0; c < in.c; c++) {
+        int32_t best = -128;
+        for (int32_t y = y0; y < y1; y++) {
+          const int8_t *row = input + ((size_t)y * in.w) * in.c + c;
+          for (int32_t x = x0; x < x1; x++) {
+            if (row[(size_t)x * in.c] > best) best = row[(size_t)x * in.c];
+          }
+        }
+        o[c] = (int8_t)clampInt8(best, actMin, actMax);
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Elementwise
+
+void int8PrepareAdd(float input1Scale, int32_t input1ZeroPoint, float input2Scale, int32_t input2ZeroPoint,
+                    float outputScale, int32_t outputZeroPoint, Int8Activation act, Int8AddParams &params) {
+  const int32_t leftShift = 20;
+  double twiceMaxScale = 2.0 * (input1Scale > input2Scale ? input1Scale : input2Scale);
+  int8QuantizeMultiplier(input1Scale / twiceMaxScale, params.input1Multiplier, params.input1Shift);
+  int8QuantizeMultiplier(input2Scale / twiceMaxScale, params.input2Multiplier, params.input2Shift);
+  int8QuantizeMultiplier(twiceMaxScale / ((double)(1 << leftShift) * outputScale),
+                         params.outputMultiplier, params.outputShift);
+  params.input1ZeroPoint = input1ZeroPoint;
+  params.input2ZeroPoint = input2ZeroPoint;
+  params.outputZeroPoint = outputZeroPoint;
+  int8ActivationRange(act, outputScale, outputZeroPoint, params.actMin, params.actMax);
+}
+
+void int8Add(const int8_t *a, const int8_t *b, size_t count, const Int8AddParams &params, int8_t *output) {
+  for (size_t i = 0; i < count; i++) {
+    int32_t x1 = (a[i] - params.input1ZeroPoint) * (1 << 20);
+    int32_t x2 = (b[i] - params.input2ZeroPoint) * (1 << 20);
+    int32_t s1 = int8MultiplyByQuantizedMultiplier(x1, params.input1Multiplier, params.input1Shift);
+    int32_t s2 = int8MultiplyByQuantizedMultiplier(x2, params.input2Multiplier, params.input2Shift);
+    int32_t v = int8MultiplyByQuantizedMultiplier(s1 + s2, params.outputMultiplier, params.outputShift) +
+                params.outputZeroPoint;
+    output[i] = (int8_t)clampInt8(v, params.actMin, params.actMax);
+  }
+}
+
+void int8Pad(const int8_t *input, const Int8Shape &in, const int32_t *paddings, int8_t padValue,
+             int8_t *output, const Int8Shape &out) {
+  memset(output, padValue, (size_t)out.h * out.w * out.c);
+  size_t rowBytes = (size_t)in.w * in.c;
+  for (int32_t y = 0; y < in.h; y++) {
+    memcpy(output + ((size_t)(y + paddings[0]) * out.w + paddings[2]) * out.c,
+           input + (size_t)y * rowBytes, rowBytes);
+  }
+}
+
+void int8Softmax(const int8_t *input, int32_t rows, int32_t depth, float inputScale, int32_t inputZeroPoint,
+                 float beta, float outputScale, int32_t outputZeroPoint, int8_t *output) {
+  (void)inputZeroPoint;  // cancels out in x - max
+  // exp() of every possible distance below the row maximum
+  float table[256];
+  for (int d = 0; d < 256; d++) table[d] = expf(-d * inputScale * beta);
+
+  for (int32_t r = 0; r < rows; r++) {
+    const int8_t *x = input + (size_t)r * depth;
+    int8_t *o = output + (size_t)r * depth;
+    int32_t maxValue = -128;
+    for (int32_t i = 0; i < depth; i++) {
+      if (x[i] > maxValue) maxValue = x[i];
+    }
+    float sum = 0.0f;
+    for (int32_t i = 0; i < depth; i++) sum += table[maxValue - x[i]];
+    float inv = 1.0f / (sum * outputScale);
+    for (int32_t i = 0; i < depth; i++) {
+      int32_t q = (int32_t)lroundf(table[maxValue - x[i]] * inv) + outputZeroPoint;
+      o[i] = (int8_t)clampInt8(q, -128, 127);
+    }
+  }
+}
+
+void int8Logistic(const int8_t *input, size_t count, float inputScale, int32_t inputZeroPoint,
+                  float outputScale, int32_t outputZeroPoint, int8_t *output) {
+  int8_t table[256];
+  for (int v = -128; v < 128; v++) {
+    float real = 1.0f / (1.0f + expf(-(v - inputZeroPoint) * inputScale));
+    table[v + 128] = (int8_t)clampInt8((int32_t)lroundf(real / outputScale) + outputZeroPoint, -128, 127);
+  }
+  for (size_t i = 0; i < count; i++) output[i] = table[input[i] + 128];
+}
@@ -0,0 +1,126 @@
+/**
+ * Int8 Inference Kernels
+ *
+ * Quantized NHWC kernels with TFLite int8 semantics: int8 activations with a
+ * zero point, symmetric per-channel int8 weights, int32 bias, and per-channel
+ * fixed-point requantization (Q31 multiplier + shift). Written for the
+ * Xtensa LX6, which has no SIMD but single-cycle 32-bit MUL/ADD:
+ *
+ * - Input zero points are folded into the bias once (bias - zp * sum(w)),
+ *   so inner loops are pure int8 x int8 multiply-accumulates; border taps
+ *   that fall in the padding are corrected with per-tap weight sums.
+ * - Channel loops read four int8 values per 32-bit load and are unrolled by
+ *   four; convolutions compute four output channels per input load.
+ *
+ * No Arduino dependencies, so results can be compared on a host.
+ */
+
+#ifndef INT8_KERNELS_H
+#define INT8_KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Fused activation (TFLite ActivationFunctionType)
+enum Int8Activation : uint8_t {
+  INT8_ACT_NONE = 0,
+  INT8_ACT_RELU = 1,
+  INT8_ACT_RELU_N1_TO_1 = 2,
+  INT8_ACT_RELU6 = 3
+};
+
+struct Int8Shape {
+  int32_t h;
+  int32_t w;
+  int32_t c;
+};
+
+// Per-output-channel requantization
+struct Int8Requant {
+  const int32_t *multiplier;   // Q31
+  const int32_t *shift;        // > 0: left shift
+  int32_t outputZeroPoint;
+  int32_t actMin;
+  int32_t actMax;
+};
+
+struct Int8ConvParams {
+  int32_t strideW;
+  int32_t strideH;
+  int32_t padW;
+  int32_t padH;
+  int32_t dilationW;
+  int32_t dilationH;
+  int32_t depthMultiplier;     // depthwise only
+  int32_t inputZeroPoint;
+};
+
+// Weight-derived constants computed once per layer at load time
+struct Int8ConvCache {
+  int32_t *foldedBias;         // bias - inputZeroPoint * sum(weights), per output channel
+  int32_t *tapSums;            // per output channel and kernel tap: sum over input channels
+};
+
+// real multiplier -> Q31 multiplier and shift
+void int8QuantizeMultiplier(double real, int32_t &multiplier, int32_t &shift);
+
+int32_t int8MultiplyByQuantizedMultiplier(int32_t x, int32_t multiplier, int32_t shift);
+
+// Clamp range of a fused activation for an int8 tensor
+void int8ActivationRange(Int8Activation act, float scale, int32_t zeroPoint, int32_t &actMin, int32_t &actMax);
+
+// Cache sizes (int32 elements) and fill; filter is OHWI for conv, 1HWO for depthwise
+size_t int8ConvCacheTaps(int32_t outChannels, int32_t kh, int32_t kw);
+void int8PrepareConv(const int8_t *filter, const int32_t *bias, int32_t outChannels, int32_t kh, int32_t kw,
+                     int32_t inChannels, int32_t inputZeroPoint, Int8ConvCache &cache);
+void int8PrepareDepthwise(const int8_t *filter, const int32_t *bias, int32_t outChannels, int32_t kh, int32_t kw,
+                          int32_t inputZeroPoint, Int8ConvCache &cache);
+
+void int8Conv2d(const int8_t *input, const Int8Shape &in, const int8_t *filter, int32_t kh, int32_t kw,
+                const Int8ConvCache &cache, const Int8ConvParams &params, const Int8Requant &rq,
+                int8_t *output, const Int8Shape &out);
+
+void int8DepthwiseConv2d(const int8_t *input, const Int8Shape &in, const int8_t *filter, int32_t kh, int32_t kw,
+                         const Int8ConvCache &cache, const Int8ConvParams &params, const Int8Requant &rq,
+                         int8_t *output, const Int8Shape &out);
+
+// Fully connected: weights [outputs][depth]; foldedBias from int8PrepareConv(kh = kw = 1)
+void int8FullyConnected(const int8_t *input, int32_t batches, int32_t depth, const int8_t *weights,
+                        const int32_t *foldedBias, int32_t outputs, const Int8Requant &rq, int8_t *output);
+
+void int8AveragePool(const int8_t *input, const Int8Shape &in, int32_t fh, int32_t fw, const Int8ConvParams &params,
+                     int32_t actMin, int32_t actMax, int8_t *output, const Int8Shape &out);
+
+void int8MaxPool(const int8_t *input, const Int8Shape &in, int32_t fh, int32_t fw, const Int8ConvParams &params,
+                 int32_t actMin, int32_t actMax, int8_t *output, const Int8Shape &out);
+
+// Elementwise add with TFLite's 20-bit headroom rescaling
+struct Int8AddParams {
+  int32_t input1ZeroPoint;
+  int32_t input2ZeroPoint;
+  int32_t input1Multiplier;
+  int32_t input1Shift;
+  int32_t input2Multiplier;
+  int32_t input2Shift;
+  int32_t outputMultiplier;
+  int32_t outputShift;
+  int32_t outputZeroPoint;
+  int32_t actMin;
+  int32_t actMax;
+};
+
+void int8PrepareAdd(float input1Scale, int32_t input1ZeroPoint, float input2Scale, int32_t input2ZeroPoint,
+                    float outputScale, int32_t outputZeroPoint, Int8Activation act, Int8AddParams &params);
+void int8Add(const int8_t *a, const int8_t *b, size_t count, const Int8AddParams &params, int8_t *output);
+
+// Pads H and W with the zero point (paddings: top, bottom, left, right)
+void int8Pad(const int8_t *input, const Int8Shape &in, const int32_t *paddings, int8_t padValue,
+             int8_t *output, const Int8Shape &out);
+
+// Softmax / logistic through dequantize -> float -> requantize
+void int8Softmax(const int8_t *input, int32_t rows, int32_t depth, float inputScale, int32_t inputZeroPoint,
+                 float beta, float outputScale, int32_t outputZeroPoint, int8_t *output);
+void int8Logistic(const int8_t *input, size_t count, float inputScale, int32_t inputZeroPoint,
+                  float outputScale, int32_t outputZeroPoint, int8_t *output);
+
+#endif // INT8_KERNELS_H
@@ -0,0 +1,677 @@
+/**
+ * Lossless JPEG Crop Implementation
+ */
+
+#include "jpeg_crop.h"
+#include <string.h>
+
+// JPEG markers
+#define M_SOF0  0xC0
+#define M_SOF1  0xC1
+#define M_DHT   0xC4
+#define M_RST0  0xD0
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_DRI   0xDD
+
+// Annex K.3 tables as one DHT payload (Tc/Th, 16 counts, values), used when
+// the source has no DHT (abbreviated MJPEG frames)
+const uint8_t JPEG_STANDARD_DHT[] = {
+  0x00, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+  0x01, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+  0x10, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa,
+  0x11, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa
+};
+const size_t JPEG_STANDARD_DHT_SIZE = sizeof(JPEG_STANDARD_DHT);
+
+static inline uint16_t readU16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// ---------------------------------------------------------------------------
+// Entropy-coded segment reader (handles 0xFF00 stuffing, stops at markers)
+
+struct BitReader {
+  const uint8_t *p;
+  const uint8_t *end;
+  uint32_t bits;      // left-aligned
+  int count;
+  bool atMarker;
+
+  void reset(const uint8_t *start, const uint8_t *stop) {
+    p = start;
+    end = stop;
+    bits = 0;
+    count = 0;
+    atMarker = false;
+  }
+
+  inline void fill() {
+    while (count <= 24) {
+      uint32_t byte = 0;
+      if (!atMarker && p < end) {
+        byte = *p;
+        if (byte == 0xFF) {
+          uint8_t next = p + 1 < end ? p[1] : 0xD9;
+          if (next == 0x00) {
+            p += 2;
+          } else {
+            atMarker = true;   // leave p on the marker; feed zeros
+            byte = 0;
+          }
+        } else {
+          p++;
+        }
+      }
+      bits |= byte << (24 - count);
+      count += 8;
+    }
+  }
+
+  inline uint32_t peek(int n) const { return bits >> (32 - n); }
+  inline void skip(int n) { bits <<= n; count -= n; }
+
+  // Drops buffered bits and consumes the next RSTn marker
+  bool restart() {
+    bits = 0;
+    count = 0;
+    atMarker = false;
+    while (p + 1 < end && p[0] == 0xFF && p[1] == 0xFF) p++;  // fill bytes
+    if (p + 1 < end && p[0] == 0xFF && (p[1] & 0xF8) == M_RST0) {
+      p += 2;
+      return true;
+    }
+    return false;
+  }
+
+  // Skips entropy data up to and including the next RSTn marker
+  bool skipToRestart() {
+    bits = 0;
+    count = 0;
+    atMarker = false;
+    while (p + 1 < end) {
+      if (p[0] == 0xFF && (p[1] & 0xF8) == M_RST0) {
+        p += 2;
+        return true;
+      }
+      p++;
+    }
+    return false;
+  }
+};
+
+struct BitWriter {
+  uint8_t *out;
+  size_t capacity;
+  size_t pos;
+  uint32_t acc;
+  int accBits;
+  bool overflow;
+
+  inline void putByte(uint8_t byte) {
+    if (pos + 2 > capacity) {
+      overflow = true;
+      return;
+    }
+    out[pos++] = byte;
+    if (byte == 0xFF) out[pos++] = 0x00;
+  }
+
+  inline void putBits(uint32_t value, int len) {
+    if (len == 0) return;
+    acc = (acc << len) | (value & ((1u << len) - 1));
+    accBits += len;
+    while (accBits >= 8) {
+      accBits -= 8;
+      putByte((uint8_t)(acc >> accBits));
+    }
+  }
+
+  // Pads the last byte with 1 bits
+  void flush() {
+    if (accBits > 0) putBits(0x7F, 8 - accBits);
+    acc = 0;
+    accBits = 0;
+  }
+
+  void raw(const uint8_t *data, size_t len) {
+    if (pos + len > capacity) {
+      overflow = true;
+      return;
+    }
+    memcpy(out + pos, data, len);
+    pos += len;
+  }
+
+  void marker(uint8_t code) {
+    uint8_t m[2] = {0xFF, code};
+    raw(m, 2);
+  }
+};
+
+static inline int decodeSymbol(BitReader &br, const int32_t *maxCode, const int32_t *valPtr,
+                               const uint16_t *minCode, const uint8_t *values, const uint16_t *lookup) {
+  br.fill();
+  uint16_t entry = lookup[br.peek(9)];
+  if (entry) {
+    br.skip(entry >> 8);
+    return entry & 0xFF;
+  }
+  for (int l = 10; l <= 16; l++) {
+    int32_t code = (int32_t)br.peek(l);
+    if (code <= maxCode[l]) {
+      br.skip(l);
+      return values[valPtr[l] + code - minCode[l]];
+    }
+  }
+  return -1;
+}
+
+static inline int magnitudeBits(int value) {
+  if (value < 0) value = -value;
+  int n = 0;
+  while (value) {
+    n++;
+    value >>= 1;
+  }
+  return n;
+}
+
+// ---------------------------------------------------------------------------
+
+JpegCropper::JpegCropper()
+  : errorMessage(NULL), width(0), height(0), componentCount(0), mcuW(8), mcuH(8),
+    restartInterval(0), dqtCount(0), dhtCount(0), sof(NULL), sos(NULL), sosLen(0),
+    scanData(NULL), scanEnd(NULL) {
+  memset(&lastStats, 0, sizeof(lastStats));
+}
+
+bool JpegCropper::fail(const char *message) {
+  errorMessage = message;
+  return false;
+}
+
+void JpegCropper::buildTable(HuffTable &table) {
+  memset(table.lookup, 0, sizeof(table.lookup));
+  memset(table.codeLen, 0, sizeof(table.codeLen));
+
+  uint16_t code = 0;
+  int k = 0;
+  for (int l = 1; l <= 16; l++) {
+    table.valPtr[l] = k;
+    table.minCode[l] = code;
+    for (int i = 0; i < table.bits[l]; i++, k++) {
+      uint8_t symbol = table.values[k];
+      table.code[symbol] = code;
+      table.codeLen[symbol] = l;
+      if (l <= 9) {
+        int shift = 9 - l;
+        for (int fill = 0; fill < (1 << shift); fill++) {
+          table.lookup[(code << shift) | fill] = (uint16_t)((l << 8) | symbol);
+        }
+      }
+      code++;
+    }
+    table.maxCode[l] = table.bits[l] ? code - 1 : -1;
+    code <<= 1;
+  }
+  table.maxCode[17] = 0x7FFFFFFF;
+}
+
+bool JpegCropper::parseDHT(const uint8_t *segment, size_t len) {
+  size_t pos = 0;
+  while (pos + 17 <= len) {
+    uint8_t tc = segment[pos] >> 4;
+    uint8_t th = segment[pos] & 0x0F;
+    if (tc > 1 || th > 3) return fail("Invalid DHT");
+    HuffTable &table = tc == 0 ? dcTables[th] : acTables[th];
+
+    size_t total = 0;
+    table.bits[0] = 0;
+    for (int l = 1; l <= 16; l++) {
+      table.bits[l] = segment[pos + l];
+      total += table.bits[l];
+    }
+    if (total > 256 || pos + 17 + total > len) return fail("Invalid DHT");
+    memcpy(table.values, segment + pos + 17, total);
+    table.present = true;
+    buildTable(table);
+    pos += 17 + total;
+  }
+  return true;
+}
+
+void JpegCropper::loadStandardTables() {
+  parseDHT(JPEG_STANDARD_DHT, JPEG_STANDARD_DHT_SIZE);
+}
+
+bool JpegCropper::parseHeaders(const uint8_t *jpeg, size_t len) {
+  dqtCount = 0;
+  dhtCount = 0;
+  sof = NULL;
+  sos = NULL;
+  restartInterval = 0;
+  for (int i = 0; i < 4; i++) {
+    dcTables[i].present = false;
+    acTables[i].present = false;
+  }
+
+  if (len < 4 || jpeg[0] != 0xFF || jpeg[1] != M_SOI) return fail("Not a JPEG");
+
+  size_t pos = 2;
+  while (pos + 4 <= len) {
+    if (jpeg[pos] != 0xFF) return fail("Corrupt JPEG header");
+    uint8_t marker = jpeg[pos + 1];
+    if (marker == 0xFF) {
+      pos++;
+      continue;
+    }
+    uint16_t segLen = readU16(jpeg + pos + 2);
+    if (segLen < 2 || pos + 2 + segLen > len) return fail("Truncated JPEG header");
+    const uint8_t *body = jpeg + pos + 4;
+    size_t bodyLen = segLen - 2;
+
+    switch (marker) {
+      case M_DQT:
+        if (dqtCount >= 4) return fail("Too many DQT segments");
+        dqt[dqtCount] = jpeg + pos;
+        dqtLen[dqtCount++] = segLen + 2;
+        break;
+
+      case M_DHT:
+        if (dhtCount >= 8) return fail("Too many DHT segments");
+        dht[dhtCount] = jpeg + pos;
+        dhtLen[dhtCount++] = segLen + 2;
+        if (!parseDHT(body, bodyLen)) return false;
+        break;
+
+      case M_DRI:
+        if (bodyLen < 2) return fail("Invalid DRI");
+        restartInterval = readU16(body);
+        break;
+
+      case M_SOF0:
+      case M_SOF1: {
+        if (bodyLen < 6 || body[0] != 8) return fail("Only 8-bit baseline JPEG is supported");
+        height = readU16(body + 1);
+        width = readU16(body + 3);
+        componentCount = body[5];
+        if (componentCount != 1 && componentCount != 3) return fail("Unsupported component count");
+        if (bodyLen < 6 + 3u * componentCount) return fail("Invalid SOF");
+        uint8_t hMax = 1;
+        uint8_t vMax = 1;
+        for (uint8_t c = 0; c < componentCount; c++) {
+          Component &comp = components[c];
+          comp.id = body[6 + c * 3];
+          comp.h = body[7 + c * 3] >> 4;
+          comp.v = body[7 + c * 3] & 0x0F;
+          if (comp.h < 1 || comp.h > 2 || comp.v < 1 || comp.v > 2) return fail("Unsupported sampling factors");
+          if (comp.h > hMax) hMax = comp.h;
+          if (comp.v > vMax) vMax = comp.v;
+        }
+        if (componentCount == 1) {
+          // Non-interleaved scan: one block per MCU whatever the sampling factors
+          components[0].h = 1;
+          components[0].v = 1;
+          hMax = 1;
+          vMax = 1;
+        }
+        mcuW = 8 * hMax;
+        mcuH = 8 * vMax;
+        sof = jpeg + pos;
+        break;
+      }
+
+      case M_SOS: {
+        if (!sof) return fail("SOS before SOF");
+        if (bodyLen < 1 + 2u * componentCount + 3 || body[0] != componentCount) {
+          return fail("Only single-scan interleaved JPEG is supported");
+        }
+        for (uint8_t c = 0; c < componentCount; c++) {
+          uint8_t id = body[1 + c * 2];
+          uint8_t tables = body[2 + c * 2];
+          if (components[c].id != id) return fail("Unexpected scan component order");
+          components[c].dcTable = tables >> 4;
+          components[c].acTable = tables & 0x0F;
+          if (components[c].dcTable > 3 || components[c].acTable > 3) return fail("Invalid table selector");
+        }
+        sos = jpeg + pos;
+        sosLen = segLen + 2;
+        scanData = jpeg + pos + 2 + segLen;
+        scanEnd = jpeg + len;
+
+        if (dhtCount == 0) loadStandardTables();
+        for (uint8_t c = 0; c < componentCount; c++) {
+          if (!dcTables[components[c].dcTable].present || !acTables[components[c].acTable].present) {
+            return fail("Missing Huffman table");
+          }
+        }
+        return true;
+      }
+
+      default:
+        if (marker >= 0xC2 && marker <= 0xCF && marker != M_DHT && marker != 0xC8 && marker != 0xCC) {
+          return fail("Progressive/arithmetic JPEG is not supported");
+        }
+        break;  // APPn, COM, ...: not copied
+    }
+    pos += 2 + segLen;
+  }
+  return fail("No scan found");
+}
+
+bool JpegCropper::crop(const uint8_t *jpeg, size_t len, const JpegCropRect &request,
+                       uint8_t *out, size_t outCapacity, size_t &outLen, JpegCropRect &actual) {
+  errorMessage = NULL;
+  memset(&lastStats, 0, sizeof(lastStats));
+  outLen = 0;
+  if (!parseHeaders(jpeg, len)) return false;
+
+  uint16_t mcusX = (width + mcuW - 1) / mcuW;
+  uint16_t mcusY = (height + mcuH - 1) / mcuH;
+  if (request.x >= width || request.y >= height) return fail("Crop outside the image");
+
+  // Round out to the MCU grid and clip to the image
+  uint32_t reqRight = (uint32_t)request.x + (request.width ? request.width : 1);
+  uint32_t reqBottom = (uint32_t)request.y + (request.height ? request.height : 1);
+  uint16_t x0 = request.x / mcuW;
+  uint16_t y0 = request.y / mcuH;
+  uint16_t x1 = (uint16_t)((reqRight + mcuW - 1) / mcuW);
+  uint16_t y1 = (uint16_t)((reqBottom + mcuH - 1) / mcuH);
+  if (x1 > mcusX) x1 = mcusX;
+  if (y1 > mcusY) y1 = mcusY;
+
+  actual.x = x0 * mcuW;
+  actual.y = y0 * mcuH;
+  actual.width = (uint16_t)((x1 * mcuW < width ? x1 * mcuW : width) - actual.x);
+  actual.height = (uint16_t)((y1 * mcuH < height ? y1 * mcuH : height) - actual.y);
+  uint16_t outMcusX = x1 - x0;
+
+  // Headers: SOI, DQT, SOF, DHT, DRI, SOS
+  BitWriter bw = {out, outCapacity, 0, 0, 0, false};
+  bw.marker(M_SOI);
+  for (uint8_t i = 0; i < dqtCount; i++) bw.raw(dqt[i], dqtLen[i]);
+
+  size_t sofLen = 2 + readU16(sof + 2);
+  size_t sofPos = bw.pos;
+  bw.raw(sof, sofLen);
+  if (!bw.overflow) {
+    out[sofPos + 5] = actual.height >> 8;
+    out[sofPos + 6] = actual.height & 0xFF;
+    out[sofPos + 7] = actual.width >> 8;
+    out[sofPos + 8] = actual.width & 0xFF;
+  }
+
+  if (dhtCount) {
+    for (uint8_t i = 0; i < dhtCount; i++) bw.raw(dht[i], dhtLen[i]);
+  } else {
+    uint8_t header[4] = {0xFF, M_DHT, (uint8_t)((JPEG_STANDARD_DHT_SIZE + 2) >> 8),
+                         (uint8_t)((JPEG_STANDARD_DHT_SIZE + 2) & 0xFF)};
+    bw.raw(header, 4);
+    bw.raw(JPEG_STANDARD_DHT, JPEG_STANDARD_DHT_SIZE);
+  }
+
+  uint8_t dri[6] = {0xFF, M_DRI, 0x00, 0x04, (uint8_t)(outMcusX >> 8), (uint8_t)(outMcusX & 0xFF)};
+  bw.raw(dri, 6);
+  bw.raw(sos, sosLen);
+  if (bw.overflow) return fail("Output buffer too small");
+
+  // Entropy data
+  BitReader br;
+  br.reset(scanData, scanEnd);
+  int inPred[JPEG_CROP_MAX_COMPONENTS] = {0};
+  int outPred[JPEG_CROP_MAX_COMPONENTS] = {0};
+  uint32_t totalMcus = (uint32_t)mcusX * mcusY;
+  uint32_t lastMcu = (uint32_t)(y1 - 1) * mcusX + (x1 - 1);
+  uint8_t outRestart = 0;
+
+  for (uint32_t mcu = 0; mcu <= lastMcu && mcu < totalMcus; mcu++) {
+    if (restartInterval && mcu && mcu % restartInterval == 0) {
+      if (!br.restart()) return fail("Missing restart marker");
+      memset(inPred, 0, sizeof(inPred));
+
+      // Skip whole intervals that do not touch the rectangle
+      while (true) {
+        uint32_t first = mcu;
+        uint32_t last = mcu + restartInterval - 1;
+        if (last > lastMcu) break;
+        bool touches = false;
+        for (uint32_t row = first / mcusX; row <= last / mcusX && !touches; row++) {
+          if (row < y0 || row >= y1) continue;
+          uint32_t colStart = row == first / mcusX ? first % mcusX : 0;
+          uint32_t colEnd = row == last / mcusX ? last % mcusX : mcusX - 1;
+          touches = colStart < x1 && colEnd >= x0;
+        }
+        if (touches) break;
+        if (!br.skipToRestart()) return fail("Missing restart marker");
+        lastStats.intervalsSkipped++;
+        mcu += restartInterval;
+      }
+    }
+
+    uint16_t row = mcu / mcusX;
+    uint16_t col = mcu % mcusX;
+    bool selected = row >= y0 && row < y1 && col >= x0 && col < x1;
+
+    if (selected && col == x0 && row > y0) {
+      // New output row: close the previous restart interval
+      bw.flush();
+      bw.marker(M_RST0 + outRestart);
+      outRestart = (outRestart + 1) & 7;
+      memset(outPred, 0, sizeof(outPred));
+    }
+
+    for (uint8_t c = 0; c < componentCount; c++) {
+      const Component &comp = components[c];
+      const HuffTable &dc = dcTables[comp.dcTable];
+      const HuffTable &ac = acTables[comp.acTable];
+      int blocks = comp.h * comp.v;
+
+      for (int b = 0; b < blocks; b++) {
+        // DC: decode the difference, rebuild the absolute value
+        int s = decodeSymbol(br, dc.maxCode, dc.valPtr, dc.minCode, dc.values, dc.lookup);
+        if (s < 0 || s > 11) return fail("Corrupt entropy data");
+        int diff = 0;
+        if (s) {
+          br.fill();
+          diff = (int)br.peek(s);
+          br.skip(s);
+          if (diff < (1 << (s - 1))) diff -= (1 << s) - 1;
+        }
+        inPred[c] += diff;
+
+        if (selected) {
+          int outDiff = inPred[c] - outPred[c];
+          outPred[c] = inPred[c];
+          int size = magnitudeBits(outDiff);
+          if (!dc.codeLen[size]) return fail("DC table cannot code the new difference");
+          bw.putBits(dc.code[size], dc.codeLen[size]);
+          if (size) bw.putBits(outDiff < 0 ? outDiff - 1 : outDiff, size);
+        }
+
+        // AC: copy symbols and their extra bits as they are
+        for (int k = 1; k < 64;) {
+          int rs = decodeSymbol(br, ac.maxCode, ac.valPtr, ac.minCode, ac.values, ac.lookup);
+          if (rs < 0) return fail("Corrupt entropy data");
+          int size = rs & 0x0F;
+          uint32_t extra = 0;
+          if (size) {
+            br.fill();
+            extra = br.peek(size);
+            br.skip(size);
+          }
+          if (selected) {
+            bw.putBits(ac.code[rs], ac.codeLen[rs]);
+            if (size) bw.putBits(extra, size);
+          }
+          if (size == 0) {
+            if (rs != 0xF0) break;  // EOB
+            k += 16;                // ZRL
+          } else {
+            k += (rs >> 4) + 1;
+          }
+        }
+      }
+    }
+
+    lastStats.mcusDecoded++;
+    if (selected) lastStats.mcusWritten++;
+    if (bw.overflow) return fail("Output buffer too small");
+  }
+
+  bw.flush();
+  bw.marker(M_EOI);
+  if (bw.overflow) return fail("Output buffer too small");
+  outLen = bw.pos;
+  return true;
+}
+
+// DC quantizer of each component: entry 0 of the table its SOF selects
+bool JpegCropper::dcQuantizers(uint16_t *quant) {
+  uint16_t tables[4] = {0, 0, 0, 0};
+  for (uint8_t i = 0; i < dqtCount; i++) {
+    const uint8_t *body = dqt[i] + 4;
+    size_t bodyLen = dqtLen[i] - 4;
+    size_t pos = 0;
+    while (pos < bodyLen) {
+      bool wide = (body[pos] >> 4) != 0;
+      uint8_t id = body[pos] & 0x0F;
+      size_t size = wide ? 128 : 64;
+      if (id > 3 || pos + 1 + size > bodyLen) return fail("Invalid DQT");
+      tables[id] = wide ? readU16(body + pos + 1) : body[pos + 1];
+      pos += 1 + size;
+    }
+  }
+  for (uint8_t c = 0; c < componentCount; c++) {
+    uint8_t id = sof[4 + 8 + c * 3];
+    if (id > 3 || tables[id] == 0) return fail("Missing quantization table");
+    quant[c] = tables[id];
+  }
+  return true;
+}
+
+bool JpegCropper::decodeDc(const uint8_t *jpeg, size_t len, uint8_t *out, size_t outCapacity,
+                           uint16_t &outWidth, uint16_t &outHeight, bool &color) {
+  errorMessage = NULL;
+  memset(&lastStats, 0, sizeof(lastStats));
+  outWidth = 0;
+  outHeight = 0;
+  if (!parseHeaders(jpeg, len)) return false;
+  uint16_t quant[JPEG_CROP_MAX_COMPONENTS];
+  if (!dcQuantizers(quant)) return false;
+
+  color = componentCount == 3;
+  uint16_t blocksX = (width + 7) / 8;
+  uint16_t blocksY = (height + 7) / 8;
+  uint16_t w = color ? (uint16_t)(blocksX & ~1) : blocksX;
+  if (w == 0 || blocksY == 0) return fail("Image too small");
+  size_t stride = color ? (size_t)w * 2 : w;
+  if (stride * blocksY > outCapacity) return fail("Output buffer too small");
+
+  uint8_t hMax = mcuW / 8;
+  uint8_t vMax = mcuH / 8;
+  uint16_t mcusX = (width + mcuW - 1) / mcuW;
+  uint16_t mcusY = (height + mcuH - 1) / mcuH;
+  uint32_t totalMcus = (uint32_t)mcusX * mcusY;
+
+  BitReader br;
+  br.reset(scanData, scanEnd);
+  int pred[JPEG_CROP_MAX_COMPONENTS] = {0};
+
+  for (uint32_t mcu = 0; mcu < totalMcus; mcu++) {
+    if (restartInterval && mcu && mcu % restartInterval == 0) {
+      if (!br.restart()) return fail("Missing restart marker");
+      memset(pred, 0, sizeof(pred));
+    }
+    uint16_t row = mcu / mcusX;
+    uint16_t col = mcu % mcusX;
+
+    for (uint8_t c = 0; c < componentCount; c++) {
+      const Component &comp = components[c];
+      const HuffTable &dc = dcTables[comp.dcTable];
+      const HuffTable &ac = acTables[comp.acTable];
+      uint8_t scaleX = hMax / comp.h;
+      uint8_t scaleY = vMax / comp.v;
+
+      for (uint8_t by = 0; by < comp.v; by++) {
+        for (uint8_t bx = 0; bx < comp.h; bx++) {
+          int s = decodeSymbol(br, dc.maxCode, dc.valPtr, dc.minCode, dc.values, dc.lookup);
+          if (s < 0 || s > 11) return fail("Corrupt entropy data");
+          int diff = 0;
+          if (s) {
+            br.fill();
+            diff = (int)br.peek(s);
+            br.skip(s);
+            if (diff < (1 << (s - 1))) diff -= (1 << s) - 1;
+          }
+          pred[c] += diff;
+
+          // AC: symbols and extra bits are only skipped
+          for (int k = 1; k < 64;) {
+            int rs = decodeSymbol(br, ac.maxCode, ac.valPtr, ac.minCode, ac.values, ac.lookup);
+            if (rs < 0) return fail("Corrupt entropy data");
+            int size = rs & 0x0F;
+            if (size) {
+              br.fill();
+              br.skip(size);
+            } else if (rs != 0xF0) {
+              break;                // EOB
+            }
+            k += size ? (rs >> 4) + 1 : 16;
+          }
+
+          // Block mean: DC * Q / 8, level-shifted
+          int value = pred[c] * quant[c];
+          value = 128 + (value >= 0 ? value + 4 : value - 4) / 8;
+          uint8_t pixel = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+
+          // Top-left output pixel the block covers
+          uint32_t x = ((uint32_t)col * comp.h + bx) * scaleX;
+          uint32_t y = ((uint32_t)row * comp.v + by) * scaleY;
+          if (x >= w || y >= blocksY) continue;   // MCU padding
+          if (!color) {
+            out[y * stride + x] = pixel;
+          } else if (c == 0) {
+            out[y * stride + x * 2] = pixel;
+          } else if ((x & 1) == 0) {
+            uint8_t offset = c == 1 ? 1 : 3;
+            for (uint32_t yy = y; yy < y + scaleY && yy < blocksY; yy++) {
+              out[yy * stride + x * 2 + offset] = pixel;
+            }
+          }
+        }
+      }
+    }
+    lastStats.mcusDecoded++;
+  }
+
+  outWidth = w;
+  outHeight = blocksY;
+  return true;
+}
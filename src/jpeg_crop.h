@@ -0,0 +1,128 @@
+/**
+ * Lossless JPEG Crop
+ *
+ * Cuts an MCU-aligned rectangle out of a baseline JPEG without decoding
+ * pixels. The entropy-coded data is Huffman-decoded only far enough to find
+ * block boundaries; the selected blocks are re-entropy-coded with the source
+ * tables, with DC predictors recomputed for the new block order. No
+ * dequantization or IDCT is done, so the crop is bit-exact with the source.
+ *
+ * - Rows below the rectangle are never decoded.
+ * - When the source has restart markers, restart intervals that do not touch
+ *   the rectangle are skipped by scanning for the next RSTn marker.
+ * - The output restarts at every MCU row (DRI = MCUs per output row), so a
+ *   damaged row does not smear into the next one.
+ *
+ * The cropper has no Arduino dependencies so it can be built on a host.
+ */
+
+#ifndef JPEG_CROP_H
+#define JPEG_CROP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JPEG_CROP_MAX_COMPONENTS  3
+#define JPEG_CROP_HEADER_SLACK    1024
+
+// Annex K.3 Huffman tables as one DHT payload (also used by jpeg_encoder)
+extern const uint8_t JPEG_STANDARD_DHT[];
+extern const size_t JPEG_STANDARD_DHT_SIZE;
+
+struct JpegCropRect {
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+};
+
+struct JpegCropStats {
+  uint32_t mcusDecoded;       // MCUs Huffman-decoded (selected or in the way)
+  uint32_t mcusWritten;
+  uint32_t intervalsSkipped;  // restart intervals skipped without decoding
+};
+
+class JpegCropper {
+public:
+  JpegCropper();
+
+  // Crops request (pixels, rounded out to the MCU grid and clipped to the
+  // image) from jpeg into out. actual receives the rectangle that was cut.
+  bool crop(const uint8_t *jpeg, size_t len, const JpegCropRect &request,
+            uint8_t *out, size_t outCapacity, size_t &outLen, JpegCropRect &actual);
+
+  // 1/8-scale image from the DC coefficients: one pixel per 8x8 luma block,
+  // ceil(width/8) x ceil(height/8). Grayscale sources give one byte per
+  // pixel; colour sources give YUYV with the width rounded down to even
+  // (chroma taken from the block covering the left pixel of each pair).
+  bool decodeDc(const uint8_t *jpeg, size_t len, uint8_t *out, size_t outCapacity,
+                uint16_t &outWidth, uint16_t &outHeight, bool &color);
+
+  // Output buffer size that is always enough for a crop of a len-byte JPEG
+  static size_t maxOutputSize(size_t len) { return len + len / 4 + JPEG_CROP_HEADER_SLACK; }
+
+  // MCU size of the last parsed image (8 or 16 pixels per axis)
+  uint8_t mcuWidth() const { return mcuW; }
+  uint8_t mcuHeight() const { return mcuH; }
+  uint16_t imageWidth() const { return width; }
+  uint16_t imageHeight() const { return height; }
+
+  const JpegCropStats &stats() const { return lastStats; }
+  const char *error() const { return errorMessage; }
+
+private:
+  struct HuffTable {
+    bool present;
+    uint8_t bits[17];           // codes per length (1..16)
+    uint8_t values[256];
+    uint16_t lookup[512];       // 9-bit fast path: (length << 8) | symbol, 0 = slow path
+    int32_t maxCode[18];
+    int32_t valPtr[17];
+    uint16_t minCode[17];
+    uint16_t code[256];         // encoder: code and length per symbol
+    uint8_t codeLen[256];
+  };
+
+  struct Component {
+    uint8_t id;
+    uint8_t h;
+    uint8_t v;
+    uint8_t dcTable;
+    uint8_t acTable;
+  };
+
+  const char *errorMessage;
+  JpegCropStats lastStats;
+
+  uint16_t width;
+  uint16_t height;
+  uint8_t componentCount;
+  Component components[JPEG_CROP_MAX_COMPONENTS];
+  uint8_t mcuW;
+  uint8_t mcuH;
+  uint16_t restartInterval;
+  HuffTable dcTables[4];
+  HuffTable acTables[4];
+
+  // Source segments copied verbatim to the output
+  const uint8_t *dqt[4];
+  size_t dqtLen[4];
+  uint8_t dqtCount;
+  const uint8_t *dht[8];
+  size_t dhtLen[8];
+  uint8_t dhtCount;
+  const uint8_t *sof;
+  const uint8_t *sos;
+  size_t sosLen;
+  const uint8_t *scanData;
+  const uint8_t *scanEnd;
+
+  bool fail(const char *message);
+  bool parseHeaders(const uint8_t *jpeg, size_t len);
+  bool parseDHT(const uint8_t *segment, size_t len);
+  bool dcQuantizers(uint16_t *quant);
+  void loadStandardTables();
+  static void buildTable(HuffTable &table);
+};
+
+#endif // JPEG_CROP_H
@@ -0,0 +1,419 @@
+/**
+ * Fixed-Point JPEG Encoder Implementation
+ */
+
+#include "jpeg_encoder.h"
+#include <string.h>
+
+JpegEncoder jpegEncoder;
+
+// JPEG markers
+#define M_SOF0  0xC0
+#define M_DHT   0xC4
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_APP0  0xE0
+
+// Worst case for one 16x8 MCU (4 blocks, every coefficient coded with a
+// 16-bit code plus 10 extra bits, every byte stuffed)
+#define MCU_WORST_BYTES   1700
+#define HEADER_BYTES      700
+
+// Fixed-point DCT constants (13 fractional bits)
+#define FIX_BITS          13
+#define FIX_0_382683433   3135
+#define FIX_0_541196100   4433
+#define FIX_0_707106781   5793
+#define FIX_1_306562965   10703
+#define MUL(x, c)         (((x) * (c) + (1 << (FIX_BITS - 1))) >> FIX_BITS)
+
+// Samples enter the DCT with 2 fractional bits so the butterfly roundings
+// stay below the quantizer step even at quality 100; quantization drops them
+#define DCT_EXTRA_BITS    2
+#define QUANT_SHIFT       (28 + DCT_EXTRA_BITS)
+
+static const uint8_t ZIGZAG[64] = {
+   0,  1,  8, 16,  9,  2,  3, 10,
+  17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34,
+  27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36,
+  29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46,
+  53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Annex K.1 quantization tables, natural order
+static const uint8_t BASE_QUANT[2][64] = {
+  {16, 11, 10, 16,  24,  40,  51,  61,
+   12, 12, 14, 19,  26,  58,  60,  55,
+   14, 13, 16, 24,  40,  57,  69,  56,
+   14, 17, 22, 29,  51,  87,  80,  62,
+   18, 22, 37, 56,  68, 109, 103,  77,
+   24, 35, 55, 64,  81, 104, 113,  92,
+   49, 64, 78, 87, 103, 121, 120, 101,
+   72, 92, 95, 98, 112, 100, 103,  99},
+  {17, 18, 24, 47, 99, 99, 99, 99,
+   18, 21, 26, 66, 99, 99, 99, 99,
+   24, 26, 56, 99, 99, 99, 99, 99,
+   47, 66, 99, 99, 99, 99, 99, 99,
+   99, 99, 99, 99, 99, 99, 99, 99,
+   99, 99, 99, 99, 99, 99, 99, 99,
+   99, 99, 99, 99, 99, 99, 99, 99,
+   99, 99, 99, 99, 99, 99, 99, 99}
+};
+
+// AAN output scale per frequency, cos(k*pi/16) * sqrt(2) in 2^14 units
+static const uint32_t AAN_SCALE[8] = {16384, 22725, 21407, 19266, 16384, 12873, 8867, 4520};
+
+// ---------------------------------------------------------------------------
+// Entropy-coded segment writer (0xFF stuffing, bounds checked per MCU)
+
+struct BitWriter {
+  uint8_t *out;
+  size_t capacity;
+  size_t pos;
+  uint32_t bits;
+  int count;
+
+  inline void put(uint32_t code, int len) {
+    bits = (bits << len) | code;
+    count += len;
+    while (count >= 8) {
+      uint8_t byte = (uint8_t)(bits >> (count - 8));
+      out[pos++] = byte;
+      if (byte == 0xFF) out[pos++] = 0x00;
+      count -= 8;
+    }
+  }
+
+  void flush() {
+    if (count > 0) put((1u << (8 - count)) - 1, 8 - count);
+  }
+
+  void raw(const uint8_t *data, size_t len) {
+    memcpy(out + pos, data, len);
+    pos += len;
+  }
+
+  void marker(uint8_t code, size_t payloadLen) {
+    out[pos++] = 0xFF;
+    out[pos++] = code;
+    if (code != M_SOI && code != M_EOI) {
+      out[pos++] = (uint8_t)((payloadLen + 2) >> 8);
+      out[pos++] = (uint8_t)((payloadLen + 2) & 0xFF);
+    }
+  }
+};
+
+static inline int magnitudeBits(int32_t value) {
+  if (value < 0) value = -value;
+  return value ? 32 - __builtin_clz((uint32_t)value) : 0;
+}
+
+// In-place 2-D AAN forward DCT; output is scaled by 8 * AAN_SCALE[u] * AAN_SCALE[v]
+static void forwardDct(int32_t *block) {
+  int32_t *p = block;
+  for (int pass = 0; pass < 2; pass++) {
+    int step = pass == 0 ? 1 : 8;
+    for (int i = 0; i < 8; i++) {
+      int32_t *d = pass == 0 ? p + i * 8 : p + i;
+      int32_t tmp0 = d[0 * step] + d[7 * step];
+      int32_t tmp7 = d[0 * step] - d[7 * step];
+      int32_t tmp1 = d[1 * step] + d[6 * step];
+      int32_t tmp6 = d[1 * step] - d[6 * step];
+      int32_t tmp2 = d[2 * step] + d[5 * step];
+      int32_t tmp5 = d[2 * step] - d[5 * step];
+      int32_t tmp3 = d[3 * step] + d[4 * step];
+      int32_t tmp4 = d[3 * step] - d[4 * step];
+
+      // Even part
+      int32_t tmp10 = tmp0 + tmp3;
+      int32_t tmp13 = tmp0 - tmp3;
+      int32_t tmp11 = tmp1 + tmp2;
+      int32_t tmp12 = tmp1 - tmp2;
+      d[0 * step] = tmp10 + tmp11;
+      d[4 * step] = tmp10 - tmp11;
+      int32_t z1 = MUL(tmp12 + tmp13, FIX_0_707106781);
+      d[2 * step] = tmp13 + z1;
+      d[6 * step] = tmp13 - z1;
+
+      // Odd part
+      tmp10 = tmp4 + tmp5;
+      tmp11 = tmp5 + tmp6;
+      tmp12 = tmp6 + tmp7;
+      int32_t z5 = MUL(tmp10 - tmp12, FIX_0_382683433);
+      int32_t z2 = MUL(tmp10, FIX_0_541196100) + z5;
+      int32_t z4 = MUL(tmp12, FIX_1_306562965) + z5;
+      int32_t z3 = MUL(tmp11, FIX_0_707106781);
+      int32_t z11 = tmp7 + z3;
+      int32_t z13 = tmp7 - z3;
+      d[5 * step] = z13 + z2;
+      d[3 * step] = z13 - z2;
+      d[1 * step] = z11 + z4;
+      d[7 * step] = z11 - z4;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+JpegEncoder::JpegEncoder() : currentQuality(0), errorMessage(NULL) {
+  memset(&encodedRegion, 0, sizeof(encodedRegion));
+  buildHuffman();
+  setQuality(80);
+}
+
+bool JpegEncoder::fail(const char *message) {
+  errorMessage = message;
+  return false;
+}
+
+void JpegEncoder::setQuality(uint8_t quality) {
+  if (quality < 1) quality = 1;
+  if (quality > 100) quality = 100;
+  if (quality == currentQuality) return;
+  currentQuality = quality;
+
+  // IJG scaling of the Annex K tables
+  uint32_t scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+  for (int t = 0; t < 2; t++) {
+    for (int z = 0; z < 64; z++) {
+      uint8_t n = ZIGZAG[z];
+      uint32_t q = (BASE_QUANT[t][n] * scale + 50) / 100;
+      if (q < 1) q = 1;
+      if (q > 255) q = 255;
+      quant[t][z] = (uint8_t)q;
+      // 2^56 / (q * 8 * scale_u * scale_v), AAN scales in 2^14 units
+      uint64_t divisor = (uint64_t)q * 8 * AAN_SCALE[n / 8] * AAN_SCALE[n % 8];
+      reciprocal[t][n] = (uint32_t)(((1ULL << 56) + divisor / 2) / divisor);
+      deadZone[t][n] = (uint32_t)(((1ULL << (QUANT_SHIFT - 1)) + reciprocal[t][n] - 1) / reciprocal[t][n]);
+    }
+  }
+}
+
+void JpegEncoder::buildHuffman() {
+  // JPEG_STANDARD_DHT holds DC0, DC1, AC0, AC1 as (class/id, 16 counts, values)
+  const uint8_t *p = JPEG_STANDARD_DHT;
+  const uint8_t *end = JPEG_STANDARD_DHT + JPEG_STANDARD_DHT_SIZE;
+  memset(dcLen, 0, sizeof(dcLen));
+  memset(acLen, 0, sizeof(acLen));
+  while (p + 17 <= end) {
+    bool ac = (p[0] >> 4) != 0;
+    uint8_t id = p[0] & 0x0F;
+    const uint8_t *counts = p + 1;
+    const uint8_t *values = p + 17;
+    uint16_t code = 0;
+    size_t k = 0;
+    for (int len = 1; len <= 16; len++) {
+      for (int i = 0; i < counts[len - 1]; i++, k++) {
+        uint8_t symbol = values[k];
+        if (ac) {
+          acCode[id][symbol] = code;
+          acLen[id][symbol] = (uint8_t)len;
+        } else if (symbol < 12) {
+          dcCode[id][symbol] = code;
+          dcLen[id][symbol] = (uint8_t)len;
+        }
+        code++;
+      }
+      code <<= 1;
+    }
+    if (id == 0) {
+      lumaDht[ac ? 1 : 0] = p;
+      lumaDhtLen[ac ? 1 : 0] = (uint16_t)(17 + k);
+    }
+    p = values + k;
+  }
+}
+
+size_t JpegEncoder::maxOutputSize(uint16_t width, uint16_t height, JpegPixelFormat format) {
+  size_t raw = (size_t)width * height * (format == JPEG_PIXELS_YUYV ? 2 : 1);
+  return raw + MCU_WORST_BYTES + HEADER_BYTES;
+}
+
+bool JpegEncoder::encode(const uint8_t *pixels, uint16_t width, uint16_t height, JpegPixelFormat format,
+                         uint8_t *out, size_t outCapacity, size_t &outLen) {
+  JpegCropRect all = {0, 0, width, height};
+  size_t stride = (size_t)width * (format == JPEG_PIXELS_YUYV ? 2 : 1);
+  return encode(pixels, width, height, stride, format, all, out, outCapacity, outLen);
+}
+
+bool JpegEncoder::encode(const uint8_t *pixels, uint16_t width, uint16_t height, size_t stride,
+                         JpegPixelFormat format, const JpegCropRect &region,
+                         uint8_t *out, size_t outCapacity, size_t &outLen) {
+  errorMessage = NULL;
+  outLen = 0;
+  if (pixels == NULL || width == 0 || height == 0) return fail("Empty frame");
+  if (format == JPEG_PIXELS_YUYV && (width & 1)) return fail("YUYV width must be even");
+  if (region.x >= width || region.y >= height) return fail("Region outside the image");
+  if (outCapacity < HEADER_BYTES + MCU_WORST_BYTES) return fail("Output buffer too small");
+
+  // Clip the region; YUYV pixel pairs share chroma, so start on an even pixel
+  bool yuyv = format == JPEG_PIXELS_YUYV;
+  uint16_t x0 = yuyv ? (region.x & ~1) : region.x;
+  uint16_t y0 = region.y;
+  uint32_t right = (uint32_t)region.x + (region.width ? region.width : 1);
+  uint32_t bottom = (uint32_t)region.y + (region.height ? region.height : 1);
+  uint16_t w = (uint16_t)((right < width ? right : width) - x0);
+  uint16_t h = (uint16_t)((bottom < height ? bottom : height) - y0);
+  encodedRegion.x = x0;
+  encodedRegion.y = y0;
+  encodedRegion.width = w;
+  encodedRegion.height = h;
+
+  BitWriter bw = {out, outCapacity, 0, 0, 0};
+
+  // Headers: SOI, APP0 (JFIF), DQT, SOF0, DHT, SOS
+  static const uint8_t JFIF[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+  bw.marker(M_SOI, 0);
+  bw.marker(M_APP0, sizeof(JFIF));
+  bw.raw(JFIF, sizeof(JFIF));
+
+  uint8_t tables = yuyv ? 2 : 1;
+  bw.marker(M_DQT, 65 * tables);
+  for (uint8_t t = 0; t < tables; t++) {
+    out[bw.pos++] = t;
+    bw.raw(quant[t], 64);
+  }
+
+  uint8_t components = yuyv ? 3 : 1;
+  bw.marker(M_SOF0, 6 + 3 * components);
+  uint8_t sof[6 + 9] = {8, (uint8_t)(h >> 8), (uint8_t)(h & 0xFF), (uint8_t)(w >> 8), (uint8_t)(w & 0xFF),
+                        components,
+                        1, (uint8_t)(yuyv ? 0x21 : 0x11), 0,
+                        2, 0x11, 1,
+                        3, 0x11, 1};
+  bw.raw(sof, 6 + 3 * components);
+
+  // Grayscale only needs the luminance tables
+  if (yuyv) {
+    bw.marker(M_DHT, JPEG_STANDARD_DHT_SIZE);
+    bw.raw(JPEG_STANDARD_DHT, JPEG_STANDARD_DHT_SIZE);
+  } else {
+    bw.marker(M_DHT, lumaDhtLen[0] + lumaDhtLen[1]);
+    bw.raw(lumaDht[0], lumaDhtLen[0]);
+    bw.raw(lumaDht[1], lumaDhtLen[1]);
+  }
+
+  bw.marker(M_SOS, 4 + 2 * components);
+  uint8_t sos[1 + 6 + 3] = {components, 1, 0x00, 2, 0x11, 3, 0x11};
+  uint8_t sosTail[3] = {0, 63, 0};
+  bw.raw(sos, 1 + 2 * components);
+  bw.raw(sosTail, 3);
+
+  // Scan: one row of MCUs at a time
+  uint8_t mcuW = yuyv ? 16 : 8;
+  uint16_t mcusX = (w + mcuW - 1) / mcuW;
+  uint16_t mcusY = (h + 7) / 8;
+  int32_t predictor[3] = {0, 0, 0};
+  int32_t block[64];
+
+  for (uint16_t my = 0; my < mcusY; my++) {
+    // Source rows for this MCU row, repeating the last row past the bottom
+    const uint8_t *rows[8];
+    for (int r = 0; r < 8; r++) {
+      uint16_t y = my * 8 + r;
+      if (y >= h) y = h - 1;
+      rows[r] = pixels + (size_t)(y0 + y) * stride;
+    }
+
+    for (uint16_t mx = 0; mx < mcusX; mx++) {
+      if (bw.pos + MCU_WORST_BYTES > outCapacity) return fail("Output buffer too small");
+
+      uint8_t blocks = yuyv ? 4 : 1;
+      for (uint8_t b = 0; b < blocks; b++) {
+        // Block b: Y (or Y left/right for YUYV), then Cb, Cr
+        uint8_t comp = yuyv ? (b < 2 ? 0 : b - 1) : 0;
+
+        // Source columns: byte offset of the first sample, distance between
+        // samples, and how many lie inside the region (the rest repeat the last)
+        uint32_t x;
+        uint32_t first;
+        uint32_t step;
+        int valid;
+        if (!yuyv) {
+          x = mx * 8;
+          first = x0 + x;
+          step = 1;
+          valid = w - x < 8 ? w - x : 8;
+        } else if (comp == 0) {
+          x = mx * 16 + b * 8;
+          if (x >= w) x = w - 1;
+          first = (x0 + x) * 2;
+          step = 2;
+          valid = w - x < 8 ? w - x : 8;
+        } else {
+          // One chroma sample per pixel pair: U at +1, V at +3
+          x = mx * 16;
+          first = (x0 + x) * 2 + (comp == 1 ? 1 : 3);
+          step = 4;
+          valid = (w - x + 1) / 2 < 8 ? (w - x + 1) / 2 : 8;
+        }
+
+        for (int r = 0; r < 8; r++) {
+          const uint8_t *src = rows[r] + first;
+          int32_t *dst = block + r * 8;
+          int c = 0;
+          for (; c < valid; c++) dst[c] = ((int32_t)src[c * step] - 128) * (1 << DCT_EXTRA_BITS);
+          for (; c < 8; c++) dst[c] = dst[valid - 1];
+        }
+
+        forwardDct(block);
+
+        // Quantize and entropy-code in zigzag order
+        uint8_t table = comp == 0 ? 0 : 1;
+        const uint32_t *recip = reciprocal[table];
+        const uint32_t *zero = deadZone[table];
+        int32_t coef[64];
+        int last = 0;
+        for (int z = 0; z < 64; z++) {
+          int n = ZIGZAG[z];
+          int32_t v = block[n];
+          uint32_t a = (uint32_t)(v < 0 ? -v : v);
+          if (a < zero[n]) {
+            coef[z] = 0;
+            continue;
+          }
+          int32_t q = (int32_t)(((uint64_t)a * recip[n] + (1u << (QUANT_SHIFT - 1))) >> QUANT_SHIFT);
+          if (q > 1023) q = 1023;
+          coef[z] = v < 0 ? -q : q;
+          last = z;
+        }
+
+        int32_t diff = coef[0] - predictor[comp];
+        predictor[comp] = coef[0];
+        int nbits = magnitudeBits(diff);
+        bw.put(dcCode[table][nbits], dcLen[table][nbits]);
+        if (nbits) bw.put((uint32_t)(diff < 0 ? diff - 1 : diff) & ((1u << nbits) - 1), nbits);
+
+        int run = 0;
+        for (int z = 1; z <= last; z++) {
+          int32_t v = coef[z];
+          if (v == 0) {
+            run++;
+            continue;
+          }
+          while (run > 15) {
+            bw.put(acCode[table][0xF0], acLen[table][0xF0]);
+            run -= 16;
+          }
+          nbits = magnitudeBits(v);
+          uint8_t symbol = (uint8_t)((run << 4) | nbits);
+          bw.put(acCode[table][symbol], acLen[table][symbol]);
+          bw.put((uint32_t)(v < 0 ? v - 1 : v) & ((1u << nbits) - 1), nbits);
+          run = 0;
+        }
+        if (last < 63) bw.put(acCode[table][0x00], acLen[table][0x00]);
+      }
+    }
+  }
+
+  bw.flush();
+  if (bw.pos + 2 > outCapacity) return fail("Output buffer too small");
+  bw.marker(M_EOI, 0);
+  outLen = bw.pos;
+  return true;
+}
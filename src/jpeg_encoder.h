@@ -0,0 +1,82 @@
+/**
+ * Fixed-Point JPEG Encoder
+ *
+ * Baseline JPEG encoder for raw sensor frames (grayscale or YUV422), used
+ * when the camera runs in a raw pixel format so analysis can read pixels
+ * without decoding. Everything is integer:
+ *
+ * - Forward DCT: AAN butterfly with 13-bit fixed-point constants on samples
+ *   carrying 2 extra fractional bits.
+ * - Quantization: the AAN output scale is folded into per-quality reciprocal
+ *   tables, so each coefficient costs one multiply and a shift.
+ * - Entropy coding: Annex K Huffman tables, precomputed code/length per
+ *   symbol.
+ *
+ * The image is processed one row of MCUs at a time straight from the frame
+ * buffer (8x8 grayscale MCUs, 16x8 Y/Cb/Cr MCUs for YUV422, which needs no
+ * chroma resampling). No Arduino dependencies, so it can be built on a host.
+ * One instance is not reentrant; the HTTP streams share jpegEncoder from the
+ * async_tcp task.
+ */
+
+#ifndef JPEG_ENCODER_H
+#define JPEG_ENCODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "jpeg_crop.h"
+
+enum JpegPixelFormat : uint8_t {
+  JPEG_PIXELS_GRAY = 0,   // 1 byte per pixel
+  JPEG_PIXELS_YUYV        // YUV422, Y0 U Y1 V per pixel pair (esp32-camera order); even widths only
+};
+
+class JpegEncoder {
+public:
+  JpegEncoder();
+
+  // IJG quality scale: 1 (worst) .. 100 (best)
+  void setQuality(uint8_t quality);
+  uint8_t quality() const { return currentQuality; }
+
+  // Encodes region (clipped to the image; x rounded down to an even pixel for
+  // YUYV) of a width x height frame. stride is bytes per source row.
+  bool encode(const uint8_t *pixels, uint16_t width, uint16_t height, size_t stride,
+              JpegPixelFormat format, const JpegCropRect &region,
+              uint8_t *out, size_t outCapacity, size_t &outLen);
+
+  // Whole frame with tightly packed rows
+  bool encode(const uint8_t *pixels, uint16_t width, uint16_t height, JpegPixelFormat format,
+              uint8_t *out, size_t outCapacity, size_t &outLen);
+
+  // Output buffer size that is enough in practice (raw size plus slack);
+  // encode() fails cleanly instead of overrunning a smaller buffer
+  static size_t maxOutputSize(uint16_t width, uint16_t height, JpegPixelFormat format);
+
+  // Region actually encoded by the last call, after clipping and alignment
+  const JpegCropRect &lastRegion() const { return encodedRegion; }
+  const char *error() const { return errorMessage; }
+
+private:
+  uint8_t currentQuality;
+  const char *errorMessage;
+  JpegCropRect encodedRegion;
+
+  uint8_t quant[2][64];         // zigzag order, as written to DQT
+  uint32_t reciprocal[2][64];   // natural order, 2^28 / (q * AAN scale * 8)
+  uint32_t deadZone[2][64];     // DCT outputs below this quantize to 0
+
+  uint16_t dcCode[2][12];
+  uint8_t dcLen[2][12];
+  uint16_t acCode[2][256];
+  uint8_t acLen[2][256];
+  const uint8_t *lumaDht[2];    // DC0 and AC0 entries of JPEG_STANDARD_DHT
+  uint16_t lumaDhtLen[2];
+
+  void buildHuffman();
+  bool fail(const char *message);
+};
+
+extern JpegEncoder jpegEncoder;
+
+#endif // JPEG_ENCODER_H
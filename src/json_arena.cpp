@@ -0,0 +1,242 @@
+/**
+ * PSRAM Arena Allocator Implementation
+ */
+
+#include "json_arena.h"
+#include <esp_heap_caps.h>
+
+JsonArenaPool jsonArenaPool;
+
+static const size_t NO_BLOCK = (size_t)-1;
+static const size_t BLOCK_HEADER = sizeof(uint32_t);
+
+static inline size_t align4(size_t size) {
+  return (size + 3) & ~(size_t)3;
+}
+
+static void *psramAlloc(size_t size) {
+  void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  return ptr ? ptr : malloc(size);
+}
+
+// Arena bodies are PSRAM only: a 64KB+ block taken from the internal heap
+// would starve WiFi and the camera
+static void *arenaAlloc(size_t size) {
+  return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+/**
+ * Response that streams the serialized body straight out of the arena and
+ * hands the arena back to the pool when the request is torn down. A body
+ * that overflowed the arena is its own heap block and is freed with it
+ */
+class ArenaJsonResponse : public AsyncProgmemResponse {
+public:
+  ArenaJsonResponse(int code, const uint8_t *body, size_t len, JsonArena *arena)
+    : AsyncProgmemResponse(code, "application/json", body, len), body((void *)body), arena(arena) {}
+
+  ~ArenaJsonResponse() {
+    arena->deallocate(body);
+    jsonArenaPool.release(arena);
+  }
+
+private:
+  void *body;
+  JsonArena *arena;
+};
+
+// ---------------------------------------------------------------------------
+// JsonArena
+
+JsonArena::JsonArena()
+  : base(NULL), capacityBytes(0), usedBytes(0), lastBlock(NO_BLOCK),
+    highWaterBytes(0), pooled(false), inUse(false) {
+}
+
+bool JsonArena::begin(size_t size) {
+  base = (uint8_t *)arenaAlloc(size);
+  capacityBytes = base ? size : 0;
+  reset();
+  return base != NULL;
+}
+
+void JsonArena::reset() {
+  usedBytes = 0;
+  lastBlock = NO_BLOCK;
+}
+
+bool JsonArena::owns(const void *ptr) const {
+  return base && (const uint8_t *)ptr >= base && (const uint8_t *)ptr < base + capacityBytes;
+}
+
+size_t JsonArena::available() const {
+  return usedBytes + BLOCK_HEADER < capacityBytes ? (capacityBytes - usedBytes - BLOCK_HEADER) & ~(size_t)3 : 0;
+}
+
+size_t JsonArena::blockSize(const void *ptr) {
+  return *(const uint32_t *)((const uint8_t *)ptr - BLOCK_HEADER);
+}
+
+void *JsonArena::allocate(size_t size) {
+  size_t need = BLOCK_HEADER + align4(size);
+  if (usedBytes + need > capacityBytes) {
+    jsonArenaPool.recordOverflow();
+    return psramAlloc(size);
+  }
+
+  uint8_t *block = base + usedBytes;
+  *(uint32_t *)block = size;
+  lastBlock = usedBytes;
+  usedBytes += need;
+  if (usedBytes > highWaterBytes) highWaterBytes = usedBytes;
+  return block + BLOCK_HEADER;
+}
+
+void JsonArena::deallocate(void *ptr) {
+  if (!ptr) return;
+  if (!owns(ptr)) {
+    free(ptr);
+    return;
+  }
+
+  // Only the newest block can be given back; everything else is reclaimed
+  // in one step when the arena is reset
+  if ((uint8_t *)ptr - BLOCK_HEADER == base + lastBlock) {
+    usedBytes = lastBlock;
+    lastBlock = NO_BLOCK;
+  }
+}
+
+void *JsonArena::reallocate(void *ptr, size_t newSize) {
+  if (!ptr) return allocate(newSize);
+
+  if (!owns(ptr)) {
+    void *grown = heap_caps_realloc(ptr, newSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    return grown ? grown : realloc(ptr, newSize);
+  }
+
+  // ArduinoJson grows strings and shrinks pools at the tail, which is the
+  // common case and can be done in place
+  if ((uint8_t *)ptr - BLOCK_HEADER == base + lastBlock) {
+    size_t need = BLOCK_HEADER + align4(newSize);
+    if (lastBlock + need <= capacityBytes) {
+      *(uint32_t *)(base + lastBlock) = newSize;
+      usedBytes = lastBlock + need;
+      if (usedBytes > highWaterBytes) highWaterBytes = usedBytes;
+      return ptr;
+    }
+  }
+
+  size_t oldSize = blockSize(ptr);
+  void *moved = allocate(newSize);
+  if (moved) {
+    memcpy(moved, ptr, oldSize < newSize ? oldSize : newSize);
+  }
+  return moved;
+}
+
+// ---------------------------------------------------------------------------
+// JsonArenaPool
+
+JsonArenaPool::JsonArenaPool()
+  : leases(0), poolMisses(0), overflows(0), highWater(0), temporaryHighWater(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+bool JsonArenaPool::begin() {
+  bool ok = true;
+  for (uint8_t i = 0; i < JSON_ARENA_COUNT; i++) {
+    arenas[i].pooled = true;
+    if (!arenas[i].begin(JSON_ARENA_SIZE)) {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+JsonArena *JsonArenaPool::acquire(size_t minSize) {
+  portENTER_CRITICAL(&lock);
+  leases++;
+  if (minSize <= JSON_ARENA_SIZE) {
+    for (uint8_t i = 0; i < JSON_ARENA_COUNT; i++) {
+      if (!arenas[i].inUse && arenas[i].base) {
+        arenas[i].inUse = true;
+        portEXIT_CRITICAL(&lock);
+        return &arenas[i];
+      }
+    }
+    poolMisses++;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  JsonArena *temporary = new JsonArena();
+  temporary->begin(minSize > JSON_ARENA_SIZE ? minSize : JSON_ARENA_SIZE);
+  temporary->inUse = true;
+  return temporary;
+}
+
+void JsonArenaPool::release(JsonArena *arena) {
+  if (!arena) return;
+
+  if (!arena->pooled) {
+    // Temporary arenas are sized to their request, so they are tracked apart
+    // from the pooled ones and never count against JSON_ARENA_SIZE
+    portENTER_CRITICAL(&lock);
+    if (arena->highWaterBytes > temporaryHighWater) temporaryHighWater = arena->highWaterBytes;
+    portEXIT_CRITICAL(&lock);
+    free(arena->base);
+    delete arena;
+    return;
+  }
+
+  arena->reset();
+  portENTER_CRITICAL(&lock);
+  if (arena->highWaterBytes > highWater) highWater = arena->highWaterBytes;
+  arena->inUse = false;
+  portEXIT_CRITICAL(&lock);
+}
+
+void JsonArenaPool::send(AsyncWebServerRequest *request, int code, JsonDocument &doc, JsonArena *arena) {
+  size_t len = measureJson(doc);
+  char *body = (char *)arena->allocate(len + 1);
+  if (!body) {
+    release(arena);
+    request->send(500, "application/json", "{\"error\":\"Out of memory\"}");
+    return;
+  }
+  serializeJson(doc, body, len + 1);
+  sendBody(request, code, body, len, arena);
+}
+
+void JsonArenaPool::sendBody(AsyncWebServerRequest *request, int code, const char *body, size_t len,
+                             JsonArena *arena) {
+  request->send(new ArenaJsonResponse(code, (const uint8_t *)body, len, arena));
+}
+
+JsonArenaStats JsonArenaPool::stats() const {
+  JsonArenaStats s;
+  s.leases = leases;
+  s.poolMisses = poolMisses;
+  s.overflows = overflows;
+  s.highWater = highWater;
+  s.temporaryHighWater = temporaryHighWater;
+  s.inUse = 0;
+  for (uint8_t i = 0; i < JSON_ARENA_COUNT; i++) {
+    if (arenas[i].inUse) s.inUse++;
+    if (arenas[i].highWaterBytes > s.highWater) s.highWater = arenas[i].highWaterBytes;
+  }
+  return s;
+}
+
+void JsonArenaPool::reportStats(JsonObject out) const {
+  JsonArenaStats s = stats();
+  out["pool_size"] = JSON_ARENA_COUNT;
+  out["arena_bytes"] = JSON_ARENA_SIZE;
+  out["in_use"] = s.inUse;
+  out["leases"] = s.leases;
+  out["pool_misses"] = s.poolMisses;
+  out["overflows"] = s.overflows;
+  out["high_water_bytes"] = s.highWater;
+  out["high_water_percent"] = (float)s.highWater * 100 / JSON_ARENA_SIZE;
+  out["temporary_high_water_bytes"] = s.temporaryHighWater;
+}
@@ -0,0 +1,102 @@
+/**
+ * PSRAM Arena Allocator for JSON Responses
+ *
+ * A small pool of bump-pointer arenas in PSRAM, plugged into ArduinoJson's
+ * Allocator interface. A handler leases one arena, builds its JsonDocument
+ * in it, then serializes straight into an arena buffer that is sent as the
+ * response body. The arena returns to the pool when the response is freed,
+ * so JSON endpoints no longer churn the internal heap.
+ */
+
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+#define JSON_ARENA_COUNT 4
+#define JSON_ARENA_SIZE  (64 * 1024)
+
+class JsonArena : public ArduinoJson::Allocator {
+public:
+  JsonArena();
+
+  bool begin(size_t size);
+  void reset();
+
+  void *allocate(size_t size) override;
+  void deallocate(void *ptr) override;
+  void *reallocate(void *ptr, size_t newSize) override;
+
+  size_t used() const { return usedBytes; }
+  size_t highWater() const { return highWaterBytes; }
+  size_t capacity() const { return capacityBytes; }
+  // Largest block allocate() can still carve out of the arena itself
+  size_t available() const;
+  bool isPooled() const { return pooled; }
+
+private:
+  friend class JsonArenaPool;
+
+  uint8_t *base;
+  size_t capacityBytes;
+  size_t usedBytes;
+  size_t lastBlock;      // offset of the most recent block (can grow/shrink in place)
+  size_t highWaterBytes;
+  bool pooled;
+  bool inUse;
+
+  bool owns(const void *ptr) const;
+  static size_t blockSize(const void *ptr);
+};
+
+struct JsonArenaStats {
+  uint32_t leases;
+  uint32_t poolMisses;      // pool exhausted, temporary arena allocated
+  uint32_t overflows;       // allocations that did not fit in an arena
+  uint32_t inUse;
+  size_t highWater;         // largest pooled arena usage seen
+  size_t temporaryHighWater; // largest temporary arena usage seen
+};
+
+class JsonArenaPool {
+public:
+  JsonArenaPool();
+
+  bool begin();
+
+  // Always returns an arena of at least minSize bytes: a pooled one when it
+  // fits and one is free, otherwise a temporary PSRAM arena. Arenas never
+  // come from the internal heap; without PSRAM the temporary arena has no
+  // capacity and every allocation overflows on its own
+  JsonArena *acquire(size_t minSize = JSON_ARENA_SIZE);
+  void release(JsonArena *arena);
+
+  // Serializes doc into the arena and sends it; the response takes ownership
+  // of the arena and releases it once the body has been written
+  void send(AsyncWebServerRequest *request, int code, JsonDocument &doc, JsonArena *arena);
+
+  // Sends a body allocated from the arena. A body that overflowed to the heap
+  // is sent as is and freed together with the response
+  void sendBody(AsyncWebServerRequest *request, int code, const char *body, size_t len, JsonArena *arena);
+
+  JsonArenaStats stats() const;
+  void recordOverflow() { overflows++; }
+
+  // Adds pool usage and high-water figures to a JSON object
+  void reportStats(JsonObject out) const;
+
+private:
+  JsonArena arenas[JSON_ARENA_COUNT];
+  portMUX_TYPE lock;
+  uint32_t leases;
+  uint32_t poolMisses;
+  uint32_t overflows;
+  size_t highWater;
+  size_t temporaryHighWater;
+};
+
+extern JsonArenaPool jsonArenaPool;
+
+#endif // JSON_ARENA_H
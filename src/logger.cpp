@@ -0,0 +1,258 @@
+/**
+ * Deferred Logging Subsystem Implementation
+ */
+
+#include "logger.h"
+#include <SD_MMC.h>
+#include <esp_heap_caps.h>
+
+// Shared with the HTTP handlers in main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+Logger logger;
+
+static const char LEVEL_CHARS[] = { 'E', 'W', 'I', 'D' };
+static const char *TAG_NAMES[TAG_COUNT] = {
+  "SYS", "HTTP", "FILES", "OTA", "CAM", "WIFI", "SD", "CFG", "MQTT"
+};
+
+Logger::Logger()
+  : ring(NULL), enqueuePos(0), dequeuePos(0), dropped(0),
+    minLevel(LOG_LEVEL_INFO), sdSinkEnabled(false),
+    tail(NULL), tailHead(0), tailWrapped(false),
+    sdBatch(NULL), sdBatchLen(0), lastSDFlush(0), errorSink(NULL), errorSinkCtx(NULL), drainTask(NULL) {
+  tailLock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+bool Logger::begin() {
+  // The ring uses atomic compare-and-swap, which only works on internal RAM;
+  // the text buffers have no such constraint and go to PSRAM when present
+  Slot *slots = (Slot *)heap_caps_malloc(sizeof(Slot) * LOG_RING_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  tail = (char *)heap_caps_malloc(LOG_TAIL_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!tail) tail = (char *)malloc(LOG_TAIL_SIZE);
+  sdBatch = (char *)heap_caps_malloc(LOG_SD_BATCH_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!sdBatch) sdBatch = (char *)malloc(LOG_SD_BATCH_SIZE);
+
+  if (!slots || !tail || !sdBatch) {
+    Serial.println("Logger: failed to allocate buffers");
+    return false;
+  }
+
+  for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+    new (&slots[i].sequence) std::atomic<uint32_t>(i);
+  }
+  ring = slots;
+
+  if (xTaskCreate(drainTaskEntry, "log_drain", 4096, this, 1, &drainTask) != pdPASS) {
+    Serial.println("Logger: failed to start drain task");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Bounded multi-producer ring (Vyukov): a producer claims a slot by advancing
+ * enqueuePos with CAS, copies the record and publishes it by bumping the slot
+ * sequence. Full ring drops the record instead of blocking the caller.
+ */
+void Logger::push(LogLevel level, LogTag tag, const char *format, const char *text,
+                  const uint32_t *args, uint8_t argCount) {
+  if (!ring) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  Slot *slot;
+  uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int32_t diff = (int32_t)(sequence - pos);
+    if (diff == 0) {
+      if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  LogRecord &record = slot->record;
+  record.timestampMs = millis();
+  record.format = format;
+  record.level = level;
+  record.tag = tag;
+  for (uint8_t i = 0; i < LOG_MAX_ARGS; i++) {
+    record.args[i] = i < argCount ? args[i] : 0;
+  }
+  record.hasText = text != NULL;
+  if (text) {
+    strlcpy(record.text, text, LOG_TEXT_LEN);
+  }
+
+  slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool Logger::pop(LogRecord &record) {
+  Slot &slot = ring[dequeuePos & (LOG_RING_SIZE - 1)];
+  uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if ((int32_t)(sequence - (dequeuePos + 1)) < 0) {
+    return false;
+  }
+
+  record = slot.record;
+  slot.sequence.store(dequeuePos + LOG_RING_SIZE, std::memory_order_release);
+  dequeuePos++;
+  return true;
+}
+
+const char *Logger::tagName(uint8_t tag) {
+  return tag < TAG_COUNT ? TAG_NAMES[tag] : "?";
+}
+
+size_t Logger::format(const LogRecord &record, char *line, size_t lineSize, size_t &messageStart) {
+  int len = snprintf(line, lineSize, "[%6lu.%03lu][%c][%s] ",
+                     (unsigned long)(record.timestampMs / 1000),
+                     (unsigned long)(record.timestampMs % 1000),
+                     LEVEL_CHARS[record.level & 3],
+                     tagName(record.tag));
+  messageStart = len;
+
+  const uint32_t *a = record.args;
+  if (record.hasText) {
+    len += snprintf(line + len, lineSize - len, record.format, record.text, a[0], a[1], a[2], a[3]);
+  } else {
+    len += snprintf(line + len, lineSize - len, record.format, a[0], a[1], a[2], a[3]);
+  }
+
+  if (len > (int)lineSize - 2) {
+    len = lineSize - 2;
+  }
+  // Formats written for Serial.printf often carry their own newline
+  if (len == 0 || line[len - 1] != '\n') {
+    line[len++] = '\n';
+  }
+  line[len] = '\0';
+  return len;
+}
+
+void Logger::appendTail(const char *line, size_t len) {
+  portENTER_CRITICAL(&tailLock);
+  for (size_t i = 0; i < len; i++) {
+    tail[tailHead++] = line[i];
+    if (tailHead == LOG_TAIL_SIZE) {
+      tailHead = 0;
+      tailWrapped = true;
+    }
+  }
+  portEXIT_CRITICAL(&tailLock);
+}
+
+void Logger::writeTail(Print &out, size_t maxBytes) {
+  if (!tail) return;
+  if (maxBytes > LOG_TAIL_SIZE) maxBytes = LOG_TAIL_SIZE;
+
+  char *snapshot = (char *)heap_caps_malloc(maxBytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!snapshot) snapshot = (char *)malloc(maxBytes);
+  if (!snapshot) return;
+
+  size_t available;
+  portENTER_CRITICAL(&tailLock);
+  available = tailWrapped ? LOG_TAIL_SIZE : tailHead;
+  if (available > maxBytes) available = maxBytes;
+  size_t start = (tailHead + LOG_TAIL_SIZE - available) % LOG_TAIL_SIZE;
+  for (size_t i = 0; i < available; i++) {
+    snapshot[i] = tail[(start + i) % LOG_TAIL_SIZE];
+  }
+  portEXIT_CRITICAL(&tailLock);
+
+  // Skip a partial first line when the window cut into it
+  size_t offset = 0;
+  if (available == maxBytes || tailWrapped) {
+    while (offset < available && snapshot[offset] != '\n') offset++;
+    if (offset < available) offset++;
+  }
+  out.write((const uint8_t *)snapshot + offset, available - offset);
+  free(snapshot);
+}
+
+void Logger::appendSD(const char *line, size_t len) {
+  if (sdBatchLen + len > LOG_SD_BATCH_SIZE) {
+    flushSD();
+  }
+  if (sdBatchLen + len > LOG_SD_BATCH_SIZE) {
+    // SD stayed busy; the tail and Serial still have these lines
+    sdBatchLen = 0;
+  }
+  memcpy(sdBatch + sdBatchLen, line, len);
+  sdBatchLen += len;
+}
+
+void Logger::flushSD() {
+  lastSDFlush = millis();
+  if (sdBatchLen == 0 || sdCardMutex == NULL) return;
+
+  // Never wait for the card: OTA and file handlers hold the mutex for long
+  // stretches and the batch can simply be retried on the next flush
+  if (xSemaphoreTake(sdCardMutex, 0) != pdTRUE) return;
+
+  if (!SD_MMC.exists("/logs")) {
+    SD_MMC.mkdir("/logs");
+  }
+
+  File file = SD_MMC.open(LOG_SD_PATH, FILE_APPEND);
+  if (file) {
+    file.write((const uint8_t *)sdBatch, sdBatchLen);
+    size_t size = file.size();
+    file.close();
+    sdBatchLen = 0;
+
+    if (size > LOG_SD_MAX_SIZE) {
+      SD_MMC.remove(LOG_SD_ROTATED);
+      SD_MMC.rename(LOG_SD_PATH, LOG_SD_ROTATED);
+    }
+  }
+
+  xSemaphoreGive(sdCardMutex);
+}
+
+void Logger::drainTaskEntry(void *param) {
+  Logger *self = (Logger *)param;
+  LogRecord record;
+  char line[192];
+  uint32_t reportedDrops = 0;
+
+  for (;;) {
+    while (self->pop(record)) {
+      size_t messageStart;
+      size_t len = self->format(record, line, sizeof(line), messageStart);
+      Serial.write((const uint8_t *)line, len);
+      self->appendTail(line, len);
+      if (self->sdSinkEnabled) {
+        self->appendSD(line, len);
+      }
+      LogErrorSink sink = self->errorSink;
+      if (sink && record.level == LOG_LEVEL_ERROR) {
+        line[len - 1] = '\0';   // without the newline
+        sink(self->errorSinkCtx, record.tag, line + messageStart);
+      }
+    }
+
+    uint32_t drops = self->droppedCount();
+    if (drops != reportedDrops) {
+      int len = snprintf(line, sizeof(line), "[logger] %lu records dropped (ring full)\n",
+                         (unsigned long)(drops - reportedDrops));
+      Serial.write((const uint8_t *)line, len);
+      reportedDrops = drops;
+    }
+
+    if (self->sdSinkEnabled && millis() - self->lastSDFlush > LOG_SD_FLUSH_MS) {
+      self->flushSD();
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(20));
+  }
+}
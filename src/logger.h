@@ -0,0 +1,163 @@
+/**
+ * Deferred Logging Subsystem
+ *
+ * Call sites push compact binary records (format pointer + raw arguments)
+ * into a lock-free ring. A low-priority task formats the records and drains
+ * them to Serial, a batched SD log file and an in-memory tail served at
+ * /api/logs, so logging from async_tcp callbacks never waits on the UART.
+ *
+ * Rules for call sites:
+ * - Format strings must be string literals (only the pointer is stored)
+ * - Arguments must be integers, or pointers to string literals
+ * - Dynamic strings (String, file names) go through the *_S macros, which
+ *   copy one string into the record; it must be the FIRST %s in the format
+ * - No floating point arguments; log integer percentages/tenths instead
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <type_traits>
+
+#define LOG_MAX_ARGS       4
+#define LOG_TEXT_LEN       32
+#define LOG_RING_SIZE      128   // records, must be a power of two
+#define LOG_TAIL_SIZE      8192  // bytes of formatted text kept for /api/logs
+#define LOG_SD_BATCH_SIZE  2048  // bytes buffered before appending to SD
+#define LOG_SD_FLUSH_MS    5000
+#define LOG_SD_MAX_SIZE    (1024 * 1024)
+#define LOG_SD_PATH        "/logs/system.log"
+#define LOG_SD_ROTATED     "/logs/system.log.1"
+
+enum LogLevel : uint8_t {
+  LOG_LEVEL_ERROR = 0,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+};
+
+enum LogTag : uint8_t {
+  TAG_SYSTEM = 0,
+  TAG_HTTP,
+  TAG_FILES,
+  TAG_OTA,
+  TAG_CAMERA,
+  TAG_WIFI,
+  TAG_SD,
+  TAG_CONFIG,
+  TAG_MQTT,
+  TAG_COUNT
+};
+
+// Receives each formatted error message (without the time/level/tag
+// prefix) on the drain task
+typedef void (*LogErrorSink)(void *ctx, uint8_t tag, const char *message);
+
+struct LogRecord {
+  uint32_t timestampMs;
+  const char *format;
+  uint32_t args[LOG_MAX_ARGS];
+  char text[LOG_TEXT_LEN];
+  uint8_t level;
+  uint8_t tag;
+  bool hasText;
+};
+
+class Logger {
+public:
+  Logger();
+
+  // Allocates the ring and starts the drain task; safe to log before this
+  // returns (records are dropped until the ring exists)
+  bool begin();
+
+  // Enables the batched SD sink once the card is mounted
+  void enableSDSink(bool enabled) { sdSinkEnabled = enabled; }
+
+  // Also hands LOG_LEVEL_ERROR records to sink (one sink; NULL removes it)
+  void setErrorSink(LogErrorSink sink, void *ctx) {
+    errorSinkCtx = ctx;
+    errorSink = sink;
+  }
+
+  void setLevel(LogLevel level) { minLevel = level; }
+  bool enabled(LogLevel level) const { return level <= minLevel; }
+
+  // Hot path: reserve a ring slot and copy the raw record (no formatting)
+  void push(LogLevel level, LogTag tag, const char *format, const char *text,
+            const uint32_t *args, uint8_t argCount);
+
+  // Copies the newest formatted output (up to maxBytes, whole lines) to out
+  void writeTail(Print &out, size_t maxBytes);
+
+  uint32_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+  static const char *tagName(uint8_t tag);
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> sequence;
+    LogRecord record;
+  };
+
+  Slot *ring;
+  std::atomic<uint32_t> enqueuePos;
+  uint32_t dequeuePos;
+  std::atomic<uint32_t> dropped;
+  volatile LogLevel minLevel;
+  volatile bool sdSinkEnabled;
+
+  char *tail;
+  size_t tailHead;
+  bool tailWrapped;
+  portMUX_TYPE tailLock;
+
+  char *sdBatch;
+  size_t sdBatchLen;
+  unsigned long lastSDFlush;
+
+  volatile LogErrorSink errorSink;
+  void *volatile errorSinkCtx;
+
+  TaskHandle_t drainTask;
+
+  static void drainTaskEntry(void *param);
+  bool pop(LogRecord &record);
+  size_t format(const LogRecord &record, char *line, size_t lineSize, size_t &messageStart);
+  void appendTail(const char *line, size_t len);
+  void appendSD(const char *line, size_t len);
+  void flushSD();
+};
+
+extern Logger logger;
+
+// Argument packing: integers by value, string literals by pointer
+template <typename T>
+inline uint32_t logArg(T value) {
+  static_assert(std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value,
+                "log arguments must be integers or string literals (no floats)");
+  return (uint32_t)(uintptr_t)value;
+}
+
+template <typename... Args>
+inline void logWrite(LogLevel level, LogTag tag, const char *format, const char *text, Args... args) {
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+  if (!logger.enabled(level)) return;
+  const uint32_t packed[LOG_MAX_ARGS + 1] = { logArg(args)..., 0 };
+  logger.push(level, tag, format, text, packed, sizeof...(Args));
+}
+
+#define LOGE(tag, fmt, ...) logWrite(LOG_LEVEL_ERROR, tag, fmt, NULL, ##__VA_ARGS__)
+#define LOGW(tag, fmt, ...) logWrite(LOG_LEVEL_WARN,  tag, fmt, NULL, ##__VA_ARGS__)
+#define LOGI(tag, fmt, ...) logWrite(LOG_LEVEL_INFO,  tag, fmt, NULL, ##__VA_ARGS__)
+#define LOGD(tag, fmt, ...) logWrite(LOG_LEVEL_DEBUG, tag, fmt, NULL, ##__VA_ARGS__)
+
+// Variants that copy one dynamic string (the first %s of the format)
+#define LOGE_S(tag, fmt, str, ...) logWrite(LOG_LEVEL_ERROR, tag, fmt, str, ##__VA_ARGS__)
+#define LOGW_S(tag, fmt, str, ...) logWrite(LOG_LEVEL_WARN,  tag, fmt, str, ##__VA_ARGS__)
+#define LOGI_S(tag, fmt, str, ...) logWrite(LOG_LEVEL_INFO,  tag, fmt, str, ##__VA_ARGS__)
+#define LOGD_S(tag, fmt, str, ...) logWrite(LOG_LEVEL_DEBUG, tag, fmt, str, ##__VA_ARGS__)
+
+#endif // LOGGER_H
@@ -22,10 +22,38 @@
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
 #include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <new>
+#include <memory>
 #include "esp_camera.h"
 #include "camera_config.h"
 #include "web_server.h"
 #include "sd_manager.h"
+#include "route_metrics.h"
+#include "logger.h"
+#include "json_arena.h"
+#include "ota_staging.h"
+#include "ota_decoder.h"
+#include "ota_verifier.h"
+#include "config_store.h"
+#include "boot_sequence.h"
+#include "quality_controller.h"
+#include "jpeg_crop.h"
+#include "jpeg_encoder.h"
+#include "detector.h"
+#include "zones.h"
+#include "event_log.h"
+#include "mqtt_publisher.h"
+#include "work_scheduler.h"
+#include "thumbnails.h"
+#include "recording_catalog.h"
+#include "clip_player.h"
+#include "pan_tilt.h"
+#include "rtp_streamer.h"
+#include "ws_video.h"
+#include "web_assets.h"
+#include "task_profiler.h"
 
 // Global objects
 AsyncWebServer server(80);
@@ -38,72 +66,250 @@ SemaphoreHandle_t sdCardMutex = NULL;
 bool otaUploadInProgress = false;
 bool firstRequestAfterBoot = true;
 bool cameraActive = true; // Flag to control camera access during OTA
-
-// Configuration
-struct Config {
-  char ssid[32];
-  char password[64];
-  bool apMode;
-} config;
+bool cameraPaused = false;   // Stopped for an OTA upload
+bool cameraReleased = false; // ... and deinitialized
+
+// Pixels per frame the raw frame buffers were allocated for (0 in JPEG
+// mode with PSRAM, where the buffers fit every frame size)
+static uint32_t frameBufferPixels = 0;
+
+// Deferred OTA work (work_scheduler.h)
+#define OTA_CAMERA_SETTLE_MS   300   // camera users notice cameraActive before deinit
+#define OTA_CAMERA_RESUME_MS   100
+#define OTA_RESTART_GRACE_MS   500   // after the last response byte is handed to TCP
+#define OTA_RESTART_TIMEOUT_MS 2000  // client gone before reading the response
+
+// Digital zoom: region followed by /stream/crop?follow=1 (set through
+// /api/camera/follow, or by a tracker) and crop timing for /api/camera
+JpegCropRect followTarget = {0, 0, 0, 0};
+portMUX_TYPE followLock = portMUX_INITIALIZER_UNLOCKED;
+
+struct CropStreamStats {
+  uint32_t frames;
+  uint32_t failures;
+  uint32_t avgMicros;       // EWMA of crop time per frame
+  uint32_t lastInBytes;
+  uint32_t lastOutBytes;
+  JpegCropStats last;
+  JpegCropRect lastRect;
+} cropStats;
+
+// Raw pixel formats: frames are JPEG-encoded into a per-stream PSRAM buffer
+struct EncodedFrame {
+  uint8_t *data;
+  size_t capacity;
+  size_t len;
+};
+
+struct EncodeStats {
+  uint32_t frames;
+  uint32_t failures;
+  uint32_t avgMicros;       // EWMA of encode time per frame
+  uint32_t lastBytes;
+} encodeStats;
 
 // Function declarations
 bool initCamera();
 void setupWiFi();
+void waitForWiFi();
 void setupWebServer();
-bool loadConfig();
-void setDefaultConfig();
+void applyCameraSettings(sensor_t *s, const CameraSettings &camera);
+void onConfigChanged(void *ctx, const AppConfig &config, uint32_t changedSections);
 String getBuiltinHTML();
 void streamJpg(AsyncWebServerRequest *request);
-void serveStaticFile(AsyncWebServerRequest *request, const char* filepath, const char* contentType);
+void streamCropJpg(AsyncWebServerRequest *request, JpegCropRect rect, bool follow);
+void streamPlayback(AsyncWebServerRequest *request, PlaybackSession *session);
+void streamEvents(AsyncWebServerRequest *request);
+void sendSnapshot(AsyncWebServerRequest *request, JpegCropRect rect);
+void setFollowTarget(const JpegCropRect &rect);
 bool isValidESP32Firmware(uint8_t *data, size_t len);
 void validateOTABoot();
 
-void setup() {
-  Serial.begin(115200);
-  Serial.println("\n\n=== ESP32-CAM File Manager ===");
-
-  // Create mutex for SD card access
-  sdCardMutex = xSemaphoreCreateMutex();
-  if (sdCardMutex == NULL) {
-    Serial.println("Failed to create SD card mutex!");
-  }
+// Boot steps (see boot_sequence.h); each runs in its own task
 
-  // Initialize SD card first
+static bool bootSD(void *ctx) {
   Serial.println("Initializing SD card...");
   if (!sdManager.begin()) {
     Serial.println("SD Card initialization failed!");
     Serial.println("WARNING: Running without SD card - limited functionality");
-  } else {
-    Serial.println("SD Card initialized successfully");
+    return false;
   }
+  Serial.println("SD Card initialized successfully");
+  otaStaging.begin();
+  return true;
+}
 
-  // Load configuration from SD card
-  if (!loadConfig()) {
-    Serial.println("Failed to load config, using defaults");
-    setDefaultConfig();
-  }
+// Loads configuration (NVS snapshot, /config.json or defaults)
+static bool bootConfig(void *ctx) {
+  configStore.begin(sdManager.isReady());
+  const AppConfig &settings = configStore.settings();
+  logger.setLevel((LogLevel)settings.system.logLevel);
+  logger.enableSDSink(sdManager.isReady() && settings.storage.logToSD);
+  qualityController.configure(settings.stream, settings.camera.quality);
+  configStore.subscribe(CONFIG_MASK(CFG_SECTION_CAMERA) | CONFIG_MASK(CFG_SECTION_STREAM) |
+                        CONFIG_MASK(CFG_SECTION_STORAGE) | CONFIG_MASK(CFG_SECTION_DETECTION) |
+                        CONFIG_MASK(CFG_SECTION_SYSTEM) | CONFIG_MASK(CFG_SECTION_MQTT) |
+                        CONFIG_MASK(CFG_SECTION_PAN_TILT),
+                        onConfigChanged, NULL);
+  return true;
+}
 
-  // Initialize camera
+static bool bootCamera(void *ctx) {
   Serial.println("Initializing camera...");
   if (!initCamera()) {
+    // Keep serving files, OTA and health instead of halting; /stream stays idle
     Serial.println("Camera initialization failed!");
-    while(1) {
-      delay(1000);
-      Serial.println("Camera initialization failed - halted");
-    }
+    cameraActive = false;
+    return false;
   }
   Serial.println("Camera initialized successfully");
 
-  // Setup WiFi
+  // Warm-up capture: marks time-to-first-frame and primes the sensor
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (fb) {
+    bootSequence.mark(BOOT_MILESTONE_FIRST_FRAME);
+    esp_camera_fb_return(fb);
+  }
+  return true;
+}
+
+// Opens the event log on the SD card and starts its writer task
+static bool bootEvents(void *ctx) {
+  return eventLog.begin(sdManager.isReady(), configStore.settings().storage);
+}
+
+// Reopens the MQTT queue on the SD card and starts the publisher task; it
+// connects once WiFi is up
+static bool bootMqtt(void *ctx) {
+  return mqttPublisher.begin(sdManager.isReady(), configStore.settings().mqtt);
+}
+
+// Starts the thumbnail task; it first catches up on the recordings directory
+static bool bootThumbnails(void *ctx) {
+  return thumbnailStore.begin(sdManager.isReady(), configStore.settings().storage);
+}
+
+// Loads the recording index (rebuilt in the background when missing) and
+// starts the retention task
+static bool bootRecordings(void *ctx) {
+  return recordingCatalog.begin(sdManager.isReady(), configStore.settings().storage);
+}
+
+// Starts the clip playback read-ahead task
+static bool bootPlayback(void *ctx) {
+  return clipPlayer.begin(sdManager.isReady());
+}
+
+// Starts the servo timer and control task; the outputs stay detached until
+// pan_tilt.enabled
+static bool bootPanTilt(void *ctx) {
+  return panTilt.begin(configStore.settings().panTilt);
+}
+
+// Starts the RTP sender task; it idles until a receiver is added
+static bool bootRtp(void *ctx) {
+  return rtpStreamer.begin(configStore.settings().stream);
+}
+
+// Starts the WebSocket video task; it idles until a client connects
+static bool bootWsVideo(void *ctx) {
+  return wsVideo.begin(configStore.settings().stream);
+}
+
+// Starts sampling task run times and stacks; no dependencies, so the rest
+// of the boot is already measured
+static bool bootTaskProfiler(void *ctx) {
+  return taskProfiler.begin();
+}
+
+// Loads the zones and starts the detector task; the model itself loads in
+// the background
+static bool bootDetector(void *ctx) {
+  zoneMap.begin(sdManager.isReady());
+  return detector.begin(configStore.settings().detection);
+}
+
+static bool bootWiFi(void *ctx) {
   setupWiFi();
+  return true;
+}
+
+static bool bootWiFiConnect(void *ctx) {
+  waitForWiFi();
+  // false when station mode timed out and fell back to AP
+  return configStore.settings().wifi.apMode || WiFi.status() == WL_CONNECTED;
+}
 
-  // Setup web server
+static bool bootWebServer(void *ctx) {
   setupWebServer();
+  bootSequence.mark(BOOT_MILESTONE_HTTP_READY);
+  return true;
+}
+
+// Registers a boot step. One that does not fit in BOOT_MAX_STEPS would be
+// dropped along with every step depending on it (the web server, once), so
+// that stops the boot here with the step's name instead
+static int addBootStep(const char *name, BootStepFn fn, uint32_t dependsOn, int core, uint8_t flags = 0) {
+  int id = bootSequence.addStep(name, fn, NULL, dependsOn, core, flags);
+  if (id < 0) {
+    Serial.printf("FATAL: boot step '%s' exceeds BOOT_MAX_STEPS (%d)\n", name, BOOT_MAX_STEPS);
+    abort();
+  }
+  return id;
+}
 
-  Serial.println("\nC=== System Ready ===");
-  Serial.print("Camera stream: http://");
-  Serial.print(WiFi.localIP());
-  Serial.println("/");
+void setup() {
+  Serial.begin(115200);
+  Serial.println("\n\n=== ESP32-CAM File Manager ===");
+
+  // Start deferred logging before anything that may log from a handler
+  if (!logger.begin()) {
+    Serial.println("Logger initialization failed - request logs will be dropped");
+  }
+
+  // Create mutex for SD card access
+  sdCardMutex = xSemaphoreCreateMutex();
+  if (sdCardMutex == NULL) {
+    Serial.println("Failed to create SD card mutex!");
+  }
+
+  // Worker for jobs web server callbacks must not wait for
+  if (!workScheduler.begin()) {
+    Serial.println("Scheduler start failed - deferred jobs run inline");
+  }
+
+  // PSRAM arenas for JSON responses (keeps per-request JSON off the heap)
+  if (!jsonArenaPool.begin()) {
+    Serial.println("JSON arena pool allocation failed - using temporary arenas");
+  }
+
+  // SD -> config, then camera (app core) in parallel with WiFi and the web
+  // server (protocol core); station association finishes in the background
+  addBootStep("task_profiler", bootTaskProfiler, 0, 1);
+  int sdStep = addBootStep("sd", bootSD, 0, 1);
+  int configStep = addBootStep("config", bootConfig, 1u << sdStep, 1);
+  int cameraStep = addBootStep("camera", bootCamera, 1u << configStep, 1);
+  addBootStep("detector", bootDetector, 1u << cameraStep, 1);
+  addBootStep("events", bootEvents, 1u << configStep, 1);
+  addBootStep("mqtt", bootMqtt, 1u << configStep, 1);
+  addBootStep("thumbnails", bootThumbnails, 1u << configStep, 1);
+  addBootStep("recordings", bootRecordings, 1u << configStep, 1);
+  addBootStep("playback", bootPlayback, 1u << sdStep, 1);
+  addBootStep("pan_tilt", bootPanTilt, 1u << configStep, 1);
+  addBootStep("rtp", bootRtp, 1u << configStep, 1);
+  addBootStep("ws_video", bootWsVideo, 1u << configStep, 1);
+  int wifiStep = addBootStep("wifi", bootWiFi, 1u << configStep, 0);
+  addBootStep("http", bootWebServer, 1u << wifiStep, 0);
+  addBootStep("wifi_connect", bootWiFiConnect, 1u << wifiStep, 0, BOOT_STEP_DETACHED);
+  bootSequence.run();
+
+  Serial.println("\n=== System Ready ===");
+  Serial.printf("Boot took %lu ms\n", millis());
+  if (WiFi.status() == WL_CONNECTED || (WiFi.getMode() & WIFI_AP)) {
+    Serial.print("Camera stream: http://");
+    Serial.print(WiFi.status() == WL_CONNECTED ? WiFi.localIP() : WiFi.softAPIP());
+    Serial.println("/");
+  }
   Serial.println("====================\n");
 }
 
@@ -118,6 +324,10 @@ void loop() {
   delay(10);
 }
 
+static uint32_t framePixels(framesize_t size) {
+  return (uint32_t)resolution[size].width * resolution[size].height;
+}
+
 bool initCamera() {
   camera_config_t config;
   config.ledc_channel = LEDC_CHANNEL_0;
@@ -138,11 +348,20 @@ bool initCamera() {
   config.pin_sccb_scl = SIOC_GPIO_NUM;
   config.pin_pwdn = PWDN_GPIO_NUM;
   config.pin_reset = RESET_GPIO_NUM;
-  config.xclk_freq_hz = 20000000;  // 20MHz is more stable for OV2640 sensor
-  config.pixel_format = PIXFORMAT_JPEG;
-  config.frame_size = FRAMESIZE_QVGA; //Opções: QVGA (320x240), VGA (640x480), SVGA (800x600)
-  config.jpeg_quality = 12;  // Higher value = more compression, more stable (10-63 range)
-  config.fb_count = 2;  // 2 buffers is more stable than 3 for high FPS
+  const CameraSettings &camera = configStore.settings().camera;
+  config.xclk_freq_hz = camera.xclkMhz * 1000000;  // 20MHz is more stable for OV2640 sensor
+  bool rawPixels = camera.pixelFormat != CAMERA_PIXELS_JPEG;
+  config.pixel_format = camera.pixelFormat == CAMERA_PIXELS_YUV422 ? PIXFORMAT_YUV422
+                      : camera.pixelFormat == CAMERA_PIXELS_GRAYSCALE ? PIXFORMAT_GRAYSCALE
+                      : PIXFORMAT_JPEG;
+  // With PSRAM, size the JPEG frame buffers for the largest mode so
+  // frame_size can be changed at runtime; the sensor is switched to the
+  // configured size below. Raw frames are sized exactly (a UXGA YUV422
+  // buffer alone is 3.8MB), so larger sizes need a restart in raw modes.
+  config.frame_size = psramFound() && !rawPixels ? FRAMESIZE_UXGA : (framesize_t)camera.frameSize;
+  frameBufferPixels = rawPixels ? framePixels(config.frame_size) : 0;
+  config.jpeg_quality = camera.quality;  // Higher value = more compression, more stable (10-63 range)
+  config.fb_count = camera.fbCount;  // 2 buffers is more stable than 3 for high FPS
 
   esp_err_t err = esp_camera_init(&config);
   if (err != ESP_OK) {
@@ -151,54 +370,190 @@ bool initCamera() {
   }
 
   // Camera sensor settings
-  sensor_t *s = esp_camera_sensor_get();
-  s->set_framesize(s, FRAMESIZE_QVGA);
-  s->set_quality(s, 12);  // 12 is a good balance between quality and stability
-  s->set_brightness(s, 0);
-  s->set_contrast(s, 0);
-  s->set_saturation(s, 0);
+  applyCameraSettings(esp_camera_sensor_get(), camera);
 
   return true;
 }
 
+// Camera and reboot jobs for OTA uploads, run by workScheduler so the
+// upload callbacks return at once
+
+static void deferOrRun(const char *name, DeferredJob job, uint32_t delayMs) {
+  if (!workScheduler.defer(name, job, NULL, delayMs)) job(NULL);
+}
+
+static void stopCameraJob(void *ctx) {
+  if (!cameraPaused || cameraReleased) return;   // resumed before it settled
+  // Frees the camera's memory and pins for the upload
+  esp_err_t err = esp_camera_deinit();
+  if (err != ESP_OK) {
+    LOGW(TAG_CAMERA, "Camera deinit warning: 0x%x", err);
+  } else {
+    LOGI(TAG_CAMERA, "Camera deinitialized successfully");
+  }
+  cameraReleased = true;
+  LOGI(TAG_OTA, "Free heap after camera deinit: %u bytes", ESP.getFreeHeap());
+}
+
+static void startCameraJob(void *ctx) {
+  if (!cameraPaused) return;
+  cameraPaused = false;
+  if (cameraReleased && initCamera()) {
+    cameraReleased = false;
+    LOGI(TAG_CAMERA, "Camera reinitialized successfully after OTA error");
+  }
+  cameraActive = true;
+  LOGI(TAG_CAMERA, "Camera access resumed");
+}
+
+static void restartJob(void *ctx) {
+  LOGI(TAG_OTA, "Restarting ESP32 now...");
+  ESP.restart();
+}
+
+// Camera users stop at the next frame; the camera is released once they
+// have had OTA_CAMERA_SETTLE_MS to notice
+static void pauseCamera() {
+  if (!cameraActive) return;   // failed at boot, or already paused
+  cameraPaused = true;
+  cameraActive = false;
+  deferOrRun("camera_stop", stopCameraJob, OTA_CAMERA_SETTLE_MS);
+}
+
+static void resumeCamera(uint32_t delayMs) {
+  deferOrRun("camera_start", startCameraJob, delayMs);
+}
+
+// Maps the sensor quality scale (4..63, lower is better) to the encoder's
+// IJG scale (1..100, higher is better) used for raw pixel formats
+static uint8_t encoderQuality(uint8_t sensorQuality) {
+  return (uint8_t)(100 - (uint16_t)sensorQuality * 80 / 63);
+}
+
+// Quality picked by the rate controller: the sensor compresses JPEG frames,
+// jpegEncoder compresses raw ones
+static void applyStreamQuality(uint8_t quality) {
+  jpegEncoder.setQuality(encoderQuality(quality));
+  if (configStore.settings().camera.pixelFormat == CAMERA_PIXELS_JPEG) {
+    sensor_t *s = esp_camera_sensor_get();
+    if (s) s->set_quality(s, quality);
+  }
+}
+
+void applyCameraSettings(sensor_t *s, const CameraSettings &camera) {
+  jpegEncoder.setQuality(encoderQuality(camera.quality));
+  if (s == NULL) return;
+  // A larger size would overrun raw frame buffers; it waits for the restart
+  // the config store asked for (ConfigStore::commit)
+  if (!frameBufferPixels || framePixels((framesize_t)camera.frameSize) <= frameBufferPixels) {
+    s->set_framesize(s, (framesize_t)camera.frameSize);
+  }
+  s->set_quality(s, camera.quality);
+  s->set_brightness(s, camera.brightness);
+  s->set_contrast(s, camera.contrast);
+  s->set_saturation(s, camera.saturation);
+  s->set_hmirror(s, camera.hmirror ? 1 : 0);
+  s->set_vflip(s, camera.vflip ? 1 : 0);
+  s->set_exposure_ctrl(s, camera.aec ? 1 : 0);
+  s->set_aec2(s, camera.aec2 ? 1 : 0);
+  s->set_ae_level(s, camera.aeLevel);
+  s->set_aec_value(s, camera.aecValue);
+  s->set_gain_ctrl(s, camera.agc ? 1 : 0);
+  s->set_agc_gain(s, camera.agcGain);
+  s->set_gainceiling(s, (gainceiling_t)camera.gainCeiling);
+  s->set_whitebal(s, camera.awb ? 1 : 0);
+  s->set_awb_gain(s, camera.awbGain ? 1 : 0);
+  s->set_wb_mode(s, camera.wbMode);
+  s->set_special_effect(s, camera.specialEffect);
+  s->set_bpc(s, camera.bpc ? 1 : 0);
+  s->set_wpc(s, camera.wpc ? 1 : 0);
+  s->set_raw_gma(s, camera.rawGma ? 1 : 0);
+  s->set_lenc(s, camera.lenc ? 1 : 0);
+  s->set_dcw(s, camera.dcw ? 1 : 0);
+}
+
+// Applies settings that can change without a restart
+void onConfigChanged(void *ctx, const AppConfig &config, uint32_t changedSections) {
+  if ((changedSections & CONFIG_MASK(CFG_SECTION_CAMERA)) && cameraActive) {
+    applyCameraSettings(esp_camera_sensor_get(), config.camera);
+  }
+  if (changedSections & (CONFIG_MASK(CFG_SECTION_CAMERA) | CONFIG_MASK(CFG_SECTION_STREAM))) {
+    // Restart the rate controller from the configured quality
+    qualityController.configure(config.stream, config.camera.quality);
+  }
+  if (changedSections & CONFIG_MASK(CFG_SECTION_STREAM)) {
+    rtpStreamer.configure(config.stream);
+    wsVideo.configure(config.stream);
+  }
+  if (changedSections & CONFIG_MASK(CFG_SECTION_DETECTION)) {
+    detector.configure(config.detection);
+  }
+  if (changedSections & CONFIG_MASK(CFG_SECTION_STORAGE)) {
+    logger.enableSDSink(sdManager.isReady() && config.storage.logToSD);
+    eventLog.configure(config.storage);
+    recordingCatalog.configure(config.storage);
+  }
+  if (changedSections & CONFIG_MASK(CFG_SECTION_MQTT)) {
+    mqttPublisher.configure(config.mqtt);
+  }
+  if (changedSections & CONFIG_MASK(CFG_SECTION_PAN_TILT)) {
+    panTilt.configure(config.panTilt);
+  }
+  if (changedSections & CONFIG_MASK(CFG_SECTION_SYSTEM)) {
+    logger.setLevel((LogLevel)config.system.logLevel);
+  }
+}
+
+// Starts AP or station mode without waiting for the association
 void setupWiFi() {
   Serial.println("Setting up WiFi...");
 
-  if (config.apMode) {
+  const WifiSettings &wifi = configStore.settings().wifi;
+  if (wifi.apMode) {
     // Access Point mode
-    WiFi.softAP(config.ssid, config.password);
+    WiFi.softAP(wifi.ssid, wifi.password);
     Serial.print("AP Mode - SSID: ");
-    Serial.println(config.ssid);
+    Serial.println(wifi.ssid);
     Serial.print("IP Address: ");
     Serial.println(WiFi.softAPIP());
+    bootSequence.mark(BOOT_MILESTONE_WIFI_CONNECTED);
   } else {
     // Station mode
-    WiFi.begin(config.ssid, config.password);
-    Serial.print("Connecting to WiFi");
+    WiFi.begin(wifi.ssid, wifi.password);
+    Serial.println("Connecting to WiFi in the background");
+  }
+}
 
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 30) {
-      delay(500);
-      Serial.print(".");
-      attempts++;
-    }
+// Waits (up to 15 s) for the station to associate, falling back to AP mode.
+// Runs as a background boot step so the web server is already listening.
+void waitForWiFi() {
+  if (configStore.settings().wifi.apMode) return;
 
-    if (WiFi.status() == WL_CONNECTED) {
-      Serial.println("\nConnected!");
-      Serial.print("IP Address: ");
-      Serial.println(WiFi.localIP());
-    } else {
-      Serial.println("\nFailed to connect, switching to AP mode");
-      WiFi.softAP("ESP32-CAM", "12345678");
-      Serial.print("AP IP: ");
-      Serial.println(WiFi.softAPIP());
-    }
+  int attempts = 0;
+  while (WiFi.status() != WL_CONNECTED && attempts < 150) {
+    vTaskDelay(pdMS_TO_TICKS(100));
+    attempts++;
+  }
+
+  if (WiFi.status() == WL_CONNECTED) {
+    bootSequence.mark(BOOT_MILESTONE_WIFI_CONNECTED);
+    Serial.println("WiFi connected!");
+    Serial.print("IP Address: ");
+    Serial.println(WiFi.localIP());
+    LOGI(TAG_WIFI, "Connected after %u ms", attempts * 100);
+  } else {
+    Serial.println("Failed to connect, switching to AP mode");
+    WiFi.softAP("ESP32-CAM", "12345678");
+    Serial.print("AP IP: ");
+    Serial.println(WiFi.softAPIP());
+    LOGW(TAG_WIFI, "Station connect timed out - AP fallback");
   }
 }
 
 /**
  * Validate ESP32 firmware binary format
- * ESP32 binaries start with magic byte 0xE9
+ * ESP32 binaries start with magic byte 0xE9; compressed (gzip, heatshrink)
+ * and delta images are recognized by their container header
  *
  * @param data Pointer to first bytes of file
  * @param len Length of data buffer
@@ -206,22 +561,25 @@ void setupWiFi() {
  */
 bool isValidESP32Firmware(uint8_t *data, size_t len) {
   if (len < 1) {
-    Serial.println("Firmware validation failed: data too short");
+    LOGE(TAG_OTA, "Firmware validation failed: data too short");
     return false;
   }
 
-  // ESP32 binary magic byte
-  const uint8_t ESP32_MAGIC_BYTE = 0xE9;
-
-  if (data[0] != ESP32_MAGIC_BYTE) {
-    Serial.printf("Invalid firmware: magic byte is 0x%02X, expected 0xE9\n", data[0]);
+  OtaImageFormat format = OtaDecoder::detect(data, len);
+  if (format == OTA_FORMAT_UNKNOWN) {
+    LOGE(TAG_OTA, "Invalid firmware: magic byte is 0x%02X, expected 0xE9", data[0]);
     return false;
   }
 
-  Serial.println("Firmware validation passed: ESP32 magic byte detected");
+  LOGI(TAG_OTA, "Firmware validation passed: %s image detected", OtaDecoder::formatName(format));
   return true;
 }
 
+// Decoded firmware bytes from the direct upload go straight to the OTA partition
+static bool writeUpdateChunk(void *ctx, const uint8_t *data, size_t len) {
+  return Update.write((uint8_t *)data, len) == len;
+}
+
 /**
  * Validate OTA boot after firmware update
  * Called on first HTTP request after boot to mark partition as valid
@@ -238,49 +596,259 @@ void validateOTABoot() {
   esp_ota_img_states_t ota_state;
 
   if (esp_ota_get_state_partition(running, &ota_state) != ESP_OK) {
-    Serial.println("Failed to get OTA partition state");
+    LOGE(TAG_OTA, "Failed to get OTA partition state");
     return;
   }
 
   if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-    Serial.println("First boot after OTA update detected");
-    Serial.println("Web server responding successfully - marking partition valid");
+    LOGI(TAG_OTA, "First boot after OTA update detected");
+    LOGI(TAG_OTA, "Web server responding successfully - marking partition valid");
 
     if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) {
-      Serial.println("OTA update validated successfully - rollback cancelled");
+      LOGI(TAG_OTA, "OTA update validated successfully - rollback cancelled");
     } else {
-      Serial.println("Failed to mark OTA partition valid");
+      LOGE(TAG_OTA, "Failed to mark OTA partition valid");
     }
   } else if (ota_state == ESP_OTA_IMG_VALID) {
-    Serial.println("Running from valid OTA partition");
+    LOGI(TAG_OTA, "Running from valid OTA partition");
   } else if (ota_state == ESP_OTA_IMG_INVALID) {
-    Serial.println("Running from invalid partition (should not happen)");
+    LOGW(TAG_OTA, "Running from invalid partition (should not happen)");
+  }
+}
+
+// Buffers a JSON request body (up to CONFIG_MAX_BODY) in _tempObject; the
+// request frees it
+static void collectConfigBody(AsyncWebServerRequest *request, uint8_t *data, size_t len,
+                              size_t index, size_t total) {
+  if (total > CONFIG_MAX_BODY) return;
+  if (index == 0) {
+    request->_tempObject = malloc(total + 1);
+  }
+  if (request->_tempObject == NULL) return;
+  memcpy((uint8_t *)request->_tempObject + index, data, len);
+  if (index + len == total) {
+    ((char *)request->_tempObject)[total] = '\0';
   }
 }
 
+static void sendConfigError(AsyncWebServerRequest *request, const String &error) {
+  JsonArena *arena = jsonArenaPool.acquire();
+  JsonDocument doc(arena);
+  doc["error"] = error;
+  jsonArenaPool.send(request, 400, doc, arena);
+}
+
+// Parses the body collected by collectConfigBody; sends the error response
+// and returns false when it is missing, too large or not JSON
+static bool readConfigBody(AsyncWebServerRequest *request, JsonDocument &body) {
+  if (request->contentLength() > CONFIG_MAX_BODY) {
+    request->send(413, "application/json", "{\"error\":\"Request body too large\"}");
+    return false;
+  }
+  if (request->_tempObject == NULL) {
+    request->send(400, "application/json", "{\"error\":\"Missing JSON body\"}");
+    return false;
+  }
+  DeserializationError parseError = deserializeJson(body, (const char *)request->_tempObject,
+                                                    request->contentLength());
+  if (parseError) {
+    sendConfigError(request, String("Invalid JSON: ") + parseError.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Reports which sections a config update or reload changed
+static void sendConfigChange(AsyncWebServerRequest *request, const ConfigChange &change) {
+  JsonArena *arena = jsonArenaPool.acquire();
+  JsonDocument doc(arena);
+  doc["status"] = "ok";
+  JsonArray changed = doc["changed"].to<JsonArray>();
+  for (uint8_t i = 0; i < CFG_SECTION_COUNT; i++) {
+    if (change.sections & CONFIG_MASK(i)) changed.add(ConfigStore::sectionName((ConfigSection)i));
+  }
+  doc["restart_required"] = change.restartRequired;
+  doc["persisted"] = change.persisted;
+  doc["version"] = configStore.version();
+  jsonArenaPool.send(request, 200, doc, arena);
+}
+
+// Reads an RTP receiver from ?port=[&host=] (host defaults to the client);
+// sends the error response and returns false when it is invalid
+static bool rtpReceiver(AsyncWebServerRequest *request, IPAddress &host, uint16_t &port) {
+  long value = request->hasParam("port") ? request->getParam("port")->value().toInt() : 0;
+  if (value <= 0 || value > 65535) {
+    request->send(400, "application/json", "{\"error\":\"Missing or invalid port\"}");
+    return false;
+  }
+  port = (uint16_t)value;
+  if (!request->hasParam("host")) {
+    host = request->client()->remoteIP();
+  } else if (!host.fromString(request->getParam("host")->value())) {
+    request->send(400, "application/json", "{\"error\":\"Invalid host\"}");
+    return false;
+  }
+  return true;
+}
+
+// /api/files/read sends at most FILE_READ_MAX bytes of content; the arena
+// holds the escaped body, which is up to twice that for text (\n, \", \\)
+#define FILE_READ_MAX 51200
+#define FILE_READ_ARENA(size) (2 * (size) + 64)
+
+static const char FILE_READ_PREFIX[] = "{\"status\":\"ok\",\"content\":\"";
+
+// Bytes one content byte takes inside a JSON string, escaped as ArduinoJson does
+static inline size_t jsonEscapedSize(uint8_t c) {
+  if (c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t') return 2;
+  return c < 0x20 ? 6 : 1;
+}
+
+// Builds {"status":"ok","content":"...","size":N} in body[0, capacity) from
+// the raw bytes stored at its tail. Writing forward never overtakes reading:
+// every byte still unread escapes to at least one byte. Returns the body
+// length, or 0 when the escaped content does not fit (binary files)
+static size_t writeFileReadBody(char *body, size_t capacity, const uint8_t *raw, size_t size) {
+  char suffix[32];
+  int suffixLen = snprintf(suffix, sizeof(suffix), "\",\"size\":%u}", (unsigned)size);
+  size_t total = sizeof(FILE_READ_PREFIX) - 1 + suffixLen;
+  for (size_t i = 0; i < size; i++) total += jsonEscapedSize(raw[i]);
+  if (total > capacity) return 0;
+
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  char *out = body;
+  memcpy(out, FILE_READ_PREFIX, sizeof(FILE_READ_PREFIX) - 1);
+  out += sizeof(FILE_READ_PREFIX) - 1;
+  for (size_t i = 0; i < size; i++) {
+    uint8_t c = raw[i];
+    switch (c) {
+      case '"': *out++ = '\\'; *out++ = '"'; break;
+      case '\\': *out++ = '\\'; *out++ = '\\'; break;
+      case '\b': *out++ = '\\'; *out++ = 'b'; break;
+      case '\f': *out++ = '\\'; *out++ = 'f'; break;
+      case '\n': *out++ = '\\'; *out++ = 'n'; break;
+      case '\r': *out++ = '\\'; *out++ = 'r'; break;
+      case '\t': *out++ = '\\'; *out++ = 't'; break;
+      default:
+        if (c < 0x20) {
+          memcpy(out, "\\u00", 4);
+          out[4] = HEX_DIGITS[c >> 4];
+          out[5] = HEX_DIGITS[c & 0x0F];
+          out += 6;
+        } else {
+          *out++ = (char)c;
+        }
+    }
+  }
+  memcpy(out, suffix, suffixLen);
+  return total;
+}
+
+// server.on() that also gives the handler its /metrics series, labelled with
+// the registered pattern rather than the request URL
+static AsyncCallbackWebHandler &route(const char *uri, WebRequestMethodComposite method,
+                                      ArRequestHandlerFunction onRequest,
+                                      ArUploadHandlerFunction onUpload = nullptr,
+                                      ArBodyHandlerFunction onBody = nullptr) {
+  AsyncCallbackWebHandler &handler = server.on(uri, method, onRequest, onUpload, onBody);
+  routeMetrics.track(handler, uri);
+  return handler;
+}
+
 void setupWebServer() {
   Serial.println("Setting up web server...");
 
-  // Serve static files from SD card
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+  // Per-route latency, status and heap instrumentation for every handler
+  server.addMiddleware(&routeMetrics);
+
+  // Every file in data/web at "/<name>" (web_manifest.h); first, so asset
+  // requests skip the scan over the routes below
+  attachWebAssets(server);
+
+  route("/", HTTP_GET, [](AsyncWebServerRequest *request) {
     validateOTABoot();
-    if (sdManager.isReady()) {
-      request->send(SD_MMC, "/web/index.html", "text/html");
+    const WebAsset *page = findWebAsset("/index.html");
+    if (sdManager.isReady() && page) {
+      serveWebAsset(request, *page);
     } else {
       request->send(200, "text/html", getBuiltinHTML());
     }
   });
 
-  server.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/style.css", "text/css");
+  // Cropped MJPEG stream (lossless, MCU-aligned): ?x=&y=&w=&h= in frame
+  // pixels, or ?follow=1 to track followTarget. Registered before "/stream",
+  // which also matches its subpaths.
+  route("/stream/crop", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (otaUploadInProgress) {
+      request->send(503, "text/plain", "Service unavailable - firmware update in progress");
+      return;
+    }
+
+    bool follow = request->hasParam("follow") && request->getParam("follow")->value() == "1";
+    JpegCropRect rect = {0, 0, 0, 0};
+    if (!follow) {
+      if (!request->hasParam("x") || !request->hasParam("y") ||
+          !request->hasParam("w") || !request->hasParam("h")) {
+        request->send(400, "text/plain", "Missing x, y, w or h (or follow=1)");
+        return;
+      }
+      rect.x = request->getParam("x")->value().toInt();
+      rect.y = request->getParam("y")->value().toInt();
+      rect.width = request->getParam("w")->value().toInt();
+      rect.height = request->getParam("h")->value().toInt();
+      if (rect.width == 0 || rect.height == 0) {
+        request->send(400, "text/plain", "w and h must be positive");
+        return;
+      }
+    }
+    streamCropJpg(request, rect, follow);
   });
 
-  server.on("/app.js", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/app.js", "application/javascript");
+  // Recorded clip (AVI or MJPEG on the SD card) as an MJPEG stream:
+  // ?file=, ?speed= (0.25 to 16, default 1) and ?from= (s into the clip).
+  // Also registered before "/stream".
+  route("/stream/playback", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (otaUploadInProgress) {
+      request->send(503, "text/plain", "Service unavailable - firmware update in progress");
+      return;
+    }
+    if (!request->hasParam("file")) {
+      request->send(400, "text/plain", "Missing file parameter");
+      return;
+    }
+    float speed = request->hasParam("speed") ? request->getParam("speed")->value().toFloat() : 1.0f;
+    float from = request->hasParam("from") ? request->getParam("from")->value().toFloat() : 0.0f;
+    if (!(speed * 100 >= PLAYBACK_MIN_SPEED && speed * 100 <= PLAYBACK_MAX_SPEED)) {
+      request->send(400, "text/plain", "speed must be between 0.25 and 16");
+      return;
+    }
+
+    PlaybackSession *session = NULL;
+    PlaybackResult result = clipPlayer.open(request->getParam("file")->value().c_str(),
+                                            from > 0 ? (uint32_t)(from * 1000) : 0,
+                                            (uint16_t)(speed * 100 + 0.5f), session);
+    switch (result) {
+      case PLAYBACK_OK:
+        streamPlayback(request, session);
+        break;
+      case PLAYBACK_UNSUPPORTED:
+        request->send(415, "text/plain", "Not an AVI or MJPEG clip");
+        break;
+      case PLAYBACK_NOT_FOUND:
+        request->send(404, "text/plain", "File not found");
+        break;
+      default:
+        request->send(503, "text/plain", "Playback busy");
+        break;
+    }
   });
 
+  // Camera frames over a WebSocket, one binary message per frame with the
+  // client acknowledging each (ws_video.h)
+  wsVideo.attach(server);
+
   // Camera stream endpoint - MJPEG streaming
-  server.on("/stream", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/stream", HTTP_GET, [](AsyncWebServerRequest *request) {
     // Block stream requests during OTA upload
     if (otaUploadInProgress) {
       request->send(503, "text/plain", "Service unavailable - firmware update in progress");
@@ -289,9 +857,54 @@ void setupWebServer() {
     streamJpg(request);
   });
 
+  // One JPEG frame, or a lossless crop of it with ?x=&y=&w=&h= (the URL MQTT
+  // detection messages carry)
+  route("/snapshot.jpg", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (otaUploadInProgress) {
+      request->send(503, "text/plain", "Service unavailable - firmware update in progress");
+      return;
+    }
+
+    JpegCropRect rect = {0, 0, 0, 0};
+    if (request->hasParam("x") || request->hasParam("y") || request->hasParam("w") || request->hasParam("h")) {
+      if (!request->hasParam("x") || !request->hasParam("y") ||
+          !request->hasParam("w") || !request->hasParam("h")) {
+        request->send(400, "text/plain", "Missing x, y, w or h");
+        return;
+      }
+      rect.x = request->getParam("x")->value().toInt();
+      rect.y = request->getParam("y")->value().toInt();
+      rect.width = request->getParam("w")->value().toInt();
+      rect.height = request->getParam("h")->value().toInt();
+      if (rect.width == 0 || rect.height == 0) {
+        request->send(400, "text/plain", "w and h must be positive");
+        return;
+      }
+    }
+    sendSnapshot(request, rect);
+  });
+
+  // Boot timeline: per-step start/end (us since boot) and milestones
+  route("/api/health/boot", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    bootSequence.reportStatus(doc.to<JsonObject>());
+    doc["uptime_us"] = esp_timer_get_time();
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Per-task CPU share and stack high-water marks, per-core load timeline
+  route("/api/health/tasks", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    taskProfiler.reportStatus(doc.to<JsonObject>());
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
   // Health check endpoint with system diagnostics
-  server.on("/api/health/status", HTTP_GET, [](AsyncWebServerRequest *request) {
-    JsonDocument doc;
+  route("/api/health/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
 
     // System uptime
     unsigned long uptimeMs = millis();
@@ -310,13 +923,22 @@ void setupWebServer() {
     doc["memory"]["heap"]["free"] = ESP.getFreeHeap();
     doc["memory"]["heap"]["used"] = ESP.getHeapSize() - ESP.getFreeHeap();
     doc["memory"]["heap"]["usage_percent"] = ((float)(ESP.getHeapSize() - ESP.getFreeHeap()) / ESP.getHeapSize()) * 100;
+    doc["memory"]["heap"]["min_free"] = ESP.getMinFreeHeap();
+    doc["memory"]["heap"]["largest_free_block"] = ESP.getMaxAllocHeap();
+    doc["memory"]["heap"]["fragmentation_percent"] = ESP.getFreeHeap() > 0 ?
+      100.0f - ((float)ESP.getMaxAllocHeap() * 100 / ESP.getFreeHeap()) : 0;
 
     doc["memory"]["psram"]["total"] = ESP.getPsramSize();
     doc["memory"]["psram"]["free"] = ESP.getFreePsram();
     doc["memory"]["psram"]["used"] = ESP.getPsramSize() - ESP.getFreePsram();
     if (ESP.getPsramSize() > 0) {
       doc["memory"]["psram"]["usage_percent"] = ((float)(ESP.getPsramSize() - ESP.getFreePsram()) / ESP.getPsramSize()) * 100;
+      doc["memory"]["psram"]["min_free"] = ESP.getMinFreePsram();
+      doc["memory"]["psram"]["largest_free_block"] = ESP.getMaxAllocPsram();
+      doc["memory"]["psram"]["fragmentation_percent"] = ESP.getFreePsram() > 0 ?
+        100.0f - ((float)ESP.getMaxAllocPsram() * 100 / ESP.getFreePsram()) : 0;
     }
+    jsonArenaPool.reportStats(doc["memory"]["json_arena"].to<JsonObject>());
 
     // WiFi information
     doc["wifi"]["connected"] = WiFi.status() == WL_CONNECTED;
@@ -349,7 +971,8 @@ void setupWebServer() {
 
     // CPU information
     doc["cpu"]["frequency_mhz"] = ESP.getCpuFreqMHz();
-    doc["cpu"]["cores"] = 2; // ESP32 has 2 cores
+    doc["cpu"]["cores"] = ESP.getChipCores();
+    taskProfiler.reportCores(doc["cpu"]["usage_percent"].to<JsonArray>());
     doc["cpu"]["chip_model"] = ESP.getChipModel();
     doc["cpu"]["chip_revision"] = ESP.getChipRevision();
     doc["cpu"]["sdk_version"] = ESP.getSdkVersion();
@@ -360,43 +983,56 @@ void setupWebServer() {
 
     // OTA status
     doc["ota"]["upload_in_progress"] = otaUploadInProgress;
+    otaStaging.reportStatus(doc["ota"]["staged"].to<JsonObject>());
+
+    configStore.reportStatus(doc["config"].to<JsonObject>());
+    eventLog.reportStatus(doc["event_log"].to<JsonObject>());
+    mqttPublisher.reportStatus(doc["mqtt"].to<JsonObject>());
+    thumbnailStore.reportStatus(doc["thumbnails"].to<JsonObject>());
+    recordingCatalog.reportStatus(doc["recordings"].to<JsonObject>());
+    clipPlayer.reportStatus(doc["playback"].to<JsonObject>());
+    panTilt.reportStatus(doc["pan_tilt"].to<JsonObject>());
+    rtpStreamer.reportStatus(doc["rtp"].to<JsonObject>());
+    wsVideo.reportStatus(doc["ws_video"].to<JsonObject>());
+    workScheduler.reportStatus(doc["scheduler"].to<JsonObject>());
 
     // Overall health status
+    uint64_t sdLimit = SD_MMC.totalBytes() / 100 * configStore.settings().storage.maxUsagePercent;
     bool isHealthy = WiFi.status() == WL_CONNECTED &&
                      ESP.getFreeHeap() > 50000 && // At least 50KB free heap
-                     (!sdManager.isReady() || SD_MMC.totalBytes() > SD_MMC.usedBytes()); // SD not full
+                     (!sdManager.isReady() || SD_MMC.usedBytes() < sdLimit); // SD not full
 
     doc["status"] = isHealthy ? "healthy" : "degraded";
     doc["timestamp"] = uptimeMs;
 
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
-  });
-
-  // Serve CSS and JS files for File Manager
-  server.on("/filemanager.css", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/filemanager.css", "text/css");
+    jsonArenaPool.send(request, 200, doc, arena);
   });
 
-  server.on("/filemanager.js", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/filemanager.js", "application/javascript");
-  });
-
-  // Serve CSS and JS files for Health Monitor
-  server.on("/health.css", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/health.css", "text/css");
+  // Prometheus metrics endpoint
+  route("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    routeMetrics.writePrometheus(*response);
+    request->send(response);
   });
 
-  server.on("/health.js", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/health.js", "application/javascript");
+  // Tail of the formatted log (Serial + SD sinks share the same records)
+  route("/api/logs", HTTP_GET, [](AsyncWebServerRequest *request) {
+    size_t maxBytes = 4096;
+    if (request->hasParam("bytes")) {
+      maxBytes = request->getParam("bytes")->value().toInt();
+    }
+    AsyncResponseStream *response = request->beginResponseStream("text/plain");
+    response->addHeader("Cache-Control", "no-cache");
+    logger.writeTail(*response, maxBytes);
+    request->send(response);
   });
 
   // Health Monitor page
-  server.on("/health", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/health", HTTP_GET, [](AsyncWebServerRequest *request) {
     validateOTABoot();
-    if (sdManager.isReady()) {
-      request->send(SD_MMC, "/web/health.html", "text/html");
+    const WebAsset *page = findWebAsset("/health.html");
+    if (sdManager.isReady() && page) {
+      serveWebAsset(request, *page);
     } else {
       request->send(503, "text/html",
         "<html><body><h1>Health Monitor unavailable</h1>"
@@ -406,10 +1042,11 @@ void setupWebServer() {
   });
 
   // File Manager endpoints
-  server.on("/filemanager", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/filemanager", HTTP_GET, [](AsyncWebServerRequest *request) {
     validateOTABoot();
-    if (sdManager.isReady()) {
-      request->send(SD_MMC, "/web/filemanager.html", "text/html");
+    const WebAsset *page = findWebAsset("/filemanager.html");
+    if (sdManager.isReady() && page) {
+      serveWebAsset(request, *page);
     } else {
       request->send(503, "text/html",
         "<html><body><h1>File Manager unavailable</h1>"
@@ -418,11 +1055,12 @@ void setupWebServer() {
     }
   });
 
-  // Firmware update page and assets
-  server.on("/firmware", HTTP_GET, [](AsyncWebServerRequest *request) {
+  // Firmware update page
+  route("/firmware", HTTP_GET, [](AsyncWebServerRequest *request) {
     validateOTABoot();
-    if (sdManager.isReady()) {
-      request->send(SD_MMC, "/web/firmware.html", "text/html");
+    const WebAsset *page = findWebAsset("/firmware.html");
+    if (sdManager.isReady() && page) {
+      serveWebAsset(request, *page);
     } else {
       request->send(503, "text/html",
         "<html><body><h1>Firmware Update unavailable</h1>"
@@ -431,44 +1069,30 @@ void setupWebServer() {
     }
   });
 
-  server.on("/firmware.css", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/firmware.css", "text/css");
-  });
-
-  server.on("/firmware.js", HTTP_GET, [](AsyncWebServerRequest *request) {
-    serveStaticFile(request, "/web/firmware.js", "application/javascript");
-  });
-
   // OTA Firmware Upload endpoint
   // Static variable to track upload errors across callbacks
   static String otaUploadError = "";
+  static OtaDecoder otaDecoder;
+  static OtaVerifier otaVerifier;
 
-  server.on("/api/firmware/upload", HTTP_POST,
+  route("/api/firmware/upload", HTTP_POST,
     // Response callback (executed after upload completes)
     [](AsyncWebServerRequest *request) {
       // Release SD card mutex
       if (otaUploadInProgress) {
         xSemaphoreGive(sdCardMutex);
         otaUploadInProgress = false;
-        Serial.println("OTA upload finished - SD card mutex released");
+        LOGI(TAG_OTA, "OTA upload finished - SD card mutex released");
       }
 
       // Check for custom error from upload callback
       if (otaUploadError.length() > 0) {
-        Serial.printf("OTA Upload error: %s\n", otaUploadError.c_str());
+        LOGE_S(TAG_OTA, "OTA Upload error: %s", otaUploadError.c_str());
+        eventLog.recordText(EVENT_OTA, 0, otaUploadError.c_str());
         request->send(500, "application/json",
           "{\"error\":\"" + otaUploadError + "\"}");
         otaUploadError = ""; // Reset error
-
-        // Re-enable camera
-        cameraActive = true;
-        Serial.println("Camera access resumed after error");
-
-        // Try to reinitialize camera
-        delay(100);
-        if (initCamera()) {
-          Serial.println("Camera reinitialized successfully after OTA error");
-        }
+        resumeCamera(OTA_CAMERA_RESUME_MS);
         return;
       }
 
@@ -476,103 +1100,111 @@ void setupWebServer() {
       if (Update.hasError()) {
         String error = "Update failed. Error: ";
         error += Update.errorString();
-        Serial.println(error);
+        LOGE_S(TAG_OTA, "%s", error.c_str());
+        eventLog.recordText(EVENT_OTA, 0, error.c_str());
         request->send(500, "application/json",
           "{\"error\":\"" + error + "\"}");
-
-        // Re-enable camera
-        cameraActive = true;
-        Serial.println("Camera access resumed after error");
-
-        // Try to reinitialize camera
-        delay(100);
-        if (initCamera()) {
-          Serial.println("Camera reinitialized successfully after OTA error");
-        }
+        resumeCamera(OTA_CAMERA_RESUME_MS);
         return;
       }
 
       // Success - send response and reboot
-      Serial.println("OTA Update successful! Rebooting...");
-      request->send(200, "application/json",
-        "{\"status\":\"ok\",\"message\":\"Firmware updated successfully. Device will reboot now.\"}");
-
-      // Give enough time for response to be fully transmitted to client
-      delay(2000);
-      Serial.println("Restarting ESP32 now...");
-      ESP.restart();
+      LOGI(TAG_OTA, "OTA Update successful! Rebooting...");
+      eventLog.recordText(EVENT_OTA, 1, "Firmware updated - rebooting");
+      const OtaVerifyResult &verified = otaVerifier.result();
+      std::shared_ptr<String> body = std::make_shared<String>(
+        String("{\"status\":\"ok\",\"message\":\"Firmware updated successfully. Device will reboot now.\"") +
+        ",\"sha256\":\"" + verified.sha256 + "\",\"signature\":\"" + OtaVerifier::signatureName(verified.signature) +
+        "\",\"hash_kbps\":" + String(verified.hashKBps) + "}");
+
+      // Reboot once the last byte is handed to TCP, or after
+      // OTA_RESTART_TIMEOUT_MS if the client stops reading
+      request->send(request->beginResponse("application/json", body->length(),
+        [body](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          size_t len = body->length() - index;
+          if (len > maxLen) len = maxLen;
+          memcpy(buffer, body->c_str() + index, len);
+          if (len && index + len == body->length()) deferOrRun("restart", restartJob, OTA_RESTART_GRACE_MS);
+          return len;
+        }));
+      deferOrRun("restart", restartJob, OTA_RESTART_TIMEOUT_MS);
     },
 
     // Upload chunk callback (executed for each data chunk)
     [](AsyncWebServerRequest *request, String filename, size_t index,
        uint8_t *data, size_t len, bool final) {
+      CallbackTimer timer(CALLBACK_UPLOAD);
 
       // First chunk - initialize OTA update
       if (index == 0) {
-        Serial.printf("\n=== OTA Update started: %s ===\n", filename.c_str());
-        Serial.printf("File size: %d bytes\n", request->contentLength());
+        LOGI_S(TAG_OTA, "=== OTA Update started: %s ===", filename.c_str());
+        LOGI(TAG_OTA, "File size: %u bytes", request->contentLength());
         otaUploadError = ""; // Reset error flag
 
         // Disable watchdog for this task to prevent timeout during camera deinit
-        Serial.println("[0/6] Disabling watchdog timer...");
+        LOGI(TAG_OTA, "[0/6] Disabling watchdog timer...");
         esp_task_wdt_delete(xTaskGetIdleTaskHandleForCPU(0));
         esp_task_wdt_delete(xTaskGetIdleTaskHandleForCPU(1));
 
-        // Stop camera access from loop() task
-        cameraActive = false;
-        Serial.println("[1/6] Camera access paused");
-        delay(300); // Increased delay to ensure camera operations stop
-
-        // Deinitialize camera to free shared pins (SD card shares pins with camera)
-        Serial.println("[2/6] Deinitializing camera...");
-        esp_err_t err = esp_camera_deinit();
-        if (err != ESP_OK) {
-          Serial.printf("Camera deinit warning: 0x%x\n", err);
-        } else {
-          Serial.println("Camera deinitialized successfully");
-        }
-        delay(200); // Increased delay for camera to fully stop
-
-        // Free up memory before OTA
-        Serial.println("[3/6] Freeing memory...");
-        Serial.printf("Free heap before OTA: %d bytes\n", ESP.getFreeHeap());
+        // Stop camera access; the worker deinitializes the camera once
+        // its users have stopped, while the upload carries on
+        pauseCamera();
+        LOGI(TAG_OTA, "[1/6] Camera access paused");
+        LOGI(TAG_OTA, "[2/6] Camera deinit deferred by %u ms", OTA_CAMERA_SETTLE_MS);
+        LOGI(TAG_OTA, "[3/6] Free heap before OTA: %u bytes", ESP.getFreeHeap());
 
         // Acquire SD card mutex to block file operations
-        Serial.println("[4/6] Acquiring SD card mutex...");
+        LOGI(TAG_OTA, "[4/6] Acquiring SD card mutex...");
         if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(10000)) != pdTRUE) {
-          Serial.println("ERROR: SD card busy - mutex timeout");
+          LOGE(TAG_OTA, "SD card busy - mutex timeout");
           otaUploadError = "SD card is busy";
-          cameraActive = true; // Re-enable camera on error
+          resumeCamera(0); // Re-enable camera on error
           return;
         }
         otaUploadInProgress = true;
-        Serial.println("SD card mutex acquired");
+        LOGI(TAG_OTA, "SD card mutex acquired");
 
         // Validate ESP32 firmware format
-        Serial.println("[5/6] Validating firmware...");
+        LOGI(TAG_OTA, "[5/6] Validating firmware...");
         if (!isValidESP32Firmware(data, len)) {
-          Serial.println("ERROR: Invalid firmware file - magic byte check failed");
-          otaUploadError = "Invalid ESP32 firmware file (magic byte check failed)";
+          LOGE(TAG_OTA, "Invalid firmware file - magic byte check failed");
+          otaUploadError = "Invalid firmware file (not an ESP32, gzip, heatshrink or delta image)";
           xSemaphoreGive(sdCardMutex);
           otaUploadInProgress = false;
-          cameraActive = true; // Re-enable camera on error
+          resumeCamera(0); // Re-enable camera on error
           return;
         }
-        Serial.println("Firmware validation passed");
+        LOGI(TAG_OTA, "Firmware validation passed");
 
         // Begin OTA update
-        Serial.println("[6/6] Initializing OTA update...");
+        LOGI(TAG_OTA, "[6/6] Initializing OTA update...");
         if (!Update.begin(UPDATE_SIZE_UNKNOWN, U_FLASH)) {
-          Serial.printf("ERROR: Update.begin() failed: %s\n", Update.errorString());
+          LOGE(TAG_OTA, "Update.begin() failed: %s", Update.errorString());
           otaUploadError = "Failed to begin OTA update: ";
           otaUploadError += Update.errorString();
           xSemaphoreGive(sdCardMutex);
           otaUploadInProgress = false;
-          cameraActive = true; // Re-enable camera on error
+          resumeCamera(0); // Re-enable camera on error
+          return;
+        }
+        otaDecoder.begin(writeUpdateChunk, NULL, OtaDecoder::readRunningFirmware, NULL);
+
+        // Hash and signature are checked as chunks arrive, before Update.end()
+        const char *expectedSha256 = request->hasParam("sha256") ? request->getParam("sha256")->value().c_str() : NULL;
+        if (!otaVerifier.begin(OtaDecoder::writeTo, &otaDecoder, expectedSha256)) {
+          otaUploadError = otaVerifier.error();
+          otaVerifier.end();
+          otaDecoder.end();
+          Update.abort();
           return;
         }
 
-        Serial.println("=== OTA Update initialized - ready to receive data ===\n");
+        LOGI(TAG_OTA, "=== OTA Update initialized - ready to receive data ===");
+      }
+
+      // Upload already failed - drain the remaining chunks
+      if (otaUploadError.length() > 0) {
+        return;
       }
 
       // Write chunk to flash
@@ -580,10 +1212,12 @@ void setupWebServer() {
         // Feed watchdog before write operation
         yield();
 
-        size_t written = Update.write(data, len);
-        if (written != len) {
-          Serial.printf("ERROR: OTA Write failed - wrote %d of %d bytes\n", written, len);
-          otaUploadError = "Failed to write firmware data to flash";
+        // Verified, then expanded (compressed and delta images) on the fly
+        if (!otaVerifier.write(data, len)) {
+          LOGE(TAG_OTA, "OTA Write failed at %u bytes", index);
+          otaUploadError = otaDecoder.error() ? otaDecoder.error() : otaVerifier.error();
+          otaVerifier.end();
+          otaDecoder.end();
           Update.abort();
           return;
         }
@@ -593,34 +1227,413 @@ void setupWebServer() {
 
         // Log progress more frequently for debugging
         if (index % 32768 == 0 && index > 0) { // Every 32KB
-          Serial.printf("Progress: %d KB written (%.1f%%)\n",
-                       (index + len) / 1024,
-                       ((float)(index + len) / request->contentLength()) * 100);
-          Serial.printf("Free heap: %d bytes\n", ESP.getFreeHeap());
+          LOGI(TAG_OTA, "Progress: %u KB written (%u%%)",
+               (index + len) / 1024,
+               (uint32_t)(((uint64_t)(index + len) * 100) / request->contentLength()));
+          LOGD(TAG_OTA, "Free heap: %u bytes", ESP.getFreeHeap());
         }
       }
 
       // Final chunk - complete OTA update
       if (final) {
-        Serial.println("\n=== Finalizing OTA update ===");
-        Serial.printf("Total received: %d bytes\n", index + len);
-
-        if (Update.end(true)) {
-          Serial.println("SUCCESS: OTA Update completed!");
-          Serial.printf("Final size: %d bytes\n", index + len);
-          Serial.printf("Free heap: %d bytes\n", ESP.getFreeHeap());
-          Serial.println("Device will reboot after sending response...");
+        LOGI(TAG_OTA, "=== Finalizing OTA update ===");
+        LOGI(TAG_OTA, "Total received: %u bytes", index + len);
+
+        // Reject before Update.end() switches the boot partition
+        bool verified = otaVerifier.finish();
+        bool decoded = verified && otaDecoder.finish();
+        size_t decodedSize = otaDecoder.outputBytes();
+        const OtaVerifyResult &result = otaVerifier.result();
+        if (!verified) {
+          LOGE(TAG_OTA, "Image verification failed: %s", otaDecoder.error() ? otaDecoder.error() : otaVerifier.error());
+          otaUploadError = otaDecoder.error() ? otaDecoder.error() : otaVerifier.error();
+          Update.abort();
+        } else if (!decoded) {
+          LOGE(TAG_OTA, "Image decode failed: %s", otaDecoder.error());
+          otaUploadError = otaDecoder.error();
+          Update.abort();
+        } else if (Update.end(true)) {
+          LOGI(TAG_OTA, "SHA-256 %08x%08x%08x%08x", OtaVerifier::digestWord(result.sha256, 0),
+               OtaVerifier::digestWord(result.sha256, 1), OtaVerifier::digestWord(result.sha256, 2),
+               OtaVerifier::digestWord(result.sha256, 3));
+          LOGI(TAG_OTA, "        %08x%08x%08x%08x", OtaVerifier::digestWord(result.sha256, 4),
+               OtaVerifier::digestWord(result.sha256, 5), OtaVerifier::digestWord(result.sha256, 6),
+               OtaVerifier::digestWord(result.sha256, 7));
+          LOGI(TAG_OTA, "Signature %s", OtaVerifier::signatureName(result.signature));
+          LOGI(TAG_OTA, "Hashed %u bytes in %u us (%u KB/s, writer stalled %u us)",
+               result.bytes, result.hashMicros, result.hashKBps, result.stallMicros);
+          LOGI(TAG_OTA, "SUCCESS: OTA Update completed!");
+          LOGI(TAG_OTA, "Final size: %u bytes (%s/%s)", decodedSize,
+               OtaDecoder::formatName(otaDecoder.container()), OtaDecoder::formatName(otaDecoder.payload()));
+          LOGI(TAG_OTA, "Free heap: %u bytes", ESP.getFreeHeap());
+          LOGI(TAG_OTA, "Device will reboot after sending response...");
         } else {
-          Serial.printf("ERROR: Update.end() failed: %s\n", Update.errorString());
+          LOGE(TAG_OTA, "Update.end() failed: %s", Update.errorString());
           otaUploadError = "Failed to finalize OTA update: ";
           otaUploadError += Update.errorString();
         }
+        otaVerifier.end();
+        otaDecoder.end();
       }
     }
   );
 
+  // Staged OTA: resumable upload of the image to SD while the camera keeps
+  // running. Each slice is a multipart POST with ?offset=<bytes already
+  // staged>&total=<image size>; a failed slice is resumed from staged_bytes.
+  static String stageUploadError = "";
+
+  route("/api/firmware/stage", HTTP_POST,
+    [](AsyncWebServerRequest *request) {
+      JsonArena *arena = jsonArenaPool.acquire();
+      JsonDocument doc(arena);
+      otaStaging.reportStatus(doc.to<JsonObject>());
+
+      int code = 200;
+      if (stageUploadError.length() > 0) {
+        doc["error"] = stageUploadError;
+        code = stageUploadError.startsWith("Offset") ? 409 : 500;
+        stageUploadError = "";
+      }
+      jsonArenaPool.send(request, code, doc, arena);
+    },
+    [](AsyncWebServerRequest *request, String filename, size_t index,
+       uint8_t *data, size_t len, bool final) {
+      CallbackTimer timer(CALLBACK_UPLOAD);
+      if (index == 0) {
+        stageUploadError = "";
+        size_t offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+        size_t total = request->hasParam("total") ? request->getParam("total")->value().toInt() : 0;
+        if (!sdManager.isReady()) {
+          stageUploadError = "SD card not ready";
+        } else {
+          String sha256 = request->hasParam("sha256") ? request->getParam("sha256")->value() : String();
+          otaStaging.beginSlice(offset, total, sha256, stageUploadError);
+        }
+      }
+
+      if (stageUploadError.length() == 0 && len) {
+        otaStaging.writeSlice(data, len, stageUploadError);
+      }
+
+      if (final) {
+        otaStaging.endSlice();
+      }
+    }
+  );
+
+  route("/api/firmware/staged", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    otaStaging.reportStatus(doc.to<JsonObject>());
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Flash the staged image from a background task; the device reboots when done
+  route("/api/firmware/apply", HTTP_POST, [](AsyncWebServerRequest *request) {
+    String error;
+    if (!otaStaging.startFlash(error)) {
+      request->send(409, "application/json", "{\"error\":\"" + error + "\"}");
+      return;
+    }
+    request->send(202, "application/json", "{\"status\":\"flashing\"}");
+  });
+
+  route("/api/firmware/discard", HTTP_POST, [](AsyncWebServerRequest *request) {
+    String error;
+    if (!otaStaging.clear(error)) {
+      request->send(409, "application/json", "{\"error\":\"" + error + "\"}");
+      return;
+    }
+    request->send(200, "application/json", "{\"status\":\"ok\"}");
+  });
+
+  // Runtime configuration (more specific routes first: "/api/config" also matches its subpaths)
+  route("/api/config/schema", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    configStore.writeSchema(doc["fields"].to<JsonArray>());
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Re-read /config.json after editing it in the file manager
+  route("/api/config/reload", HTTP_POST, [](AsyncWebServerRequest *request) {
+    ConfigChange change;
+    String error;
+    if (!sdManager.isReady()) {
+      request->send(503, "application/json", "{\"error\":\"SD card not ready\"}");
+      return;
+    }
+    if (!configStore.reload(change, error)) {
+      sendConfigError(request, error);
+      return;
+    }
+    sendConfigChange(request, change);
+  });
+
+  route("/api/config", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    configStore.writeConfig(doc.to<JsonObject>(), false);
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Partial update: {"camera": {"quality": 10}, "stream": {...}}
+  route("/api/config", HTTP_POST,
+    [](AsyncWebServerRequest *request) {
+      JsonDocument patch;
+      if (!readConfigBody(request, patch)) return;
+
+      ConfigChange change;
+      String error;
+      if (!configStore.update(patch, change, error)) {
+        sendConfigError(request, error);
+        return;
+      }
+      sendConfigChange(request, change);
+    },
+    NULL, collectConfigBody);
+
+  // Region followed by /stream/crop?follow=1
+  route("/api/camera/follow", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("x") || !request->hasParam("y") ||
+        !request->hasParam("w") || !request->hasParam("h")) {
+      request->send(400, "application/json", "{\"error\":\"Missing x, y, w or h\"}");
+      return;
+    }
+    JpegCropRect rect;
+    rect.x = request->getParam("x")->value().toInt();
+    rect.y = request->getParam("y")->value().toInt();
+    rect.width = request->getParam("w")->value().toInt();
+    rect.height = request->getParam("h")->value().toInt();
+    setFollowTarget(rect);
+    request->send(200, "application/json", "{\"status\":\"ok\"}");
+  });
+
+  // Live camera control: sensor settings as reported by the driver, the
+  // camera/stream settings and the rate controller state
+  route("/api/camera", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    configStore.writeConfig(doc["settings"].to<JsonObject>(), false,
+                            CONFIG_MASK(CFG_SECTION_CAMERA) | CONFIG_MASK(CFG_SECTION_STREAM));
+
+    sensor_t *s = cameraActive ? esp_camera_sensor_get() : NULL;
+    if (s) {
+      JsonObject sensor = doc["sensor"].to<JsonObject>();
+      sensor["framesize"] = s->status.framesize;
+      sensor["quality"] = s->status.quality;
+      sensor["brightness"] = s->status.brightness;
+      sensor["contrast"] = s->status.contrast;
+      sensor["saturation"] = s->status.saturation;
+      sensor["aec"] = s->status.aec;
+      sensor["aec2"] = s->status.aec2;
+      sensor["ae_level"] = s->status.ae_level;
+      sensor["aec_value"] = s->status.aec_value;
+      sensor["agc"] = s->status.agc;
+      sensor["agc_gain"] = s->status.agc_gain;
+      sensor["gainceiling"] = s->status.gainceiling;
+      sensor["awb"] = s->status.awb;
+      sensor["awb_gain"] = s->status.awb_gain;
+      sensor["wb_mode"] = s->status.wb_mode;
+      sensor["special_effect"] = s->status.special_effect;
+      sensor["hmirror"] = s->status.hmirror;
+      sensor["vflip"] = s->status.vflip;
+    }
+    qualityController.reportStatus(doc["rate_control"].to<JsonObject>());
+
+    // Crop stream timing: fps is what the cropper alone could sustain
+    JsonObject crop = doc["crop"].to<JsonObject>();
+    crop["frames"] = cropStats.frames;
+    crop["failures"] = cropStats.failures;
+    crop["avg_us"] = cropStats.avgMicros;
+    crop["fps"] = cropStats.avgMicros ? 1000000 / cropStats.avgMicros : 0;
+    crop["in_bytes"] = cropStats.lastInBytes;
+    crop["out_bytes"] = cropStats.lastOutBytes;
+    crop["mcus_decoded"] = cropStats.last.mcusDecoded;
+    crop["mcus_written"] = cropStats.last.mcusWritten;
+    crop["intervals_skipped"] = cropStats.last.intervalsSkipped;
+    JsonArray rect = crop["rect"].to<JsonArray>();
+    rect.add(cropStats.lastRect.x);
+    rect.add(cropStats.lastRect.y);
+    rect.add(cropStats.lastRect.width);
+    rect.add(cropStats.lastRect.height);
+
+    // Raw pixel formats: on-device JPEG encoder timing
+    JsonObject encoder = doc["encoder"].to<JsonObject>();
+    encoder["active"] = configStore.settings().camera.pixelFormat != CAMERA_PIXELS_JPEG;
+    encoder["quality"] = jpegEncoder.quality();
+    encoder["frames"] = encodeStats.frames;
+    encoder["failures"] = encodeStats.failures;
+    encoder["avg_us"] = encodeStats.avgMicros;
+    encoder["fps"] = encodeStats.avgMicros ? 1000000 / encodeStats.avgMicros : 0;
+    encoder["last_bytes"] = encodeStats.lastBytes;
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Latest results of the on-device model, model information, memory plan
+  // and per-layer timing (?layers=0 leaves the layer list out, ?plan=1
+  // adds where every activation tensor lives)
+  route("/api/detections", HTTP_GET, [](AsyncWebServerRequest *request) {
+    bool layers = !request->hasParam("layers") || request->getParam("layers")->value() != "0";
+    bool plan = request->hasParam("plan") && request->getParam("plan")->value() == "1";
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    detector.reportStatus(doc.to<JsonObject>(), layers, plan);
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Rest position of the pan/tilt servos while no target is followed.
+  // Registered before "/api/pan_tilt", which would also match it.
+  route("/api/pan_tilt/aim", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("pan") || !request->hasParam("tilt")) {
+      request->send(400, "application/json", "{\"error\":\"Missing pan or tilt\"}");
+      return;
+    }
+    panTilt.aim(request->getParam("pan")->value().toFloat(), request->getParam("tilt")->value().toFloat());
+    request->send(200, "application/json", "{\"status\":\"ok\"}");
+  });
+
+  // Servo angles, the followed track and control loop timing (jitter)
+  route("/api/pan_tilt", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    panTilt.reportStatus(doc.to<JsonObject>());
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // RTP/UDP sessions. host defaults to the requesting client; start answers
+  // with the SDP to open in a player and renews an existing session.
+  // Registered before "/api/rtp", which would also match them.
+  route("/api/rtp/start", HTTP_POST, [](AsyncWebServerRequest *request) {
+    IPAddress host;
+    uint16_t port;
+    if (!rtpReceiver(request, host, port)) return;
+    const char *error = rtpStreamer.start(host, port);
+    if (error) {
+      request->send(409, "application/json", String("{\"error\":\"") + error + "\"}");
+      return;
+    }
+    request->send(200, "application/sdp", rtpStreamer.sdp(host, port));
+  });
+
+  route("/api/rtp/stop", HTTP_POST, [](AsyncWebServerRequest *request) {
+    IPAddress host;
+    uint16_t port;
+    if (!rtpReceiver(request, host, port)) return;
+    if (!rtpStreamer.stop(host, port)) {
+      request->send(404, "application/json", "{\"error\":\"No such session\"}");
+      return;
+    }
+    request->send(200, "application/json", "{\"status\":\"ok\"}");
+  });
+
+  route("/api/rtp", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    rtpStreamer.reportStatus(doc.to<JsonObject>());
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Detection zones and the latest zone-crossing events
+  route("/api/zones", HTTP_GET, [](AsyncWebServerRequest *request) {
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    zoneMap.writeJson(doc.to<JsonObject>(), true);
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Persistent events in a time range, one JSON object per line:
+  // ?from=&to= (event time in ms; negative = ms before now), ?type=a,b and
+  // ?limit= (default 1000)
+  route("/api/events/query", HTTP_GET, [](AsyncWebServerRequest *request) {
+    streamEvents(request);
+  });
+
+  // Page of the recording catalog: ?from=&to= (start time, s since the
+  // epoch), ?kind=clip|snapshot, ?order=asc|desc (default newest first),
+  // ?offset= and ?limit= (default 50, at most 200)
+  route("/api/recordings", HTTP_GET, [](AsyncWebServerRequest *request) {
+    int kind = -1;
+    if (request->hasParam("kind")) {
+      String value = request->getParam("kind")->value();
+      if (value == "clip") kind = RECORDING_CLIP;
+      else if (value == "snapshot") kind = RECORDING_SNAPSHOT;
+      else {
+        request->send(400, "application/json", "{\"error\":\"kind must be clip or snapshot\"}");
+        return;
+      }
+    }
+    uint32_t from = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), NULL, 10) : 0;
+    uint32_t to = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), NULL, 10) : UINT32_MAX;
+    long offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+    long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : CATALOG_PAGE_DEFAULT;
+    bool ascending = request->hasParam("order") && request->getParam("order")->value() == "asc";
+
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
+    recordingCatalog.query(doc.to<JsonObject>(), from, to, offset < 0 ? 0 : offset,
+                           limit < 1 ? 1 : (limit > CATALOG_PAGE_MAX ? CATALOG_PAGE_MAX : limit), ascending, kind);
+    jsonArenaPool.send(request, 200, doc, arena);
+  });
+
+  // Replaces every zone: {"zones": [{"name", "type", "points"}]}. ?save=0
+  // keeps the zones for this session without writing /zones.json.
+  route("/api/zones", HTTP_POST,
+    [](AsyncWebServerRequest *request) {
+      JsonDocument body;
+      if (!readConfigBody(request, body)) return;
+      bool persist = !(request->hasParam("save") && request->getParam("save")->value() == "0");
+      String error;
+      if (!zoneMap.update(body, error, persist)) {
+        sendConfigError(request, error);
+        return;
+      }
+      JsonArena *arena = jsonArenaPool.acquire();
+      JsonDocument doc(arena);
+      zoneMap.writeJson(doc.to<JsonObject>(), false);
+      jsonArenaPool.send(request, 200, doc, arena);
+    },
+    NULL, collectConfigBody);
+
+  // Flat update of camera (and rate control) keys, applied to the sensor
+  // without re-initializing the camera: {"frame_size": "VGA", "aec": false}.
+  // ?save=0 applies the change without writing it to the SD card and NVS.
+  route("/api/camera", HTTP_POST,
+    [](AsyncWebServerRequest *request) {
+      JsonDocument body;
+      if (!readConfigBody(request, body)) return;
+      if (!body.is<JsonObject>()) {
+        sendConfigError(request, "Expected a JSON object of camera settings");
+        return;
+      }
+
+      JsonDocument patch;
+      for (JsonPair pair : body.as<JsonObject>()) {
+        const char *key = pair.key().c_str();
+        if (ConfigStore::hasKey(CFG_SECTION_CAMERA, key)) {
+          patch["camera"][key] = pair.value();
+        } else if (ConfigStore::hasKey(CFG_SECTION_STREAM, key)) {
+          patch["stream"][key] = pair.value();
+        } else {
+          sendConfigError(request, String("Unknown camera setting: ") + key);
+          return;
+        }
+      }
+
+      bool persist = !(request->hasParam("save") && request->getParam("save")->value() == "0");
+      ConfigChange change;
+      String error;
+      if (!configStore.update(patch, change, error, persist)) {
+        sendConfigError(request, error);
+        return;
+      }
+      sendConfigChange(request, change);
+    },
+    NULL, collectConfigBody);
+
   // List files in directory
-  server.on("/api/files/list", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/api/files/list", HTTP_GET, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "application/json", "{\"error\":\"System busy - firmware update in progress\"}");
       return;
@@ -642,25 +1655,24 @@ void setupWebServer() {
       return;
     }
 
-    JsonDocument doc;
+    JsonArena *arena = jsonArenaPool.acquire();
+    JsonDocument doc(arena);
     JsonArray files = doc["files"].to<JsonArray>();
 
     File file = root.openNextFile();
     while (file) {
       JsonObject fileObj = files.add<JsonObject>();
-      fileObj["name"] = String(file.name());
+      fileObj["name"] = file.name();
       fileObj["size"] = file.size();
       fileObj["isDir"] = file.isDirectory();
       file = root.openNextFile();
     }
 
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+    jsonArenaPool.send(request, 200, doc, arena);
   });
 
   // Download file
-  server.on("/api/files/download", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/api/files/download", HTTP_GET, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "text/plain", "System busy - firmware update in progress");
       return;
@@ -685,8 +1697,77 @@ void setupWebServer() {
     request->send(SD_MMC, filepath, String(), true);
   });
 
+  // Gallery thumbnail of a JPEG or MJPEG/AVI clip. Misses are generated in
+  // the background: 202 with Retry-After until the thumbnail is cached.
+  route("/api/files/thumb", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (otaUploadInProgress) {
+      request->send(503, "application/json", "{\"error\":\"System busy - firmware update in progress\"}");
+      return;
+    }
+
+    if (!sdManager.isReady()) {
+      request->send(503, "application/json", "{\"error\":\"SD card not ready\"}");
+      return;
+    }
+
+    if (!request->hasParam("file")) {
+      request->send(400, "application/json", "{\"error\":\"Missing file parameter\"}");
+      return;
+    }
+
+    String filepath = request->getParam("file")->value();
+    String cachePath;
+    String etag;
+    const char *error = NULL;
+    ThumbnailState state = thumbnailStore.lookup(filepath.c_str(), cachePath, etag, error);
+    AsyncWebServerResponse *response = NULL;
+
+    switch (state) {
+      case THUMB_READY: {
+        const AsyncWebHeader *match = request->getHeader("If-None-Match");
+        if (match && match->value() == etag) {
+          response = request->beginResponse(304, "image/jpeg", String());
+        } else {
+          response = request->beginResponse(SD_MMC, cachePath, "image/jpeg");
+        }
+        if (response) {
+          response->addHeader("ETag", etag);
+          response->addHeader("Cache-Control", "no-cache");
+        }
+        break;
+      }
+      case THUMB_QUEUED:
+        response = request->beginResponse(202, "application/json", "{\"status\":\"queued\"}");
+        response->addHeader("Retry-After", "1");
+        break;
+      case THUMB_QUEUE_FULL:
+        response = request->beginResponse(503, "application/json", "{\"error\":\"Thumbnail queue full\"}");
+        response->addHeader("Retry-After", "2");
+        break;
+      case THUMB_SD_BUSY:
+        response = request->beginResponse(503, "application/json", "{\"error\":\"SD card busy\"}");
+        response->addHeader("Retry-After", "1");
+        break;
+      case THUMB_NOT_FOUND:
+        response = request->beginResponse(404, "application/json", "{\"error\":\"File not found\"}");
+        break;
+      case THUMB_UNSUPPORTED:
+        response = request->beginResponse(415, "application/json", "{\"error\":\"Not a JPEG or MJPEG/AVI file\"}");
+        break;
+      case THUMB_FAILED:
+        response = request->beginResponse(422, "application/json", String("{\"error\":\"") + error + "\"}");
+        break;
+    }
+
+    if (response) {
+      request->send(response);
+    } else {
+      request->send(500, "application/json", "{\"error\":\"Failed to create response\"}");
+    }
+  });
+
   // View file content
-  server.on("/api/files/view", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/api/files/view", HTTP_GET, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "text/plain", "System busy - firmware update in progress");
       return;
@@ -712,7 +1793,7 @@ void setupWebServer() {
   });
 
   // Read file content for editing (with size limit)
-  server.on("/api/files/read", HTTP_GET, [](AsyncWebServerRequest *request) {
+  route("/api/files/read", HTTP_GET, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "application/json", "{\"error\":\"System busy - firmware update in progress\"}");
       return;
@@ -746,38 +1827,55 @@ void setupWebServer() {
       size_t fileSize = file.size();
 
       // Limit file size to 50KB for safety
-      if (fileSize > 51200) {
+      if (fileSize > FILE_READ_MAX) {
         file.close();
         xSemaphoreGive(sdCardMutex);
         request->send(413, "application/json", "{\"error\":\"File too large (max 50KB)\"}");
         return;
       }
 
-      String content = "";
-      content.reserve(fileSize + 1);
-
-      while (file.available()) {
-        content += (char)file.read();
-      }
+      // The whole arena is the response body. The file is read into its tail
+      // and escaped forward in place, so the content is copied once and never
+      // goes through a JsonDocument or a String. When the arena has no room
+      // (no PSRAM for a temporary one) the block overflows to the heap and
+      // the response frees it
+      JsonArena *arena = jsonArenaPool.acquire(FILE_READ_ARENA(fileSize));
+      size_t capacity = arena->available();
+      if (capacity < FILE_READ_ARENA(fileSize)) capacity = FILE_READ_ARENA(fileSize);
+      char *body = (char *)arena->allocate(capacity);
+      uint8_t *raw = body ? (uint8_t *)body + capacity - fileSize : NULL;
+      size_t bytesRead = raw ? file.read(raw, fileSize) : 0;
 
       file.close();
       xSemaphoreGive(sdCardMutex);
 
-      JsonDocument doc;
-      doc["status"] = "ok";
-      doc["content"] = content;
-      doc["size"] = fileSize;
+      if (!body) {
+        jsonArenaPool.release(arena);
+        request->send(500, "application/json", "{\"error\":\"Out of memory\"}");
+        return;
+      }
+      if (bytesRead != fileSize) {
+        arena->deallocate(body);
+        jsonArenaPool.release(arena);
+        request->send(500, "application/json", "{\"error\":\"Failed to read file\"}");
+        return;
+      }
 
-      String response;
-      serializeJson(doc, response);
-      request->send(200, "application/json", response);
+      size_t len = writeFileReadBody(body, capacity, raw, fileSize);
+      if (len == 0) {
+        arena->deallocate(body);
+        jsonArenaPool.release(arena);
+        request->send(415, "application/json", "{\"error\":\"File is not text\"}");
+        return;
+      }
+      jsonArenaPool.sendBody(request, 200, body, len, arena);
     } else {
       request->send(503, "application/json", "{\"error\":\"SD card busy\"}");
     }
   });
 
   // Write file content (save edited file)
-  server.on("/api/files/write", HTTP_POST, [](AsyncWebServerRequest *request) {
+  route("/api/files/write", HTTP_POST, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "application/json", "{\"error\":\"System busy - firmware update in progress\"}");
       return;
@@ -810,13 +1908,12 @@ void setupWebServer() {
       xSemaphoreGive(sdCardMutex);
 
       if (written > 0) {
-        JsonDocument doc;
+        JsonArena *arena = jsonArenaPool.acquire();
+        JsonDocument doc(arena);
         doc["status"] = "ok";
         doc["written"] = written;
 
-        String response;
-        serializeJson(doc, response);
-        request->send(200, "application/json", response);
+        jsonArenaPool.send(request, 200, doc, arena);
       } else {
         request->send(500, "application/json", "{\"error\":\"Failed to write file\"}");
       }
@@ -826,7 +1923,7 @@ void setupWebServer() {
   });
 
   // Delete file
-  server.on("/api/files/delete", HTTP_POST, [](AsyncWebServerRequest *request) {
+  route("/api/files/delete", HTTP_POST, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "application/json", "{\"error\":\"System busy - firmware update in progress\"}");
       return;
@@ -858,6 +1955,7 @@ void setupWebServer() {
       success = SD_MMC.rmdir(filepath);
     } else {
       success = SD_MMC.remove(filepath);
+      if (success) recordingCatalog.forget(filepath.c_str());
     }
 
     if (success) {
@@ -868,20 +1966,21 @@ void setupWebServer() {
   });
 
   // Upload file
-  server.on("/api/files/upload", HTTP_POST,
+  route("/api/files/upload", HTTP_POST,
     [](AsyncWebServerRequest *request) {
       request->send(200, "application/json", "{\"status\":\"ok\"}");
     },
     [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+      CallbackTimer timer(CALLBACK_UPLOAD);
       static File uploadFile;
 
       if (otaUploadInProgress) {
-        Serial.println("File upload blocked: OTA in progress");
+        LOGW(TAG_FILES, "File upload blocked: OTA in progress");
         return;
       }
 
       if (!sdManager.isReady()) {
-        Serial.println("Upload failed: SD not ready");
+        LOGE(TAG_FILES, "Upload failed: SD not ready");
         return;
       }
 
@@ -890,30 +1989,29 @@ void setupWebServer() {
         String path = "/";
         if (request->hasParam("dir", false)) {  // false = GET parameter
           path = request->getParam("dir", false)->value();
-          Serial.printf("Upload - received dir parameter from query string: '%s'\n", path.c_str());
+          LOGD_S(TAG_FILES, "Upload - received dir parameter from query string: '%s'", path.c_str());
 
           // Normalize path: ensure it ends with / unless it's just "/"
           if (path != "/" && !path.endsWith("/")) {
             path += "/";
           }
         } else {
-          Serial.println("Upload - no dir parameter, using root");
+          LOGD(TAG_FILES, "Upload - no dir parameter, using root");
         }
 
         String filepath = path + filename;
-        Serial.printf("Upload start: %s (dir='%s', file='%s')\n",
-                      filepath.c_str(), path.c_str(), filename.c_str());
+        LOGI_S(TAG_FILES, "Upload start: %s", filepath.c_str());
 
         // Delete existing file to prevent appending to old content
         // FILE_WRITE mode appends if file exists, so we need to remove it first
         if (SD_MMC.exists(filepath)) {
           SD_MMC.remove(filepath);
-          Serial.printf("Existing file removed for overwrite: %s\n", filepath.c_str());
+          LOGI_S(TAG_FILES, "Existing file removed for overwrite: %s", filepath.c_str());
         }
 
         uploadFile = SD_MMC.open(filepath, FILE_WRITE);
         if (!uploadFile) {
-          Serial.printf("Failed to open file for writing: %s\n", filepath.c_str());
+          LOGE_S(TAG_FILES, "Failed to open file for writing: %s", filepath.c_str());
           return;
         }
       }
@@ -922,7 +2020,7 @@ void setupWebServer() {
       if (uploadFile && len) {
         size_t written = uploadFile.write(data, len);
         if (written != len) {
-          Serial.printf("Warning: Only wrote %d of %d bytes\n", written, len);
+          LOGW(TAG_FILES, "Only wrote %u of %u bytes", written, len);
         }
 
         // Feed watchdog periodically to prevent timeout on large uploads
@@ -933,40 +2031,45 @@ void setupWebServer() {
 
       if (final) {
         if (uploadFile) {
+          String closedPath = uploadFile.path();
           uploadFile.close();
-          Serial.printf("Upload complete: %s (%d bytes total)\n", filename.c_str(), index + len);
+          LOGI_S(TAG_FILES, "Upload complete: %s (%u bytes total)", filename.c_str(), index + len);
+          thumbnailStore.enqueue(closedPath.c_str());   // no-op unless a JPEG or clip
+          if (recordingCatalog.covers(closedPath.c_str())) {
+            recordingCatalog.addFile(closedPath.c_str(), RECORDING_TRIGGER_UPLOAD);
+          }
         }
       }
     }
   );
 
   // Create directory
-  server.on("/api/files/mkdir", HTTP_POST, [](AsyncWebServerRequest *request) {
+  route("/api/files/mkdir", HTTP_POST, [](AsyncWebServerRequest *request) {
     if (otaUploadInProgress) {
       request->send(503, "application/json", "{\"error\":\"System busy - firmware update in progress\"}");
       return;
     }
 
     if (!sdManager.isReady()) {
-      Serial.println("Mkdir failed: SD not ready");
+      LOGE(TAG_FILES, "Mkdir failed: SD not ready");
       request->send(503, "application/json", "{\"error\":\"SD card not ready\"}");
       return;
     }
 
     if (!request->hasParam("dir", true)) {
-      Serial.println("Mkdir failed: Missing dir parameter");
+      LOGW(TAG_FILES, "Mkdir failed: Missing dir parameter");
       request->send(400, "application/json", "{\"error\":\"Missing dir parameter\"}");
       return;
     }
 
     String dirpath = request->getParam("dir", true)->value();
-    Serial.printf("Mkdir - creating directory: '%s'\n", dirpath.c_str());
+    LOGD_S(TAG_FILES, "Mkdir - creating directory: '%s'", dirpath.c_str());
 
     if (SD_MMC.mkdir(dirpath)) {
-      Serial.printf("Mkdir - success: '%s'\n", dirpath.c_str());
+      LOGI_S(TAG_FILES, "Mkdir - success: '%s'", dirpath.c_str());
       request->send(200, "application/json", "{\"status\":\"ok\"}");
     } else {
-      Serial.printf("Mkdir - failed: '%s'\n", dirpath.c_str());
+      LOGE_S(TAG_FILES, "Mkdir - failed: '%s'", dirpath.c_str());
       request->send(500, "application/json", "{\"error\":\"Failed to create directory\"}");
     }
   });
@@ -974,6 +2077,7 @@ void setupWebServer() {
   // 404 handler with OTA boot validation
   server.onNotFound([](AsyncWebServerRequest *request) {
     validateOTABoot();
+    routeMetrics.markUnmatched(request);
     request->send(404, "text/plain", "Not found");
   });
 
@@ -981,64 +2085,124 @@ void setupWebServer() {
   Serial.println("Web server started");
 }
 
-bool loadConfig() {
-  if (!sdManager.isReady()) return false;
+// Grows a stream's PSRAM frame buffer; keeps the old one if that fails
+static bool reserveFrame(EncodedFrame &frame, size_t needed) {
+  if (needed <= frame.capacity) return true;
+  uint8_t *data = (uint8_t *)heap_caps_malloc(needed, MALLOC_CAP_SPIRAM);
+  if (data == NULL) return false;
+  free(frame.data);
+  frame.data = data;
+  frame.capacity = needed;
+  return true;
+}
 
-  File file = SD_MMC.open("/config.json", FILE_READ);
-  if (!file) {
-    Serial.println("Config file not found");
+// JPEG-encodes region of a raw (YUV422 or grayscale) frame into frame
+static bool encodeFrame(const camera_fb_t *fb, const JpegCropRect &region, EncodedFrame &frame) {
+  JpegPixelFormat format = fb->format == PIXFORMAT_GRAYSCALE ? JPEG_PIXELS_GRAY : JPEG_PIXELS_YUYV;
+  size_t stride = fb->format == PIXFORMAT_GRAYSCALE ? fb->width : fb->width * 2;
+  frame.len = 0;
+  if (!reserveFrame(frame, JpegEncoder::maxOutputSize(fb->width, fb->height, format))) {
+    encodeStats.failures++;
     return false;
   }
 
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, file);
-  file.close();
-
-  if (error) {
-    Serial.println("Failed to parse config file");
+  uint32_t start = micros();
+  if (!jpegEncoder.encode(fb->buf, fb->width, fb->height, stride, format, region,
+                          frame.data, frame.capacity, frame.len)) {
+    if (++encodeStats.failures % 50 == 1) {
+      LOGW(TAG_CAMERA, "JPEG encode failed: %s", jpegEncoder.error());
+    }
     return false;
   }
-
-  strlcpy(config.ssid, doc["wifi"]["ssid"] | "ESP32-CAM", sizeof(config.ssid));
-  strlcpy(config.password, doc["wifi"]["password"] | "12345678", sizeof(config.password));
-  config.apMode = doc["wifi"]["ap_mode"] | false;
-
-  Serial.println("Configuration loaded from SD card");
+  uint32_t elapsed = micros() - start;
+  encodeStats.frames++;
+  encodeStats.avgMicros = encodeStats.avgMicros ? (encodeStats.avgMicros * 7 + elapsed) / 8 : elapsed;
+  encodeStats.lastBytes = frame.len;
   return true;
 }
 
-void setDefaultConfig() {
-  strcpy(config.ssid, "ESP32-CAM");
-  strcpy(config.password, "12345678");
-  config.apMode = true;
+// Copies the next part of a multipart JPEG frame (boundary + headers, data,
+// trailing CRLF) into buffer. Returns 0 when the header does not fit.
+static size_t writeMultipartChunk(uint8_t *buffer, size_t maxLen, const uint8_t *frame, size_t frameLen,
+                                  size_t &frameOffset, bool &headerSent, bool &complete) {
+  size_t written = 0;
+  complete = false;
+
+  // Send boundary and headers at frame start
+  if (!headerSent) {
+    String header = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: ";
+    header += String(frameLen);
+    header += "\r\n\r\n";
+
+    size_t headerLen = header.length();
+    if (headerLen > maxLen) return 0;
+
+    memcpy(buffer, header.c_str(), headerLen);
+    written = headerLen;
+    headerSent = true;
+  }
+
+  // Send image data in chunks
+  size_t remainingData = frameLen - frameOffset;
+  size_t availableSpace = maxLen - written;
+  size_t toSend = (remainingData < availableSpace) ? remainingData : availableSpace;
+
+  if (toSend > 0) {
+    memcpy(buffer + written, frame + frameOffset, toSend);
+    written += toSend;
+    frameOffset += toSend;
+  }
+
+  // If frame complete, add CRLF
+  if (frameOffset >= frameLen) {
+    if (written + 2 <= maxLen) {
+      buffer[written++] = '\r';
+      buffer[written++] = '\n';
+    }
+    complete = true;
+  }
+  return written;
 }
 
 void streamJpg(AsyncWebServerRequest *request) {
-  Serial.println("Stream requested");
+  LOGI(TAG_CAMERA, "Stream requested");
 
   AsyncWebServerResponse *response = request->beginChunkedResponse(
     "multipart/x-mixed-replace; boundary=frame",
     [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      CallbackTimer timer(CALLBACK_STREAM);
       static unsigned long lastFrameTime = 0;
-      static camera_fb_t *currentFrame = NULL;
+      static camera_fb_t *currentFrame = NULL;   // held while a JPEG frame is sent
+      static EncodedFrame encoded = {NULL, 0, 0};  // raw formats: encoded copy
+      static const uint8_t *frameData = NULL;
+      static size_t frameLen = 0;
+      static bool haveFrame = false;
       static size_t frameOffset = 0;
       static bool headerSent = false;
       static uint32_t frameCount = 0;
+      static unsigned long frameStartMicros = 0;
+      static unsigned long retryAt = 0;
 
       // Control frame rate (~10 FPS for stability)
       unsigned long now = millis();
 
       // If we don't have a current frame, get a new one
-      if (currentFrame == NULL) {
+      if (!haveFrame) {
         // Check if camera is active (not during OTA)
         if (!cameraActive) {
-          delay(100);
           return 0; // Stop streaming during OTA
         }
 
-        // Frame rate limit (~16 FPS for stability)
-        if (now - lastFrameTime < 60) {  // 60ms = ~16 FPS (more stable than 50ms)
-          delay(60 - (now - lastFrameTime));
+        // After a failed capture, retry on a later ACK or poll instead of
+        // sleeping in the async_tcp task
+        if ((long)(now - retryAt) < 0) return RESPONSE_TRY_AGAIN;
+
+        // Frame rate limit (~16 FPS for stability). The one wait left here,
+        // at most a frame interval: a filler that returns RESPONSE_TRY_AGAIN
+        // is not called again until the next ACK or lwIP poll (500 ms)
+        uint16_t frameInterval = qualityController.frameIntervalMs();
+        if (now - lastFrameTime < frameInterval) {  // 60ms = ~16 FPS (more stable than 50ms)
+          delay(frameInterval - (now - lastFrameTime));
         }
 
         currentFrame = esp_camera_fb_get();
@@ -1046,127 +2210,401 @@ void streamJpg(AsyncWebServerRequest *request) {
           // Only log every 10th failure to reduce serial spam
           static uint8_t failCount = 0;
           if (++failCount >= 10) {
-            Serial.println("Camera capture failed");
+            LOGW(TAG_CAMERA, "Camera capture failed");
             failCount = 0;
           }
-          delay(100);
-          return 0;
+          retryAt = millis() + configStore.settings().stream.retryDelayMs;
+          return RESPONSE_TRY_AGAIN;
         }
 
         // Validate frame buffer integrity
         if (currentFrame->len == 0 || currentFrame->buf == NULL) {
-          Serial.println("Invalid frame buffer detected - skipping");
+          LOGW(TAG_CAMERA, "Invalid frame buffer detected - skipping");
           esp_camera_fb_return(currentFrame);
           currentFrame = NULL;
-          delay(50);
-          return 0;
+          retryAt = millis() + configStore.settings().stream.retryDelayMs;
+          return RESPONSE_TRY_AGAIN;
         }
 
+        if (currentFrame->format == PIXFORMAT_JPEG) {
+          frameData = currentFrame->buf;
+          frameLen = currentFrame->len;
+        } else {
+          // Raw pixels: encode, then hand the camera buffer straight back
+          JpegCropRect all = {0, 0, (uint16_t)currentFrame->width, (uint16_t)currentFrame->height};
+          bool ok = encodeFrame(currentFrame, all, encoded);
+          esp_camera_fb_return(currentFrame);
+          currentFrame = NULL;
+          if (!ok) return 0;
+          frameData = encoded.data;
+          frameLen = encoded.len;
+        }
+
+        haveFrame = true;
         frameOffset = 0;
         headerSent = false;
         lastFrameTime = millis();
+        frameStartMicros = micros();
         frameCount++;
 
         // Only log every 1000th frame to reduce CPU usage
         if (frameCount % 1000 == 0) {
-          Serial.printf("Frame #%d: %d bytes\n", frameCount, currentFrame->len);
+          LOGD(TAG_CAMERA, "Frame #%u: %u bytes", frameCount, frameLen);
         }
       }
 
-      size_t written = 0;
+      bool complete = false;
+      size_t written = writeMultipartChunk(buffer, maxLen, frameData, frameLen,
+                                           frameOffset, headerSent, complete);
+      if (written == 0) {
+        if (currentFrame) esp_camera_fb_return(currentFrame);
+        currentFrame = NULL;
+        haveFrame = false;
+        return 0;
+      }
 
-      // Send boundary and headers at frame start
-      if (!headerSent) {
-        String header = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: ";
-        header += String(currentFrame->len);
-        header += "\r\n\r\n";
+      // If frame complete, release
+      if (complete) {
+        // Rate control: adjust JPEG quality from how fast this frame drained
+        uint8_t quality = qualityController.onFrameSent(frameLen, micros() - frameStartMicros);
+        if (currentFrame) esp_camera_fb_return(currentFrame);
+        currentFrame = NULL;
+        haveFrame = false;
+        frameOffset = 0;
+        headerSent = false;
+        if (quality) applyStreamQuality(quality);
+      }
 
-        size_t headerLen = header.length();
-        if (headerLen > maxLen) {
-          esp_camera_fb_return(currentFrame);
-          currentFrame = NULL;
+      // Yield every N chunks
+      uint8_t yieldEvery = configStore.settings().stream.yieldEveryChunks;
+      if (yieldEvery && index % yieldEvery == 0) {
+        delay(1);
+      }
+
+      return written;
+    }
+  );
+
+  response->addHeader("Access-Control-Allow-Origin", "*");
+  response->addHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  response->addHeader("Pragma", "no-cache");
+  response->addHeader("Expires", "0");
+
+  request->send(response);
+  LOGI(TAG_CAMERA, "Stream started");
+}
+
+// The session goes back to the player when the response is freed (also
+// when the client leaves)
+void streamPlayback(AsyncWebServerRequest *request, PlaybackSession *opened) {
+  std::shared_ptr<PlaybackSession> session(opened, [](PlaybackSession *s) {
+    clipPlayer.close(s);
+  });
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse(
+    "multipart/x-mixed-replace; boundary=frame",
+    [session](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      CallbackTimer timer(CALLBACK_STREAM);
+      if (otaUploadInProgress) return 0;
+      return clipPlayer.fill(session.get(), buffer, maxLen);
+    }
+  );
+
+  response->addHeader("Access-Control-Allow-Origin", "*");
+  response->addHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  clipPlayer.attach(opened, request->client());
+  request->send(response);
+}
+
+void setFollowTarget(const JpegCropRect &rect) {
+  portENTER_CRITICAL(&followLock);
+  followTarget = rect;
+  portEXIT_CRITICAL(&followLock);
+}
+
+// Moves a coordinate a quarter of the way to its target (smooths tracking)
+static uint16_t approach(uint16_t current, uint16_t target) {
+  int32_t delta = (int32_t)target - current;
+  if (delta > -4 && delta < 4) return target;
+  return (uint16_t)(current + delta / 4);
+}
+
+// The cropper holds its Huffman tables (~18KB), so it lives in PSRAM. Only
+// used from the web server task.
+static JpegCropper *sharedCropper() {
+  static JpegCropper *cropper = NULL;
+  if (cropper == NULL) {
+    void *mem = heap_caps_malloc(sizeof(JpegCropper), MALLOC_CAP_SPIRAM);
+    if (mem != NULL) cropper = new (mem) JpegCropper();
+  }
+  return cropper;
+}
+
+void streamCropJpg(AsyncWebServerRequest *request, JpegCropRect rect, bool follow) {
+  LOGI(TAG_CAMERA, "Crop stream requested (%u,%u %ux%u)", rect.x, rect.y, rect.width, rect.height);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse(
+    "multipart/x-mixed-replace; boundary=frame",
+    [rect, follow](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+      CallbackTimer timer(CALLBACK_STREAM);
+      static EncodedFrame cropped = {NULL, 0, 0};
+      static size_t frameOffset = 0;
+      static bool headerSent = false;
+      static bool haveFrame = false;
+      static unsigned long lastFrameTime = 0;
+      static unsigned long retryAt = 0;
+
+      if (!haveFrame) {
+        if (!cameraActive) {
           return 0;
         }
 
-        memcpy(buffer, header.c_str(), headerLen);
-        written = headerLen;
-        headerSent = true;
-      }
+        unsigned long now = millis();
+        if ((long)(now - retryAt) < 0) return RESPONSE_TRY_AGAIN;
+        // Pacing wait as in streamJpg()
+        uint16_t frameInterval = qualityController.frameIntervalMs();
+        if (now - lastFrameTime < frameInterval) {
+          delay(frameInterval - (now - lastFrameTime));
+        }
 
-      // Send image data in chunks
-      size_t remainingData = currentFrame->len - frameOffset;
-      size_t availableSpace = maxLen - written;
-      size_t toSend = (remainingData < availableSpace) ? remainingData : availableSpace;
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+          retryAt = millis() + configStore.settings().stream.retryDelayMs;
+          return RESPONSE_TRY_AGAIN;
+        }
 
-      if (toSend > 0) {
-        memcpy(buffer + written, currentFrame->buf + frameOffset, toSend);
-        written += toSend;
-        frameOffset += toSend;
-      }
+        if (follow) {
+          JpegCropRect target;
+          portENTER_CRITICAL(&followLock);
+          target = followTarget;
+          portEXIT_CRITICAL(&followLock);
+          if (target.width == 0 || target.height == 0) {
+            target.x = 0;
+            target.y = 0;
+            target.width = fb->width;
+            target.height = fb->height;
+          }
+          if (rect.width == 0) {
+            rect = target;
+          } else {
+            rect.x = approach(rect.x, target.x);
+            rect.y = approach(rect.y, target.y);
+            rect.width = approach(rect.width, target.width);
+            rect.height = approach(rect.height, target.height);
+          }
+        }
 
-      // If frame complete, add CRLF and release
-      if (frameOffset >= currentFrame->len) {
-        if (written + 2 <= maxLen) {
-          buffer[written++] = '\r';
-          buffer[written++] = '\n';
+        cropStats.lastInBytes = fb->len;
+        if (fb->format != PIXFORMAT_JPEG) {
+          // Raw pixels: encode just the region (timed in encodeStats)
+          bool ok = encodeFrame(fb, rect, cropped);
+          esp_camera_fb_return(fb);
+          if (!ok) return 0;
+          cropStats.frames++;
+          cropStats.lastOutBytes = cropped.len;
+          cropStats.lastRect = jpegEncoder.lastRegion();
+        } else {
+          JpegCropper *cropper = sharedCropper();
+
+          // Crop, then hand the camera buffer back before sending anything
+          unsigned long cropStart = micros();
+          JpegCropRect actual;
+          bool ok = cropper && reserveFrame(cropped, JpegCropper::maxOutputSize(fb->len)) &&
+                    cropper->crop(fb->buf, fb->len, rect, cropped.data, cropped.capacity, cropped.len, actual);
+          uint32_t cropMicros = micros() - cropStart;
+          esp_camera_fb_return(fb);
+
+          if (!ok) {
+            if (++cropStats.failures % 50 == 1) {
+              LOGW(TAG_CAMERA, "Crop failed: %s", cropper && cropper->error() ? cropper->error() : "out of memory");
+            }
+            return 0;
+          }
+
+          cropStats.frames++;
+          cropStats.avgMicros = cropStats.avgMicros ? (cropStats.avgMicros * 7 + cropMicros) / 8 : cropMicros;
+          cropStats.lastOutBytes = cropped.len;
+          cropStats.last = cropper->stats();
+          cropStats.lastRect = actual;
         }
 
-        esp_camera_fb_return(currentFrame);
-        currentFrame = NULL;
+        haveFrame = true;
         frameOffset = 0;
         headerSent = false;
+        lastFrameTime = millis();
       }
 
-      // Yield every 10 chunks
-      if (index % 10 == 0) {
-        delay(1);
+      bool complete = false;
+      size_t written = writeMultipartChunk(buffer, maxLen, cropped.data, cropped.len,
+                                           frameOffset, headerSent, complete);
+      if (written == 0 || complete) {
+        haveFrame = false;
       }
 
+      uint8_t yieldEvery = configStore.settings().stream.yieldEveryChunks;
+      if (yieldEvery && index % yieldEvery == 0) {
+        delay(1);
+      }
       return written;
     }
   );
 
   response->addHeader("Access-Control-Allow-Origin", "*");
   response->addHeader("Cache-Control", "no-cache, no-store, must-revalidate");
-  response->addHeader("Pragma", "no-cache");
-  response->addHeader("Expires", "0");
-
   request->send(response);
-  Serial.println("Stream started");
 }
 
-// getFileManagerHTML() removed - now served from SD card files to save memory
-
-/**
- * Serve static files from SD card using AsyncFileResponse
- * ESPAsyncWebServer handles async file reading internally, no mutex needed
- */
-void serveStaticFile(AsyncWebServerRequest *request, const char* filepath, const char* contentType) {
-  if (!sdManager.isReady()) {
-    Serial.printf("Cannot serve %s - SD not ready\n", filepath);
-    request->send(503, "text/plain", "SD card not available");
+void sendSnapshot(AsyncWebServerRequest *request, JpegCropRect rect) {
+  if (!cameraActive) {
+    request->send(503, "text/plain", "Camera not available");
+    return;
+  }
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (!fb) {
+    request->send(503, "text/plain", "Camera capture failed");
     return;
   }
 
-  if (!SD_MMC.exists(filepath)) {
-    Serial.printf("File not found: %s\n", filepath);
-    request->send(404, "text/plain", "File not found");
+  // The JPEG is copied (or cropped, or encoded) to PSRAM so the camera
+  // buffer goes straight back; the copy is freed with the response
+  std::shared_ptr<EncodedFrame> frame(new EncodedFrame(), [](EncodedFrame *f) {
+    free(f->data);
+    delete f;
+  });
+  frame->data = NULL;
+  frame->capacity = 0;
+  frame->len = 0;
+  bool ok;
+  if (fb->format != PIXFORMAT_JPEG) {
+    if (rect.width == 0) rect = {0, 0, (uint16_t)fb->width, (uint16_t)fb->height};
+    ok = encodeFrame(fb, rect, *frame);
+  } else if (rect.width == 0) {
+    ok = reserveFrame(*frame, fb->len);
+    if (ok) {
+      memcpy(frame->data, fb->buf, fb->len);
+      frame->len = fb->len;
+    }
+  } else {
+    JpegCropper *cropper = sharedCropper();
+    JpegCropRect actual;
+    ok = cropper && reserveFrame(*frame, JpegCropper::maxOutputSize(fb->len)) &&
+         cropper->crop(fb->buf, fb->len, rect, frame->data, frame->capacity, frame->len, actual);
+  }
+  esp_camera_fb_return(fb);
+  if (!ok) {
+    request->send(500, "text/plain", "Failed to encode frame");
     return;
   }
 
-  Serial.printf("Serving %s\n", filepath);
+  AsyncWebServerResponse *response = request->beginResponse(
+    "image/jpeg", frame->len,
+    [frame](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t remaining = frame->len - index;
+      size_t chunk = remaining < maxLen ? remaining : maxLen;
+      memcpy(buffer, frame->data + index, chunk);
+      return chunk;
+    });
+  response->addHeader("Access-Control-Allow-Origin", "*");
+  response->addHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  request->send(response);
+}
 
-  // AsyncFileResponse handles file reading asynchronously and internally
-  // No mutex needed here as ESPAsyncWebServer manages the file access safely
-  AsyncWebServerResponse *response = request->beginResponse(SD_MMC, filepath, contentType);
+// getFileManagerHTML() removed - now served from SD card files to save memory
 
-  if (response) {
-    response->addHeader("Cache-Control", "public, max-age=3600");
-    request->send(response);
-  } else {
-    Serial.printf("Failed to create response for %s\n", filepath);
-    request->send(500, "text/plain", "Failed to serve file");
+// Range query state, freed with the response (also when the client leaves)
+struct EventQueryState {
+  EventCursor cursor;
+  uint32_t limit;
+  uint32_t sent;
+  char line[256];
+  size_t lineLen;
+  size_t lineOffset;
+  JsonDocument doc;
+};
+
+// Absolute event time, or with a negative value ms before now
+static uint64_t eventTimeParam(AsyncWebServerRequest *request, const char *name, uint64_t fallback, uint64_t now) {
+  if (!request->hasParam(name)) return fallback;
+  long long value = atoll(request->getParam(name)->value().c_str());
+  if (value >= 0) return (uint64_t)value;
+  return (uint64_t)-value < now ? now - (uint64_t)-value : 0;
+}
+
+void streamEvents(AsyncWebServerRequest *request) {
+  if (otaUploadInProgress) {
+    request->send(503, "text/plain", "System busy - firmware update in progress");
+    return;
+  }
+  if (!eventLog.ready()) {
+    request->send(503, "text/plain", "Event log not available");
+    return;
+  }
+  uint32_t types = 0;
+  if (request->hasParam("type") && !EventLog::parseTypes(request->getParam("type")->value(), types)) {
+    request->send(400, "text/plain", "Unknown event type");
+    return;
+  }
+  uint64_t now = eventLog.now();
+  uint64_t from = eventTimeParam(request, "from", 0, now);
+  uint64_t to = eventTimeParam(request, "to", EVENT_TIME_MAX, now);
+  long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : 1000;
+
+  std::shared_ptr<EventQueryState> state = std::make_shared<EventQueryState>();
+  state->limit = limit < 1 ? 1 : (limit > 10000 ? 10000 : limit);
+  state->sent = 0;
+  state->lineLen = 0;
+  state->lineOffset = 0;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    request->send(503, "text/plain", "SD card busy");
+    return;
   }
+  // Binary searches the segment table and block heads: reads a few blocks
+  eventLog.query(state->cursor, from, to, types);
+  xSemaphoreGive(sdCardMutex);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/x-ndjson",
+    [state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      CallbackTimer timer(CALLBACK_STREAM);
+      EventQueryState &q = *state;
+      size_t written = 0;
+      bool locked = false;
+      while (written < maxLen) {
+        // The rest of a line cut off by the previous chunk goes first
+        if (q.lineOffset < q.lineLen) {
+          size_t part = q.lineLen - q.lineOffset;
+          if (part > maxLen - written) part = maxLen - written;
+          memcpy(buffer + written, q.line + q.lineOffset, part);
+          written += part;
+          q.lineOffset += part;
+          continue;
+        }
+        if (q.cursor.done || q.sent >= q.limit) break;
+        if (!locked) {
+          if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(100)) != pdTRUE) break;
+          locked = true;
+        }
+        EventRecord record;
+        if (!eventLog.next(q.cursor, record)) {
+          if (q.cursor.done) continue;
+          break;   // scan budget used up: let the card go and come back
+        }
+        q.doc.clear();
+        EventLog::writeJson(q.doc.to<JsonObject>(), record);
+        q.lineLen = serializeJson(q.doc, q.line, sizeof(q.line) - 1);
+        q.line[q.lineLen++] = '\n';
+        q.lineOffset = 0;
+        q.sent++;
+      }
+      if (locked) xSemaphoreGive(sdCardMutex);
+      bool finished = q.lineOffset == q.lineLen && (q.cursor.done || q.sent >= q.limit);
+      if (written == 0 && !finished) return RESPONSE_TRY_AGAIN;
+      return written;
+    });
+  char header[24];
+  snprintf(header, sizeof(header), "%llu", (unsigned long long)now);
+  response->addHeader("X-Event-Time", header);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
 }
 
 String getBuiltinHTML() {
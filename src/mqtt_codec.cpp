@@ -0,0 +1,176 @@
+/**
+ * MQTT 3.1.1 Packet Codec Implementation
+ */
+
+#include "mqtt_codec.h"
+#include <string.h>
+
+static size_t lengthBytes(size_t remaining) {
+  return remaining < 128 ? 1 : remaining < 16384 ? 2 : remaining < 2097152 ? 3 : 4;
+}
+
+// Fixed header; returns its size
+static size_t putHeader(uint8_t *out, uint8_t first, size_t remaining) {
+  size_t pos = 0;
+  out[pos++] = first;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    if (remaining) digit |= 0x80;
+    out[pos++] = digit;
+  } while (remaining);
+  return pos;
+}
+
+static size_t putString(uint8_t *out, const char *text, size_t length) {
+  out[0] = (uint8_t)(length >> 8);
+  out[1] = (uint8_t)length;
+  memcpy(out + 2, text, length);
+  return length + 2;
+}
+
+static bool present(const char *text) {
+  return text != NULL && text[0] != '\0';
+}
+
+size_t mqttEncodeConnect(uint8_t *out, size_t capacity, const MqttConnectOptions &options) {
+  size_t clientLen = strlen(options.clientId);
+  bool hasWill = present(options.willTopic);
+  bool hasUser = present(options.username);
+  bool hasPassword = hasUser && options.password != NULL;
+  size_t willTopicLen = hasWill ? strlen(options.willTopic) : 0;
+  size_t willLen = hasWill && options.willMessage ? strlen(options.willMessage) : 0;
+  size_t userLen = hasUser ? strlen(options.username) : 0;
+  size_t passwordLen = hasPassword ? strlen(options.password) : 0;
+  if (clientLen > 0xFFFF || willTopicLen > 0xFFFF || willLen > 0xFFFF || userLen > 0xFFFF || passwordLen > 0xFFFF) {
+    return 0;
+  }
+
+  // Variable header: "MQTT", level 4, flags, keep alive
+  size_t remaining = 10 + 2 + clientLen;
+  if (hasWill) remaining += 4 + willTopicLen + willLen;
+  if (hasUser) remaining += 2 + userLen;
+  if (hasPassword) remaining += 2 + passwordLen;
+  if (1 + lengthBytes(remaining) + remaining > capacity) return 0;
+
+  uint8_t flags = options.cleanSession ? 0x02 : 0;
+  if (hasWill) flags |= 0x04 | (uint8_t)((options.willQos & 3) << 3) | (options.willRetain ? 0x20 : 0);
+  if (hasPassword) flags |= 0x40;
+  if (hasUser) flags |= 0x80;
+
+  size_t pos = putHeader(out, MQTT_PACKET_CONNECT << 4, remaining);
+  pos += putString(out + pos, "MQTT", 4);
+  out[pos++] = 4;
+  out[pos++] = flags;
+  out[pos++] = (uint8_t)(options.keepAliveS >> 8);
+  out[pos++] = (uint8_t)options.keepAliveS;
+  pos += putString(out + pos, options.clientId, clientLen);
+  if (hasWill) {
+    pos += putString(out + pos, options.willTopic, willTopicLen);
+    pos += putString(out + pos, options.willMessage ? options.willMessage : "", willLen);
+  }
+  if (hasUser) pos += putString(out + pos, options.username, userLen);
+  if (hasPassword) pos += putString(out + pos, options.password, passwordLen);
+  return pos;
+}
+
+size_t mqttPublishSize(size_t topicLength, size_t payloadLength, uint8_t qos) {
+  size_t remaining = 2 + topicLength + (qos ? 2 : 0) + payloadLength;
+  return 1 + lengthBytes(remaining) + remaining;
+}
+
+size_t mqttEncodePublish(uint8_t *out, size_t capacity, const char *topic, const uint8_t *payload,
+                         size_t length, uint8_t qos, bool retain, bool dup, uint16_t packetId) {
+  size_t topicLen = strlen(topic);
+  size_t remaining = 2 + topicLen + (qos ? 2 : 0) + length;
+  if (topicLen == 0 || topicLen > 0xFFFF || remaining > MQTT_MAX_REMAINING) return 0;
+  if (1 + lengthBytes(remaining) + remaining > capacity) return 0;
+
+  uint8_t first = (uint8_t)(MQTT_PACKET_PUBLISH << 4) | (uint8_t)((qos & 3) << 1) | (retain ? 0x01 : 0);
+  if (dup && qos) first |= 0x08;
+  size_t pos = putHeader(out, first, remaining);
+  pos += putString(out + pos, topic, topicLen);
+  if (qos) {
+    out[pos++] = (uint8_t)(packetId >> 8);
+    out[pos++] = (uint8_t)packetId;
+  }
+  if (length) memcpy(out + pos, payload, length);
+  return pos + length;
+}
+
+size_t mqttEncodePingReq(uint8_t *out, size_t capacity) {
+  if (capacity < 2) return 0;
+  out[0] = MQTT_PACKET_PINGREQ << 4;
+  out[1] = 0;
+  return 2;
+}
+
+size_t mqttEncodeDisconnect(uint8_t *out, size_t capacity) {
+  if (capacity < 2) return 0;
+  out[0] = MQTT_PACKET_DISCONNECT << 4;
+  out[1] = 0;
+  return 2;
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+
+void MqttParser::reset() {
+  state = STATE_HEADER;
+  header = 0;
+  lengthDigits = 0;
+  multiplier = 1;
+  remaining = 0;
+  received = 0;
+  body[0] = body[1] = 0;
+}
+
+bool MqttParser::feed(uint8_t byte, MqttPacket &packet) {
+  switch (state) {
+    case STATE_HEADER:
+      header = byte;
+      lengthDigits = 0;
+      multiplier = 1;
+      remaining = 0;
+      received = 0;
+      state = STATE_LENGTH;
+      return false;
+
+    case STATE_LENGTH:
+      remaining += (uint32_t)(byte & 0x7F) * multiplier;
+      multiplier *= 128;
+      if (byte & 0x80) {
+        if (++lengthDigits == 4) state = STATE_ERROR;
+        return false;
+      }
+      if (remaining == 0) return complete(packet);
+      state = STATE_BODY;
+      return false;
+
+    case STATE_BODY:
+      if (received < sizeof(body)) body[received] = byte;
+      if (++received < remaining) return false;
+      return complete(packet);
+
+    case STATE_ERROR:
+      return false;
+  }
+  return false;
+}
+
+bool MqttParser::complete(MqttPacket &packet) {
+  packet.type = header >> 4;
+  packet.flags = header & 0x0F;
+  packet.length = remaining;
+  packet.packetId = 0;
+  packet.returnCode = 0;
+  packet.sessionPresent = false;
+  if (packet.type == MQTT_PACKET_CONNACK && remaining >= 2) {
+    packet.sessionPresent = (body[0] & 0x01) != 0;
+    packet.returnCode = body[1];
+  } else if (packet.type == MQTT_PACKET_PUBACK && remaining >= 2) {
+    packet.packetId = (uint16_t)((body[0] << 8) | body[1]);
+  }
+  state = STATE_HEADER;
+  return true;
+}
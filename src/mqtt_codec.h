@@ -0,0 +1,92 @@
+/**
+ * MQTT 3.1.1 Packet Codec
+ *
+ * Encodes the packets a publish-only client sends (CONNECT, PUBLISH,
+ * PINGREQ, DISCONNECT) into caller buffers, so several packets can be
+ * packed into one socket write, and parses what the broker sends back
+ * one byte at a time. No I/O and no allocation: runs (and is checked) on
+ * a host.
+ */
+
+#ifndef MQTT_CODEC_H
+#define MQTT_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQTT_PACKET_CONNECT     1
+#define MQTT_PACKET_CONNACK     2
+#define MQTT_PACKET_PUBLISH     3
+#define MQTT_PACKET_PUBACK      4
+#define MQTT_PACKET_PINGREQ     12
+#define MQTT_PACKET_PINGRESP    13
+#define MQTT_PACKET_DISCONNECT  14
+
+#define MQTT_MAX_REMAINING      268435455   // 4-byte remaining length
+
+struct MqttConnectOptions {
+  const char *clientId;
+  const char *username;       // NULL or "" = none
+  const char *password;
+  uint16_t keepAliveS;
+  bool cleanSession;
+  const char *willTopic;      // NULL = no will
+  const char *willMessage;
+  uint8_t willQos;
+  bool willRetain;
+};
+
+// Each returns the packet length, or 0 when it does not fit in capacity
+size_t mqttEncodeConnect(uint8_t *out, size_t capacity, const MqttConnectOptions &options);
+size_t mqttEncodePublish(uint8_t *out, size_t capacity, const char *topic, const uint8_t *payload,
+                         size_t length, uint8_t qos, bool retain, bool dup, uint16_t packetId);
+size_t mqttEncodePingReq(uint8_t *out, size_t capacity);
+size_t mqttEncodeDisconnect(uint8_t *out, size_t capacity);
+
+// Bytes mqttEncodePublish needs
+size_t mqttPublishSize(size_t topicLength, size_t payloadLength, uint8_t qos);
+
+// Marks an encoded QoS 1 PUBLISH as a retransmission
+inline void mqttSetDup(uint8_t *packet) { packet[0] |= 0x08; }
+
+struct MqttPacket {
+  uint8_t type;               // MQTT_PACKET_*
+  uint8_t flags;              // low nibble of the fixed header
+  uint32_t length;            // remaining length
+  uint16_t packetId;          // PUBACK
+  uint8_t returnCode;         // CONNACK
+  bool sessionPresent;        // CONNACK
+};
+
+// Incremental parser for broker packets. Bodies other than CONNACK and
+// PUBACK are skipped.
+class MqttParser {
+public:
+  MqttParser() { reset(); }
+  void reset();
+
+  // Consumes one byte; true when it completes a packet
+  bool feed(uint8_t byte, MqttPacket &packet);
+  // A remaining length longer than 4 bytes was seen; the stream is lost
+  bool failed() const { return state == STATE_ERROR; }
+
+private:
+  enum State : uint8_t {
+    STATE_HEADER = 0,
+    STATE_LENGTH,
+    STATE_BODY,
+    STATE_ERROR
+  };
+
+  State state;
+  uint8_t header;
+  uint8_t lengthDigits;
+  uint32_t multiplier;
+  uint32_t remaining;
+  uint32_t received;
+  uint8_t body[2];            // CONNACK flags + code, or PUBACK packet id
+
+  bool complete(MqttPacket &packet);
+};
+
+#endif // MQTT_CODEC_H
@@ -0,0 +1,605 @@
+/**
+ * MQTT Publisher Implementation
+ */
+
+#include "mqtt_publisher.h"
+#include "logger.h"
+#include <SD_MMC.h>
+#include <esp_heap_caps.h>
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+extern bool cameraActive;
+
+MqttPublisher mqttPublisher;
+
+// Indexed by MqttTopic
+static const char *TOPIC_NAMES[] = {"detections", "tracks"};
+
+// Indexed by MqttState
+static const char *STATE_NAMES[] = {"disabled", "offline", "connecting", "connected", "retrying"};
+
+// PSRAM when available: the buffers are only touched by the publisher task
+static uint8_t *allocate(size_t size) {
+  uint8_t *buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  return buffer ? buffer : (uint8_t *)malloc(size);
+}
+
+// Labels and zone names come from files on the card; drop what would need
+// escaping in a JSON string
+static void jsonSafe(char *out, size_t size, const char *text) {
+  size_t len = 0;
+  for (; text && *text && len + 1 < size; text++) {
+    if (*text != '"' && *text != '\\' && (uint8_t)*text >= 0x20) out[len++] = *text;
+  }
+  out[len] = '\0';
+}
+
+MqttPublisher::MqttPublisher()
+  : inbox(NULL), task(NULL), sdReady(false), running(false), accepting(false), reconfigure(false), localIp(0),
+    state(MQTT_STATE_DISABLED), lastError(NULL), retryAt(0), retryDelay(MQTT_RETRY_MIN_MS), offlineSince(0),
+    batchOpen(false), batchStart(0), failureStreak(0), lastSendMs(0), pingSentMs(0), pingOutstanding(false),
+    healthDueAt(0), nextPacketId(0), sendBuffer(NULL), batchBuffer(NULL), inflightCount(0), connects(0),
+    connectFailures(0), published(0), packets(0), bytesSent(0), inboxDrops(0), connectedAt(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(&config, 0, sizeof(config));
+  memset(&pending, 0, sizeof(pending));
+  memset(topics, 0, sizeof(topics));
+  memset(healthTopic, 0, sizeof(healthTopic));
+  memset(statusTopic, 0, sizeof(statusTopic));
+  memset(inflight, 0, sizeof(inflight));
+}
+
+bool MqttPublisher::begin(bool ready, const MqttSettings &settings) {
+  sdReady = ready;
+  inbox = xQueueCreate(MQTT_INBOX_LEN, sizeof(MqttMessage));
+  sendBuffer = allocate(MQTT_SEND_BUFFER);
+  batchBuffer = (char *)allocate(MQTT_MAX_BATCH);
+  uint8_t *packets = allocate(MQTT_MAX_INFLIGHT * MQTT_PACKET_MAX);
+  if (!inbox || !sendBuffer || !batchBuffer || !packets) {
+    LOGW(TAG_MQTT, "MQTT: no memory for buffers");
+    return false;
+  }
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) inflight[i].packet = packets + i * MQTT_PACKET_MAX;
+
+  // Events queued before a reboot are still on the card
+  bool opened;
+  uint32_t spillLimit = (uint32_t)settings.queueKb * 1024;
+  if (sdReady) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+      LOGW(TAG_MQTT, "MQTT: SD card busy");
+      return false;
+    }
+    if (!SD_MMC.exists(MQTT_QUEUE_DIR)) SD_MMC.mkdir(MQTT_QUEUE_DIR);
+    opened = queue.begin(this, MQTT_RAM_QUEUE, spillLimit);
+    xSemaphoreGive(sdCardMutex);
+  } else {
+    opened = queue.begin(NULL, MQTT_RAM_QUEUE, spillLimit);
+  }
+  if (!opened) {
+    LOGW(TAG_MQTT, "MQTT: no memory for the queue");
+    return false;
+  }
+  if (queue.spillBytes()) LOGI(TAG_MQTT, "MQTT: %u bytes of queued events on the card", queue.spillBytes());
+
+  configure(settings);
+  offlineSince = millis();
+  if (xTaskCreatePinnedToCore(taskEntry, "mqtt", MQTT_STACK_SIZE, this, 1, &task, 0) != pdPASS) {
+    LOGW(TAG_MQTT, "MQTT: failed to start task");
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+void MqttPublisher::configure(const MqttSettings &settings) {
+  portENTER_CRITICAL(&lock);
+  pending = settings;
+  reconfigure = true;
+  portEXIT_CRITICAL(&lock);
+  accepting = settings.enabled && settings.host[0];
+}
+
+// ---------------------------------------------------------------------------
+// Producers (any task)
+
+bool MqttPublisher::enqueue(MqttMessage &message, int length) {
+  if (length <= 0 || length >= MQTT_MAX_MESSAGE) return false;
+  message.length = (uint16_t)length;
+  if (xQueueSend(inbox, &message, 0) != pdTRUE) {
+    inboxDrops++;
+    return false;
+  }
+  return true;
+}
+
+bool MqttPublisher::publishDetection(const EventDetection &detection, const char *label, uint64_t timeMs) {
+  if (!running || !accepting) return false;
+  char name[32];
+  jsonSafe(name, sizeof(name), label);
+
+  // The box, cut from the current frame by /snapshot.jpg
+  char snapshot[96] = "";
+  uint32_t ip = localIp;
+  if (ip) {
+    snprintf(snapshot, sizeof(snapshot), ",\"snapshot\":\"http://%u.%u.%u.%u/snapshot.jpg?x=%u&y=%u&w=%u&h=%u\"",
+             (unsigned)(ip & 0xFF), (unsigned)((ip >> 8) & 0xFF), (unsigned)((ip >> 16) & 0xFF),
+             (unsigned)(ip >> 24), detection.x, detection.y, detection.width, detection.height);
+  }
+
+  MqttMessage message;
+  message.topic = MQTT_TOPIC_DETECTIONS;
+  int len = snprintf(message.payload, sizeof(message.payload),
+                     "{\"t\":%llu,\"track\":%u,\"class\":%u,\"label\":\"%s\",\"score\":%u,\"box\":[%u,%u,%u,%u]%s}",
+                     (unsigned long long)timeMs, detection.track, detection.classId, name, detection.score,
+                     detection.x, detection.y, detection.width, detection.height, snapshot);
+  return enqueue(message, len);
+}
+
+bool MqttPublisher::publishTrack(const char *event, uint16_t track, uint8_t classId, const char *label,
+                                 const char *zone, uint64_t timeMs) {
+  if (!running || !accepting) return false;
+  char name[32];
+  jsonSafe(name, sizeof(name), label);
+
+  MqttMessage message;
+  message.topic = MQTT_TOPIC_TRACKS;
+  int len = snprintf(message.payload, sizeof(message.payload),
+                     "{\"t\":%llu,\"track\":%u,\"class\":%u,\"label\":\"%s\",\"event\":\"%s\"",
+                     (unsigned long long)timeMs, track, classId, name, event);
+  if (zone && len > 0 && len < MQTT_MAX_MESSAGE) {
+    char zoneName[ZONE_NAME_LEN];
+    jsonSafe(zoneName, sizeof(zoneName), zone);
+    len += snprintf(message.payload + len, sizeof(message.payload) - len, ",\"zone\":\"%s\"", zoneName);
+  }
+  if (len > 0 && len < MQTT_MAX_MESSAGE) {
+    len += snprintf(message.payload + len, sizeof(message.payload) - len, "}");
+  }
+  return enqueue(message, len);
+}
+
+// ---------------------------------------------------------------------------
+// Publisher task
+
+void MqttPublisher::taskEntry(void *param) {
+  ((MqttPublisher *)param)->run();
+}
+
+void MqttPublisher::run() {
+  for (;;) {
+    if (reconfigure) applySettings();
+    receive(nextWake(millis()));
+
+    uint32_t now = millis();
+    bool network = WiFi.status() == WL_CONNECTED;
+    if (network) localIp = (uint32_t)WiFi.localIP();
+    if (!config.enabled || !config.host[0] || !network) {
+      if (state == MQTT_STATE_CONNECTED) disconnect(network ? NULL : "WiFi lost");
+      state = config.enabled && config.host[0] ? MQTT_STATE_OFFLINE : MQTT_STATE_DISABLED;
+    } else if (state != MQTT_STATE_CONNECTED && (int32_t)(now - retryAt) >= 0) {
+      connectBroker();
+    }
+
+    if (state == MQTT_STATE_CONNECTED) readPackets();
+    if (state == MQTT_STATE_CONNECTED) sendPending(millis());
+    if (state == MQTT_STATE_CONNECTED) keepAlive(millis());
+    if (state == MQTT_STATE_CONNECTED) publishHealth(millis());
+
+    // A short outage stays in RAM; a long one goes to the card
+    if (state != MQTT_STATE_CONNECTED && queue.ramMessages() && millis() - offlineSince >= MQTT_OFFLINE_SPILL_MS) {
+      spillToCard();
+    }
+  }
+}
+
+void MqttPublisher::applySettings() {
+  MqttSettings next;
+  portENTER_CRITICAL(&lock);
+  next = pending;
+  reconfigure = false;
+  portEXIT_CRITICAL(&lock);
+
+  bool brokerChanged = next.enabled != config.enabled || strcmp(next.host, config.host) != 0 ||
+                       next.port != config.port || strcmp(next.clientId, config.clientId) != 0 ||
+                       strcmp(next.username, config.username) != 0 || strcmp(next.password, config.password) != 0 ||
+                       strcmp(next.baseTopic, config.baseTopic) != 0 || next.keepAliveS != config.keepAliveS;
+  if (brokerChanged && state == MQTT_STATE_CONNECTED) disconnect(NULL);
+  config = next;
+
+  for (uint8_t t = 0; t < MQTT_TOPIC_COUNT; t++) {
+    snprintf(topics[t], MQTT_TOPIC_LEN, "%s/%s", config.baseTopic, TOPIC_NAMES[t]);
+  }
+  snprintf(healthTopic, MQTT_TOPIC_LEN, "%s/health", config.baseTopic);
+  snprintf(statusTopic, MQTT_TOPIC_LEN, "%s/status", config.baseTopic);
+  limiter.configure(config.drainPerSecond);
+  queue.setSpillLimit((uint32_t)config.queueKb * 1024);
+  if (brokerChanged) {
+    retryAt = millis();
+    retryDelay = MQTT_RETRY_MIN_MS;
+    failureStreak = 0;
+  }
+}
+
+// Moves events from the inbox into the queue
+void MqttPublisher::receive(uint32_t waitMs) {
+  MqttMessage message;
+  if (xQueueReceive(inbox, &message, pdMS_TO_TICKS(waitMs)) != pdTRUE) return;
+  do {
+    if (queue.ramFull()) spillToCard();
+    if (queue.push(message.topic, message.payload, message.length) && !batchOpen) {
+      batchOpen = true;
+      batchStart = millis();
+    }
+  } while (xQueueReceive(inbox, &message, 0) == pdTRUE);
+}
+
+// More than one batch waiting, or anything on the card
+bool MqttPublisher::backlog() const {
+  return queue.spillBytes() > 0 || queue.ramMessages() >= MQTT_BATCH_MESSAGES;
+}
+
+uint16_t MqttPublisher::drainBatch() const {
+  return config.drainPerSecond < MQTT_BATCH_MESSAGES ? config.drainPerSecond : MQTT_BATCH_MESSAGES;
+}
+
+uint32_t MqttPublisher::nextWake(uint32_t now) const {
+  if (state != MQTT_STATE_CONNECTED) return 500;
+  uint32_t wait = inflightCount || pingOutstanding ? MQTT_POLL_MS : 1000;
+
+  if (!queue.empty()) {
+    uint32_t ready = limiter.waitMs(backlog() ? drainBatch() : 1);
+    if (batchOpen && !backlog()) {
+      uint32_t waited = now - batchStart;
+      if (waited < config.batchMs && config.batchMs - waited > ready) ready = config.batchMs - waited;
+    }
+    if (config.qos && inflightCount == MQTT_MAX_INFLIGHT) ready = MQTT_POLL_MS;
+    if (ready < wait) wait = ready > 5 ? ready : 5;
+  }
+
+  uint32_t interval = (uint32_t)config.keepAliveS * 1000;
+  if (!pingOutstanding) {
+    uint32_t idle = now - lastSendMs;
+    uint32_t pingIn = idle < interval / 2 ? interval / 2 - idle : 0;
+    if (pingIn < wait) wait = pingIn;
+  }
+  if (config.healthIntervalS) {
+    uint32_t healthIn = (int32_t)(healthDueAt - now) > 0 ? healthDueAt - now : 0;
+    if (healthIn < wait) wait = healthIn;
+  }
+  return wait;
+}
+
+// ---------------------------------------------------------------------------
+// Connection
+
+bool MqttPublisher::connectBroker() {
+  state = MQTT_STATE_CONNECTING;
+  if (!client.connect(config.host, config.port, MQTT_CONNECT_TIMEOUT_MS)) {
+    return connectFailed("TCP connect failed");
+  }
+  client.setNoDelay(true);
+
+  // Clean session; the will marks the camera offline when it drops out
+  MqttConnectOptions options = {config.clientId, config.username, config.password, config.keepAliveS, true,
+                                statusTopic, "offline", 0, true};
+  size_t len = mqttEncodeConnect(sendBuffer, MQTT_SEND_BUFFER, options);
+  parser.reset();
+  if (len == 0 || !writeAll(sendBuffer, len)) return connectFailed("CONNECT not sent");
+
+  MqttPacket packet;
+  bool acked = false;
+  uint32_t sent = millis();
+  while (!acked && millis() - sent < MQTT_CONNECT_TIMEOUT_MS && client.connected()) {
+    while (client.available() > 0) {
+      if (parser.feed((uint8_t)client.read(), packet) && packet.type == MQTT_PACKET_CONNACK) {
+        acked = true;
+        break;
+      }
+    }
+    if (!acked) vTaskDelay(pdMS_TO_TICKS(20));
+  }
+  if (!acked) return connectFailed("no CONNACK");
+  if (packet.returnCode != 0) {
+    LOGW(TAG_MQTT, "MQTT: broker refused the connection (code %u)", packet.returnCode);
+    return connectFailed(packet.returnCode == 4 || packet.returnCode == 5 ? "not authorized" : "connection refused");
+  }
+
+  state = MQTT_STATE_CONNECTED;
+  connects++;
+  connectedAt = millis();
+  retryDelay = MQTT_RETRY_MIN_MS;
+  failureStreak = 0;
+  lastError = NULL;
+  pingOutstanding = false;
+  healthDueAt = connectedAt;
+  LOGI_S(TAG_MQTT, "MQTT: connected to %s:%u", config.host, config.port);
+
+  // Publishes the last connection left unacknowledged go first
+  for (uint8_t i = 0; i < inflightCount; i++) {
+    mqttSetDup(inflight[i].packet);
+    if (!writeAll(inflight[i].packet, inflight[i].length)) {
+      disconnect("write failed");
+      return false;
+    }
+  }
+  const char *online = "online";
+  len = mqttEncodePublish(sendBuffer, MQTT_SEND_BUFFER, statusTopic, (const uint8_t *)online, strlen(online), 0,
+                          true, false, 0);
+  if (!writeAll(sendBuffer, len)) {
+    disconnect("write failed");
+    return false;
+  }
+  return true;
+}
+
+bool MqttPublisher::connectFailed(const char *reason) {
+  client.stop();
+  state = MQTT_STATE_RETRYING;
+  lastError = reason;
+  connectFailures++;
+  // Logged once per outage
+  if (failureStreak++ == 0) LOGW_S(TAG_MQTT, "MQTT: connecting to %s failed: %s", config.host, reason);
+  retryAt = millis() + retryDelay;
+  retryDelay = retryDelay * 2 < MQTT_RETRY_MAX_MS ? retryDelay * 2 : MQTT_RETRY_MAX_MS;
+  return false;
+}
+
+// reason NULL: an orderly disconnect (settings changed or disabled)
+void MqttPublisher::disconnect(const char *reason) {
+  if (reason == NULL) {
+    uint8_t packet[2];
+    writeAll(packet, mqttEncodeDisconnect(packet, sizeof(packet)));
+  } else {
+    LOGW(TAG_MQTT, "MQTT: disconnected (%s)", reason);
+  }
+  client.stop();
+  parser.reset();
+  pingOutstanding = false;
+  lastError = reason;
+  state = MQTT_STATE_RETRYING;
+  retryAt = millis() + (reason ? MQTT_RETRY_MIN_MS : 0);
+  offlineSince = millis();
+}
+
+bool MqttPublisher::writeAll(const uint8_t *data, size_t len) {
+  if (client.write(data, len) != len) return false;
+  bytesSent += len;
+  lastSendMs = millis();
+  return true;
+}
+
+void MqttPublisher::readPackets() {
+  MqttPacket packet;
+  while (client.available() > 0) {
+    int byte = client.read();
+    if (byte < 0) break;
+    if (parser.feed((uint8_t)byte, packet)) {
+      // Any packet shows the broker is alive
+      pingOutstanding = false;
+      if (packet.type == MQTT_PACKET_PUBACK) acknowledge(packet.packetId);
+    }
+    if (parser.failed()) {
+      disconnect("malformed packet");
+      return;
+    }
+  }
+  if (!client.connected()) disconnect("connection closed");
+}
+
+void MqttPublisher::acknowledge(uint16_t packetId) {
+  for (uint8_t i = 0; i < inflightCount; i++) {
+    if (inflight[i].packetId != packetId) continue;
+    uint8_t *buffer = inflight[i].packet;
+    for (uint8_t j = i; j + 1 < inflightCount; j++) inflight[j] = inflight[j + 1];
+    inflight[inflightCount - 1].packet = buffer;
+    inflightCount--;
+    break;
+  }
+  // Everything taken from the card so far is delivered
+  if (inflightCount == 0) syncQueue();
+}
+
+void MqttPublisher::keepAlive(uint32_t now) {
+  uint32_t interval = (uint32_t)config.keepAliveS * 1000;
+  if (pingOutstanding) {
+    if (now - pingSentMs > interval) disconnect("keepalive timeout");
+    return;
+  }
+  if (now - lastSendMs < interval / 2) return;
+  uint8_t packet[2];
+  if (!writeAll(packet, mqttEncodePingReq(packet, sizeof(packet)))) {
+    disconnect("write failed");
+    return;
+  }
+  pingOutstanding = true;
+  pingSentMs = now;
+}
+
+// ---------------------------------------------------------------------------
+// Sending
+
+void MqttPublisher::sendPending(uint32_t now) {
+  limiter.refill(now);
+  if (queue.empty()) return;
+  // Live events wait for the batch window; a backlog waits until a full
+  // batch may be sent, so a rate-limited drain still fills its packets
+  bool ready = backlog() ? limiter.available() >= drainBatch() : !batchOpen || now - batchStart >= config.batchMs;
+  if (!ready) return;
+
+  bool more = true;
+  while (more) {
+    size_t used = fillPackets(more);
+    if (used == 0) break;
+    if (!writeAll(sendBuffer, used)) {
+      disconnect("write failed");
+      return;
+    }
+  }
+  if (queue.empty()) batchOpen = false;
+}
+
+// Encodes PUBLISH packets into sendBuffer until it is full, the rate limit
+// or the qos 1 window is reached, or the queue is empty
+size_t MqttPublisher::fillPackets(bool &more) {
+  more = false;
+  bool card = queue.spillBytes() > 0;
+  if (card && xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return 0;
+
+  size_t used = 0;
+  while (!queue.empty()) {
+    uint16_t budget = limiter.available();
+    if (budget == 0 || (config.qos && inflightCount == MQTT_MAX_INFLIGHT)) break;
+    if (MQTT_SEND_BUFFER - used < MQTT_PACKET_MAX) {
+      more = true;
+      break;
+    }
+    uint8_t topic;
+    uint16_t messages;
+    size_t len = queue.takeBatch(topic, batchBuffer, MQTT_MAX_BATCH,
+                                 budget < MQTT_BATCH_MESSAGES ? budget : MQTT_BATCH_MESSAGES, messages);
+    if (messages == 0) break;   // the spill file cannot be read right now
+    limiter.consume(messages);
+    if (topic >= MQTT_TOPIC_COUNT) continue;
+
+    uint16_t packetId = 0;
+    if (config.qos) {
+      if (++nextPacketId == 0) nextPacketId = 1;
+      packetId = nextPacketId;
+    }
+    size_t packetLen = mqttEncodePublish(sendBuffer + used, MQTT_SEND_BUFFER - used, topics[topic],
+                                         (const uint8_t *)batchBuffer, len, config.qos, false, false, packetId);
+    if (config.qos) {
+      Inflight &slot = inflight[inflightCount++];
+      slot.packetId = packetId;
+      slot.messages = messages;
+      slot.length = (uint16_t)packetLen;
+      memcpy(slot.packet, sendBuffer + used, packetLen);
+    }
+    used += packetLen;
+    published += messages;
+    packets++;
+  }
+
+  if (card) {
+    // qos 0 has no acknowledgement to wait for
+    if (!config.qos) queue.sync();
+    xSemaphoreGive(sdCardMutex);
+  }
+  return used;
+}
+
+void MqttPublisher::publishHealth(uint32_t now) {
+  if (!config.healthIntervalS || (int32_t)(now - healthDueAt) < 0) return;
+  healthDueAt = now + (uint32_t)config.healthIntervalS * 1000;
+
+  JsonDocument doc;
+  doc["uptime_s"] = now / 1000;
+  doc["heap_free"] = ESP.getFreeHeap();
+  doc["heap_min_free"] = ESP.getMinFreeHeap();
+  doc["psram_free"] = ESP.getFreePsram();
+  doc["rssi"] = WiFi.RSSI();
+  doc["ip"] = WiFi.localIP().toString();
+  doc["camera"] = cameraActive;
+  doc["sd_card"] = sdReady;
+  JsonObject backlog = doc["queue"].to<JsonObject>();
+  backlog["ram"] = queue.ramMessages();
+  backlog["spill_bytes"] = queue.spillBytes();
+  backlog["dropped"] = queue.stats().dropped + inboxDrops;
+
+  size_t len = serializeJson(doc, batchBuffer, MQTT_MAX_BATCH);
+  size_t packetLen = mqttEncodePublish(sendBuffer, MQTT_SEND_BUFFER, healthTopic, (const uint8_t *)batchBuffer, len,
+                                       0, true, false, 0);
+  if (!writeAll(sendBuffer, packetLen)) disconnect("write failed");
+}
+
+bool MqttPublisher::spillToCard() {
+  if (!sdReady) return false;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  bool moved = queue.spill();
+  xSemaphoreGive(sdCardMutex);
+  return moved;
+}
+
+void MqttPublisher::syncQueue() {
+  if (queue.spillBytes() == 0) return;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+  queue.sync();
+  xSemaphoreGive(sdCardMutex);
+}
+
+void MqttPublisher::reportStatus(JsonObject out) const {
+  out["enabled"] = accepting;
+  out["state"] = STATE_NAMES[state];
+  if (!running) return;
+  out["broker"] = String(config.host) + ":" + String(config.port);
+  out["last_error"] = lastError ? lastError : "";
+  out["connected_ms"] = state == MQTT_STATE_CONNECTED ? millis() - connectedAt : 0;
+  out["connects"] = connects;
+  out["connect_failures"] = connectFailures;
+  out["published"] = published;
+  out["packets"] = packets;
+  out["bytes_sent"] = bytesSent;
+  out["inflight"] = inflightCount;
+
+  const MqttQueueStats &stats = queue.stats();
+  JsonObject backlog = out["queue"].to<JsonObject>();
+  backlog["ram"] = queue.ramMessages();
+  backlog["spill_bytes"] = queue.spillBytes();
+  backlog["limit_kb"] = config.queueKb;
+  backlog["queued"] = stats.queued;
+  backlog["spilled"] = stats.spilled;
+  backlog["dropped"] = stats.dropped + inboxDrops;
+  backlog["spill_errors"] = stats.spillErrors;
+}
+
+// ---------------------------------------------------------------------------
+// MqttSpillStorage (caller holds sdCardMutex)
+
+uint32_t MqttPublisher::spillSize() {
+  File file = SD_MMC.open(MQTT_QUEUE_FILE, FILE_READ);
+  if (!file) return 0;
+  uint32_t bytes = file.size();
+  file.close();
+  return bytes;
+}
+
+size_t MqttPublisher::spillRead(uint32_t offset, uint8_t *dst, size_t len) {
+  File file = SD_MMC.open(MQTT_QUEUE_FILE, FILE_READ);
+  if (!file) return 0;
+  size_t got = file.seek(offset) ? file.read(dst, len) : 0;
+  file.close();
+  return got;
+}
+
+size_t MqttPublisher::spillAppend(const uint8_t *data, size_t len) {
+  File file = SD_MMC.open(MQTT_QUEUE_FILE, FILE_APPEND);
+  if (!file) return 0;
+  size_t written = file.write(data, len);
+  file.close();
+  return written;
+}
+
+void MqttPublisher::spillClear() {
+  if (SD_MMC.exists(MQTT_QUEUE_FILE)) SD_MMC.remove(MQTT_QUEUE_FILE);
+  if (SD_MMC.exists(MQTT_QUEUE_HEAD_FILE)) SD_MMC.remove(MQTT_QUEUE_HEAD_FILE);
+}
+
+uint32_t MqttPublisher::loadHead() {
+  File file = SD_MMC.open(MQTT_QUEUE_HEAD_FILE, FILE_READ);
+  if (!file) return 0;
+  uint8_t bytes[4];
+  bool ok = file.size() == sizeof(bytes) && file.read(bytes, sizeof(bytes)) == sizeof(bytes);
+  file.close();
+  if (!ok) return 0;
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// A lost update only means a few events are sent twice after a reboot
+bool MqttPublisher::saveHead(uint32_t offset) {
+  File file = SD_MMC.open(MQTT_QUEUE_HEAD_FILE, FILE_WRITE);
+  if (!file) return false;
+  uint8_t bytes[4] = {(uint8_t)offset, (uint8_t)(offset >> 8), (uint8_t)(offset >> 16), (uint8_t)(offset >> 24)};
+  bool ok = file.write(bytes, sizeof(bytes)) == sizeof(bytes);
+  file.close();
+  return ok;
+}
@@ -0,0 +1,173 @@
+/**
+ * MQTT Publisher
+ *
+ * Publishes detection and track events, and a periodic health message, to
+ * an MQTT 3.1.1 broker (mqtt section of the configuration):
+ *
+ *   <base_topic>/detections   new tracks, as a JSON array of events
+ *   <base_topic>/tracks       track start/end and zone enter/exit
+ *   <base_topic>/health       retained, every health_interval_s
+ *   <base_topic>/status       retained "online"; "offline" is the will
+ *
+ * publishDetection()/publishTrack() may be called from any task: events are
+ * queued to a publisher task on core 0 that owns the socket. Events that
+ * arrive within batch_ms of each other are sent as one PUBLISH per topic
+ * (a JSON array), and the PUBLISH packets of one round go out in a single
+ * socket write. Detection events carry a /snapshot.jpg URL for the box
+ * instead of image data.
+ *
+ * While the broker is unreachable events wait in the RAM queue
+ * (mqtt_queue.h); after MQTT_OFFLINE_SPILL_MS, or when the queue fills,
+ * they move to /mqtt/queue.bin on the SD card (up to queue_kb). On
+ * reconnect the backlog is drained oldest first at drain_per_s messages
+ * per second. With qos 1 up to MQTT_MAX_INFLIGHT publishes wait for their
+ * PUBACK and are re-sent after a reconnect.
+ */
+
+#ifndef MQTT_PUBLISHER_H
+#define MQTT_PUBLISHER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include "config_store.h"
+#include "event_log.h"
+#include "mqtt_codec.h"
+#include "mqtt_queue.h"
+
+#define MQTT_QUEUE_DIR          "/mqtt"
+#define MQTT_QUEUE_FILE         "/mqtt/queue.bin"
+#define MQTT_QUEUE_HEAD_FILE    "/mqtt/queue.pos"
+#define MQTT_INBOX_LEN          16
+#define MQTT_RAM_QUEUE          32          // messages held in RAM
+#define MQTT_BATCH_MESSAGES     16          // events per PUBLISH
+#define MQTT_MAX_BATCH          1024        // PUBLISH payload
+#define MQTT_TOPIC_LEN          64
+#define MQTT_PACKET_MAX         (MQTT_MAX_BATCH + MQTT_TOPIC_LEN + 8)
+#define MQTT_SEND_BUFFER        (3 * MQTT_PACKET_MAX)
+#define MQTT_MAX_INFLIGHT       4           // qos 1 publishes awaiting PUBACK
+#define MQTT_STACK_SIZE         6144
+#define MQTT_CONNECT_TIMEOUT_MS 5000
+#define MQTT_RETRY_MIN_MS       1000
+#define MQTT_RETRY_MAX_MS       60000
+#define MQTT_OFFLINE_SPILL_MS   10000
+#define MQTT_POLL_MS            50          // socket polling while replies are due
+
+enum MqttTopic : uint8_t {
+  MQTT_TOPIC_DETECTIONS = 0,
+  MQTT_TOPIC_TRACKS,
+  MQTT_TOPIC_COUNT
+};
+
+enum MqttState : uint8_t {
+  MQTT_STATE_DISABLED = 0,
+  MQTT_STATE_OFFLINE,         // no WiFi
+  MQTT_STATE_CONNECTING,
+  MQTT_STATE_CONNECTED,
+  MQTT_STATE_RETRYING         // waiting before the next attempt
+};
+
+class MqttPublisher : public MqttSpillStorage {
+public:
+  MqttPublisher();
+
+  // Opens the spill file and starts the publisher task
+  bool begin(bool sdReady, const MqttSettings &settings);
+  // New settings; the task reconnects when the broker settings changed
+  void configure(const MqttSettings &settings);
+
+  // Queue one event; false when the publisher is not running or busy
+  bool publishDetection(const EventDetection &detection, const char *label, uint64_t timeMs);
+  bool publishTrack(const char *event, uint16_t track, uint8_t classId, const char *label, const char *zone,
+                    uint64_t timeMs);
+
+  void reportStatus(JsonObject out) const;
+
+  // MqttSpillStorage: MQTT_QUEUE_FILE; caller holds sdCardMutex
+  uint32_t spillSize() override;
+  size_t spillRead(uint32_t offset, uint8_t *dst, size_t len) override;
+  size_t spillAppend(const uint8_t *data, size_t len) override;
+  void spillClear() override;
+  uint32_t loadHead() override;
+  bool saveHead(uint32_t offset) override;
+
+private:
+  struct Inflight {
+    uint16_t packetId;
+    uint16_t messages;
+    uint16_t length;
+    uint8_t *packet;
+  };
+
+  MqttQueue queue;
+  MqttRateLimiter limiter;
+  MqttParser parser;
+  WiFiClient client;
+  QueueHandle_t inbox;
+  TaskHandle_t task;
+  portMUX_TYPE lock;
+  bool sdReady;
+  volatile bool running;
+  volatile bool accepting;    // enabled with a broker host
+
+  MqttSettings config;        // task copy
+  MqttSettings pending;       // from configure()
+  volatile bool reconfigure;
+  char topics[MQTT_TOPIC_COUNT][MQTT_TOPIC_LEN];
+  char healthTopic[MQTT_TOPIC_LEN];
+  char statusTopic[MQTT_TOPIC_LEN];
+  volatile uint32_t localIp;  // for snapshot URLs
+
+  volatile MqttState state;
+  const char *lastError;
+  uint32_t retryAt;
+  uint32_t retryDelay;
+  uint32_t offlineSince;
+  bool batchOpen;             // events are waiting for the batch window
+  uint32_t batchStart;
+  uint8_t failureStreak;
+  uint32_t lastSendMs;
+  uint32_t pingSentMs;
+  bool pingOutstanding;
+  uint32_t healthDueAt;
+  uint16_t nextPacketId;
+
+  uint8_t *sendBuffer;
+  char *batchBuffer;
+  Inflight inflight[MQTT_MAX_INFLIGHT];
+  volatile uint8_t inflightCount;
+
+  // Counters for reportStatus()
+  volatile uint32_t connects;
+  volatile uint32_t connectFailures;
+  volatile uint32_t published;      // events
+  volatile uint32_t packets;        // PUBLISH packets with events
+  volatile uint32_t bytesSent;
+  volatile uint32_t inboxDrops;
+  volatile uint32_t connectedAt;
+
+  bool enqueue(MqttMessage &message, int length);
+  static void taskEntry(void *param);
+  void run();
+  void applySettings();
+  void receive(uint32_t waitMs);
+  uint32_t nextWake(uint32_t now) const;
+  bool backlog() const;
+  uint16_t drainBatch() const;
+  bool connectBroker();
+  bool connectFailed(const char *reason);
+  void disconnect(const char *reason);
+  bool writeAll(const uint8_t *data, size_t len);
+  void readPackets();
+  void sendPending(uint32_t now);
+  size_t fillPackets(bool &more);
+  void acknowledge(uint16_t packetId);
+  void keepAlive(uint32_t now);
+  void publishHealth(uint32_t now);
+  bool spillToCard();
+  void syncQueue();
+};
+
+extern MqttPublisher mqttPublisher;
+
+#endif // MQTT_PUBLISHER_H
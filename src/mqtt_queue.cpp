@@ -0,0 +1,295 @@
+/**
+ * MQTT Outbound Queue Implementation
+ */
+
+#include "mqtt_queue.h"
+#include "event_store.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SPILL_RECORD_MAX (MQTT_SPILL_HEADER_SIZE + MQTT_MAX_MESSAGE + MQTT_SPILL_CRC_SIZE)
+
+enum SpillStatus {
+  SPILL_OK = 0,
+  SPILL_UNREADABLE,     // read failed, try again later
+  SPILL_BAD
+};
+
+MqttQueue::MqttQueue()
+  : storage(NULL), ring(NULL), ramCapacity(0), ramHead(0), ramCount(0), spillLimit(0), spillHead(0),
+    spillEnd(0), savedHead(0), stagedSize(0), stagedValid(false), spillSealed(false), readBuffer(NULL), readOffset(0),
+    readLen(0), writeBuffer(NULL) {
+  memset(&counters, 0, sizeof(counters));
+}
+
+MqttQueue::~MqttQueue() {
+  end();
+}
+
+void MqttQueue::end() {
+  free(ring);
+  free(readBuffer);
+  free(writeBuffer);
+  ring = NULL;
+  readBuffer = NULL;
+  writeBuffer = NULL;
+  storage = NULL;
+  ramCapacity = 0;
+  ramHead = 0;
+  ramCount = 0;
+  spillHead = 0;
+  spillEnd = 0;
+  savedHead = 0;
+  stagedValid = false;
+  spillSealed = false;
+  readLen = 0;
+}
+
+bool MqttQueue::begin(MqttSpillStorage *source, uint16_t capacity, uint32_t limit) {
+  end();
+  ring = (MqttMessage *)malloc(sizeof(MqttMessage) * capacity);
+  if (source) {
+    readBuffer = (uint8_t *)malloc(MQTT_SPILL_READ_BUFFER);
+    writeBuffer = (uint8_t *)malloc(MQTT_SPILL_WRITE_BUFFER);
+  }
+  if (ring == NULL || (source && (readBuffer == NULL || writeBuffer == NULL))) {
+    end();
+    return false;
+  }
+  ramCapacity = capacity;
+  spillLimit = limit;
+  storage = source;
+  if (storage) {
+    spillEnd = storage->spillSize();
+    spillHead = storage->loadHead();
+    if (spillHead > spillEnd) spillHead = 0;
+    savedHead = spillHead;
+    checkSpill();
+    if (spillEnd && spillHead == spillEnd) resetSpill();
+  }
+  return true;
+}
+
+bool MqttQueue::push(uint8_t topic, const char *payload, uint16_t length) {
+  if (length > MQTT_MAX_MESSAGE || ramCount == ramCapacity) {
+    counters.dropped++;
+    return false;
+  }
+  MqttMessage &slot = ring[(ramHead + ramCount) % ramCapacity];
+  slot.topic = topic;
+  slot.length = length;
+  memcpy(slot.payload, payload, length);
+  ramCount++;
+  counters.queued++;
+  return true;
+}
+
+bool MqttQueue::spill() {
+  if (storage == NULL || ramCount == 0 || spillSealed) return false;
+  uint16_t moved = 0;
+  while (ramCount) {
+    // Fill the write buffer with whole records, then append it in one call
+    size_t used = 0;
+    uint16_t batch = 0;
+    while (batch < ramCount) {
+      const MqttMessage &message = ring[(ramHead + batch) % ramCapacity];
+      size_t recordSize = MQTT_SPILL_HEADER_SIZE + message.length + MQTT_SPILL_CRC_SIZE;
+      if (used + recordSize > MQTT_SPILL_WRITE_BUFFER) break;
+      if (spillEnd + used + recordSize > spillLimit) break;
+      uint8_t *record = writeBuffer + used;
+      record[0] = MQTT_SPILL_MAGIC;
+      record[1] = message.topic;
+      record[2] = (uint8_t)message.length;
+      record[3] = (uint8_t)(message.length >> 8);
+      memcpy(record + MQTT_SPILL_HEADER_SIZE, message.payload, message.length);
+      uint32_t crc = eventCrc32(0, record, MQTT_SPILL_HEADER_SIZE + message.length);
+      uint8_t *tail = record + MQTT_SPILL_HEADER_SIZE + message.length;
+      tail[0] = (uint8_t)crc;
+      tail[1] = (uint8_t)(crc >> 8);
+      tail[2] = (uint8_t)(crc >> 16);
+      tail[3] = (uint8_t)(crc >> 24);
+      used += recordSize;
+      batch++;
+    }
+    if (batch == 0) break;   // spill file full
+
+    size_t written = storage->spillAppend(writeBuffer, used);
+    if (written != used) {
+      // The records written whole are in the file; the rest stay in RAM.
+      // The torn tail is past spillEnd, and appending after it would put
+      // records where readers never reach them, so the file is sealed
+      // until it has been read out.
+      used = 0;
+      batch = 0;
+      while (batch < ramCount) {
+        size_t recordSize = MQTT_SPILL_HEADER_SIZE + ring[(ramHead + batch) % ramCapacity].length + MQTT_SPILL_CRC_SIZE;
+        if (used + recordSize > written) break;
+        used += recordSize;
+        batch++;
+      }
+      counters.spillErrors++;
+      spillSealed = true;
+    }
+    spillEnd += (uint32_t)used;
+    ramHead = (ramHead + batch) % ramCapacity;
+    ramCount -= batch;
+    moved += batch;
+    counters.spilled += batch;
+    if (spillSealed) break;
+  }
+  return moved > 0;
+}
+
+// Walks the records left by an earlier boot. A damaged one (a reset during
+// an append) ends the file: spillEnd moves back to it and the file is
+// sealed, as after a short write.
+void MqttQueue::checkSpill() {
+  uint32_t offset = spillHead;
+  while (offset < spillEnd) {
+    uint16_t recordSize;
+    int status = loadRecord(offset, staged, recordSize);
+    if (status == SPILL_UNREADABLE) {
+      spillSealed = true;
+      break;
+    }
+    if (status == SPILL_BAD) {
+      counters.spillErrors++;
+      spillEnd = offset;
+      spillSealed = true;
+      break;
+    }
+    offset += recordSize;
+  }
+  readOffset = 0;
+  readLen = 0;
+}
+
+bool MqttQueue::readSpill(uint32_t offset, uint8_t *dst, size_t len) {
+  if (offset < readOffset || offset + len > readOffset + readLen) {
+    uint32_t available = spillEnd - offset;
+    size_t want = available < MQTT_SPILL_READ_BUFFER ? available : MQTT_SPILL_READ_BUFFER;
+    readOffset = offset;
+    readLen = (uint16_t)storage->spillRead(offset, readBuffer, want);
+    if (len > readLen) {
+      readLen = 0;
+      return false;
+    }
+  }
+  memcpy(dst, readBuffer + (offset - readOffset), len);
+  return true;
+}
+
+int MqttQueue::loadRecord(uint32_t offset, MqttMessage &message, uint16_t &recordSize) {
+  uint8_t record[SPILL_RECORD_MAX];
+  if (spillEnd - offset < MQTT_SPILL_HEADER_SIZE + MQTT_SPILL_CRC_SIZE) return SPILL_BAD;
+  if (!readSpill(offset, record, MQTT_SPILL_HEADER_SIZE)) return SPILL_UNREADABLE;
+  uint16_t length = (uint16_t)(record[2] | (record[3] << 8));
+  if (record[0] != MQTT_SPILL_MAGIC || length > MQTT_MAX_MESSAGE) return SPILL_BAD;
+  recordSize = (uint16_t)(MQTT_SPILL_HEADER_SIZE + length + MQTT_SPILL_CRC_SIZE);
+  if (spillEnd - offset < recordSize) return SPILL_BAD;
+  if (!readSpill(offset, record, recordSize)) return SPILL_UNREADABLE;
+
+  const uint8_t *tail = record + MQTT_SPILL_HEADER_SIZE + length;
+  uint32_t crc = (uint32_t)tail[0] | ((uint32_t)tail[1] << 8) | ((uint32_t)tail[2] << 16) | ((uint32_t)tail[3] << 24);
+  if (crc != eventCrc32(0, record, MQTT_SPILL_HEADER_SIZE + length)) return SPILL_BAD;
+  message.topic = record[1];
+  message.length = length;
+  memcpy(message.payload, record + MQTT_SPILL_HEADER_SIZE, length);
+  return SPILL_OK;
+}
+
+void MqttQueue::resetSpill() {
+  if (storage) storage->spillClear();
+  spillHead = 0;
+  spillEnd = 0;
+  savedHead = 0;
+  stagedValid = false;
+  spillSealed = false;
+  readOffset = 0;
+  readLen = 0;
+}
+
+// Oldest message: the spill file first, then the ring. NULL while the
+// spill file cannot be read.
+const MqttMessage *MqttQueue::front() {
+  if (spillHead < spillEnd) {
+    if (stagedValid) return &staged;
+    int status = loadRecord(spillHead, staged, stagedSize);
+    if (status == SPILL_OK) {
+      stagedValid = true;
+      return &staged;
+    }
+    if (status == SPILL_UNREADABLE) return NULL;
+    // Damaged or torn: nothing after it can be trusted
+    counters.spillErrors++;
+    resetSpill();
+  }
+  return ramCount ? &ring[ramHead] : NULL;
+}
+
+void MqttQueue::pop() {
+  counters.taken++;
+  if (stagedValid) {
+    stagedValid = false;
+    spillHead += stagedSize;
+    if (spillHead >= spillEnd) resetSpill();
+    return;
+  }
+  ramHead = (ramHead + 1) % ramCapacity;
+  ramCount--;
+}
+
+size_t MqttQueue::takeBatch(uint8_t &topic, char *out, size_t capacity, uint16_t maxMessages, uint16_t &messages) {
+  size_t len = 0;
+  messages = 0;
+  while (messages < maxMessages) {
+    const MqttMessage *message = front();
+    if (message == NULL) break;
+    if (messages && message->topic != topic) break;
+    // '[' or ',' before it, ']' after the last one
+    if (len + message->length + 2 > capacity) break;
+    if (messages == 0) topic = message->topic;
+    out[len++] = messages ? ',' : '[';
+    memcpy(out + len, message->payload, message->length);
+    len += message->length;
+    messages++;
+    pop();
+  }
+  if (messages) out[len++] = ']';
+  return len;
+}
+
+void MqttQueue::sync() {
+  if (storage == NULL || spillEnd == 0 || spillHead == savedHead) return;
+  if (storage->saveHead(spillHead)) savedHead = spillHead;
+}
+
+// ---------------------------------------------------------------------------
+// Rate limiter
+
+void MqttRateLimiter::configure(uint16_t perSecond) {
+  rate = perSecond ? perSecond : 1;
+  uint32_t burst = (uint32_t)rate * 1000;
+  if (tokens > burst) tokens = burst;
+}
+
+void MqttRateLimiter::refill(uint32_t nowMs) {
+  uint32_t elapsed = nowMs - lastMs;
+  lastMs = nowMs;
+  if (elapsed > 1000) elapsed = 1000;
+  uint32_t burst = (uint32_t)rate * 1000;
+  tokens += elapsed * rate;
+  if (tokens > burst) tokens = burst;
+}
+
+void MqttRateLimiter::consume(uint16_t count) {
+  uint32_t cost = (uint32_t)count * 1000;
+  tokens = cost < tokens ? tokens - cost : 0;
+}
+
+uint32_t MqttRateLimiter::waitMs(uint16_t count) const {
+  if (count > rate) count = rate;
+  uint32_t need = (uint32_t)(count ? count : 1) * 1000;
+  if (tokens >= need) return 0;
+  return (need - tokens + rate - 1) / rate;
+}
@@ -0,0 +1,156 @@
+/**
+ * MQTT Outbound Queue
+ *
+ * Messages waiting for the broker, oldest first. New messages go to a
+ * bounded RAM ring; when the ring fills (or the publisher decides the
+ * broker has been gone long enough) its messages are appended to a spill
+ * file, so a long outage costs SD space instead of RAM and survives a
+ * reboot. Everything in the spill file is older than everything in the
+ * ring, so draining reads the file first and the order is kept.
+ *
+ * Spill record layout (little endian):
+ *   0  magic     u8   MQTT_SPILL_MAGIC
+ *   1  topic     u8
+ *   2  length    u16  payload bytes
+ *   4  payload
+ *   .. crc       u32  CRC-32 of the header and payload
+ *
+ * The file is only appended to; the read position is kept in RAM and saved
+ * by sync(), and the file is deleted once it has been read to the end. A
+ * record that fails its check (a write cut short by a reset, found when
+ * begin() walks the file) or a short append ends the file: nothing more is
+ * appended to it until it has been read out, and the messages that did
+ * not make it stay in RAM. When the file reaches its size limit, or is
+ * ended early, new messages are dropped once the ring is full: the event
+ * log keeps the full history.
+ *
+ * Files are reached through MqttSpillStorage, so the queue runs (and is
+ * checked) on a host. Not thread safe: the caller serializes all calls.
+ */
+
+#ifndef MQTT_QUEUE_H
+#define MQTT_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQTT_MAX_MESSAGE        224         // one JSON event
+#define MQTT_SPILL_MAGIC        0xA7
+#define MQTT_SPILL_HEADER_SIZE  4
+#define MQTT_SPILL_CRC_SIZE     4
+#define MQTT_SPILL_READ_BUFFER  512
+#define MQTT_SPILL_WRITE_BUFFER 2048
+
+struct MqttMessage {
+  uint8_t topic;
+  uint16_t length;
+  char payload[MQTT_MAX_MESSAGE];
+};
+
+// The spill file and its saved read position
+class MqttSpillStorage {
+public:
+  virtual ~MqttSpillStorage() {}
+  virtual uint32_t spillSize() = 0;
+  virtual size_t spillRead(uint32_t offset, uint8_t *dst, size_t len) = 0;
+  // Returns the bytes written (0 = nothing written)
+  virtual size_t spillAppend(const uint8_t *data, size_t len) = 0;
+  // Deletes the file and the saved position
+  virtual void spillClear() = 0;
+  virtual uint32_t loadHead() = 0;
+  virtual bool saveHead(uint32_t offset) = 0;
+};
+
+struct MqttQueueStats {
+  uint32_t queued;            // messages accepted
+  uint32_t taken;             // messages handed to the publisher
+  uint32_t spilled;           // messages moved to the spill file
+  uint32_t dropped;           // messages lost to a full queue
+  uint32_t spillErrors;       // failed appends and damaged records
+};
+
+class MqttQueue {
+public:
+  MqttQueue();
+  ~MqttQueue();
+
+  // Allocates the ring and reopens a spill file left by an earlier boot
+  // (reading it through once to find a damaged tail). storage may be NULL
+  // (no SD card): a full ring then drops messages.
+  bool begin(MqttSpillStorage *storage, uint16_t ramCapacity, uint32_t spillLimit);
+  void end();
+  void setSpillLimit(uint32_t bytes) { spillLimit = bytes; }
+
+  // Queues one message; false (and counted as dropped) when it is too long
+  // or the ring is full. The caller spills a full ring first.
+  bool push(uint8_t topic, const char *payload, uint16_t length);
+  bool ramFull() const { return ramCount == ramCapacity; }
+
+  // Appends every RAM message to the spill file, as far as the limit
+  // allows; false when none could be moved
+  bool spill();
+
+  // Removes the oldest run of messages with the same topic (at most
+  // maxMessages) and writes them to out as a JSON array. Returns the bytes
+  // written; messages is 0 when the queue is empty. capacity must hold
+  // at least MQTT_MAX_MESSAGE + 2 bytes.
+  size_t takeBatch(uint8_t &topic, char *out, size_t capacity, uint16_t maxMessages, uint16_t &messages);
+
+  // Saves the spill read position (messages taken so far are not re-sent
+  // after a reboot)
+  void sync();
+
+  bool empty() const { return ramCount == 0 && spillHead >= spillEnd; }
+  uint16_t ramMessages() const { return ramCount; }
+  uint32_t spillBytes() const { return spillEnd - spillHead; }
+  const MqttQueueStats &stats() const { return counters; }
+
+private:
+  MqttSpillStorage *storage;
+  MqttMessage *ring;
+  uint16_t ramCapacity;
+  uint16_t ramHead;
+  uint16_t ramCount;
+
+  uint32_t spillLimit;
+  uint32_t spillHead;         // read position
+  uint32_t spillEnd;          // file size
+  uint32_t savedHead;
+  MqttMessage staged;         // spill record at spillHead, once read
+  uint16_t stagedSize;
+  bool stagedValid;
+  bool spillSealed;           // damaged tail: no appends until read out
+
+  uint8_t *readBuffer;
+  uint32_t readOffset;
+  uint16_t readLen;
+  uint8_t *writeBuffer;
+
+  MqttQueueStats counters;
+
+  const MqttMessage *front();
+  void pop();
+  bool readSpill(uint32_t offset, uint8_t *dst, size_t len);
+  int loadRecord(uint32_t offset, MqttMessage &message, uint16_t &recordSize);
+  void checkSpill();
+  void resetSpill();
+};
+
+// Token bucket: perSecond messages, bursts of up to one second's worth
+class MqttRateLimiter {
+public:
+  MqttRateLimiter() : rate(10), tokens(10000), lastMs(0) {}
+  void configure(uint16_t perSecond);
+  void refill(uint32_t nowMs);
+  uint16_t available() const { return (uint16_t)(tokens / 1000); }
+  void consume(uint16_t count);
+  // ms until count messages (at most one second's worth) may be sent
+  uint32_t waitMs(uint16_t count = 1) const;
+
+private:
+  uint16_t rate;
+  uint32_t tokens;            // thousandths of a message
+  uint32_t lastMs;
+};
+
+#endif // MQTT_QUEUE_H
@@ -0,0 +1,585 @@
+/**
+ * Streaming OTA Image Decoder Implementation
+ */
+
+#include "ota_decoder.h"
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#endif
+
+#if __has_include(<esp32/rom/miniz.h>)
+#include <esp32/rom/miniz.h>
+#define OTA_DECODER_HAS_GZIP 1
+#elif __has_include(<rom/miniz.h>)
+#include <rom/miniz.h>
+#define OTA_DECODER_HAS_GZIP 1
+#elif __has_include(<miniz.h>)
+#include <miniz.h>
+#define OTA_DECODER_HAS_GZIP 1
+#else
+#define OTA_DECODER_HAS_GZIP 0
+#endif
+
+static const uint8_t ESP32_IMAGE_MAGIC = 0xE9;
+
+// gzip header flag bits (RFC 1952)
+static const uint8_t GZIP_FHCRC = 0x02;
+static const uint8_t GZIP_FEXTRA = 0x04;
+static const uint8_t GZIP_FNAME = 0x08;
+static const uint8_t GZIP_FCOMMENT = 0x10;
+
+static inline uint32_t readLE32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+OtaDecoder::OtaDecoder()
+  : sink(NULL), sinkCtx(NULL), oldImage(NULL), oldImageCtx(NULL),
+    inflator(NULL), dictionary(NULL), window(NULL), oldBlock(NULL) {
+  begin(NULL, NULL);
+}
+
+OtaDecoder::~OtaDecoder() {
+  end();
+}
+
+OtaImageFormat OtaDecoder::detect(const uint8_t *data, size_t len) {
+  if (len >= 1 && data[0] == ESP32_IMAGE_MAGIC) return OTA_FORMAT_RAW;
+  if (len >= 2 && data[0] == 0x1F && data[1] == 0x8B) return OTA_FORMAT_GZIP;
+  if (len >= 4 && memcmp(data, OTA_HEATSHRINK_MAGIC, 4) == 0) return OTA_FORMAT_HEATSHRINK;
+  if (len >= 4 && memcmp(data, OTA_DELTA_MAGIC, 4) == 0) return OTA_FORMAT_DELTA;
+  return OTA_FORMAT_UNKNOWN;
+}
+
+const char *OtaDecoder::formatName(OtaImageFormat format) {
+  switch (format) {
+    case OTA_FORMAT_RAW: return "raw";
+    case OTA_FORMAT_GZIP: return "gzip";
+    case OTA_FORMAT_HEATSHRINK: return "heatshrink";
+    case OTA_FORMAT_DELTA: return "delta";
+    default: return "unknown";
+  }
+}
+
+uint32_t OtaDecoder::crc32(uint32_t crc, const uint8_t *data, size_t len) {
+  static uint32_t table[256];
+  static bool tableReady = false;
+  if (!tableReady) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (uint8_t k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+    tableReady = true;
+  }
+
+  crc = ~crc;
+  while (len--) {
+    crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#ifdef ESP_PLATFORM
+bool OtaDecoder::readRunningFirmware(void *ctx, size_t offset, uint8_t *data, size_t len) {
+  (void)ctx;
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  return running && offset + len <= running->size &&
+         esp_partition_read(running, offset, data, len) == ESP_OK;
+}
+#endif
+
+void *OtaDecoder::allocate(size_t size) {
+#ifdef ESP_PLATFORM
+  void *ptr = heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ptr) return ptr;
+#endif
+  return calloc(1, size);
+}
+
+void OtaDecoder::begin(SinkFn sinkFn, void *sinkContext, SourceFn oldImageFn, void *oldImageContext) {
+  end();
+  sink = sinkFn;
+  sinkCtx = sinkContext;
+  oldImage = oldImageFn;
+  oldImageCtx = oldImageContext;
+  errorMessage = NULL;
+
+  outerState = OUTER_DETECT;
+  outerFormat = OTA_FORMAT_UNKNOWN;
+  headerLen = 0;
+  inputCount = 0;
+  memset(inputTail, 0, sizeof(inputTail));
+  outerCrc = 0;
+  outerCount = 0;
+
+  dictionaryOffset = 0;
+  gzipFlags = 0;
+  gzipHeaderStep = 0;
+  gzipSkip = 0;
+
+  windowBits = 0;
+  lookaheadBits = 0;
+  windowHead = 0;
+  bitBuffer = 0;
+  bitCount = 0;
+  hsStep = 0;
+  hsIndex = 0;
+  hsCount = 0;
+  hsExpectedSize = 0;
+  hsExpectedCrc = 0;
+  stagingLen = 0;
+
+  innerState = INNER_DETECT;
+  innerFormat = OTA_FORMAT_UNKNOWN;
+  innerHeaderLen = 0;
+  oldSize = 0;
+  newSize = 0;
+  newCrc = 0;
+  oldPos = 0;
+  diffRemaining = 0;
+  extraRemaining = 0;
+  pendingSeek = 0;
+  finalCrc = 0;
+  outputCount = 0;
+}
+
+void OtaDecoder::end() {
+  free(inflator);
+  free(dictionary);
+  free(window);
+  free(oldBlock);
+  inflator = NULL;
+  dictionary = NULL;
+  window = NULL;
+  oldBlock = NULL;
+}
+
+bool OtaDecoder::fail(const char *message) {
+  if (!errorMessage) errorMessage = message;
+  return false;
+}
+
+bool OtaDecoder::write(const uint8_t *data, size_t len) {
+  if (errorMessage) return false;
+
+  // Keep the last 8 input bytes: the gzip trailer (CRC32 + ISIZE)
+  if (len >= sizeof(inputTail)) {
+    memcpy(inputTail, data + len - sizeof(inputTail), sizeof(inputTail));
+  } else {
+    memmove(inputTail, inputTail + len, sizeof(inputTail) - len);
+    memcpy(inputTail + sizeof(inputTail) - len, data, len);
+  }
+  inputCount += len;
+
+  return feedOuter(data, len);
+}
+
+// ---------------------------------------------------------------------------
+// Outer stage: container detection and decompression
+
+bool OtaDecoder::feedOuter(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    switch (outerState) {
+      case OUTER_DETECT: {
+        header[headerLen++] = *data++;
+        len--;
+        if (header[0] != ESP32_IMAGE_MAGIC && headerLen < 4) break;
+
+        OtaImageFormat format = detect(header, headerLen);
+        if (format == OTA_FORMAT_UNKNOWN) return fail("Unrecognized firmware image format");
+
+        uint8_t detected[4];
+        size_t detectedLen = headerLen;
+        memcpy(detected, header, detectedLen);
+        headerLen = 0;
+
+        if (format == OTA_FORMAT_GZIP) {
+          if (!OTA_DECODER_HAS_GZIP) return fail("gzip images are not supported by this build");
+          outerFormat = OTA_FORMAT_GZIP;
+          outerState = OUTER_GZIP_HEADER;
+        } else if (format == OTA_FORMAT_HEATSHRINK) {
+          outerFormat = OTA_FORMAT_HEATSHRINK;
+          outerState = OUTER_HS_HEADER;
+        } else {
+          outerFormat = OTA_FORMAT_RAW;  // uncompressed image or delta
+          outerState = OUTER_PASS;
+        }
+        if (!feedOuter(detected, detectedLen)) return false;
+        break;
+      }
+
+      case OUTER_PASS:
+        if (!emitOuter(data, len)) return false;
+        len = 0;
+        break;
+
+      case OUTER_GZIP_HEADER:
+        if (!gzipHeader(data, len)) return false;
+        break;
+
+      case OUTER_GZIP_BODY:
+        if (!inflate(data, len, false)) return false;
+        len = 0;
+        break;
+
+      case OUTER_HS_HEADER: {
+        header[headerLen++] = *data++;
+        len--;
+        if (headerLen < OTA_HEATSHRINK_HEADER) break;
+
+        windowBits = header[4];
+        lookaheadBits = header[5];
+        hsExpectedSize = readLE32(header + 8);
+        hsExpectedCrc = readLE32(header + 12);
+        headerLen = 0;
+        if (windowBits < 4 || windowBits > 12 || lookaheadBits < 3 || lookaheadBits >= windowBits) {
+          return fail("Invalid heatshrink parameters");
+        }
+        window = (uint8_t *)allocate((size_t)1 << windowBits);
+        if (!window) return fail("Out of memory");
+        outerState = OUTER_HS_BODY;
+        break;
+      }
+
+      case OUTER_HS_BODY:
+        if (!expandHeatshrink(data, len)) return false;
+        len = 0;
+        break;
+
+      case OUTER_DONE:
+        len = 0;  // gzip trailer or heatshrink padding
+        break;
+    }
+  }
+  return true;
+}
+
+bool OtaDecoder::gzipHeader(const uint8_t *&data, size_t &len) {
+  while (len > 0 && outerState == OUTER_GZIP_HEADER) {
+    uint8_t byte = *data++;
+    len--;
+
+    switch (gzipHeaderStep) {
+      case 0: case 1: case 4: case 5: case 6: case 7: case 8: case 9:
+        gzipHeaderStep++;  // magic (already detected), MTIME, XFL, OS
+        break;
+      case 2:
+        if (byte != 8) return fail("Unsupported gzip compression method");
+        gzipHeaderStep++;
+        break;
+      case 3:
+        gzipFlags = byte;
+        gzipHeaderStep++;
+        break;
+      case 10:  // FEXTRA length, low byte
+        gzipSkip = byte;
+        gzipHeaderStep++;
+        break;
+      case 11:  // FEXTRA length, high byte
+        gzipSkip |= (uint16_t)byte << 8;
+        gzipHeaderStep++;
+        break;
+      case 12:  // FEXTRA payload
+        if (gzipSkip > 0) gzipSkip--;
+        break;
+      case 13:  // FNAME
+      case 14:  // FCOMMENT
+        if (byte == 0) gzipHeaderStep++;
+        break;
+      case 15:  // FHCRC
+        if (gzipSkip > 0) gzipSkip--;
+        break;
+    }
+
+    // Advance past optional fields that are absent or fully consumed
+    for (;;) {
+      if (gzipHeaderStep == 10 && !(gzipFlags & GZIP_FEXTRA)) gzipHeaderStep = 13;
+      else if (gzipHeaderStep == 12 && gzipSkip == 0) gzipHeaderStep = 13;
+      else if (gzipHeaderStep == 13 && !(gzipFlags & GZIP_FNAME)) gzipHeaderStep = 14;
+      else if (gzipHeaderStep == 14 && !(gzipFlags & GZIP_FCOMMENT)) { gzipHeaderStep = 15; gzipSkip = 2; }
+      else if (gzipHeaderStep == 15 && (!(gzipFlags & GZIP_FHCRC) || gzipSkip == 0)) gzipHeaderStep = 16;
+      else break;
+    }
+
+    if (gzipHeaderStep == 16) {
+#if OTA_DECODER_HAS_GZIP
+      inflator = allocate(sizeof(tinfl_decompressor));
+      dictionary = (uint8_t *)allocate(TINFL_LZ_DICT_SIZE);
+      if (!inflator || !dictionary) return fail("Out of memory");
+      tinfl_init((tinfl_decompressor *)inflator);
+      outerState = OUTER_GZIP_BODY;
+#endif
+    }
+  }
+  return true;
+}
+
+bool OtaDecoder::inflate(const uint8_t *data, size_t len, bool final) {
+#if OTA_DECODER_HAS_GZIP
+  tinfl_decompressor *decompressor = (tinfl_decompressor *)inflator;
+  for (;;) {
+    size_t inBytes = len;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - dictionaryOffset;
+    tinfl_status status = tinfl_decompress(decompressor, data, &inBytes,
+                                           dictionary, dictionary + dictionaryOffset, &outBytes,
+                                           final ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+    data += inBytes;
+    len -= inBytes;
+
+    if (outBytes > 0) {
+      if (!emitOuter(dictionary + dictionaryOffset, outBytes)) return false;
+      dictionaryOffset = (dictionaryOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (status < TINFL_STATUS_DONE) return fail("Corrupt gzip stream");
+    if (status == TINFL_STATUS_DONE) {
+      outerState = OUTER_DONE;
+      return true;
+    }
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) return true;
+  }
+#else
+  (void)data; (void)len; (void)final;
+  return fail("gzip images are not supported by this build");
+#endif
+}
+
+/**
+ * heatshrink stream: MSB-first bits, tag 1 = 8-bit literal, tag 0 = backref
+ * of (index + 1) distance and (count + 1) length, sizes from the header.
+ */
+bool OtaDecoder::expandHeatshrink(const uint8_t *data, size_t len) {
+  const size_t windowMask = ((size_t)1 << windowBits) - 1;
+
+  for (;;) {
+    if (outerCount + stagingLen >= hsExpectedSize) {
+      outerState = OUTER_DONE;
+      return flushStaging();
+    }
+
+    uint8_t need = hsStep == 0 ? 1 : hsStep == 1 ? 8 : hsStep == 2 ? windowBits : lookaheadBits;
+    while (bitCount < need) {
+      if (len == 0) return true;  // resume on the next write
+      bitBuffer = (bitBuffer << 8) | *data++;
+      bitCount += 8;
+      len--;
+    }
+    uint16_t value = (bitBuffer >> (bitCount - need)) & ((1u << need) - 1);
+    bitCount -= need;
+
+    switch (hsStep) {
+      case 0:
+        hsStep = value ? 1 : 2;
+        break;
+      case 1: {
+        uint8_t byte = (uint8_t)value;
+        window[windowHead++ & windowMask] = byte;
+        if (!stage(byte)) return false;
+        hsStep = 0;
+        break;
+      }
+      case 2:
+        hsIndex = value + 1;
+        hsStep = 3;
+        break;
+      case 3:
+        hsCount = value + 1;
+        for (uint16_t i = 0; i < hsCount && outerCount + stagingLen < hsExpectedSize; i++) {
+          uint8_t byte = window[(windowHead - hsIndex) & windowMask];
+          window[windowHead++ & windowMask] = byte;
+          if (!stage(byte)) return false;
+        }
+        hsStep = 0;
+        break;
+    }
+  }
+}
+
+bool OtaDecoder::stage(uint8_t byte) {
+  staging[stagingLen++] = byte;
+  return stagingLen < sizeof(staging) || flushStaging();
+}
+
+bool OtaDecoder::flushStaging() {
+  size_t len = stagingLen;
+  stagingLen = 0;
+  return len == 0 || emitOuter(staging, len);
+}
+
+bool OtaDecoder::emitOuter(const uint8_t *data, size_t len) {
+  outerCrc = crc32(outerCrc, data, len);
+  outerCount += len;
+  return feedInner(data, len);
+}
+
+// ---------------------------------------------------------------------------
+// Inner stage: raw image passthrough or delta patching
+
+bool OtaDecoder::feedInner(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    switch (innerState) {
+      case INNER_DETECT:
+        innerHeader[innerHeaderLen++] = *data++;
+        len--;
+        if (innerHeader[0] == ESP32_IMAGE_MAGIC) {
+          innerFormat = OTA_FORMAT_RAW;
+          innerState = INNER_IMAGE;
+          if (!emit(innerHeader, innerHeaderLen)) return false;
+          innerHeaderLen = 0;
+        } else if (innerHeaderLen == 4) {
+          if (detect(innerHeader, 4) != OTA_FORMAT_DELTA) {
+            return fail("Compressed payload is not an ESP32 image or delta");
+          }
+          innerFormat = OTA_FORMAT_DELTA;
+          innerState = INNER_DELTA_HEADER;
+        }
+        break;
+
+      case INNER_IMAGE:
+        if (!emit(data, len)) return false;
+        len = 0;
+        break;
+
+      case INNER_DELTA_HEADER:
+        innerHeader[innerHeaderLen++] = *data++;
+        len--;
+        if (innerHeaderLen == OTA_DELTA_HEADER) {
+          innerHeaderLen = 0;
+          if (!startDelta()) return false;
+          innerState = INNER_DELTA_CONTROL;
+        }
+        break;
+
+      case INNER_DELTA_CONTROL:
+        innerHeader[innerHeaderLen++] = *data++;
+        len--;
+        if (innerHeaderLen == OTA_DELTA_CONTROL) {
+          innerHeaderLen = 0;
+          diffRemaining = readLE32(innerHeader);
+          extraRemaining = readLE32(innerHeader + 4);
+          pendingSeek = (int32_t)readLE32(innerHeader + 8);
+          if (outputCount + diffRemaining + extraRemaining > newSize) {
+            return fail("Corrupt delta: record exceeds image size");
+          }
+          innerState = INNER_DELTA_DIFF;
+        }
+        break;
+
+      case INNER_DELTA_DIFF: {
+        size_t n = len < diffRemaining ? len : diffRemaining;
+        if (n > OTA_DELTA_BLOCK) n = OTA_DELTA_BLOCK;
+        if (oldPos + n > oldSize) return fail("Corrupt delta: reads past old image");
+        if (n > 0) {
+          if (!oldImage(oldImageCtx, oldPos, oldBlock, n)) return fail("Failed to read running firmware");
+          for (size_t i = 0; i < n; i++) {
+            oldBlock[i] += data[i];
+          }
+          if (!emit(oldBlock, n)) return false;
+          oldPos += n;
+          diffRemaining -= n;
+          data += n;
+          len -= n;
+        }
+        break;
+      }
+
+      case INNER_DELTA_EXTRA: {
+        size_t n = len < extraRemaining ? len : extraRemaining;
+        if (!emit(data, n)) return false;
+        extraRemaining -= n;
+        data += n;
+        len -= n;
+        break;
+      }
+    }
+
+    // Record bookkeeping: diff -> extra -> seek -> next control block
+    if (innerState == INNER_DELTA_DIFF && diffRemaining == 0) {
+      innerState = INNER_DELTA_EXTRA;
+    }
+    if (innerState == INNER_DELTA_EXTRA && extraRemaining == 0) {
+      int64_t seeked = (int64_t)oldPos + pendingSeek;
+      if (seeked < 0 || seeked > (int64_t)oldSize) return fail("Corrupt delta: seek out of range");
+      oldPos = (size_t)seeked;
+      innerState = INNER_DELTA_CONTROL;
+    }
+  }
+  return true;
+}
+
+/**
+ * Delta header: magic, version, 3 reserved, old size, old CRC-32, new size,
+ * new CRC-32. The running firmware is checked against the old CRC before
+ * any byte is written, so a delta built for another base is rejected early.
+ */
+bool OtaDecoder::startDelta() {
+  if (innerHeader[4] != 1) return fail("Unsupported delta version");
+  if (!oldImage) return fail("Delta images need the running firmware as a base");
+
+  oldSize = readLE32(innerHeader + 8);
+  uint32_t oldCrc = readLE32(innerHeader + 12);
+  newSize = readLE32(innerHeader + 16);
+  newCrc = readLE32(innerHeader + 20);
+
+  oldBlock = (uint8_t *)allocate(OTA_DELTA_BLOCK);
+  if (!oldBlock) return fail("Out of memory");
+
+  uint32_t crc = 0;
+  for (size_t offset = 0; offset < oldSize; offset += OTA_DELTA_BLOCK) {
+    size_t n = oldSize - offset < OTA_DELTA_BLOCK ? oldSize - offset : OTA_DELTA_BLOCK;
+    if (!oldImage(oldImageCtx, offset, oldBlock, n)) return fail("Failed to read running firmware");
+    crc = crc32(crc, oldBlock, n);
+  }
+  if (crc != oldCrc) return fail("Delta was built for a different firmware version");
+
+  oldPos = 0;
+  return true;
+}
+
+bool OtaDecoder::emit(const uint8_t *data, size_t len) {
+  if (len == 0) return true;
+  finalCrc = crc32(finalCrc, data, len);
+  outputCount += len;
+  if (sink && !sink(sinkCtx, data, len)) return fail("Failed to write firmware data to flash");
+  return true;
+}
+
+bool OtaDecoder::finish() {
+  if (errorMessage) return false;
+
+  switch (outerFormat) {
+    case OTA_FORMAT_GZIP:
+      if (outerState == OUTER_GZIP_BODY && !inflate(NULL, 0, true)) return false;
+      if (outerState != OUTER_DONE) return fail("Truncated gzip image");
+      if (readLE32(inputTail) != outerCrc || readLE32(inputTail + 4) != (uint32_t)outerCount) {
+        return fail("gzip CRC mismatch");
+      }
+      break;
+    case OTA_FORMAT_HEATSHRINK:
+      if (!flushStaging()) return false;
+      if (outerCount != hsExpectedSize) return fail("Truncated heatshrink image");
+      if (outerCrc != hsExpectedCrc) return fail("heatshrink CRC mismatch");
+      break;
+    case OTA_FORMAT_RAW:
+      break;
+    default:
+      return fail("Image too short");
+  }
+
+  if (innerFormat == OTA_FORMAT_DELTA) {
+    if (innerState != INNER_DELTA_CONTROL || innerHeaderLen != 0 || outputCount != newSize) {
+      return fail("Truncated delta image");
+    }
+    if (finalCrc != newCrc) return fail("Patched image CRC mismatch");
+  } else if (innerFormat != OTA_FORMAT_RAW) {
+    return fail("Image too short");
+  }
+  return true;
+}
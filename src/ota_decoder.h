@@ -0,0 +1,153 @@
+/**
+ * Streaming OTA Image Decoder
+ *
+ * Sits between the upload (or staged SD image) and Update.write(). Accepts:
+ * - Raw ESP32 images (first byte 0xE9), passed through unchanged
+ * - gzip-compressed images, inflated with the ROM miniz and a 32KB window
+ * - heatshrink-compressed images ("HSHK" header, window up to 4KB)
+ * - Binary deltas against the running firmware ("ODLT" header, bsdiff-style
+ *   diff/extra/seek records), optionally wrapped in gzip or heatshrink
+ *
+ * Everything is decoded in one streaming pass with fixed-size buffers; sizes
+ * and CRC-32s carried by each format are checked in finish().
+ *
+ * The decoder has no Arduino dependencies so it can be built on a host. The
+ * matching encoder lives in tools/ota_image.py.
+ */
+
+#ifndef OTA_DECODER_H
+#define OTA_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OTA_HEATSHRINK_MAGIC  "HSHK"
+#define OTA_DELTA_MAGIC       "ODLT"
+#define OTA_HEATSHRINK_HEADER 16
+#define OTA_DELTA_HEADER      24
+#define OTA_DELTA_CONTROL     12
+#define OTA_DELTA_BLOCK       512
+
+enum OtaImageFormat : uint8_t {
+  OTA_FORMAT_UNKNOWN = 0,
+  OTA_FORMAT_RAW,
+  OTA_FORMAT_GZIP,
+  OTA_FORMAT_HEATSHRINK,
+  OTA_FORMAT_DELTA
+};
+
+class OtaDecoder {
+public:
+  // Receives decoded firmware bytes; return false to abort
+  typedef bool (*SinkFn)(void *ctx, const uint8_t *data, size_t len);
+  // Reads the running firmware for delta images; return false on error
+  typedef bool (*SourceFn)(void *ctx, size_t offset, uint8_t *data, size_t len);
+
+  OtaDecoder();
+  ~OtaDecoder();
+
+  // Identifies the container from the first bytes (needs 4 bytes)
+  static OtaImageFormat detect(const uint8_t *data, size_t len);
+  static const char *formatName(OtaImageFormat format);
+  static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+  // SinkFn adapter so an upstream stage can feed a decoder (ctx = OtaDecoder*)
+  static bool writeTo(void *decoder, const uint8_t *data, size_t len) {
+    return ((OtaDecoder *)decoder)->write(data, len);
+  }
+
+#ifdef ESP_PLATFORM
+  // SourceFn over the running app partition (ctx unused)
+  static bool readRunningFirmware(void *ctx, size_t offset, uint8_t *data, size_t len);
+#endif
+
+  void begin(SinkFn sink, void *sinkCtx, SourceFn oldImage = NULL, void *oldImageCtx = NULL);
+  bool write(const uint8_t *data, size_t len);
+  bool finish();
+  void end();
+
+  OtaImageFormat container() const { return outerFormat; }
+  OtaImageFormat payload() const { return innerFormat; }
+  size_t inputBytes() const { return inputCount; }
+  size_t outputBytes() const { return outputCount; }
+  const char *error() const { return errorMessage; }
+
+private:
+  enum OuterState : uint8_t {
+    OUTER_DETECT, OUTER_PASS, OUTER_GZIP_HEADER, OUTER_GZIP_BODY,
+    OUTER_HS_HEADER, OUTER_HS_BODY, OUTER_DONE
+  };
+  enum InnerState : uint8_t {
+    INNER_DETECT, INNER_IMAGE, INNER_DELTA_HEADER, INNER_DELTA_CONTROL,
+    INNER_DELTA_DIFF, INNER_DELTA_EXTRA
+  };
+
+  SinkFn sink;
+  void *sinkCtx;
+  SourceFn oldImage;
+  void *oldImageCtx;
+  const char *errorMessage;
+
+  OuterState outerState;
+  OtaImageFormat outerFormat;
+  uint8_t header[OTA_DELTA_HEADER];
+  size_t headerLen;
+  size_t inputCount;
+  uint8_t inputTail[8];          // gzip trailer (CRC32 + ISIZE)
+  uint32_t outerCrc;
+  size_t outerCount;
+
+  // gzip
+  void *inflator;
+  uint8_t *dictionary;
+  size_t dictionaryOffset;
+  uint8_t gzipFlags;
+  uint8_t gzipHeaderStep;
+  uint16_t gzipSkip;
+
+  // heatshrink
+  uint8_t *window;
+  uint8_t windowBits;
+  uint8_t lookaheadBits;
+  size_t windowHead;
+  uint32_t bitBuffer;
+  uint8_t bitCount;
+  uint8_t hsStep;
+  uint16_t hsIndex;
+  uint16_t hsCount;
+  uint32_t hsExpectedSize;
+  uint32_t hsExpectedCrc;
+  uint8_t staging[OTA_DELTA_BLOCK];
+  size_t stagingLen;
+
+  // inner (raw image or delta)
+  InnerState innerState;
+  OtaImageFormat innerFormat;
+  uint8_t innerHeader[OTA_DELTA_HEADER];
+  size_t innerHeaderLen;
+  uint32_t oldSize;
+  uint32_t newSize;
+  uint32_t newCrc;
+  size_t oldPos;
+  uint32_t diffRemaining;
+  uint32_t extraRemaining;
+  int32_t pendingSeek;
+  uint8_t *oldBlock;
+  uint32_t finalCrc;
+  size_t outputCount;
+
+  bool fail(const char *message);
+  bool feedOuter(const uint8_t *data, size_t len);
+  bool gzipHeader(const uint8_t *&data, size_t &len);
+  bool inflate(const uint8_t *data, size_t len, bool final);
+  bool expandHeatshrink(const uint8_t *data, size_t len);
+  bool stage(uint8_t byte);
+  bool flushStaging();
+  bool emitOuter(const uint8_t *data, size_t len);
+  bool feedInner(const uint8_t *data, size_t len);
+  bool startDelta();
+  bool emit(const uint8_t *data, size_t len);
+  void *allocate(size_t size);
+};
+
+#endif // OTA_DECODER_H
@@ -0,0 +1,444 @@
+/**
+ * Staged OTA Updates Implementation
+ */
+
+#include "ota_staging.h"
+#include "logger.h"
+#include "event_log.h"
+#include <Update.h>
+#include <MD5Builder.h>
+#include <esp_heap_caps.h>
+
+// Shared with the HTTP handlers in main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+extern bool otaUploadInProgress;
+extern bool cameraActive;
+
+OtaStaging otaStaging;
+
+static const char *STATE_NAMES[] = {
+  "empty", "uploading", "verifying", "ready", "invalid", "flashing", "rebooting", "failed"
+};
+
+OtaStaging::OtaStaging()
+  : currentState(STAGE_EMPTY), stagedSize(0), totalSize(0),
+    flashedBytes(0), decodedBytes(0), imageFormat(OTA_FORMAT_UNKNOWN), flashDurationMs(0),
+    imageBytes(0) {
+  memset(&verifyResult, 0, sizeof(verifyResult));
+}
+
+bool OtaStaging::begin() {
+  if (!SD_MMC.exists(OTA_STAGING_DIR)) {
+    SD_MMC.mkdir(OTA_STAGING_DIR);
+  }
+
+  File image = SD_MMC.open(OTA_STAGED_IMAGE, FILE_READ);
+  if (!image) {
+    currentState = STAGE_EMPTY;
+    return true;
+  }
+  stagedSize = image.size();
+  uint8_t magic[4] = {0};
+  imageFormat = OtaDecoder::detect(magic, image.read(magic, sizeof(magic)));
+  image.close();
+
+  File meta = SD_MMC.open(OTA_STAGED_META, FILE_READ);
+  if (meta) {
+    JsonDocument doc;
+    if (!deserializeJson(doc, meta)) {
+      totalSize = doc["total"] | 0;
+      imageMD5 = doc["md5"] | "";
+      imageSHA256 = doc["sha256"] | "";
+      expectedSHA256 = doc["expected_sha256"] | "";
+      imageBytes = doc["image_bytes"] | 0;
+      verifyResult.signature = (OtaSignatureState)(doc["signature"] | 0);
+    }
+    meta.close();
+  }
+
+  bool complete = totalSize > 0 && stagedSize == totalSize;
+  if (complete && imageMD5.length() == 32 && imageSHA256.length() == 64 && imageBytes > 0) {
+    currentState = STAGE_READY;
+  } else if (complete) {
+    startVerify();  // upload finished but the verify pass did not
+  } else {
+    currentState = STAGE_UPLOADING;  // partial image, waiting to be resumed
+  }
+
+  LOGI(TAG_OTA, "Staged image: %u of %u bytes (%s)", stagedSize, totalSize, STATE_NAMES[currentState]);
+  return true;
+}
+
+bool OtaStaging::beginSlice(size_t offset, size_t total, const String &sha256, String &error) {
+  if (flashing() || currentState == STAGE_VERIFYING) {
+    error = "Staged image is busy";
+    return false;
+  }
+  if (total == 0 || total > OTA_MAX_IMAGE_SIZE) {
+    error = "Invalid image size";
+    return false;
+  }
+  if (offset != 0 && (offset != stagedSize || total != totalSize)) {
+    error = "Offset does not match staged image";
+    return false;
+  }
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    error = "SD card busy";
+    return false;
+  }
+
+  if (offset == 0) {
+    SD_MMC.remove(OTA_STAGED_IMAGE);
+    stagedSize = 0;
+    totalSize = total;
+    imageMD5 = "";
+    imageSHA256 = "";
+    expectedSHA256 = sha256;
+    imageBytes = 0;
+    memset(&verifyResult, 0, sizeof(verifyResult));
+    saveMeta();
+  }
+  uploadFile = SD_MMC.open(OTA_STAGED_IMAGE, FILE_APPEND);
+  xSemaphoreGive(sdCardMutex);
+
+  if (!uploadFile) {
+    error = "Failed to open staged image";
+    return false;
+  }
+
+  currentState = STAGE_UPLOADING;
+  lastError = "";
+  LOGI(TAG_OTA, "Staging slice at offset %u of %u", offset, total);
+  return true;
+}
+
+bool OtaStaging::writeSlice(const uint8_t *data, size_t len, String &error) {
+  if (!uploadFile) {
+    error = "No staged upload in progress";
+    return false;
+  }
+  if (stagedSize + len > totalSize) {
+    error = "Slice exceeds declared image size";
+    return false;
+  }
+  if (stagedSize == 0 && len > 0) {
+    imageFormat = OtaDecoder::detect(data, len);
+    if (imageFormat == OTA_FORMAT_UNKNOWN) {
+      error = "Invalid firmware file (not an ESP32, gzip, heatshrink or delta image)";
+      return false;
+    }
+  }
+
+  // Short per-chunk hold so the file manager keeps working during the upload
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    error = "SD card busy";
+    return false;
+  }
+  size_t written = uploadFile.write(data, len);
+  xSemaphoreGive(sdCardMutex);
+
+  stagedSize += written;
+  if (written != len) {
+    error = "Failed to write staged image";
+    return false;
+  }
+  return true;
+}
+
+void OtaStaging::endSlice() {
+  if (uploadFile) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+      uploadFile.close();
+      xSemaphoreGive(sdCardMutex);
+    }
+  }
+
+  if (totalSize > 0 && stagedSize == totalSize && currentState == STAGE_UPLOADING) {
+    startVerify();
+  }
+}
+
+bool OtaStaging::startVerify() {
+  currentState = STAGE_VERIFYING;
+  if (xTaskCreate(verifyTaskEntry, "ota_verify", 6144, this, 1, NULL) != pdPASS) {
+    fail(STAGE_INVALID, "Failed to start verification task");
+    return false;
+  }
+  return true;
+}
+
+bool OtaStaging::startFlash(String &error) {
+  if (currentState != STAGE_READY) {
+    error = String("Staged image is not ready (") + STATE_NAMES[currentState] + ")";
+    return false;
+  }
+
+  currentState = STAGE_FLASHING;
+  flashedBytes = 0;
+  decodedBytes = 0;
+  lastError = "";
+  if (xTaskCreatePinnedToCore(flashTaskEntry, "ota_flash", 8192, this, 2, NULL, 0) != pdPASS) {
+    currentState = STAGE_READY;
+    error = "Failed to start flash task";
+    return false;
+  }
+  return true;
+}
+
+bool OtaStaging::clear(String &error) {
+  if (flashing() || currentState == STAGE_VERIFYING) {
+    error = "Staged image is busy";
+    return false;
+  }
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    error = "SD card busy";
+    return false;
+  }
+  if (uploadFile) uploadFile.close();
+  SD_MMC.remove(OTA_STAGED_IMAGE);
+  SD_MMC.remove(OTA_STAGED_META);
+  xSemaphoreGive(sdCardMutex);
+
+  stagedSize = 0;
+  totalSize = 0;
+  imageMD5 = "";
+  imageSHA256 = "";
+  expectedSHA256 = "";
+  imageBytes = 0;
+  memset(&verifyResult, 0, sizeof(verifyResult));
+  imageFormat = OTA_FORMAT_UNKNOWN;
+  lastError = "";
+  currentState = STAGE_EMPTY;
+  return true;
+}
+
+void OtaStaging::verifyTaskEntry(void *param) {
+  ((OtaStaging *)param)->verifyImage();
+  vTaskDelete(NULL);
+}
+
+void OtaStaging::flashTaskEntry(void *param) {
+  ((OtaStaging *)param)->flashImage();
+  vTaskDelete(NULL);
+}
+
+/**
+ * Hash the complete image from SD in one pass: SHA-256 and signature through
+ * OtaVerifier, and the MD5 of the bytes it passes on (signature trailer
+ * removed). For raw images the MD5 is handed to Update.setMD5() at flash time
+ * so the written partition is checked against the staged file; encoded images
+ * are checked by their own CRC-32s.
+ */
+void OtaStaging::verifyImage() {
+  uint8_t *block = (uint8_t *)heap_caps_malloc(OTA_FLASH_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!block) {
+    fail(STAGE_INVALID, "Out of memory");
+    return;
+  }
+
+  MD5Builder md5;
+  md5.begin();
+  OtaVerifier verifier;
+  if (!verifier.begin(hashVerified, &md5, expectedSHA256.c_str())) {
+    free(block);
+    fail(STAGE_INVALID, verifier.error());
+    return;
+  }
+  size_t hashed = 0;
+  bool headerOk = false;
+
+  while (hashed < stagedSize) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(5000)) != pdTRUE) {
+      break;
+    }
+    File image = SD_MMC.open(OTA_STAGED_IMAGE, FILE_READ);
+    size_t got = 0;
+    if (image && image.seek(hashed)) {
+      got = image.read(block, OTA_FLASH_BLOCK_SIZE);
+    }
+    if (image) image.close();
+    xSemaphoreGive(sdCardMutex);
+
+    if (got == 0) break;
+    if (hashed == 0) {
+      imageFormat = OtaDecoder::detect(block, got);
+      headerOk = imageFormat != OTA_FORMAT_UNKNOWN;
+    }
+    verifier.write(block, got);
+    hashed += got;
+    vTaskDelay(1);
+  }
+  free(block);
+
+  if (hashed != stagedSize) {
+    fail(STAGE_INVALID, "Failed to read staged image");
+    return;
+  }
+  if (!headerOk) {
+    fail(STAGE_INVALID, "Invalid ESP32 firmware file (magic byte check failed)");
+    return;
+  }
+
+  bool verified = verifier.finish();
+  verifyResult = verifier.result();
+  if (!verified) {
+    fail(STAGE_INVALID, verifier.error());
+    return;
+  }
+
+  md5.calculate();
+  imageMD5 = md5.toString();
+  imageSHA256 = verifyResult.sha256;
+  imageBytes = verifyResult.bytes;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(5000)) == pdTRUE) {
+    saveMeta();
+    xSemaphoreGive(sdCardMutex);
+  }
+  currentState = STAGE_READY;
+  LOGI(TAG_OTA, "Staged image verified (%s, signature %s)", OtaDecoder::formatName(imageFormat),
+       OtaVerifier::signatureName(verifyResult.signature));
+  const char *digest = imageSHA256.c_str();
+  LOGI(TAG_OTA, "SHA-256 %08x%08x%08x%08x", OtaVerifier::digestWord(digest, 0), OtaVerifier::digestWord(digest, 1),
+       OtaVerifier::digestWord(digest, 2), OtaVerifier::digestWord(digest, 3));
+  LOGI(TAG_OTA, "        %08x%08x%08x%08x", OtaVerifier::digestWord(digest, 4), OtaVerifier::digestWord(digest, 5),
+       OtaVerifier::digestWord(digest, 6), OtaVerifier::digestWord(digest, 7));
+  LOGI(TAG_OTA, "Verify pass hashed %u bytes at %u KB/s", verifyResult.bytes, verifyResult.hashKBps);
+  eventLog.recordText(EVENT_OTA, 1, (String("Staged image verified, sha256 ") + imageSHA256).c_str());
+}
+
+bool OtaStaging::hashVerified(void *ctx, const uint8_t *data, size_t len) {
+  ((MD5Builder *)ctx)->add((uint8_t *)data, len);
+  return true;
+}
+
+bool OtaStaging::writeDecoded(void *ctx, const uint8_t *data, size_t len) {
+  OtaStaging *self = (OtaStaging *)ctx;
+  if (Update.write((uint8_t *)data, len) != len) return false;
+  self->decodedBytes += len;
+  return true;
+}
+
+void OtaStaging::flashImage() {
+  uint8_t *block = (uint8_t *)heap_caps_malloc(OTA_FLASH_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!block) {
+    fail(STAGE_FAILED, "Out of memory");
+    currentState = STAGE_READY;
+    return;
+  }
+
+  // The downtime window starts here: pause the camera and block file access.
+  // A camera that failed at boot stays off when the flash fails
+  bool cameraWasActive = cameraActive;
+  cameraActive = false;
+  otaUploadInProgress = true;
+  unsigned long start = millis();
+  LOGI(TAG_OTA, "Flashing staged image (%u bytes)", stagedSize);
+
+  // Raw images have a known size and MD5; encoded ones are sized by the decoder
+  bool raw = imageFormat == OTA_FORMAT_RAW;
+  bool ok = Update.begin(raw ? imageBytes : UPDATE_SIZE_UNKNOWN, U_FLASH);
+  if (ok && raw) {
+    Update.setMD5(imageMD5.c_str());
+  }
+
+  OtaDecoder decoder;
+  decoder.begin(writeDecoded, this, OtaDecoder::readRunningFirmware, NULL);
+
+  // Re-hashed while flashing (overlapped with the writes) and pinned to the
+  // verify-pass digest, so a staged file changed since then never boots
+  OtaVerifier verifier;
+  ok = ok && verifier.begin(OtaDecoder::writeTo, &decoder, imageSHA256.c_str());
+
+  File image;
+  if (ok && xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(10000)) == pdTRUE) {
+    image = SD_MMC.open(OTA_STAGED_IMAGE, FILE_READ);
+    while (image && flashedBytes < stagedSize) {
+      size_t got = image.read(block, OTA_FLASH_BLOCK_SIZE);
+      if (got == 0 || !verifier.write(block, got)) {
+        ok = false;
+        break;
+      }
+      flashedBytes += got;
+      vTaskDelay(1);
+    }
+    if (image) image.close();
+    xSemaphoreGive(sdCardMutex);
+  } else {
+    ok = false;
+  }
+  free(block);
+
+  // Both checks must pass before Update.end() switches the boot partition
+  bool decoded = ok && flashedBytes == stagedSize && verifier.finish() && decoder.finish();
+  ok = decoded && Update.end(true);
+  flashDurationMs = millis() - start;
+  if (verifier.result().signature != OTA_SIG_PENDING) verifyResult = verifier.result();
+
+  if (!ok) {
+    const char *reason = decoder.error() ? decoder.error() : verifier.error() ? verifier.error() : Update.errorString();
+    String error = String("Flash failed: ") + reason;
+    Update.abort();
+    otaUploadInProgress = false;
+    cameraActive = cameraWasActive;
+    lastError = error;
+    currentState = STAGE_READY;  // image is still intact on SD and can be retried
+    LOGE_S(TAG_OTA, "%s", error.c_str());
+    eventLog.recordText(EVENT_OTA, 0, error.c_str());
+    return;
+  }
+
+  currentState = STAGE_REBOOTING;
+  LOGI(TAG_OTA, "Staged image flashed in %u ms (%u bytes decoded) - rebooting", flashDurationMs, decodedBytes);
+  eventLog.recordText(EVENT_OTA, 1, "Staged image flashed - rebooting");
+  vTaskDelay(pdMS_TO_TICKS(1000));  // let status polls see the final state
+  ESP.restart();
+}
+
+// Caller holds sdCardMutex
+void OtaStaging::saveMeta() {
+  File meta = SD_MMC.open(OTA_STAGED_META, FILE_WRITE);
+  if (!meta) return;
+  JsonDocument doc;
+  doc["total"] = totalSize;
+  doc["md5"] = imageMD5;
+  doc["sha256"] = imageSHA256;
+  doc["expected_sha256"] = expectedSHA256;
+  doc["image_bytes"] = imageBytes;
+  doc["signature"] = (int)verifyResult.signature;
+  serializeJson(doc, meta);
+  meta.close();
+}
+
+void OtaStaging::fail(StagedState state, const char *error) {
+  lastError = error;
+  currentState = state;
+  LOGE(TAG_OTA, "Staged OTA: %s", error);
+  eventLog.recordText(EVENT_OTA, 0, error);
+}
+
+void OtaStaging::reportStatus(JsonObject out) const {
+  out["state"] = STATE_NAMES[currentState];
+  out["staged_bytes"] = stagedSize;
+  out["total_bytes"] = totalSize;
+  out["md5"] = imageMD5;
+  out["format"] = OtaDecoder::formatName(imageFormat);
+  if (imageSHA256.length()) out["sha256"] = imageSHA256;
+  if (verifyResult.signature != OTA_SIG_PENDING) {
+    out["signature"] = OtaVerifier::signatureName(verifyResult.signature);
+  }
+  if (verifyResult.hashMicros) {
+    out["hash_bytes"] = verifyResult.bytes;
+    out["hash_ms"] = verifyResult.hashMicros / 1000;
+    out["hash_kbps"] = verifyResult.hashKBps;
+    out["hash_stall_ms"] = verifyResult.stallMicros / 1000;
+  }
+  out["ready"] = currentState == STAGE_READY;
+  if (currentState == STAGE_FLASHING || currentState == STAGE_REBOOTING) {
+    out["flashed_bytes"] = flashedBytes;
+    out["flash_percent"] = stagedSize ? (float)flashedBytes * 100 / stagedSize : 0;
+    out["decoded_bytes"] = decodedBytes;
+  }
+  if (flashDurationMs) out["flash_duration_ms"] = flashDurationMs;
+  if (lastError.length()) out["error"] = lastError;
+}
@@ -0,0 +1,98 @@
+/**
+ * Staged OTA Updates
+ *
+ * Firmware images are uploaded (resumably, in slices) to the SD card while the
+ * camera and file manager keep running. Once complete the image is verified
+ * in the background, and a flash task copies it to the OTA partition in large
+ * blocks. Service is only interrupted for the flash-and-reboot window, and
+ * the staged image can be re-flashed later without uploading it again.
+ *
+ * The staged file may be a raw, compressed or delta image (see
+ * ota_decoder.h); it is expanded while being copied to the OTA partition.
+ * SHA-256 and signature (ota_verifier.h) are checked in the verify pass and
+ * again, pipelined with the flash writes, before the partition switch.
+ */
+
+#ifndef OTA_STAGING_H
+#define OTA_STAGING_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <SD_MMC.h>
+#include "ota_decoder.h"
+#include "ota_verifier.h"
+
+#define OTA_STAGING_DIR        "/firmware"
+#define OTA_STAGED_IMAGE       "/firmware/staged.bin"
+#define OTA_STAGED_META        "/firmware/staged.json"
+#define OTA_FLASH_BLOCK_SIZE   (32 * 1024)
+#define OTA_MAX_IMAGE_SIZE     (0x1E0000)   // app slot size in min_spiffs.csv
+
+enum StagedState : uint8_t {
+  STAGE_EMPTY = 0,
+  STAGE_UPLOADING,
+  STAGE_VERIFYING,
+  STAGE_READY,
+  STAGE_INVALID,
+  STAGE_FLASHING,
+  STAGE_REBOOTING,
+  STAGE_FAILED
+};
+
+class OtaStaging {
+public:
+  OtaStaging();
+
+  // Restores the staged image state from the SD card
+  bool begin();
+
+  // Upload slice handling (called from the async upload callbacks).
+  // offset must match the bytes already staged, so an interrupted upload
+  // resumes from stagedBytes() instead of starting over. sha256 (first slice
+  // only, optional) pins the image digest.
+  bool beginSlice(size_t offset, size_t total, const String &sha256, String &error);
+  bool writeSlice(const uint8_t *data, size_t len, String &error);
+  void endSlice();
+
+  // Starts the background flash task for a verified image
+  bool startFlash(String &error);
+
+  // Discards the staged image
+  bool clear(String &error);
+
+  size_t stagedBytes() const { return stagedSize; }
+  StagedState state() const { return currentState; }
+  bool flashing() const { return currentState == STAGE_FLASHING || currentState == STAGE_REBOOTING; }
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  volatile StagedState currentState;
+  size_t stagedSize;
+  size_t totalSize;
+  size_t flashedBytes;
+  size_t decodedBytes;
+  OtaImageFormat imageFormat;
+  uint32_t flashDurationMs;
+  String imageMD5;
+  String imageSHA256;
+  String expectedSHA256;
+  size_t imageBytes;             // staged bytes without the signature trailer
+  OtaVerifyResult verifyResult;  // from the last verify or flash pass
+  String lastError;
+  File uploadFile;
+
+  static void verifyTaskEntry(void *param);
+  static void flashTaskEntry(void *param);
+  void verifyImage();
+  void flashImage();
+  bool startVerify();
+  static bool hashVerified(void *ctx, const uint8_t *data, size_t len);
+  static bool writeDecoded(void *ctx, const uint8_t *data, size_t len);
+  void saveMeta();
+  void fail(StagedState state, const char *error);
+};
+
+extern OtaStaging otaStaging;
+
+#endif // OTA_STAGING_H
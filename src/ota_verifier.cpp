@@ -0,0 +1,465 @@
+/**
+ * Streaming OTA Image Verification Implementation
+ */
+
+#include "ota_verifier.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#else
+#include <chrono>
+#endif
+
+// SHA-256 uses mbedTLS (hardware accelerated on the ESP32) when available
+#if __has_include(<mbedtls/sha256.h>)
+#include <mbedtls/sha256.h>
+#define OTA_VERIFIER_MBEDTLS_SHA 1
+#else
+#define OTA_VERIFIER_MBEDTLS_SHA 0
+#endif
+
+// Signatures use mbedTLS on the device and libcrypto on a host (test/host)
+#if __has_include(<mbedtls/pk.h>)
+#include <mbedtls/pk.h>
+#define OTA_VERIFIER_HAS_PK 1
+#define OTA_VERIFIER_OPENSSL_PK 0
+#elif !defined(ESP_PLATFORM) && __has_include(<openssl/evp.h>)
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#define OTA_VERIFIER_HAS_PK 0
+#define OTA_VERIFIER_OPENSSL_PK 1
+#else
+#define OTA_VERIFIER_HAS_PK 0
+#define OTA_VERIFIER_OPENSSL_PK 0
+#endif
+
+static uint64_t nowMicros() {
+#ifdef ESP_PLATFORM
+  return esp_timer_get_time();
+#else
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// SHA-256 backend
+
+#if OTA_VERIFIER_MBEDTLS_SHA
+
+typedef mbedtls_sha256_context Sha256Context;
+
+static void sha256Start(Sha256Context *ctx) {
+  mbedtls_sha256_init(ctx);
+  mbedtls_sha256_starts(ctx, 0);
+}
+
+static void sha256Update(Sha256Context *ctx, const uint8_t *data, size_t len) {
+  mbedtls_sha256_update(ctx, data, len);
+}
+
+static void sha256Finish(Sha256Context *ctx, uint8_t digest[32]) {
+  mbedtls_sha256_finish(ctx, digest);
+  mbedtls_sha256_free(ctx);
+}
+
+#else
+
+// Portable FIPS 180-4 implementation for host builds
+struct Sha256Context {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  size_t blockLen;
+};
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, uint8_t n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256Block(Sha256Context *ctx, const uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+           ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+  uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+  ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256Start(Sha256Context *ctx) {
+  static const uint32_t init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->length = 0;
+  ctx->blockLen = 0;
+}
+
+static void sha256Update(Sha256Context *ctx, const uint8_t *data, size_t len) {
+  ctx->length += len;
+  if (ctx->blockLen > 0) {
+    size_t n = 64 - ctx->blockLen < len ? 64 - ctx->blockLen : len;
+    memcpy(ctx->block + ctx->blockLen, data, n);
+    ctx->blockLen += n;
+    data += n;
+    len -= n;
+    if (ctx->blockLen < 64) return;
+    sha256Block(ctx, ctx->block);
+    ctx->blockLen = 0;
+  }
+  for (; len >= 64; data += 64, len -= 64) {
+    sha256Block(ctx, data);
+  }
+  memcpy(ctx->block, data, len);
+  ctx->blockLen = len;
+}
+
+static void sha256Finish(Sha256Context *ctx, uint8_t digest[32]) {
+  uint64_t bits = ctx->length * 8;
+  uint8_t pad = 0x80;
+  sha256Update(ctx, &pad, 1);
+  pad = 0;
+  while (ctx->blockLen != 56) {
+    sha256Update(ctx, &pad, 1);
+  }
+  uint8_t lengthBytes[8];
+  for (int i = 0; i < 8; i++) {
+    lengthBytes[i] = (uint8_t)(bits >> (56 - i * 8));
+  }
+  sha256Update(ctx, lengthBytes, 8);
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+  }
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+
+#ifdef ESP_PLATFORM
+struct HashBlockMsg {
+  uint8_t index;
+  uint16_t len;   // 0 stops the worker
+};
+static const uint8_t WORKER_EXITED = 0xFF;
+#endif
+
+OtaVerifier::OtaVerifier()
+  : sink(NULL), sinkCtx(NULL), errorMessage(NULL), tailLen(0), hashContext(NULL),
+    fillLen(0), fillIndex(0), pipelined(false), readyQueue(NULL), freeQueue(NULL), worker(NULL) {
+  buffers[0] = buffers[1] = NULL;
+  expected[0] = '\0';
+  memset(&verifyResult, 0, sizeof(verifyResult));
+}
+
+OtaVerifier::~OtaVerifier() {
+  end();
+}
+
+const char *OtaVerifier::signatureName(OtaSignatureState state) {
+  switch (state) {
+    case OTA_SIG_NOT_REQUIRED: return "not_required";
+    case OTA_SIG_UNCHECKED: return "unchecked";
+    case OTA_SIG_VALID: return "valid";
+    case OTA_SIG_MISSING: return "missing";
+    case OTA_SIG_INVALID: return "invalid";
+    default: return "pending";
+  }
+}
+
+uint32_t OtaVerifier::digestWord(const char *sha256, uint8_t index) {
+  char word[9];
+  if (strlen(sha256) < (size_t)(index + 1) * 8) return 0;
+  memcpy(word, sha256 + index * 8, 8);
+  word[8] = '\0';
+  return (uint32_t)strtoul(word, NULL, 16);
+}
+
+bool OtaVerifier::begin(SinkFn sinkFn, void *sinkContext, const char *expectedSha256) {
+  end();
+  sink = sinkFn;
+  sinkCtx = sinkContext;
+  errorMessage = NULL;
+  tailLen = 0;
+  memset(&verifyResult, 0, sizeof(verifyResult));
+
+  expected[0] = '\0';
+  if (expectedSha256 && expectedSha256[0]) {
+    if (strlen(expectedSha256) != 64) return fail("Expected SHA-256 must be 64 hex characters");
+    for (int i = 0; i < 64; i++) {
+      expected[i] = tolower((unsigned char)expectedSha256[i]);
+    }
+    expected[64] = '\0';
+  }
+
+  hashContext = malloc(sizeof(Sha256Context));
+  if (!hashContext) return fail("Out of memory");
+  sha256Start((Sha256Context *)hashContext);
+
+  pipelined = startPipeline();
+  return true;
+}
+
+void OtaVerifier::end() {
+  stopPipeline();
+  free(hashContext);
+  hashContext = NULL;
+}
+
+bool OtaVerifier::fail(const char *message) {
+  if (!errorMessage) errorMessage = message;
+  return false;
+}
+
+void OtaVerifier::hashBlock(const uint8_t *data, size_t len) {
+  uint64_t start = nowMicros();
+  sha256Update((Sha256Context *)hashContext, data, len);
+  verifyResult.hashMicros += (uint32_t)(nowMicros() - start);
+}
+
+/**
+ * The worker runs on the other core so hashing overlaps with the caller's
+ * flash writes. Falls back to inline hashing if anything can't be allocated.
+ */
+bool OtaVerifier::startPipeline() {
+#ifdef ESP_PLATFORM
+  for (int i = 0; i < 2; i++) {
+    buffers[i] = (uint8_t *)heap_caps_malloc(OTA_VERIFY_BUFFER, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!buffers[i]) buffers[i] = (uint8_t *)heap_caps_malloc(OTA_VERIFY_BUFFER, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  readyQueue = xQueueCreate(2, sizeof(HashBlockMsg));
+  freeQueue = xQueueCreate(3, sizeof(uint8_t));
+  if (!buffers[0] || !buffers[1] || !readyQueue || !freeQueue) {
+    stopPipeline();
+    return false;
+  }
+
+  uint8_t index = 1;
+  xQueueSend((QueueHandle_t)freeQueue, &index, 0);
+  fillIndex = 0;
+  fillLen = 0;
+
+  BaseType_t core = xPortGetCoreID() == 0 ? 1 : 0;
+  if (xTaskCreatePinnedToCore(workerEntry, "ota_hash", 4096, this, 2, (TaskHandle_t *)&worker, core) != pdPASS) {
+    worker = NULL;
+    stopPipeline();
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void OtaVerifier::stopPipeline() {
+#ifdef ESP_PLATFORM
+  if (worker) {
+    HashBlockMsg stop = {0, 0};
+    xQueueSend((QueueHandle_t)readyQueue, &stop, portMAX_DELAY);
+    uint8_t index = 0;
+    do {
+      xQueueReceive((QueueHandle_t)freeQueue, &index, portMAX_DELAY);
+    } while (index != WORKER_EXITED);
+    worker = NULL;
+  }
+  if (readyQueue) vQueueDelete((QueueHandle_t)readyQueue);
+  if (freeQueue) vQueueDelete((QueueHandle_t)freeQueue);
+  readyQueue = NULL;
+  freeQueue = NULL;
+  for (int i = 0; i < 2; i++) {
+    free(buffers[i]);
+    buffers[i] = NULL;
+  }
+#endif
+  pipelined = false;
+}
+
+void OtaVerifier::workerEntry(void *param) {
+#ifdef ESP_PLATFORM
+  OtaVerifier *self = (OtaVerifier *)param;
+  HashBlockMsg msg;
+  for (;;) {
+    xQueueReceive((QueueHandle_t)self->readyQueue, &msg, portMAX_DELAY);
+    if (msg.len == 0) break;
+    self->hashBlock(self->buffers[msg.index], msg.len);
+    xQueueSend((QueueHandle_t)self->freeQueue, &msg.index, portMAX_DELAY);
+  }
+  uint8_t exited = WORKER_EXITED;
+  xQueueSend((QueueHandle_t)self->freeQueue, &exited, portMAX_DELAY);
+  vTaskDelete(NULL);
+#else
+  (void)param;
+#endif
+}
+
+// Hands the filled buffer to the worker and waits for the other one
+bool OtaVerifier::submit() {
+#ifdef ESP_PLATFORM
+  if (fillLen == 0) return true;
+  HashBlockMsg msg = {fillIndex, (uint16_t)fillLen};
+  xQueueSend((QueueHandle_t)readyQueue, &msg, portMAX_DELAY);
+  uint64_t start = nowMicros();
+  xQueueReceive((QueueHandle_t)freeQueue, &fillIndex, portMAX_DELAY);
+  verifyResult.stallMicros += (uint32_t)(nowMicros() - start);
+  fillLen = 0;
+#endif
+  return true;
+}
+
+bool OtaVerifier::emit(const uint8_t *data, size_t len) {
+  if (len == 0) return true;
+  verifyResult.bytes += len;
+
+  if (pipelined) {
+    size_t offset = 0;
+    while (offset < len) {
+      size_t n = OTA_VERIFY_BUFFER - fillLen;
+      if (n > len - offset) n = len - offset;
+      memcpy(buffers[fillIndex] + fillLen, data + offset, n);
+      fillLen += n;
+      offset += n;
+      if (fillLen == OTA_VERIFY_BUFFER) submit();
+    }
+  } else {
+    hashBlock(data, len);
+  }
+
+  if (sink && !sink(sinkCtx, data, len)) return fail("Failed to write firmware data to flash");
+  return true;
+}
+
+/**
+ * Everything but the last OTA_TRAILER_MAX bytes goes downstream right away;
+ * the tail is held until finish() knows whether it is a signature trailer.
+ */
+bool OtaVerifier::write(const uint8_t *data, size_t len) {
+  if (errorMessage) return false;
+
+  if (tailLen + len > OTA_TRAILER_MAX) {
+    size_t excess = tailLen + len - OTA_TRAILER_MAX;
+    size_t fromTail = excess < tailLen ? excess : tailLen;
+    if (!emit(tail, fromTail)) return false;
+    memmove(tail, tail + fromTail, tailLen - fromTail);
+    tailLen -= fromTail;
+    excess -= fromTail;
+
+    if (!emit(data, excess)) return false;
+    data += excess;
+    len -= excess;
+  }
+  memcpy(tail + tailLen, data, len);
+  tailLen += len;
+  return true;
+}
+
+bool OtaVerifier::checkSignature(const uint8_t *digest, const uint8_t *signature, size_t len) {
+#if OTA_VERIFIER_HAS_PK
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  const char *key = OTA_SIGNING_PUBLIC_KEY;
+  int rc = mbedtls_pk_parse_public_key(&pk, (const unsigned char *)key, strlen(key) + 1);
+  if (rc == 0) {
+    rc = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, 32, signature, len);
+  }
+  mbedtls_pk_free(&pk);
+  return rc == 0;
+#elif OTA_VERIFIER_OPENSSL_PK
+  BIO *bio = BIO_new_mem_buf(OTA_SIGNING_PUBLIC_KEY, -1);
+  EVP_PKEY *pkey = bio ? PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL) : NULL;
+  EVP_PKEY_CTX *ctx = pkey ? EVP_PKEY_CTX_new(pkey, NULL) : NULL;
+  bool ok = ctx && EVP_PKEY_verify_init(ctx) == 1 && EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 &&
+            EVP_PKEY_verify(ctx, signature, len, digest, 32) == 1;
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(pkey);
+  BIO_free(bio);
+  return ok;
+#else
+  (void)digest; (void)signature; (void)len;
+  return false;
+#endif
+}
+
+bool OtaVerifier::finish() {
+  if (errorMessage) return false;
+
+  // Split off the signature trailer, if any
+  const uint8_t *signature = NULL;
+  size_t signatureLen = 0;
+  size_t payload = tailLen;
+  if (tailLen >= 6 && memcmp(tail + tailLen - 4, OTA_SIGNATURE_MAGIC, 4) == 0) {
+    size_t n = tail[tailLen - 6] | ((size_t)tail[tailLen - 5] << 8);
+    if (n > 0 && n <= OTA_SIGNATURE_MAX && n + 6 <= tailLen) {
+      signature = tail + tailLen - 6 - n;
+      signatureLen = n;
+      payload = tailLen - 6 - n;
+    }
+  }
+  if (!emit(tail, payload)) return false;
+  tailLen = 0;
+
+  if (pipelined) {
+    submit();
+    stopPipeline();
+  }
+
+  uint8_t digest[32];
+  sha256Finish((Sha256Context *)hashContext, digest);
+  free(hashContext);
+  hashContext = NULL;
+  for (int i = 0; i < 32; i++) {
+    snprintf(verifyResult.sha256 + i * 2, 3, "%02x", digest[i]);
+  }
+  if (verifyResult.hashMicros > 0) {
+    verifyResult.hashKBps = (uint32_t)((uint64_t)verifyResult.bytes * 1000000 / verifyResult.hashMicros / 1024);
+  }
+
+  if (!signature) {
+    verifyResult.signature = signingRequired() ? OTA_SIG_MISSING : OTA_SIG_NOT_REQUIRED;
+  } else if (!signingRequired()) {
+    verifyResult.signature = OTA_SIG_UNCHECKED;
+  } else {
+    verifyResult.signature = checkSignature(digest, signature, signatureLen) ? OTA_SIG_VALID : OTA_SIG_INVALID;
+  }
+
+  if (expected[0] && strcmp(expected, verifyResult.sha256) != 0) return fail("SHA-256 mismatch");
+  if (verifyResult.signature == OTA_SIG_MISSING) return fail("Unsigned image rejected (signing key configured)");
+  if (verifyResult.signature == OTA_SIG_INVALID) return fail("Invalid image signature");
+  return true;
+}
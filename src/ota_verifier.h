@@ -0,0 +1,113 @@
+/**
+ * Streaming OTA Image Verification
+ *
+ * Hashes the uploaded image (SHA-256) chunk by chunk and checks an optional
+ * detached signature, so a corrupted, truncated or untrusted image is rejected
+ * before Update.end() switches the boot partition.
+ *
+ * On the device, hashing runs in a worker task fed through two ping-pong
+ * buffers: while the worker hashes one buffer the caller fills the other and
+ * keeps writing to flash, so verification adds no extra pass over the image.
+ * On a host build the same code hashes synchronously.
+ *
+ * Signed images carry a trailer after the image bytes:
+ *   [signature (DER, up to OTA_SIGNATURE_MAX bytes)][u16 LE length]["OSIG"]
+ * The trailer is held back from the sink and the signature covers every byte
+ * before it (the file exactly as built by tools/ota_image.py, compressed or
+ * not). When a public key is configured, unsigned images are rejected.
+ */
+
+#ifndef OTA_VERIFIER_H
+#define OTA_VERIFIER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Optional PEM public key (ECDSA P-256 or RSA) in ota_signing_key.h as
+// OTA_SIGNING_PUBLIC_KEY: one string literal per PEM line ("...\n"), joined
+// with line continuations (README); a multi-line raw string does not work
+// inside a #define
+#if __has_include("ota_signing_key.h")
+#include "ota_signing_key.h"
+#endif
+#ifndef OTA_SIGNING_PUBLIC_KEY
+#define OTA_SIGNING_PUBLIC_KEY ""
+#endif
+
+#define OTA_SIGNATURE_MAGIC   "OSIG"
+#define OTA_SIGNATURE_MAX     512
+#define OTA_TRAILER_MAX       (OTA_SIGNATURE_MAX + 6)
+#define OTA_VERIFY_BUFFER     (8 * 1024)
+
+enum OtaSignatureState : uint8_t {
+  OTA_SIG_PENDING = 0,
+  OTA_SIG_NOT_REQUIRED,  // no key configured and image unsigned
+  OTA_SIG_UNCHECKED,     // image signed but no key configured
+  OTA_SIG_VALID,
+  OTA_SIG_MISSING,       // key configured, image unsigned
+  OTA_SIG_INVALID
+};
+
+struct OtaVerifyResult {
+  char sha256[65];            // hex digest of the image bytes (without trailer)
+  OtaSignatureState signature;
+  uint32_t bytes;
+  uint32_t hashMicros;        // time spent inside the hash function
+  uint32_t hashKBps;          // hash throughput
+  uint32_t stallMicros;       // time the writer waited for a free buffer
+};
+
+class OtaVerifier {
+public:
+  // Receives image bytes (trailer removed); return false to abort
+  typedef bool (*SinkFn)(void *ctx, const uint8_t *data, size_t len);
+
+  OtaVerifier();
+  ~OtaVerifier();
+
+  // expectedSha256 is an optional 64-char hex digest to pin the image to
+  bool begin(SinkFn sink, void *sinkCtx, const char *expectedSha256 = NULL);
+  bool write(const uint8_t *data, size_t len);
+  // Flushes the held-back tail, waits for the hash and checks digest and signature
+  bool finish();
+  void end();
+
+  const OtaVerifyResult &result() const { return verifyResult; }
+  const char *error() const { return errorMessage; }
+
+  static const char *signatureName(OtaSignatureState state);
+  // Word index (0..7) of a hex digest as a number, so the 64 digits can be
+  // logged as %08x arguments instead of a (truncated) dynamic string
+  static uint32_t digestWord(const char *sha256, uint8_t index);
+  static bool signingRequired() { return OTA_SIGNING_PUBLIC_KEY[0] != '\0'; }
+
+private:
+  SinkFn sink;
+  void *sinkCtx;
+  const char *errorMessage;
+  char expected[65];
+  OtaVerifyResult verifyResult;
+
+  uint8_t tail[OTA_TRAILER_MAX];
+  size_t tailLen;
+
+  void *hashContext;
+  uint8_t *buffers[2];
+  size_t fillLen;
+  uint8_t fillIndex;
+  bool pipelined;
+  void *readyQueue;
+  void *freeQueue;
+  void *worker;
+
+  bool fail(const char *message);
+  bool emit(const uint8_t *data, size_t len);
+  bool submit();
+  void hashBlock(const uint8_t *data, size_t len);
+  bool startPipeline();
+  void stopPipeline();
+  bool checkSignature(const uint8_t *digest, const uint8_t *signature, size_t len);
+  static void workerEntry(void *param);
+};
+
+#endif // OTA_VERIFIER_H
@@ -0,0 +1,286 @@
+/**
+ * Pan/Tilt Servos Implementation
+ */
+
+#include "pan_tilt.h"
+#include "detector.h"
+#include "logger.h"
+#include <esp_timer.h>
+
+PanTilt panTilt;
+
+// Upper bounds of the jitter histogram buckets (the last bucket is open)
+static const uint32_t JITTER_LIMITS_US[PAN_TILT_JITTER_BUCKETS - 1] = {50, 200, 1000, 5000};
+static const char *const JITTER_BUCKET_NAMES[PAN_TILT_JITTER_BUCKETS] = {
+  "50", "200", "1000", "5000", "more"
+};
+
+static float tenths(float value) {
+  return roundf(value * 10) / 10;
+}
+
+PanTilt::PanTilt()
+  : timer(NULL), task(NULL), firedUs(0), reconfigure(false), aimRequested(false), aimPan(90), aimTilt(90),
+    attached(false), followedTrack(0), lastFrameId(0), pan(90), tilt(90), periodUs(0), lastWakeUs(0), ticks(0),
+    missedTicks(0), jitterSumUs(0), jitterMaxUs(0), wakeSumUs(0), wakeMaxUs(0), computeMaxUs(0),
+    targetSwitches(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(&config, 0, sizeof(config));
+  memset(&pending, 0, sizeof(pending));
+  memset(jitterBuckets, 0, sizeof(jitterBuckets));
+}
+
+bool PanTilt::begin(const PanTiltSettings &settings) {
+  // The pins are only taken at boot (pan_tilt.*_pin need a restart)
+  config.panPin = settings.panPin;
+  config.tiltPin = settings.tiltPin;
+  configure(settings);
+
+  ledcSetup(PAN_TILT_PAN_CHANNEL, PAN_TILT_PWM_HZ, PAN_TILT_PWM_BITS);
+  ledcSetup(PAN_TILT_TILT_CHANNEL, PAN_TILT_PWM_HZ, PAN_TILT_PWM_BITS);
+
+  // 80 MHz APB / 80: the alarm counts microseconds
+  timer = timerBegin(PAN_TILT_TIMER, 80, true);
+  if (timer == NULL) {
+    LOGW(TAG_CAMERA, "Pan/tilt: hardware timer %d unavailable", PAN_TILT_TIMER);
+    return false;
+  }
+  timerAttachInterrupt(timer, &PanTilt::onTimer, true);
+
+  if (xTaskCreatePinnedToCore(taskEntry, "pan_tilt", PAN_TILT_STACK_SIZE, this, PAN_TILT_PRIORITY, &task,
+                              PAN_TILT_CORE) != pdPASS) {
+    LOGW(TAG_CAMERA, "Pan/tilt: task start failed");
+    return false;
+  }
+  return true;
+}
+
+void PanTilt::configure(const PanTiltSettings &settings) {
+  portENTER_CRITICAL(&lock);
+  pending = settings;
+  reconfigure = true;
+  portEXIT_CRITICAL(&lock);
+}
+
+void PanTilt::aim(float panAngle, float tiltAngle) {
+  portENTER_CRITICAL(&lock);
+  aimPan = panAngle;
+  aimTilt = tiltAngle;
+  aimRequested = true;
+  portEXIT_CRITICAL(&lock);
+}
+
+// ---------------------------------------------------------------------------
+// Control task
+
+void IRAM_ATTR PanTilt::onTimer() {
+  panTilt.firedUs = esp_timer_get_time();
+  BaseType_t woken = pdFALSE;
+  if (panTilt.task) vTaskNotifyGiveFromISR(panTilt.task, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+void PanTilt::taskEntry(void *param) {
+  ((PanTilt *)param)->run();
+}
+
+void PanTilt::run() {
+  for (;;) {
+    if (reconfigure) apply();
+    // One notification per timer alarm; more than one means ticks were missed
+    uint32_t fired = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PAN_TILT_IDLE_MS));
+    if (!config.enabled || fired == 0) continue;
+
+    int64_t now = esp_timer_get_time();
+    recordTiming(now, fired - 1);
+    tick(now);
+  }
+}
+
+// New settings on the task: loop parameters, timer period, outputs
+void PanTilt::apply() {
+  portENTER_CRITICAL(&lock);
+  PanTiltSettings settings = pending;
+  reconfigure = false;
+  portEXIT_CRITICAL(&lock);
+  settings.panPin = config.panPin;
+  settings.tiltPin = config.tiltPin;
+  bool wasEnabled = config.enabled;
+  uint16_t oldRate = config.rateHz;
+  config = settings;
+
+  PanTiltParams params;
+  params.axes[PAN_AXIS].fovDeg = config.hfovDeg;
+  params.axes[PAN_AXIS].direction = config.invertPan ? -1 : 1;
+  params.axes[PAN_AXIS].minAngle = config.panMin;
+  params.axes[PAN_AXIS].maxAngle = config.panMax;
+  params.axes[PAN_AXIS].homeAngle = config.panHome;
+  params.axes[TILT_AXIS].fovDeg = config.vfovDeg;
+  params.axes[TILT_AXIS].direction = config.invertTilt ? -1 : 1;
+  params.axes[TILT_AXIS].minAngle = config.tiltMin;
+  params.axes[TILT_AXIS].maxAngle = config.tiltMax;
+  params.axes[TILT_AXIS].homeAngle = config.tiltHome;
+  params.kp = config.kp / 100.0f;
+  params.ki = config.ki / 100.0f;
+  params.kd = config.kd / 100.0f;
+  params.maxSpeed = config.maxSpeed;
+  params.maxAccel = config.maxAccel;
+  params.accelNoise = config.kalmanAccel;
+  params.measureNoise = config.kalmanNoise / 10.0f;
+  params.servoLagUs = (uint32_t)config.servoLagMs * 1000;
+  params.lostUs = (uint32_t)config.lostMs * 1000;
+  params.homeAfterUs = (uint32_t)config.homeAfterS * 1000000;
+  loop.configure(params);
+
+  if (config.enabled && (!wasEnabled || config.rateHz != oldRate)) {
+    periodUs = 1000000 / config.rateHz;
+    lastWakeUs = 0;
+    ticks = missedTicks = 0;
+    jitterSumUs = wakeSumUs = 0;
+    jitterMaxUs = wakeMaxUs = computeMaxUs = 0;
+    memset(jitterBuckets, 0, sizeof(jitterBuckets));
+    timerAlarmWrite(timer, periodUs, true);
+    timerAlarmEnable(timer);
+  }
+  if (config.enabled && !wasEnabled) {
+    // Start from home: the servos' real position is unknown
+    loop.reset(esp_timer_get_time(), config.panHome, config.tiltHome);
+    pan = loop.angle(PAN_AXIS);
+    tilt = loop.angle(TILT_AXIS);
+    followedTrack = 0;
+    attach(true);
+    LOGI(TAG_CAMERA, "Pan/tilt: %d Hz on GPIO%d/%d", config.rateHz, config.panPin, config.tiltPin);
+  } else if (!config.enabled && wasEnabled) {
+    timerAlarmDisable(timer);
+    attach(false);
+  }
+}
+
+void PanTilt::tick(int64_t nowUs) {
+  uint32_t start = micros();
+  if (aimRequested) {
+    portENTER_CRITICAL(&lock);
+    float restPan = aimPan;
+    float restTilt = aimTilt;
+    aimRequested = false;
+    portEXIT_CRITICAL(&lock);
+    loop.aim(restPan, restTilt);
+  }
+  follow(nowUs);
+  loop.tick(nowUs, pan, tilt);
+  writeServo(PAN_TILT_PAN_CHANNEL, pan);
+  writeServo(PAN_TILT_TILT_CHANNEL, tilt);
+  uint32_t spent = micros() - start;
+  if (spent > computeMaxUs) computeMaxUs = spent;
+}
+
+// Feeds a new detector result for the followed track to the loop. Another
+// track is only taken once the followed one has been lost.
+void PanTilt::follow(int64_t nowUs) {
+  Detection found[DETECTOR_MAX_RESULTS];
+  DetectionFrame frame;
+  uint8_t count = detector.latest(found, DETECTOR_MAX_RESULTS, frame);
+  if (frame.id == lastFrameId || frame.width == 0 || frame.height == 0) return;
+  lastFrameId = frame.id;
+
+  int best = -1;
+  uint32_t bestArea = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    const Detection &d = found[i];
+    if (d.track == 0 || (config.classId >= 0 && d.classId != config.classId)) continue;
+    if (d.track == followedTrack) {
+      best = i;
+      break;
+    }
+    uint32_t area = (uint32_t)d.width * d.height;
+    if (area > bestArea) {
+      bestArea = area;
+      best = i;
+    }
+  }
+  if (best < 0) return;
+
+  const Detection &target = found[best];
+  if (target.track != followedTrack) {
+    if (followedTrack && loop.tracking(nowUs)) return;
+    followedTrack = target.track;
+    targetSwitches++;
+  }
+  float offsetX = (target.x + target.width * 0.5f) / frame.width - 0.5f;
+  float offsetY = (target.y + target.height * 0.5f) / frame.height - 0.5f;
+  loop.measure(frame.capturedUs - (int64_t)config.captureLatencyMs * 1000, offsetX, offsetY);
+}
+
+void PanTilt::attach(bool on) {
+  if (on == attached) return;
+  if (on) {
+    writeServo(PAN_TILT_PAN_CHANNEL, pan);
+    writeServo(PAN_TILT_TILT_CHANNEL, tilt);
+    ledcAttachPin(config.panPin, PAN_TILT_PAN_CHANNEL);
+    ledcAttachPin(config.tiltPin, PAN_TILT_TILT_CHANNEL);
+  } else {
+    ledcDetachPin(config.panPin);
+    ledcDetachPin(config.tiltPin);
+  }
+  attached = on;
+}
+
+void PanTilt::writeServo(uint8_t channel, float angle) {
+  float pulseUs = config.pulseMinUs + angle * (config.pulseMaxUs - config.pulseMinUs) / 180.0f;
+  uint32_t duty = (uint32_t)(pulseUs * ((1u << PAN_TILT_PWM_BITS) - 1) / (1000000 / PAN_TILT_PWM_HZ));
+  ledcWrite(channel, duty);
+}
+
+void PanTilt::recordTiming(int64_t wokeUs, uint32_t missed) {
+  ticks++;
+  missedTicks += missed;
+
+  int64_t fired = firedUs;
+  uint32_t wake = wokeUs > fired ? (uint32_t)(wokeUs - fired) : 0;
+  wakeSumUs += wake;
+  if (wake > wakeMaxUs) wakeMaxUs = wake;
+
+  if (lastWakeUs) {
+    int64_t deviation = (wokeUs - lastWakeUs) - (int64_t)periodUs * (missed + 1);
+    uint32_t jitter = (uint32_t)(deviation < 0 ? -deviation : deviation);
+    jitterSumUs += jitter;
+    if (jitter > jitterMaxUs) jitterMaxUs = jitter;
+    uint8_t bucket = 0;
+    while (bucket < PAN_TILT_JITTER_BUCKETS - 1 && jitter >= JITTER_LIMITS_US[bucket]) bucket++;
+    jitterBuckets[bucket]++;
+  }
+  lastWakeUs = wokeUs;
+}
+
+void PanTilt::reportStatus(JsonObject out) const {
+  out["enabled"] = attached;
+  if (!attached) return;
+  int64_t now = esp_timer_get_time();
+  bool following = loop.tracking(now);
+  out["pan"] = tenths(pan);
+  out["tilt"] = tenths(tilt);
+  out["tracking"] = following;
+  out["track"] = following ? followedTrack : 0;
+  if (following) {
+    JsonObject speed = out["target_speed_dps"].to<JsonObject>();
+    speed["pan"] = tenths(loop.filter(PAN_AXIS).rate());
+    speed["tilt"] = tenths(loop.filter(TILT_AXIS).rate());
+  }
+  out["detections"] = loop.measurements();
+  out["stale_detections"] = loop.staleMeasurements();
+  out["target_switches"] = targetSwitches;
+
+  JsonObject timing = out["loop"].to<JsonObject>();
+  timing["rate_hz"] = config.rateHz;
+  timing["period_us"] = periodUs;
+  timing["ticks"] = ticks;
+  timing["missed"] = missedTicks;
+  uint32_t periods = ticks > 1 ? ticks - 1 : 0;
+  timing["jitter_avg_us"] = periods ? (uint32_t)(jitterSumUs / periods) : 0;
+  timing["jitter_max_us"] = jitterMaxUs;
+  JsonObject buckets = timing["jitter_below_us"].to<JsonObject>();
+  for (uint8_t i = 0; i < PAN_TILT_JITTER_BUCKETS; i++) buckets[JITTER_BUCKET_NAMES[i]] = jitterBuckets[i];
+  timing["wake_avg_us"] = ticks ? (uint32_t)(wakeSumUs / ticks) : 0;
+  timing["wake_max_us"] = wakeMaxUs;
+  timing["compute_max_us"] = computeMaxUs;
+}
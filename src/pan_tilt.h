@@ -0,0 +1,102 @@
+/**
+ * Pan/Tilt Servos
+ *
+ * Two hobby servos on GPIO12/13 (left free by the SD card's 1-bit mode)
+ * that keep the detector's target centred. A hardware timer fires at
+ * pan_tilt.rate_hz and wakes a high-priority task on the app core, so the
+ * servos are driven at a fixed rate however seldom frames and detections
+ * arrive; the control law itself (Kalman prediction over the detection
+ * latency, PID with speed and acceleration limits) is pan_tilt_control.h.
+ *
+ * Each new detector result is stamped with the time the detector got the
+ * frame, less pan_tilt.capture_latency_ms for exposure and transfer. The
+ * task follows one track: the largest of pan_tilt.class_id when it picks
+ * one, then the same track id until it is lost.
+ *
+ * Servo pulses are LEDC channels 2/3 at 50 Hz (timer 1; the camera clock
+ * uses channel 0 on timer 0). The outputs are detached while disabled.
+ *
+ * Loop timing is measured on every tick: the period between wake-ups
+ * against the nominal one (jitter), the timer-to-task latency, ticks
+ * missed while the task was late and the time spent in the control law.
+ * Served at /api/pan_tilt and in /api/health/status.
+ */
+
+#ifndef PAN_TILT_H
+#define PAN_TILT_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config_store.h"
+#include "pan_tilt_control.h"
+
+#define PAN_TILT_STACK_SIZE     3072
+#define PAN_TILT_PRIORITY       5        // above async_tcp and the detector on the same core
+#define PAN_TILT_CORE           1
+#define PAN_TILT_TIMER          1        // hardware timer (0-3)
+#define PAN_TILT_PWM_HZ         50
+#define PAN_TILT_PWM_BITS       16
+#define PAN_TILT_PAN_CHANNEL    2
+#define PAN_TILT_TILT_CHANNEL   3
+#define PAN_TILT_IDLE_MS        1000     // wake-up while disabled
+#define PAN_TILT_JITTER_BUCKETS 5
+
+class PanTilt {
+public:
+  PanTilt();
+
+  bool begin(const PanTiltSettings &settings);
+  // New settings; applied on the task
+  void configure(const PanTiltSettings &settings);
+  // Rest position in degrees, taken while no target is followed
+  void aim(float pan, float tilt);
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  static void IRAM_ATTR onTimer();
+  static void taskEntry(void *param);
+  void run();
+  void apply();
+  void tick(int64_t nowUs);
+  void follow(int64_t nowUs);
+  void attach(bool on);
+  void writeServo(uint8_t channel, float angle);
+  void recordTiming(int64_t wokeUs, uint32_t missed);
+
+  hw_timer_t *timer;
+  TaskHandle_t task;
+  portMUX_TYPE lock;
+  volatile int64_t firedUs;          // set by the timer interrupt
+
+  PanTiltSettings config;            // task only
+  PanTiltSettings pending;
+  volatile bool reconfigure;
+  volatile bool aimRequested;
+  float aimPan;
+  float aimTilt;
+
+  PanTiltLoop loop;
+  bool attached;
+  uint16_t followedTrack;            // 0 = none
+  uint32_t lastFrameId;
+  float pan;                         // commanded, degrees
+  float tilt;
+
+  // Timing (task writes, reportStatus reads)
+  uint32_t periodUs;
+  int64_t lastWakeUs;
+  uint32_t ticks;
+  uint32_t missedTicks;
+  uint64_t jitterSumUs;
+  uint32_t jitterMaxUs;
+  uint32_t jitterBuckets[PAN_TILT_JITTER_BUCKETS];
+  uint64_t wakeSumUs;
+  uint32_t wakeMaxUs;
+  uint32_t computeMaxUs;
+  uint32_t targetSwitches;
+};
+
+extern PanTilt panTilt;
+
+#endif // PAN_TILT_H
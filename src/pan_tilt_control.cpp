@@ -0,0 +1,246 @@
+/**
+ * Pan/Tilt Control Law Implementation
+ */
+
+#include "pan_tilt_control.h"
+#include <math.h>
+#include <string.h>
+
+#define DEG_TO_RAD_F  0.017453293f
+#define RAD_TO_DEG_F  57.29578f
+#define MAX_TICK_S    0.1f        // a longer gap (a stalled task) is not integrated in one step
+#define INTEGRAL_BAND 2.0f        // degrees of error within which the integral grows
+
+static inline float clampf(float value, float low, float high) {
+  return value < low ? low : (value > high ? high : value);
+}
+
+// ---------------------------------------------------------------------------
+// BearingFilter
+
+BearingFilter::BearingFilter()
+  : started(false), timeUs(0), position(0), velocity(0), p00(0), p01(0), p11(0), q(1), r(1) {
+}
+
+void BearingFilter::reset() {
+  started = false;
+  velocity = 0;
+}
+
+void BearingFilter::configure(float accelNoise, float measureNoise) {
+  q = accelNoise * accelNoise;
+  r = measureNoise * measureNoise;
+}
+
+void BearingFilter::update(int64_t at, float bearing, uint32_t restartUs) {
+  if (!started || at - timeUs > (int64_t)restartUs) {
+    started = true;
+    timeUs = at;
+    position = bearing;
+    velocity = 0;
+    p00 = r;
+    p01 = 0;
+    p11 = PAN_TILT_INITIAL_RATE_VAR;
+    return;
+  }
+  if (at < timeUs) return;
+
+  // Predict to the capture time (white acceleration noise)
+  float dt = (float)(at - timeUs) / 1000000.0f;
+  float dt2 = dt * dt;
+  position += velocity * dt;
+  p00 += dt * (2 * p01 + dt * p11) + q * dt2 * dt2 / 4;
+  p01 += dt * p11 + q * dt2 * dt / 2;
+  p11 += q * dt2;
+  timeUs = at;
+
+  // Correct with the measured bearing
+  float s = p00 + r;
+  float k0 = p00 / s;
+  float k1 = p01 / s;
+  float innovation = bearing - position;
+  position += k0 * innovation;
+  velocity += k1 * innovation;
+  p11 -= k1 * p01;
+  p00 *= 1 - k0;
+  p01 *= 1 - k0;
+}
+
+float BearingFilter::predict(int64_t at) const {
+  return position + velocity * ((float)(at - timeUs) / 1000000.0f);
+}
+
+// ---------------------------------------------------------------------------
+// PanTiltLoop
+
+PanTiltLoop::PanTiltLoop()
+  : historyHead(0), historyCount(0), lastTickUs(0), ticked(false), resting(false), seen(false), lastSeenUs(0),
+    measured(0), stale(0) {
+  memset(&config, 0, sizeof(config));
+  memset(history, 0, sizeof(history));
+  for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+    config.axes[a].fovDeg = 60;
+    config.axes[a].direction = 1;
+    config.axes[a].maxAngle = 180;
+    config.axes[a].homeAngle = 90;
+    AxisState &axis = state[a];
+    axis.angle = axis.rest = axis.aim = 90;
+    axis.speed = axis.integral = axis.lastError = 0;
+  }
+}
+
+void PanTiltLoop::configure(const PanTiltParams &params) {
+  config = params;
+  for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+    PanTiltAxisParams &axis = config.axes[a];
+    if (axis.minAngle > axis.maxAngle) {
+      float swap = axis.minAngle;
+      axis.minAngle = axis.maxAngle;
+      axis.maxAngle = swap;
+    }
+    axis.homeAngle = clampf(axis.homeAngle, axis.minAngle, axis.maxAngle);
+    state[a].filter.configure(config.accelNoise, config.measureNoise);
+    if (!resting) state[a].rest = axis.homeAngle;
+    state[a].rest = clampf(state[a].rest, axis.minAngle, axis.maxAngle);
+  }
+}
+
+void PanTiltLoop::reset(int64_t nowUs, float pan, float tilt) {
+  float angles[PAN_TILT_AXES] = {pan, tilt};
+  for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+    AxisState &axis = state[a];
+    axis.filter.reset();
+    axis.angle = axis.aim = clampf(angles[a], config.axes[a].minAngle, config.axes[a].maxAngle);
+    axis.speed = axis.integral = axis.lastError = 0;
+  }
+  historyHead = historyCount = 0;
+  lastTickUs = nowUs;
+  ticked = false;
+  seen = false;
+}
+
+void PanTiltLoop::aim(float pan, float tilt) {
+  state[PAN_AXIS].rest = clampf(pan, config.axes[PAN_AXIS].minAngle, config.axes[PAN_AXIS].maxAngle);
+  state[TILT_AXIS].rest = clampf(tilt, config.axes[TILT_AXIS].minAngle, config.axes[TILT_AXIS].maxAngle);
+  resting = true;
+}
+
+bool PanTiltLoop::tracking(int64_t nowUs) const {
+  return seen && nowUs - lastSeenUs < (int64_t)config.lostUs;
+}
+
+// Commanded angle at a past time (the newest sample not after it)
+float PanTiltLoop::angleAt(uint8_t axis, int64_t timeUs, bool &known) const {
+  known = true;
+  if (historyCount == 0) return state[axis].angle;
+  for (uint16_t i = 1; i <= historyCount; i++) {
+    const Sample &sample = history[(historyHead + PAN_TILT_HISTORY - i) % PAN_TILT_HISTORY];
+    if (sample.timeUs <= timeUs) return sample.angles[axis];
+  }
+  known = historyCount < PAN_TILT_HISTORY;   // before the first tick is fine, past the ring is not
+  return history[(historyHead + PAN_TILT_HISTORY - historyCount) % PAN_TILT_HISTORY].angles[axis];
+}
+
+void PanTiltLoop::measure(int64_t capturedUs, float offsetX, float offsetY) {
+  float offsets[PAN_TILT_AXES] = {offsetX, offsetY};
+  bool allKnown = true;
+  for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+    const PanTiltAxisParams &axis = config.axes[a];
+    bool known;
+    // The commanded angle one servo lag earlier is where the servo was
+    float at = angleAt(a, capturedUs - (int64_t)config.servoLagUs, known);
+    allKnown = allKnown && known;
+    float halfFov = axis.fovDeg * 0.5f * DEG_TO_RAD_F;
+    float offset = atanf(2 * clampf(offsets[a], -0.5f, 0.5f) * tanf(halfFov)) * RAD_TO_DEG_F;
+    state[a].filter.update(capturedUs, at + axis.direction * offset, config.lostUs);
+  }
+  if (!allKnown) stale++;
+  if (!seen || capturedUs > lastSeenUs) lastSeenUs = capturedUs;
+  seen = true;
+  resting = false;
+  measured++;
+}
+
+void PanTiltLoop::tick(int64_t nowUs, float &pan, float &tilt) {
+  float dt = ticked ? (float)(nowUs - lastTickUs) / 1000000.0f : 0;
+  dt = clampf(dt, 0, MAX_TICK_S);
+  lastTickUs = nowUs;
+  ticked = true;
+
+  bool following = tracking(nowUs);
+  bool goHome = !following &&
+                (resting || !seen || (config.homeAfterUs && nowUs - lastSeenUs >= (int64_t)config.homeAfterUs));
+  for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+    AxisState &axis = state[a];
+    if (following && axis.filter.active()) {
+      // Where the target will be once the servo has moved
+      stepAxis(a, axis.filter.predict(nowUs + config.servoLagUs), axis.filter.rate(), dt, false);
+    } else if (goHome) {
+      stepAxis(a, axis.rest, 0, dt, false);
+    } else {
+      stepAxis(a, axis.angle, 0, dt, true);
+    }
+  }
+
+  Sample &sample = history[historyHead];
+  sample.timeUs = nowUs;
+  sample.angles[PAN_AXIS] = state[PAN_AXIS].angle;
+  sample.angles[TILT_AXIS] = state[TILT_AXIS].angle;
+  historyHead = (historyHead + 1) % PAN_TILT_HISTORY;
+  if (historyCount < PAN_TILT_HISTORY) historyCount++;
+
+  pan = state[PAN_AXIS].angle;
+  tilt = state[TILT_AXIS].angle;
+}
+
+// Fastest speed that can still stop within distance, braking maxAccel * dt
+// per tick: from v that covers v^2 / 2a + v dt / 2, not just v^2 / 2a, and
+// up to a dt^2 / 8 more when v is not a whole number of braking steps
+static float brakingSpeed(float distance, float maxAccel, float dt) {
+  distance -= maxAccel * dt * dt / 8;
+  if (distance <= 0) return 0;
+  float half = maxAccel * dt / 2;
+  return sqrtf(half * half + 2 * maxAccel * distance) - half;
+}
+
+void PanTiltLoop::stepAxis(uint8_t a, float target, float feedForward, float dt, bool hold) {
+  AxisState &axis = state[a];
+  const PanTiltAxisParams &limits = config.axes[a];
+  target = clampf(target, limits.minAngle, limits.maxAngle);
+  axis.aim = target;
+  float error = target - axis.angle;
+
+  float wanted = 0;
+  if (hold) {
+    axis.integral = 0;
+  } else {
+    float derivative = dt > 0 ? (error - axis.lastError) / dt : 0;
+    wanted = feedForward + config.kp * error + config.ki * axis.integral + config.kd * derivative;
+    // No faster than can still be braked within the error (plus the
+    // target's own speed), nor than can stop before the end stops
+    float cap = brakingSpeed(fabsf(error), config.maxAccel, dt) + fabsf(feedForward);
+    if (cap > config.maxSpeed) cap = config.maxSpeed;
+    float limited = clampf(wanted, -fminf(cap, brakingSpeed(axis.angle - limits.minAngle, config.maxAccel, dt)),
+                           fminf(cap, brakingSpeed(limits.maxAngle - axis.angle, config.maxAccel, dt)));
+    // Anti-windup: integrate near the aim only (a large step would
+    // otherwise wind it up on the way and overshoot), and not while
+    // limited in the direction of the error
+    if (fabsf(error) < INTEGRAL_BAND && (limited == wanted || (wanted > 0) != (error > 0))) {
+      axis.integral += error * dt;
+      if (config.ki > 0) {
+        float bound = config.maxSpeed / config.ki;
+        axis.integral = clampf(axis.integral, -bound, bound);
+      }
+    }
+    wanted = limited;
+  }
+  axis.lastError = error;
+
+  float step = config.maxAccel * dt;
+  axis.speed += clampf(wanted - axis.speed, -step, step);
+  axis.angle += axis.speed * dt;
+  if (axis.angle > limits.maxAngle || axis.angle < limits.minAngle) {
+    axis.angle = clampf(axis.angle, limits.minAngle, limits.maxAngle);
+    axis.speed = 0;
+  }
+}
@@ -0,0 +1,154 @@
+/**
+ * Pan/Tilt Control Law
+ *
+ * Points the camera at a tracked target. Each axis works in servo degrees:
+ * a detection's offset from the image centre is turned into the target's
+ * bearing (the angle the servo would need to centre it) using the angle
+ * the servo had when the frame was captured, looked up in a short history
+ * of commanded angles. The camera moving while the detector runs therefore
+ * does not look like target motion.
+ *
+ * Bearings feed a constant-velocity Kalman filter per axis. Detections
+ * arrive late (exposure, transfer and inference) and seldom (the model
+ * interval), so the filter is updated at the capture time and every
+ * control tick aims at its prediction for now + servo lag, which also
+ * covers the time the servo takes to get there.
+ *
+ * The commanded angle follows that aim through a PID on the angle error
+ * whose output is a servo speed, plus the filter's target speed as feed
+ * forward. The speed is limited (max speed) and so is its change (max
+ * acceleration), which keeps a noisy detection or a re-acquired target
+ * from jerking the mount; near the aim the speed is also held to what can
+ * still be braked within the error, so large steps do not overshoot, and
+ * near an angle limit to what stops before it. The integral only grows
+ * within a couple of degrees of the aim, and not while the output is
+ * limited.
+ *
+ * Without a detection for lostUs the axes brake to a stop; after homeAfterUs
+ * they return to the rest position (homeAngle, or the one set by aim()).
+ *
+ * Plain C++ with no device calls, so the loop runs (and is checked) on a
+ * host against a simulated target and servo. Not thread safe: the caller
+ * serializes all calls.
+ */
+
+#ifndef PAN_TILT_CONTROL_H
+#define PAN_TILT_CONTROL_H
+
+#include <stdint.h>
+
+#define PAN_TILT_HISTORY         256    // commanded angles kept, one per tick
+#define PAN_TILT_INITIAL_RATE_VAR 400.0f  // (deg/s)^2 of a new target's unknown speed
+
+enum PanTiltAxis : uint8_t {
+  PAN_AXIS = 0,
+  TILT_AXIS,
+  PAN_TILT_AXES
+};
+
+struct PanTiltAxisParams {
+  float fovDeg;             // camera field of view along the axis
+  float direction;          // +1 when a larger angle turns the camera towards +x / +y, else -1
+  float minAngle;
+  float maxAngle;
+  float homeAngle;
+};
+
+struct PanTiltParams {
+  PanTiltAxisParams axes[PAN_TILT_AXES];
+  float kp;                 // deg/s per degree of error
+  float ki;                 // deg/s per degree-second
+  float kd;                 // deg/s per deg/s
+  float maxSpeed;           // deg/s
+  float maxAccel;           // deg/s^2
+  float accelNoise;         // Kalman process noise: target acceleration, deg/s^2
+  float measureNoise;       // Kalman measurement noise, degrees
+  uint32_t servoLagUs;      // command to position
+  uint32_t lostUs;          // no detection: stop following
+  uint32_t homeAfterUs;     // no detection: return home (0 = stay)
+};
+
+// Constant-velocity Kalman filter over one axis' bearing
+class BearingFilter {
+public:
+  BearingFilter();
+
+  void reset();
+  void configure(float accelNoise, float measureNoise);
+  // Bearing measured in a frame captured at timeUs; measurements must come
+  // in capture order. A gap over restartUs starts the filter afresh.
+  void update(int64_t timeUs, float bearing, uint32_t restartUs);
+  bool active() const { return started; }
+  float predict(int64_t timeUs) const;
+  float rate() const { return velocity; }
+  int64_t lastUpdate() const { return timeUs; }
+
+private:
+  bool started;
+  int64_t timeUs;
+  float position;
+  float velocity;
+  float p00, p01, p11;      // covariance (symmetric)
+  float q;                  // accelNoise^2
+  float r;                  // measureNoise^2
+};
+
+class PanTiltLoop {
+public:
+  PanTiltLoop();
+
+  void configure(const PanTiltParams &params);
+  // Starts over at the given angles: no target, empty history
+  void reset(int64_t nowUs, float pan, float tilt);
+  // Rest position, taken at once when no target is followed
+  void aim(float pan, float tilt);
+
+  // A detection: target centre as a fraction of the frame from its centre
+  // (-0.5..0.5, +x right, +y down) in a frame captured at capturedUs
+  void measure(int64_t capturedUs, float offsetX, float offsetY);
+
+  // One control tick; returns the commanded angles
+  void tick(int64_t nowUs, float &pan, float &tilt);
+
+  bool tracking(int64_t nowUs) const;
+  float angle(uint8_t axis) const { return state[axis].angle; }
+  float speed(uint8_t axis) const { return state[axis].speed; }
+  float aimAngle(uint8_t axis) const { return state[axis].aim; }
+  const BearingFilter &filter(uint8_t axis) const { return state[axis].filter; }
+  uint32_t measurements() const { return measured; }
+  uint32_t staleMeasurements() const { return stale; }
+
+private:
+  struct AxisState {
+    BearingFilter filter;
+    float angle;            // commanded
+    float speed;            // deg/s
+    float integral;
+    float lastError;
+    float rest;
+    float aim;              // last aim point
+  };
+
+  struct Sample {
+    int64_t timeUs;
+    float angles[PAN_TILT_AXES];
+  };
+
+  PanTiltParams config;
+  AxisState state[PAN_TILT_AXES];
+  Sample history[PAN_TILT_HISTORY];
+  uint16_t historyHead;     // next slot
+  uint16_t historyCount;
+  int64_t lastTickUs;
+  bool ticked;
+  bool resting;             // rest position requested by aim()
+  bool seen;                // a detection since reset()
+  int64_t lastSeenUs;       // its capture time
+  uint32_t measured;
+  uint32_t stale;           // captured before the oldest history entry
+
+  float angleAt(uint8_t axis, int64_t timeUs, bool &known) const;
+  void stepAxis(uint8_t axis, float target, float feedForward, float dt, bool hold);
+};
+
+#endif // PAN_TILT_CONTROL_H
@@ -0,0 +1,100 @@
+/**
+ * Closed-Loop JPEG Quality Controller Implementation
+ */
+
+#include "quality_controller.h"
+#include "logger.h"
+
+QualityController qualityController;
+
+static const char *MODE_NAMES[] = {"off", "bitrate", "fps"};
+
+QualityController::QualityController()
+  : mode(RATE_CONTROL_OFF), targetBytesPerSec(0), targetFps(10), pacingMs(60),
+    qualityMin(10), qualityMax(40), quality(12), avgFrameBytes(0), linkBytesPerSec(0),
+    avgFrameMicros(0), lastFrameMicros(0), budgetBytes(0), framesSinceChange(0), adjustments(0) {
+}
+
+void QualityController::configure(const StreamSettings &stream, uint8_t baseQuality) {
+  mode = stream.rateControl <= RATE_CONTROL_FPS ? (RateControlMode)stream.rateControl : RATE_CONTROL_OFF;
+  targetBytesPerSec = (uint32_t)stream.targetKbps * 125;
+  targetFps = stream.targetFps ? stream.targetFps : 1;
+  pacingMs = stream.frameIntervalMs;
+  qualityMin = min(stream.qualityMin, stream.qualityMax);
+  qualityMax = max(stream.qualityMin, stream.qualityMax);
+  quality = constrain(baseQuality, qualityMin, qualityMax);
+  avgFrameBytes = 0;
+  budgetBytes = 0;
+  framesSinceChange = 0;
+  // Link estimate and frame timing carry over: they describe the connection
+}
+
+uint16_t QualityController::frameIntervalMs() const {
+  return mode == RATE_CONTROL_FPS ? 1000 / targetFps : pacingMs;
+}
+
+uint8_t QualityController::onFrameSent(size_t frameBytes, uint32_t sendMicros) {
+  uint32_t now = micros();
+  if (lastFrameMicros) {
+    uint32_t interval = now - lastFrameMicros;
+    avgFrameMicros = avgFrameMicros ? (avgFrameMicros * 7 + interval) / 8 : interval;
+  }
+  lastFrameMicros = now;
+
+  if (frameBytes >= RATE_MIN_SAMPLE_BYTES && sendMicros > 0) {
+    uint32_t sample = (uint32_t)((uint64_t)frameBytes * 1000000 / sendMicros);
+    linkBytesPerSec = linkBytesPerSec ? (linkBytesPerSec * 7 + sample) / 8 : sample;
+  }
+
+  avgFrameBytes = avgFrameBytes ? (avgFrameBytes * 3 + frameBytes) / 4 : frameBytes;
+
+  if (mode == RATE_CONTROL_OFF) return 0;
+  if (++framesSinceChange < RATE_SETTLE_FRAMES) return 0;
+
+  uint32_t linkBudget = (uint32_t)((uint64_t)linkBytesPerSec * RATE_LINK_HEADROOM / 100);
+  uint32_t rate;
+  uint32_t fps;
+  if (mode == RATE_CONTROL_BITRATE) {
+    rate = linkBudget ? min(targetBytesPerSec, linkBudget) : targetBytesPerSec;
+    fps = pacingMs ? max(1000u / pacingMs, 1u) : 1;
+  } else {
+    if (!linkBudget) return 0;  // nothing to aim for until the link is measured
+    rate = linkBudget;
+    fps = targetFps;
+  }
+  budgetBytes = rate / fps;
+  if (budgetBytes == 0) return 0;
+
+  // Quality: lower number = better picture = bigger frames
+  uint32_t ratio = (uint32_t)((uint64_t)avgFrameBytes * 100 / budgetBytes);
+  uint8_t next = quality;
+  if (ratio > 110) {
+    // Over budget: back off fast, proportionally to the overshoot
+    uint8_t step = (uint8_t)min(4u, 1 + (ratio - 110) / 25);
+    next = min<uint16_t>(quality + step, qualityMax);
+  } else if (ratio < 75 && quality > qualityMin) {
+    // Comfortably under budget: recover one step at a time
+    next = quality - 1;
+  }
+
+  if (next == quality) return 0;
+
+  LOGD(TAG_CAMERA, "Rate control: quality %u -> %u (frame %u B, budget %u B)",
+       quality, next, avgFrameBytes, budgetBytes);
+  quality = next;
+  framesSinceChange = 0;
+  adjustments++;
+  return quality;
+}
+
+void QualityController::reportStatus(JsonObject out) const {
+  out["mode"] = MODE_NAMES[mode];
+  out["quality"] = quality;
+  out["quality_min"] = qualityMin;
+  out["quality_max"] = qualityMax;
+  out["avg_frame_bytes"] = avgFrameBytes;
+  out["budget_bytes"] = budgetBytes;
+  out["link_kbps"] = linkBytesPerSec / 125;
+  out["fps"] = avgFrameMicros ? 1000000 / avgFrameMicros : 0;
+  out["adjustments"] = adjustments;
+}
@@ -0,0 +1,72 @@
+/**
+ * Closed-Loop JPEG Quality Controller
+ *
+ * Watches how large each streamed frame is and how fast the connection drains
+ * it, and nudges the sensor's JPEG quality so the stream holds either a
+ * target bitrate or a target frame rate. When WiFi throughput drops the
+ * picture gets coarser instead of the stream stalling; when it recovers the
+ * quality climbs back one step at a time.
+ *
+ * Fed from the MJPEG chunk callback (one call per completed frame); all
+ * arithmetic is integer.
+ */
+
+#ifndef QUALITY_CONTROLLER_H
+#define QUALITY_CONTROLLER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config_store.h"
+
+enum RateControlMode : uint8_t {
+  RATE_CONTROL_OFF = 0,
+  RATE_CONTROL_BITRATE,    // hold stream.target_kbps (capped by the link)
+  RATE_CONTROL_FPS         // hold stream.target_fps with what the link can carry
+};
+
+// Only frames this large give a meaningful throughput sample; smaller ones
+// fit in the TCP send buffer and "drain" instantly
+#define RATE_MIN_SAMPLE_BYTES  4096
+// Frames to wait after a change: the next frame may already be in a buffer
+#define RATE_SETTLE_FRAMES     3
+#define RATE_LINK_HEADROOM     85   // percent of measured throughput to use
+
+class QualityController {
+public:
+  QualityController();
+
+  // Resets the loop with new targets, starting from baseQuality
+  void configure(const StreamSettings &stream, uint8_t baseQuality);
+
+  bool active() const { return mode != RATE_CONTROL_OFF; }
+
+  // Minimum time between frames for the stream loop
+  uint16_t frameIntervalMs() const;
+
+  // Called once a frame has been fully handed to the connection. Returns the
+  // quality to apply to the sensor, or 0 when it should stay as is.
+  uint8_t onFrameSent(size_t frameBytes, uint32_t sendMicros);
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  RateControlMode mode;
+  uint32_t targetBytesPerSec;
+  uint8_t targetFps;
+  uint16_t pacingMs;
+  uint8_t qualityMin;
+  uint8_t qualityMax;
+
+  uint8_t quality;
+  uint32_t avgFrameBytes;      // EWMA
+  uint32_t linkBytesPerSec;    // EWMA of per-frame drain rate, 0 = unknown
+  uint32_t avgFrameMicros;     // EWMA of time between frames
+  uint32_t lastFrameMicros;
+  uint32_t budgetBytes;        // per-frame target from the last decision
+  uint8_t framesSinceChange;
+  uint32_t adjustments;
+};
+
+extern QualityController qualityController;
+
+#endif // QUALITY_CONTROLLER_H
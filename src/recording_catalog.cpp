@@ -0,0 +1,476 @@
+/**
+ * Recording Catalog Implementation
+ */
+
+#include "recording_catalog.h"
+#include "event_log.h"
+#include "logger.h"
+#include <SD_MMC.h>
+#include <sys/time.h>
+
+#define CATALOG_LOCK_WAIT_MS    1000
+#define CATALOG_EVICT_BATCH     32      // evictions per pass before yielding
+#define CATALOG_AVI_HEADER      256     // bytes searched for the avih chunk
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+static const char *const KIND_NAMES[] = {"clip", "snapshot"};
+static const char *const TRIGGER_NAMES[RECORDING_TRIGGER_COUNT] = {
+  "unknown", "manual", "motion", "detection", "upload"
+};
+
+RecordingCatalog recordingCatalog;
+
+RecordingCatalog::RecordingCatalog()
+  : lock(NULL), task(NULL), running(false), loaded(false), quotaMb(0), retentionDays(0), maxUsagePercent(100),
+    evictedBytes(0), rebuildMs(0), rebuildFiles(0), lastEnforceMs(0) {
+  dir[0] = '\0';
+  indexPath[0] = '\0';
+  tempPath[0] = '\0';
+}
+
+bool RecordingCatalog::begin(bool sdReady, const StorageSettings &settings) {
+  if (!sdReady) return false;
+  configure(settings);
+  // Kept without a trailing slash ("" for the card root)
+  strlcpy(dir, settings.recordingsDir, sizeof(dir));
+  size_t len = strlen(dir);
+  while (len && dir[len - 1] == '/') dir[--len] = '\0';
+  snprintf(indexPath, sizeof(indexPath), "%s/" CATALOG_INDEX_NAME, dir);
+  snprintf(tempPath, sizeof(tempPath), "%s/" CATALOG_INDEX_NAME ".tmp", dir);
+
+  lock = xSemaphoreCreateMutex();
+  if (!lock || !index.begin(this, CATALOG_MAX_ENTRIES)) {
+    LOGW(TAG_SD, "Catalog: no memory");
+    return false;
+  }
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    LOGW(TAG_SD, "Catalog: SD card busy");
+    return false;
+  }
+  if (len && !SD_MMC.exists(dir)) SD_MMC.mkdir(dir);
+  SD_MMC.remove(tempPath);   // left by a reset during a rewrite
+  loaded = index.load();
+  xSemaphoreGive(sdCardMutex);
+
+  // Recordings closed before the walk finishes are kept by the merge
+  if (!loaded) index.beginRebuild();
+  running = true;
+  if (xTaskCreatePinnedToCore(taskEntry, "catalog", CATALOG_STACK_SIZE, this, 1, &task, 0) != pdPASS) {
+    running = false;
+    LOGW(TAG_SD, "Catalog: failed to start task");
+    return false;
+  }
+  if (loaded) {
+    LOGI(TAG_SD, "Catalog: %u recordings, %u MB", index.count(), (uint32_t)(index.totalBytes() >> 20));
+  } else {
+    LOGW(TAG_SD, "Catalog: index missing or damaged, rebuilding");
+  }
+  return true;
+}
+
+void RecordingCatalog::configure(const StorageSettings &settings) {
+  quotaMb = settings.recordingsMb;
+  retentionDays = settings.recordingRetentionDays;
+  maxUsagePercent = settings.maxUsagePercent;
+  if (task) xTaskNotifyGive(task);
+}
+
+// ---------------------------------------------------------------------------
+// Names
+
+// Path below the recordings directory, NULL when outside it or too long
+const char *RecordingCatalog::relativeName(const char *path) const {
+  size_t len = strlen(dir);
+  if (strncmp(path, dir, len) != 0 || path[len] != '/') return NULL;
+  const char *name = path + len + 1;
+  if (*name == '\0' || *name == '.' || strlen(name) >= RECORDING_NAME_LEN) return NULL;
+  return name;
+}
+
+String RecordingCatalog::absolutePath(const char *name) const {
+  String path(dir);
+  path += '/';
+  path += name;
+  return path;
+}
+
+static const char *extension(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  return dot && (!slash || dot > slash) ? dot + 1 : "";
+}
+
+static int kindOf(const char *path) {
+  const char *ext = extension(path);
+  if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0) return RECORDING_SNAPSHOT;
+  if (strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "mjpeg") == 0 || strcasecmp(ext, "mjpg") == 0) {
+    return RECORDING_CLIP;
+  }
+  return -1;
+}
+
+static uint32_t readU32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Size, time, kind and (for an AVI) duration of an open file. Caller holds
+// sdCardMutex.
+bool RecordingCatalog::describe(File &file, const char *path, RecordingEntry &entry) {
+  int kind = kindOf(path);
+  const char *name = relativeName(path);
+  if (kind < 0 || name == NULL || !file || file.isDirectory()) return false;
+
+  memset(&entry, 0, sizeof(entry));
+  strlcpy(entry.name, name, sizeof(entry.name));
+  entry.kind = (uint8_t)kind;
+  entry.start = (uint32_t)file.getLastWrite();
+  entry.size = file.size();
+
+  // avih: microseconds per frame at +8, total frames at +24
+  if (kind == RECORDING_CLIP && strcasecmp(extension(path), "avi") == 0) {
+    uint8_t header[CATALOG_AVI_HEADER];
+    size_t got = file.read(header, sizeof(header));
+    for (size_t i = 0; i + 28 <= got; i++) {
+      if (memcmp(header + i, "avih", 4) != 0) continue;
+      uint64_t us = (uint64_t)readU32(header + i + 8) * readU32(header + i + 24);
+      entry.durationMs = (uint32_t)(us / 1000);
+      break;
+    }
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Updates (recorder and web server tasks)
+
+bool RecordingCatalog::add(const char *path, uint32_t start, uint32_t durationMs, uint32_t size,
+                           RecordingTrigger trigger) {
+  const char *name = relativeName(path);
+  int kind = kindOf(path);
+  if (!running || name == NULL || kind < 0) return false;
+
+  RecordingEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  strlcpy(entry.name, name, sizeof(entry.name));
+  entry.start = start;
+  entry.durationMs = durationMs;
+  entry.size = size;
+  entry.kind = (uint8_t)kind;
+  entry.trigger = trigger;
+  if (start == 0 || size == 0) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+    File file = SD_MMC.open(path, FILE_READ);
+    if (file && !file.isDirectory()) {
+      if (start == 0) entry.start = (uint32_t)file.getLastWrite();
+      if (size == 0) entry.size = file.size();
+    }
+    if (file) file.close();
+    xSemaphoreGive(sdCardMutex);
+  }
+  return store(entry);
+}
+
+bool RecordingCatalog::addFile(const char *path, RecordingTrigger trigger) {
+  if (!running) return false;
+  RecordingEntry entry;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  File file = SD_MMC.open(path, FILE_READ);
+  bool described = describe(file, path, entry);
+  if (file) file.close();
+  xSemaphoreGive(sdCardMutex);
+  if (!described) return false;
+  entry.trigger = trigger;
+  return store(entry);
+}
+
+bool RecordingCatalog::store(const RecordingEntry &entry) {
+  if (xSemaphoreTake(lock, pdMS_TO_TICKS(CATALOG_LOCK_WAIT_MS)) != pdTRUE) return false;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    xSemaphoreGive(lock);
+    return false;
+  }
+  index.forget(entry.name);   // an overwritten file replaces its entry
+  RecordingEntry evicted;
+  bool makeRoom = index.full();
+  bool room = !makeRoom || index.evictOldest(&evicted);
+  bool added = room && index.add(entry);
+  xSemaphoreGive(sdCardMutex);
+  xSemaphoreGive(lock);
+
+  if (makeRoom && room) {
+    evictedBytes += evicted.size;
+    LOGW_S(TAG_SD, "Catalog full, deleted %s", evicted.name);
+  }
+  if (added) xTaskNotifyGive(task);   // limits are checked right away
+  return added;
+}
+
+bool RecordingCatalog::forget(const char *path) {
+  const char *name = relativeName(path);
+  if (!running || name == NULL) return false;
+  if (xSemaphoreTake(lock, pdMS_TO_TICKS(CATALOG_LOCK_WAIT_MS)) != pdTRUE) return false;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    xSemaphoreGive(lock);
+    return false;
+  }
+  bool found = index.forget(name);
+  xSemaphoreGive(sdCardMutex);
+  xSemaphoreGive(lock);
+  return found;
+}
+
+bool RecordingCatalog::covers(const char *path) const {
+  return running && relativeName(path) != NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Query (web server task; the index lock only, no SD access)
+
+void RecordingCatalog::query(JsonObject out, uint32_t from, uint32_t to, uint32_t offset, uint16_t limit,
+                             bool ascending, int kind) {
+  out["offset"] = offset;
+  out["limit"] = limit;
+  JsonArray list = out["recordings"].to<JsonArray>();
+  if (!running || xSemaphoreTake(lock, pdMS_TO_TICKS(CATALOG_LOCK_WAIT_MS)) != pdTRUE) {
+    out["total"] = 0;
+    out["error"] = running ? "Catalog busy" : "Catalog not running";
+    return;
+  }
+
+  uint32_t first = index.lowerBound(from);
+  uint32_t last = index.upperBound(to);   // one past the range
+  if (last < first) last = first;
+  uint32_t total = 0;
+  uint32_t listed = 0;
+  uint64_t bytes = 0;
+  for (uint32_t n = 0; n < last - first; n++) {
+    const RecordingEntry &entry = index.at(ascending ? first + n : last - 1 - n);
+    if (kind >= 0 && entry.kind != kind) continue;
+    bytes += entry.size;
+    if (total++ < offset || listed >= limit) continue;
+    listed++;
+    JsonObject item = list.add<JsonObject>();
+    item["path"] = absolutePath(entry.name);
+    item["start"] = entry.start;
+    item["duration_ms"] = entry.durationMs;
+    item["size"] = entry.size;
+    item["kind"] = KIND_NAMES[entry.kind <= RECORDING_SNAPSHOT ? entry.kind : 0];
+    item["trigger"] = TRIGGER_NAMES[entry.trigger < RECORDING_TRIGGER_COUNT ? entry.trigger : 0];
+  }
+  bool rebuilding = index.rebuilding();
+  xSemaphoreGive(lock);
+
+  out["total"] = total;
+  out["bytes"] = bytes;
+  out["rebuilding"] = rebuilding;
+}
+
+// ---------------------------------------------------------------------------
+// Task
+
+void RecordingCatalog::taskEntry(void *param) {
+  static_cast<RecordingCatalog *>(param)->run();
+}
+
+void RecordingCatalog::run() {
+  if (!loaded) rebuild();
+  for (;;) {
+    enforce();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CATALOG_CHECK_MS));
+  }
+}
+
+void RecordingCatalog::rebuild() {
+  uint32_t startMs = millis();
+  rebuildFiles = 0;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+    File root = SD_MMC.open(dir[0] ? dir : "/");
+    bool isDir = root && root.isDirectory();
+    xSemaphoreGive(sdCardMutex);
+    if (isDir) walk(root, 0);
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+      root.close();
+      xSemaphoreGive(sdCardMutex);
+    }
+  }
+
+  // Rebuilt even after a busy card: the files not found come back when the
+  // index is next found damaged, and retention needs a finished index
+  xSemaphoreTake(lock, portMAX_DELAY);
+  xSemaphoreTake(sdCardMutex, portMAX_DELAY);
+  bool written = index.finishRebuild();
+  xSemaphoreGive(sdCardMutex);
+  loaded = true;
+  uint32_t count = index.count();
+  xSemaphoreGive(lock);
+
+  rebuildMs = millis() - startMs;
+  if (!written) LOGW(TAG_SD, "Catalog: index write failed, retried on the next change");
+  LOGI(TAG_SD, "Catalog: rebuilt from %u files in %u ms, %u recordings", rebuildFiles, rebuildMs, count);
+}
+
+// sdCardMutex is released between entries so recording is not held up
+void RecordingCatalog::walk(File &directory, uint8_t depth) {
+  for (;;) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+    File file = directory.openNextFile();
+    if (!file) {
+      xSemaphoreGive(sdCardMutex);
+      return;
+    }
+    String path = file.path();
+    const char *base = strrchr(path.c_str(), '/');
+    bool hidden = (base ? base[1] : path[0]) == '.';   // the index, thumbnails
+    bool isDir = file.isDirectory();
+    RecordingEntry entry;
+    bool described = !hidden && !isDir && describe(file, path.c_str(), entry);
+    if (!isDir || hidden || depth + 1 >= CATALOG_WALK_DEPTH) file.close();
+    xSemaphoreGive(sdCardMutex);
+
+    if (described) {
+      rebuildFiles++;
+      xSemaphoreTake(lock, portMAX_DELAY);
+      index.rebuildAdd(entry);
+      xSemaphoreGive(lock);
+    } else if (isDir && !hidden && depth + 1 < CATALOG_WALK_DEPTH) {
+      walk(file, depth + 1);
+      if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+      file.close();
+      xSemaphoreGive(sdCardMutex);
+    }
+  }
+}
+
+// Deletes the oldest recordings while a limit is exceeded
+void RecordingCatalog::enforce() {
+  if (!loaded) return;
+  uint32_t startMs = millis();
+
+  uint32_t cutoff = 0;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  uint32_t age = (uint32_t)retentionDays * 86400u;
+  if (age && tv.tv_sec > EVENT_LOG_EPOCH_VALID) cutoff = (uint32_t)tv.tv_sec - age;
+  uint64_t quota = (uint64_t)quotaMb << 20;
+
+  // Card usage is read once per pass; each eviction counts against it
+  int64_t cardExcess = 0;
+  if (maxUsagePercent < 100) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+    uint64_t limit = SD_MMC.totalBytes() / 100 * maxUsagePercent;
+    cardExcess = (int64_t)SD_MMC.usedBytes() - (int64_t)limit;
+    xSemaphoreGive(sdCardMutex);
+  }
+
+  uint32_t removed = 0;
+  for (;;) {
+    if (xSemaphoreTake(lock, pdMS_TO_TICKS(CATALOG_LOCK_WAIT_MS)) != pdTRUE) break;
+    bool due = false;
+    if (!index.rebuilding() && index.count()) {
+      due = (quota && index.totalBytes() > quota) || (cutoff && index.at(0).start < cutoff) || cardExcess > 0;
+    }
+    RecordingEntry evicted;
+    bool done = false;
+    if (due && xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+      done = index.evictOldest(&evicted);
+      xSemaphoreGive(sdCardMutex);
+    }
+    xSemaphoreGive(lock);
+    if (!done) break;
+
+    removed++;
+    evictedBytes += evicted.size;
+    cardExcess -= evicted.size;
+    LOGI_S(TAG_SD, "Catalog: deleted %s (%u KB)", evicted.name, evicted.size >> 10);
+    if (removed % CATALOG_EVICT_BATCH == 0) vTaskDelay(1);
+  }
+  if (removed) {
+    lastEnforceMs = millis() - startMs;
+    LOGI(TAG_SD, "Catalog: deleted %u recordings in %u ms", removed, lastEnforceMs);
+  }
+}
+
+void RecordingCatalog::reportStatus(JsonObject out) const {
+  out["running"] = running;
+  if (!running) return;
+  const RecordingIndexStats &stats = index.stats();
+  out["rebuilding"] = !loaded;
+  out["recordings"] = index.count();
+  out["bytes"] = index.totalBytes();
+  out["quota_mb"] = quotaMb;
+  out["retention_days"] = retentionDays;
+  out["file_records"] = index.fileRecords();
+  out["added"] = stats.added;
+  out["evicted"] = stats.evicted;
+  out["evicted_bytes"] = evictedBytes;
+  out["forgotten"] = stats.forgotten;
+  out["dropped"] = stats.dropped;
+  out["rewrites"] = stats.rewrites;
+  out["write_errors"] = stats.writeErrors;
+  out["damaged_loads"] = stats.damaged;
+  out["rebuild_ms"] = rebuildMs;
+  out["rebuild_files"] = rebuildFiles;
+  out["last_enforce_ms"] = lastEnforceMs;
+}
+
+// ---------------------------------------------------------------------------
+// RecordingIndexStorage (caller holds sdCardMutex)
+
+uint32_t RecordingCatalog::indexSize() {
+  File file = SD_MMC.open(indexPath, FILE_READ);
+  if (!file) return 0;
+  uint32_t bytes = file.size();
+  file.close();
+  return bytes;
+}
+
+size_t RecordingCatalog::indexRead(uint32_t offset, uint8_t *dst, size_t len) {
+  File file = SD_MMC.open(indexPath, FILE_READ);
+  if (!file) return 0;
+  size_t got = file.seek(offset) ? file.read(dst, len) : 0;
+  file.close();
+  return got;
+}
+
+size_t RecordingCatalog::indexAppend(const uint8_t *data, size_t len) {
+  File file = SD_MMC.open(indexPath, FILE_APPEND);
+  if (!file) return 0;
+  size_t written = file.write(data, len);
+  file.close();
+  return written;
+}
+
+// "r+" writes in place; FILE_WRITE would truncate
+bool RecordingCatalog::indexWrite(uint32_t offset, const uint8_t *data, size_t len) {
+  File file = SD_MMC.open(indexPath, "r+");
+  if (!file) return false;
+  bool ok = file.seek(offset) && file.write(data, len) == len;
+  file.close();
+  return ok;
+}
+
+size_t RecordingCatalog::rewriteAppend(const uint8_t *data, size_t len) {
+  if (!rewriteFile) rewriteFile = SD_MMC.open(tempPath, FILE_WRITE);
+  if (!rewriteFile) return 0;
+  return rewriteFile.write(data, len);
+}
+
+bool RecordingCatalog::rewriteCommit() {
+  if (!rewriteFile) return false;
+  rewriteFile.close();
+  SD_MMC.remove(indexPath);
+  return SD_MMC.rename(tempPath, indexPath);
+}
+
+void RecordingCatalog::rewriteAbort() {
+  if (rewriteFile) rewriteFile.close();
+  SD_MMC.remove(tempPath);
+}
+
+bool RecordingCatalog::removeRecording(const char *name) {
+  String path = absolutePath(name);
+  return SD_MMC.remove(path) || !SD_MMC.exists(path);
+}
@@ -0,0 +1,111 @@
+/**
+ * Recording Catalog
+ *
+ * Keeps the recording index (recording_index.h) for storage.recordings_dir
+ * in <recordings_dir>/.index and enforces the storage limits from it,
+ * deleting the oldest recordings first without walking directories:
+ *
+ *   storage.recordings_mb             total size of the catalogued files
+ *   storage.recording_retention_days  age (once the clock is set)
+ *   storage.max_usage_percent         SD card usage
+ *
+ * add() is called when a recording or snapshot is closed (and for files
+ * uploaded into the directory); forget() when one is deleted by hand.
+ * Both update the index file in place. A missing or damaged index is
+ * rebuilt by the catalog task from a walk of the directory and its
+ * subdirectories, while add() keeps working; limits are not enforced
+ * until it finishes.
+ *
+ * The index is guarded by its own mutex, taken before sdCardMutex, so
+ * queries from the web server only wait for index updates, not SD I/O.
+ */
+
+#ifndef RECORDING_CATALOG_H
+#define RECORDING_CATALOG_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+#include "config_store.h"
+#include "recording_index.h"
+
+#define CATALOG_INDEX_NAME       ".index"
+#define CATALOG_MAX_ENTRIES      8192         // 512 KB of PSRAM when full
+#define CATALOG_CHECK_MS         60000        // limits are also checked after add()
+#define CATALOG_WALK_DEPTH       2            // the directory and one level below
+#define CATALOG_STACK_SIZE       4096
+#define CATALOG_PAGE_DEFAULT     50
+#define CATALOG_PAGE_MAX         200
+
+class RecordingCatalog : public RecordingIndexStorage {
+public:
+  RecordingCatalog();
+
+  // Loads the index and starts the catalog task (which rebuilds a missing
+  // index). recordings_dir is fixed until the next boot.
+  bool begin(bool sdReady, const StorageSettings &settings);
+  // Limits; checked again right away
+  void configure(const StorageSettings &settings);
+
+  // path is absolute and must be inside the recordings directory; start 0
+  // takes the file's mtime, size 0 its size
+  bool add(const char *path, uint32_t start, uint32_t durationMs, uint32_t size, RecordingTrigger trigger);
+  // Stats the file and adds it (kind from the extension, AVI duration
+  // from its header)
+  bool addFile(const char *path, RecordingTrigger trigger);
+  bool forget(const char *path);
+  // True for paths add() accepts the directory of
+  bool covers(const char *path) const;
+
+  // Page of entries with from <= start <= to, newest first unless
+  // ascending; kind < 0 for every kind
+  void query(JsonObject out, uint32_t from, uint32_t to, uint32_t offset, uint16_t limit, bool ascending,
+             int kind);
+
+  void reportStatus(JsonObject out) const;
+
+  // RecordingIndexStorage (caller holds sdCardMutex)
+  uint32_t indexSize() override;
+  size_t indexRead(uint32_t offset, uint8_t *dst, size_t len) override;
+  size_t indexAppend(const uint8_t *data, size_t len) override;
+  bool indexWrite(uint32_t offset, const uint8_t *data, size_t len) override;
+  size_t rewriteAppend(const uint8_t *data, size_t len) override;
+  bool rewriteCommit() override;
+  void rewriteAbort() override;
+  bool removeRecording(const char *name) override;
+
+private:
+  RecordingIndex index;
+  SemaphoreHandle_t lock;
+  TaskHandle_t task;
+  volatile bool running;
+  bool loaded;                // false until the index is loaded or rebuilt
+  char dir[32];
+  char indexPath[48];
+  char tempPath[48];
+  File rewriteFile;
+
+  volatile uint32_t quotaMb;
+  volatile uint16_t retentionDays;
+  volatile uint8_t maxUsagePercent;
+
+  // Counters for reportStatus()
+  uint32_t evictedBytes;
+  uint32_t rebuildMs;
+  uint32_t rebuildFiles;
+  uint32_t lastEnforceMs;
+
+  static void taskEntry(void *param);
+  void run();
+  void rebuild();
+  void walk(File &directory, uint8_t depth);
+  void enforce();
+  bool store(const RecordingEntry &entry);
+  bool describe(File &file, const char *path, RecordingEntry &entry);
+  const char *relativeName(const char *path) const;
+  String absolutePath(const char *name) const;
+};
+
+extern RecordingCatalog recordingCatalog;
+
+#endif // RECORDING_CATALOG_H
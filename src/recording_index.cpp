@@ -0,0 +1,461 @@
+/**
+ * Recording Index Implementation
+ */
+
+#include "recording_index.h"
+#include "event_store.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_SLOT 0xFFFFFFFFu
+
+static inline void putU16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void putU32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static inline uint16_t getU16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t getU32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int compareStart(const void *a, const void *b) {
+  const RecordingEntry *x = (const RecordingEntry *)a;
+  const RecordingEntry *y = (const RecordingEntry *)b;
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return x->slot < y->slot ? -1 : x->slot > y->slot ? 1 : 0;
+}
+
+static uint32_t nameHash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const char *p = name; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+  return hash;
+}
+
+struct NameKey {
+  uint32_t hash;
+  uint32_t position;
+};
+
+static int compareKey(const void *a, const void *b) {
+  uint32_t x = ((const NameKey *)a)->hash;
+  uint32_t y = ((const NameKey *)b)->hash;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+
+RecordingIndex::RecordingIndex()
+  : storage(NULL), entries(NULL), capacity(0), head(0), live(0), maxEntries(0), bytes(0), records(0),
+    fileOpen(false), dirty(false), rebuildActive(false), walked(NULL), walkedCount(0), walkedCapacity(0),
+    io(NULL) {
+  memset(&counters, 0, sizeof(counters));
+}
+
+RecordingIndex::~RecordingIndex() {
+  end();
+}
+
+bool RecordingIndex::begin(RecordingIndexStorage *indexStorage, uint32_t limit) {
+  end();
+  storage = indexStorage;
+  maxEntries = limit;
+  io = (uint8_t *)malloc(RECORDING_IO_RECORDS * RECORDING_RECORD_SIZE);
+  if (io == NULL) return false;
+  return grow(RECORDING_INITIAL_CAPACITY < limit ? RECORDING_INITIAL_CAPACITY : limit);
+}
+
+void RecordingIndex::end() {
+  free(entries);
+  free(walked);
+  free(io);
+  entries = NULL;
+  walked = NULL;
+  io = NULL;
+  capacity = 0;
+  head = 0;
+  live = 0;
+  bytes = 0;
+  records = 0;
+  fileOpen = false;
+  dirty = false;
+  rebuildActive = false;
+  walkedCount = 0;
+  walkedCapacity = 0;
+}
+
+// ---------------------------------------------------------------------------
+// RAM ring: entries[(head + i) % capacity] is the i-th oldest
+
+bool RecordingIndex::grow(uint32_t newCapacity) {
+  if (newCapacity > maxEntries) newCapacity = maxEntries;
+  if (newCapacity <= capacity) return capacity > live;
+  RecordingEntry *array = (RecordingEntry *)malloc(sizeof(RecordingEntry) * newCapacity);
+  if (array == NULL) return false;
+  for (uint32_t i = 0; i < live; i++) array[i] = at(i);
+  free(entries);
+  entries = array;
+  capacity = newCapacity;
+  head = 0;
+  return true;
+}
+
+uint32_t RecordingIndex::lowerBound(uint32_t start) const {
+  uint32_t lo = 0;
+  uint32_t hi = live;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (at(mid).start < start) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+uint32_t RecordingIndex::upperBound(uint32_t start) const {
+  uint32_t lo = 0;
+  uint32_t hi = live;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (at(mid).start <= start) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Inserts after the entries with the same start; shifts the shorter side
+bool RecordingIndex::insert(const RecordingEntry &entry) {
+  if (live == capacity && !grow(capacity * 2)) return false;
+  uint32_t position = upperBound(entry.start);
+  if (position < live / 2) {
+    head = (head + capacity - 1) % capacity;
+    for (uint32_t i = 0; i < position; i++) slotAt(i) = at(i + 1);
+  } else {
+    for (uint32_t i = live; i > position; i--) slotAt(i) = at(i - 1);
+  }
+  live++;
+  slotAt(position) = entry;
+  bytes += entry.size;
+  return true;
+}
+
+void RecordingIndex::removeAt(uint32_t position) {
+  bytes -= at(position).size;
+  if (position < live / 2) {
+    for (uint32_t i = position; i > 0; i--) slotAt(i) = at(i - 1);
+    head = (head + 1) % capacity;
+  } else {
+    for (uint32_t i = position; i + 1 < live; i++) slotAt(i) = at(i + 1);
+  }
+  live--;
+}
+
+// ---------------------------------------------------------------------------
+// Records
+
+void RecordingIndex::encode(const RecordingEntry &entry, uint8_t *record) {
+  memset(record, 0, RECORDING_RECORD_SIZE);
+  record[0] = RECORDING_RECORD_MAGIC;
+  record[2] = entry.kind;
+  record[3] = entry.trigger;
+  putU32(record + 4, entry.start);
+  putU32(record + 8, entry.durationMs);
+  putU32(record + 12, entry.size);
+  strncpy((char *)record + 16, entry.name, RECORDING_NAME_LEN - 1);
+  putU32(record + 60, eventCrc32(0, record + 2, 58));
+}
+
+bool RecordingIndex::decode(const uint8_t *record, RecordingEntry &entry, bool &deleted) {
+  if (record[0] != RECORDING_RECORD_MAGIC) return false;
+  if (getU32(record + 60) != eventCrc32(0, record + 2, 58)) return false;
+  deleted = record[1] != 0;
+  entry.kind = record[2];
+  entry.trigger = record[3];
+  entry.start = getU32(record + 4);
+  entry.durationMs = getU32(record + 8);
+  entry.size = getU32(record + 12);
+  memcpy(entry.name, record + 16, RECORDING_NAME_LEN);
+  entry.name[RECORDING_NAME_LEN - 1] = '\0';
+  return true;
+}
+
+static void encodeHeader(uint8_t *header) {
+  memset(header, 0, RECORDING_HEADER_SIZE);
+  putU32(header, RECORDING_INDEX_MAGIC);
+  putU16(header + 4, RECORDING_FORMAT_VERSION);
+  putU16(header + 6, RECORDING_RECORD_SIZE);
+}
+
+// After a failed write the file no longer matches the slots: appends and
+// deletion marks stop until a rewrite succeeds
+bool RecordingIndex::appendRecord(RecordingEntry &entry) {
+  entry.slot = NO_SLOT;
+  if (dirty) return false;
+  size_t len = 0;
+  if (!fileOpen) {
+    encodeHeader(io);
+    len = RECORDING_HEADER_SIZE;
+  }
+  encode(entry, io + len);
+  len += RECORDING_RECORD_SIZE;
+  if (storage->indexAppend(io, len) != len) {
+    counters.writeErrors++;
+    dirty = true;
+    return false;
+  }
+  fileOpen = true;
+  entry.slot = records++;
+  return true;
+}
+
+void RecordingIndex::markDeleted(const RecordingEntry &entry) {
+  if (dirty || entry.slot == NO_SLOT) return;
+  uint8_t mark = 1;
+  if (!storage->indexWrite(RECORDING_HEADER_SIZE + entry.slot * RECORDING_RECORD_SIZE + 1, &mark, 1)) {
+    counters.writeErrors++;
+    dirty = true;
+  }
+}
+
+bool RecordingIndex::rewrite() {
+  uint8_t header[RECORDING_HEADER_SIZE];
+  encodeHeader(header);
+  bool ok = storage->rewriteAppend(header, sizeof(header)) == sizeof(header);
+  for (uint32_t i = 0; ok && i < live; i += RECORDING_IO_RECORDS) {
+    uint32_t batch = live - i < RECORDING_IO_RECORDS ? live - i : RECORDING_IO_RECORDS;
+    for (uint32_t j = 0; j < batch; j++) {
+      RecordingEntry &entry = slotAt(i + j);
+      entry.slot = i + j;
+      encode(entry, io + j * RECORDING_RECORD_SIZE);
+    }
+    size_t len = batch * RECORDING_RECORD_SIZE;
+    ok = storage->rewriteAppend(io, len) == len;
+  }
+  if (!ok || !storage->rewriteCommit()) {
+    storage->rewriteAbort();
+    counters.writeErrors++;
+    dirty = true;
+    return false;
+  }
+  records = live;
+  fileOpen = true;
+  dirty = false;
+  counters.rewrites++;
+  return true;
+}
+
+void RecordingIndex::maybeRewrite() {
+  if (rebuildActive) return;
+  uint32_t deleted = records - live;
+  if (dirty || (deleted > live && deleted >= RECORDING_REWRITE_MIN)) rewrite();
+}
+
+// ---------------------------------------------------------------------------
+
+bool RecordingIndex::load() {
+  head = 0;
+  live = 0;
+  bytes = 0;
+  records = 0;
+  fileOpen = false;
+  dirty = false;
+
+  uint32_t size = storage->indexSize();
+  uint8_t header[RECORDING_HEADER_SIZE];
+  if (size < RECORDING_HEADER_SIZE) return false;
+  if (storage->indexRead(0, header, sizeof(header)) != sizeof(header) ||
+      getU32(header) != RECORDING_INDEX_MAGIC || getU16(header + 4) != RECORDING_FORMAT_VERSION ||
+      getU16(header + 6) != RECORDING_RECORD_SIZE) {
+    counters.damaged++;
+    return false;
+  }
+
+  uint32_t total = (size - RECORDING_HEADER_SIZE) / RECORDING_RECORD_SIZE;
+  bool damaged = false;
+  bool sorted = true;
+  uint32_t slot = 0;
+  while (slot < total && !damaged) {
+    uint32_t batch = total - slot < RECORDING_IO_RECORDS ? total - slot : RECORDING_IO_RECORDS;
+    size_t len = batch * RECORDING_RECORD_SIZE;
+    if (storage->indexRead(RECORDING_HEADER_SIZE + slot * RECORDING_RECORD_SIZE, io, len) != len) {
+      damaged = true;
+      break;
+    }
+    for (uint32_t j = 0; j < batch; j++, slot++) {
+      RecordingEntry entry;
+      bool deleted = false;
+      if (!decode(io + j * RECORDING_RECORD_SIZE, entry, deleted)) {
+        damaged = true;
+        break;
+      }
+      if (deleted) continue;
+      if (live == capacity && !grow(capacity * 2)) {
+        counters.dropped++;
+        dirty = true;       // written back without the dropped entries
+        continue;
+      }
+      entry.slot = slot;
+      if (live && entry.start < entries[live - 1].start) sorted = false;
+      entries[live++] = entry;   // head is 0 while loading
+      bytes += entry.size;
+    }
+  }
+  // A partial record at the end is a torn append
+  if (!damaged && (size - RECORDING_HEADER_SIZE) % RECORDING_RECORD_SIZE != 0) damaged = true;
+  records = slot;
+  fileOpen = true;
+  if (!sorted) qsort(entries, live, sizeof(RecordingEntry), compareStart);
+  if (damaged) {
+    // Rewriting drops the damaged tail, so appends start on a clean record
+    counters.damaged++;
+    dirty = true;
+  }
+  maybeRewrite();
+  return true;
+}
+
+bool RecordingIndex::add(const RecordingEntry &entry) {
+  if (live >= maxEntries) {
+    counters.dropped++;
+    return false;
+  }
+  RecordingEntry copy = entry;
+  copy.name[RECORDING_NAME_LEN - 1] = '\0';
+  copy.slot = NO_SLOT;
+  if (!rebuildActive) appendRecord(copy);
+  if (!insert(copy)) {
+    // Out of memory: the record is on file, undo it there
+    markDeleted(copy);
+    counters.dropped++;
+    return false;
+  }
+  counters.added++;
+  maybeRewrite();
+  return true;
+}
+
+// Searched newest first: recent recordings are the ones usually removed
+bool RecordingIndex::forget(const char *name) {
+  for (uint32_t i = live; i > 0; i--) {
+    if (strncmp(at(i - 1).name, name, RECORDING_NAME_LEN) != 0) continue;
+    markDeleted(at(i - 1));
+    removeAt(i - 1);
+    counters.forgotten++;
+    maybeRewrite();
+    return true;
+  }
+  return false;
+}
+
+bool RecordingIndex::evictOldest(RecordingEntry *evicted) {
+  if (live == 0) return false;
+  RecordingEntry oldest = at(0);
+  storage->removeRecording(oldest.name);
+  markDeleted(oldest);
+  removeAt(0);
+  counters.evicted++;
+  if (evicted) *evicted = oldest;
+  maybeRewrite();
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Rebuild
+
+void RecordingIndex::beginRebuild() {
+  rebuildActive = true;
+  walkedCount = 0;
+}
+
+bool RecordingIndex::rebuildAdd(const RecordingEntry &entry) {
+  if (!rebuildActive) return false;
+  if (walkedCount == walkedCapacity) {
+    uint32_t grown = walkedCapacity ? walkedCapacity * 2 : RECORDING_INITIAL_CAPACITY;
+    if (grown > maxEntries) grown = maxEntries;
+    RecordingEntry *array = grown > walkedCapacity
+      ? (RecordingEntry *)realloc(walked, sizeof(RecordingEntry) * grown) : NULL;
+    if (array == NULL) {
+      counters.dropped++;
+      return false;
+    }
+    walked = array;
+    walkedCapacity = grown;
+  }
+  RecordingEntry &copy = walked[walkedCount];
+  copy = entry;
+  copy.name[RECORDING_NAME_LEN - 1] = '\0';
+  copy.slot = walkedCount++;
+  return true;
+}
+
+bool RecordingIndex::finishRebuild() {
+  if (!rebuildActive) return false;
+  if (walkedCount) qsort(walked, walkedCount, sizeof(RecordingEntry), compareStart);
+
+  // Entries added during the walk replace the walk's entry for their name
+  NameKey *keys = live ? (NameKey *)malloc(sizeof(NameKey) * live) : NULL;
+  if (live && keys == NULL) return false;
+  for (uint32_t i = 0; i < live; i++) {
+    keys[i].hash = nameHash(at(i).name);
+    keys[i].position = i;
+  }
+  if (live) qsort(keys, live, sizeof(NameKey), compareKey);
+
+  // Merge both sorted lists; the oldest are left out when over maxEntries
+  uint32_t total = walkedCount + live;
+  uint32_t size = total < RECORDING_INITIAL_CAPACITY ? RECORDING_INITIAL_CAPACITY : total;
+  RecordingEntry *merged = (RecordingEntry *)malloc(sizeof(RecordingEntry) * size);
+  if (merged == NULL) {
+    free(keys);
+    return false;
+  }
+
+  uint32_t count = 0;
+  uint32_t w = 0;
+  uint32_t m = 0;
+  while (w < walkedCount || m < live) {
+    const RecordingEntry *next;
+    if (m >= live || (w < walkedCount && walked[w].start <= at(m).start)) {
+      next = &walked[w++];
+      NameKey probe = {nameHash(next->name), 0};
+      NameKey *found = live ? (NameKey *)bsearch(&probe, keys, live, sizeof(NameKey), compareKey) : NULL;
+      bool duplicate = false;
+      // bsearch lands on any key with this hash: check its neighbours too
+      for (NameKey *k = found; k && k > keys && (k - 1)->hash == probe.hash; k--) found = k - 1;
+      for (NameKey *k = found; k && k < keys + live && k->hash == probe.hash && !duplicate; k++) {
+        duplicate = strcmp(at(k->position).name, next->name) == 0;
+      }
+      if (duplicate) continue;
+    } else {
+      next = &at(m++);
+    }
+    merged[count++] = *next;
+  }
+  free(keys);
+  if (count > maxEntries) {
+    counters.dropped += count - maxEntries;
+    memmove(merged, merged + (count - maxEntries), sizeof(RecordingEntry) * maxEntries);
+    count = maxEntries;
+  }
+  free(walked);
+  walked = NULL;
+  walkedCount = 0;
+  walkedCapacity = 0;
+
+  free(entries);
+  entries = merged;
+  capacity = size;
+  head = 0;
+  live = count;
+  bytes = 0;
+  for (uint32_t i = 0; i < live; i++) bytes += entries[i].size;
+  rebuildActive = false;
+  rewrite();
+  return true;
+}
@@ -0,0 +1,172 @@
+/**
+ * Recording Index
+ *
+ * Catalog of the recordings and snapshots on the card, kept in RAM sorted
+ * by start time so retention never walks directories: the oldest entry is
+ * the head of the array, and evicting it is O(1) (advance the head, mark
+ * its record deleted, remove the file). Entries arrive in time order, so
+ * add() is an append; an older entry is inserted in place.
+ *
+ * Index file layout (little endian): a 16-byte header (magic u32, version
+ * u16, record size u16, 8 reserved), then 64-byte records that are only
+ * appended:
+ *   0  magic     u8   RECORDING_RECORD_MAGIC
+ *   1  deleted   u8   0 = live; set in place when the entry goes away
+ *   2  kind      u8   RecordingKind
+ *   3  trigger   u8   RecordingTrigger
+ *   4  start     u32  s since the epoch
+ *   8  duration  u32  ms (0 for snapshots)
+ *   12 size      u32  bytes
+ *   16 name      44   path below the recordings directory, NUL padded
+ *   60 crc       u32  CRC-32 of bytes 2..59
+ *
+ * load() stops at the first record that fails its check (a write cut short
+ * by a reset). Once deleted records outnumber live ones, or after damage,
+ * the file is rewritten from RAM into a temporary file that replaces it.
+ *
+ * A missing or unreadable index is rebuilt from a directory walk:
+ * beginRebuild(), rebuildAdd() per file, finishRebuild(). Entries added
+ * meanwhile are kept and win over the walk's entry for the same name.
+ *
+ * Files are reached through RecordingIndexStorage, so the index runs (and
+ * is checked) on a host. Not thread safe: the caller serializes all calls.
+ */
+
+#ifndef RECORDING_INDEX_H
+#define RECORDING_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RECORDING_NAME_LEN        44
+#define RECORDING_RECORD_SIZE     64
+#define RECORDING_HEADER_SIZE     16
+#define RECORDING_INDEX_MAGIC     0x58494352u   // "RCIX"
+#define RECORDING_RECORD_MAGIC    0xC5
+#define RECORDING_FORMAT_VERSION  1
+#define RECORDING_INITIAL_CAPACITY 256
+#define RECORDING_REWRITE_MIN     64            // deleted records before a rewrite
+#define RECORDING_IO_RECORDS      32            // records per storage read/write
+
+enum RecordingKind : uint8_t {
+  RECORDING_CLIP = 0,
+  RECORDING_SNAPSHOT
+};
+
+enum RecordingTrigger : uint8_t {
+  RECORDING_TRIGGER_UNKNOWN = 0,  // found by a rebuild
+  RECORDING_TRIGGER_MANUAL,
+  RECORDING_TRIGGER_MOTION,
+  RECORDING_TRIGGER_DETECTION,
+  RECORDING_TRIGGER_UPLOAD,
+  RECORDING_TRIGGER_COUNT
+};
+
+struct RecordingEntry {
+  uint32_t start;             // s since the epoch
+  uint32_t durationMs;
+  uint32_t size;
+  uint32_t slot;              // record number in the index file
+  uint8_t kind;
+  uint8_t trigger;
+  char name[RECORDING_NAME_LEN];
+};
+
+// The index file and the recordings it lists
+class RecordingIndexStorage {
+public:
+  virtual ~RecordingIndexStorage() {}
+  virtual uint32_t indexSize() = 0;   // 0 when missing
+  virtual size_t indexRead(uint32_t offset, uint8_t *dst, size_t len) = 0;
+  // Returns the bytes written (0 = nothing written)
+  virtual size_t indexAppend(const uint8_t *data, size_t len) = 0;
+  virtual bool indexWrite(uint32_t offset, const uint8_t *data, size_t len) = 0;
+  // A rewrite appends to a temporary file that replaces the index on commit
+  virtual size_t rewriteAppend(const uint8_t *data, size_t len) = 0;
+  virtual bool rewriteCommit() = 0;
+  virtual void rewriteAbort() = 0;
+  // Deletes a recording; true when it is gone (or was already)
+  virtual bool removeRecording(const char *name) = 0;
+};
+
+struct RecordingIndexStats {
+  uint32_t added;
+  uint32_t evicted;           // removed by retention
+  uint32_t forgotten;         // removed by forget()
+  uint32_t rewrites;
+  uint32_t writeErrors;
+  uint32_t damaged;           // loads that stopped at a bad record
+  uint32_t dropped;           // adds lost to a full index
+};
+
+class RecordingIndex {
+public:
+  RecordingIndex();
+  ~RecordingIndex();
+
+  // maxEntries bounds the RAM array (64 bytes per entry)
+  bool begin(RecordingIndexStorage *storage, uint32_t maxEntries);
+  void end();
+
+  // Reads the index file; false when it is missing or unusable and a
+  // rebuild is needed
+  bool load();
+
+  // Adds a recording (slot is ignored); false when the index is full
+  bool add(const RecordingEntry &entry);
+  // Drops the entry for name (the file is left alone)
+  bool forget(const char *name);
+  // Deletes the oldest recording and its entry; false when empty
+  bool evictOldest(RecordingEntry *evicted = NULL);
+
+  uint32_t count() const { return live; }
+  uint64_t totalBytes() const { return bytes; }
+  bool full() const { return live >= maxEntries; }
+  // i-th entry by start time (0 = oldest)
+  const RecordingEntry &at(uint32_t i) const { return entries[(head + i) % capacity]; }
+  // Position of the first entry with start >= time / > time
+  uint32_t lowerBound(uint32_t start) const;
+  uint32_t upperBound(uint32_t start) const;
+
+  void beginRebuild();
+  bool rebuildAdd(const RecordingEntry &entry);
+  // Merges the walk with the entries added meanwhile and writes a new file
+  bool finishRebuild();
+  bool rebuilding() const { return rebuildActive; }
+
+  const RecordingIndexStats &stats() const { return counters; }
+  uint32_t fileRecords() const { return records; }
+
+private:
+  RecordingIndexStorage *storage;
+  RecordingEntry *entries;    // ring: live entries from head, sorted by start
+  uint32_t capacity;
+  uint32_t head;
+  uint32_t live;
+  uint32_t maxEntries;
+  uint64_t bytes;
+  uint32_t records;           // records in the file, deleted ones included
+  bool fileOpen;              // the file has its header
+  bool dirty;                 // the file lags RAM until the next rewrite
+
+  bool rebuildActive;
+  RecordingEntry *walked;     // entries found by the rebuild walk
+  uint32_t walkedCount;
+  uint32_t walkedCapacity;
+
+  uint8_t *io;                // RECORDING_IO_RECORDS records
+  RecordingIndexStats counters;
+
+  RecordingEntry &slotAt(uint32_t i) { return entries[(head + i) % capacity]; }
+  bool grow(uint32_t newCapacity);
+  bool insert(const RecordingEntry &entry);
+  void removeAt(uint32_t position);
+  bool appendRecord(RecordingEntry &entry);
+  void markDeleted(const RecordingEntry &entry);
+  bool rewrite();
+  void maybeRewrite();
+  static void encode(const RecordingEntry &entry, uint8_t *record);
+  static bool decode(const uint8_t *record, RecordingEntry &entry, bool &deleted);
+};
+
+#endif // RECORDING_INDEX_H
@@ -0,0 +1,187 @@
+/**
+ * Per-route Request Metrics Implementation
+ */
+
+#include "route_metrics.h"
+#include "work_scheduler.h"
+
+RouteMetrics routeMetrics;
+
+// Histogram upper bounds for handler latency (microseconds)
+const uint32_t RouteMetrics::LATENCY_BOUNDS_US[ROUTE_METRICS_LATENCY_BUCKETS] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000
+};
+
+// AsyncWebServerResponse keeps its byte counter protected; a pointer to
+// member taken through a derived class gives read access without copying
+// or subclassing every response type
+struct ResponseCounters : public AsyncWebServerResponse {
+  using AsyncWebServerResponse::_writtenLength;
+};
+
+RouteMetrics::RouteStats::RouteStats(const char *route)
+  : route(route), next(NULL), count(0), latencySumUs(0), latencyMaxUs(0), bytesOut(0),
+    heapDeltaSum(0), heapDeltaMax(0), psramDeltaSum(0), psramDeltaMax(0) {
+  memset(statuses, 0, sizeof(statuses));
+  memset(latencyBuckets, 0, sizeof(latencyBuckets));
+}
+
+RouteMetrics::RouteMetrics()
+  : unmatched("unmatched"), untracked("other"), first(&unmatched), last(&untracked),
+    markedRequest(NULL), markedRoute(NULL) {
+  unmatched.next = &untracked;
+}
+
+AsyncWebHandler &RouteMetrics::track(AsyncWebHandler &handler, const char *route) {
+  RouteStats *stats = findOrCreate(route);
+  handler.addMiddleware([this, stats](AsyncWebServerRequest *request, ArMiddlewareNext next) {
+    mark(request, stats);
+    next();
+  });
+  return handler;
+}
+
+/**
+ * Wrap the matched handler: measure the time spent in the async_tcp callback
+ * and the memory it retained, then collect the bytes written once the client
+ * disconnects. All callbacks run on the async_tcp task, so no locking needed.
+ */
+void RouteMetrics::run(AsyncWebServerRequest *request, ArMiddlewareNext next) {
+  uint32_t heapBefore = ESP.getFreeHeap();
+  uint32_t psramBefore = ESP.getFreePsram();
+  uint32_t start = micros();
+
+  markedRequest = NULL;
+  next();
+
+  uint32_t elapsedUs = micros() - start;
+  workScheduler.noteCallback(CALLBACK_HANDLER, elapsedUs);
+  int32_t heapDelta = (int32_t)heapBefore - (int32_t)ESP.getFreeHeap();
+  int32_t psramDelta = (int32_t)psramBefore - (int32_t)ESP.getFreePsram();
+
+  RouteStats *stats = markedRequest == request ? markedRoute : &untracked;
+  markedRequest = NULL;
+
+  stats->count++;
+  recordLatency(*stats, elapsedUs);
+  stats->heapDeltaSum += heapDelta;
+  stats->psramDeltaSum += psramDelta;
+  if (heapDelta > stats->heapDeltaMax) stats->heapDeltaMax = heapDelta;
+  if (psramDelta > stats->psramDeltaMax) stats->psramDeltaMax = psramDelta;
+
+  const AsyncWebServerResponse *response = request->getResponse();
+  recordStatus(*stats, response ? response->code() : 0);
+
+  request->onDisconnect([request, stats]() {
+    const AsyncWebServerResponse *response = request->getResponse();
+    if (response) {
+      stats->bytesOut += response->*(&ResponseCounters::_writtenLength);
+    }
+  });
+}
+
+// Only called while routes are registered, so the list never changes while
+// requests are being counted
+RouteMetrics::RouteStats *RouteMetrics::findOrCreate(const char *route) {
+  for (RouteStats *stats = first; stats; stats = stats->next) {
+    if (strcmp(stats->route, route) == 0) {
+      return stats;
+    }
+  }
+
+  RouteStats *stats = new RouteStats(route);
+  last->next = stats;
+  last = stats;
+  return stats;
+}
+
+void RouteMetrics::recordStatus(RouteStats &stats, int code) {
+  for (uint8_t i = 0; i < ROUTE_METRICS_MAX_STATUS_CODES; i++) {
+    if (stats.statuses[i].code == code || stats.statuses[i].count == 0) {
+      stats.statuses[i].code = code;
+      stats.statuses[i].count++;
+      return;
+    }
+  }
+  // Too many distinct codes on one route - fold into the last entry
+  stats.statuses[ROUTE_METRICS_MAX_STATUS_CODES - 1].count++;
+}
+
+void RouteMetrics::recordLatency(RouteStats &stats, uint32_t elapsedUs) {
+  uint8_t bucket = 0;
+  while (bucket < ROUTE_METRICS_LATENCY_BUCKETS && elapsedUs > LATENCY_BOUNDS_US[bucket]) {
+    bucket++;
+  }
+  stats.latencyBuckets[bucket]++;
+  stats.latencySumUs += elapsedUs;
+  if (elapsedUs > stats.latencyMaxUs) stats.latencyMaxUs = elapsedUs;
+}
+
+void RouteMetrics::writePrometheus(Print &out) const {
+  out.print("# HELP http_requests_total Requests handled per route and status code.\n");
+  out.print("# TYPE http_requests_total counter\n");
+  for (const RouteStats *node = first; node; node = node->next) {
+    const RouteStats &stats = *node;
+    if (stats.count == 0) continue;
+    for (uint8_t s = 0; s < ROUTE_METRICS_MAX_STATUS_CODES && stats.statuses[s].count; s++) {
+      out.printf("http_requests_total{route=\"%s\",code=\"%u\"} %u\n",
+                 stats.route, stats.statuses[s].code, stats.statuses[s].count);
+    }
+  }
+
+  out.print("# HELP http_handler_duration_seconds Time spent in the request handler.\n");
+  out.print("# TYPE http_handler_duration_seconds histogram\n");
+  for (const RouteStats *node = first; node; node = node->next) {
+    const RouteStats &stats = *node;
+    if (stats.count == 0) continue;
+    const char *route = stats.route;
+    uint32_t cumulative = 0;
+    for (uint8_t b = 0; b < ROUTE_METRICS_LATENCY_BUCKETS; b++) {
+      cumulative += stats.latencyBuckets[b];
+      out.printf("http_handler_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %u\n",
+                 route, LATENCY_BOUNDS_US[b] / 1e6, cumulative);
+    }
+    out.printf("http_handler_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %u\n", route, stats.count);
+    out.printf("http_handler_duration_seconds_sum{route=\"%s\"} %.6f\n", route, stats.latencySumUs / 1e6);
+    out.printf("http_handler_duration_seconds_count{route=\"%s\"} %u\n", route, stats.count);
+  }
+
+  // Prometheus requires each metric family to be emitted as one group
+  auto writeFamily = [&](const char *name, const char *help, const char *type,
+                         void (*writeSeries)(Print &, const char *, const char *, const RouteStats &)) {
+    out.printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (const RouteStats *node = first; node; node = node->next) {
+      if (node->count == 0) continue;
+      writeSeries(out, name, node->route, *node);
+    }
+  };
+
+  writeFamily("http_handler_duration_max_seconds", "Slowest handler invocation per route.", "gauge",
+    [](Print &out, const char *name, const char *route, const RouteStats &stats) {
+      out.printf("%s{route=\"%s\"} %.6f\n", name, route, stats.latencyMaxUs / 1e6);
+    });
+  writeFamily("http_response_bytes_total", "Bytes written to the socket per route.", "counter",
+    [](Print &out, const char *name, const char *route, const RouteStats &stats) {
+      out.printf("%s{route=\"%s\"} %llu\n", name, route, stats.bytesOut);
+    });
+  writeFamily("http_handler_heap_delta_bytes", "Internal heap retained across the handler.", "gauge",
+    [](Print &out, const char *name, const char *route, const RouteStats &stats) {
+      out.printf("%s{route=\"%s\",stat=\"sum\"} %lld\n", name, route, stats.heapDeltaSum);
+      out.printf("%s{route=\"%s\",stat=\"max\"} %d\n", name, route, stats.heapDeltaMax);
+    });
+  writeFamily("http_handler_psram_delta_bytes", "PSRAM retained across the handler.", "gauge",
+    [](Print &out, const char *name, const char *route, const RouteStats &stats) {
+      out.printf("%s{route=\"%s\",stat=\"sum\"} %lld\n", name, route, stats.psramDeltaSum);
+      out.printf("%s{route=\"%s\",stat=\"max\"} %d\n", name, route, stats.psramDeltaMax);
+    });
+
+  out.print("# HELP esp_heap_free_bytes Free internal heap.\n");
+  out.print("# TYPE esp_heap_free_bytes gauge\n");
+  out.printf("esp_heap_free_bytes %u\n", ESP.getFreeHeap());
+  out.print("# HELP esp_heap_min_free_bytes Lowest free internal heap since boot.\n");
+  out.print("# TYPE esp_heap_min_free_bytes gauge\n");
+  out.printf("esp_heap_min_free_bytes %u\n", ESP.getMinFreeHeap());
+  out.print("# HELP esp_psram_free_bytes Free PSRAM.\n");
+  out.print("# TYPE esp_psram_free_bytes gauge\n");
+  out.printf("esp_psram_free_bytes %u\n", ESP.getFreePsram());
+}
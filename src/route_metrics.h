@@ -0,0 +1,85 @@
+/**
+ * Per-route Request Metrics
+ *
+ * Server-wide middleware that records, for every route, the request count,
+ * status codes, handler latency histogram, bytes sent and the heap/PSRAM
+ * change across the handler. Exported in Prometheus text format.
+ *
+ * Series are keyed by the pattern a handler was registered with, never by
+ * the request URL, so the label set is fixed at boot: one series per
+ * tracked route plus "unmatched" (404s) and "other" (untracked handlers).
+ */
+
+#ifndef ROUTE_METRICS_H
+#define ROUTE_METRICS_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#define ROUTE_METRICS_MAX_STATUS_CODES 6
+#define ROUTE_METRICS_LATENCY_BUCKETS  10
+
+class RouteMetrics : public AsyncMiddleware {
+public:
+  RouteMetrics();
+
+  void run(AsyncWebServerRequest *request, ArMiddlewareNext next) override;
+
+  // Gives a handler its own series under the given label (its registered
+  // pattern). Handlers registered with the same label share one series
+  AsyncWebHandler &track(AsyncWebHandler &handler, const char *route);
+
+  // Called from onNotFound so unmatched URLs share one series instead of
+  // creating a new label per random path
+  void markUnmatched(AsyncWebServerRequest *request) { mark(request, &unmatched); }
+
+  // Writes all series in Prometheus text exposition format
+  void writePrometheus(Print &out) const;
+
+private:
+  struct StatusCount {
+    uint16_t code;
+    uint32_t count;
+  };
+
+  struct RouteStats {
+    explicit RouteStats(const char *route);
+
+    const char *route;
+    RouteStats *next;
+    uint32_t count;
+    StatusCount statuses[ROUTE_METRICS_MAX_STATUS_CODES];
+    uint32_t latencyBuckets[ROUTE_METRICS_LATENCY_BUCKETS + 1];  // last = +Inf
+    uint64_t latencySumUs;
+    uint32_t latencyMaxUs;
+    uint64_t bytesOut;
+    int64_t heapDeltaSum;
+    int32_t heapDeltaMax;
+    int64_t psramDeltaSum;
+    int32_t psramDeltaMax;
+  };
+
+  static const uint32_t LATENCY_BOUNDS_US[ROUTE_METRICS_LATENCY_BUCKETS];
+
+  // One node per tracked route, allocated at registration
+  RouteStats unmatched;
+  RouteStats untracked;
+  RouteStats *first;
+  RouteStats *last;
+
+  // Set by the handler's own middleware, which runs inside run()'s next()
+  AsyncWebServerRequest *markedRequest;
+  RouteStats *markedRoute;
+
+  void mark(AsyncWebServerRequest *request, RouteStats *stats) {
+    markedRequest = request;
+    markedRoute = stats;
+  }
+  RouteStats *findOrCreate(const char *route);
+  void recordStatus(RouteStats &stats, int code);
+  void recordLatency(RouteStats &stats, uint32_t elapsedUs);
+};
+
+extern RouteMetrics routeMetrics;
+
+#endif // ROUTE_METRICS_H
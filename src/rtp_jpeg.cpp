@@ -0,0 +1,211 @@
+/**
+ * RTP/JPEG Packetizer Implementation
+ */
+
+#include "rtp_jpeg.h"
+#include "jpeg_crop.h"
+#include <string.h>
+
+// JPEG markers
+#define M_SOF0  0xC0
+#define M_SOF15 0xCF
+#define M_DHT   0xC4
+#define M_JPG   0xC8
+#define M_DAC   0xCC
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_DRI   0xDD
+
+#define DYNAMIC_Q      255      // quantization tables in-band
+#define EOI_SEARCH     1024     // frames may carry padding after the EOI
+
+static inline uint16_t readU16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void putU16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+static inline void putU32(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+// The receiver rebuilds the Annex K tables; a table that differs would
+// decode as garbage
+static bool standardTable(const uint8_t *table, size_t size) {
+  size_t pos = 0;
+  while (pos + 17 <= JPEG_STANDARD_DHT_SIZE) {
+    size_t count = 0;
+    for (uint8_t i = 1; i <= 16; i++) count += JPEG_STANDARD_DHT[pos + i];
+    if (JPEG_STANDARD_DHT[pos] == table[0]) {
+      return size == 17 + count && memcmp(JPEG_STANDARD_DHT + pos, table, size) == 0;
+    }
+    pos += 17 + count;
+  }
+  return false;
+}
+
+const char *rtpJpegParse(const uint8_t *jpeg, size_t len, RtpJpegFrame &frame) {
+  memset(&frame, 0, sizeof(frame));
+  if (len < 4 || jpeg[0] != 0xFF || jpeg[1] != M_SOI) return "Not a JPEG";
+
+  const uint8_t *tables[4] = {NULL, NULL, NULL, NULL};
+  bool haveFrame = false;
+  size_t pos = 2;
+  while (pos + 4 <= len) {
+    if (jpeg[pos] != 0xFF) return "Bad marker";
+    uint8_t marker = jpeg[pos + 1];
+    if (marker == 0xFF) {
+      pos++;                  // fill byte
+      continue;
+    }
+    uint16_t length = readU16(jpeg + pos + 2);
+    if (length < 2 || pos + 2 + length > len) return "Truncated header";
+    const uint8_t *seg = jpeg + pos + 4;
+    size_t segSize = length - 2;
+
+    if (marker == M_DQT) {
+      for (size_t i = 0; i < segSize; i += 65) {
+        if (seg[i] >> 4) return "16-bit quantization tables";
+        if ((seg[i] & 0x0F) > 3 || i + 65 > segSize) return "Bad DQT";
+        tables[seg[i] & 0x0F] = seg + i + 1;
+      }
+    } else if (marker == M_SOF0) {
+      if (segSize < 6 || seg[0] != 8) return "Bad SOF";
+      if (seg[5] != 3) return "Not a colour JPEG";
+      if (segSize < 15) return "Bad SOF";
+      frame.height = readU16(seg + 1);
+      frame.width = readU16(seg + 3);
+      uint8_t luma = seg[7];
+      if (luma == 0x21) frame.type = 0;
+      else if (luma == 0x22) frame.type = 1;
+      else return "Sampling is not 4:2:2 or 4:2:0";
+      if (seg[10] != 0x11 || seg[13] != 0x11) return "Sampling is not 4:2:2 or 4:2:0";
+      if (seg[8] != 0 || seg[11] != seg[14] || seg[11] > 1) return "Unsupported quantization table layout";
+      frame.tableCount = seg[11] + 1;
+      haveFrame = true;
+    } else if (marker > M_SOF0 && marker <= M_SOF15 && marker != M_DHT && marker != M_JPG && marker != M_DAC) {
+      return "Not a baseline JPEG";
+    } else if (marker == M_DHT) {
+      for (size_t i = 0; i < segSize;) {
+        if (i + 17 > segSize) return "Bad DHT";
+        size_t count = 0;
+        for (uint8_t b = 1; b <= 16; b++) count += seg[i + b];
+        if (i + 17 + count > segSize) return "Bad DHT";
+        if (!standardTable(seg + i, 17 + count)) return "Custom Huffman tables";
+        i += 17 + count;
+      }
+    } else if (marker == M_DRI) {
+      if (segSize < 2) return "Bad DRI";
+      frame.restartInterval = readU16(seg);
+    } else if (marker == M_SOS) {
+      if (!haveFrame) return "No SOF before SOS";
+      if (segSize < 10 || seg[0] != 3) return "Bad SOS";
+      if (seg[2] != 0x00 || seg[4] != 0x11 || seg[6] != 0x11) return "Unsupported Huffman table layout";
+      pos += 2 + length;
+      size_t end = len;
+      size_t stop = len > EOI_SEARCH + pos ? len - EOI_SEARCH : pos;
+      for (size_t i = len; i >= stop + 2; i--) {
+        if (jpeg[i - 2] == 0xFF && jpeg[i - 1] == M_EOI) {
+          end = i - 2;
+          break;
+        }
+      }
+      frame.scan = jpeg + pos;
+      frame.scanLength = (uint32_t)(end - pos);
+      break;
+    }
+    pos += 2 + length;
+  }
+
+  if (frame.scan == NULL) return "No scan";
+  if (frame.width == 0 || frame.height == 0 ||
+      frame.width > RTP_JPEG_MAX_DIMENSION || frame.height > RTP_JPEG_MAX_DIMENSION) {
+    return "Image size not representable";
+  }
+  for (uint8_t t = 0; t < frame.tableCount; t++) {
+    if (tables[t] == NULL) return "Missing quantization table";
+    frame.tables[t] = tables[t];
+  }
+  if (frame.restartInterval) frame.type += 64;
+  return NULL;
+}
+
+RtpJpegPacketizer::RtpJpegPacketizer() : source(0), nextSequence(0) {
+}
+
+void RtpJpegPacketizer::begin(uint32_t ssrc, uint16_t firstSequence) {
+  source = ssrc;
+  nextSequence = firstSequence;
+}
+
+size_t RtpJpegPacketizer::bufferSize(uint32_t scanLength, size_t maxPacket) {
+  size_t header = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + RTP_JPEG_RESTART_SIZE;
+  size_t tables = RTP_JPEG_QTABLE_SIZE + 2 * 64;
+  size_t packets = (scanLength + tables) / (maxPacket - header) + 1;
+  return scanLength + tables + packets * header;
+}
+
+uint16_t RtpJpegPacketizer::packetize(const RtpJpegFrame &frame, uint32_t timestamp, size_t maxPacket,
+                                      uint8_t *out, size_t outCapacity, uint16_t *sizes, uint16_t maxPackets) {
+  size_t fixed = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + (frame.restartInterval ? RTP_JPEG_RESTART_SIZE : 0);
+  size_t tableBytes = RTP_JPEG_QTABLE_SIZE + 64 * frame.tableCount;
+  if (maxPacket < RTP_JPEG_MIN_PACKET || maxPacket <= fixed + tableBytes) return 0;
+
+  uint16_t sequence = nextSequence;
+  uint16_t count = 0;
+  size_t used = 0;
+  uint32_t offset = 0;
+  do {
+    bool first = offset == 0;
+    size_t header = fixed + (first ? tableBytes : 0);
+    uint32_t payload = frame.scanLength - offset;
+    if (payload > maxPacket - header) payload = (uint32_t)(maxPacket - header);
+    if (count == maxPackets || used + header + payload > outCapacity) return 0;
+    bool last = offset + payload == frame.scanLength;
+
+    uint8_t *p = out + used;
+    p[0] = 0x80;                                   // version 2
+    p[1] = (uint8_t)((last ? 0x80 : 0) | RTP_JPEG_PAYLOAD_TYPE);
+    putU16(p + 2, sequence);
+    putU32(p + 4, timestamp);
+    putU32(p + 8, source);
+    p += RTP_HEADER_SIZE;
+
+    putU32(p, offset);                             // type-specific 0, 24-bit fragment offset
+    p[4] = frame.type;
+    p[5] = DYNAMIC_Q;
+    p[6] = (uint8_t)((frame.width + 7) / 8);
+    p[7] = (uint8_t)((frame.height + 7) / 8);
+    p += RTP_JPEG_HEADER_SIZE;
+
+    if (frame.restartInterval) {
+      putU16(p, frame.restartInterval);
+      putU16(p + 2, 0xFFFF);                       // F = L = 1, count 0x3FFF: not aligned
+      p += RTP_JPEG_RESTART_SIZE;
+    }
+    if (first) {
+      p[0] = 0;                                    // MBZ
+      p[1] = 0;                                    // 8-bit tables
+      putU16(p + 2, (uint16_t)(64 * frame.tableCount));
+      p += RTP_JPEG_QTABLE_SIZE;
+      for (uint8_t t = 0; t < frame.tableCount; t++, p += 64) memcpy(p, frame.tables[t], 64);
+    }
+    memcpy(p, frame.scan + offset, payload);
+
+    sizes[count++] = (uint16_t)(header + payload);
+    used += header + payload;
+    offset += payload;
+    sequence++;
+  } while (offset < frame.scanLength);
+
+  nextSequence = sequence;
+  return count;
+}
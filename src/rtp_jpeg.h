@@ -0,0 +1,76 @@
+/**
+ * RTP/JPEG Packetizer (RFC 2435)
+ *
+ * Splits a baseline JPEG into RTP packets (payload type 26) without
+ * touching the image: only the entropy-coded scan is carried, and the
+ * receiver rebuilds the JPEG headers from a small per-packet header.
+ *
+ * - Type 0 (4:2:2, the OV2640's sampling) and type 1 (4:2:0) colour JPEGs
+ *   with the Annex K Huffman tables; grayscale or custom Huffman tables
+ *   cannot be described by RFC 2435 and are rejected by rtpJpegParse().
+ * - Quantization tables go in-band (Q = 255) in the first packet of every
+ *   frame, so a quality change reaches the receiver with the next frame.
+ * - Restart intervals (DRI) use types 64/65 with a restart header on every
+ *   packet. Fragments are not aligned to restart intervals (F = L = 1,
+ *   count 0x3FFF), as the RFC allows.
+ *
+ * One packetize() writes every packet of a frame back to back into one
+ * buffer, so the same packets can be sent to several receivers. No
+ * Arduino dependencies, so it can be built (and checked against a standard
+ * receiver) on a host.
+ */
+
+#ifndef RTP_JPEG_H
+#define RTP_JPEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RTP_JPEG_PAYLOAD_TYPE   26
+#define RTP_JPEG_CLOCK_HZ       90000
+#define RTP_HEADER_SIZE         12
+#define RTP_JPEG_HEADER_SIZE    8
+#define RTP_JPEG_RESTART_SIZE   4
+#define RTP_JPEG_QTABLE_SIZE    4     // header before the tables
+#define RTP_JPEG_MAX_DIMENSION  2040  // width and height travel in units of 8 pixels
+#define RTP_JPEG_MIN_PACKET     256
+
+struct RtpJpegFrame {
+  uint8_t type;                 // RFC 2435 type, +64 with restart markers
+  uint16_t width;
+  uint16_t height;
+  uint16_t restartInterval;     // MCUs (0 = none)
+  uint8_t tableCount;           // 1 (all components share table 0) or 2
+  const uint8_t *tables[2];     // 64 bytes each, zigzag order, in the JPEG
+  const uint8_t *scan;          // entropy-coded data, EOI excluded
+  uint32_t scanLength;
+};
+
+// Reads the headers of a baseline JPEG. Returns NULL when the frame can be
+// sent as RTP/JPEG, else the reason it cannot.
+const char *rtpJpegParse(const uint8_t *jpeg, size_t len, RtpJpegFrame &frame);
+
+class RtpJpegPacketizer {
+public:
+  RtpJpegPacketizer();
+
+  void begin(uint32_t ssrc, uint16_t firstSequence);
+
+  // Writes the packets of one frame (each at most maxPacket bytes) back to
+  // back into out and their lengths into sizes. Returns the packet count,
+  // 0 when out or sizes is too small (the sequence is then not advanced).
+  uint16_t packetize(const RtpJpegFrame &frame, uint32_t timestamp, size_t maxPacket,
+                     uint8_t *out, size_t outCapacity, uint16_t *sizes, uint16_t maxPackets);
+
+  // Buffer needed for a frame whose scan is scanLength bytes
+  static size_t bufferSize(uint32_t scanLength, size_t maxPacket);
+
+  uint32_t ssrc() const { return source; }
+  uint16_t sequence() const { return nextSequence; }
+
+private:
+  uint32_t source;
+  uint16_t nextSequence;
+};
+
+#endif // RTP_JPEG_H
@@ -0,0 +1,351 @@
+/**
+ * RTP/UDP Streaming Implementation
+ */
+
+#include "rtp_streamer.h"
+#include "logger.h"
+#include <esp_camera.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <lwip/sockets.h>
+#include <errno.h>
+
+extern bool cameraActive;
+
+RtpStreamer rtpStreamer;
+
+// A send target for one frame, copied from the receiver list
+struct RtpTarget {
+  struct sockaddr_in addr;
+  uint32_t ip;
+  uint16_t port;
+  uint16_t sent;
+  bool failed;
+};
+
+static bool retryable(int error) {
+  return error == EAGAIN || error == EWOULDBLOCK || error == ENOMEM || error == ENOBUFS;
+}
+
+RtpStreamer::RtpStreamer()
+  : task(NULL), receiverCount(0), sock(-1), timestampBase(0), buffer(NULL), bufferCapacity(0), frames(0),
+    packets(0), bytes(0), lateFrames(0), rejectedFrames(0), captureFailures(0), backoffs(0), lastReject(NULL),
+    latencySumUs(0), latencyMaxUs(0), lastFrameBytes(0), lastFramePackets(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(&config, 0, sizeof(config));
+  memset(receivers, 0, sizeof(receivers));
+}
+
+bool RtpStreamer::begin(const StreamSettings &settings) {
+  configure(settings);
+  packetizer.begin(esp_random(), (uint16_t)esp_random());
+  timestampBase = esp_random();
+  if (xTaskCreatePinnedToCore(taskEntry, "rtp", RTP_STACK_SIZE, this, RTP_PRIORITY, &task, RTP_CORE) != pdPASS) {
+    LOGW(TAG_CAMERA, "RTP: task start failed");
+    return false;
+  }
+  return true;
+}
+
+void RtpStreamer::configure(const StreamSettings &settings) {
+  portENTER_CRITICAL(&lock);
+  config = settings;
+  if (!settings.rtpEnabled) {
+    memset(receivers, 0, sizeof(receivers));
+    receiverCount = 0;
+  }
+  portEXIT_CRITICAL(&lock);
+  if (task) xTaskNotifyGive(task);
+}
+
+const char *RtpStreamer::start(IPAddress ip, uint16_t port) {
+  uint32_t addr = (uint32_t)ip;
+  if (port == 0) return "Invalid port";
+  // Multicast, broadcast and loopback would put every frame on the air for nobody
+  if (addr == 0 || ip[0] == 127 || ip[0] >= 224) return "Unicast receivers only";
+
+  const char *error = NULL;
+  bool added = false;
+  portENTER_CRITICAL(&lock);
+  if (!config.rtpEnabled) {
+    error = "RTP streaming disabled";
+  } else {
+    int slot = -1;
+    for (int i = 0; i < RTP_MAX_RECEIVERS; i++) {
+      if (receivers[i].ip == addr && receivers[i].port == port) {
+        slot = i;
+        break;
+      }
+      if (receivers[i].ip == 0 && slot < 0) slot = i;
+    }
+    if (slot < 0) {
+      error = "Too many receivers";
+    } else {
+      RtpReceiver &receiver = receivers[slot];
+      if (receiver.ip == 0) {
+        memset(&receiver, 0, sizeof(receiver));
+        receiver.ip = addr;
+        receiver.port = port;
+        receiverCount++;
+        added = true;
+      }
+      receiver.renewedMs = millis();
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if (added) {
+    LOGI_S(TAG_CAMERA, "RTP: streaming to %s port %d", ip.toString().c_str(), port);
+    if (task) xTaskNotifyGive(task);
+  }
+  return error;
+}
+
+bool RtpStreamer::stop(IPAddress ip, uint16_t port) {
+  uint32_t addr = (uint32_t)ip;
+  bool found = false;
+  portENTER_CRITICAL(&lock);
+  for (int i = 0; i < RTP_MAX_RECEIVERS; i++) {
+    if (receivers[i].ip == addr && receivers[i].port == port) {
+      receivers[i].ip = 0;
+      receiverCount--;
+      found = true;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+  if (found) LOGI_S(TAG_CAMERA, "RTP: stopped %s port %d", ip.toString().c_str(), port);
+  return found;
+}
+
+String RtpStreamer::sdp(IPAddress ip, uint16_t port) const {
+  IPAddress local = WiFi.status() == WL_CONNECTED ? WiFi.localIP() : WiFi.softAPIP();
+  String out = "v=0\r\n";
+  out += "o=- " + String(packetizer.ssrc()) + " 1 IN IP4 " + local.toString() + "\r\n";
+  out += "s=ESP32-CAM\r\n";
+  out += "c=IN IP4 " + ip.toString() + "\r\n";
+  out += "t=0 0\r\n";
+  out += "m=video " + String(port) + " RTP/AVP " + String(RTP_JPEG_PAYLOAD_TYPE) + "\r\n";
+  out += "a=rtpmap:" + String(RTP_JPEG_PAYLOAD_TYPE) + " JPEG/" + String(RTP_JPEG_CLOCK_HZ) + "\r\n";
+  out += "a=framerate:" + String(config.rtpFps) + "\r\n";
+  out += "a=recvonly\r\n";
+  return out;
+}
+
+// ---------------------------------------------------------------------------
+// Sender task
+
+void RtpStreamer::taskEntry(void *param) {
+  ((RtpStreamer *)param)->run();
+}
+
+void RtpStreamer::run() {
+  uint32_t nextFrameMs = 0;
+  for (;;) {
+    portENTER_CRITICAL(&lock);
+    StreamSettings settings = config;
+    portEXIT_CRITICAL(&lock);
+
+    uint32_t now = millis();
+    expireReceivers(now);
+    if (!settings.rtpEnabled || receiverCount == 0 || !cameraActive) {
+      nextFrameMs = 0;
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RTP_IDLE_MS));
+      continue;
+    }
+
+    uint32_t interval = 1000 / settings.rtpFps;
+    if (nextFrameMs && (int32_t)(nextFrameMs - now) > 0) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(nextFrameMs - now));
+      continue;
+    }
+    // Keep the cadence, unless a frame overran a whole interval
+    nextFrameMs = (nextFrameMs && now - nextFrameMs < interval ? nextFrameMs : now) + interval;
+
+    if (sock < 0 && !openSocket()) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RTP_IDLE_MS));
+      continue;
+    }
+    sendFrame(settings);
+  }
+}
+
+bool RtpStreamer::openSocket() {
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0) {
+    LOGW(TAG_CAMERA, "RTP: socket failed (%d)", errno);
+    return false;
+  }
+  return true;
+}
+
+void RtpStreamer::expireReceivers(uint32_t nowMs) {
+  portENTER_CRITICAL(&lock);
+  uint32_t timeoutMs = (uint32_t)config.rtpTimeoutS * 1000;
+  uint32_t expired = 0;
+  for (int i = 0; i < RTP_MAX_RECEIVERS; i++) {
+    if (receivers[i].ip && timeoutMs && nowMs - receivers[i].renewedMs > timeoutMs) {
+      receivers[i].ip = 0;
+      receiverCount--;
+      expired++;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+  if (expired) LOGI(TAG_CAMERA, "RTP: %u session(s) expired", expired);
+}
+
+// Grows the packet buffer (PSRAM) with some slack for larger frames
+void RtpStreamer::ensureBuffer(size_t size) {
+  if (size <= bufferCapacity) return;
+  free(buffer);
+  bufferCapacity = size + size / 4;
+  buffer = (uint8_t *)heap_caps_malloc(bufferCapacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (buffer == NULL) bufferCapacity = 0;
+}
+
+void RtpStreamer::sendFrame(const StreamSettings &settings) {
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (!fb) {
+    captureFailures++;
+    return;
+  }
+  int64_t capturedUs = esp_timer_get_time();
+
+  // Packetize straight out of the frame buffer, then hand it back before
+  // anything is sent
+  RtpJpegFrame frame;
+  const char *reason = fb->format == PIXFORMAT_JPEG ? rtpJpegParse(fb->buf, fb->len, frame) : "Raw pixel format";
+  uint16_t count = 0;
+  if (reason == NULL) {
+    ensureBuffer(RtpJpegPacketizer::bufferSize(frame.scanLength, settings.rtpPacketBytes));
+    uint32_t timestamp = timestampBase + (uint32_t)(capturedUs * (RTP_JPEG_CLOCK_HZ / 1000) / 1000);
+    if (buffer) {
+      count = packetizer.packetize(frame, timestamp, settings.rtpPacketBytes, buffer, bufferCapacity, sizes,
+                                   RTP_MAX_PACKETS);
+    }
+    if (count == 0) reason = buffer ? "Frame too large" : "Out of memory";
+  }
+  esp_camera_fb_return(fb);
+  if (reason) {
+    if (rejectedFrames++ % 100 == 0) LOGW_S(TAG_CAMERA, "RTP: frame not sent (%s)", reason);
+    lastReject = reason;
+    return;
+  }
+
+  RtpTarget targets[RTP_MAX_RECEIVERS];
+  uint8_t targetCount = 0;
+  portENTER_CRITICAL(&lock);
+  for (int i = 0; i < RTP_MAX_RECEIVERS; i++) {
+    if (receivers[i].ip == 0) continue;
+    RtpTarget &target = targets[targetCount++];
+    memset(&target, 0, sizeof(target));
+    target.addr.sin_family = AF_INET;
+    target.addr.sin_port = htons(receivers[i].port);
+    target.addr.sin_addr.s_addr = receivers[i].ip;
+    target.ip = receivers[i].ip;
+    target.port = receivers[i].port;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  // Packet-major, so every receiver gets the start of the frame before the
+  // slowest one holds anybody up
+  int64_t deadlineUs = capturedUs + (int64_t)settings.rtpMaxLateMs * 1000;
+  bool late = false;
+  size_t offset = 0;
+  uint32_t sentBytes = 0;
+  for (uint16_t p = 0; p < count && !late; p++) {
+    for (uint8_t t = 0; t < targetCount && !late; t++) {
+      RtpTarget &target = targets[t];
+      if (target.failed) continue;
+      while (sendto(sock, buffer + offset, sizes[p], MSG_DONTWAIT, (struct sockaddr *)&target.addr,
+                    sizeof(target.addr)) < 0) {
+        if (!retryable(errno)) {
+          target.failed = true;
+          break;
+        }
+        if (esp_timer_get_time() > deadlineUs) {
+          late = true;
+          break;
+        }
+        backoffs++;
+        vTaskDelay(1);
+      }
+      if (!target.failed && !late) {
+        target.sent++;
+        sentBytes += sizes[p];
+      }
+    }
+    offset += sizes[p];
+  }
+
+  uint32_t sentPackets = 0;
+  portENTER_CRITICAL(&lock);
+  for (uint8_t t = 0; t < targetCount; t++) {
+    sentPackets += targets[t].sent;
+    for (int i = 0; i < RTP_MAX_RECEIVERS; i++) {
+      RtpReceiver &receiver = receivers[i];
+      if (receiver.ip != targets[t].ip || receiver.port != targets[t].port) continue;
+      receiver.packets += targets[t].sent;
+      if (targets[t].failed) receiver.errors++;
+      else if (!late) receiver.frames++;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+
+  packets += sentPackets;
+  bytes += sentBytes;
+  lastFrameBytes = (uint32_t)offset;
+  lastFramePackets = count;
+  if (late) {
+    lateFrames++;
+    return;
+  }
+  frames++;
+  uint32_t latency = (uint32_t)(esp_timer_get_time() - capturedUs);
+  latencySumUs += latency;
+  if (latency > latencyMaxUs) latencyMaxUs = latency;
+}
+
+void RtpStreamer::reportStatus(JsonObject out) const {
+  portENTER_CRITICAL(&lock);
+  StreamSettings settings = config;
+  RtpReceiver list[RTP_MAX_RECEIVERS];
+  memcpy(list, receivers, sizeof(list));
+  portEXIT_CRITICAL(&lock);
+
+  out["enabled"] = settings.rtpEnabled;
+  if (!settings.rtpEnabled) return;
+  out["fps"] = settings.rtpFps;
+  out["packet_bytes"] = settings.rtpPacketBytes;
+  out["ssrc"] = packetizer.ssrc();
+
+  uint32_t now = millis();
+  JsonArray sessions = out["receivers"].to<JsonArray>();
+  for (int i = 0; i < RTP_MAX_RECEIVERS; i++) {
+    const RtpReceiver &receiver = list[i];
+    if (receiver.ip == 0) continue;
+    JsonObject session = sessions.add<JsonObject>();
+    session["host"] = IPAddress(receiver.ip).toString();
+    session["port"] = receiver.port;
+    session["frames"] = receiver.frames;
+    session["packets"] = receiver.packets;
+    session["errors"] = receiver.errors;
+    if (settings.rtpTimeoutS) {
+      uint32_t idle = (now - receiver.renewedMs) / 1000;
+      session["expires_in_s"] = idle < settings.rtpTimeoutS ? settings.rtpTimeoutS - idle : 0;
+    }
+  }
+
+  out["frames"] = frames;
+  out["packets"] = packets;
+  out["bytes"] = bytes;
+  out["late_frames"] = lateFrames;
+  out["rejected_frames"] = rejectedFrames;
+  if (lastReject) out["last_reject"] = lastReject;
+  out["capture_failures"] = captureFailures;
+  out["backoffs"] = backoffs;
+  out["latency_avg_ms"] = frames ? (uint32_t)(latencySumUs / frames / 1000) : 0;
+  out["latency_max_ms"] = latencyMaxUs / 1000;
+  out["last_frame_bytes"] = lastFrameBytes;
+  out["last_frame_packets"] = lastFramePackets;
+}
@@ -0,0 +1,104 @@
+/**
+ * RTP/UDP Streaming
+ *
+ * Low-latency alternative to the MJPEG /stream: camera frames go out as
+ * RTP/JPEG (RFC 2435, rtp_jpeg.h) over UDP to up to RTP_MAX_RECEIVERS
+ * unicast receivers. There is no TCP underneath, so a lost packet costs one
+ * frame instead of stalling every later one behind a retransmission.
+ *
+ * - Sessions are started with POST /api/rtp/start, which answers with the
+ *   SDP a player (ffplay, VLC, GStreamer) opens. A session not renewed
+ *   within stream.rtp_timeout_s is dropped, so a vanished receiver does not
+ *   keep the radio busy.
+ * - Each frame is parsed and packetized once, straight out of the camera
+ *   buffer (which is then returned), and the same packets are sent to every
+ *   receiver: packet n goes to all of them before packet n + 1.
+ * - Sends never block. When lwIP is out of buffers the task backs off one
+ *   tick and retries; a frame still unsent stream.rtp_max_late_ms after
+ *   capture is abandoned and the next one is sent instead.
+ * - Only the sensor's JPEG pixel format can be sent; raw formats would need
+ *   the web server's encoder.
+ *
+ * No RTCP: receivers get no sender reports, which players only need for
+ * A/V sync. Served at /api/rtp and in /api/health/status.
+ */
+
+#ifndef RTP_STREAMER_H
+#define RTP_STREAMER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include "config_store.h"
+#include "rtp_jpeg.h"
+
+#define RTP_MAX_RECEIVERS   4
+#define RTP_MAX_PACKETS     512      // per frame; larger frames are dropped
+#define RTP_STACK_SIZE      4096
+#define RTP_PRIORITY        2
+#define RTP_CORE            0        // next to the lwIP and WiFi tasks
+#define RTP_IDLE_MS         1000     // wake-up without receivers
+
+struct RtpReceiver {
+  uint32_t ip;                 // network byte order (0 = free slot)
+  uint16_t port;
+  uint32_t renewedMs;
+  uint32_t frames;             // sent whole
+  uint32_t packets;
+  uint32_t errors;             // frames cut short by a send error
+};
+
+class RtpStreamer {
+public:
+  RtpStreamer();
+
+  bool begin(const StreamSettings &settings);
+  void configure(const StreamSettings &settings);
+
+  // Adds or renews a receiver. Returns NULL on success, else the reason.
+  const char *start(IPAddress ip, uint16_t port);
+  bool stop(IPAddress ip, uint16_t port);
+  // Session description for a receiver
+  String sdp(IPAddress ip, uint16_t port) const;
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  static void taskEntry(void *param);
+  void run();
+  bool openSocket();
+  void expireReceivers(uint32_t nowMs);
+  void sendFrame(const StreamSettings &settings);
+  void ensureBuffer(size_t size);
+
+  TaskHandle_t task;
+  mutable portMUX_TYPE lock;
+  StreamSettings config;
+  RtpReceiver receivers[RTP_MAX_RECEIVERS];
+  uint8_t receiverCount;
+
+  int sock;
+  RtpJpegPacketizer packetizer;
+  uint32_t timestampBase;      // random, as RFC 3550 asks
+  uint8_t *buffer;             // PSRAM, all packets of one frame
+  size_t bufferCapacity;
+  uint16_t sizes[RTP_MAX_PACKETS];
+
+  // Statistics (task writes, reportStatus reads)
+  uint32_t frames;
+  uint32_t packets;
+  uint64_t bytes;
+  uint32_t lateFrames;         // abandoned at rtp_max_late_ms
+  uint32_t rejectedFrames;     // not RFC 2435 compatible or too large
+  uint32_t captureFailures;
+  uint32_t backoffs;           // lwIP out of buffers
+  const char *lastReject;
+  uint64_t latencySumUs;       // capture to last packet sent
+  uint32_t latencyMaxUs;
+  uint32_t lastFrameBytes;
+  uint16_t lastFramePackets;
+};
+
+extern RtpStreamer rtpStreamer;
+
+#endif // RTP_STREAMER_H
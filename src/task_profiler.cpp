@@ -0,0 +1,235 @@
+/**
+ * Task Profiler Implementation
+ */
+
+#include "task_profiler.h"
+#include "logger.h"
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+TaskProfiler taskProfiler;
+
+static const char *const TASK_STATE_NAMES[] = {"running", "ready", "blocked", "suspended", "deleted", "invalid"};
+
+TaskProfiler::TaskProfiler()
+  : task(NULL), status(NULL), head(0), samples(0), runTimeStats(false), historyHead(0), historyCount(0),
+    snapshots(0), overflows(0), lastSampleUs(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(idle, 0, sizeof(idle));
+  memset(profiles, 0, sizeof(profiles));
+  memset(totalTime, 0, sizeof(totalTime));
+  memset(history, 0, sizeof(history));
+}
+
+bool TaskProfiler::begin() {
+  status = (TaskStatus_t *)heap_caps_malloc(sizeof(TaskStatus_t) * TASK_PROFILER_MAX_TASKS, MALLOC_CAP_SPIRAM);
+  if (status == NULL) {
+    status = (TaskStatus_t *)malloc(sizeof(TaskStatus_t) * TASK_PROFILER_MAX_TASKS);
+  }
+  if (status == NULL) {
+    LOGW(TAG_SYSTEM, "Task profiler: out of memory");
+    return false;
+  }
+  for (int core = 0; core < TASK_PROFILER_CORES; core++) {
+    idle[core] = xTaskGetIdleTaskHandleForCPU(core);
+  }
+  if (xTaskCreatePinnedToCore(taskEntry, "task_prof", TASK_PROFILER_STACK_SIZE, this, TASK_PROFILER_PRIORITY,
+                              &task, TASK_PROFILER_CORE) != pdPASS) {
+    LOGW(TAG_SYSTEM, "Task profiler: task start failed");
+    return false;
+  }
+  return true;
+}
+
+void TaskProfiler::taskEntry(void *param) {
+  static_cast<TaskProfiler *>(param)->run();
+}
+
+void TaskProfiler::run() {
+  TickType_t wake = xTaskGetTickCount();
+  for (;;) {
+    sample();
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(TASK_PROFILER_INTERVAL_MS));
+  }
+}
+
+// The slot tracking handle, or a free one (reset) for a new task
+TaskProfile *TaskProfiler::slotFor(TaskHandle_t handle) {
+  TaskProfile *free = NULL;
+  for (int i = 0; i < TASK_PROFILER_MAX_TASKS; i++) {
+    if (profiles[i].handle == handle) return &profiles[i];
+    if (free == NULL && profiles[i].handle == NULL) free = &profiles[i];
+  }
+  if (free) {
+    memset(free, 0, sizeof(*free));
+    free->handle = handle;
+  }
+  return free;
+}
+
+void TaskProfiler::sample() {
+  uint32_t total = 0;
+  UBaseType_t count = uxTaskGetSystemState(status, TASK_PROFILER_MAX_TASKS, &total);
+  uint32_t nowUs = (uint32_t)esp_timer_get_time();
+  if (count == 0) {
+    if (overflows++ == 0) {
+      LOGW(TAG_SYSTEM, "Task profiler: more than %d tasks", TASK_PROFILER_MAX_TASKS);
+    }
+    return;
+  }
+
+  char lowStack[configMAX_TASK_NAME_LEN] = "";
+  uint32_t lowStackFree = 0;
+
+  portENTER_CRITICAL(&lock);
+  head = (head + 1) % (TASK_PROFILER_WINDOW + 1);
+  totalTime[head] = total;
+  if (samples <= TASK_PROFILER_WINDOW) samples++;
+  runTimeStats = total != 0;
+
+  // Tasks not in this snapshot have been deleted
+  bool seen[TASK_PROFILER_MAX_TASKS] = {false};
+  for (UBaseType_t i = 0; i < count; i++) {
+    const TaskStatus_t &s = status[i];
+    TaskProfile *profile = slotFor(s.xHandle);
+    if (profile == NULL) continue;
+    seen[profile - profiles] = true;
+    strncpy(profile->name, s.pcTaskName, sizeof(profile->name) - 1);
+#if configTASKLIST_INCLUDE_COREID
+    profile->core = s.xCoreID == tskNO_AFFINITY ? -1 : (int8_t)s.xCoreID;
+#else
+    profile->core = -1;
+#endif
+    profile->priority = (uint8_t)s.uxCurrentPriority;
+    profile->state = (uint8_t)s.eCurrentState;
+    profile->stackFree = s.usStackHighWaterMark;     // StackType_t is a byte on ESP32
+    profile->runTime[head] = s.ulRunTimeCounter;
+    if (profile->samples <= TASK_PROFILER_WINDOW) profile->samples++;
+    if (!profile->stackLow && profile->stackFree < TASK_PROFILER_STACK_LOW) {
+      profile->stackLow = true;
+      memcpy(lowStack, profile->name, sizeof(lowStack));
+      lowStackFree = profile->stackFree;
+    }
+  }
+  for (int i = 0; i < TASK_PROFILER_MAX_TASKS; i++) {
+    if (!seen[i]) profiles[i].handle = NULL;
+  }
+
+  // Per-core load of this interval for the timeline
+  if (samples > 1) {
+    uint8_t previous = (head + TASK_PROFILER_WINDOW) % (TASK_PROFILER_WINDOW + 1);
+    uint32_t elapsed = totalTime[head] - totalTime[previous];
+    for (int core = 0; core < TASK_PROFILER_CORES; core++) {
+      uint8_t load = 0;
+      for (int i = 0; i < TASK_PROFILER_MAX_TASKS; i++) {
+        const TaskProfile &p = profiles[i];
+        if (p.handle != idle[core] || p.samples < 2 || elapsed == 0) continue;
+        uint32_t idleTime = p.runTime[head] - p.runTime[previous];
+        load = idleTime >= elapsed ? 0 : (uint8_t)(100 - (uint64_t)idleTime * 100 / elapsed);
+      }
+      history[core][historyHead] = load;
+    }
+    historyHead = (historyHead + 1) % TASK_PROFILER_HISTORY;
+    if (historyCount < TASK_PROFILER_HISTORY) historyCount++;
+  }
+  snapshots++;
+  lastSampleUs = (uint32_t)esp_timer_get_time() - nowUs;
+  portEXIT_CRITICAL(&lock);
+
+  if (lowStack[0]) {
+    LOGW_S(TAG_SYSTEM, "Task profiler: %s low on stack (%u bytes never used)", lowStack, (unsigned)lowStackFree);
+  }
+}
+
+// Caller holds lock
+int16_t TaskProfiler::windowPercent(const TaskProfile &profile) const {
+  uint8_t span = profile.samples < samples ? profile.samples : samples;
+  if (!runTimeStats || span < 2) return -1;
+  uint8_t oldest = (head + TASK_PROFILER_WINDOW + 2 - span) % (TASK_PROFILER_WINDOW + 1);
+  uint32_t elapsed = totalTime[head] - totalTime[oldest];
+  if (elapsed == 0) return -1;
+  uint32_t used = profile.runTime[head] - profile.runTime[oldest];
+  return used >= elapsed ? 100 : (int16_t)((uint64_t)used * 100 / elapsed);
+}
+
+void TaskProfiler::reportCores(JsonArray out) const {
+  int16_t load[TASK_PROFILER_CORES];
+  portENTER_CRITICAL(&lock);
+  for (int core = 0; core < TASK_PROFILER_CORES; core++) {
+    load[core] = -1;
+    for (int i = 0; i < TASK_PROFILER_MAX_TASKS; i++) {
+      if (profiles[i].handle == NULL || profiles[i].handle != idle[core]) continue;
+      int16_t idlePercent = windowPercent(profiles[i]);
+      if (idlePercent >= 0) load[core] = 100 - idlePercent;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+
+  for (int core = 0; core < TASK_PROFILER_CORES; core++) {
+    if (load[core] >= 0) {
+      out.add(load[core]);
+    } else {
+      out.add(nullptr);
+    }
+  }
+}
+
+void TaskProfiler::reportStatus(JsonObject out) const {
+  portENTER_CRITICAL(&lock);
+  bool stats = runTimeStats;
+  uint8_t windowSamples = samples;
+  uint32_t snapshotCount = snapshots;
+  uint32_t overflowCount = overflows;
+  uint32_t sampleUs = lastSampleUs;
+  portEXIT_CRITICAL(&lock);
+
+  out["interval_ms"] = TASK_PROFILER_INTERVAL_MS;
+  out["window_s"] = (windowSamples > 1 ? windowSamples - 1 : 0) * TASK_PROFILER_INTERVAL_MS / 1000;
+  out["run_time_stats"] = stats;
+  out["snapshots"] = snapshotCount;
+  out["overflows"] = overflowCount;
+  out["sample_us"] = sampleUs;
+  if (stats) reportCores(out["cores"].to<JsonArray>());
+
+  // One entry at a time so the lock is never held while the JSON grows
+  JsonArray tasks = out["tasks"].to<JsonArray>();
+  for (int i = 0; i < TASK_PROFILER_MAX_TASKS; i++) {
+    TaskProfile profile;
+    int16_t percent;
+    portENTER_CRITICAL(&lock);
+    profile = profiles[i];
+    percent = profile.handle ? windowPercent(profile) : -1;
+    portEXIT_CRITICAL(&lock);
+    if (profile.handle == NULL || profile.samples == 0) continue;
+
+    JsonObject entry = tasks.add<JsonObject>();
+    entry["name"] = profile.name;
+    if (profile.core >= 0) {
+      entry["core"] = profile.core;
+    } else {
+      entry["core"] = nullptr;
+    }
+    entry["priority"] = profile.priority;
+    entry["state"] = TASK_STATE_NAMES[profile.state < 6 ? profile.state : 5];
+    if (percent >= 0) entry["cpu_percent"] = percent;
+    entry["stack_free_min"] = profile.stackFree;
+    entry["stack_low"] = profile.stackLow;
+  }
+
+  if (!stats) return;
+  JsonObject timeline = out["timeline"].to<JsonObject>();
+  timeline["interval_ms"] = TASK_PROFILER_INTERVAL_MS;
+  JsonArray cores = timeline["cores"].to<JsonArray>();
+  for (int core = 0; core < TASK_PROFILER_CORES; core++) {
+    uint8_t points[TASK_PROFILER_HISTORY];
+    uint8_t count;
+    portENTER_CRITICAL(&lock);
+    count = historyCount;
+    for (uint8_t n = 0; n < count; n++) {
+      points[n] = history[core][(historyHead + TASK_PROFILER_HISTORY - count + n) % TASK_PROFILER_HISTORY];
+    }
+    portEXIT_CRITICAL(&lock);
+    JsonArray series = cores.add<JsonArray>();
+    for (uint8_t n = 0; n < count; n++) series.add(points[n]);
+  }
+}
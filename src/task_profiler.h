@@ -0,0 +1,94 @@
+/**
+ * Task Profiler
+ *
+ * Where the CPU time goes, per FreeRTOS task and per core, so task
+ * placement (camera on core 0, async_tcp on core 1, ...) can be tuned from
+ * data. Every TASK_PROFILER_INTERVAL_MS a low-priority task takes a
+ * snapshot of all tasks (uxTaskGetSystemState): run-time counter, state,
+ * priority, core and stack high-water mark.
+ *
+ * CPU % comes from the run-time counter deltas over the last
+ * TASK_PROFILER_WINDOW snapshots: a task's share of one core, and a core's
+ * load as 100 % minus the share of its idle task. The counter is 32 bits;
+ * the window stays well below its wrap even when it counts CPU cycles.
+ * Per-core load of the last TASK_PROFILER_HISTORY intervals is kept for
+ * the health page timeline.
+ *
+ * The counter exists only when the framework is built with
+ * CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS; without it the snapshot still
+ * has stacks, states and priorities and CPU figures are left out
+ * (run_time_stats: false).
+ *
+ * The high-water mark is the least free stack a task has ever had, in
+ * bytes; tasks under TASK_PROFILER_STACK_LOW are flagged and logged once.
+ */
+
+#ifndef TASK_PROFILER_H
+#define TASK_PROFILER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define TASK_PROFILER_INTERVAL_MS  1000
+#define TASK_PROFILER_WINDOW       10       // intervals averaged for CPU %
+#define TASK_PROFILER_HISTORY      60       // intervals kept per core for the timeline
+#define TASK_PROFILER_MAX_TASKS    40
+#define TASK_PROFILER_STACK_LOW    512      // bytes of free stack flagged as low
+#define TASK_PROFILER_STACK_SIZE   3072
+#define TASK_PROFILER_PRIORITY     1
+#define TASK_PROFILER_CORE         1
+#define TASK_PROFILER_CORES        portNUM_PROCESSORS
+
+struct TaskProfile {
+  TaskHandle_t handle;                          // NULL = free slot
+  char name[configMAX_TASK_NAME_LEN];
+  int8_t core;                                  // -1 = not pinned
+  uint8_t priority;
+  uint8_t state;                                // eTaskState
+  bool stackLow;
+  uint32_t stackFree;                           // high-water mark, bytes
+  uint32_t runTime[TASK_PROFILER_WINDOW + 1];   // counter per snapshot, ring
+  uint8_t samples;                              // snapshots in runTime
+};
+
+class TaskProfiler {
+public:
+  TaskProfiler();
+
+  bool begin();
+
+  // Task list, per-core load and timeline (/api/health/tasks)
+  void reportStatus(JsonObject out) const;
+  // Per-core load over the window, for /api/health/status
+  void reportCores(JsonArray out) const;
+
+private:
+  static void taskEntry(void *param);
+  void run();
+  void sample();
+  TaskProfile *slotFor(TaskHandle_t handle);
+  // Percent of one core used by profile over the window, -1 if unknown
+  int16_t windowPercent(const TaskProfile &profile) const;
+
+  TaskHandle_t task;
+  mutable portMUX_TYPE lock;
+  TaskStatus_t *status;                         // snapshot scratch, task only
+  TaskHandle_t idle[TASK_PROFILER_CORES];
+  TaskProfile profiles[TASK_PROFILER_MAX_TASKS];
+  uint32_t totalTime[TASK_PROFILER_WINDOW + 1];
+  uint8_t head;                                 // newest entry of the rings
+  uint8_t samples;
+  bool runTimeStats;
+  uint8_t history[TASK_PROFILER_CORES][TASK_PROFILER_HISTORY];   // load %, ring
+  uint8_t historyHead;
+  uint8_t historyCount;
+
+  // Statistics
+  uint32_t snapshots;
+  uint32_t overflows;                           // more tasks than TASK_PROFILER_MAX_TASKS
+  uint32_t lastSampleUs;
+};
+
+extern TaskProfiler taskProfiler;
+
+#endif // TASK_PROFILER_H
@@ -0,0 +1,458 @@
+/**
+ * Thumbnail Store Implementation
+ */
+
+#include "thumbnails.h"
+#include "jpeg_crop.h"
+#include "logger.h"
+#include <SD_MMC.h>
+#include <esp_heap_caps.h>
+#include <new>
+
+#define THUMB_LOOKUP_WAIT_MS  200   // web server task: sdCardMutex wait
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+static const char SD_BUSY[] = "SD card busy";
+
+ThumbnailStore thumbnailStore;
+
+ThumbnailStore::ThumbnailStore()
+  : queue(NULL), task(NULL), running(false), cropper(NULL), encoder(NULL), pixels(NULL), nextFailure(0),
+    cachedFiles(0), generated(0), failed(0), queueDrops(0), hits(0), misses(0), lastMs(0), maxMs(0), bytesRead(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  recordingsDir[0] = '\0';
+  memset(pending, 0, sizeof(pending));
+  memset(failures, 0, sizeof(failures));
+}
+
+bool ThumbnailStore::begin(bool sdReady, const StorageSettings &settings) {
+  if (!sdReady) return false;
+  strlcpy(recordingsDir, settings.recordingsDir, sizeof(recordingsDir));
+
+  // The cropper's Huffman tables and the pixel buffer live in PSRAM
+  void *cropperMem = heap_caps_malloc(sizeof(JpegCropper), MALLOC_CAP_SPIRAM);
+  void *encoderMem = heap_caps_malloc(sizeof(JpegEncoder), MALLOC_CAP_SPIRAM);
+  pixels = (uint8_t *)heap_caps_malloc(THUMB_DC_MAX_PIXELS * 2, MALLOC_CAP_SPIRAM);
+  queue = xQueueCreate(THUMB_QUEUE_LEN, sizeof(Job));
+  if (!cropperMem || !encoderMem || !pixels || !queue) {
+    LOGW(TAG_SD, "Thumbnails: no memory");
+    free(cropperMem);
+    free(encoderMem);
+    free(pixels);
+    pixels = NULL;
+    if (queue) vQueueDelete(queue);
+    queue = NULL;
+    return false;
+  }
+  cropper = new (cropperMem) JpegCropper();
+  encoder = new (encoderMem) JpegEncoder();
+  encoder->setQuality(THUMB_QUALITY);
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+    LOGW(TAG_SD, "Thumbnails: SD card busy");
+    return false;
+  }
+  if (!SD_MMC.exists(THUMB_DIR)) SD_MMC.mkdir(THUMB_DIR);
+  countCache();
+  xSemaphoreGive(sdCardMutex);
+
+  running = true;
+  if (xTaskCreatePinnedToCore(taskEntry, "thumbs", THUMB_STACK_SIZE, this, THUMB_TASK_PRIORITY, &task, 0) != pdPASS) {
+    running = false;
+    LOGW(TAG_SD, "Thumbnails: failed to start task");
+    return false;
+  }
+  LOGI(TAG_SD, "Thumbnails: %u cached", cachedFiles);
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Keys
+
+// FNV-1a over the path, then mtime and size: a new version of the source
+// gets a new cache file
+uint64_t ThumbnailStore::cacheKey(const char *path, time_t mtime, uint32_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+  uint64_t stamp = (uint64_t)mtime;
+  for (uint8_t i = 0; i < 8; i++) hash = (hash ^ (uint8_t)(stamp >> (i * 8))) * 0x100000001b3ULL;
+  for (uint8_t i = 0; i < 4; i++) hash = (hash ^ (uint8_t)(size >> (i * 8))) * 0x100000001b3ULL;
+  return hash;
+}
+
+String ThumbnailStore::cacheFile(uint64_t key) {
+  char name[40];
+  snprintf(name, sizeof(name), THUMB_DIR "/%08lx%08lx.jpg", (unsigned long)(key >> 32), (unsigned long)(uint32_t)key);
+  return String(name);
+}
+
+String ThumbnailStore::etagFor(uint64_t key) {
+  char tag[20];
+  snprintf(tag, sizeof(tag), "\"%08lx%08lx\"", (unsigned long)(key >> 32), (unsigned long)(uint32_t)key);
+  return String(tag);
+}
+
+uint32_t ThumbnailStore::pathHash(const char *path) {
+  uint32_t hash = 2166136261u;
+  for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+  return hash ? hash : 1;   // 0 marks a free pending slot
+}
+
+static const char *extension(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  return dot && (!slash || dot > slash) ? dot + 1 : "";
+}
+
+bool ThumbnailStore::isClip(const char *path) {
+  const char *ext = extension(path);
+  return strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "mjpeg") == 0 || strcasecmp(ext, "mjpg") == 0;
+}
+
+bool ThumbnailStore::supported(const char *path) {
+  const char *ext = extension(path);
+  return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 || isClip(path);
+}
+
+// ---------------------------------------------------------------------------
+// Requests (web server and recorder tasks)
+
+ThumbnailState ThumbnailStore::lookup(const char *path, String &cachePath, String &etag, const char *&error) {
+  error = NULL;
+  if (!supported(path)) return THUMB_UNSUPPORTED;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(THUMB_LOOKUP_WAIT_MS)) != pdTRUE) return THUMB_SD_BUSY;
+  File source = SD_MMC.open(path, FILE_READ);
+  bool found = source && !source.isDirectory();
+  uint64_t key = found ? cacheKey(path, source.getLastWrite(), source.size()) : 0;
+  if (source) source.close();
+  bool cached = found && SD_MMC.exists(cacheFile(key));
+  xSemaphoreGive(sdCardMutex);
+
+  if (!found) return THUMB_NOT_FOUND;
+  etag = etagFor(key);
+  if (cached) {
+    hits++;
+    cachePath = cacheFile(key);
+    return THUMB_READY;
+  }
+  error = failureFor((uint32_t)key);
+  if (error) return THUMB_FAILED;
+  misses++;
+  return enqueue(path) ? THUMB_QUEUED : THUMB_QUEUE_FULL;
+}
+
+bool ThumbnailStore::enqueue(const char *path) {
+  if (!running || !supported(path) || strlen(path) >= THUMB_PATH_LEN) return false;
+  uint32_t hash = pathHash(path);
+  if (isPending(hash)) return true;
+
+  Job job;
+  strlcpy(job.path, path, sizeof(job.path));
+  markPending(hash, true);
+  if (xQueueSend(queue, &job, 0) != pdTRUE) {
+    markPending(hash, false);
+    queueDrops++;
+    return false;
+  }
+  return true;
+}
+
+void ThumbnailStore::markPending(uint32_t hash, bool queued) {
+  portENTER_CRITICAL(&lock);
+  for (uint8_t i = 0; i < THUMB_QUEUE_LEN; i++) {
+    if (pending[i] == (queued ? 0 : hash)) {
+      pending[i] = queued ? hash : 0;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+bool ThumbnailStore::isPending(uint32_t hash) const {
+  bool found = false;
+  portENTER_CRITICAL(&lock);
+  for (uint8_t i = 0; i < THUMB_QUEUE_LEN && !found; i++) found = pending[i] == hash;
+  portEXIT_CRITICAL(&lock);
+  return found;
+}
+
+const char *ThumbnailStore::failureFor(uint32_t key) const {
+  for (uint8_t i = 0; i < THUMB_FAILURES; i++) {
+    if (failures[i].error && failures[i].key == key) return failures[i].error;
+  }
+  return NULL;
+}
+
+void ThumbnailStore::rememberFailure(uint32_t key, const char *error) {
+  failures[nextFailure].key = key;
+  failures[nextFailure].error = error;
+  nextFailure = (nextFailure + 1) % THUMB_FAILURES;
+}
+
+// ---------------------------------------------------------------------------
+// Task
+
+void ThumbnailStore::taskEntry(void *param) {
+  static_cast<ThumbnailStore *>(param)->run();
+}
+
+void ThumbnailStore::run() {
+  backfill();
+  for (;;) {
+    Job job;
+    if (xQueueReceive(queue, &job, portMAX_DELAY) != pdTRUE) continue;
+    generate(job.path);
+    markPending(pathHash(job.path), false);
+  }
+}
+
+// Recordings made while the store was not running
+void ThumbnailStore::backfill() {
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+  File dir = SD_MMC.open(recordingsDir);
+  bool isDir = dir && dir.isDirectory();
+  File file = isDir ? dir.openNextFile() : File();
+  xSemaphoreGive(sdCardMutex);
+
+  while (file) {
+    String path = file.path();
+    bool candidate = !file.isDirectory() && supported(path.c_str());
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+    file.close();
+    file = dir.openNextFile();
+    xSemaphoreGive(sdCardMutex);
+    if (candidate) generate(path.c_str());
+  }
+}
+
+void ThumbnailStore::generate(const char *path) {
+  uint32_t start = millis();
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;   // retried on the next lookup
+  File source = SD_MMC.open(path, FILE_READ);
+  bool found = source && !source.isDirectory();
+  uint64_t key = found ? cacheKey(path, source.getLastWrite(), source.size()) : 0;
+  bool done = !found || SD_MMC.exists(cacheFile(key)) || failureFor((uint32_t)key);
+  if (done && source) source.close();
+  xSemaphoreGive(sdCardMutex);
+  if (done) return;
+
+  const char *error = render(source, isClip(path), key);
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+    source.close();
+    xSemaphoreGive(sdCardMutex);
+  }
+
+  if (error) {
+    if (error == SD_BUSY) return;
+    failed++;
+    rememberFailure((uint32_t)key, error);
+    LOGW_S(TAG_SD, "Thumbnail failed for %s", path);
+    return;
+  }
+  generated++;
+  lastMs = millis() - start;
+  if (lastMs > maxMs) maxMs = lastMs;
+}
+
+// Reads the JPEG to decode: the whole file for an image, from the first SOI
+// to the following EOI for a clip. Returns its length, 0 on error.
+size_t ThumbnailStore::readFrame(File &source, bool clip, uint8_t *buffer, size_t capacity, const char *&error) {
+  if (!clip && source.size() > capacity) {
+    error = "Image too large";
+    return 0;
+  }
+  size_t filled = 0;
+  size_t skipped = 0;          // clip bytes searched before the frame
+  size_t searchFrom = 0;
+  bool inFrame = !clip;
+
+  while (filled < capacity) {
+    size_t want = capacity - filled;
+    if (want > THUMB_READ_CHUNK) want = THUMB_READ_CHUNK;
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) {
+      error = SD_BUSY;
+      return 0;
+    }
+    size_t got = source.read(buffer + filled, want);
+    xSemaphoreGive(sdCardMutex);
+    if (got == 0) break;
+    filled += got;
+    bytesRead += got;
+    if (!clip) continue;
+
+    if (!inFrame) {
+      size_t i = searchFrom;
+      while (i + 2 < filled && !(buffer[i] == 0xFF && buffer[i + 1] == 0xD8 && buffer[i + 2] == 0xFF)) i++;
+      if (i + 2 >= filled) {
+        // Keep the last two bytes: the marker may straddle reads
+        size_t keep = filled < 2 ? filled : 2;
+        skipped += filled - keep;
+        memmove(buffer, buffer + filled - keep, keep);
+        filled = keep;
+        searchFrom = 0;
+        if (skipped > THUMB_CLIP_SCAN) break;
+        continue;
+      }
+      memmove(buffer, buffer + i, filled - i);
+      filled -= i;
+      inFrame = true;
+      searchFrom = 2;
+    }
+
+    size_t i = searchFrom;
+    while (i + 1 < filled && !(buffer[i] == 0xFF && buffer[i + 1] == 0xD9)) i++;
+    if (i + 1 < filled) return i + 2;
+    searchFrom = filled - 1;
+  }
+
+  if (!inFrame) {
+    error = "No JPEG frame in clip";
+    return 0;
+  }
+  return filled;   // a frame cut at capacity still decodes its top part
+}
+
+// 2x2 box average in place; YUYV keeps an even width
+static void halve(uint8_t *pixels, uint16_t &width, uint16_t &height, bool color) {
+  uint16_t w = width / 2;
+  uint16_t h = height / 2;
+  if (!color) {
+    for (uint16_t y = 0; y < h; y++) {
+      const uint8_t *row0 = pixels + (size_t)(y * 2) * width;
+      const uint8_t *row1 = row0 + width;
+      for (uint16_t x = 0; x < w; x++) {
+        pixels[(size_t)y * w + x] = (row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] + row1[x * 2 + 1] + 2) / 4;
+      }
+    }
+  } else {
+    w &= ~1;
+    size_t stride = (size_t)width * 2;
+    for (uint16_t y = 0; y < h; y++) {
+      const uint8_t *row0 = pixels + (size_t)(y * 2) * stride;
+      const uint8_t *row1 = row0 + stride;
+      uint8_t *out = pixels + (size_t)y * w * 2;
+      for (uint16_t pair = 0; pair < w / 2; pair++) {
+        // Source pixel pairs 2p and 2p+1 of both rows: Y0 U Y1 V each
+        const uint8_t *a = row0 + pair * 8;
+        const uint8_t *b = row1 + pair * 8;
+        out[pair * 4] = (a[0] + a[2] + b[0] + b[2] + 2) / 4;
+        out[pair * 4 + 1] = (a[1] + a[5] + b[1] + b[5] + 2) / 4;
+        out[pair * 4 + 2] = (a[4] + a[6] + b[4] + b[6] + 2) / 4;
+        out[pair * 4 + 3] = (a[3] + a[7] + b[3] + b[7] + 2) / 4;
+      }
+    }
+  }
+  width = w;
+  height = h;
+}
+
+const char *ThumbnailStore::render(File &source, bool clip, uint64_t key) {
+  size_t capacity = clip || source.size() > THUMB_MAX_SOURCE ? THUMB_MAX_SOURCE : source.size();
+  uint8_t *buffer = (uint8_t *)heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM);
+  if (buffer == NULL) return SD_BUSY;   // transient: retried on the next lookup
+
+  const char *error = NULL;
+  size_t len = readFrame(source, clip, buffer, capacity, error);
+  uint16_t width = 0;
+  uint16_t height = 0;
+  bool color = false;
+  if (len && !cropper->decodeDc(buffer, len, pixels, THUMB_DC_MAX_PIXELS * 2, width, height, color)) {
+    error = cropper->error();
+  }
+  free(buffer);
+  if (error) return error;
+
+  while (width > THUMB_MAX_WIDTH && height >= 2) halve(pixels, width, height, color);
+
+  JpegPixelFormat format = color ? JPEG_PIXELS_YUYV : JPEG_PIXELS_GRAY;
+  size_t outCapacity = JpegEncoder::maxOutputSize(width, height, format);
+  uint8_t *out = (uint8_t *)heap_caps_malloc(outCapacity, MALLOC_CAP_SPIRAM);
+  if (out == NULL) return SD_BUSY;
+  size_t outLen = 0;
+  if (!encoder->encode(pixels, width, height, format, out, outCapacity, outLen)) {
+    error = encoder->error();
+  } else if (!store(key, out, outLen)) {
+    error = SD_BUSY;
+  }
+  free(out);
+  return error;
+}
+
+// Written to a temporary name first so a torn write is never served
+bool ThumbnailStore::store(uint64_t key, const uint8_t *jpeg, size_t len) {
+  String target = cacheFile(key);
+  String temp = target + ".tmp";
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  File file = SD_MMC.open(temp, FILE_WRITE);
+  bool ok = file && file.write(jpeg, len) == len;
+  if (file) file.close();
+  ok = ok && SD_MMC.rename(temp, target);
+  if (!ok) SD_MMC.remove(temp);
+  if (ok && ++cachedFiles > THUMB_CACHE_MAX_FILES) trimCache();
+  xSemaphoreGive(sdCardMutex);
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Cache directory (caller holds sdCardMutex)
+
+void ThumbnailStore::countCache() {
+  cachedFiles = 0;
+  File dir = SD_MMC.open(THUMB_DIR);
+  if (!dir || !dir.isDirectory()) return;
+  File file = dir.openNextFile();
+  while (file) {
+    if (!file.isDirectory()) cachedFiles++;
+    file = dir.openNextFile();
+  }
+}
+
+// Removes the THUMB_TRIM_BATCH oldest thumbnails
+void ThumbnailStore::trimCache() {
+  struct Entry {
+    time_t mtime;
+    char name[24];
+  };
+  Entry *oldest = (Entry *)malloc(THUMB_TRIM_BATCH * sizeof(Entry));
+  if (oldest == NULL) return;
+  uint8_t count = 0;
+
+  File dir = SD_MMC.open(THUMB_DIR);
+  File file = dir && dir.isDirectory() ? dir.openNextFile() : File();
+  while (file) {
+    time_t mtime = file.getLastWrite();
+    // Insertion into the list sorted oldest first
+    int8_t pos = count;
+    while (pos > 0 && oldest[pos - 1].mtime > mtime) pos--;
+    if (!file.isDirectory() && pos < THUMB_TRIM_BATCH) {
+      if (count < THUMB_TRIM_BATCH) count++;
+      memmove(&oldest[pos + 1], &oldest[pos], (count - 1 - pos) * sizeof(Entry));
+      oldest[pos].mtime = mtime;
+      strlcpy(oldest[pos].name, file.name(), sizeof(oldest[pos].name));
+    }
+    file = dir.openNextFile();
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    String path = String(THUMB_DIR "/") + oldest[i].name;
+    if (SD_MMC.remove(path) && cachedFiles) cachedFiles--;
+  }
+  free(oldest);
+  LOGI(TAG_SD, "Thumbnails: trimmed %u, %u cached", count, cachedFiles);
+}
+
+void ThumbnailStore::reportStatus(JsonObject out) const {
+  out["running"] = running;
+  out["cached"] = cachedFiles;
+  out["queued"] = queue ? uxQueueMessagesWaiting(queue) : 0;
+  out["generated"] = generated;
+  out["failed"] = failed;
+  out["queue_drops"] = queueDrops;
+  out["hits"] = hits;
+  out["misses"] = misses;
+  out["last_ms"] = lastMs;
+  out["max_ms"] = maxMs;
+  out["bytes_read"] = bytesRead;
+}
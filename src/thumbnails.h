@@ -0,0 +1,135 @@
+/**
+ * Thumbnail Store
+ *
+ * Small previews for the gallery, /api/files/thumb?file=. The source is a
+ * JPEG, or the first frame of an MJPEG/AVI clip. It is never fully decoded:
+ * JpegCropper::decodeDc() turns each 8x8 block into one pixel from its DC
+ * coefficient (a 1/8-scale image without IDCT). The result is box-halved
+ * down to THUMB_MAX_WIDTH and re-encoded at THUMB_QUALITY.
+ *
+ * Thumbnails are cached under THUMB_DIR, one file per source version: the
+ * name is a hash of path, mtime and size, so an overwritten source gets a
+ * new thumbnail and the old one ages out of the cache (oldest first, above
+ * THUMB_CACHE_MAX_FILES).
+ *
+ * Generation runs on a task below every other priority, fed by enqueue():
+ * called when a recording or upload closes and on a cache miss, and for
+ * storage.recordings_dir once at boot. The web server never waits for it;
+ * a miss answers 202 and the client retries.
+ */
+
+#ifndef THUMBNAILS_H
+#define THUMBNAILS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+#include "config_store.h"
+#include "jpeg_encoder.h"
+
+#define THUMB_DIR                "/.thumbs"
+#define THUMB_PATH_LEN           96
+#define THUMB_QUEUE_LEN          16
+#define THUMB_MAX_WIDTH          160         // halved until no wider
+#define THUMB_QUALITY            70
+#define THUMB_MAX_SOURCE         (512 * 1024) // bytes of JPEG read per source
+#define THUMB_CLIP_SCAN          (64 * 1024)  // clip bytes searched for the first frame
+#define THUMB_READ_CHUNK         16384        // sdCardMutex is released between chunks
+#define THUMB_DC_MAX_PIXELS      (256 * 192)  // 2048x1536 source
+#define THUMB_CACHE_MAX_FILES    1000
+#define THUMB_TRIM_BATCH         50
+#define THUMB_FAILURES           8            // sources remembered as undecodable
+#define THUMB_STACK_SIZE         4096
+#define THUMB_TASK_PRIORITY      0            // idle priority: only spare CPU time
+
+enum ThumbnailState : uint8_t {
+  THUMB_READY = 0,            // cachePath holds the thumbnail
+  THUMB_QUEUED,               // being generated, retry later
+  THUMB_QUEUE_FULL,
+  THUMB_NOT_FOUND,
+  THUMB_UNSUPPORTED,          // not a JPEG or clip
+  THUMB_FAILED,               // source could not be decoded (see error)
+  THUMB_SD_BUSY
+};
+
+class JpegCropper;
+
+class ThumbnailStore {
+public:
+  ThumbnailStore();
+
+  // Allocates the decoder and starts the task, which first fills in
+  // missing thumbnails of the recordings directory
+  bool begin(bool sdReady, const StorageSettings &settings);
+
+  // Cache lookup for a source file; queues generation on a miss. etag
+  // receives the cache key (changes with the source). Takes sdCardMutex.
+  ThumbnailState lookup(const char *path, String &cachePath, String &etag, const char *&error);
+
+  // Queue a source, e.g. when a recording closes; false when not a
+  // supported type or the queue is full
+  bool enqueue(const char *path);
+
+  static bool supported(const char *path);
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  struct Job {
+    char path[THUMB_PATH_LEN];
+  };
+
+  struct Failure {
+    uint32_t key;             // low half of the cache key
+    const char *error;
+  };
+
+  QueueHandle_t queue;
+  TaskHandle_t task;
+  mutable portMUX_TYPE lock;
+  volatile bool running;
+  char recordingsDir[32];
+
+  JpegCropper *cropper;       // PSRAM
+  JpegEncoder *encoder;       // PSRAM; jpegEncoder belongs to async_tcp
+  uint8_t *pixels;            // decodeDc() output, THUMB_DC_MAX_PIXELS * 2
+
+  uint32_t pending[THUMB_QUEUE_LEN];   // path hashes in the queue
+  Failure failures[THUMB_FAILURES];
+  uint8_t nextFailure;
+  uint32_t cachedFiles;
+
+  // Counters for reportStatus()
+  uint32_t generated;
+  uint32_t failed;
+  uint32_t queueDrops;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t lastMs;
+  uint32_t maxMs;
+  uint32_t bytesRead;
+
+  static void taskEntry(void *param);
+  void run();
+  void backfill();
+  void generate(const char *path);
+  size_t readFrame(File &source, bool clip, uint8_t *buffer, size_t capacity, const char *&error);
+  const char *render(File &source, bool clip, uint64_t key);
+  bool store(uint64_t key, const uint8_t *jpeg, size_t len);
+  void countCache();
+  void trimCache();
+  const char *failureFor(uint32_t key) const;
+  void rememberFailure(uint32_t key, const char *error);
+  void markPending(uint32_t hash, bool queued);
+  bool isPending(uint32_t hash) const;
+
+  static uint64_t cacheKey(const char *path, time_t mtime, uint32_t size);
+  static String cacheFile(uint64_t key);
+  static String etagFor(uint64_t key);
+  static uint32_t pathHash(const char *path);
+  static bool isClip(const char *path);
+};
+
+extern ThumbnailStore thumbnailStore;
+
+#endif // THUMBNAILS_H
@@ -0,0 +1,105 @@
+/**
+ * Web Assets - see web_assets.h
+ */
+
+#include "web_assets.h"
+#include <SD_MMC.h>
+#include "sd_manager.h"
+#include "logger.h"
+#include "route_metrics.h"
+#include "web_manifest.h"
+
+extern SDManager sdManager;
+
+static_assert(WEB_ASSET_COUNT > 0 && WEB_ASSET_COUNT < 128, "web asset count out of range");
+static_assert(WEB_ASSET_SLOTS == 1 << WEB_ASSET_SLOT_BITS, "web asset slots must be 2^WEB_ASSET_SLOT_BITS");
+
+// Top bits of the hash (the low bits of FNV-1a mix poorly)
+constexpr uint32_t webAssetSlot(const char *url) {
+  return webAssetHash(url, WEB_ASSET_SEED) >> (32 - WEB_ASSET_SLOT_BITS);
+}
+
+constexpr size_t webUrlLength(const char *s) {
+  return *s ? 1 + webUrlLength(s + 1) : 0;
+}
+
+// Each asset sits in the slot its URL hashes to (so no two share one) and
+// no URL is longer than the bound checked before hashing
+constexpr bool webAssetsPlaced(int i) {
+  return i == WEB_ASSET_COUNT ||
+         (WEB_ASSET_SLOT[webAssetSlot(WEB_ASSETS[i].url)] == i &&
+          webUrlLength(WEB_ASSETS[i].url) <= WEB_ASSET_MAX_URL && webAssetsPlaced(i + 1));
+}
+
+// ... and no slot points at anything else
+constexpr int webAssetSlotsUsed(int slot) {
+  return slot == WEB_ASSET_SLOTS ? 0 : (WEB_ASSET_SLOT[slot] >= 0) + webAssetSlotsUsed(slot + 1);
+}
+
+static_assert(webAssetsPlaced(0), "web_manifest.h does not match webAssetHash(); rerun tools/web_assets.py");
+static_assert(webAssetSlotsUsed(0) == WEB_ASSET_COUNT, "web_manifest.h has stray slots; rerun tools/web_assets.py");
+
+const WebAsset *findWebAsset(const String &url) {
+  if (url.length() == 0 || url.length() > WEB_ASSET_MAX_URL) return NULL;
+  int8_t index = WEB_ASSET_SLOT[webAssetSlot(url.c_str())];
+  if (index < 0 || strcmp(WEB_ASSETS[index].url, url.c_str()) != 0) return NULL;
+  return &WEB_ASSETS[index];
+}
+
+void attachWebAssets(AsyncWebServer &server) {
+  // "/*" matches every URL; the filter lets through only table hits, so
+  // every other request falls through to the routes after this one. All
+  // assets share the "assets" series in /metrics
+  AsyncWebHandler &handler = server.on("/*", HTTP_GET, [](AsyncWebServerRequest *request) {
+    const WebAsset *asset = findWebAsset(request->url());
+    if (asset) {
+      serveWebAsset(request, *asset);
+    } else {
+      request->send(404, "text/plain", "File not found");
+    }
+  }).setFilter([](AsyncWebServerRequest *request) {
+    return findWebAsset(request->url()) != NULL;
+  });
+  routeMetrics.track(handler, "assets");
+}
+
+/**
+ * AsyncFileResponse reads the file asynchronously; ESPAsyncWebServer
+ * manages the file access, so no mutex is needed here
+ */
+void serveWebAsset(AsyncWebServerRequest *request, const WebAsset &asset) {
+  if (!sdManager.isReady()) {
+    LOGW_S(TAG_HTTP, "Cannot serve %s - SD not ready", asset.path);
+    request->send(503, "text/plain", "SD card not available");
+    return;
+  }
+  File file = SD_MMC.open(asset.path, FILE_READ);
+  if (!file || file.isDirectory()) {
+    LOGW_S(TAG_HTTP, "File not found: %s", asset.path);
+    request->send(404, "text/plain", "File not found");
+    return;
+  }
+
+  // Validator of the copy being served: size and FAT modification time
+  char etag[32];
+  snprintf(etag, sizeof(etag), "\"%x-%lx\"", (unsigned)file.size(), (unsigned long)file.getLastWrite());
+
+  AsyncWebServerResponse *response;
+  const AsyncWebHeader *match = request->getHeader("If-None-Match");
+  if (match && match->value() == etag) {
+    file.close();
+    response = request->beginResponse(304, asset.mime, String());
+  } else {
+    LOGD_S(TAG_HTTP, "Serving %s", asset.path);
+    response = request->beginResponse(file, String(asset.path), asset.mime);
+  }
+
+  if (response) {
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", asset.cacheControl);
+    request->send(response);
+  } else {
+    LOGE_S(TAG_HTTP, "Failed to create response for %s", asset.path);
+    request->send(500, "text/plain", "Failed to serve file");
+  }
+}
@@ -0,0 +1,50 @@
+/**
+ * Web Assets
+ *
+ * Every file in data/web is served from /web on the SD card at "/<name>"
+ * by one catch-all handler, instead of a route per file. The table of
+ * assets (web_manifest.h: URL, SD path, MIME type, Cache-Control) is
+ * generated at build time by tools/web_assets.py, so adding a file to
+ * data/web needs no firmware change beyond the rebuild.
+ *
+ * The table is a perfect hash: the generator picks a seed for which every
+ * URL has a slot of its own, so a lookup is one hash of the URL and one
+ * string compare, and a URL that is not an asset is rejected just as fast
+ * (first by length). web_assets.cpp recomputes every slot at compile time
+ * and fails the build if one does not match, e.g. after a hand edit.
+ *
+ * Responses carry an ETag made of the size and modification time of the
+ * file on the SD card, so it changes whenever the card's copy does, with or
+ * without a firmware rebuild. A matching If-None-Match gets 304 after
+ * opening the file, without reading it.
+ */
+
+#ifndef WEB_ASSETS_H
+#define WEB_ASSETS_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+struct WebAsset {
+  const char *url;             // "/app.js"
+  const char *path;            // on the SD card, "/web/app.js"
+  const char *mime;
+  const char *cacheControl;
+};
+
+// 32-bit FNV-1a from seed; must match fnv1a() in tools/web_assets.py.
+// Recursive for C++11 constexpr: call only on strings of bounded length.
+constexpr uint32_t webAssetHash(const char *s, uint32_t h) {
+  return *s ? webAssetHash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+// The asset served at url, or NULL
+const WebAsset *findWebAsset(const String &url);
+
+// Registers the catch-all asset handler; call before any other route
+void attachWebAssets(AsyncWebServer &server);
+
+// Sends the asset from the SD card, or 304 when the client has it
+void serveWebAsset(AsyncWebServerRequest *request, const WebAsset &asset);
+
+#endif // WEB_ASSETS_H
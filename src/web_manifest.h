@@ -0,0 +1,33 @@
+// Generated by tools/web_assets.py from data/web - do not edit.
+// Checked against web_assets.h at compile time.
+
+#ifndef WEB_MANIFEST_H
+#define WEB_MANIFEST_H
+
+#define WEB_ASSET_COUNT     12
+#define WEB_ASSET_SLOT_BITS 4
+#define WEB_ASSET_SLOTS     16
+#define WEB_ASSET_SEED      0x000001DAu
+#define WEB_ASSET_MAX_URL   17
+
+static constexpr WebAsset WEB_ASSETS[WEB_ASSET_COUNT] = {
+  {"/app.js", "/web/app.js", "application/javascript", "public, max-age=3600"},
+  {"/filemanager.css", "/web/filemanager.css", "text/css", "public, max-age=3600"},
+  {"/filemanager.html", "/web/filemanager.html", "text/html", "no-cache"},
+  {"/filemanager.js", "/web/filemanager.js", "application/javascript", "public, max-age=3600"},
+  {"/firmware.css", "/web/firmware.css", "text/css", "public, max-age=3600"},
+  {"/firmware.html", "/web/firmware.html", "text/html", "no-cache"},
+  {"/firmware.js", "/web/firmware.js", "application/javascript", "public, max-age=3600"},
+  {"/health.css", "/web/health.css", "text/css", "public, max-age=3600"},
+  {"/health.html", "/web/health.html", "text/html", "no-cache"},
+  {"/health.js", "/web/health.js", "application/javascript", "public, max-age=3600"},
+  {"/index.html", "/web/index.html", "text/html", "no-cache"},
+  {"/style.css", "/web/style.css", "text/css", "public, max-age=3600"},
+};
+
+// Index into WEB_ASSETS by hash slot, -1 = empty
+static constexpr int8_t WEB_ASSET_SLOT[WEB_ASSET_SLOTS] = {
+  1, 7, 5, -1, 11, -1, 4, -1, 2, 8, 9, 0, 3, -1, 10, 6,
+};
+
+#endif // WEB_MANIFEST_H
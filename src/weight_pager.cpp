@@ -0,0 +1,111 @@
+/**
+ * Model Weight Pager Implementation
+ */
+
+#include "weight_pager.h"
+#include "logger.h"
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+WeightPager::WeightPager()
+  : requestQueue(NULL), doneQueue(NULL), residentData(NULL), residentBytes(0), hasFile(false), busy(false),
+    reads(0), sdReads(0), failures(0), bytesRead(0), lastReadMicros(0) {
+}
+
+bool WeightPager::begin() {
+  requestQueue = xQueueCreate(1, sizeof(Request));
+  doneQueue = xQueueCreate(1, sizeof(bool));
+  if (!requestQueue || !doneQueue) {
+    LOGE(TAG_CAMERA, "Weight pager: no memory for queues");
+    return false;
+  }
+  // Core 0: the detector computes on core 1 while the next weights load
+  if (xTaskCreatePinnedToCore(pagerTaskEntry, "weights", WEIGHT_PAGER_STACK_SIZE, this, 1, NULL, 0) != pdPASS) {
+    LOGE(TAG_CAMERA, "Weight pager: failed to start task");
+    return false;
+  }
+  return true;
+}
+
+void WeightPager::attach(File file) {
+  detach();
+  modelFile = file;
+  hasFile = (bool)modelFile;
+}
+
+void WeightPager::setResident(const uint8_t *resident, size_t residentLen) {
+  waitRead();
+  residentData = resident;
+  residentBytes = residentLen;
+}
+
+void WeightPager::detach() {
+  waitRead();
+  if (hasFile) {
+    if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) == pdTRUE) {
+      modelFile.close();
+      xSemaphoreGive(sdCardMutex);
+    }
+    modelFile = File();
+  }
+  hasFile = false;
+  residentData = NULL;
+  residentBytes = 0;
+}
+
+bool WeightPager::beginRead(uint32_t modelOffset, uint8_t *dst, size_t len) {
+  if (busy || !requestQueue) return false;
+  Request request = {modelOffset, dst, (uint32_t)len};
+  if (xQueueSend(requestQueue, &request, 0) != pdTRUE) return false;
+  busy = true;
+  return true;
+}
+
+// SD reads give up on the mutex after 2 s, so every request completes
+bool WeightPager::waitRead() {
+  if (!busy) return true;
+  bool ok = false;
+  xQueueReceive(doneQueue, &ok, portMAX_DELAY);
+  busy = false;
+  return ok;
+}
+
+void WeightPager::pagerTaskEntry(void *param) {
+  ((WeightPager *)param)->run();
+}
+
+void WeightPager::run() {
+  Request request;
+  for (;;) {
+    if (xQueueReceive(requestQueue, &request, portMAX_DELAY) != pdTRUE) continue;
+    uint32_t start = micros();
+    bool ok = copy(request);
+    lastReadMicros = micros() - start;
+    reads++;
+    if (ok) bytesRead += request.len;
+    else failures++;
+    xQueueSend(doneQueue, &ok, portMAX_DELAY);
+  }
+}
+
+bool WeightPager::copy(const Request &request) {
+  if ((size_t)request.offset + request.len <= residentBytes) {
+    memcpy(request.dst, residentData + request.offset, request.len);
+    return true;
+  }
+  if (!hasFile || xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  bool ok = modelFile.seek(request.offset) && modelFile.read(request.dst, request.len) == request.len;
+  xSemaphoreGive(sdCardMutex);
+  sdReads++;
+  return ok;
+}
+
+void WeightPager::reportStatus(JsonObject out) const {
+  out["source"] = hasFile ? "sd" : "psram";
+  out["reads"] = reads;
+  out["sd_reads"] = sdReads;
+  out["failures"] = failures;
+  out["bytes"] = bytesRead;
+  out["last_read_us"] = lastReadMicros;
+}
@@ -0,0 +1,66 @@
+/**
+ * Model Weight Pager
+ *
+ * The InferWeightSource behind the detector: copies model bytes into the
+ * inference engine's page buffers on a helper task on core 0, so the copy
+ * overlaps with the layer running on core 1. Bytes inside the resident model
+ * image (PSRAM) are memcpy'd; bytes past it are read from the open model file
+ * on the SD card under sdCardMutex.
+ */
+
+#ifndef WEIGHT_PAGER_H
+#define WEIGHT_PAGER_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <ArduinoJson.h>
+#include "inference_engine.h"
+
+#define WEIGHT_PAGER_STACK_SIZE 3072
+
+class WeightPager : public InferWeightSource {
+public:
+  WeightPager();
+
+  bool begin();
+
+  // Reads past the resident image come from file, which the pager keeps
+  // open until detach()
+  void attach(File file);
+  // Model bytes below residentLen are served from memory
+  void setResident(const uint8_t *resident, size_t residentLen);
+  void detach();
+  bool readsFromSD() const { return hasFile; }
+
+  bool beginRead(uint32_t modelOffset, uint8_t *dst, size_t len) override;
+  bool waitRead() override;
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  struct Request {
+    uint32_t offset;
+    uint8_t *dst;
+    uint32_t len;
+  };
+
+  QueueHandle_t requestQueue;
+  QueueHandle_t doneQueue;
+  const uint8_t *residentData;
+  size_t residentBytes;
+  File modelFile;
+  bool hasFile;
+  bool busy;
+
+  uint32_t reads;
+  uint32_t sdReads;
+  uint32_t failures;
+  uint64_t bytesRead;
+  uint32_t lastReadMicros;
+
+  static void pagerTaskEntry(void *param);
+  void run();
+  bool copy(const Request &request);
+};
+
+#endif // WEIGHT_PAGER_H
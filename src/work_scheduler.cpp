@@ -0,0 +1,204 @@
+/**
+ * Deferred Work Scheduler Implementation
+ */
+
+#include "work_scheduler.h"
+#include "logger.h"
+#include <esp_timer.h>
+
+#define NO_JOB -1
+#define NO_WAKE 0xFFFFFFFF
+
+static const char *const CALLBACK_NAMES[CALLBACK_KIND_COUNT] = {"handler", "upload", "stream"};
+
+WorkScheduler workScheduler;
+
+WorkScheduler::WorkScheduler()
+  : doneTick(0), readyMask(0), nextId(1), task(NULL), jobsRun(0), jobsCancelled(0), tableFull(0), maxLateMs(0),
+    maxJobMs(0), slowestJob(NULL) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(jobs, 0, sizeof(jobs));
+  memset(wheel, NO_JOB, sizeof(wheel));
+  memset(callbacks, 0, sizeof(callbacks));
+}
+
+bool WorkScheduler::begin() {
+  if (task) return true;
+  doneTick = currentTick();
+  if (xTaskCreatePinnedToCore(taskEntry, "deferred", SCHEDULER_STACK_SIZE, this, 1, &task, 1) != pdPASS) {
+    task = NULL;
+    LOGE(TAG_SYSTEM, "Scheduler: failed to start task");
+    return false;
+  }
+  return true;
+}
+
+uint32_t WorkScheduler::currentTick() {
+  return (uint32_t)(esp_timer_get_time() / (SCHEDULER_TICK_MS * 1000));
+}
+
+uint32_t WorkScheduler::defer(const char *name, DeferredJob job, void *context, uint32_t delayMs) {
+  if (task == NULL || job == NULL) return 0;
+  uint32_t ticks = (delayMs + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS;
+  uint32_t id = 0;
+
+  portENTER_CRITICAL(&lock);
+  for (int8_t i = 0; i < SCHEDULER_MAX_JOBS; i++) {
+    if (jobs[i].id) continue;
+    id = nextId++;
+    if (nextId == 0) nextId = 1;
+    // Slots up to doneTick have been visited: the earliest is the next one
+    uint32_t due = currentTick() + ticks;
+    if ((int32_t)(due - doneTick) <= 0) due = doneTick + 1;
+    uint8_t slot = due % SCHEDULER_WHEEL_SLOTS;
+    Job &entry = jobs[i];
+    entry.id = id;
+    entry.name = name;
+    entry.run = job;
+    entry.context = context;
+    entry.dueTick = due;
+    entry.turns = (uint16_t)((due - doneTick - 1) / SCHEDULER_WHEEL_SLOTS);
+    entry.next = wheel[slot];
+    wheel[slot] = i;
+    break;
+  }
+  if (id == 0) tableFull++;
+  portEXIT_CRITICAL(&lock);
+
+  if (id == 0) {
+    LOGW_S(TAG_SYSTEM, "Scheduler: job table full, %s dropped", name);
+    return 0;
+  }
+  xTaskNotifyGive(task);
+  return id;
+}
+
+// The job stays on the wheel without a function and is freed when due
+bool WorkScheduler::cancel(uint32_t id) {
+  if (id == 0) return false;
+  bool cancelled = false;
+  portENTER_CRITICAL(&lock);
+  for (int8_t i = 0; i < SCHEDULER_MAX_JOBS; i++) {
+    if (jobs[i].id == id && jobs[i].run) {
+      jobs[i].run = NULL;
+      jobsCancelled++;
+      cancelled = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+  return cancelled;
+}
+
+void WorkScheduler::noteCallback(CallbackKind kind, uint32_t elapsedUs) {
+  CallbackStats &stats = callbacks[kind];
+  stats.calls++;
+  if (elapsedUs >= SCHEDULER_SLOW_CALLBACK_US) stats.slow++;
+  if (elapsedUs > stats.maxUs) stats.maxUs = elapsedUs;
+}
+
+CallbackTimer::~CallbackTimer() {
+  workScheduler.noteCallback(kind, micros() - start);
+}
+
+void WorkScheduler::taskEntry(void *param) {
+  static_cast<WorkScheduler *>(param)->run();
+}
+
+void WorkScheduler::run() {
+  for (;;) {
+    Job job;
+    portENTER_CRITICAL(&lock);
+    int8_t index = takeDue();
+    uint32_t wait = 0;
+    if (index != NO_JOB) {
+      job = jobs[index];
+      jobs[index].id = 0;
+    } else {
+      wait = ticksUntilNext();
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (index == NO_JOB) {
+      ulTaskNotifyTake(pdTRUE, wait == NO_WAKE ? portMAX_DELAY : pdMS_TO_TICKS(wait * SCHEDULER_TICK_MS));
+      continue;
+    }
+    if (job.run == NULL) continue;   // cancelled
+
+    uint32_t lateMs = (currentTick() - job.dueTick) * SCHEDULER_TICK_MS;
+    if (lateMs > maxLateMs) maxLateMs = lateMs;
+    uint32_t start = millis();
+    job.run(job.context);
+    uint32_t elapsed = millis() - start;
+    jobsRun++;
+    if (elapsed >= maxJobMs) {
+      maxJobMs = elapsed;
+      slowestJob = job.name;
+    }
+  }
+}
+
+// Caller holds lock. Visits the slots of the ticks that have passed until
+// one holds a due job; returns NO_JOB when nothing is due yet.
+int8_t WorkScheduler::takeDue() {
+  uint32_t now = currentTick();
+  while (readyMask == 0 && (int32_t)(now - doneTick) > 0) {
+    doneTick++;
+    int8_t *link = &wheel[doneTick % SCHEDULER_WHEEL_SLOTS];
+    while (*link != NO_JOB) {
+      Job &job = jobs[*link];
+      if (job.turns) {
+        job.turns--;
+        link = &job.next;
+      } else {
+        readyMask |= 1u << *link;
+        *link = job.next;
+      }
+    }
+  }
+  if (readyMask == 0) return NO_JOB;
+  int8_t index = (int8_t)__builtin_ctz(readyMask);
+  readyMask &= readyMask - 1;
+  return index;
+}
+
+// Caller holds lock. Ticks until the next occupied slot comes round.
+uint32_t WorkScheduler::ticksUntilNext() const {
+  uint32_t now = currentTick();
+  for (uint32_t ahead = 1; ahead <= SCHEDULER_WHEEL_SLOTS; ahead++) {
+    uint32_t tick = doneTick + ahead;
+    if (wheel[tick % SCHEDULER_WHEEL_SLOTS] == NO_JOB) continue;
+    return (int32_t)(tick - now) > 0 ? tick - now : 0;
+  }
+  return NO_WAKE;
+}
+
+void WorkScheduler::reportStatus(JsonObject out) const {
+  uint8_t pending = 0;
+  portENTER_CRITICAL(&lock);
+  for (uint8_t i = 0; i < SCHEDULER_MAX_JOBS; i++) {
+    if (jobs[i].id && jobs[i].run) pending++;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  out["running"] = task != NULL;
+  out["pending"] = pending;
+  out["jobs_run"] = jobsRun;
+  out["jobs_cancelled"] = jobsCancelled;
+  out["table_full"] = tableFull;
+  out["max_late_ms"] = maxLateMs;
+  out["max_job_ms"] = maxJobMs;
+  if (slowestJob) out["slowest_job"] = slowestJob;
+
+  uint32_t worst = 0;
+  JsonObject kinds = out["callbacks"].to<JsonObject>();
+  for (uint8_t k = 0; k < CALLBACK_KIND_COUNT; k++) {
+    const CallbackStats &stats = callbacks[k];
+    JsonObject kind = kinds[CALLBACK_NAMES[k]].to<JsonObject>();
+    kind["calls"] = stats.calls;
+    kind["slow"] = stats.slow;
+    kind["max_us"] = stats.maxUs;
+    if (stats.maxUs > worst) worst = stats.maxUs;
+  }
+  out["callback_max_us"] = worst;
+}
@@ -0,0 +1,111 @@
+/**
+ * Deferred Work Scheduler
+ *
+ * Web server callbacks run on the async_tcp task: while one of them sleeps
+ * or does slow work, every other client stalls. Such work is handed to
+ * defer() instead, which runs it on a worker task after a delay, so the
+ * callback returns right away (reboot once the response is out, stop or
+ * restart the camera, ...).
+ *
+ * Pending jobs sit in a hashed timer wheel: SCHEDULER_WHEEL_SLOTS slots of
+ * SCHEDULER_TICK_MS each, a job further out than one turn keeps a count of
+ * turns still to wait. The worker sleeps until the next occupied slot, or
+ * indefinitely when nothing is pending; defer() wakes it to recompute.
+ * Jobs run one at a time, in due order, on core 1.
+ *
+ * CallbackTimer measures a web server callback (handler, upload chunk,
+ * stream filler); the worst duration of each kind is reported with the
+ * job counters.
+ */
+
+#ifndef WORK_SCHEDULER_H
+#define WORK_SCHEDULER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define SCHEDULER_MAX_JOBS       16
+#define SCHEDULER_WHEEL_SLOTS    32
+#define SCHEDULER_TICK_MS        10
+#define SCHEDULER_STACK_SIZE     6144         // jobs include initCamera()
+#define SCHEDULER_SLOW_CALLBACK_US 20000      // callbacks counted as slow
+
+typedef void (*DeferredJob)(void *context);
+
+enum CallbackKind : uint8_t {
+  CALLBACK_HANDLER = 0,       // request handlers (route middleware)
+  CALLBACK_UPLOAD,            // upload and body chunks
+  CALLBACK_STREAM,            // chunked response fillers
+  CALLBACK_KIND_COUNT
+};
+
+class WorkScheduler {
+public:
+  WorkScheduler();
+
+  bool begin();
+
+  // Runs job(context) on the worker after delayMs. Returns an id for
+  // cancel(), or 0 when the job table is full. Callable from any task.
+  uint32_t defer(const char *name, DeferredJob job, void *context, uint32_t delayMs = 0);
+  // false when the job already ran (or is running)
+  bool cancel(uint32_t id);
+
+  void noteCallback(CallbackKind kind, uint32_t elapsedUs);
+  void reportStatus(JsonObject out) const;
+
+private:
+  struct Job {
+    uint32_t id;              // 0 = free
+    const char *name;
+    DeferredJob run;
+    void *context;
+    uint32_t dueTick;
+    uint16_t turns;           // full wheel turns still to wait
+    int8_t next;              // next job in the same slot
+  };
+
+  struct CallbackStats {
+    uint32_t calls;
+    uint32_t slow;
+    uint32_t maxUs;
+  };
+
+  Job jobs[SCHEDULER_MAX_JOBS];
+  int8_t wheel[SCHEDULER_WHEEL_SLOTS];
+  uint32_t doneTick;          // last tick whose slot was processed
+  uint32_t readyMask;         // due jobs taken off the wheel
+  uint32_t nextId;
+  TaskHandle_t task;
+  mutable portMUX_TYPE lock;
+
+  // Counters for reportStatus()
+  uint32_t jobsRun;
+  uint32_t jobsCancelled;
+  uint32_t tableFull;
+  uint32_t maxLateMs;
+  uint32_t maxJobMs;
+  const char *slowestJob;
+  CallbackStats callbacks[CALLBACK_KIND_COUNT];
+
+  static uint32_t currentTick();
+  static void taskEntry(void *param);
+  void run();
+  int8_t takeDue();
+  uint32_t ticksUntilNext() const;
+};
+
+// Records the time from construction to destruction as one callback
+class CallbackTimer {
+public:
+  explicit CallbackTimer(CallbackKind kind) : kind(kind), start(micros()) {}
+  ~CallbackTimer();
+
+private:
+  CallbackKind kind;
+  uint32_t start;
+};
+
+extern WorkScheduler workScheduler;
+
+#endif // WORK_SCHEDULER_H
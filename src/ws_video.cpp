@@ -0,0 +1,434 @@
+/**
+ * WebSocket Video Channel Implementation
+ */
+
+#include "ws_video.h"
+#include "logger.h"
+#include "route_metrics.h"
+#include <esp_camera.h>
+#include <esp_heap_caps.h>
+#include <new>
+
+extern bool cameraActive;
+
+WsVideo wsVideo;
+
+// Heap kept free beside a frame message (vectors above the malloc threshold
+// land in PSRAM, where the camera buffers also live)
+#define WS_VIDEO_HEAP_MARGIN  16384
+
+static inline void putU16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+static inline void putU32(uint8_t *p, uint32_t value) {
+  putU16(p, (uint16_t)value);
+  putU16(p + 2, (uint16_t)(value >> 16));
+}
+
+// Running average weighted 7/8 to the past, as the encoder timing
+static inline uint32_t smooth(uint32_t average, uint32_t sample) {
+  return average ? (average * 7 + sample) / 8 : sample;
+}
+
+WsVideo::WsVideo()
+  : socket(WS_VIDEO_PATH), task(NULL), frameIntervalMs(0), cropper(NULL), sequence(0), captureFailures(0),
+    sendFailures(0), cropFailures(0), rawFrames(0), bytes(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(clients, 0, sizeof(clients));
+}
+
+void WsVideo::attach(AsyncWebServer &server) {
+  socket.onEvent(onEvent);
+  routeMetrics.track(server.addHandler(&socket), WS_VIDEO_PATH);
+}
+
+bool WsVideo::begin(const StreamSettings &settings) {
+  configure(settings);
+  void *memory = heap_caps_malloc(sizeof(JpegCropper), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (memory) cropper = new (memory) JpegCropper();
+  if (xTaskCreatePinnedToCore(taskEntry, "ws_video", WS_VIDEO_STACK_SIZE, this, WS_VIDEO_PRIORITY, &task,
+                              WS_VIDEO_CORE) != pdPASS) {
+    LOGW(TAG_CAMERA, "WebSocket video: task start failed");
+    return false;
+  }
+  return true;
+}
+
+void WsVideo::configure(const StreamSettings &settings) {
+  portENTER_CRITICAL(&lock);
+  frameIntervalMs = settings.frameIntervalMs;
+  portEXIT_CRITICAL(&lock);
+  wake();
+}
+
+void WsVideo::wake() {
+  if (task) xTaskNotifyGive(task);
+}
+
+// ---------------------------------------------------------------------------
+// Socket events (async_tcp task)
+
+void WsVideo::onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                      uint8_t *data, size_t len) {
+  switch (type) {
+    case WS_EVT_CONNECT:
+      wsVideo.connected(client);
+      break;
+    case WS_EVT_DISCONNECT:
+      wsVideo.disconnected(client->id());
+      break;
+    case WS_EVT_DATA: {
+      // Control messages are small: a single unfragmented text frame
+      AwsFrameInfo *info = (AwsFrameInfo *)arg;
+      if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT &&
+          len <= WS_VIDEO_MAX_CONTROL) {
+        wsVideo.control(client, data, len);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+WsVideoClient *WsVideo::find(uint32_t id) {
+  for (int i = 0; i < WS_VIDEO_MAX_CLIENTS; i++) {
+    if (clients[i].id == id) return &clients[i];
+  }
+  return NULL;
+}
+
+void WsVideo::connected(AsyncWebSocketClient *client) {
+  portENTER_CRITICAL(&lock);
+  WsVideoClient *slot = find(0);
+  if (slot) {
+    memset(slot, 0, sizeof(*slot));
+    slot->id = client->id();
+    slot->ip = (uint32_t)client->remoteIP();
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if (slot == NULL) {
+    client->close(1013, "Too many video clients");
+    return;
+  }
+  LOGI_S(TAG_CAMERA, "WebSocket video: %s connected", client->remoteIP().toString().c_str());
+  wake();
+}
+
+void WsVideo::disconnected(uint32_t id) {
+  portENTER_CRITICAL(&lock);
+  WsVideoClient *slot = find(id);
+  if (slot) slot->id = 0;
+  portEXIT_CRITICAL(&lock);
+}
+
+void WsVideo::control(AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+  JsonDocument doc;
+  if (deserializeJson(doc, (const char *)data, len) || !doc.is<JsonObject>()) {
+    client->text("{\"error\":\"Invalid control message\"}");
+    return;
+  }
+  JsonObjectConst message = doc.as<JsonObjectConst>();
+  // "roi": null clears the region, so look for the key itself
+  bool hasRoi = false;
+  for (JsonPairConst pair : message) {
+    if (strcmp(pair.key().c_str(), "roi") == 0) hasRoi = true;
+  }
+  JsonObjectConst roi = message["roi"].as<JsonObjectConst>();
+  if (hasRoi && !roi.isNull() && (!(roi["w"].as<int>() > 0) || !(roi["h"].as<int>() > 0))) {
+    client->text("{\"error\":\"roi needs positive w and h\"}");
+    return;
+  }
+
+  // Read everything before taking the lock
+  bool ack = message["ack"].is<uint32_t>();
+  uint32_t ackSequence = message["ack"].as<uint32_t>();
+  bool setPause = message["pause"].is<bool>();
+  bool pause = message["pause"].as<bool>();
+  bool setFps = message["max_fps"].is<int>();
+  int fps = message["max_fps"].as<int>();
+  JpegCropRect region = {0, 0, 0, 0};
+  if (hasRoi && !roi.isNull()) {
+    region.x = roi["x"].as<uint16_t>();
+    region.y = roi["y"].as<uint16_t>();
+    region.width = roi["w"].as<uint16_t>();
+    region.height = roi["h"].as<uint16_t>();
+  }
+
+  uint32_t now = millis();
+  bool ready = false;
+  portENTER_CRITICAL(&lock);
+  WsVideoClient *slot = find(client->id());
+  if (slot) {
+    if (ack && slot->inFlight && ackSequence == slot->sentSequence) {
+      uint32_t rtt = now - slot->sentMs;
+      uint32_t age = now - slot->capturedMs;
+      slot->rttAvgMs = smooth(slot->rttAvgMs, rtt);
+      slot->ageAvgMs = smooth(slot->ageAvgMs, age);
+      if (rtt > slot->rttMaxMs) slot->rttMaxMs = rtt;
+      if (age > slot->ageMaxMs) slot->ageMaxMs = age;
+      slot->inFlight = false;
+      ready = true;
+    }
+    if (setPause) {
+      slot->paused = pause;
+      ready = ready || !pause;
+    }
+    if (setFps) slot->maxFps = (uint8_t)(fps < 0 ? 0 : (fps > 30 ? 30 : fps));
+    if (hasRoi) slot->roi = region;
+  }
+  portEXIT_CRITICAL(&lock);
+  if (ready) wake();
+
+  // Hints go through the config store like a live /api/camera change, but
+  // are not saved
+  if (message["quality"].is<int>() || message["frame_size"].is<const char *>()) {
+    JsonDocument patch;
+    if (message["quality"].is<int>()) patch["camera"]["quality"] = message["quality"];
+    if (message["frame_size"].is<const char *>()) patch["camera"]["frame_size"] = message["frame_size"];
+    ConfigChange change;
+    String error;
+    if (!configStore.update(patch, change, error, false)) {
+      client->text(("{\"error\":\"" + error + "\"}").c_str());
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Sender task
+
+void WsVideo::taskEntry(void *param) {
+  ((WsVideo *)param)->run();
+}
+
+void WsVideo::run() {
+  uint32_t lastCaptureMs = 0;
+  uint32_t lastCleanupMs = 0;
+  for (;;) {
+    uint32_t now = millis();
+    if (now - lastCleanupMs >= WS_VIDEO_IDLE_MS) {
+      socket.cleanupClients(WS_VIDEO_MAX_CLIENTS);
+      lastCleanupMs = now;
+    }
+
+    Target targets[WS_VIDEO_MAX_CLIENTS];
+    uint32_t waitMs = WS_VIDEO_IDLE_MS;
+    uint8_t count = readyTargets(now, targets, waitMs);
+    count = dropBacklogged(targets, count, waitMs);
+    if (count == 0 || !cameraActive) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+      continue;
+    }
+
+    portENTER_CRITICAL(&lock);
+    uint16_t interval = frameIntervalMs;
+    portEXIT_CRITICAL(&lock);
+    if (lastCaptureMs && now - lastCaptureMs < interval) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(interval - (now - lastCaptureMs)));
+      continue;
+    }
+    lastCaptureMs = now;
+    sendFrame(targets, count);
+  }
+}
+
+// Clients that can take a frame now. waitMs is lowered to when the next
+// one could (an ack timeout or its max_fps).
+uint8_t WsVideo::readyTargets(uint32_t nowMs, Target *targets, uint32_t &waitMs) {
+  uint8_t count = 0;
+  portENTER_CRITICAL(&lock);
+  for (int i = 0; i < WS_VIDEO_MAX_CLIENTS; i++) {
+    WsVideoClient &client = clients[i];
+    if (client.id == 0 || client.paused) continue;
+    uint32_t since = nowMs - client.sentMs;
+    uint32_t holdMs = 0;
+    if (client.inFlight) {
+      if (since < WS_VIDEO_ACK_TIMEOUT_MS) {
+        holdMs = WS_VIDEO_ACK_TIMEOUT_MS - since;
+      } else {
+        client.inFlight = false;
+        client.timeouts++;
+      }
+    }
+    if (holdMs == 0 && client.maxFps && client.frames && since < 1000u / client.maxFps) {
+      holdMs = 1000u / client.maxFps - since;
+    }
+    if (holdMs) {
+      if (holdMs < waitMs) waitMs = holdMs;
+      continue;
+    }
+    targets[count].id = client.id;
+    targets[count].roi = client.roi;
+    count++;
+  }
+  portEXIT_CRITICAL(&lock);
+  return count;
+}
+
+// Removes clients whose socket queue is not empty: after an ack timeout the
+// previous frame may still be queued, and another one would only pile up
+// behind it (or be refused once the queue is full). They are checked again
+// after WS_VIDEO_BACKLOG_POLL_MS.
+uint8_t WsVideo::dropBacklogged(Target *targets, uint8_t count, uint32_t &waitMs) {
+  uint8_t kept = 0;
+  for (uint8_t t = 0; t < count; t++) {
+    AsyncWebSocketClient *wsClient = socket.client(targets[t].id);
+    if (wsClient && wsClient->queueLen() == 0) {
+      targets[kept++] = targets[t];
+      continue;
+    }
+    portENTER_CRITICAL(&lock);
+    WsVideoClient *client = find(targets[t].id);
+    if (client) client->backlogged++;
+    portEXIT_CRITICAL(&lock);
+    if (WS_VIDEO_BACKLOG_POLL_MS < waitMs) waitMs = WS_VIDEO_BACKLOG_POLL_MS;
+  }
+  return kept;
+}
+
+// A message with room for a JPEG of up to capacity bytes after the header,
+// or NULL when the heap cannot spare it
+static AsyncWebSocketSharedBuffer newMessage(size_t capacity) {
+  size_t size = WS_VIDEO_HEADER_SIZE + capacity;
+  if (heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) < size + WS_VIDEO_HEAP_MARGIN) {
+    return AsyncWebSocketSharedBuffer();
+  }
+  return std::make_shared<std::vector<uint8_t>>(size);
+}
+
+static void writeHeader(uint8_t *p, uint32_t sequence, uint32_t capturedMs, const JpegCropRect &rect) {
+  putU32(p, sequence);
+  putU32(p + 4, capturedMs);
+  putU16(p + 8, rect.x);
+  putU16(p + 10, rect.y);
+  putU16(p + 12, rect.width);
+  putU16(p + 14, rect.height);
+}
+
+// Lossless crop of the frame into a new message; the header is left to the
+// caller
+AsyncWebSocketSharedBuffer WsVideo::cropMessage(const uint8_t *jpeg, size_t len, const JpegCropRect &roi) {
+  if (cropper == NULL) return AsyncWebSocketSharedBuffer();
+  AsyncWebSocketSharedBuffer message = newMessage(JpegCropper::maxOutputSize(len));
+  if (!message) return message;
+  size_t outLen = 0;
+  JpegCropRect actual;
+  if (!cropper->crop(jpeg, len, roi, message->data() + WS_VIDEO_HEADER_SIZE,
+                     message->size() - WS_VIDEO_HEADER_SIZE, outLen, actual)) {
+    return AsyncWebSocketSharedBuffer();
+  }
+  message->resize(WS_VIDEO_HEADER_SIZE + outLen);
+  writeHeader(message->data(), 0, 0, actual);
+  return message;
+}
+
+void WsVideo::sendFrame(const Target *targets, uint8_t count) {
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (!fb) {
+    captureFailures++;
+    return;
+  }
+  uint32_t capturedMs = millis();
+  uint32_t frameSequence = ++sequence;
+
+  if (fb->format != PIXFORMAT_JPEG) {
+    esp_camera_fb_return(fb);
+    // Pause them rather than retry every frame interval
+    if (rawFrames++ == 0) LOGW(TAG_CAMERA, "WebSocket video: only the JPEG pixel format is sent");
+    for (uint8_t t = 0; t < count; t++) {
+      socket.text(targets[t].id, "{\"error\":\"Raw pixel format: use /stream\"}");
+    }
+    portENTER_CRITICAL(&lock);
+    for (uint8_t t = 0; t < count; t++) {
+      WsVideoClient *client = find(targets[t].id);
+      if (client) client->paused = true;
+    }
+    portEXIT_CRITICAL(&lock);
+    return;
+  }
+
+  // One copy of the whole frame shared by every client that wants it, a
+  // crop each for the others; the camera buffer goes back before sending
+  AsyncWebSocketSharedBuffer whole;
+  AsyncWebSocketSharedBuffer messages[WS_VIDEO_MAX_CLIENTS];
+  for (uint8_t t = 0; t < count; t++) {
+    if (targets[t].roi.width) {
+      messages[t] = cropMessage(fb->buf, fb->len, targets[t].roi);
+      if (!messages[t]) cropFailures++;
+    } else {
+      if (!whole) {
+        whole = newMessage(fb->len);
+        if (whole) {
+          memcpy(whole->data() + WS_VIDEO_HEADER_SIZE, fb->buf, fb->len);
+          JpegCropRect all = {0, 0, (uint16_t)fb->width, (uint16_t)fb->height};
+          writeHeader(whole->data(), 0, 0, all);
+        }
+      }
+      messages[t] = whole;
+    }
+    if (messages[t]) {
+      putU32(messages[t]->data(), frameSequence);
+      putU32(messages[t]->data() + 4, capturedMs);
+    }
+  }
+  esp_camera_fb_return(fb);
+
+  for (uint8_t t = 0; t < count; t++) {
+    if (!messages[t]) continue;
+    bool sent = socket.binary(targets[t].id, messages[t]);
+    uint32_t now = millis();
+    portENTER_CRITICAL(&lock);
+    WsVideoClient *client = find(targets[t].id);
+    if (client && sent) {
+      client->inFlight = true;
+      client->sentSequence = frameSequence;
+      client->sentMs = now;
+      client->capturedMs = capturedMs;
+      client->frames++;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (sent) bytes += messages[t]->size();
+    else sendFailures++;
+  }
+}
+
+void WsVideo::reportStatus(JsonObject out) const {
+  portENTER_CRITICAL(&lock);
+  WsVideoClient list[WS_VIDEO_MAX_CLIENTS];
+  memcpy(list, clients, sizeof(list));
+  portEXIT_CRITICAL(&lock);
+
+  JsonArray sessions = out["clients"].to<JsonArray>();
+  for (int i = 0; i < WS_VIDEO_MAX_CLIENTS; i++) {
+    const WsVideoClient &client = list[i];
+    if (client.id == 0) continue;
+    JsonObject session = sessions.add<JsonObject>();
+    session["id"] = client.id;
+    session["host"] = IPAddress(client.ip).toString();
+    session["paused"] = client.paused;
+    session["max_fps"] = client.maxFps;
+    if (client.roi.width) {
+      JsonObject roi = session["roi"].to<JsonObject>();
+      roi["x"] = client.roi.x;
+      roi["y"] = client.roi.y;
+      roi["w"] = client.roi.width;
+      roi["h"] = client.roi.height;
+    }
+    session["frames"] = client.frames;
+    session["ack_timeouts"] = client.timeouts;
+    session["backlogged"] = client.backlogged;
+    session["rtt_avg_ms"] = client.rttAvgMs;
+    session["rtt_max_ms"] = client.rttMaxMs;
+    session["age_avg_ms"] = client.ageAvgMs;
+    session["age_max_ms"] = client.ageMaxMs;
+  }
+  out["captures"] = sequence;
+  out["capture_failures"] = captureFailures;
+  out["send_failures"] = sendFailures;
+  out["crop_failures"] = cropFailures;
+  out["raw_frames"] = rawFrames;
+  out["bytes"] = bytes;
+}
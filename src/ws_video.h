@@ -0,0 +1,125 @@
+/**
+ * WebSocket Video Channel
+ *
+ * Camera frames over a WebSocket at /ws/video, one binary message per
+ * frame, with the browser in the loop: the multipart /stream pushes frames
+ * into the TCP window whether or not the viewer keeps up, so a slow viewer
+ * sees ever older frames. Here each client has at most one frame in flight
+ * and acknowledges it once drawn; only then is it sent another, and that
+ * one is a fresh capture. Frames taken for other clients in the meantime
+ * are simply not sent to it (latest frame wins), so what is on screen stays
+ * about one capture plus one transfer old however slow the viewer is.
+ *
+ * Binary message: WS_VIDEO_HEADER_SIZE bytes (little-endian) then the JPEG
+ *   uint32 sequence   echoed in the ack
+ *   uint32 captured   uptime ms at capture
+ *   uint16 x, y       origin of the JPEG in the frame (ROI, else 0)
+ *   uint16 w, h       size of the JPEG
+ *
+ * Control messages are JSON text, any keys combined:
+ *   {"ack": seq}                    frame drawn, send the next
+ *   {"pause": true|false}
+ *   {"max_fps": n}                  this client only (0 = as acks allow)
+ *   {"roi": {"x":,"y":,"w":,"h":}}  lossless crop for this client, null = whole frame
+ *   {"quality": 4..63}              hints: applied to the sensor (shared
+ *   {"frame_size": "vga"}           with every viewer) and not saved
+ *
+ * A frame not acknowledged within WS_VIDEO_ACK_TIMEOUT_MS is given up on,
+ * but the client gets no new frame while the socket still has messages
+ * queued for it (the lost ack may just be a slow link): it is polled every
+ * WS_VIDEO_BACKLOG_POLL_MS until the queue drains.
+ * Frames are captured by a task of their own (each consumer takes its own
+ * camera buffer), copied once into a buffer shared by every client that
+ * gets the whole frame, and the camera buffer is returned before sending.
+ * Only the sensor's JPEG pixel format is sent.
+ */
+
+#ifndef WS_VIDEO_H
+#define WS_VIDEO_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+#include "config_store.h"
+#include "jpeg_crop.h"
+
+#define WS_VIDEO_PATH            "/ws/video"
+#define WS_VIDEO_MAX_CLIENTS     4
+#define WS_VIDEO_HEADER_SIZE     16
+#define WS_VIDEO_ACK_TIMEOUT_MS  1000
+#define WS_VIDEO_MAX_CONTROL     256      // bytes of one control message
+#define WS_VIDEO_STACK_SIZE      4096
+#define WS_VIDEO_PRIORITY        2
+#define WS_VIDEO_CORE            0
+#define WS_VIDEO_IDLE_MS         1000     // wake-up without ready clients
+#define WS_VIDEO_BACKLOG_POLL_MS 50       // recheck of a client with queued messages
+
+struct WsVideoClient {
+  uint32_t id;                 // WebSocket client id (0 = free slot)
+  uint32_t ip;
+  bool paused;
+  bool inFlight;
+  uint8_t maxFps;
+  JpegCropRect roi;            // width 0 = whole frame
+  uint32_t sentSequence;
+  uint32_t sentMs;
+  uint32_t capturedMs;
+  uint32_t frames;
+  uint32_t timeouts;           // acks that never came
+  uint32_t backlogged;         // frames skipped, socket queue not drained
+  uint32_t rttAvgMs;           // send to ack (transfer, decode, draw)
+  uint32_t rttMaxMs;
+  uint32_t ageAvgMs;           // capture to ack
+  uint32_t ageMaxMs;
+};
+
+class WsVideo {
+public:
+  WsVideo();
+
+  // Registers the socket handler on the web server
+  void attach(AsyncWebServer &server);
+  bool begin(const StreamSettings &settings);
+  void configure(const StreamSettings &settings);
+
+  void reportStatus(JsonObject out) const;
+
+private:
+  struct Target {
+    uint32_t id;
+    JpegCropRect roi;
+  };
+
+  static void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                      uint8_t *data, size_t len);
+  static void taskEntry(void *param);
+  void connected(AsyncWebSocketClient *client);
+  void disconnected(uint32_t id);
+  void control(AsyncWebSocketClient *client, const uint8_t *data, size_t len);
+  WsVideoClient *find(uint32_t id);
+  void run();
+  uint8_t readyTargets(uint32_t nowMs, Target *targets, uint32_t &waitMs);
+  uint8_t dropBacklogged(Target *targets, uint8_t count, uint32_t &waitMs);
+  void sendFrame(const Target *targets, uint8_t count);
+  AsyncWebSocketSharedBuffer cropMessage(const uint8_t *jpeg, size_t len, const JpegCropRect &roi);
+  void wake();
+
+  AsyncWebSocket socket;
+  TaskHandle_t task;
+  mutable portMUX_TYPE lock;
+  uint16_t frameIntervalMs;
+  WsVideoClient clients[WS_VIDEO_MAX_CLIENTS];
+  JpegCropper *cropper;        // PSRAM, task only
+
+  // Statistics (task writes, reportStatus reads)
+  uint32_t sequence;
+  uint32_t captureFailures;
+  uint32_t sendFailures;       // client gone or its queue full
+  uint32_t cropFailures;
+  uint32_t rawFrames;          // not JPEG, not sent
+  uint64_t bytes;
+};
+
+extern WsVideo wsVideo;
+
+#endif // WS_VIDEO_H
@@ -0,0 +1,147 @@
+/**
+ * Detection Zone Masks Implementation
+ */
+
+#include "zone_mask.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Edges cross a scanline when exactly one end is at or below it, so a
+// vertex shared by two edges is counted once
+static inline bool crosses(const ZonePoint &p, const ZonePoint &q, float y) {
+  return (p.y <= y) != (q.y <= y);
+}
+
+bool zoneContains(const ZonePolygon &zone, uint16_t x, uint16_t y) {
+  bool inside = false;
+  for (uint8_t i = 0, j = zone.pointCount - 1; i < zone.pointCount; j = i++) {
+    const ZonePoint &p = zone.points[i];
+    const ZonePoint &q = zone.points[j];
+    if (crosses(p, q, y) && x < p.x + ((float)y - p.y) * ((float)q.x - p.x) / ((float)q.y - p.y)) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+static void setRange(uint32_t *bits, uint16_t x0, uint16_t x1, bool set) {
+  while (x0 < x1) {
+    uint16_t word = x0 >> 5;
+    uint16_t end = (uint16_t)((word + 1) << 5) < x1 ? (uint16_t)((word + 1) << 5) : x1;
+    uint32_t span = end - x0 == 32 ? 0xFFFFFFFFu : (((1u << (end - x0)) - 1) << (x0 & 31));
+    if (set) bits[word] |= span;
+    else bits[word] &= ~span;
+    x0 = end;
+  }
+}
+
+// First pixel whose centre is at or right of a per-mille x
+static uint16_t pixelAt(float x, uint16_t width) {
+  float v = ceilf(x * width / ZONE_COORD_MAX - 0.5f);
+  return v <= 0.0f ? 0 : (v >= width ? width : (uint16_t)v);
+}
+
+// Sets or clears the pixels of one row that the polygon covers at
+// per-mille height y
+static void fillRow(const ZonePolygon &zone, float y, uint16_t width, uint32_t *bits, bool set) {
+  float xs[ZONE_MAX_POINTS];
+  uint8_t n = 0;
+  for (uint8_t i = 0, j = zone.pointCount - 1; i < zone.pointCount; j = i++) {
+    const ZonePoint &p = zone.points[i];
+    const ZonePoint &q = zone.points[j];
+    if (!crosses(p, q, y)) continue;
+    float x = p.x + (y - p.y) * ((float)q.x - p.x) / ((float)q.y - p.y);
+    uint8_t k = n++;
+    while (k > 0 && xs[k - 1] > x) {
+      xs[k] = xs[k - 1];
+      k--;
+    }
+    xs[k] = x;
+  }
+  for (uint8_t k = 0; k + 1 < n; k += 2) {
+    setRange(bits, pixelAt(xs[k], width), pixelAt(xs[k + 1], width), set);
+  }
+}
+
+ZoneMask::ZoneMask()
+  : bitmap(NULL), rowWords(0), spans(NULL), rowStart(NULL), maskWidth(0), maskHeight(0), activeCount(0) {
+}
+
+ZoneMask::~ZoneMask() {
+  clear();
+}
+
+void ZoneMask::clear() {
+  free(bitmap);
+  free(spans);
+  free(rowStart);
+  bitmap = NULL;
+  spans = NULL;
+  rowStart = NULL;
+  rowWords = 0;
+  maskWidth = 0;
+  maskHeight = 0;
+  activeCount = 0;
+}
+
+bool ZoneMask::compile(const ZonePolygon *zones, uint8_t count, uint16_t width, uint16_t height) {
+  clear();
+  if (width == 0 || height == 0) return false;
+  rowWords = (width + 31) / 32;
+  bitmap = (uint32_t *)calloc((size_t)rowWords * height, sizeof(uint32_t));
+  rowStart = (uint32_t *)malloc(((size_t)height + 1) * sizeof(uint32_t));
+  if (!bitmap || !rowStart) {
+    clear();
+    return false;
+  }
+  maskWidth = width;
+  maskHeight = height;
+
+  bool anyInclude = false;
+  for (uint8_t z = 0; z < count; z++) {
+    if (!zones[z].exclude && zones[z].pointCount >= 3) anyInclude = true;
+  }
+
+  // Includes first, then excludes cut them back
+  uint32_t runs = 0;
+  for (uint16_t y = 0; y < height; y++) {
+    uint32_t *bits = bitmap + (size_t)y * rowWords;
+    float sy = (y + 0.5f) * ZONE_COORD_MAX / height;
+    if (!anyInclude) setRange(bits, 0, width, true);
+    for (uint8_t pass = 0; pass < 2; pass++) {
+      for (uint8_t z = 0; z < count; z++) {
+        if (zones[z].pointCount < 3 || zones[z].exclude != (pass == 1)) continue;
+        fillRow(zones[z], sy, width, bits, pass == 0);
+      }
+    }
+    bool previous = false;
+    for (uint16_t x = 0; x < width; x++) {
+      bool active = test(x, y);
+      if (active && !previous) runs++;
+      if (active) activeCount++;
+      previous = active;
+    }
+  }
+
+  spans = (ZoneSpan *)malloc((runs ? runs : 1) * sizeof(ZoneSpan));
+  if (!spans) {
+    clear();
+    return false;
+  }
+  uint32_t next = 0;
+  for (uint16_t y = 0; y < height; y++) {
+    rowStart[y] = next;
+    uint16_t x = 0;
+    while (x < width) {
+      while (x < width && !test(x, y)) x++;
+      if (x == width) break;
+      ZoneSpan &span = spans[next++];
+      span.x0 = x;
+      while (x < width && test(x, y)) x++;
+      span.x1 = x;
+    }
+  }
+  rowStart[height] = next;
+  return true;
+}
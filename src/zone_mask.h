@@ -0,0 +1,83 @@
+/**
+ * Detection Zone Masks
+ *
+ * Zones are polygons in frame-relative coordinates (per mille of the width
+ * and height), so one definition serves every resolution. A ZoneMask is the
+ * zones rasterized once at an analysis resolution: a pixel is active when it
+ * lies inside an include zone (or no include zone exists) and inside no
+ * exclude zone, sampled at the pixel centre.
+ *
+ * The mask is kept both as packed bits (one bit per pixel, rows padded to
+ * 32 bits) for point tests and as runs of active pixels per row, so loops
+ * over the active area cost what the area covers.
+ *
+ * No Arduino dependencies, so masks can be checked on a host.
+ */
+
+#ifndef ZONE_MASK_H
+#define ZONE_MASK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ZONE_MAX_ZONES    8
+#define ZONE_MAX_POINTS   12
+#define ZONE_COORD_MAX    1000    // per mille
+
+struct ZonePoint {
+  uint16_t x;
+  uint16_t y;
+};
+
+struct ZonePolygon {
+  bool exclude;
+  uint8_t pointCount;
+  ZonePoint points[ZONE_MAX_POINTS];
+};
+
+// Active pixels [x0, x1) of one row
+struct ZoneSpan {
+  uint16_t x0;
+  uint16_t x1;
+};
+
+// Even-odd test of a per-mille point
+bool zoneContains(const ZonePolygon &zone, uint16_t x, uint16_t y);
+
+class ZoneMask {
+public:
+  ZoneMask();
+  ~ZoneMask();
+
+  // Rasterizes zones at width x height; false when out of memory (the mask
+  // is then cleared)
+  bool compile(const ZonePolygon *zones, uint8_t count, uint16_t width, uint16_t height);
+  void clear();
+
+  bool compiled() const { return bitmap != NULL; }
+  // No zones, or zones that leave every pixel active
+  bool full() const { return activeCount == (uint32_t)maskWidth * maskHeight; }
+  uint16_t width() const { return maskWidth; }
+  uint16_t height() const { return maskHeight; }
+  uint32_t activePixels() const { return activeCount; }
+
+  bool test(uint16_t x, uint16_t y) const {
+    return (bitmap[(size_t)y * rowWords + (x >> 5)] >> (x & 31)) & 1;
+  }
+  const uint32_t *row(uint16_t y) const { return bitmap + (size_t)y * rowWords; }
+  const ZoneSpan *rowSpans(uint16_t y, uint16_t &count) const {
+    count = rowStart[y + 1] - rowStart[y];
+    return spans + rowStart[y];
+  }
+
+private:
+  uint32_t *bitmap;
+  uint16_t rowWords;
+  ZoneSpan *spans;
+  uint32_t *rowStart;             // height + 1 entries into spans
+  uint16_t maskWidth;
+  uint16_t maskHeight;
+  uint32_t activeCount;
+};
+
+#endif // ZONE_MASK_H
@@ -0,0 +1,226 @@
+/**
+ * Detection Zones Implementation
+ */
+
+#include "zones.h"
+#include "logger.h"
+#include <SD_MMC.h>
+
+// Shared with main.cpp
+extern SemaphoreHandle_t sdCardMutex;
+
+ZoneMap zoneMap;
+
+static const char *ZONE_TYPE_NAMES[] = {"include", "exclude"};
+static const char *EVENT_TYPE_NAMES[] = {"enter", "exit"};
+
+static void writeZones(JsonArray out, const ZonePolygon *polygons, const char (*names)[ZONE_NAME_LEN],
+                       uint8_t count) {
+  for (uint8_t z = 0; z < count; z++) {
+    JsonObject zone = out.add<JsonObject>();
+    zone["name"] = names[z];
+    zone["type"] = ZONE_TYPE_NAMES[polygons[z].exclude ? 1 : 0];
+    JsonArray points = zone["points"].to<JsonArray>();
+    for (uint8_t k = 0; k < polygons[z].pointCount; k++) {
+      JsonArray point = points.add<JsonArray>();
+      point.add(polygons[z].points[k].x);
+      point.add(polygons[z].points[k].y);
+    }
+  }
+}
+
+ZoneMap::ZoneMap()
+  : zoneCount(0), zonesVersion(1), eventHead(0), eventCount(0), eventTotal(0) {
+  lock = portMUX_INITIALIZER_UNLOCKED;
+  memset(polygons, 0, sizeof(polygons));
+  memset(names, 0, sizeof(names));
+}
+
+void ZoneMap::begin(bool sdReady) {
+  if (!sdReady) return;
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return;
+  File file = SD_MMC.open(ZONES_FILE, FILE_READ);
+  if (!file) {
+    xSemaphoreGive(sdCardMutex);
+    return;
+  }
+  JsonDocument doc;
+  DeserializationError parseError = deserializeJson(doc, file);
+  file.close();
+  xSemaphoreGive(sdCardMutex);
+
+  String error;
+  if (parseError) {
+    LOGW(TAG_CONFIG, "Zones: %s is not valid JSON", ZONES_FILE);
+  } else if (!update(doc, error, false)) {
+    LOGW_S(TAG_CONFIG, "Zones: %s", error.c_str());
+  } else {
+    LOGI(TAG_CONFIG, "Zones: %u loaded", zoneCount);
+  }
+}
+
+bool ZoneMap::parse(JsonVariantConst doc, ZonePolygon *outPolygons, char (*outNames)[ZONE_NAME_LEN],
+                    uint8_t &count, String &error) const {
+  JsonArrayConst list = doc["zones"].as<JsonArrayConst>();
+  if (list.isNull()) {
+    error = "Expected {\"zones\": [...]}";
+    return false;
+  }
+  if (list.size() > ZONE_MAX_ZONES) {
+    error = String("At most ") + String(ZONE_MAX_ZONES) + " zones";
+    return false;
+  }
+
+  count = 0;
+  for (JsonVariantConst entry : list) {
+    JsonObjectConst zone = entry.as<JsonObjectConst>();
+    String prefix = String("Zone ") + String(count) + ": ";
+    ZonePolygon &polygon = outPolygons[count];
+    memset(&polygon, 0, sizeof(polygon));
+
+    const char *name = zone["name"] | "";
+    if (strlen(name) >= ZONE_NAME_LEN) {
+      error = prefix + "name longer than " + String(ZONE_NAME_LEN - 1) + " characters";
+      return false;
+    }
+    if (name[0]) strcpy(outNames[count], name);
+    else snprintf(outNames[count], ZONE_NAME_LEN, "zone%u", count);
+
+    const char *type = zone["type"] | ZONE_TYPE_NAMES[0];
+    if (strcmp(type, ZONE_TYPE_NAMES[0]) != 0 && strcmp(type, ZONE_TYPE_NAMES[1]) != 0) {
+      error = prefix + "type must be include or exclude";
+      return false;
+    }
+    polygon.exclude = strcmp(type, ZONE_TYPE_NAMES[1]) == 0;
+
+    JsonArrayConst points = zone["points"].as<JsonArrayConst>();
+    if (points.isNull() || points.size() < 3 || points.size() > ZONE_MAX_POINTS) {
+      error = prefix + "needs 3 to " + String(ZONE_MAX_POINTS) + " points";
+      return false;
+    }
+    for (JsonVariantConst entry : points) {
+      JsonArrayConst point = entry.as<JsonArrayConst>();
+      if (point.size() != 2 || !point[0].is<int>() || !point[1].is<int>()) {
+        error = prefix + "points are [x, y] pairs";
+        return false;
+      }
+      int x = point[0].as<int>();
+      int y = point[1].as<int>();
+      if (x < 0 || x > ZONE_COORD_MAX || y < 0 || y > ZONE_COORD_MAX) {
+        error = prefix + "coordinates are per mille (0.." + String(ZONE_COORD_MAX) + ")";
+        return false;
+      }
+      polygon.points[polygon.pointCount].x = (uint16_t)x;
+      polygon.points[polygon.pointCount].y = (uint16_t)y;
+      polygon.pointCount++;
+    }
+    count++;
+  }
+  return true;
+}
+
+bool ZoneMap::update(JsonVariantConst doc, String &error, bool persist) {
+  ZonePolygon nextPolygons[ZONE_MAX_ZONES];
+  char nextNames[ZONE_MAX_ZONES][ZONE_NAME_LEN];
+  uint8_t count = 0;
+  if (!parse(doc, nextPolygons, nextNames, count, error)) return false;
+  if (persist && !save(nextPolygons, nextNames, count)) {
+    error = "Failed to write " ZONES_FILE;
+    return false;
+  }
+
+  portENTER_CRITICAL(&lock);
+  memcpy(polygons, nextPolygons, sizeof(ZonePolygon) * count);
+  memcpy(names, nextNames, sizeof(names[0]) * count);
+  zoneCount = count;
+  zonesVersion++;
+  portEXIT_CRITICAL(&lock);
+  return true;
+}
+
+// Written to a temporary file first, like /config.json
+bool ZoneMap::save(const ZonePolygon *savePolygons, const char (*saveNames)[ZONE_NAME_LEN], uint8_t count) const {
+  JsonDocument doc;
+  writeZones(doc["zones"].to<JsonArray>(), savePolygons, saveNames, count);
+
+  if (xSemaphoreTake(sdCardMutex, pdMS_TO_TICKS(2000)) != pdTRUE) return false;
+  static const char *TEMP_FILE = ZONES_FILE ".tmp";
+  File file = SD_MMC.open(TEMP_FILE, FILE_WRITE);
+  bool ok = file && serializeJsonPretty(doc, file) > 0;
+  if (file) file.close();
+  if (ok) {
+    SD_MMC.remove(ZONES_FILE);
+    ok = SD_MMC.rename(TEMP_FILE, ZONES_FILE);
+  }
+  xSemaphoreGive(sdCardMutex);
+  return ok;
+}
+
+uint8_t ZoneMap::snapshot(ZonePolygon *out, uint32_t &version) const {
+  portENTER_CRITICAL((portMUX_TYPE *)&lock);
+  uint8_t count = zoneCount;
+  memcpy(out, polygons, sizeof(ZonePolygon) * count);
+  version = zonesVersion;
+  portEXIT_CRITICAL((portMUX_TYPE *)&lock);
+  return count;
+}
+
+uint32_t ZoneMap::zonesAt(uint16_t x, uint16_t y, uint16_t frameWidth, uint16_t frameHeight) const {
+  if (frameWidth == 0 || frameHeight == 0) return 0;
+  uint16_t px = (uint16_t)((uint32_t)x * ZONE_COORD_MAX / frameWidth);
+  uint16_t py = (uint16_t)((uint32_t)y * ZONE_COORD_MAX / frameHeight);
+  uint32_t mask = 0;
+  portENTER_CRITICAL((portMUX_TYPE *)&lock);
+  for (uint8_t z = 0; z < zoneCount; z++) {
+    if (zoneContains(polygons[z], px, py)) mask |= 1u << z;
+  }
+  portEXIT_CRITICAL((portMUX_TYPE *)&lock);
+  return mask;
+}
+
+void ZoneMap::nameOf(uint8_t zone, char *out) const {
+  portENTER_CRITICAL((portMUX_TYPE *)&lock);
+  if (zone < zoneCount) memcpy(out, names[zone], ZONE_NAME_LEN);
+  else out[0] = '\0';
+  portEXIT_CRITICAL((portMUX_TYPE *)&lock);
+}
+
+void ZoneMap::recordEvent(const ZoneEvent &event) {
+  portENTER_CRITICAL(&lock);
+  events[eventHead] = event;
+  eventHead = (eventHead + 1) % ZONE_EVENT_COUNT;
+  if (eventCount < ZONE_EVENT_COUNT) eventCount++;
+  eventTotal++;
+  portEXIT_CRITICAL(&lock);
+}
+
+void ZoneMap::writeJson(JsonObject out, bool includeEvents) const {
+  ZonePolygon copy[ZONE_MAX_ZONES];
+  char copyNames[ZONE_MAX_ZONES][ZONE_NAME_LEN];
+  ZoneEvent recent[ZONE_EVENT_COUNT];
+  portENTER_CRITICAL((portMUX_TYPE *)&lock);
+  uint8_t count = zoneCount;
+  memcpy(copy, polygons, sizeof(ZonePolygon) * count);
+  memcpy(copyNames, names, sizeof(names[0]) * count);
+  uint8_t recentCount = eventCount;
+  for (uint8_t i = 0; i < recentCount; i++) {
+    recent[i] = events[(eventHead + ZONE_EVENT_COUNT - 1 - i) % ZONE_EVENT_COUNT];   // newest first
+  }
+  uint32_t total = eventTotal;
+  uint32_t currentVersion = zonesVersion;
+  portEXIT_CRITICAL((portMUX_TYPE *)&lock);
+
+  out["version"] = currentVersion;
+  writeZones(out["zones"].to<JsonArray>(), copy, copyNames, count);
+  if (!includeEvents) return;
+  out["event_total"] = total;
+  JsonArray list = out["events"].to<JsonArray>();
+  for (uint8_t i = 0; i < recentCount; i++) {
+    JsonObject event = list.add<JsonObject>();
+    event["age_ms"] = millis() - recent[i].timeMs;
+    event["track"] = recent[i].trackId;
+    event["zone"] = recent[i].zone < count ? copyNames[recent[i].zone] : "";
+    event["class"] = recent[i].classId;
+    event["type"] = EVENT_TYPE_NAMES[recent[i].type];
+  }
+}
@@ -0,0 +1,81 @@
+/**
+ * Detection Zones
+ *
+ * Named include / exclude polygons (zone_mask.h) kept in /zones.json on the
+ * SD card and replaced as a whole through /api/zones. Consumers compile
+ * masks from a snapshot and recompile when version() changes.
+ *
+ * Also keeps the most recent zone-crossing events (a tracked object's
+ * centre entering or leaving a zone), reported with the zones.
+ *
+ * /zones.json:
+ *   {"zones": [{"name": "door", "type": "include",
+ *               "points": [[100, 200], [600, 200], [600, 900], [100, 900]]}]}
+ * Points are per mille of the frame width and height.
+ */
+
+#ifndef ZONES_H
+#define ZONES_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "zone_mask.h"
+
+#define ZONES_FILE        "/zones.json"
+#define ZONE_NAME_LEN     16
+#define ZONE_EVENT_COUNT  32
+
+enum ZoneEventType : uint8_t {
+  ZONE_EVENT_ENTER = 0,
+  ZONE_EVENT_EXIT
+};
+
+struct ZoneEvent {
+  uint32_t timeMs;
+  uint16_t trackId;
+  uint8_t zone;
+  uint8_t classId;
+  uint8_t type;               // ZoneEventType
+};
+
+class ZoneMap {
+public:
+  ZoneMap();
+
+  // Loads /zones.json; a missing file means no zones
+  void begin(bool sdReady);
+
+  // Replaces every zone from {"zones": [...]}. Nothing changes when any
+  // zone is invalid. persist=false keeps the zones for this session only.
+  bool update(JsonVariantConst doc, String &error, bool persist = true);
+
+  uint32_t version() const { return zonesVersion; }
+  // Copies the polygons (index = zone id); returns their count
+  uint8_t snapshot(ZonePolygon *out, uint32_t &version) const;
+  // Bitmask of the zones containing a point in frame pixels
+  uint32_t zonesAt(uint16_t x, uint16_t y, uint16_t frameWidth, uint16_t frameHeight) const;
+  // Copies a zone's name (empty when there is no such zone)
+  void nameOf(uint8_t zone, char *out) const;
+
+  void recordEvent(const ZoneEvent &event);
+  void writeJson(JsonObject out, bool includeEvents) const;
+
+private:
+  ZonePolygon polygons[ZONE_MAX_ZONES];
+  char names[ZONE_MAX_ZONES][ZONE_NAME_LEN];
+  uint8_t zoneCount;
+  volatile uint32_t zonesVersion;
+  ZoneEvent events[ZONE_EVENT_COUNT];
+  uint8_t eventHead;
+  uint8_t eventCount;
+  uint32_t eventTotal;
+  portMUX_TYPE lock;
+
+  bool parse(JsonVariantConst doc, ZonePolygon *outPolygons, char (*outNames)[ZONE_NAME_LEN],
+             uint8_t &count, String &error) const;
+  bool save(const ZonePolygon *savePolygons, const char (*saveNames)[ZONE_NAME_LEN], uint8_t count) const;
+};
+
+extern ZoneMap zoneMap;
+
+#endif // ZONES_H
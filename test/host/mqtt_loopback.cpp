@@ -0,0 +1,208 @@
+/**
+ * Host driver for the MQTT codec and queue against a real broker
+ *
+ *   mqtt_loopback HOST PORT BASE_TOPIC COUNT QOS
+ *
+ * Does what the publisher task does after an outage, over a plain TCP
+ * socket: COUNT events (runs of detections and tracks) go through an
+ * MqttQueue whose ring spills to an in-memory file, then the tool connects
+ * with src/mqtt_codec.cpp (will "offline" on BASE_TOPIC/status), publishes
+ * a retained "online", drains the queue as batched PUBLISH packets several
+ * to a socket write (at qos 1 with MQTT_MAX_INFLIGHT awaiting PUBACK),
+ * sends a PINGREQ and disconnects. Event n's payload is {"n":n,...}.
+ * Prints the events and packets sent; exits 1 with a message on failure.
+ */
+
+#include "mqtt_codec.h"
+#include "mqtt_queue.h"
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// The publisher's sizes (mqtt_publisher.h needs Arduino)
+#define MQTT_RAM_QUEUE      32
+#define MQTT_BATCH_MESSAGES 16
+#define MQTT_MAX_BATCH      1024
+#define MQTT_TOPIC_LEN      64
+#define MQTT_PACKET_MAX     (MQTT_MAX_BATCH + MQTT_TOPIC_LEN + 8)
+#define MQTT_SEND_BUFFER    (3 * MQTT_PACKET_MAX)
+#define MQTT_MAX_INFLIGHT   4
+#define REPLY_TIMEOUT_MS    5000
+
+class MemorySpill : public MqttSpillStorage {
+public:
+  std::vector<uint8_t> file;
+  uint32_t head;
+
+  MemorySpill() : head(0) {}
+  uint32_t spillSize() override { return (uint32_t)file.size(); }
+  size_t spillRead(uint32_t offset, uint8_t *dst, size_t len) override {
+    if (offset >= file.size()) return 0;
+    if (len > file.size() - offset) len = file.size() - offset;
+    memcpy(dst, file.data() + offset, len);
+    return len;
+  }
+  size_t spillAppend(const uint8_t *data, size_t len) override {
+    file.insert(file.end(), data, data + len);
+    return len;
+  }
+  void spillClear() override {
+    file.clear();
+    head = 0;
+  }
+  uint32_t loadHead() override { return head; }
+  bool saveHead(uint32_t offset) override {
+    head = offset;
+    return true;
+  }
+};
+
+static int fail(const char *message) {
+  fprintf(stderr, "mqtt_loopback: %s\n", message);
+  return 1;
+}
+
+static int connectTo(const char *host, const char *port) {
+  struct addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &found) != 0) return -1;
+  int fd = -1;
+  for (struct addrinfo *a = found; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t len) {
+  while (len) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+// Reads until the parser completes a packet; false on timeout or a closed
+// socket
+static bool readPacket(int fd, MqttParser &parser, MqttPacket &packet) {
+  for (;;) {
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, REPLY_TIMEOUT_MS) <= 0) return false;
+    uint8_t byte;
+    if (recv(fd, &byte, 1, 0) != 1) return false;
+    if (parser.feed(byte, packet)) return true;
+    if (parser.failed()) return false;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 6) {
+    fprintf(stderr, "usage: mqtt_loopback HOST PORT BASE_TOPIC COUNT QOS\n");
+    return 2;
+  }
+  const char *base = argv[3];
+  uint32_t count = (uint32_t)strtoul(argv[4], NULL, 10);
+  uint8_t qos = (uint8_t)atoi(argv[5]);
+  if (qos > 1) return fail("qos must be 0 or 1");
+  char topics[2][MQTT_TOPIC_LEN], statusTopic[MQTT_TOPIC_LEN];
+  snprintf(topics[0], MQTT_TOPIC_LEN, "%s/detections", base);
+  snprintf(topics[1], MQTT_TOPIC_LEN, "%s/tracks", base);
+  snprintf(statusTopic, MQTT_TOPIC_LEN, "%s/status", base);
+
+  // The backlog of an outage: the ring spills whenever it fills
+  MemorySpill spill;
+  MqttQueue queue;
+  if (!queue.begin(&spill, MQTT_RAM_QUEUE, 1024 * 1024)) return fail("no memory for the queue");
+  for (uint32_t n = 0; n < count; n++) {
+    uint8_t topic = (n / 7) % 3 == 2 ? 1 : 0;
+    char payload[MQTT_MAX_MESSAGE];
+    int len = snprintf(payload, sizeof(payload), "{\"n\":%u,\"event\":\"%s\",\"score\":%u}", n,
+                       topic ? "track_start" : "detection", n * 37 % 100);
+    if (queue.ramFull() && !queue.spill()) return fail("spill failed");
+    if (!queue.push(topic, payload, (uint16_t)len)) return fail("queue full");
+  }
+
+  int fd = connectTo(argv[1], argv[2]);
+  if (fd < 0) return fail("cannot connect to the broker");
+  uint8_t *sendBuffer = (uint8_t *)malloc(MQTT_SEND_BUFFER);
+  char batch[MQTT_MAX_BATCH];
+  MqttParser parser;
+  MqttPacket packet;
+
+  MqttConnectOptions options;
+  memset(&options, 0, sizeof(options));
+  options.clientId = "mqtt-loopback";
+  options.keepAliveS = 30;
+  options.cleanSession = true;
+  options.willTopic = statusTopic;
+  options.willMessage = "offline";
+  options.willQos = 1;
+  options.willRetain = true;
+  size_t len = mqttEncodeConnect(sendBuffer, MQTT_SEND_BUFFER, options);
+  if (!writeAll(fd, sendBuffer, len)) return fail("write failed");
+  if (!readPacket(fd, parser, packet) || packet.type != MQTT_PACKET_CONNACK) return fail("no CONNACK");
+  if (packet.returnCode != 0) return fail("connection refused");
+
+  len = mqttEncodePublish(sendBuffer, MQTT_SEND_BUFFER, statusTopic, (const uint8_t *)"online", 6, 0, true, false, 0);
+  if (!writeAll(fd, sendBuffer, len)) return fail("write failed");
+
+  uint32_t events = 0, packets = 0, writes = 0, acknowledged = 0;
+  uint16_t nextPacketId = 0;
+  std::vector<uint16_t> waiting;
+  while (!queue.empty() || !waiting.empty()) {
+    size_t used = 0;
+    while (!queue.empty() && waiting.size() < (qos ? MQTT_MAX_INFLIGHT : (size_t)-1) &&
+           MQTT_SEND_BUFFER - used >= MQTT_PACKET_MAX) {
+      uint8_t topic;
+      uint16_t messages;
+      size_t batchLen = queue.takeBatch(topic, batch, sizeof(batch), MQTT_BATCH_MESSAGES, messages);
+      if (messages == 0) return fail("spill file unreadable");
+      uint16_t packetId = 0;
+      if (qos) {
+        if (++nextPacketId == 0) nextPacketId = 1;
+        packetId = nextPacketId;
+        waiting.push_back(packetId);
+      }
+      used += mqttEncodePublish(sendBuffer + used, MQTT_SEND_BUFFER - used, topics[topic], (const uint8_t *)batch,
+                                batchLen, qos, false, false, packetId);
+      events += messages;
+      packets++;
+    }
+    if (used) {
+      if (!writeAll(fd, sendBuffer, used)) return fail("write failed");
+      writes++;
+    }
+    if (!qos) continue;
+    // Oldest first, as the publisher frees its window
+    if (!readPacket(fd, parser, packet)) return fail("no PUBACK");
+    if (packet.type != MQTT_PACKET_PUBACK) continue;
+    if (waiting.empty() || packet.packetId != waiting.front()) return fail("PUBACK out of order");
+    waiting.erase(waiting.begin());
+    acknowledged++;
+  }
+  queue.sync();
+
+  len = mqttEncodePingReq(sendBuffer, MQTT_SEND_BUFFER);
+  if (!writeAll(fd, sendBuffer, len)) return fail("write failed");
+  if (!readPacket(fd, parser, packet) || packet.type != MQTT_PACKET_PINGRESP) return fail("no PINGRESP");
+  len = mqttEncodeDisconnect(sendBuffer, MQTT_SEND_BUFFER);
+  writeAll(fd, sendBuffer, len);
+  close(fd);
+  free(sendBuffer);
+
+  printf("%u events in %u packets, %u writes, %u acknowledged, %u spilled\n", events, packets, writes, acknowledged,
+         queue.stats().spilled);
+  return events == count ? 0 : fail("events missing");
+}
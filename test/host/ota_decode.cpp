@@ -0,0 +1,78 @@
+/**
+ * Host driver for OtaDecoder
+ *
+ *   ota_decode IMAGE OUT [OLD]
+ *
+ * Feeds IMAGE through src/ota_decoder.cpp in irregular chunks (1 byte up to
+ * a few KB, like TCP segments and SD reads) and writes the decoded firmware
+ * to OUT. OLD stands in for the running partition of delta images. Exits 1
+ * with the decoder's error message on failure.
+ */
+
+#include "ota_decoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static bool readFile(const char *path, std::vector<uint8_t> &data) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+  fclose(f);
+  return true;
+}
+
+static bool sinkToFile(void *ctx, const uint8_t *data, size_t len) {
+  return fwrite(data, 1, len, (FILE *)ctx) == len;
+}
+
+static bool readOld(void *ctx, size_t offset, uint8_t *data, size_t len) {
+  const std::vector<uint8_t> &old = *(const std::vector<uint8_t> *)ctx;
+  if (offset + len > old.size()) return false;
+  memcpy(data, old.data() + offset, len);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "usage: %s IMAGE OUT [OLD]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> image, old;
+  if (!readFile(argv[1], image) || (argc == 4 && !readFile(argv[3], old))) {
+    perror("read");
+    return 2;
+  }
+  FILE *out = fopen(argv[2], "wb");
+  if (!out) {
+    perror(argv[2]);
+    return 2;
+  }
+
+  OtaDecoder decoder;
+  decoder.begin(sinkToFile, out, argc == 4 ? readOld : NULL, &old);
+
+  static const size_t CHUNKS[] = {1, 3, 1436, 7, 4096, 512, 2, 1460, 31, 4095};
+  size_t pos = 0;
+  bool ok = true;
+  for (size_t k = 0; ok && pos < image.size(); k++) {
+    size_t len = CHUNKS[k % (sizeof(CHUNKS) / sizeof(CHUNKS[0]))];
+    if (len > image.size() - pos) len = image.size() - pos;
+    ok = decoder.write(image.data() + pos, len);
+    pos += len;
+  }
+  ok = ok && decoder.finish();
+  fclose(out);
+
+  if (!ok) {
+    fprintf(stderr, "%s: %s\n", argv[1], decoder.error() ? decoder.error() : "failed");
+    return 1;
+  }
+  printf("%s: %s/%s, %zu -> %zu bytes\n", argv[1], OtaDecoder::formatName(decoder.container()),
+         OtaDecoder::formatName(decoder.payload()), decoder.inputBytes(), decoder.outputBytes());
+  return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * Host stand-in for the parts of Arduino.h and FreeRTOS the scheduler uses
+ *
+ * Time is simulated: millis(), micros() and esp_timer_get_time() read a
+ * clock that only the test moves (hostAdvanceMicros). A task created with
+ * xTaskCreatePinnedToCore runs on a thread, and ulTaskNotifyTake blocks it
+ * until it is notified or the simulated clock reaches its timeout, so a
+ * test can step time and wait for the task to go back to sleep
+ * (hostSettle) before it looks at what happened.
+ */
+
+#ifndef HOST_ARDUINO_SHIM_H
+#define HOST_ARDUINO_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class Print {
+public:
+  virtual ~Print() {}
+};
+
+// ---------------------------------------------------------------------------
+// Simulated clock and task notifications
+
+struct HostSim {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::atomic<uint64_t> nowUs;
+  uint64_t wakeUs;           // the sleeping task's timeout
+  bool notified;
+  bool sleeping;
+
+  HostSim() : nowUs(0), wakeUs(0), notified(false), sleeping(false) {}
+};
+
+// Never destroyed: a task thread may still be asleep when the test exits
+inline HostSim &hostSim() {
+  static HostSim *sim = new HostSim();
+  return *sim;
+}
+
+// Returns once the task sleeps with nothing to wake it
+inline void hostSettle() {
+  HostSim &sim = hostSim();
+  std::unique_lock<std::mutex> guard(sim.mutex);
+  sim.changed.wait(guard, [&sim]() {
+    return sim.sleeping && !sim.notified && sim.nowUs.load() < sim.wakeUs;
+  });
+}
+
+inline void hostAdvanceMicros(uint64_t us) {
+  HostSim &sim = hostSim();
+  std::lock_guard<std::mutex> guard(sim.mutex);
+  sim.nowUs += us;
+  sim.changed.notify_all();
+}
+
+inline unsigned long millis() { return (unsigned long)(hostSim().nowUs.load() / 1000); }
+inline unsigned long micros() { return (unsigned long)hostSim().nowUs.load(); }
+
+// ---------------------------------------------------------------------------
+// FreeRTOS
+
+typedef void *TaskHandle_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdPASS 1
+#define pdTRUE 1
+#define portMAX_DELAY 0xFFFFFFFFu
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))   // 1 kHz tick
+
+typedef struct {
+  int locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) do { \
+    while (__atomic_exchange_n(&(mux)->locked, 1, __ATOMIC_ACQUIRE)) {} \
+  } while (0)
+#define portEXIT_CRITICAL(mux) __atomic_store_n(&(mux)->locked, 0, __ATOMIC_RELEASE)
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t entry, const char *, uint32_t, void *param, unsigned,
+                                          TaskHandle_t *handle, int) {
+  std::thread(entry, param).detach();
+  if (handle) *handle = (TaskHandle_t)param;
+  return pdPASS;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t ticks) {
+  HostSim &sim = hostSim();
+  std::unique_lock<std::mutex> guard(sim.mutex);
+  sim.wakeUs = ticks == portMAX_DELAY ? UINT64_MAX : sim.nowUs.load() + (uint64_t)ticks * 1000;
+  sim.sleeping = true;
+  sim.changed.notify_all();
+  sim.changed.wait(guard, [&sim]() { return sim.notified || sim.nowUs.load() >= sim.wakeUs; });
+  sim.sleeping = false;
+  bool notified = sim.notified;
+  sim.notified = false;
+  return notified ? 1 : 0;
+}
+
+inline void xTaskNotifyGive(TaskHandle_t) {
+  HostSim &sim = hostSim();
+  std::lock_guard<std::mutex> guard(sim.mutex);
+  sim.notified = true;
+  sim.changed.notify_all();
+}
+
+#endif // HOST_ARDUINO_SHIM_H
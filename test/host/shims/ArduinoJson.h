@@ -0,0 +1,69 @@
+/**
+ * Host stand-in for the slice of ArduinoJson that status reports use
+ *
+ * A JsonObject is a handle on a tree node: out["key"] = value stores a
+ * number or a string, out["key"].to<JsonObject>() starts a nested object.
+ * Tests read values back with as<T>().
+ */
+
+#ifndef HOST_ARDUINOJSON_SHIM_H
+#define HOST_ARDUINOJSON_SHIM_H
+
+#include <map>
+#include <string>
+
+struct HostJsonNode {
+  double number;
+  std::string text;
+  std::map<std::string, HostJsonNode> children;
+
+  HostJsonNode() : number(0) {}
+};
+
+class JsonObject {
+public:
+  JsonObject() : node(NULL) {}
+  explicit JsonObject(HostJsonNode *node) : node(node) {}
+
+  JsonObject operator[](const char *key) const { return JsonObject(&node->children[key]); }
+
+  template <typename T>
+  T to() {
+    *node = HostJsonNode();
+    return T(node);
+  }
+
+  template <typename T>
+  JsonObject &operator=(T value) {
+    node->number = (double)value;
+    return *this;
+  }
+  JsonObject &operator=(const char *value) {
+    node->text = value;
+    return *this;
+  }
+
+  template <typename T>
+  T as() const { return (T)node->number; }
+
+  bool containsKey(const char *key) const { return node->children.count(key) > 0; }
+
+private:
+  HostJsonNode *node;
+};
+
+template <>
+inline const char *JsonObject::as<const char *>() const {
+  return node->text.c_str();
+}
+
+class JsonDocument {
+public:
+  template <typename T>
+  T to() { return JsonObject(&root).to<T>(); }
+
+private:
+  HostJsonNode root;
+};
+
+#endif // HOST_ARDUINOJSON_SHIM_H
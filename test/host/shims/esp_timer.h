@@ -0,0 +1,14 @@
+/**
+ * Host stand-in for esp_timer.h: the simulated clock of shims/Arduino.h
+ */
+
+#ifndef HOST_ESP_TIMER_SHIM_H
+#define HOST_ESP_TIMER_SHIM_H
+
+#include "Arduino.h"
+
+inline int64_t esp_timer_get_time() {
+  return (int64_t)hostSim().nowUs.load();
+}
+
+#endif // HOST_ESP_TIMER_SHIM_H
@@ -0,0 +1,57 @@
+/**
+ * Host stand-in for the ROM miniz inflater (esp32/rom/miniz.h)
+ *
+ * Implements the one tinfl entry point OtaDecoder uses on top of zlib's raw
+ * inflate, so gzip images decode on a host without the ESP-IDF. Each
+ * decompressor keeps its own 32KB zlib window; the caller's circular
+ * dictionary is only used as the output buffer. The z_stream is not released
+ * when the decoder frees the struct, which is fine for a test process.
+ */
+
+#ifndef HOST_MINIZ_SHIM_H
+#define HOST_MINIZ_SHIM_H
+
+#include <zlib.h>
+#include <string.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+
+typedef enum {
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+typedef struct {
+  int started;
+  z_stream stream;
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->started = 0; } while (0)
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const unsigned char *in, size_t *inSize,
+                                            unsigned char *outStart, unsigned char *outNext, size_t *outSize,
+                                            unsigned flags) {
+  (void)outStart;
+  (void)flags;
+  if (!r->started) {
+    memset(&r->stream, 0, sizeof(r->stream));
+    if (inflateInit2(&r->stream, -15) != Z_OK) return TINFL_STATUS_FAILED;
+    r->started = 1;
+  }
+  r->stream.next_in = (Bytef *)in;
+  r->stream.avail_in = (uInt)*inSize;
+  r->stream.next_out = outNext;
+  r->stream.avail_out = (uInt)*outSize;
+  int rc = inflate(&r->stream, Z_NO_FLUSH);
+  *inSize -= r->stream.avail_in;
+  *outSize -= r->stream.avail_out;
+  if (rc == Z_STREAM_END) return TINFL_STATUS_DONE;
+  if (rc != Z_OK && rc != Z_BUF_ERROR) return TINFL_STATUS_FAILED;
+  if (r->stream.avail_out == 0) return TINFL_STATUS_HAS_MORE_OUTPUT;
+  return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+#endif // HOST_MINIZ_SHIM_H
@@ -0,0 +1,43 @@
+/**
+ * Minimal check macros for the host tests
+ *
+ * A failed check prints its location and expression and the test carries
+ * on; main() returns testSummary(), which is non-zero after any failure.
+ */
+
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+
+static int testChecks = 0;
+static int testFailures = 0;
+
+#define CHECK(cond) do { \
+    testChecks++; \
+    if (!(cond)) { \
+      testFailures++; \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    testChecks++; \
+    long long a_ = (long long)(actual), e_ = (long long)(expected); \
+    if (a_ != e_) { \
+      testFailures++; \
+      fprintf(stderr, "%s:%d: %s == %lld, expected %s == %lld\n", __FILE__, __LINE__, #actual, a_, #expected, e_); \
+    } \
+  } while (0)
+
+// Prints the group name, so a failure can be told apart in the output
+static inline void testCase(const char *name) {
+  printf("  %s\n", name);
+}
+
+static inline int testSummary(const char *name) {
+  printf("%s: %d checks, %d failed\n", name, testChecks, testFailures);
+  return testFailures ? 1 : 0;
+}
+
+#endif // HOST_TEST_H
@@ -0,0 +1,345 @@
+/**
+ * Arena planner host test
+ *
+ * Checks the placements arenaPlace() makes and the peaks it reaches:
+ *
+ * - small plans whose offsets are worked out by hand;
+ * - random plans, where every placement must be aligned, must not share
+ *   bytes with a buffer whose lifetime overlaps it, and must sit at the
+ *   lowest offset the greedy rule allows given the buffers placed before it;
+ * - arenaLiveMax() against a brute-force count, and arenaPeak() never below it;
+ * - capacities, which leave buffers unplaced for a second region;
+ * - layer chains shaped like the models the engine runs, printing how far
+ *   the greedy peak lands above the live-bytes lower bound.
+ */
+
+#include "arena_planner.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static uint32_t rngState = 0xA5A5A5A5u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static ArenaBuffer buffer(uint32_t size, int16_t firstUse, int16_t lastUse) {
+  ArenaBuffer b = {size, firstUse, lastUse, ARENA_UNPLACED, 0};
+  return b;
+}
+
+static bool liveTogether(const ArenaBuffer &a, const ArenaBuffer &b) {
+  return a.firstUse <= b.lastUse && b.firstUse <= a.lastUse;
+}
+
+static bool bytesOverlap(uint32_t aStart, uint32_t aSize, uint32_t bStart, uint32_t bSize) {
+  return aStart < bStart + bSize && bStart < aStart + aSize;
+}
+
+// Places everything into region 0 largest first, as the engine does
+static uint16_t placeAll(std::vector<ArenaBuffer> &buffers, uint32_t align, uint32_t capacity = 0) {
+  std::vector<uint16_t> order(buffers.size());
+  arenaOrderBySize(buffers.data(), order.data(), (uint16_t)buffers.size());
+  return arenaPlace(buffers.data(), (uint16_t)buffers.size(), order.data(), (uint16_t)order.size(), 0, capacity,
+                    align);
+}
+
+// Most bytes live at any one step, counted step by step
+static uint32_t bruteLiveMax(const std::vector<ArenaBuffer> &buffers, uint8_t region) {
+  uint32_t best = 0;
+  for (int step = -1; step < 1100; step++) {
+    uint32_t live = 0;
+    for (size_t i = 0; i < buffers.size(); i++) {
+      const ArenaBuffer &b = buffers[i];
+      if (b.offset != ARENA_UNPLACED && b.region == region && b.firstUse <= step && step <= b.lastUse) live += b.size;
+    }
+    if (live > best) best = live;
+  }
+  return best;
+}
+
+// Every placed buffer is aligned, collides with nothing live at the same time,
+// and no lower candidate offset was free when it was placed (only buffers
+// earlier in order existed then)
+static bool checkPlan(const std::vector<ArenaBuffer> &buffers, const std::vector<uint16_t> &order, uint8_t region,
+                      uint32_t align, uint32_t capacity, const char *name) {
+  for (size_t i = 0; i < order.size(); i++) {
+    const ArenaBuffer &b = buffers[order[i]];
+    if (b.offset == ARENA_UNPLACED || b.region != region) continue;
+    if (b.offset % align) {
+      fprintf(stderr, "%s: buffer %u at unaligned offset %d\n", name, order[i], b.offset);
+      return false;
+    }
+    if (capacity && b.offset + b.size > capacity) {
+      fprintf(stderr, "%s: buffer %u ends at %u, above the capacity %u\n", name, order[i], b.offset + b.size,
+              capacity);
+      return false;
+    }
+    for (size_t j = 0; j < buffers.size(); j++) {
+      const ArenaBuffer &o = buffers[j];
+      if (j == order[i] || o.offset == ARENA_UNPLACED || o.region != region || !liveTogether(b, o)) continue;
+      if (bytesOverlap(b.offset, b.size, o.offset, o.size)) {
+        fprintf(stderr, "%s: buffers %u and %zu overlap while both are live\n", name, order[i], j);
+        return false;
+      }
+    }
+
+    // The greedy rule: 0 or the aligned end of an earlier, conflicting buffer
+    std::vector<uint32_t> candidates(1, 0);
+    for (size_t k = 0; k < i; k++) {
+      const ArenaBuffer &o = buffers[order[k]];
+      if (o.offset != ARENA_UNPLACED && o.region == region && liveTogether(b, o)) {
+        candidates.push_back((o.offset + o.size + align - 1) / align * align);
+      }
+    }
+    for (size_t c = 0; c < candidates.size(); c++) {
+      uint32_t at = candidates[c];
+      if (at >= (uint32_t)b.offset) continue;
+      bool free = true;
+      for (size_t k = 0; k < i && free; k++) {
+        const ArenaBuffer &o = buffers[order[k]];
+        if (o.offset == ARENA_UNPLACED || o.region != region || !liveTogether(b, o)) continue;
+        free = !bytesOverlap(at, b.size, o.offset, o.size);
+      }
+      if (free) {
+        fprintf(stderr, "%s: buffer %u placed at %d, but %u was free\n", name, order[i], b.offset, at);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+
+static void testOrder() {
+  testCase("order by size");
+  std::vector<ArenaBuffer> buffers;
+  static const uint32_t SIZES[] = {16, 64, 16, 0, 64, 32};
+  for (size_t i = 0; i < 6; i++) buffers.push_back(buffer(SIZES[i], 0, 1));
+  uint16_t order[6];
+  arenaOrderBySize(buffers.data(), order, 6);
+  static const uint16_t EXPECTED[] = {1, 4, 5, 0, 2, 3};   // ties keep index order
+  CHECK(memcmp(order, EXPECTED, sizeof(order)) == 0);
+  arenaOrderBySize(buffers.data(), order, 0);
+}
+
+static void testHandPlans() {
+  testCase("hand-checked plans");
+  // A chain: each op reads the previous output and writes the next
+  //   t0 [0,1] 100   t1 [1,2] 300   t2 [2,3] 200   t3 [3,4] 50
+  std::vector<ArenaBuffer> chain;
+  chain.push_back(buffer(100, 0, 1));
+  chain.push_back(buffer(300, 1, 2));
+  chain.push_back(buffer(200, 2, 3));
+  chain.push_back(buffer(50, 3, 4));
+  CHECK_EQ(placeAll(chain, 1), 4);
+  CHECK_EQ(chain[1].offset, 0);     // largest first, at 0
+  CHECK_EQ(chain[2].offset, 300);   // live with t1: above it
+  CHECK_EQ(chain[0].offset, 300);   // live with t1 only: t2 is not live yet
+  CHECK_EQ(chain[3].offset, 0);     // t1 is dead by then: reuses its bytes
+  CHECK_EQ(arenaPeak(chain.data(), 4, 0), 500);
+  CHECK_EQ(arenaLiveMax(chain.data(), 4, 0), 500);
+
+  // A skip connection keeps t0 alive across the block
+  std::vector<ArenaBuffer> skip;
+  skip.push_back(buffer(64, 0, 3));   // block input, also read by the add at step 3
+  skip.push_back(buffer(96, 1, 2));
+  skip.push_back(buffer(64, 2, 3));
+  skip.push_back(buffer(64, 3, 4));   // add output
+  CHECK_EQ(placeAll(skip, 16), 4);
+  CHECK_EQ(skip[1].offset, 0);
+  CHECK_EQ(skip[0].offset, 96);
+  CHECK_EQ(skip[2].offset, 160);
+  CHECK_EQ(skip[3].offset, 0);
+  CHECK_EQ(arenaPeak(skip.data(), 4, 0), 224);
+  CHECK_EQ(arenaLiveMax(skip.data(), 4, 0), 224);
+
+  // Alignment rounds every offset up
+  std::vector<ArenaBuffer> odd;
+  odd.push_back(buffer(10, 0, 2));
+  odd.push_back(buffer(7, 0, 2));
+  odd.push_back(buffer(3, 1, 1));
+  CHECK_EQ(placeAll(odd, 16), 3);
+  CHECK_EQ(odd[0].offset, 0);
+  CHECK_EQ(odd[1].offset, 16);
+  CHECK_EQ(odd[2].offset, 32);
+  CHECK_EQ(arenaPeak(odd.data(), 3, 0), 35);
+
+  // Gaps left by dead buffers are filled from the bottom
+  std::vector<ArenaBuffer> hole;
+  hole.push_back(buffer(40, 0, 1));
+  hole.push_back(buffer(30, 1, 3));
+  hole.push_back(buffer(30, 2, 4));
+  hole.push_back(buffer(20, 0, 0));
+  hole.push_back(buffer(20, 4, 4));
+  CHECK_EQ(placeAll(hole, 1), 5);
+  CHECK_EQ(hole[0].offset, 0);
+  CHECK_EQ(hole[1].offset, 40);
+  CHECK_EQ(hole[2].offset, 0);    // t0 is dead by step 2
+  CHECK_EQ(hole[3].offset, 40);   // t1 is not live yet at step 0
+  CHECK_EQ(hole[4].offset, 30);   // just above t2
+  CHECK_EQ(arenaPeak(hole.data(), 5, 0), 70);
+  CHECK_EQ(arenaLiveMax(hole.data(), 5, 0), 70);
+
+  // Zero-sized buffers (unused tensors) are never placed; placed ones are left alone
+  std::vector<ArenaBuffer> unused;
+  unused.push_back(buffer(0, 0, 0));
+  unused.push_back(buffer(8, 0, 1));
+  unused.push_back(buffer(8, 0, 1));
+  unused[2].offset = 64;
+  CHECK_EQ(placeAll(unused, 4), 1);
+  CHECK_EQ(unused[0].offset, ARENA_UNPLACED);
+  CHECK_EQ(unused[1].offset, 0);
+  CHECK_EQ(unused[2].offset, 64);
+  CHECK_EQ(arenaPeak(unused.data(), 3, 0), 72);
+
+  std::vector<ArenaBuffer> none;
+  CHECK_EQ(arenaPeak(none.data(), 0, 0), 0);
+  CHECK_EQ(arenaLiveMax(none.data(), 0, 0), 0);
+}
+
+static void testRandomPlans() {
+  testCase("random plans");
+  static const uint32_t ALIGNS[] = {1, 4, 16};
+  int bad = 0, belowBound = 0, liveMismatch = 0;
+  double worstRatio = 1.0;
+  for (int iteration = 0; iteration < 400; iteration++) {
+    uint16_t count = (uint16_t)(1 + rnd() % 60);
+    int16_t steps = (int16_t)(1 + rnd() % 40);
+    uint32_t align = ALIGNS[rnd() % 3];
+    std::vector<ArenaBuffer> buffers;
+    for (uint16_t i = 0; i < count; i++) {
+      int16_t first = (int16_t)(rnd() % steps);
+      int16_t last = (int16_t)(first + rnd() % (rnd() % 4 ? 3 : steps));
+      uint32_t size = rnd() % 8 ? 1 + rnd() % 5000 : 0;
+      buffers.push_back(buffer(size, first, last));
+    }
+    std::vector<uint16_t> order(count);
+    // Largest first, or the given order (the engine's heat order is arbitrary)
+    if (iteration % 2) {
+      arenaOrderBySize(buffers.data(), order.data(), count);
+    } else {
+      for (uint16_t i = 0; i < count; i++) order[i] = i;
+    }
+    uint16_t placed = arenaPlace(buffers.data(), count, order.data(), count, 0, 0, align);
+    uint16_t nonEmpty = 0;
+    for (uint16_t i = 0; i < count; i++) nonEmpty += buffers[i].size != 0;
+    if (placed != nonEmpty || !checkPlan(buffers, order, 0, align, 0, "random")) bad++;
+
+    uint32_t live = arenaLiveMax(buffers.data(), count, 0);
+    uint32_t peak = arenaPeak(buffers.data(), count, 0);
+    if (live != bruteLiveMax(buffers, 0)) liveMismatch++;
+    if (peak < live) belowBound++;
+    if (live && (double)peak / live > worstRatio) worstRatio = (double)peak / live;
+  }
+  printf("  worst peak / live bytes over random plans: %.2f\n", worstRatio);
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(liveMismatch, 0);
+  CHECK_EQ(belowBound, 0);
+}
+
+static void testCapacity() {
+  testCase("capacity and a second region");
+  int bad = 0;
+  for (int iteration = 0; iteration < 200; iteration++) {
+    uint16_t count = (uint16_t)(2 + rnd() % 40);
+    std::vector<ArenaBuffer> buffers;
+    for (uint16_t i = 0; i < count; i++) {
+      int16_t first = (int16_t)(rnd() % 20);
+      buffers.push_back(buffer(16 + rnd() % 4000, first, (int16_t)(first + rnd() % 4)));
+    }
+    uint32_t capacity = 1024 + rnd() % 8192;
+    std::vector<uint16_t> order(count);
+    arenaOrderBySize(buffers.data(), order.data(), count);
+    uint16_t fast = arenaPlace(buffers.data(), count, order.data(), count, 1, capacity, 16);
+    uint16_t slow = arenaPlace(buffers.data(), count, order.data(), count, 0, 0, 16);
+    bool ok = fast + slow == count && checkPlan(buffers, order, 1, 16, capacity, "fast region") &&
+              arenaPeak(buffers.data(), count, 1) <= capacity &&
+              arenaLiveMax(buffers.data(), count, 1) == bruteLiveMax(buffers, 1) &&
+              arenaLiveMax(buffers.data(), count, 0) == bruteLiveMax(buffers, 0) &&
+              arenaPeak(buffers.data(), count, 0) >= arenaLiveMax(buffers.data(), count, 0);
+    // Buffers in the slow region share bytes only across regions, never within one
+    for (uint16_t i = 0; i < count && ok; i++) {
+      for (uint16_t j = i + 1; j < count && ok; j++) {
+        const ArenaBuffer &a = buffers[i], &b = buffers[j];
+        ok = a.region != b.region || !liveTogether(a, b) || !bytesOverlap(a.offset, a.size, b.offset, b.size);
+      }
+    }
+    // Anything larger than the capacity can only be in the slow region
+    for (uint16_t i = 0; i < count && ok; i++) ok = buffers[i].size <= capacity || buffers[i].region == 0;
+    if (!ok) bad++;
+  }
+  CHECK_EQ(bad, 0);
+
+  // Buffers that would end above the capacity are skipped, not the ones after them
+  std::vector<ArenaBuffer> tight;
+  tight.push_back(buffer(600, 0, 1));
+  tight.push_back(buffer(500, 1, 2));
+  tight.push_back(buffer(300, 1, 3));
+  CHECK_EQ(placeAll(tight, 1, 1000), 2);
+  CHECK_EQ(tight[0].offset, 0);
+  CHECK_EQ(tight[1].offset, ARENA_UNPLACED);   // 600 + 500 is past the capacity
+  CHECK_EQ(tight[2].offset, 600);              // a smaller one behind it still fits
+}
+
+// Tensors of a MobileNet-style network: each op reads the previous output;
+// every other block adds a residual that keeps its input alive
+static std::vector<ArenaBuffer> modelLike(int blocks, uint32_t inputBytes) {
+  std::vector<ArenaBuffer> tensors;
+  uint32_t size = inputBytes;
+  int16_t step = 0;
+  tensors.push_back(buffer(size, -1, 0));
+  for (int b = 0; b < blocks; b++) {
+    bool residual = b % 2 == 1;
+    size_t blockInput = tensors.size() - 1;
+    uint32_t expanded = size * 6;
+    if (b % 3 == 0) size /= 2;                                 // strided block halves the map
+    tensors.push_back(buffer(expanded, step, (int16_t)(step + 1)));                   // 1x1 expand
+    tensors.push_back(buffer(b % 3 == 0 ? expanded / 4 : expanded, (int16_t)(step + 1), (int16_t)(step + 2)));  // depthwise
+    tensors.push_back(buffer(size, (int16_t)(step + 2), (int16_t)(step + 3)));        // 1x1 project
+    if (residual) {
+      tensors[blockInput].lastUse = (int16_t)(step + 3);
+      tensors.push_back(buffer(size, (int16_t)(step + 3), (int16_t)(step + 4)));      // add
+      step++;
+    }
+    step += 3;
+  }
+  return tensors;
+}
+
+static void testModelShapes() {
+  testCase("model-shaped plans");
+  static const int BLOCKS[] = {4, 8, 12, 17};
+  int bad = 0, loose = 0;
+  for (size_t i = 0; i < sizeof(BLOCKS) / sizeof(BLOCKS[0]); i++) {
+    std::vector<ArenaBuffer> tensors = modelLike(BLOCKS[i], 96 * 96 * 16);
+    std::vector<uint16_t> order(tensors.size());
+    arenaOrderBySize(tensors.data(), order.data(), (uint16_t)order.size());
+    arenaPlace(tensors.data(), (uint16_t)tensors.size(), order.data(), (uint16_t)order.size(), 0, 0, 16);
+    if (!checkPlan(tensors, order, 0, 16, 0, "model")) bad++;
+    uint32_t peak = arenaPeak(tensors.data(), (uint16_t)tensors.size(), 0);
+    uint32_t live = arenaLiveMax(tensors.data(), (uint16_t)tensors.size(), 0);
+    uint32_t total = 0;
+    for (size_t k = 0; k < tensors.size(); k++) total += tensors[k].size;
+    printf("  %2d blocks, %2zu tensors: peak %7u, live bound %7u (+%.1f%%), no reuse %8u\n", BLOCKS[i],
+           tensors.size(), peak, live, 100.0 * (peak - live) / live, total);
+    if (peak < live || peak > live + live / 4) loose++;
+  }
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(loose, 0);
+}
+
+int main() {
+  testOrder();
+  testHandPlans();
+  testRandomPlans();
+  testCapacity();
+  testModelShapes();
+  return testSummary("test_arena_planner");
+}
@@ -0,0 +1,339 @@
+/**
+ * EventStore host test
+ *
+ * Runs src/event_store.cpp over segment files kept in memory, where a test
+ * can cut an append short, flip bytes or pad a file with zeros the way a
+ * reset during a write leaves it, then reopens the store as begin() does
+ * at boot and checks what the queries return.
+ */
+
+#include "event_store.h"
+#include "test.h"
+#include <string.h>
+#include <map>
+#include <vector>
+
+class MemoryStorage : public EventStorage {
+public:
+  std::map<uint32_t, std::vector<uint8_t> > files;
+  size_t appendLimit;        // bytes the next append writes (tear), SIZE_MAX = all
+  bool appendFails;
+
+  MemoryStorage() : appendLimit((size_t)-1), appendFails(false) {}
+
+  void list(void (*found)(void *ctx, uint32_t segment), void *ctx) override {
+    for (std::map<uint32_t, std::vector<uint8_t> >::iterator it = files.begin(); it != files.end(); ++it) {
+      found(ctx, it->first);
+    }
+  }
+
+  uint32_t size(uint32_t segment) override {
+    return files.count(segment) ? (uint32_t)files[segment].size() : 0;
+  }
+
+  size_t read(uint32_t segment, uint32_t offset, uint8_t *dst, size_t len) override {
+    if (!files.count(segment)) return 0;
+    const std::vector<uint8_t> &file = files[segment];
+    if (offset >= file.size()) return 0;
+    if (len > file.size() - offset) len = file.size() - offset;
+    memcpy(dst, file.data() + offset, len);
+    return len;
+  }
+
+  size_t append(uint32_t segment, const uint8_t *data, size_t len) override {
+    if (appendFails) return 0;
+    if (len > appendLimit) {
+      len = appendLimit;
+      appendLimit = (size_t)-1;
+    }
+    files[segment].insert(files[segment].end(), data, data + len);
+    return len;
+  }
+
+  bool remove(uint32_t segment) override {
+    return files.erase(segment) > 0;
+  }
+};
+
+// Payload of record i: its index and a length that varies with it
+static uint8_t payloadLength(uint32_t i) {
+  return (uint8_t)(i % (EVENT_MAX_PAYLOAD + 1));
+}
+
+static bool appendNumbered(EventStore &store, uint32_t i, uint64_t timeMs) {
+  uint8_t payload[EVENT_MAX_PAYLOAD];
+  for (uint8_t k = 0; k < sizeof(payload); k++) payload[k] = (uint8_t)(i * 7 + k);
+  return store.append((uint8_t)(i % 4), timeMs, payload, payloadLength(i));
+}
+
+static bool payloadMatches(const EventRecord &record, uint32_t i) {
+  if (record.length != payloadLength(i) || record.type != i % 4) return false;
+  for (uint8_t k = 0; k < record.length; k++) {
+    if (record.payload[k] != (uint8_t)(i * 7 + k)) return false;
+  }
+  return true;
+}
+
+// Every record in [fromMs, toMs] of the given types, resuming after the
+// scan budget runs out
+static std::vector<EventRecord> queryAll(EventStore &store, uint64_t fromMs = 0, uint64_t toMs = EVENT_TIME_MAX,
+                                         uint32_t types = 0) {
+  std::vector<EventRecord> out;
+  EventCursor cursor;
+  EventRecord record;
+  store.query(cursor, fromMs, toMs, types);
+  while (!cursor.done) {
+    if (store.next(cursor, record)) out.push_back(record);
+  }
+  return out;
+}
+
+static void testAppendAndQuery() {
+  testCase("append and query");
+  MemoryStorage storage;
+  EventStore store;
+  CHECK(store.begin(&storage, 16));
+  const uint32_t COUNT = 5000;
+  for (uint32_t i = 0; i < COUNT; i++) CHECK(appendNumbered(store, i, 1000 + i * 10));
+  CHECK(store.flush());
+  CHECK_EQ(store.pendingBytes(), 0);
+  CHECK(store.segmentCount() > 1);
+  CHECK_EQ(store.stats().appended, COUNT);
+
+  std::vector<EventRecord> all = queryAll(store);
+  CHECK_EQ(all.size(), COUNT);
+  bool ordered = true;
+  for (uint32_t i = 0; i < all.size(); i++) {
+    ordered = ordered && all[i].sequence == i && all[i].timeMs == 1000 + i * 10 && payloadMatches(all[i], i);
+  }
+  CHECK(ordered);
+
+  // Ranges land on the right record whatever segment or block they start in
+  static const uint32_t STARTS[] = {0, 1, 203, 204, 1999, 2500, 4999};
+  for (size_t s = 0; s < sizeof(STARTS) / sizeof(STARTS[0]); s++) {
+    uint32_t first = STARTS[s];
+    std::vector<EventRecord> range = queryAll(store, 1000 + first * 10, 1000 + (first + 99) * 10);
+    uint32_t expected = first + 100 <= COUNT ? 100 : COUNT - first;
+    CHECK_EQ(range.size(), expected);
+    CHECK(!range.empty() && range[0].sequence == first);
+  }
+  CHECK_EQ(queryAll(store, 1005, 1005).size(), 0);
+  CHECK_EQ(queryAll(store, 2000, 1000).size(), 0);
+  CHECK_EQ(queryAll(store, 0, EVENT_TIME_MAX, 1u << 2).size(), COUNT / 4);
+
+  // Times never go backwards; an empty payload may be NULL
+  CHECK(store.append(3, 5, NULL, 0));
+  CHECK(!store.append(3, 5, NULL, 4));
+  CHECK(!store.append(3, 5, "x", EVENT_MAX_PAYLOAD + 1));
+  CHECK(store.flush());
+  all = queryAll(store);
+  CHECK_EQ(all.back().timeMs, 1000 + (COUNT - 1) * 10);
+  CHECK_EQ(all.back().length, 0);
+  CHECK_EQ(store.stats().dropped, 2);
+}
+
+static void testReopen() {
+  testCase("reopen");
+  MemoryStorage storage;
+  {
+    EventStore store;
+    CHECK(store.begin(&storage, 16));
+    for (uint32_t i = 0; i < 300; i++) appendNumbered(store, i, 100 + i);
+    CHECK(store.flush());
+  }
+  size_t segments = storage.files.size();
+  EventStore store;
+  CHECK(store.begin(&storage, 16));
+  CHECK_EQ(store.stats().tornTails, 0);
+  CHECK_EQ(store.nextSequence(), 300);
+  CHECK_EQ(store.lastTime(), 399);
+  for (uint32_t i = 300; i < 400; i++) appendNumbered(store, i, 100 + i);
+  CHECK(store.flush());
+  CHECK_EQ(storage.files.size(), segments);   // carried on in the same segment
+  std::vector<EventRecord> all = queryAll(store);
+  CHECK_EQ(all.size(), 400);
+  CHECK(all.size() == 400 && all[399].sequence == 399 && payloadMatches(all[399], 399));
+}
+
+static void testTornTail() {
+  testCase("torn tail");
+  MemoryStorage storage;
+  uint32_t lastSegment;
+  {
+    EventStore store;
+    CHECK(store.begin(&storage, 16));
+    for (uint32_t i = 0; i < 200; i++) appendNumbered(store, i, i);
+    CHECK(store.flush());
+    for (uint32_t i = 200; i < 220; i++) appendNumbered(store, i, i);   // fits the write buffer
+    storage.appendLimit = 333;           // reset in the middle of a record
+    CHECK(!store.flush());
+    CHECK_EQ(store.stats().writeErrors, 1);
+    lastSegment = storage.files.rbegin()->first;
+
+    // Nothing is appended after the damaged bytes, even in this session
+    for (uint32_t i = 220; i < 230; i++) appendNumbered(store, i, i);
+    CHECK(store.flush());
+    CHECK(storage.files.rbegin()->first != lastSegment);
+  }
+
+  EventStore store;
+  CHECK(store.begin(&storage, 16));
+  CHECK_EQ(store.stats().tornTails, 0);   // the newest segment ends cleanly
+  std::vector<EventRecord> all = queryAll(store);
+  bool intact = true;
+  for (size_t k = 0; k < all.size(); k++) intact = intact && payloadMatches(all[k], all[k].sequence);
+  CHECK(intact);
+  CHECK(all.size() >= 210 && all.size() < 230);
+  CHECK(!all.empty() && all.back().sequence == 229);
+
+  // A tear in the newest segment is found at boot
+  storage.files[storage.files.rbegin()->first].resize(storage.files.rbegin()->second.size() - 7);
+  EventStore reopened;
+  CHECK(reopened.begin(&storage, 16));
+  CHECK_EQ(reopened.stats().tornTails, 1);
+  CHECK_EQ(reopened.nextSequence(), 229);
+  size_t before = storage.files.size();
+  appendNumbered(reopened, 229, 229);
+  CHECK(reopened.flush());
+  CHECK_EQ(storage.files.size(), before + 1);
+  all = queryAll(reopened);
+  CHECK(!all.empty() && all.back().sequence == 229 && payloadMatches(all.back(), 229));
+}
+
+static void testZeroTail() {
+  testCase("zero-filled tail");
+  MemoryStorage storage;
+  {
+    EventStore store;
+    CHECK(store.begin(&storage, 16));
+    for (uint32_t i = 0; i < 100; i++) appendNumbered(store, i, i);
+    CHECK(store.flush());
+  }
+  // The file grew but the data never made it: the card left zeros
+  std::vector<uint8_t> &file = storage.files.rbegin()->second;
+  file.insert(file.end(), 5000, 0);
+  size_t before = storage.files.size();
+
+  EventStore store;
+  CHECK(store.begin(&storage, 16));
+  CHECK_EQ(store.stats().tornTails, 1);
+  CHECK_EQ(store.nextSequence(), 100);
+  CHECK_EQ(queryAll(store).size(), 100);
+  appendNumbered(store, 100, 100);
+  CHECK(store.flush());
+  CHECK_EQ(storage.files.size(), before + 1);
+  CHECK_EQ(queryAll(store).size(), 101);
+}
+
+static void testCorruptBlock() {
+  testCase("corrupt block");
+  MemoryStorage storage;
+  EventStore store;
+  CHECK(store.begin(&storage, 16));
+  const uint32_t COUNT = 2000;
+  for (uint32_t i = 0; i < COUNT; i++) appendNumbered(store, i, i * 2);
+  CHECK(store.flush());
+
+  // Flip one payload byte in the middle of the second block of the first segment
+  std::vector<uint8_t> &file = storage.files.begin()->second;
+  uint32_t offset = EVENT_BLOCK_SIZE + 1000;
+  std::vector<EventRecord> before = queryAll(store);
+  file[offset] ^= 0xFF;
+
+  std::vector<EventRecord> after = queryAll(store);
+  CHECK(after.size() < before.size());
+  CHECK(before.size() - after.size() < EVENT_BLOCK_SIZE / EVENT_HEADER_SIZE);
+  // What is lost is one run inside that block; everything else reads back
+  bool intact = true;
+  uint32_t gaps = 0;
+  for (size_t k = 0; k < after.size(); k++) {
+    intact = intact && payloadMatches(after[k], after[k].sequence);
+    if (k && after[k].sequence != after[k - 1].sequence + 1) gaps++;
+  }
+  CHECK(intact);
+  CHECK_EQ(gaps, 1);
+  CHECK(!after.empty() && after.back().sequence == COUNT - 1);
+
+  // Queries that start inside the damaged block still find the records after it
+  std::vector<EventRecord> tail = queryAll(store, after[0].timeMs + 200, EVENT_TIME_MAX);
+  CHECK(!tail.empty() && tail.back().sequence == COUNT - 1);
+
+  // A damaged segment header drops the whole segment at boot
+  storage.files.begin()->second[0] ^= 0x01;
+  EventStore reopened;
+  CHECK(reopened.begin(&storage, 16));
+  CHECK_EQ(reopened.stats().removedSegments, 1);
+  CHECK_EQ(reopened.segmentCount(), storage.files.size());
+}
+
+static void testTrim() {
+  testCase("trim and retention");
+  MemoryStorage storage;
+  EventStore store;
+  CHECK(store.begin(&storage, 6));
+  uint32_t i = 0;
+  for (; i < 20000; i++) appendNumbered(store, i, i * 100);
+  CHECK(store.flush());
+  // The table never holds more than maxSegments: the oldest go first
+  CHECK_EQ(store.segmentCount(), 6);
+  CHECK_EQ(storage.files.size(), 6);
+  CHECK(store.stats().expiredSegments > 0);
+
+  // A cursor in a segment that retention deletes moves on to the next one
+  EventCursor cursor;
+  EventRecord record;
+  store.query(cursor, 0, EVENT_TIME_MAX, 0);
+  CHECK(store.next(cursor, record));
+  uint32_t firstSeen = record.sequence;
+  CHECK_EQ(store.trim(store.totalBytes() - 1, 0), 1);
+  CHECK(store.next(cursor, record));
+  CHECK(record.sequence > firstSeen);
+  CHECK_EQ(storage.files.size(), 5);
+
+  // By size: down to the limit, never below the segment being written
+  CHECK_EQ(store.trim(2 * EVENT_SEGMENT_SIZE, 0), 3);
+  CHECK(store.totalBytes() <= 2 * EVENT_SEGMENT_SIZE);
+  CHECK_EQ(store.trim(1, 0), 1);
+  CHECK_EQ(store.segmentCount(), 1);
+  CHECK_EQ(store.trim(1, 0), 0);
+
+  // By age: a segment goes once the next one starts before the cutoff
+  for (; i < 40000; i++) appendNumbered(store, i, i * 100);
+  CHECK(store.flush());
+  uint16_t segments = store.segmentCount();
+  CHECK_EQ(store.trim(0, store.firstTime()), 0);
+  uint64_t cutoff = (uint64_t)35000 * 100;
+  uint16_t removed = store.trim(0, cutoff);
+  CHECK(removed > 0 && removed < segments);
+  std::vector<EventRecord> all = queryAll(store);
+  CHECK(!all.empty() && all[0].timeMs < cutoff);
+  CHECK(!all.empty() && all.back().sequence == 39999);
+  CHECK_EQ(store.trim(0, EVENT_TIME_MAX), store.segmentCount() ? segments - removed - 1 : 0);
+  CHECK_EQ(store.segmentCount(), 1);
+}
+
+static void testWriteFailure() {
+  testCase("failed writes");
+  MemoryStorage storage;
+  EventStore store;
+  CHECK(store.begin(&storage, 4));
+  for (uint32_t i = 0; i < 10; i++) appendNumbered(store, i, i);
+  storage.appendFails = true;
+  CHECK(!store.flush());
+  CHECK_EQ(store.stats().writeErrors, 1);
+  CHECK(store.pendingBytes() > 0);       // kept for the next flush
+  storage.appendFails = false;
+  CHECK(store.flush());
+  CHECK_EQ(queryAll(store).size(), 10);
+}
+
+int main() {
+  testAppendAndQuery();
+  testReopen();
+  testTornTail();
+  testZeroTail();
+  testCorruptBlock();
+  testTrim();
+  testWriteFailure();
+  return testSummary("test_event_store");
+}
@@ -0,0 +1,547 @@
+/**
+ * Int8 kernels host test
+ *
+ * Compares every kernel in src/int8_kernels.cpp byte for byte with plain
+ * reference loops written from the TFLite int8 reference kernels: the input
+ * zero point is subtracted tap by tap, padding taps are skipped, there are
+ * no packed loads, and the fixed-point rounding is spelled out in 64-bit
+ * arithmetic instead of the gemmlowp mask-and-threshold form. Shapes,
+ * strides, padding, dilation, zero points and requantization are drawn at
+ * random; buffers are placed both 4-byte aligned and off by one so the
+ * packed and the byte-wise paths are both covered.
+ */
+
+#include "int8_kernels.h"
+#include "test.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static uint32_t rngState = 0x1234567u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Uniform in [lo, hi]
+static int32_t rndRange(int32_t lo, int32_t hi) {
+  return lo + (int32_t)(rnd() % (uint32_t)(hi - lo + 1));
+}
+
+// int8 buffer whose data starts at the given offset from a 4-byte boundary
+class Buffer {
+public:
+  Buffer(size_t size, size_t misalign) : storage(size + 8), offset(misalign) {
+    uintptr_t base = (uintptr_t)storage.data();
+    offset += (4 - (base & 3)) & 3;
+  }
+  int8_t *data() { return (int8_t *)storage.data() + offset; }
+  void fillRandom(size_t size) {
+    for (size_t i = 0; i < size; i++) data()[i] = (int8_t)rnd();
+  }
+
+private:
+  std::vector<uint32_t> storage;
+  size_t offset;
+};
+
+// ---------------------------------------------------------------------------
+// Reference arithmetic
+
+static int32_t refDoublingHighMul(int32_t a, int32_t b) {
+  if (a == INT32_MIN && b == INT32_MIN) return INT32_MAX;
+  int64_t ab = (int64_t)a * b;
+  // round(ab / 2^31): halves away from zero when positive, toward zero when negative
+  if (ab >= 0) return (int32_t)((ab + (1LL << 30)) >> 31);
+  return (int32_t)-((-ab + (1LL << 30) - 1) >> 31);
+}
+
+// x / 2^exponent rounded to nearest, halves away from zero
+static int32_t refRoundingShift(int32_t x, int32_t exponent) {
+  if (exponent == 0) return x;
+  int64_t half = 1LL << (exponent - 1);
+  if (x >= 0) return (int32_t)(((int64_t)x + half) >> exponent);
+  return (int32_t)-((-(int64_t)x + half) >> exponent);
+}
+
+static int32_t refRequantize(int32_t acc, int32_t multiplier, int32_t shift) {
+  int32_t left = shift > 0 ? shift : 0;
+  return refRoundingShift(refDoublingHighMul((int32_t)((uint32_t)acc << left), multiplier), shift > 0 ? 0 : -shift);
+}
+
+static int8_t refClamp(int32_t v, int32_t lo, int32_t hi) {
+  return (int8_t)(v < lo ? lo : (v > hi ? hi : v));
+}
+
+// ---------------------------------------------------------------------------
+// Reference kernels
+
+static void refConv(const int8_t *input, const Int8Shape &in, const int8_t *filter, int32_t kh, int32_t kw,
+                    const int32_t *bias, const Int8ConvParams &p, const Int8Requant &rq, int8_t *output,
+                    const Int8Shape &out) {
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      for (int32_t oc = 0; oc < out.c; oc++) {
+        int32_t acc = 0;
+        for (int32_t ky = 0; ky < kh; ky++) {
+          for (int32_t kx = 0; kx < kw; kx++) {
+            int32_t iy = oy * p.strideH - p.padH + ky * p.dilationH;
+            int32_t ix = ox * p.strideW - p.padW + kx * p.dilationW;
+            if (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w) continue;
+            for (int32_t ic = 0; ic < in.c; ic++) {
+              int32_t x = input[(iy * in.w + ix) * in.c + ic];
+              int32_t w = filter[((oc * kh + ky) * kw + kx) * in.c + ic];
+              acc += (x - p.inputZeroPoint) * w;
+            }
+          }
+        }
+        acc += bias[oc];
+        int32_t v = refRequantize(acc, rq.multiplier[oc], rq.shift[oc]) + rq.outputZeroPoint;
+        output[(oy * out.w + ox) * out.c + oc] = refClamp(v, rq.actMin, rq.actMax);
+      }
+    }
+  }
+}
+
+static void refDepthwise(const int8_t *input, const Int8Shape &in, const int8_t *filter, int32_t kh, int32_t kw,
+                         const int32_t *bias, const Int8ConvParams &p, const Int8Requant &rq, int8_t *output,
+                         const Int8Shape &out) {
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      for (int32_t ic = 0; ic < in.c; ic++) {
+        for (int32_t m = 0; m < p.depthMultiplier; m++) {
+          int32_t oc = ic * p.depthMultiplier + m;
+          int32_t acc = 0;
+          for (int32_t ky = 0; ky < kh; ky++) {
+            for (int32_t kx = 0; kx < kw; kx++) {
+              int32_t iy = oy * p.strideH - p.padH + ky * p.dilationH;
+              int32_t ix = ox * p.strideW - p.padW + kx * p.dilationW;
+              if (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w) continue;
+              int32_t x = input[(iy * in.w + ix) * in.c + ic];
+              int32_t w = filter[(ky * kw + kx) * out.c + oc];
+              acc += (x - p.inputZeroPoint) * w;
+            }
+          }
+          acc += bias[oc];
+          int32_t v = refRequantize(acc, rq.multiplier[oc], rq.shift[oc]) + rq.outputZeroPoint;
+          output[(oy * out.w + ox) * out.c + oc] = refClamp(v, rq.actMin, rq.actMax);
+        }
+      }
+    }
+  }
+}
+
+static void refFullyConnected(const int8_t *input, int32_t batches, int32_t depth, const int8_t *weights,
+                              const int32_t *bias, int32_t inputZeroPoint, int32_t outputs, const Int8Requant &rq,
+                              int8_t *output) {
+  for (int32_t b = 0; b < batches; b++) {
+    for (int32_t o = 0; o < outputs; o++) {
+      int32_t acc = 0;
+      for (int32_t d = 0; d < depth; d++) acc += (input[b * depth + d] - inputZeroPoint) * weights[o * depth + d];
+      acc += bias[o];
+      int32_t v = refRequantize(acc, rq.multiplier[o], rq.shift[o]) + rq.outputZeroPoint;
+      output[b * outputs + o] = refClamp(v, rq.actMin, rq.actMax);
+    }
+  }
+}
+
+static void refPool(bool average, const int8_t *input, const Int8Shape &in, int32_t fh, int32_t fw,
+                    const Int8ConvParams &p, int32_t actMin, int32_t actMax, int8_t *output, const Int8Shape &out) {
+  for (int32_t oy = 0; oy < out.h; oy++) {
+    for (int32_t ox = 0; ox < out.w; ox++) {
+      for (int32_t c = 0; c < in.c; c++) {
+        int32_t sum = 0, count = 0, best = -128;
+        for (int32_t fy = 0; fy < fh; fy++) {
+          for (int32_t fx = 0; fx < fw; fx++) {
+            int32_t iy = oy * p.strideH - p.padH + fy;
+            int32_t ix = ox * p.strideW - p.padW + fx;
+            if (iy < 0 || iy >= in.h || ix < 0 || ix >= in.w) continue;
+            int32_t x = input[(iy * in.w + ix) * in.c + c];
+            sum += x;
+            count++;
+            if (x > best) best = x;
+          }
+        }
+        int32_t v = best;
+        if (average) v = count == 0 ? 0 : (sum > 0 ? (sum + count / 2) / count : (sum - count / 2) / count);
+        output[(oy * out.w + ox) * out.c + c] = refClamp(v, actMin, actMax);
+      }
+    }
+  }
+}
+
+static int8_t refAdd(int8_t a, int8_t b, const Int8AddParams &p) {
+  int32_t s1 = refRequantize((a - p.input1ZeroPoint) * (1 << 20), p.input1Multiplier, p.input1Shift);
+  int32_t s2 = refRequantize((b - p.input2ZeroPoint) * (1 << 20), p.input2Multiplier, p.input2Shift);
+  int32_t v = refRequantize(s1 + s2, p.outputMultiplier, p.outputShift) + p.outputZeroPoint;
+  return refClamp(v, p.actMin, p.actMax);
+}
+
+// ---------------------------------------------------------------------------
+// Random layer parameters
+
+struct RandomRequant {
+  std::vector<int32_t> multiplier;
+  std::vector<int32_t> shift;
+  Int8Requant rq;
+
+  explicit RandomRequant(int32_t channels) : multiplier(channels), shift(channels) {
+    for (int32_t c = 0; c < channels; c++) {
+      // Typical conv scales land between 2^-12 and 2^-2; now and then above 1
+      double real = ldexp(0.5 + (rnd() % 1000) / 2000.0, rndRange(-12, rnd() % 16 ? -1 : 2));
+      int8QuantizeMultiplier(real, multiplier[c], shift[c]);
+    }
+    rq.multiplier = multiplier.data();
+    rq.shift = shift.data();
+    rq.outputZeroPoint = rndRange(-128, 127);
+    static const Int8Activation ACTS[] = {INT8_ACT_NONE, INT8_ACT_RELU, INT8_ACT_RELU6, INT8_ACT_RELU_N1_TO_1};
+    int8ActivationRange(ACTS[rnd() % 4], 0.02f + (rnd() % 100) / 1000.0f, rq.outputZeroPoint, rq.actMin, rq.actMax);
+  }
+};
+
+static std::vector<int32_t> randomBias(int32_t channels) {
+  std::vector<int32_t> bias(channels);
+  for (int32_t c = 0; c < channels; c++) bias[c] = rndRange(-20000, 20000);
+  return bias;
+}
+
+static int32_t outputSize(int32_t in, int32_t k, int32_t stride, int32_t pad, int32_t dilation) {
+  int32_t span = (k - 1) * dilation + 1;
+  int32_t padded = in + 2 * pad;
+  return padded < span ? 0 : (padded - span) / stride + 1;
+}
+
+static Int8ConvParams randomGeometry(int32_t kh, int32_t kw, bool dilate) {
+  Int8ConvParams p;
+  p.strideH = rndRange(1, 2);
+  p.strideW = rndRange(1, 2);
+  p.dilationH = dilate ? rndRange(1, 2) : 1;
+  p.dilationW = dilate ? rndRange(1, 2) : 1;
+  p.padH = rndRange(0, ((kh - 1) * p.dilationH + 1) / 2);
+  p.padW = rndRange(0, ((kw - 1) * p.dilationW + 1) / 2);
+  p.depthMultiplier = 1;
+  p.inputZeroPoint = rndRange(-128, 127);
+  return p;
+}
+
+// Index of the first differing byte, or -1
+static long firstDifference(const int8_t *a, const int8_t *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] != b[i]) return (long)i;
+  }
+  return -1;
+}
+
+static bool reportDifference(const char *kernel, int iteration, const int8_t *got, const int8_t *want, size_t n) {
+  long at = firstDifference(got, want, n);
+  if (at < 0) return true;
+  fprintf(stderr, "%s case %d: byte %ld is %d, reference %d\n", kernel, iteration, at, got[at], want[at]);
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+// Tests
+
+static void testFixedPoint() {
+  testCase("fixed-point requantization");
+  static const int32_t EDGES[] = {0, 1, -1, 2, -2, 3, 127, -128, 1 << 20, -(1 << 20), INT32_MAX, INT32_MIN,
+                                  INT32_MAX - 1, INT32_MIN + 1, 0x40000000, -0x40000000};
+  static const int32_t MULTIPLIERS[] = {0x40000000, 0x7FFFFFFF, INT32_MIN, 0x55555555, 0x40000001, 1};
+  int mismatches = 0;
+  for (size_t i = 0; i < sizeof(EDGES) / sizeof(EDGES[0]); i++) {
+    for (size_t m = 0; m < sizeof(MULTIPLIERS) / sizeof(MULTIPLIERS[0]); m++) {
+      for (int32_t shift = -31; shift <= 0; shift++) {
+        if (int8MultiplyByQuantizedMultiplier(EDGES[i], MULTIPLIERS[m], shift) !=
+            refRequantize(EDGES[i], MULTIPLIERS[m], shift)) mismatches++;
+      }
+    }
+  }
+  for (int i = 0; i < 1000000; i++) {
+    int32_t x = (int32_t)rnd() >> rndRange(0, 31);
+    int32_t multiplier = (int32_t)(0x40000000u + (rnd() & 0x3FFFFFFF));
+    int32_t shift = rndRange(-31, 0);
+    if (int8MultiplyByQuantizedMultiplier(x, multiplier, shift) != refRequantize(x, multiplier, shift)) mismatches++;
+    // Left shifts only happen with accumulators small enough not to overflow
+    int32_t left = rndRange(1, 8);
+    x >>= left + 1;
+    if (int8MultiplyByQuantizedMultiplier(x, multiplier, left) != refRequantize(x, multiplier, left)) mismatches++;
+  }
+  CHECK_EQ(mismatches, 0);
+
+  // Quantized multipliers reproduce the real value to 31 bits
+  int badMultipliers = 0;
+  for (int i = 0; i < 10000; i++) {
+    double real = ldexp(0.5 + (rnd() % 1000000) / 2000000.0, rndRange(-30, 8));
+    int32_t multiplier, shift;
+    int8QuantizeMultiplier(real, multiplier, shift);
+    double back = ldexp((double)multiplier, shift - 31);
+    if (multiplier < 0x40000000 || fabs(back - real) > ldexp(real, -30)) badMultipliers++;
+  }
+  CHECK_EQ(badMultipliers, 0);
+  int32_t multiplier = -1, shift = -1;
+  int8QuantizeMultiplier(0.0, multiplier, shift);
+  CHECK_EQ(multiplier, 0);
+  CHECK_EQ(shift, 0);
+  int8QuantizeMultiplier(0.5, multiplier, shift);
+  CHECK_EQ(multiplier, 0x40000000);
+  CHECK_EQ(shift, 0);
+  int8QuantizeMultiplier(1.0 - ldexp(1.0, -40), multiplier, shift);   // rounds up to exactly 1.0
+  CHECK_EQ(multiplier, 0x40000000);
+  CHECK_EQ(shift, 1);
+}
+
+static void testActivationRange() {
+  testCase("activation ranges");
+  int32_t lo, hi;
+  int8ActivationRange(INT8_ACT_NONE, 0.1f, 5, lo, hi);
+  CHECK_EQ(lo, -128);
+  CHECK_EQ(hi, 127);
+  int8ActivationRange(INT8_ACT_RELU, 0.1f, -20, lo, hi);
+  CHECK_EQ(lo, -20);
+  CHECK_EQ(hi, 127);
+  int8ActivationRange(INT8_ACT_RELU6, 0.1f, -20, lo, hi);
+  CHECK_EQ(lo, -20);
+  CHECK_EQ(hi, 40);
+  int8ActivationRange(INT8_ACT_RELU6, 0.01f, 0, lo, hi);   // 6.0 is past the int8 range
+  CHECK_EQ(hi, 127);
+  int8ActivationRange(INT8_ACT_RELU_N1_TO_1, 0.05f, 10, lo, hi);
+  CHECK_EQ(lo, -10);
+  CHECK_EQ(hi, 30);
+}
+
+static void testConv() {
+  testCase("conv2d");
+  int failures = 0;
+  for (int iteration = 0; iteration < 600; iteration++) {
+    int32_t kh = rndRange(1, 3) * 2 - 1, kw = rnd() % 4 ? kh : rndRange(1, 5);
+    Int8Shape in = {rndRange(1, 12), rndRange(1, 12), rnd() % 2 ? 4 * rndRange(1, 6) : rndRange(1, 13)};
+    Int8ConvParams p = randomGeometry(kh, kw, true);
+    Int8Shape out = {outputSize(in.h, kh, p.strideH, p.padH, p.dilationH),
+                     outputSize(in.w, kw, p.strideW, p.padW, p.dilationW), rndRange(1, 19)};
+    if (out.h <= 0 || out.w <= 0) continue;
+
+    size_t inSize = (size_t)in.h * in.w * in.c, filterSize = (size_t)out.c * kh * kw * in.c;
+    size_t outSize = (size_t)out.h * out.w * out.c;
+    Buffer input(inSize, rnd() % 3 == 0), filter(filterSize, rnd() % 3 == 0);
+    input.fillRandom(inSize);
+    filter.fillRandom(filterSize);
+    std::vector<int32_t> bias = randomBias(out.c);
+    RandomRequant rq(out.c);
+
+    std::vector<int32_t> folded(out.c), tapSums(int8ConvCacheTaps(out.c, kh, kw));
+    Int8ConvCache cache = {folded.data(), tapSums.data()};
+    int8PrepareConv(filter.data(), bias.data(), out.c, kh, kw, in.c, p.inputZeroPoint, cache);
+
+    std::vector<int8_t> got(outSize), want(outSize);
+    int8Conv2d(input.data(), in, filter.data(), kh, kw, cache, p, rq.rq, got.data(), out);
+    refConv(input.data(), in, filter.data(), kh, kw, bias.data(), p, rq.rq, want.data(), out);
+    if (!reportDifference("conv2d", iteration, got.data(), want.data(), outSize)) failures++;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testDepthwise() {
+  testCase("depthwise conv2d");
+  int failures = 0;
+  for (int iteration = 0; iteration < 800; iteration++) {
+    int32_t kh = rndRange(1, 3) * 2 - 1, kw = rnd() % 4 ? kh : rndRange(1, 5);
+    Int8Shape in = {rndRange(1, 14), rndRange(1, 14), rnd() % 2 ? 4 * rndRange(1, 8) : rndRange(1, 13)};
+    Int8ConvParams p = randomGeometry(kh, kw, true);
+    p.depthMultiplier = rnd() % 3 ? 1 : rndRange(2, 3);
+    Int8Shape out = {outputSize(in.h, kh, p.strideH, p.padH, p.dilationH),
+                     outputSize(in.w, kw, p.strideW, p.padW, p.dilationW), in.c * p.depthMultiplier};
+    if (out.h <= 0 || out.w <= 0) continue;
+
+    size_t inSize = (size_t)in.h * in.w * in.c, filterSize = (size_t)kh * kw * out.c;
+    size_t outSize = (size_t)out.h * out.w * out.c;
+    Buffer input(inSize, rnd() % 3 == 0), filter(filterSize, rnd() % 3 == 0);
+    input.fillRandom(inSize);
+    filter.fillRandom(filterSize);
+    std::vector<int32_t> bias = randomBias(out.c);
+    RandomRequant rq(out.c);
+
+    std::vector<int32_t> folded(out.c);
+    Int8ConvCache cache = {folded.data(), NULL};
+    int8PrepareDepthwise(filter.data(), bias.data(), out.c, kh, kw, p.inputZeroPoint, cache);
+
+    std::vector<int8_t> got(outSize), want(outSize);
+    int8DepthwiseConv2d(input.data(), in, filter.data(), kh, kw, cache, p, rq.rq, got.data(), out);
+    refDepthwise(input.data(), in, filter.data(), kh, kw, bias.data(), p, rq.rq, want.data(), out);
+    if (!reportDifference("depthwise", iteration, got.data(), want.data(), outSize)) failures++;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testFullyConnected() {
+  testCase("fully connected");
+  int failures = 0;
+  for (int iteration = 0; iteration < 400; iteration++) {
+    int32_t batches = rndRange(1, 3);
+    int32_t depth = rnd() % 2 ? 4 * rndRange(1, 64) : rndRange(1, 257);
+    int32_t outputs = rndRange(1, 21);
+    int32_t zp = rndRange(-128, 127);
+    Buffer input((size_t)batches * depth, rnd() % 3 == 0), weights((size_t)outputs * depth, rnd() % 3 == 0);
+    input.fillRandom((size_t)batches * depth);
+    weights.fillRandom((size_t)outputs * depth);
+    std::vector<int32_t> bias = randomBias(outputs);
+    RandomRequant rq(outputs);
+
+    std::vector<int32_t> folded(outputs);
+    Int8ConvCache cache = {folded.data(), NULL};
+    int8PrepareConv(weights.data(), bias.data(), outputs, 1, 1, depth, zp, cache);
+
+    size_t outSize = (size_t)batches * outputs;
+    std::vector<int8_t> got(outSize), want(outSize);
+    int8FullyConnected(input.data(), batches, depth, weights.data(), folded.data(), outputs, rq.rq, got.data());
+    refFullyConnected(input.data(), batches, depth, weights.data(), bias.data(), zp, outputs, rq.rq, want.data());
+    if (!reportDifference("fully connected", iteration, got.data(), want.data(), outSize)) failures++;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testPooling() {
+  testCase("average and max pool");
+  int failures = 0;
+  for (int iteration = 0; iteration < 600; iteration++) {
+    int32_t fh = rndRange(1, 4), fw = rndRange(1, 4);
+    Int8Shape in = {rndRange(1, 12), rndRange(1, 12), rndRange(1, 10)};
+    Int8ConvParams p = randomGeometry(fh, fw, false);
+    p.padH = rndRange(0, (fh - 1) / 2);   // SAME padding never exceeds half the window
+    p.padW = rndRange(0, (fw - 1) / 2);
+    Int8Shape out = {outputSize(in.h, fh, p.strideH, p.padH, 1), outputSize(in.w, fw, p.strideW, p.padW, 1), in.c};
+    if (out.h <= 0 || out.w <= 0) continue;
+    int32_t actMin = rnd() % 2 ? -128 : rndRange(-128, 0), actMax = rnd() % 2 ? 127 : rndRange(0, 127);
+
+    size_t inSize = (size_t)in.h * in.w * in.c, outSize = (size_t)out.h * out.w * out.c;
+    Buffer input(inSize, rnd() % 2);
+    input.fillRandom(inSize);
+    std::vector<int8_t> got(outSize), want(outSize);
+    int8AveragePool(input.data(), in, fh, fw, p, actMin, actMax, got.data(), out);
+    refPool(true, input.data(), in, fh, fw, p, actMin, actMax, want.data(), out);
+    if (!reportDifference("average pool", iteration, got.data(), want.data(), outSize)) failures++;
+    int8MaxPool(input.data(), in, fh, fw, p, actMin, actMax, got.data(), out);
+    refPool(false, input.data(), in, fh, fw, p, actMin, actMax, want.data(), out);
+    if (!reportDifference("max pool", iteration, got.data(), want.data(), outSize)) failures++;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testAdd() {
+  testCase("add");
+  int failures = 0;
+  std::vector<int8_t> a(256 * 256), b(256 * 256), got(a.size());
+  for (int i = 0; i < 256 * 256; i++) {
+    a[i] = (int8_t)(i & 0xFF);
+    b[i] = (int8_t)(i >> 8);
+  }
+  for (int iteration = 0; iteration < 50; iteration++) {
+    Int8AddParams p;
+    float s1 = 0.005f + (rnd() % 1000) / 10000.0f, s2 = 0.005f + (rnd() % 1000) / 10000.0f;
+    float so = 0.005f + (rnd() % 1000) / 5000.0f;
+    int8PrepareAdd(s1, rndRange(-128, 127), s2, rndRange(-128, 127), so, rndRange(-128, 127),
+                   rnd() % 2 ? INT8_ACT_NONE : INT8_ACT_RELU, p);
+    // Every pair of inputs
+    int8Add(a.data(), b.data(), a.size(), p, got.data());
+    for (size_t i = 0; i < a.size(); i++) {
+      if (got[i] != refAdd(a[i], b[i], p)) {
+        fprintf(stderr, "add case %d: %d + %d gives %d, reference %d\n", iteration, a[i], b[i], got[i],
+                refAdd(a[i], b[i], p));
+        failures++;
+        break;
+      }
+    }
+  }
+  CHECK_EQ(failures, 0);
+
+  // The rescaled sum tracks the real sum to within one output step
+  Int8AddParams p;
+  int8PrepareAdd(0.05f, 3, 0.02f, -7, 0.1f, 10, INT8_ACT_NONE, p);
+  int off = 0;
+  int8Add(a.data(), b.data(), a.size(), p, got.data());
+  for (size_t i = 0; i < a.size(); i++) {
+    float real = (a[i] - 3) * 0.05f + (b[i] + 7) * 0.02f;
+    float q = real / 0.1f + 10;
+    if (q > -128 && q < 127 && fabsf(got[i] - q) > 1.0f) off++;
+  }
+  CHECK_EQ(off, 0);
+}
+
+static void testPad() {
+  testCase("pad");
+  int failures = 0;
+  for (int iteration = 0; iteration < 100; iteration++) {
+    Int8Shape in = {rndRange(1, 8), rndRange(1, 8), rndRange(1, 6)};
+    int32_t paddings[4] = {rndRange(0, 2), rndRange(0, 2), rndRange(0, 2), rndRange(0, 2)};
+    Int8Shape out = {in.h + paddings[0] + paddings[1], in.w + paddings[2] + paddings[3], in.c};
+    int8_t padValue = (int8_t)rnd();
+    size_t inSize = (size_t)in.h * in.w * in.c, outSize = (size_t)out.h * out.w * out.c;
+    Buffer input(inSize, 0);
+    input.fillRandom(inSize);
+    std::vector<int8_t> got(outSize), want(outSize, padValue);
+    for (int32_t y = 0; y < in.h; y++) {
+      for (int32_t x = 0; x < in.w; x++) {
+        for (int32_t c = 0; c < in.c; c++) {
+          want[((y + paddings[0]) * out.w + x + paddings[2]) * out.c + c] = input.data()[(y * in.w + x) * in.c + c];
+        }
+      }
+    }
+    int8Pad(input.data(), in, paddings, padValue, got.data(), out);
+    if (!reportDifference("pad", iteration, got.data(), want.data(), outSize)) failures++;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testSoftmaxAndLogistic() {
+  testCase("softmax and logistic");
+  // Output quantization of TFLite int8 softmax and logistic: scale 1/256, zero point -128
+  const float outScale = 1.0f / 256;
+  int worst = 0;
+  for (int iteration = 0; iteration < 200; iteration++) {
+    int32_t depth = rndRange(2, 40);
+    float inScale = 0.02f + (rnd() % 1000) / 5000.0f;
+    std::vector<int8_t> x(depth), got(depth);
+    for (int32_t i = 0; i < depth; i++) x[i] = (int8_t)rnd();
+    int8Softmax(x.data(), 1, depth, inScale, 0, 1.0f, outScale, -128, got.data());
+    double sum = 0;
+    for (int32_t i = 0; i < depth; i++) sum += exp((x[i] - 127) * (double)inScale);
+    for (int32_t i = 0; i < depth; i++) {
+      double want = exp((x[i] - 127) * (double)inScale) / sum / outScale - 128;
+      if (want > 127) want = 127;
+      int diff = abs(got[i] - (int)lround(want));
+      if (diff > worst) worst = diff;
+    }
+  }
+  CHECK(worst <= 1);
+
+  int8_t all[256], out[256];
+  for (int v = 0; v < 256; v++) all[v] = (int8_t)(v - 128);
+  int8Logistic(all, 256, 0.1f, -5, outScale, -128, out);
+  worst = 0;
+  for (int v = 0; v < 256; v++) {
+    double want = 1.0 / (1.0 + exp(-(all[v] + 5) * 0.1)) * 256 - 128;
+    if (want > 127) want = 127;
+    int diff = abs(out[v] - (int)lround(want));
+    if (diff > worst) worst = diff;
+  }
+  CHECK(worst <= 1);
+  CHECK_EQ(out[0], -128 + (int)lround(256 / (1 + exp(12.3))));
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) rngState = (uint32_t)strtoul(argv[1], NULL, 0);
+  printf("  seed 0x%x\n", rngState);
+  testFixedPoint();
+  testActivationRange();
+  testConv();
+  testDepthwise();
+  testFullyConnected();
+  testPooling();
+  testAdd();
+  testPad();
+  testSoftmaxAndLogistic();
+  return testSummary("test_int8_kernels");
+}
@@ -0,0 +1,605 @@
+/**
+ * JpegCropper host test and benchmark
+ *
+ * Reference images are encoded in-process with libjpeg: grayscale and
+ * 4:4:4, 4:2:2, 4:2:0 and 4:4:0 colour, with and without restart intervals,
+ * with optimized Huffman tables, and as abbreviated frames without DHT like
+ * the camera sends. Each crop is decoded back with libjpeg and checked
+ * against the source:
+ *
+ * - every DCT coefficient of every block equals the source block it was
+ *   cut from, and libjpeg reports no warning about the entropy data;
+ * - without chroma subsampling the decoded pixels equal the source pixels;
+ * - decodeDc() matches the mean of each decoded 8x8 luma block.
+ *
+ * The benchmark crops and DC-decodes a VGA 4:2:2 frame, the camera's
+ * format, and prints frames per second; it does not fail the test.
+ *
+ *   build/test_jpeg_crop            tests, then the benchmark
+ *   build/test_jpeg_crop bench      benchmark only
+ */
+
+#include "jpeg_crop.h"
+#include "test.h"
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <jpeglib.h>
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t rngState = 0x2545F491u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// ---------------------------------------------------------------------------
+// libjpeg glue: errors longjmp back instead of exiting
+
+struct ErrorTrap {
+  jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void trapError(j_common_ptr cinfo) {
+  longjmp(((ErrorTrap *)cinfo->err)->jump, 1);
+}
+
+static void quietMessage(j_common_ptr) {}
+
+static void installTrap(ErrorTrap &trap, j_common_ptr cinfo) {
+  cinfo->err = jpeg_std_error(&trap.mgr);
+  trap.mgr.error_exit = trapError;
+  trap.mgr.output_message = quietMessage;
+}
+
+struct Options {
+  int components;        // 1 or 3
+  int h;                 // luma sampling factors
+  int v;
+  int quality;
+  int restartMcus;
+  bool optimize;         // per-image Huffman tables
+  bool abbreviated;      // DHT stripped: the decoder falls back to the Annex K tables
+};
+
+// Textured test card: gradients, a few hard edges and noise
+static Bytes makePixels(int width, int height, int components, uint32_t seed) {
+  Bytes pixels((size_t)width * height * components);
+  rngState = seed | 1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < components; c++) {
+        int value = (x * (3 + c) + y * (2 + 2 * c)) % 200 + 20;
+        if (((x / 24) + (y / 16)) % 3 == c % 3) value = 255 - value;
+        value += (int)(rnd() % 17) - 8;
+        pixels[((size_t)y * width + x) * components + c] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+      }
+    }
+  }
+  return pixels;
+}
+
+// Removes every DHT segment before the scan
+static Bytes stripDht(const Bytes &jpeg) {
+  Bytes out(jpeg.begin(), jpeg.begin() + 2);
+  size_t pos = 2;
+  while (pos + 4 <= jpeg.size()) {
+    size_t segment = 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+    if (jpeg[pos + 1] != 0xC4) out.insert(out.end(), jpeg.begin() + pos, jpeg.begin() + pos + segment);
+    if (jpeg[pos + 1] == 0xDA) {
+      out.insert(out.end(), jpeg.begin() + pos + segment, jpeg.end());
+      break;
+    }
+    pos += segment;
+  }
+  return out;
+}
+
+static Bytes encode(const Bytes &pixels, int width, int height, const Options &o, bool progressive = false) {
+  jpeg_compress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  unsigned char *buffer = NULL;
+  unsigned long size = 0;
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return Bytes();
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = o.components;
+  cinfo.in_color_space = o.components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, o.quality, TRUE);
+  if (o.components == 3) {
+    cinfo.comp_info[0].h_samp_factor = o.h;
+    cinfo.comp_info[0].v_samp_factor = o.v;
+  }
+  cinfo.restart_interval = o.restartMcus;
+  cinfo.optimize_coding = o.optimize;
+  if (progressive) jpeg_simple_progression(&cinfo);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = (JSAMPROW)&pixels[(size_t)cinfo.next_scanline * width * o.components];
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  Bytes jpeg(buffer, buffer + size);
+  free(buffer);
+  return o.abbreviated ? stripDht(jpeg) : jpeg;
+}
+
+// Quantized coefficients of every block, as libjpeg reads them
+struct Coefficients {
+  bool ok;
+  int width;
+  int height;
+  int components;
+  long warnings;
+  int blocksW[JPEG_CROP_MAX_COMPONENTS];
+  int blocksH[JPEG_CROP_MAX_COMPONENTS];
+  int quantDc[JPEG_CROP_MAX_COMPONENTS];
+  std::vector<JCOEF> blocks[JPEG_CROP_MAX_COMPONENTS];
+
+  const JCOEF *block(int c, int bx, int by) const { return &blocks[c][((size_t)by * blocksW[c] + bx) * 64]; }
+};
+
+static Coefficients readCoefficients(const uint8_t *jpeg, size_t len) {
+  Coefficients result;
+  result.ok = false;
+  jpeg_decompress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return result;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *)jpeg, len);
+  jpeg_read_header(&cinfo, TRUE);
+  jvirt_barray_ptr *arrays = jpeg_read_coefficients(&cinfo);
+  result.width = cinfo.image_width;
+  result.height = cinfo.image_height;
+  result.components = cinfo.num_components;
+  for (int c = 0; c < cinfo.num_components && c < JPEG_CROP_MAX_COMPONENTS; c++) {
+    jpeg_component_info &comp = cinfo.comp_info[c];
+    result.blocksW[c] = comp.width_in_blocks;
+    result.blocksH[c] = comp.height_in_blocks;
+    result.quantDc[c] = comp.quant_table->quantval[0];
+    result.blocks[c].resize((size_t)comp.width_in_blocks * comp.height_in_blocks * 64);
+    for (JDIMENSION by = 0; by < comp.height_in_blocks; by++) {
+      JBLOCKARRAY row = (*cinfo.mem->access_virt_barray)((j_common_ptr)&cinfo, arrays[c], by, 1, FALSE);
+      memcpy(&result.blocks[c][(size_t)by * comp.width_in_blocks * 64], row[0],
+             sizeof(JBLOCK) * comp.width_in_blocks);
+    }
+  }
+  jpeg_finish_decompress(&cinfo);
+  result.warnings = trap.mgr.num_warnings;
+  jpeg_destroy_decompress(&cinfo);
+  result.ok = true;
+  return result;
+}
+
+// Decoded pixels (RGB or gray; YCbCr when raw)
+static Bytes decodePixels(const uint8_t *jpeg, size_t len, bool ycc, int &width, int &height, int &components) {
+  Bytes pixels;
+  jpeg_decompress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return Bytes();
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *)jpeg, len);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.dct_method = JDCT_ISLOW;
+  if (ycc && cinfo.num_components == 3) cinfo.out_color_space = JCS_YCbCr;
+  jpeg_start_decompress(&cinfo);
+  width = cinfo.output_width;
+  height = cinfo.output_height;
+  components = cinfo.output_components;
+  pixels.resize((size_t)width * height * components);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = &pixels[(size_t)cinfo.output_scanline * width * components];
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return pixels;
+}
+
+// ---------------------------------------------------------------------------
+// Checks
+
+static std::string describe(const Options &o, int width, int height) {
+  char text[96];
+  snprintf(text, sizeof(text), "%dx%d %s q%d rst%d%s%s", width, height,
+           o.components == 1 ? "gray" : o.h == 2 ? (o.v == 2 ? "420" : "422") : (o.v == 2 ? "440" : "444"),
+           o.quality, o.restartMcus, o.optimize ? " optimized" : "", o.abbreviated ? " abbreviated" : "");
+  return text;
+}
+
+// One crop of source, checked against the source coefficients and pixels.
+// Returns false (and prints why) on the first mismatch.
+static bool checkCrop(JpegCropper &cropper, const Bytes &jpeg, const Coefficients &source, const Options &o,
+                      const JpegCropRect &request, const char *name) {
+  Bytes out(JpegCropper::maxOutputSize(jpeg.size()));
+  size_t outLen = 0;
+  JpegCropRect actual;
+  if (!cropper.crop(jpeg.data(), jpeg.size(), request, out.data(), out.size(), outLen, actual)) {
+    // Optimized tables only hold the DC sizes the source used; the caller counts these
+    if (o.optimize && strstr(cropper.error(), "cannot code")) return false;
+    fprintf(stderr, "%s: crop %u,%u %ux%u failed: %s\n", name, request.x, request.y, request.width, request.height,
+            cropper.error());
+    return false;
+  }
+  int mcuW = cropper.mcuWidth(), mcuH = cropper.mcuHeight();
+  uint32_t right = (uint32_t)request.x + (request.width ? request.width : 1);
+  uint32_t bottom = (uint32_t)request.y + (request.height ? request.height : 1);
+  if (right > (uint32_t)source.width) right = source.width;
+  if (bottom > (uint32_t)source.height) bottom = source.height;
+  bool covers = actual.x % mcuW == 0 && actual.y % mcuH == 0 && actual.x <= request.x && actual.y <= request.y &&
+                actual.x + actual.width >= right && actual.y + actual.height >= bottom &&
+                request.x - actual.x < mcuW && request.y - actual.y < mcuH &&
+                actual.x + actual.width <= source.width && actual.y + actual.height <= source.height;
+  if (!covers) {
+    fprintf(stderr, "%s: crop %u,%u %ux%u gave %u,%u %ux%u\n", name, request.x, request.y, request.width,
+            request.height, actual.x, actual.y, actual.width, actual.height);
+    return false;
+  }
+  uint32_t mcusX = (actual.width + mcuW - 1) / mcuW, mcusY = (actual.height + mcuH - 1) / mcuH;
+  if (cropper.stats().mcusWritten != mcusX * mcusY) {
+    fprintf(stderr, "%s: %u MCUs written, expected %u\n", name, cropper.stats().mcusWritten, mcusX * mcusY);
+    return false;
+  }
+
+  Coefficients cut = readCoefficients(out.data(), outLen);
+  if (!cut.ok || cut.warnings || cut.width != actual.width || cut.height != actual.height ||
+      cut.components != source.components) {
+    fprintf(stderr, "%s: crop %u,%u %ux%u does not decode cleanly (%ld warnings)\n", name, actual.x, actual.y,
+            actual.width, actual.height, cut.ok ? cut.warnings : -1L);
+    return false;
+  }
+  int hMax = mcuW / 8, vMax = mcuH / 8;
+  for (int c = 0; c < cut.components; c++) {
+    int h = c == 0 && cut.components == 3 ? o.h : 1, v = c == 0 && cut.components == 3 ? o.v : 1;
+    int offsetX = actual.x / mcuW * (cut.components == 3 ? h : hMax);
+    int offsetY = actual.y / mcuH * (cut.components == 3 ? v : vMax);
+    for (int by = 0; by < cut.blocksH[c]; by++) {
+      for (int bx = 0; bx < cut.blocksW[c]; bx++) {
+        if (memcmp(cut.block(c, bx, by), source.block(c, bx + offsetX, by + offsetY), 64 * sizeof(JCOEF))) {
+          fprintf(stderr, "%s: crop %u,%u %ux%u component %d block %d,%d differs\n", name, actual.x, actual.y,
+                  actual.width, actual.height, c, bx, by);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Without upsampling every output pixel depends only on its own block
+static bool checkPixels(JpegCropper &cropper, const Bytes &jpeg, const JpegCropRect &request, const char *name) {
+  Bytes out(JpegCropper::maxOutputSize(jpeg.size()));
+  size_t outLen = 0;
+  JpegCropRect actual;
+  if (!cropper.crop(jpeg.data(), jpeg.size(), request, out.data(), out.size(), outLen, actual)) return false;
+  int sw, sh, sc, cw, ch, cc;
+  Bytes full = decodePixels(jpeg.data(), jpeg.size(), false, sw, sh, sc);
+  Bytes cut = decodePixels(out.data(), outLen, false, cw, ch, cc);
+  if (cut.empty() || cw != actual.width || ch != actual.height || cc != sc) return false;
+  for (int y = 0; y < ch; y++) {
+    const uint8_t *a = &cut[(size_t)y * cw * cc];
+    const uint8_t *b = &full[(((size_t)(y + actual.y) * sw) + actual.x) * sc];
+    if (memcmp(a, b, (size_t)cw * cc)) {
+      fprintf(stderr, "%s: crop pixels differ on row %d\n", name, y);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool checkDc(JpegCropper &cropper, const Bytes &jpeg, const Coefficients &source, const Options &o,
+                    const char *name) {
+  Bytes dc(((size_t)source.width / 8 + 1) * (source.height / 8 + 1) * 2);
+  uint16_t w, h;
+  bool color;
+  int blocksX = (source.width + 7) / 8, blocksY = (source.height + 7) / 8;
+  if (source.components == 3 && blocksX < 2) {
+    // YUYV needs a pair of blocks
+    return !cropper.decodeDc(jpeg.data(), jpeg.size(), dc.data(), dc.size(), w, h, color);
+  }
+  if (!cropper.decodeDc(jpeg.data(), jpeg.size(), dc.data(), dc.size(), w, h, color)) {
+    fprintf(stderr, "%s: decodeDc failed: %s\n", name, cropper.error());
+    return false;
+  }
+  if (color != (source.components == 3) || h != blocksY || w != (color ? blocksX & ~1 : blocksX)) {
+    fprintf(stderr, "%s: decodeDc gave %ux%u\n", name, w, h);
+    return false;
+  }
+  int pw, ph, pc;
+  Bytes pixels = decodePixels(jpeg.data(), jpeg.size(), true, pw, ph, pc);
+  size_t stride = color ? (size_t)w * 2 : w;
+  for (int by = 0; by < h; by++) {
+    for (int bx = 0; bx < w; bx++) {
+      uint8_t y = dc[by * stride + (color ? bx * 2 : bx)];
+
+      // Luma: the mean of a whole 8x8 block, unless clipping moved it
+      if ((bx + 1) * 8 <= pw && (by + 1) * 8 <= ph) {
+        int sum = 0;
+        bool clipped = false;
+        for (int yy = 0; yy < 8; yy++) {
+          for (int xx = 0; xx < 8; xx++) {
+            uint8_t p = pixels[((size_t)(by * 8 + yy) * pw + bx * 8 + xx) * pc];
+            clipped = clipped || p == 0 || p == 255;
+            sum += p;
+          }
+        }
+        if (!clipped && abs(y - (sum + 32) / 64) > 1) {
+          fprintf(stderr, "%s: DC pixel %d,%d is %d, block mean %d\n", name, bx, by, y, (sum + 32) / 64);
+          return false;
+        }
+      }
+
+      // Chroma: the DC coefficient of the block that covers the pair
+      if (color && (bx & 1) == 0) {
+        for (int c = 1; c < 3; c++) {
+          int value = source.block(c, bx / o.h, by / o.v)[0] * source.quantDc[c];
+          value = 128 + (value >= 0 ? value + 4 : value - 4) / 8;
+          value = value < 0 ? 0 : value > 255 ? 255 : value;
+          if (dc[by * stride + bx * 2 + (c == 1 ? 1 : 3)] != value) {
+            fprintf(stderr, "%s: DC chroma %d at %d,%d is %d, expected %d\n", name, c, bx, by,
+                    dc[by * stride + bx * 2 + (c == 1 ? 1 : 3)], value);
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static void testReferenceImages() {
+  testCase("crops against reference images");
+  static const Options OPTIONS[] = {
+    {1, 1, 1, 85, 0, false, false},
+    {1, 1, 1, 50, 5, false, true},
+    {3, 1, 1, 90, 0, false, false},
+    {3, 1, 1, 75, 4, true, false},
+    {3, 2, 1, 80, 0, false, true},     // the camera's format
+    {3, 2, 1, 80, 3, false, true},
+    {3, 2, 1, 95, 1, false, false},
+    {3, 2, 1, 60, 0, true, false},
+    {3, 2, 2, 75, 0, false, false},
+    {3, 2, 2, 75, 7, false, true},
+    {3, 1, 2, 70, 2, false, false},
+  };
+  static const int SIZES[][2] = {{160, 120}, {97, 61}, {8, 8}, {200, 33}, {17, 150}};
+
+  int images = 0, crops = 0, failures = 0, skipped = 0, dcFailures = 0, pixelFailures = 0;
+  for (size_t i = 0; i < sizeof(OPTIONS) / sizeof(OPTIONS[0]); i++) {
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+      const Options &o = OPTIONS[i];
+      int width = SIZES[s][0], height = SIZES[s][1];
+      Bytes jpeg = encode(makePixels(width, height, o.components, (uint32_t)(i * 31 + s)), width, height, o);
+      Coefficients source = readCoefficients(jpeg.data(), jpeg.size());
+      std::string name = describe(o, width, height);
+      if (jpeg.empty() || !source.ok) {
+        fprintf(stderr, "%s: could not build the reference image\n", name.c_str());
+        failures++;
+        continue;
+      }
+      images++;
+      JpegCropper cropper;
+      if (!checkDc(cropper, jpeg, source, o, name.c_str())) dcFailures++;
+
+      // Whole image, single MCU corners, zero-sized and oversized requests, then random ones
+      std::vector<JpegCropRect> requests;
+      JpegCropRect whole = {0, 0, (uint16_t)width, (uint16_t)height};
+      JpegCropRect corner = {(uint16_t)(width - 1), (uint16_t)(height - 1), 1, 1};
+      JpegCropRect empty = {(uint16_t)(width / 2), (uint16_t)(height / 2), 0, 0};
+      JpegCropRect oversized = {3, 5, 60000, 60000};
+      requests.push_back(whole);
+      requests.push_back(corner);
+      requests.push_back(empty);
+      requests.push_back(oversized);
+      rngState = (uint32_t)(i * 977 + s * 131 + 1);
+      for (int k = 0; k < 24; k++) {
+        JpegCropRect r;
+        r.x = (uint16_t)(rnd() % width);
+        r.y = (uint16_t)(rnd() % height);
+        r.width = (uint16_t)(1 + rnd() % width);
+        r.height = (uint16_t)(1 + rnd() % height);
+        requests.push_back(r);
+      }
+      for (size_t k = 0; k < requests.size(); k++) {
+        crops++;
+        if (checkCrop(cropper, jpeg, source, o, requests[k], name.c_str())) continue;
+        if (o.optimize && strstr(cropper.error(), "cannot code")) {
+          skipped++;
+          continue;
+        }
+        failures++;
+      }
+      if (o.components == 1 || (o.h == 1 && o.v == 1)) {
+        for (size_t k = 4; k < requests.size(); k += 5) {
+          if (!checkPixels(cropper, jpeg, requests[k], name.c_str())) pixelFailures++;
+        }
+      }
+    }
+  }
+  printf("  %d images, %d crops (%d not codable with optimized tables)\n", images, crops, skipped);
+  CHECK_EQ(images, 55);
+  CHECK_EQ(failures, 0);
+  CHECK_EQ(pixelFailures, 0);
+  CHECK_EQ(dcFailures, 0);
+  CHECK(skipped * 10 < crops);
+}
+
+static void testRestartSkipping() {
+  testCase("restart intervals");
+  Options o = {3, 2, 1, 80, 4, false, true};
+  int width = 320, height = 240;
+  Bytes jpeg = encode(makePixels(width, height, 3, 7), width, height, o);
+  Coefficients source = readCoefficients(jpeg.data(), jpeg.size());
+  JpegCropper cropper;
+
+  // A window in the middle: intervals wholly above it or beside it are not decoded
+  JpegCropRect window = {96, 120, 64, 48};
+  CHECK(checkCrop(cropper, jpeg, source, o, window, "restart window"));
+  JpegCropStats stats = cropper.stats();
+  uint32_t mcusX = 20, lastRow = (120 + 48) / 8 - 1;
+  CHECK(stats.intervalsSkipped > 0);
+  CHECK(stats.mcusDecoded < lastRow * mcusX);
+  CHECK_EQ(stats.mcusDecoded + stats.intervalsSkipped * 4, lastRow * mcusX + (96 + 64) / 16);
+
+  // Without restart markers every MCU up to the last selected one is decoded
+  o.restartMcus = 0;
+  jpeg = encode(makePixels(width, height, 3, 7), width, height, o);
+  source = readCoefficients(jpeg.data(), jpeg.size());
+  CHECK(checkCrop(cropper, jpeg, source, o, window, "no restarts"));
+  CHECK_EQ(cropper.stats().intervalsSkipped, 0);
+  CHECK_EQ(cropper.stats().mcusDecoded, lastRow * mcusX + (96 + 64) / 16);
+
+  // The output restarts at every MCU row
+  Bytes out(JpegCropper::maxOutputSize(jpeg.size()));
+  size_t outLen;
+  JpegCropRect actual;
+  CHECK(cropper.crop(jpeg.data(), jpeg.size(), window, out.data(), out.size(), outLen, actual));
+  int markers = 0;
+  for (size_t i = 0; i + 1 < outLen; i++) {
+    if (out[i] == 0xFF && (out[i + 1] & 0xF8) == 0xD0) markers++;
+  }
+  CHECK_EQ(markers, actual.height / 8 - 1);
+}
+
+static void testErrors() {
+  testCase("rejected input");
+  Options o = {3, 2, 1, 80, 2, false, false};
+  int width = 64, height = 48;
+  Bytes pixels = makePixels(width, height, 3, 3);
+  Bytes jpeg = encode(pixels, width, height, o);
+  JpegCropper cropper;
+  Bytes out(JpegCropper::maxOutputSize(jpeg.size()));
+  size_t outLen = 1;
+  JpegCropRect actual;
+  JpegCropRect rect = {8, 8, 16, 16};
+  uint8_t dc[1024];
+  uint16_t w, h;
+  bool color;
+
+  Bytes png(jpeg);
+  png[1] = 0x50;
+  CHECK(!cropper.crop(png.data(), png.size(), rect, out.data(), out.size(), outLen, actual));
+  CHECK(cropper.error() && strcmp(cropper.error(), "Not a JPEG") == 0);
+  CHECK_EQ(outLen, 0);
+
+  Bytes progressive = encode(pixels, width, height, o, true);
+  CHECK(!cropper.crop(progressive.data(), progressive.size(), rect, out.data(), out.size(), outLen, actual));
+  CHECK(!cropper.decodeDc(progressive.data(), progressive.size(), dc, sizeof(dc), w, h, color));
+
+  JpegCropRect outside = {64, 0, 8, 8};
+  CHECK(!cropper.crop(jpeg.data(), jpeg.size(), outside, out.data(), out.size(), outLen, actual));
+  CHECK(cropper.error() && strcmp(cropper.error(), "Crop outside the image") == 0);
+
+  JpegCropRect all = {0, 0, 64, 48};
+  CHECK(!cropper.crop(jpeg.data(), jpeg.size(), all, out.data(), 200, outLen, actual));
+  CHECK(!cropper.crop(jpeg.data(), jpeg.size(), all, out.data(), jpeg.size() / 2, outLen, actual));
+  CHECK(cropper.error() && strcmp(cropper.error(), "Output buffer too small") == 0);
+  CHECK(!cropper.decodeDc(jpeg.data(), jpeg.size(), dc, 10, w, h, color));
+
+  // A header cut short is reported; a scan cut short or damaged never reads past the buffer
+  CHECK(!cropper.crop(jpeg.data(), 300, rect, out.data(), out.size(), outLen, actual));
+  int handled = 0;
+  for (size_t len = jpeg.size() - 1; len > jpeg.size() / 2; len -= 7) {
+    Bytes cut(jpeg.begin(), jpeg.begin() + len);
+    cropper.crop(cut.data(), cut.size(), all, out.data(), out.size(), outLen, actual);
+    cropper.decodeDc(cut.data(), cut.size(), dc, sizeof(dc), w, h, color);
+    handled++;
+  }
+  rngState = 99;
+  for (int k = 0; k < 200; k++) {
+    Bytes damaged(jpeg);
+    for (int n = 0; n < 4; n++) damaged[jpeg.size() / 2 + rnd() % (jpeg.size() / 2 - 2)] = (uint8_t)rnd();
+    cropper.crop(damaged.data(), damaged.size(), all, out.data(), out.size(), outLen, actual);
+    if (outLen > out.size()) handled = -1000;
+    handled++;
+  }
+  CHECK(handled > 200);
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark
+
+static double seconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *label, const Bytes &jpeg, const JpegCropRect &rect, bool dcOnly) {
+  JpegCropper cropper;
+  Bytes out(JpegCropper::maxOutputSize(jpeg.size()));
+  size_t outLen = 0;
+  JpegCropRect actual;
+  uint16_t w, h;
+  bool color;
+  int frames = 0;
+  double start = seconds(), elapsed = 0;
+  while (elapsed < 0.25) {
+    for (int i = 0; i < 20; i++) {
+      if (dcOnly) {
+        cropper.decodeDc(jpeg.data(), jpeg.size(), out.data(), out.size(), w, h, color);
+      } else {
+        cropper.crop(jpeg.data(), jpeg.size(), rect, out.data(), out.size(), outLen, actual);
+      }
+    }
+    frames += 20;
+    elapsed = seconds() - start;
+  }
+  printf("  %-34s %7.0f fps  (%u MCUs decoded, %u written, %u intervals skipped)\n", label, frames / elapsed,
+         cropper.stats().mcusDecoded, cropper.stats().mcusWritten, cropper.stats().intervalsSkipped);
+}
+
+static void benchmark() {
+  testCase("benchmark, VGA 4:2:2 q80 (host CPU, not the ESP32)");
+  int width = 640, height = 480;
+  Bytes pixels = makePixels(width, height, 3, 11);
+  Options o = {3, 2, 1, 80, 0, false, true};
+  Bytes plain = encode(pixels, width, height, o);
+  o.restartMcus = 10;
+  Bytes restarts = encode(pixels, width, height, o);
+  JpegCropRect center = {160, 120, 320, 240};
+  JpegCropRect top = {0, 0, 320, 240};
+  JpegCropRect whole = {0, 0, 640, 480};
+  bench("crop 320x240 center", plain, center, false);
+  bench("crop 320x240 center, RST every 10", restarts, center, false);
+  bench("crop 320x240 top-left", plain, top, false);
+  bench("crop whole frame", plain, whole, false);
+  bench("decodeDc", plain, whole, true);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    benchmark();
+    return 0;
+  }
+  testReferenceImages();
+  testRestartSkipping();
+  testErrors();
+  benchmark();
+  return testSummary("test_jpeg_crop");
+}
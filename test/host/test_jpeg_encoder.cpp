@@ -0,0 +1,526 @@
+/**
+ * JpegEncoder host test and benchmark
+ *
+ * Encodes synthetic grayscale and YUYV frames, decodes them with libjpeg
+ * and measures PSNR against the source. The yardstick is libjpeg's own
+ * encoder (accurate integer DCT, same IJG quality scaling, same 4:2:2
+ * sampling) run on the same pixels: at every quality the fixed-point
+ * encoder must stay within a fraction of a dB of it at a similar size.
+ * Also checks that the DQT tables are exactly libjpeg's for each quality,
+ * that regions, strides and odd sizes encode the right pixels, that flat
+ * frames come back flat, and that a short buffer fails cleanly.
+ *
+ * The benchmark encodes VGA frames and prints frames per second next to
+ * libjpeg's; it does not fail the test.
+ *
+ *   build/test_jpeg_encoder          tests, then the benchmark
+ *   build/test_jpeg_encoder bench    benchmark only
+ */
+
+#include "jpeg_encoder.h"
+#include "test.h"
+#include <math.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <jpeglib.h>
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t rngState = 0x9E3779B9u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static uint8_t clamp255(int v) {
+  return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+// ---------------------------------------------------------------------------
+// Frames: planes plus the packed buffer the encoder reads
+
+struct Frame {
+  int width;
+  int height;
+  bool yuyv;
+  Bytes y;          // width x height
+  Bytes u;          // one sample per pixel pair, width/2 x height
+  Bytes v;
+  Bytes packed;     // GRAY or YUYV rows
+
+  size_t stride() const { return (size_t)width * (yuyv ? 2 : 1); }
+};
+
+// Something like a photo: soft gradients, a few edges, fine texture and
+// noise. YUYV frames come in pixel pairs, so their width is even.
+static Frame makeFrame(int width, int height, bool yuyv, uint32_t seed) {
+  Frame f;
+  f.width = width;
+  f.height = height;
+  f.yuyv = yuyv;
+  f.y.resize((size_t)width * height);
+  f.u.resize((size_t)(width / 2) * height);
+  f.v.resize(f.u.size());
+  rngState = seed | 1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double value = 128 + 60 * sin(x * 0.045 + y * 0.02) + 30 * cos(y * 0.07 - x * 0.013);
+      if ((x - width / 3) * (x - width / 3) + (y - height / 2) * (y - height / 2) < width * width / 36) value -= 70;
+      if (x > width * 2 / 3 && ((x / 4 + y / 4) & 1)) value += 25;
+      f.y[(size_t)y * width + x] = clamp255((int)value + (int)(rnd() % 9) - 4);
+    }
+    for (int x = 0; x < width / 2; x++) {
+      f.u[(size_t)y * (width / 2) + x] = clamp255(128 + (int)(40 * sin(x * 0.05 + y * 0.03)));
+      f.v[(size_t)y * (width / 2) + x] = clamp255(128 + (int)(35 * cos(x * 0.04 - y * 0.05)) + (x > width / 4 ? 20 : 0));
+    }
+  }
+  f.packed.resize(f.stride() * height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      if (!yuyv) {
+        f.packed[(size_t)y * width + x] = f.y[(size_t)y * width + x];
+        continue;
+      }
+      uint8_t *p = &f.packed[(size_t)y * f.stride() + x * 2];
+      p[0] = f.y[(size_t)y * width + x];
+      p[1] = (x & 1 ? f.v : f.u)[(size_t)y * (width / 2) + x / 2];
+    }
+  }
+  return f;
+}
+
+// ---------------------------------------------------------------------------
+// libjpeg glue
+
+struct ErrorTrap {
+  jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void trapError(j_common_ptr cinfo) {
+  longjmp(((ErrorTrap *)cinfo->err)->jump, 1);
+}
+
+static void quietMessage(j_common_ptr) {}
+
+static void installTrap(ErrorTrap &trap, j_common_ptr cinfo) {
+  cinfo->err = jpeg_std_error(&trap.mgr);
+  trap.mgr.error_exit = trapError;
+  trap.mgr.output_message = quietMessage;
+}
+
+// Decoded planes at full resolution; chroma is replicated, not interpolated
+struct Decoded {
+  bool ok;
+  int width;
+  int height;
+  int components;
+  long warnings;
+  Bytes planes[3];
+  uint16_t quant[2][64];    // natural order
+};
+
+static Decoded decode(const uint8_t *jpeg, size_t len) {
+  Decoded d;
+  d.ok = false;
+  jpeg_decompress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return d;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *)jpeg, len);
+  jpeg_read_header(&cinfo, TRUE);
+  memset(d.quant, 0, sizeof(d.quant));
+  for (int t = 0; t < 2; t++) {
+    if (!cinfo.quant_tbl_ptrs[t]) continue;
+    for (int i = 0; i < 64; i++) d.quant[t][i] = cinfo.quant_tbl_ptrs[t]->quantval[i];
+  }
+  cinfo.dct_method = JDCT_ISLOW;
+  cinfo.do_fancy_upsampling = FALSE;
+  if (cinfo.num_components == 3) cinfo.out_color_space = JCS_YCbCr;
+  jpeg_start_decompress(&cinfo);
+  d.width = cinfo.output_width;
+  d.height = cinfo.output_height;
+  d.components = cinfo.output_components;
+  Bytes row((size_t)d.width * d.components);
+  for (int c = 0; c < d.components; c++) d.planes[c].resize((size_t)d.width * d.height);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    int y = cinfo.output_scanline;
+    JSAMPROW rowPtr = row.data();
+    jpeg_read_scanlines(&cinfo, &rowPtr, 1);
+    for (int x = 0; x < d.width; x++) {
+      for (int c = 0; c < d.components; c++) d.planes[c][(size_t)y * d.width + x] = row[x * d.components + c];
+    }
+  }
+  jpeg_finish_decompress(&cinfo);
+  d.warnings = trap.mgr.num_warnings;
+  jpeg_destroy_decompress(&cinfo);
+  d.ok = true;
+  return d;
+}
+
+// libjpeg's encoder on the same pixels: IJG quality, 4:2:2 for colour
+static Bytes libjpegEncode(const Frame &f, int quality, J_DCT_METHOD method = JDCT_ISLOW) {
+  jpeg_compress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  unsigned char *buffer = NULL;
+  unsigned long size = 0;
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return Bytes();
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = f.width;
+  cinfo.image_height = f.height;
+  cinfo.input_components = f.yuyv ? 3 : 1;
+  cinfo.in_color_space = f.yuyv ? JCS_YCbCr : JCS_GRAYSCALE;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.dct_method = method;
+  if (f.yuyv) {
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+  }
+  jpeg_start_compress(&cinfo, TRUE);
+  Bytes row((size_t)f.width * cinfo.input_components);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    int y = cinfo.next_scanline;
+    for (int x = 0; x < f.width; x++) {
+      if (!f.yuyv) {
+        row[x] = f.y[(size_t)y * f.width + x];
+        continue;
+      }
+      row[x * 3] = f.packed[(size_t)y * f.stride() + x * 2];
+      row[x * 3 + 1] = f.packed[(size_t)y * f.stride() + (x & ~1) * 2 + 1];
+      row[x * 3 + 2] = f.packed[(size_t)y * f.stride() + (x & ~1) * 2 + 3];
+    }
+    JSAMPROW rowPtr = row.data();
+    jpeg_write_scanlines(&cinfo, &rowPtr, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  Bytes jpeg(buffer, buffer + size);
+  free(buffer);
+  return jpeg;
+}
+
+static Bytes encodeWith(JpegEncoder &encoder, const Frame &f, int quality) {
+  JpegPixelFormat format = f.yuyv ? JPEG_PIXELS_YUYV : JPEG_PIXELS_GRAY;
+  Bytes out(JpegEncoder::maxOutputSize(f.width, f.height, format));
+  size_t len = 0;
+  encoder.setQuality(quality);
+  if (!encoder.encode(f.packed.data(), f.width, f.height, format, out.data(), out.size(), len)) return Bytes();
+  out.resize(len);
+  return out;
+}
+
+// PSNR of a decoded plane against the source over the region, in dB
+static double psnr(const Bytes &decoded, int decodedWidth, const Bytes &source, int sourceWidth,
+                   int x0, int y0, int width, int height) {
+  double sum = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int d = decoded[(size_t)y * decodedWidth + x] - source[(size_t)(y + y0) * sourceWidth + x + x0];
+      sum += d * d;
+    }
+  }
+  double mse = sum / ((double)width * height);
+  return mse == 0 ? 99.0 : 10 * log10(255.0 * 255.0 / mse);
+}
+
+static double lumaPsnr(const Decoded &d, const Frame &f) {
+  return psnr(d.planes[0], d.width, f.y, f.width, 0, 0, f.width, f.height);
+}
+
+// Chroma of the left pixel of each pair against the source sample
+static double chromaPsnr(const Decoded &d, const Frame &f, int c) {
+  Bytes left((size_t)(f.width / 2) * f.height);
+  for (int y = 0; y < f.height; y++) {
+    for (int x = 0; x < f.width / 2; x++) left[(size_t)y * (f.width / 2) + x] = d.planes[c][(size_t)y * d.width + x * 2];
+  }
+  return psnr(left, f.width / 2, c == 1 ? f.u : f.v, f.width / 2, 0, 0, f.width / 2, f.height);
+}
+
+// ---------------------------------------------------------------------------
+// Tests
+
+static void testQuantTables() {
+  testCase("DQT matches libjpeg's quality scaling");
+  JpegEncoder encoder;
+  Frame f = makeFrame(32, 16, true, 1);
+  int mismatches = 0;
+  for (int quality = 1; quality <= 100; quality++) {
+    Bytes jpeg = encodeWith(encoder, f, quality);
+    Decoded ours = decode(jpeg.data(), jpeg.size());
+    Bytes reference = libjpegEncode(f, quality);
+    Decoded theirs = decode(reference.data(), reference.size());
+    if (!ours.ok || !theirs.ok || memcmp(ours.quant, theirs.quant, sizeof(ours.quant))) mismatches++;
+  }
+  CHECK_EQ(mismatches, 0);
+  CHECK_EQ(encoder.quality(), 100);
+  encoder.setQuality(0);
+  CHECK_EQ(encoder.quality(), 1);
+  encoder.setQuality(200);
+  CHECK_EQ(encoder.quality(), 100);
+}
+
+static void testPsnr() {
+  testCase("PSNR against libjpeg at the same quality");
+  static const int QUALITIES[] = {10, 25, 50, 65, 80, 90, 95, 100};
+  JpegEncoder encoder;
+  for (int yuyv = 0; yuyv < 2; yuyv++) {
+    Frame f = makeFrame(320, 240, yuyv, 5);
+    double previous = 0;
+    int worse = 0, larger = 0, clean = 0, monotonic = 0;
+    for (size_t i = 0; i < sizeof(QUALITIES) / sizeof(QUALITIES[0]); i++) {
+      int q = QUALITIES[i];
+      Bytes ours = encodeWith(encoder, f, q);
+      Bytes theirs = libjpegEncode(f, q);
+      Decoded a = decode(ours.data(), ours.size());
+      Decoded b = decode(theirs.data(), theirs.size());
+      if (!a.ok || a.warnings || a.width != f.width || a.height != f.height || a.components != (yuyv ? 3 : 1)) continue;
+      clean++;
+      double pa = lumaPsnr(a, f), pb = lumaPsnr(b, f);
+      printf("  %-4s q%-3d  Y %5.2f dB (libjpeg %5.2f)", yuyv ? "YUYV" : "gray", q, pa, pb);
+      if (yuyv) {
+        double ua = chromaPsnr(a, f, 1), va = chromaPsnr(a, f, 2);
+        double ub = chromaPsnr(b, f, 1), vb = chromaPsnr(b, f, 2);
+        printf("  Cb %5.2f (%5.2f)  Cr %5.2f (%5.2f)", ua, ub, va, vb);
+        if (ua < ub - 0.3 || va < vb - 0.3) worse++;
+      }
+      printf("  %6zu bytes (libjpeg %6zu)\n", ours.size(), theirs.size());
+      if (pa < pb - 0.3) worse++;
+      if (ours.size() > theirs.size() + theirs.size() / 20 + 64) larger++;
+      if (pa >= previous) monotonic++;
+      previous = pa;
+      // Absolute floors for this test card
+      if (q >= 50) CHECK(pa > 32);
+      if (q >= 90) CHECK(pa > 38);
+    }
+    CHECK_EQ(clean, 8);
+    CHECK_EQ(worse, 0);
+    CHECK_EQ(larger, 0);
+    CHECK_EQ(monotonic, 8);
+  }
+}
+
+static void testRegions() {
+  testCase("regions, strides and odd sizes");
+  JpegEncoder encoder;
+  encoder.setQuality(95);
+  int bad = 0;
+  for (int yuyv = 0; yuyv < 2; yuyv++) {
+    Frame f = makeFrame(yuyv ? 124 : 123, 77, yuyv, 9);
+    JpegPixelFormat format = yuyv ? JPEG_PIXELS_YUYV : JPEG_PIXELS_GRAY;
+    // The same frame inside wider rows, as a region of a larger buffer
+    size_t stride = f.stride() + 36;
+    Bytes padded(stride * f.height, 0xAA);
+    for (int y = 0; y < f.height; y++) memcpy(&padded[y * stride], &f.packed[y * f.stride()], f.stride());
+
+    rngState = 17 + yuyv;
+    for (int k = 0; k < 60; k++) {
+      JpegCropRect region = {(uint16_t)(rnd() % f.width), (uint16_t)(rnd() % f.height),
+                             (uint16_t)(rnd() % 80), (uint16_t)(rnd() % 80)};
+      if (k == 0) region = {0, 0, (uint16_t)f.width, (uint16_t)f.height};
+      if (k == 1) region = {(uint16_t)(f.width - 1), (uint16_t)(f.height - 1), 9, 9};
+      Bytes out(JpegEncoder::maxOutputSize(f.width, f.height, format));
+      size_t len = 0;
+      if (!encoder.encode(padded.data(), f.width, f.height, stride, format, region, out.data(), out.size(), len)) {
+        bad++;
+        continue;
+      }
+      const JpegCropRect &got = encoder.lastRegion();
+      uint32_t right = region.x + (region.width ? region.width : 1);
+      uint32_t bottom = region.y + (region.height ? region.height : 1);
+      if (right > (uint32_t)f.width) right = f.width;
+      if (bottom > (uint32_t)f.height) bottom = f.height;
+      bool expected = got.x == (yuyv ? region.x & ~1 : region.x) && got.y == region.y &&
+                      got.x + got.width == right && got.y + got.height == bottom;
+      Decoded d = decode(out.data(), len);
+      if (!expected || !d.ok || d.warnings || d.width != got.width || d.height != got.height) {
+        fprintf(stderr, "region %u,%u %ux%u: encoded %u,%u %ux%u\n", region.x, region.y, region.width,
+                region.height, got.x, got.y, got.width, got.height);
+        bad++;
+        continue;
+      }
+      // Close to the source pixels it was cut from, not the padding beside them
+      double p = psnr(d.planes[0], d.width, f.y, f.width, got.x, got.y, got.width, got.height);
+      if (p < 34) {
+        fprintf(stderr, "region %u,%u %ux%u: Y PSNR %.1f dB\n", got.x, got.y, got.width, got.height, p);
+        bad++;
+      }
+    }
+  }
+  CHECK_EQ(bad, 0);
+}
+
+static void testFlatAndTiny() {
+  testCase("flat frames and tiny sizes");
+  JpegEncoder encoder;
+  int off = 0;
+  for (int value = 0; value < 256; value += 15) {
+    for (int yuyv = 0; yuyv < 2; yuyv++) {
+      Frame f = makeFrame(40, 24, yuyv, 1);
+      for (size_t i = 0; i < f.packed.size(); i++) f.packed[i] = (uint8_t)(yuyv && (i & 1) ? 255 - value : value);
+      Bytes jpeg = encodeWith(encoder, f, 50);
+      Decoded d = decode(jpeg.data(), jpeg.size());
+      if (!d.ok) {
+        off++;
+        continue;
+      }
+      for (size_t i = 0; i < d.planes[0].size(); i++) {
+        if (abs(d.planes[0][i] - value) > 1 || (yuyv && abs(d.planes[1][i] - (255 - value)) > 1)) {
+          off++;
+          break;
+        }
+      }
+    }
+  }
+  CHECK_EQ(off, 0);
+
+  static const int SIZES[][2] = {{1, 1}, {2, 1}, {1, 9}, {2, 9}, {3, 3}, {7, 8}, {8, 8}, {9, 9}, {16, 8},
+                                 {17, 1}, {18, 1}};
+  int broken = 0;
+  for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+    for (int yuyv = 0; yuyv < 2; yuyv++) {
+      if (yuyv && (SIZES[s][0] & 1)) continue;
+      Frame f = makeFrame(SIZES[s][0], SIZES[s][1], yuyv, 3);
+      Bytes jpeg = encodeWith(encoder, f, 90);
+      Decoded d = decode(jpeg.data(), jpeg.size());
+      if (!d.ok || d.warnings || d.width != f.width || d.height != f.height || lumaPsnr(d, f) < 30) broken++;
+    }
+  }
+  CHECK_EQ(broken, 0);
+}
+
+static void testLimits() {
+  testCase("buffer limits and errors");
+  JpegEncoder encoder;
+  encoder.setQuality(100);
+  // maxOutputSize() covers real frames at quality 100
+  Frame photo = makeFrame(320, 240, true, 8);
+  size_t capacity = JpegEncoder::maxOutputSize(320, 240, JPEG_PIXELS_YUYV);
+  Bytes out(capacity);
+  size_t len = 0;
+  CHECK(encoder.encode(photo.packed.data(), 320, 240, JPEG_PIXELS_YUYV, out.data(), out.size(), len));
+  CHECK(len <= capacity);
+
+  // Pure noise is larger than the raw frame: the encoder stops at the end of
+  // any buffer that is too short instead of writing past it
+  Frame f = makeFrame(64, 32, true, 4);
+  for (size_t i = 0; i < f.packed.size(); i++) f.packed[i] = (uint8_t)rnd();
+  Bytes big(8 * f.packed.size() + 4096);
+  CHECK(encoder.encode(f.packed.data(), 64, 32, JPEG_PIXELS_YUYV, big.data(), big.size(), len));
+  Decoded d = decode(big.data(), len);
+  CHECK(d.ok && d.warnings == 0);
+  size_t noiseLen = len;
+  int overruns = 0, failures = 0;
+  for (size_t size = 600; size < noiseLen + 2000; size += 97) {
+    Bytes exact(size + 64, 0x5A);
+    size_t got = 1;
+    if (!encoder.encode(f.packed.data(), 64, 32, JPEG_PIXELS_YUYV, exact.data(), size, got)) {
+      failures++;
+      if (got != 0) overruns++;
+    }
+    for (size_t i = size; i < exact.size(); i++) {
+      if (exact[i] != 0x5A) {
+        overruns++;
+        break;
+      }
+    }
+  }
+  CHECK_EQ(overruns, 0);
+  CHECK(failures > 0);
+  len = noiseLen;
+  CHECK(!encoder.encode(f.packed.data(), 64, 32, JPEG_PIXELS_YUYV, out.data(), len / 2, len));
+  CHECK(encoder.error() && strcmp(encoder.error(), "Output buffer too small") == 0);
+
+  JpegCropRect outside = {64, 0, 8, 8};
+  CHECK(!encoder.encode(f.packed.data(), 64, 32, f.stride(), JPEG_PIXELS_YUYV, outside, out.data(), out.size(), len));
+  CHECK(encoder.error() && strcmp(encoder.error(), "Region outside the image") == 0);
+  CHECK(!encoder.encode(f.packed.data(), 63, 32, JPEG_PIXELS_YUYV, out.data(), out.size(), len));
+  CHECK(encoder.error() && strcmp(encoder.error(), "YUYV width must be even") == 0);
+  CHECK(!encoder.encode(NULL, 64, 32, JPEG_PIXELS_YUYV, out.data(), out.size(), len));
+  CHECK(!encoder.encode(f.packed.data(), 0, 32, JPEG_PIXELS_YUYV, out.data(), out.size(), len));
+  CHECK(encoder.error() && strcmp(encoder.error(), "Empty frame") == 0);
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark
+
+static double seconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename Encode>
+static double framesPerSecond(Encode encode) {
+  int frames = 0;
+  double start = seconds(), elapsed = 0;
+  while (elapsed < 0.3) {
+    encode();
+    frames++;
+    elapsed = seconds() - start;
+  }
+  return frames / elapsed;
+}
+
+struct OurEncode {
+  JpegEncoder *encoder;
+  const Frame *frame;
+  Bytes *out;
+  void operator()() const {
+    size_t len;
+    encoder->encode(frame->packed.data(), frame->width, frame->height,
+                    frame->yuyv ? JPEG_PIXELS_YUYV : JPEG_PIXELS_GRAY, out->data(), out->size(), len);
+  }
+};
+
+struct LibjpegEncode {
+  const Frame *frame;
+  int quality;
+  J_DCT_METHOD method;
+  void operator()() const { libjpegEncode(*frame, quality, method); }
+};
+
+static void benchmark() {
+  testCase("benchmark, VGA q80 (host CPU, not the ESP32)");
+  JpegEncoder encoder;
+  encoder.setQuality(80);
+  for (int yuyv = 0; yuyv < 2; yuyv++) {
+    Frame f = makeFrame(640, 480, yuyv, 21);
+    Bytes out(JpegEncoder::maxOutputSize(640, 480, yuyv ? JPEG_PIXELS_YUYV : JPEG_PIXELS_GRAY));
+    OurEncode ours = {&encoder, &f, &out};
+    LibjpegEncode fast = {&f, 80, JDCT_IFAST};
+    LibjpegEncode slow = {&f, 80, JDCT_ISLOW};
+    printf("  %-4s  JpegEncoder %6.0f fps   libjpeg ifast %6.0f fps   islow %6.0f fps\n", yuyv ? "YUYV" : "gray",
+           framesPerSecond(ours), framesPerSecond(fast), framesPerSecond(slow));
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    benchmark();
+    return 0;
+  }
+  testQuantTables();
+  testPsnr();
+  testRegions();
+  testFlatAndTiny();
+  testLimits();
+  benchmark();
+  return testSummary("test_jpeg_encoder");
+}
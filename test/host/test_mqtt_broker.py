@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+"""
+Runs the MQTT codec and queue against a real broker on loopback.
+
+  test_mqtt_broker.py BUILD_DIR
+
+The broker is MQTT_BROKER (host:port) when set; otherwise a mosquitto on
+the PATH is started on a free loopback port for the run. With neither the
+test is skipped (exit 0), so `make check` passes on machines without one:
+
+  MQTT_BROKER=127.0.0.1:1883 python3 test/host/test_mqtt_broker.py test/host/build
+
+A subscriber written here (raw sockets, no client library) listens on
+<base>/#, then BUILD_DIR/mqtt_loopback publishes a backlog of events at
+qos 0 and 1. Checks that every event arrives once and in order, as JSON
+arrays of at most 16 events on the right topic, that the retained status
+reads "online" to a late subscriber, and that the will is not sent after
+a clean disconnect.
+"""
+
+import json
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+COUNT = 500
+BATCH_MESSAGES = 16
+
+failures = 0
+
+
+def check(condition, what):
+    global failures
+    if condition:
+        print("  ok   %s" % what)
+    else:
+        print("  FAIL %s" % what)
+        failures += 1
+
+
+def encode_length(n):
+    out = bytearray()
+    while True:
+        digit = n % 128
+        n //= 128
+        out.append(digit | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def string(text):
+    data = text.encode()
+    return struct.pack(">H", len(data)) + data
+
+
+class Subscriber:
+    """Minimal MQTT 3.1.1 client: CONNECT, SUBSCRIBE, receive PUBLISH."""
+
+    def __init__(self, host, port, client_id, topic):
+        self.sock = socket.create_connection((host, port), timeout=5)
+        self.buffer = b""
+        body = string("MQTT") + bytes([4, 0x02]) + struct.pack(">H", 30) + string(client_id)
+        self.sock.sendall(bytes([0x10]) + encode_length(len(body)) + body)
+        kind, _, payload = self.packet()
+        if kind != 2 or payload[1] != 0:
+            raise RuntimeError("broker refused the subscriber")
+        body = struct.pack(">H", 1) + string(topic) + bytes([1])
+        self.sock.sendall(bytes([0x82]) + encode_length(len(body)) + body)
+        kind, _, payload = self.packet()
+        if kind != 9 or payload[2] > 1:
+            raise RuntimeError("subscription refused")
+
+    def read(self, n):
+        while len(self.buffer) < n:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise EOFError
+            self.buffer += chunk
+        data, self.buffer = self.buffer[:n], self.buffer[n:]
+        return data
+
+    def packet(self):
+        first = self.read(1)[0]
+        length, shift = 0, 0
+        while True:
+            digit = self.read(1)[0]
+            length |= (digit & 0x7F) << shift
+            shift += 7
+            if not digit & 0x80:
+                break
+        return first >> 4, first & 0x0F, self.read(length)
+
+    def publishes(self, timeout):
+        """Yields (topic, payload, retained) until nothing arrives for timeout s."""
+        self.sock.settimeout(timeout)
+        while True:
+            try:
+                kind, flags, body = self.packet()
+            except (socket.timeout, EOFError):
+                return
+            if kind != 3:
+                continue
+            topic_len = struct.unpack(">H", body[:2])[0]
+            topic = body[2:2 + topic_len].decode()
+            pos = 2 + topic_len
+            qos = (flags >> 1) & 3
+            if qos:
+                packet_id = body[pos:pos + 2]
+                pos += 2
+                self.sock.sendall(bytes([0x40, 2]) + packet_id)
+            yield topic, body[pos:], bool(flags & 1)
+
+    def close(self):
+        self.sock.sendall(bytes([0xE0, 0]))
+        self.sock.close()
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def start_mosquitto(tmp):
+    """Starts mosquitto on a free loopback port; returns (process, port)."""
+    port = free_port()
+    config = os.path.join(tmp, "mosquitto.conf")
+    with open(config, "w") as f:
+        f.write("listener %d 127.0.0.1\nallow_anonymous true\npersistence false\n" % port)
+    process = subprocess.Popen(["mosquitto", "-c", config], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    for _ in range(50):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return process, port
+        except OSError:
+            time.sleep(0.1)
+    process.kill()
+    raise RuntimeError("mosquitto did not start")
+
+
+def run(tool, host, port, qos):
+    base = "test/loopback-%d-%d" % (os.getpid(), qos)
+    subscriber = Subscriber(host, port, "loopback-sub-%d" % qos, base + "/#")
+    result = subprocess.run([tool, host, str(port), base, str(COUNT), str(qos)], capture_output=True, text=True)
+    check(result.returncode == 0, "qos %d: mqtt_loopback %s" % (qos, (result.stdout + result.stderr).strip()))
+
+    events, packets, bad = [], 0, 0
+    for topic, payload, _ in subscriber.publishes(2):
+        if topic == base + "/status":
+            continue
+        packets += 1
+        try:
+            batch = json.loads(payload)
+        except ValueError:
+            bad += 1
+            continue
+        if not isinstance(batch, list) or not 1 <= len(batch) <= BATCH_MESSAGES:
+            bad += 1
+            continue
+        for event in batch:
+            expected = base + ("/tracks" if event["event"] == "track_start" else "/detections")
+            bad += topic != expected
+            events.append(event["n"])
+    subscriber.close()
+    check(bad == 0, "qos %d: every packet is a JSON array of 1..%d events on its topic" % (qos, BATCH_MESSAGES))
+    check(events == list(range(COUNT)), "qos %d: %d events arrive once and in order" % (qos, COUNT))
+    check(packets < COUNT // 4, "qos %d: batched into %d packets" % (qos, packets))
+
+    # A late subscriber sees the retained status; the clean disconnect sent
+    # no will
+    late = Subscriber(host, port, "loopback-late-%d" % qos, base + "/status")
+    status = [(payload, retained) for _, payload, retained in late.publishes(1)]
+    late.close()
+    check(status == [(b"online", True)], "qos %d: retained status is online" % qos)
+
+    # Clear the retained message
+    cleaner = Subscriber(host, port, "loopback-clean-%d" % qos, base + "/none")
+    topic = string(base + "/status")
+    cleaner.sock.sendall(bytes([0x31]) + encode_length(len(topic)) + topic)
+    cleaner.close()
+
+
+def main():
+    tool = os.path.join(sys.argv[1] if len(sys.argv) > 1 else "build", "mqtt_loopback")
+    broker = os.environ.get("MQTT_BROKER")
+    with tempfile.TemporaryDirectory() as tmp:
+        process = None
+        if broker:
+            host, _, port = broker.rpartition(":")
+            port = int(port)
+        elif shutil.which("mosquitto"):
+            process, port = start_mosquitto(tmp)
+            host = "127.0.0.1"
+        else:
+            print("  skipped: no broker (set MQTT_BROKER=host:port or install mosquitto)")
+            return
+        print("broker %s:%d" % (host, port))
+        try:
+            for qos in (0, 1):
+                run(tool, host, port, qos)
+        finally:
+            if process:
+                process.terminate()
+                process.wait()
+
+    if failures:
+        print("%d check(s) failed" % failures)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,348 @@
+/**
+ * MQTT codec host test
+ *
+ * Checks src/mqtt_codec.cpp against packets written out by hand from the
+ * MQTT 3.1.1 specification: CONNECT with and without will and login,
+ * PUBLISH at qos 0 and 1, every remaining-length size class at its edges,
+ * and the capacity checks (a buffer one byte short is refused and left
+ * untouched). The parser is fed broker replies one byte at a time, mixed
+ * with packets whose bodies it skips, and random streams split anywhere.
+ */
+
+#include "mqtt_codec.h"
+#include "test.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+static uint32_t rngState = 0x2545F491;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static bool sameBytes(const uint8_t *actual, size_t actualLen, const uint8_t *expected, size_t expectedLen) {
+  if (actualLen != expectedLen) {
+    fprintf(stderr, "    length %zu, expected %zu\n", actualLen, expectedLen);
+    return false;
+  }
+  for (size_t i = 0; i < expectedLen; i++) {
+    if (actual[i] != expected[i]) {
+      fprintf(stderr, "    byte %zu is %02X, expected %02X\n", i, actual[i], expected[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static MqttConnectOptions connectOptions(const char *clientId) {
+  MqttConnectOptions options;
+  memset(&options, 0, sizeof(options));
+  options.clientId = clientId;
+  options.keepAliveS = 60;
+  options.cleanSession = true;
+  return options;
+}
+
+static void testConnect() {
+  testCase("connect");
+  uint8_t out[256];
+
+  MqttConnectOptions options = connectOptions("cam1");
+  static const uint8_t plain[] = {
+    0x10, 16, 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 60, 0, 4, 'c', 'a', 'm', '1'
+  };
+  CHECK(sameBytes(out, mqttEncodeConnect(out, sizeof(out), options), plain, sizeof(plain)));
+
+  // Will (qos 1, retained) and login: every flag but the reserved bit
+  options.keepAliveS = 0x1234;
+  options.willTopic = "c/s";
+  options.willMessage = "off";
+  options.willQos = 1;
+  options.willRetain = true;
+  options.username = "u";
+  options.password = "pw";
+  static const uint8_t full[] = {
+    0x10, 33, 0, 4, 'M', 'Q', 'T', 'T', 4, 0xEE, 0x12, 0x34, 0, 4, 'c', 'a', 'm', '1',
+    0, 3, 'c', '/', 's', 0, 3, 'o', 'f', 'f', 0, 1, 'u', 0, 2, 'p', 'w'
+  };
+  CHECK(sameBytes(out, mqttEncodeConnect(out, sizeof(out), options), full, sizeof(full)));
+
+  // Persistent session, will without a message, user with an empty password
+  options.cleanSession = false;
+  options.keepAliveS = 60;
+  options.willMessage = NULL;
+  options.willQos = 0;
+  options.willRetain = false;
+  options.password = "";
+  static const uint8_t partial[] = {
+    0x10, 28, 0, 4, 'M', 'Q', 'T', 'T', 4, 0xC4, 0, 60, 0, 4, 'c', 'a', 'm', '1',
+    0, 3, 'c', '/', 's', 0, 0, 0, 1, 'u', 0, 0
+  };
+  CHECK(sameBytes(out, mqttEncodeConnect(out, sizeof(out), options), partial, sizeof(partial)));
+
+  // A password without a user name is not sent (the protocol forbids it),
+  // and empty strings count as absent
+  options = connectOptions("cam1");
+  options.username = "";
+  options.password = "pw";
+  options.willTopic = "";
+  options.willMessage = "off";
+  CHECK(sameBytes(out, mqttEncodeConnect(out, sizeof(out), options), plain, sizeof(plain)));
+
+  // Capacity: one byte short is refused without writing
+  options = connectOptions("cam1");
+  memset(out, 0xA5, sizeof(out));
+  CHECK_EQ(mqttEncodeConnect(out, sizeof(plain) - 1, options), 0);
+  bool untouched = true;
+  for (size_t i = 0; i < sizeof(out); i++) untouched = untouched && out[i] == 0xA5;
+  CHECK(untouched);
+  CHECK_EQ(mqttEncodeConnect(out, sizeof(plain), options), sizeof(plain));
+
+  // Strings longer than a 16-bit length
+  std::string longId(0x10000, 'x');
+  std::vector<uint8_t> big(0x10000 + 64);
+  options.clientId = longId.c_str();
+  CHECK_EQ(mqttEncodeConnect(big.data(), big.size(), options), 0);
+  longId.resize(0xFFFF);
+  options.clientId = longId.c_str();
+  size_t len = mqttEncodeConnect(big.data(), big.size(), options);
+  CHECK_EQ(len, 1 + 3 + 12 + 0xFFFF);
+  CHECK(len > 0 && big[14] == 0xFF && big[15] == 0xFF);
+}
+
+static void testPublish() {
+  testCase("publish");
+  uint8_t out[64];
+  const uint8_t *hi = (const uint8_t *)"hi";
+
+  static const uint8_t qos0[] = {0x30, 7, 0, 3, 'a', '/', 'b', 'h', 'i'};
+  CHECK(sameBytes(out, mqttEncodePublish(out, sizeof(out), "a/b", hi, 2, 0, false, false, 0), qos0, sizeof(qos0)));
+  CHECK_EQ(mqttPublishSize(3, 2, 0), sizeof(qos0));
+
+  // dup only applies to qos > 0; the packet id is not sent at qos 0
+  CHECK(sameBytes(out, mqttEncodePublish(out, sizeof(out), "a/b", hi, 2, 0, false, true, 7), qos0, sizeof(qos0)));
+
+  static const uint8_t qos1[] = {0x3B, 9, 0, 3, 'a', '/', 'b', 0x12, 0x34, 'h', 'i'};
+  CHECK(sameBytes(out, mqttEncodePublish(out, sizeof(out), "a/b", hi, 2, 1, true, true, 0x1234), qos1, sizeof(qos1)));
+  CHECK_EQ(mqttPublishSize(3, 2, 1), sizeof(qos1));
+
+  // A re-send sets dup in place
+  static const uint8_t retained[] = {0x33, 9, 0, 3, 'a', '/', 'b', 0, 1, 'h', 'i'};
+  size_t len = mqttEncodePublish(out, sizeof(out), "a/b", hi, 2, 1, true, false, 1);
+  CHECK(sameBytes(out, len, retained, sizeof(retained)));
+  mqttSetDup(out);
+  CHECK_EQ(out[0], 0x3B);
+
+  // Empty payload
+  static const uint8_t empty[] = {0x31, 5, 0, 3, 'a', '/', 'b'};
+  CHECK(sameBytes(out, mqttEncodePublish(out, sizeof(out), "a/b", NULL, 0, 0, true, false, 0), empty, sizeof(empty)));
+
+  // No topic, and a buffer one byte short
+  CHECK_EQ(mqttEncodePublish(out, sizeof(out), "", hi, 2, 0, false, false, 0), 0);
+  memset(out, 0xA5, sizeof(out));
+  CHECK_EQ(mqttEncodePublish(out, sizeof(qos1) - 1, "a/b", hi, 2, 1, false, false, 1), 0);
+  CHECK_EQ(out[0], 0xA5);
+  CHECK_EQ(mqttEncodePublish(out, 0, "a/b", hi, 2, 0, false, false, 0), 0);
+
+  // Above the protocol limit, whatever the buffer: refused before any write
+  uint8_t guard = 0xA5;
+  CHECK_EQ(mqttEncodePublish(&guard, (size_t)-1, "a", hi, MQTT_MAX_REMAINING - 2, 0, false, false, 0), 0);
+  CHECK_EQ(guard, 0xA5);
+}
+
+// Remaining length at the edges of each size class: the encoded digits
+// and the packet size reported by mqttPublishSize
+static void testRemainingLength() {
+  testCase("remaining length");
+  static const struct {
+    uint32_t remaining;
+    uint8_t digits[4];
+    size_t count;
+  } cases[] = {
+    {3, {0x03}, 1},
+    {127, {0x7F}, 1},
+    {128, {0x80, 0x01}, 2},
+    {16383, {0xFF, 0x7F}, 2},
+    {16384, {0x80, 0x80, 0x01}, 3},
+    {2097151, {0xFF, 0xFF, 0x7F}, 3},
+    {2097152, {0x80, 0x80, 0x80, 0x01}, 4},
+  };
+  std::vector<uint8_t> payload(2097152), out(2097152 + 8);
+  for (size_t i = 0; i < payload.size(); i++) payload[i] = (uint8_t)rnd();
+
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    size_t length = cases[c].remaining - 3;   // topic "t"
+    size_t expected = 1 + cases[c].count + cases[c].remaining;
+    CHECK_EQ(mqttPublishSize(1, length, 0), expected);
+    CHECK_EQ(mqttEncodePublish(out.data(), expected - 1, "t", payload.data(), length, 0, false, false, 0), 0);
+    size_t len = mqttEncodePublish(out.data(), out.size(), "t", payload.data(), length, 0, false, false, 0);
+    CHECK_EQ(len, expected);
+    CHECK(len == expected && memcmp(out.data() + 1, cases[c].digits, cases[c].count) == 0 &&
+          memcmp(out.data() + len - length, payload.data(), length) == 0);
+
+    // The parser reads the same length back
+    MqttParser parser;
+    MqttPacket packet;
+    size_t done = 0;
+    for (size_t i = 0; i < len; i++) {
+      if (parser.feed(out[i], packet)) done = i + 1;
+    }
+    CHECK_EQ(done, len);
+    CHECK_EQ(packet.type, MQTT_PACKET_PUBLISH);
+    CHECK_EQ(packet.length, cases[c].remaining);
+  }
+  CHECK_EQ(mqttPublishSize(1, MQTT_MAX_REMAINING - 3, 0), 1 + 4 + MQTT_MAX_REMAINING);
+}
+
+static void testPingDisconnect() {
+  testCase("pingreq, disconnect");
+  uint8_t out[4] = {0, 0, 0xA5, 0xA5};
+  CHECK_EQ(mqttEncodePingReq(out, 1), 0);
+  CHECK_EQ(mqttEncodePingReq(out, sizeof(out)), 2);
+  CHECK(out[0] == 0xC0 && out[1] == 0 && out[2] == 0xA5);
+  CHECK_EQ(mqttEncodeDisconnect(out, 1), 0);
+  CHECK_EQ(mqttEncodeDisconnect(out, sizeof(out)), 2);
+  CHECK(out[0] == 0xE0 && out[1] == 0 && out[2] == 0xA5);
+}
+
+// Feeds bytes one at a time; collects the packets completed
+static std::vector<MqttPacket> feedAll(MqttParser &parser, const std::vector<uint8_t> &stream) {
+  std::vector<MqttPacket> packets;
+  MqttPacket packet;
+  for (size_t i = 0; i < stream.size(); i++) {
+    if (parser.feed(stream[i], packet)) packets.push_back(packet);
+  }
+  return packets;
+}
+
+static void append(std::vector<uint8_t> &stream, const uint8_t *bytes, size_t len) {
+  stream.insert(stream.end(), bytes, bytes + len);
+}
+
+static void testParser() {
+  testCase("parser");
+  static const uint8_t connack[] = {0x20, 2, 0x01, 0x00};
+  static const uint8_t refused[] = {0x20, 2, 0x00, 0x05};
+  static const uint8_t puback[] = {0x40, 2, 0xAB, 0xCD};
+  static const uint8_t pingresp[] = {0xD0, 0};
+  static const uint8_t suback[] = {0x90, 3, 0x00, 0x01, 0x01};
+
+  std::vector<uint8_t> stream;
+  append(stream, connack, sizeof(connack));
+  append(stream, suback, sizeof(suback));
+  // An incoming PUBLISH with a two-byte length: its body is skipped
+  std::vector<uint8_t> publish(1 + 2 + 300), body(295, 0x20);
+  size_t len = mqttEncodePublish(publish.data(), publish.size(), "cmd", body.data(), body.size(), 0, false, false, 0);
+  CHECK_EQ(len, publish.size());
+  stream.insert(stream.end(), publish.begin(), publish.end());
+  append(stream, puback, sizeof(puback));
+  append(stream, pingresp, sizeof(pingresp));
+  append(stream, refused, sizeof(refused));
+
+  MqttParser parser;
+  std::vector<MqttPacket> packets = feedAll(parser, stream);
+  CHECK_EQ(packets.size(), 6);
+  if (packets.size() == 6) {
+    CHECK_EQ(packets[0].type, MQTT_PACKET_CONNACK);
+    CHECK(packets[0].sessionPresent);
+    CHECK_EQ(packets[0].returnCode, 0);
+    CHECK_EQ(packets[1].type, 9);
+    CHECK_EQ(packets[1].length, 3);
+    CHECK_EQ(packets[2].type, MQTT_PACKET_PUBLISH);
+    CHECK_EQ(packets[2].length, 300);
+    CHECK_EQ(packets[2].packetId, 0);
+    CHECK_EQ(packets[3].type, MQTT_PACKET_PUBACK);
+    CHECK_EQ(packets[3].packetId, 0xABCD);
+    CHECK_EQ(packets[4].type, MQTT_PACKET_PINGRESP);
+    CHECK_EQ(packets[4].length, 0);
+    CHECK_EQ(packets[5].type, MQTT_PACKET_CONNACK);
+    CHECK(!packets[5].sessionPresent);
+    CHECK_EQ(packets[5].returnCode, 5);
+  }
+  CHECK(!parser.failed());
+
+  // Four length digits are the most the protocol allows
+  static const uint8_t longest[] = {0x30, 0xFF, 0xFF, 0xFF, 0x7F};
+  MqttPacket packet;
+  parser.reset();
+  for (size_t i = 0; i < sizeof(longest); i++) CHECK(!parser.feed(longest[i], packet));
+  CHECK(!parser.failed());
+
+  static const uint8_t tooLong[] = {0x30, 0x80, 0x80, 0x80, 0x80, 0x01};
+  parser.reset();
+  for (size_t i = 0; i < sizeof(tooLong); i++) CHECK(!parser.feed(tooLong[i], packet));
+  CHECK(parser.failed());
+  CHECK(!parser.feed(pingresp[0], packet) && !parser.feed(pingresp[1], packet));
+  parser.reset();
+  CHECK(!parser.failed());
+  CHECK(!parser.feed(puback[0], packet) && !parser.feed(puback[1], packet) && !parser.feed(puback[2], packet));
+  CHECK(parser.feed(puback[3], packet));
+  CHECK_EQ(packet.packetId, 0xABCD);
+}
+
+// Random replies with random bodies, parsed as one stream: every packet
+// comes out with its type, flags and length
+static void testParserSweep() {
+  testCase("parser sweep");
+  int failures = 0;
+  for (int round = 0; round < 200; round++) {
+    std::vector<uint8_t> stream;
+    std::vector<MqttPacket> expected;
+    int count = 1 + rnd() % 20;
+    for (int p = 0; p < count; p++) {
+      MqttPacket packet;
+      memset(&packet, 0, sizeof(packet));
+      packet.type = (uint8_t)(1 + rnd() % 14);
+      packet.flags = (uint8_t)(rnd() & 0x0F);
+      uint32_t sizes[] = {0, 1, 2, 3, 127, 128, 200, 16383, 16384, 20000};
+      packet.length = (rnd() & 1) ? sizes[rnd() % 10] : rnd() % 64;
+      stream.push_back((uint8_t)(packet.type << 4 | packet.flags));
+      uint32_t remaining = packet.length;
+      do {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        stream.push_back(remaining ? (uint8_t)(digit | 0x80) : digit);
+      } while (remaining);
+      size_t body = stream.size();
+      for (uint32_t i = 0; i < packet.length; i++) stream.push_back((uint8_t)rnd());
+      if (packet.length >= 2 && packet.type == MQTT_PACKET_CONNACK) {
+        packet.sessionPresent = stream[body] & 1;
+        packet.returnCode = stream[body + 1];
+      }
+      if (packet.length >= 2 && packet.type == MQTT_PACKET_PUBACK) {
+        packet.packetId = (uint16_t)(stream[body] << 8 | stream[body + 1]);
+      }
+      expected.push_back(packet);
+    }
+
+    MqttParser parser;
+    std::vector<MqttPacket> packets = feedAll(parser, stream);
+    bool same = packets.size() == expected.size() && !parser.failed();
+    for (size_t p = 0; same && p < packets.size(); p++) {
+      same = packets[p].type == expected[p].type && packets[p].flags == expected[p].flags &&
+             packets[p].length == expected[p].length && packets[p].packetId == expected[p].packetId &&
+             packets[p].returnCode == expected[p].returnCode &&
+             packets[p].sessionPresent == expected[p].sessionPresent;
+      if (!same && failures == 0) {
+        fprintf(stderr, "    round %d packet %zu: type %u length %u, expected type %u length %u\n", round, p,
+                packets[p].type, packets[p].length, expected[p].type, expected[p].length);
+      }
+    }
+    if (!same) failures++;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+int main() {
+  testConnect();
+  testPublish();
+  testRemainingLength();
+  testPingDisconnect();
+  testParser();
+  testParserSweep();
+  return testSummary("test_mqtt_codec");
+}
@@ -0,0 +1,530 @@
+/**
+ * MqttQueue host test
+ *
+ * Runs src/mqtt_queue.cpp over a spill file kept in memory, where a test
+ * can cut an append short, fail reads or reopen the queue the way begin()
+ * does after a reboot, and checks that every accepted message comes out
+ * of takeBatch() once, in order, grouped by topic, unless it was counted
+ * as dropped. Also checks the drain rate limiter.
+ */
+
+#include "mqtt_queue.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+class MemorySpill : public MqttSpillStorage {
+public:
+  std::vector<uint8_t> file;
+  uint32_t head;
+  bool hasHead;
+  size_t appendLimit;        // bytes the next append writes (tear), SIZE_MAX = all
+  bool readFails;
+  int clears;
+
+  MemorySpill() : head(0), hasHead(false), appendLimit((size_t)-1), readFails(false), clears(0) {}
+
+  uint32_t spillSize() override {
+    return (uint32_t)file.size();
+  }
+
+  size_t spillRead(uint32_t offset, uint8_t *dst, size_t len) override {
+    if (readFails || offset >= file.size()) return 0;
+    if (len > file.size() - offset) len = file.size() - offset;
+    memcpy(dst, file.data() + offset, len);
+    return len;
+  }
+
+  size_t spillAppend(const uint8_t *data, size_t len) override {
+    if (len > appendLimit) {
+      len = appendLimit;
+      appendLimit = (size_t)-1;
+    }
+    file.insert(file.end(), data, data + len);
+    return len;
+  }
+
+  void spillClear() override {
+    file.clear();
+    hasHead = false;
+    head = 0;
+    clears++;
+  }
+
+  uint32_t loadHead() override {
+    return hasHead ? head : 0;
+  }
+
+  bool saveHead(uint32_t offset) override {
+    head = offset;
+    hasHead = true;
+    return true;
+  }
+};
+
+static uint32_t rngState = 0x9E3779B9;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Message i: a JSON object with its number, padded to a length that
+// varies with it (1 + i % 3 entries of padding)
+static std::string event(uint32_t i) {
+  char text[MQTT_MAX_MESSAGE];
+  int len = snprintf(text, sizeof(text), "{\"n\":%u,\"pad\":\"%.*s\"}", i, (int)(i * 37 % 160),
+                     "................................................................................"
+                     "................................................................................");
+  return std::string(text, len);
+}
+
+static uint32_t recordSize(uint32_t i) {
+  return MQTT_SPILL_HEADER_SIZE + (uint32_t)event(i).size() + MQTT_SPILL_CRC_SIZE;
+}
+
+static bool push(MqttQueue &queue, uint8_t topic, uint32_t i) {
+  std::string text = event(i);
+  return queue.push(topic, text.data(), (uint16_t)text.size());
+}
+
+struct Taken {
+  uint8_t topic;
+  uint32_t n;
+};
+
+// Drains up to maxMessages per batch, splitting each JSON array back into
+// message numbers; checks that every batch is one well-formed array
+static std::vector<Taken> drain(MqttQueue &queue, uint16_t maxMessages = 16, size_t capacity = 1024,
+                                size_t limit = (size_t)-1) {
+  std::vector<Taken> taken;
+  std::vector<char> out(capacity);
+  while (taken.size() < limit) {
+    uint8_t topic = 0xFF;
+    uint16_t messages;
+    size_t len = queue.takeBatch(topic, out.data(), out.size(), maxMessages, messages);
+    if (messages == 0) {
+      CHECK_EQ(len, 0);
+      break;
+    }
+    std::string batch(out.data(), len);
+    CHECK(len >= 2 && batch[0] == '[' && batch[len - 1] == ']');
+    CHECK(messages <= maxMessages);
+    uint16_t found = 0;
+    size_t pos = 0;
+    while ((pos = batch.find("{\"n\":", pos)) != std::string::npos) {
+      Taken t = {topic, (uint32_t)strtoul(batch.c_str() + pos + 5, NULL, 10)};
+      CHECK(batch[pos - 1] == (found ? ',' : '['));
+      taken.push_back(t);
+      found++;
+      pos++;
+    }
+    CHECK_EQ(found, messages);
+  }
+  return taken;
+}
+
+// Taken messages are first..first+count-1, in order, on topic
+static bool inOrder(const std::vector<Taken> &taken, uint32_t first, uint32_t count, uint8_t topic = 0) {
+  if (taken.size() != count) {
+    fprintf(stderr, "    %zu messages, expected %u\n", taken.size(), count);
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (taken[i].n != first + i || taken[i].topic != topic) {
+      fprintf(stderr, "    message %u is %u (topic %u), expected %u\n", i, taken[i].n, taken[i].topic, first + i);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void testRam() {
+  testCase("ram only");
+  MqttQueue queue;
+  CHECK(queue.begin(NULL, 8, 0));
+  CHECK(queue.empty());
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.ramFull());
+  CHECK(!push(queue, 0, 8));
+  CHECK(!queue.spill());
+  CHECK_EQ(queue.stats().queued, 8);
+  CHECK_EQ(queue.stats().dropped, 1);
+
+  // Too long for a message
+  char big[MQTT_MAX_MESSAGE + 1];
+  memset(big, 'x', sizeof(big));
+  MqttQueue other;
+  CHECK(other.begin(NULL, 2, 0));
+  CHECK(!other.push(0, big, sizeof(big)));
+  CHECK(other.push(0, big, MQTT_MAX_MESSAGE));
+  CHECK_EQ(other.stats().dropped, 1);
+
+  // Batches of three, then the ring wraps around
+  CHECK(inOrder(drain(queue, 3, 1024, 3), 0, 3));
+  for (uint32_t i = 8; i < 11; i++) CHECK(push(queue, 0, i));
+  CHECK(inOrder(drain(queue, 3), 3, 8));
+  CHECK(queue.empty());
+  CHECK_EQ(queue.stats().taken, 11);
+}
+
+static void testBatches() {
+  testCase("batches");
+  MqttQueue queue;
+  CHECK(queue.begin(NULL, 32, 0));
+  // Topic runs 0 0 0 1 1 0: a batch never mixes topics
+  uint8_t topics[] = {0, 0, 0, 1, 1, 0};
+  for (uint32_t i = 0; i < 6; i++) CHECK(push(queue, topics[i], i));
+  char out[1024];
+  uint8_t topic;
+  uint16_t messages;
+  queue.takeBatch(topic, out, sizeof(out), 16, messages);
+  CHECK_EQ(messages, 3);
+  CHECK_EQ(topic, 0);
+  queue.takeBatch(topic, out, sizeof(out), 16, messages);
+  CHECK_EQ(messages, 2);
+  CHECK_EQ(topic, 1);
+  size_t len = queue.takeBatch(topic, out, sizeof(out), 16, messages);
+  CHECK_EQ(messages, 1);
+  CHECK_EQ(topic, 0);
+  std::string one = "[" + event(5) + "]";
+  CHECK(len == one.size() && memcmp(out, one.data(), len) == 0);
+
+  // A batch stops before the message that would not fit, and the smallest
+  // allowed buffer still takes one message at a time
+  for (uint32_t i = 0; i < 20; i++) CHECK(push(queue, 0, i));
+  std::string first = event(0), second = event(1);
+  len = queue.takeBatch(topic, out, first.size() + second.size() + 2, 16, messages);
+  CHECK_EQ(messages, 1);
+  CHECK_EQ(len, first.size() + 2);
+  len = queue.takeBatch(topic, out, second.size() + event(2).size() + 3, 16, messages);
+  CHECK_EQ(messages, 2);
+  CHECK_EQ(len, second.size() + event(2).size() + 3);
+  CHECK(inOrder(drain(queue, 16, MQTT_MAX_MESSAGE + 2), 3, 17));
+}
+
+static void testSpill() {
+  testCase("spill");
+  MemorySpill spill;
+  MqttQueue queue;
+  CHECK(queue.begin(&spill, 8, 64 * 1024));
+  uint32_t next = 0;
+  for (int round = 0; round < 5; round++) {
+    while (!queue.ramFull()) CHECK(push(queue, 0, next++));
+    CHECK(queue.spill());
+    CHECK_EQ(queue.ramMessages(), 0);
+  }
+  CHECK_EQ(queue.stats().spilled, 40);
+  CHECK_EQ(queue.spillBytes(), spill.file.size());
+  // RAM messages are newer than the file: the file drains first
+  for (int i = 0; i < 3; i++) CHECK(push(queue, 0, next++));
+  CHECK(inOrder(drain(queue), 0, 43));
+  CHECK(queue.empty());
+  // Read to the end: the file is deleted
+  CHECK(spill.file.empty());
+  CHECK_EQ(spill.clears, 1);
+
+  // Spilling more while the file is being read keeps the order
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, 100 + i));
+  CHECK(queue.spill());
+  std::vector<Taken> taken = drain(queue, 4, 1024, 4);
+  for (uint32_t i = 8; i < 16; i++) CHECK(push(queue, 0, 100 + i));
+  CHECK(queue.spill());
+  for (uint32_t i = 16; i < 20; i++) CHECK(push(queue, 0, 100 + i));
+  std::vector<Taken> rest = drain(queue, 4);
+  taken.insert(taken.end(), rest.begin(), rest.end());
+  CHECK(inOrder(taken, 100, 20));
+  CHECK_EQ(queue.stats().spillErrors, 0);
+}
+
+static void testLimit() {
+  testCase("spill limit");
+  MemorySpill spill;
+  MqttQueue queue;
+  // Room for about ten records
+  uint32_t limit = 0;
+  for (uint32_t i = 0; i < 10; i++) limit += recordSize(i);
+  CHECK(queue.begin(&spill, 8, limit));
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  for (uint32_t i = 8; i < 16; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  CHECK_EQ(queue.stats().spilled, 10);
+  CHECK_EQ(queue.ramMessages(), 6);
+  CHECK(queue.spillBytes() <= limit);
+  // Full file and ring: new messages are dropped, nothing is lost silently
+  CHECK(!queue.spill());
+  CHECK(push(queue, 0, 16) && push(queue, 0, 17));
+  CHECK(!push(queue, 0, 18));
+  CHECK_EQ(queue.stats().dropped, 1);
+  CHECK(inOrder(drain(queue), 0, 18));
+}
+
+static void testReboot() {
+  testCase("reboot");
+  MemorySpill spill;
+  {
+    MqttQueue queue;
+    CHECK(queue.begin(&spill, 8, 64 * 1024));
+    for (uint32_t i = 0; i < 24; i++) {
+      CHECK(push(queue, 0, i));
+      if (queue.ramFull()) CHECK(queue.spill());
+    }
+    // Five sent and synced, three more sent but not synced
+    CHECK(inOrder(drain(queue, 5, 1024, 5), 0, 5));
+    queue.sync();
+    CHECK(inOrder(drain(queue, 3, 1024, 3), 5, 3));
+  }
+  // The unsynced three are sent again; RAM messages were lost with the reset
+  {
+    MqttQueue queue;
+    CHECK(queue.begin(&spill, 8, 64 * 1024));
+    CHECK_EQ(queue.ramMessages(), 0);
+    CHECK(inOrder(drain(queue, 4, 1024, 8), 5, 8));
+    queue.sync();
+  }
+  {
+    MqttQueue queue;
+    CHECK(queue.begin(&spill, 8, 64 * 1024));
+    CHECK(inOrder(drain(queue), 13, 11));
+    CHECK(spill.file.empty());
+  }
+  // A saved position at the end of the file, or past it, is not trusted
+  // to mean "all sent" beyond what the file says: at the end the file goes
+  spill.file.assign(100, 0);
+  spill.saveHead(100);
+  {
+    MqttQueue queue;
+    CHECK(queue.begin(&spill, 8, 64 * 1024));
+    CHECK(queue.empty());
+    CHECK(spill.file.empty());
+  }
+}
+
+static void testDamage() {
+  testCase("damage");
+  // A reset during an append leaves a torn record: the file ends there
+  MemorySpill spill;
+  MqttQueue queue;
+  CHECK(queue.begin(&spill, 8, 64 * 1024));
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  for (uint32_t i = 8; i < 16; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  spill.file.resize(spill.file.size() - 7);
+  {
+    MqttQueue reopened;
+    CHECK(reopened.begin(&spill, 8, 64 * 1024));
+    CHECK(inOrder(drain(reopened), 0, 15));
+    CHECK_EQ(reopened.stats().spillErrors, 1);
+    CHECK(reopened.empty());
+    CHECK(spill.file.empty());
+  }
+
+  // A flipped byte: records before it are sent, the rest of the file goes
+  queue.end();
+  CHECK(queue.begin(&spill, 8, 64 * 1024));
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  uint32_t third = recordSize(0) + recordSize(1);
+  spill.file[third + MQTT_SPILL_HEADER_SIZE + 3] ^= 0x10;
+  CHECK(push(queue, 0, 50));
+  std::vector<Taken> taken = drain(queue);
+  CHECK(taken.size() == 3 && taken[0].n == 0 && taken[1].n == 1 && taken[2].n == 50);
+  CHECK_EQ(queue.stats().spillErrors, 1);
+
+  // Failed reads: nothing is taken or lost until the card answers again
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, 60 + i));
+  CHECK(queue.spill());
+  CHECK(push(queue, 0, 68));
+  spill.readFails = true;
+  CHECK_EQ(drain(queue).size(), 0);
+  CHECK(!queue.empty());
+  spill.readFails = false;
+  CHECK(inOrder(drain(queue), 60, 9));
+}
+
+// An append cut short without a reset (card full or failing): the records
+// written whole stay in the file, the rest in RAM, and nothing is appended
+// after the torn bytes until the file has been read out
+static void testShortWrite() {
+  testCase("short write");
+  MemorySpill spill;
+  MqttQueue queue;
+  CHECK(queue.begin(&spill, 8, 64 * 1024));
+  for (uint32_t i = 0; i < 8; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  for (uint32_t i = 8; i < 16; i++) CHECK(push(queue, 0, i));
+  spill.appendLimit = recordSize(8) + recordSize(9) + 10;
+  CHECK(queue.spill());
+  CHECK_EQ(queue.stats().spillErrors, 1);
+  CHECK_EQ(queue.stats().spilled, 10);
+  CHECK_EQ(queue.ramMessages(), 6);
+
+  // Sealed: a full ring drops instead of appending after the tear
+  CHECK(push(queue, 0, 16) && push(queue, 0, 17));
+  CHECK(!queue.spill());
+  CHECK(!push(queue, 0, 18));
+  CHECK(inOrder(drain(queue, 5, 1024, 5), 0, 5));
+  CHECK(inOrder(drain(queue), 5, 13));
+  CHECK_EQ(queue.stats().spillErrors, 1);
+  CHECK(spill.file.empty());
+
+  // Read out: the file is appended to again
+  for (uint32_t i = 20; i < 28; i++) CHECK(push(queue, 0, i));
+  CHECK(queue.spill());
+  CHECK(push(queue, 0, 28));
+  CHECK(inOrder(drain(queue), 20, 9));
+
+  // The same tear found after a reboot
+  for (uint32_t i = 30; i < 38; i++) CHECK(push(queue, 0, i));
+  spill.appendLimit = recordSize(30) + recordSize(31) + 10;
+  CHECK(queue.spill());
+  queue.end();
+  CHECK(queue.begin(&spill, 8, 64 * 1024));
+  CHECK_EQ(queue.stats().spillErrors, 3);
+  for (uint32_t i = 40; i < 48; i++) CHECK(push(queue, 0, i));
+  CHECK(!queue.spill());
+  std::vector<Taken> taken = drain(queue);
+  CHECK(taken.size() == 10 && taken[0].n == 30 && taken[1].n == 31 && taken[2].n == 40 && taken[9].n == 47);
+}
+
+// Random pushes, spills, takes, syncs, short appends and reboots. Every
+// accepted message comes out, in order, except the ones a reboot lost
+// with the RAM ring; a reboot may send the messages taken since the last
+// sync() again, and nothing else comes out twice.
+static void testSweep() {
+  testCase("random sweep");
+  int failures = 0;
+  for (int round = 0; round < 300; round++) {
+    MemorySpill spill;
+    MqttQueue *queue = new MqttQueue();
+    uint32_t limit = 2048 + rnd() % 16384;
+    queue->begin(&spill, (uint16_t)(2 + rnd() % 12), limit);
+    std::vector<uint8_t> seen;      // per message: 0 dropped, 1 accepted, 2 taken
+    int64_t last = -1;
+    uint32_t accepted = 0, acceptedSinceBoot = 0, lostToReset = 0, duplicates = 0;
+    bool ordered = true, counted = true, rebooted = false;
+    for (int step = 0; step < 400; step++) {
+      uint32_t action = rnd() % 100;
+      std::vector<Taken> taken;
+      if (action < 50) {
+        if (queue->ramFull() && (rnd() & 1)) queue->spill();
+        bool ok = push(*queue, (uint8_t)(rnd() % 100 < 90 ? 0 : 1), (uint32_t)seen.size());
+        seen.push_back(ok ? 1 : 0);
+        accepted += ok;
+        acceptedSinceBoot += ok;
+      } else if (action < 80) {
+        taken = drain(*queue, (uint16_t)(1 + rnd() % 16), MQTT_MAX_MESSAGE + 2 + rnd() % 2048, rnd() % 20);
+      } else if (action < 88) {
+        queue->spill();
+      } else if (action < 93) {
+        queue->sync();
+      } else if (action < 95) {
+        spill.appendLimit = rnd() % 600;
+      } else if (action < 97) {
+        // Reboot: the file is read again from the saved position, so the
+        // order check starts over
+        counted = counted && queue->stats().queued == acceptedSinceBoot;
+        lostToReset += queue->ramMessages();
+        delete queue;
+        queue = new MqttQueue();
+        queue->begin(&spill, (uint16_t)(2 + rnd() % 12), limit);
+        acceptedSinceBoot = 0;
+        last = -1;
+        rebooted = true;
+      }
+      if (step == 399) {
+        std::vector<Taken> rest = drain(*queue);
+        taken.insert(taken.end(), rest.begin(), rest.end());
+      }
+      for (size_t i = 0; i < taken.size(); i++) {
+        uint32_t n = taken[i].n;
+        if ((int64_t)n <= last || n >= seen.size() || seen[n] == 0) ordered = false;
+        last = n;
+        if (n < seen.size() && seen[n] == 2) duplicates++;
+        if (n < seen.size() && seen[n] == 1) seen[n] = 2;
+      }
+    }
+    uint32_t received = 0;
+    for (size_t i = 0; i < seen.size(); i++) received += seen[i] == 2;
+    counted = counted && queue->stats().queued == acceptedSinceBoot;
+    bool complete = received + lostToReset == accepted && (rebooted || duplicates == 0);
+    if (!ordered || !counted || !complete || !queue->empty()) {
+      if (failures == 0) {
+        fprintf(stderr, "    round %d: ordered %d, accepted %u, received %u, lost at reset %u, duplicates %u\n", round,
+                ordered, accepted, received, lostToReset, duplicates);
+      }
+      failures++;
+    }
+    delete queue;
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testRateLimiter() {
+  testCase("rate limiter");
+  MqttRateLimiter limiter;
+  limiter.configure(5);
+  CHECK_EQ(limiter.available(), 5);
+  limiter.consume(5);
+  CHECK_EQ(limiter.available(), 0);
+  CHECK_EQ(limiter.waitMs(), 200);
+  CHECK_EQ(limiter.waitMs(2), 400);
+  // More than a second's worth waits for a full bucket only
+  CHECK_EQ(limiter.waitMs(50), 1000);
+  limiter.refill(100);
+  CHECK_EQ(limiter.available(), 0);
+  CHECK_EQ(limiter.waitMs(), 100);
+  limiter.refill(500);
+  CHECK_EQ(limiter.available(), 2);
+  CHECK_EQ(limiter.waitMs(2), 0);
+  // A long pause refills at most one second's worth
+  limiter.refill(60000);
+  CHECK_EQ(limiter.available(), 5);
+  limiter.consume(7);
+  CHECK_EQ(limiter.available(), 0);
+  // millis() wraps around
+  limiter.refill(0xFFFFFF00u);
+  limiter.consume(5);
+  limiter.refill(0x100);
+  CHECK_EQ(limiter.available(), 2);
+  // A lower rate shrinks the bucket; zero means one per second
+  limiter.refill(0x100 + 2000);
+  limiter.configure(2);
+  CHECK_EQ(limiter.available(), 2);
+  limiter.configure(0);
+  CHECK_EQ(limiter.available(), 1);
+  limiter.consume(1);
+  CHECK_EQ(limiter.waitMs(), 1000);
+
+  // Sent over a simulated minute at 10 ms steps: never more than the rate
+  limiter.configure(20);
+  uint32_t sent = 0;
+  for (uint32_t now = 100000; now < 160000; now += 10) {
+    limiter.refill(now);
+    uint16_t n = limiter.available();
+    if (n) {
+      limiter.consume(n);
+      sent += n;
+    }
+  }
+  CHECK(sent >= 20 * 60 - 1 && sent <= 20 * 61);
+}
+
+int main() {
+  testRam();
+  testBatches();
+  testSpill();
+  testLimit();
+  testReboot();
+  testDamage();
+  testShortWrite();
+  testSweep();
+  testRateLimiter();
+  return testSummary("test_mqtt_queue");
+}
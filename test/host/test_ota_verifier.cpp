@@ -0,0 +1,259 @@
+/**
+ * OtaVerifier host test
+ *
+ * Runs synthetic images through src/ota_verifier.cpp in irregular chunks and
+ * checks the digest, what reaches the sink and the signature verdict for
+ * correct, truncated, corrupted and wrongly signed images. Built twice by
+ * the Makefile: without a key (signatures optional) and with TEST_SIGNED,
+ * where build/keys/ota_signing_key.h configures a P-256 public key and the
+ * images are signed in-process with libcrypto.
+ */
+
+#include "ota_verifier.h"
+#include "test.h"
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+typedef std::vector<uint8_t> Bytes;
+
+static Bytes makeImage(size_t size, uint32_t seed) {
+  Bytes image(size);
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245u + 12345u;
+    image[i] = (uint8_t)(seed >> 16);
+  }
+  if (size) image[0] = 0xE9;
+  return image;
+}
+
+static std::string sha256Hex(const Bytes &data) {
+  uint8_t digest[32];
+  unsigned int len = 0;
+  EVP_Digest(data.data(), data.size(), digest, &len, EVP_sha256(), NULL);
+  char hex[65];
+  for (int i = 0; i < 32; i++) snprintf(hex + i * 2, 3, "%02x", digest[i]);
+  return hex;
+}
+
+// Appends the trailer tools/ota_image.py writes: signature, u16 length, "OSIG"
+static Bytes sign(const Bytes &image, const char *keyPath) {
+  FILE *f = fopen(keyPath, "r");
+  EVP_PKEY *key = f ? PEM_read_PrivateKey(f, NULL, NULL, NULL) : NULL;
+  if (f) fclose(f);
+  if (!key) {
+    fprintf(stderr, "cannot read %s\n", keyPath);
+    exit(2);
+  }
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  size_t len = 0;
+  EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, key);
+  EVP_DigestSign(ctx, NULL, &len, image.data(), image.size());
+  Bytes signature(len);
+  EVP_DigestSign(ctx, signature.data(), &len, image.data(), image.size());
+  signature.resize(len);
+  EVP_MD_CTX_free(ctx);
+  EVP_PKEY_free(key);
+
+  Bytes out = image;
+  out.insert(out.end(), signature.begin(), signature.end());
+  out.push_back((uint8_t)len);
+  out.push_back((uint8_t)(len >> 8));
+  out.insert(out.end(), OTA_SIGNATURE_MAGIC, OTA_SIGNATURE_MAGIC + 4);
+  return out;
+}
+
+static bool collect(void *ctx, const uint8_t *data, size_t len) {
+  ((Bytes *)ctx)->insert(((Bytes *)ctx)->end(), data, data + len);
+  return true;
+}
+
+static bool refuse(void *ctx, const uint8_t *data, size_t len) {
+  (void)ctx; (void)data; (void)len;
+  return false;
+}
+
+struct Run {
+  bool ok;
+  Bytes sunk;
+  OtaVerifyResult result;
+  std::string error;
+};
+
+// Feeds the image in chunks of the given size (0 = a fixed irregular mix)
+static Run verify(const Bytes &image, const char *expected = NULL, size_t chunk = 0) {
+  static const size_t MIX[] = {1, 517, 1436, 3, 8192, 6, 4096, 1460, 2};
+  Run run;
+  OtaVerifier verifier;
+  run.ok = verifier.begin(collect, &run.sunk, expected);
+  size_t pos = 0;
+  for (size_t k = 0; run.ok && pos < image.size(); k++) {
+    size_t len = chunk ? chunk : MIX[k % (sizeof(MIX) / sizeof(MIX[0]))];
+    if (len > image.size() - pos) len = image.size() - pos;
+    run.ok = verifier.write(image.data() + pos, len);
+    pos += len;
+  }
+  run.ok = run.ok && verifier.finish();
+  run.result = verifier.result();
+  run.error = verifier.error() ? verifier.error() : "";
+  return run;
+}
+
+static void testDigest() {
+  testCase("digest and sink");
+  static const size_t SIZES[] = {0, 1, 5, 6, OTA_TRAILER_MAX, OTA_TRAILER_MAX + 1, 65536, 300001};
+  for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+    Bytes image = makeImage(SIZES[s], (uint32_t)s);
+    Run run = verify(image);
+    CHECK(run.ok || OtaVerifier::signingRequired());
+    CHECK(run.sunk == image);
+    CHECK_EQ(run.result.bytes, image.size());
+    CHECK(sha256Hex(image) == run.result.sha256);
+  }
+
+  // The same digest whatever the chunking
+  Bytes image = makeImage(100000, 7);
+  std::string digest = sha256Hex(image);
+  static const size_t CHUNKS[] = {1, 6, 518, 519, 8191, 100000};
+  for (size_t c = 0; c < sizeof(CHUNKS) / sizeof(CHUNKS[0]); c++) {
+    Run run = verify(image, NULL, CHUNKS[c]);
+    CHECK(digest == run.result.sha256);
+    CHECK(run.sunk == image);
+  }
+
+  CHECK_EQ(OtaVerifier::digestWord(digest.c_str(), 0), strtoul(digest.substr(0, 8).c_str(), NULL, 16));
+  CHECK_EQ(OtaVerifier::digestWord(digest.c_str(), 7), strtoul(digest.substr(56, 8).c_str(), NULL, 16));
+  CHECK_EQ(OtaVerifier::digestWord("abc", 0), 0);
+}
+
+static void testExpectedDigest() {
+  testCase("pinned sha256");
+  Bytes image = makeImage(50000, 11);
+#ifdef TEST_SIGNED
+  image = sign(image, TEST_KEY_DIR "/ota_key.pem");
+  std::string digest = sha256Hex(Bytes(image.begin(), image.end() - (image.size() - 50000)));
+#else
+  std::string digest = sha256Hex(image);
+#endif
+
+  Run run = verify(image, digest.c_str());
+  CHECK(run.ok);
+
+  std::string upper = digest;
+  for (size_t i = 0; i < upper.size(); i++) upper[i] = toupper(upper[i]);
+  CHECK(verify(image, upper.c_str()).ok);
+
+  std::string other = digest;
+  other[10] = other[10] == '0' ? '1' : '0';
+  run = verify(image, other.c_str());
+  CHECK(!run.ok);
+  CHECK(run.error == "SHA-256 mismatch");
+
+  OtaVerifier verifier;
+  CHECK(!verifier.begin(collect, NULL, "1234"));
+}
+
+static void testSinkFailure() {
+  testCase("sink failure");
+  Bytes image = makeImage(20000, 3);
+  OtaVerifier verifier;
+  CHECK(verifier.begin(refuse, NULL));
+  CHECK(!verifier.write(image.data(), image.size()));
+  CHECK(!verifier.finish());
+  CHECK(verifier.error() != NULL);
+}
+
+#ifdef TEST_SIGNED
+
+static void testSigned() {
+  testCase("signing key configured");
+  CHECK(OtaVerifier::signingRequired());
+  Bytes image = makeImage(200000, 21);
+  Bytes signedImage = sign(image, TEST_KEY_DIR "/ota_key.pem");
+
+  Run run = verify(signedImage);
+  CHECK(run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_VALID);
+  CHECK(run.sunk == image);
+  CHECK(sha256Hex(image) == run.result.sha256);
+
+  run = verify(image);
+  CHECK(!run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_MISSING);
+
+  // Truncated: the trailer is gone, or the payload is short under a valid trailer
+  run = verify(Bytes(signedImage.begin(), signedImage.end() - 100000));
+  CHECK(!run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_MISSING);
+  Bytes shortPayload(image.begin(), image.end() - 1000);
+  shortPayload.insert(shortPayload.end(), signedImage.begin() + image.size(), signedImage.end());
+  run = verify(shortPayload);
+  CHECK(!run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_INVALID);
+
+  // Corrupted: one payload bit, one signature byte, the length field
+  Bytes corrupt = signedImage;
+  corrupt[123456] ^= 0x01;
+  run = verify(corrupt);
+  CHECK(!run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_INVALID);
+  CHECK(run.error == "Invalid image signature");
+  corrupt = signedImage;
+  corrupt[image.size() + 10] ^= 0x40;
+  CHECK_EQ(verify(corrupt).result.signature, OTA_SIG_INVALID);
+  corrupt = signedImage;
+  corrupt[corrupt.size() - 6] ^= 0x01;
+  CHECK(!verify(corrupt).ok);
+
+  // Signed with another key
+  run = verify(sign(image, TEST_KEY_DIR "/other_key.pem"));
+  CHECK(!run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_INVALID);
+}
+
+#else
+
+static void testUnsigned() {
+  testCase("no signing key");
+  CHECK(!OtaVerifier::signingRequired());
+  Bytes image = makeImage(200000, 21);
+
+  Run run = verify(image);
+  CHECK(run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_NOT_REQUIRED);
+
+  // A trailer is still recognised and kept from the sink, but not checked
+  Bytes signedImage = sign(image, TEST_KEY_DIR "/ota_key.pem");
+  run = verify(signedImage);
+  CHECK(run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_UNCHECKED);
+  CHECK(run.sunk == image);
+  CHECK(sha256Hex(image) == run.result.sha256);
+
+  // Something that only looks like a trailer is image data
+  Bytes fake = image;
+  const uint8_t bogus[] = {0x00, 0x10, 'O', 'S', 'I', 'G'};  // length 4096 > OTA_SIGNATURE_MAX
+  fake.insert(fake.end(), bogus, bogus + sizeof(bogus));
+  run = verify(fake);
+  CHECK(run.ok);
+  CHECK_EQ(run.result.signature, OTA_SIG_NOT_REQUIRED);
+  CHECK(run.sunk == fake);
+}
+
+#endif
+
+int main() {
+  testDigest();
+  testExpectedDigest();
+  testSinkFailure();
+#ifdef TEST_SIGNED
+  testSigned();
+  return testSummary("test_ota_verifier_signed");
+#else
+  testUnsigned();
+  return testSummary("test_ota_verifier");
+#endif
+}
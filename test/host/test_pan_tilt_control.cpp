@@ -0,0 +1,509 @@
+/**
+ * PanTiltLoop host test
+ *
+ * Closes src/pan_tilt_control.cpp around a simulated mount: the servo
+ * follows the commanded angle after a dead time and a first-order lag, the
+ * camera sees a moving target through its field of view (perspective, with
+ * detection noise), and each detection reaches the loop an inference time
+ * after its frame was captured, at the model's frame rate. The loop ticks
+ * at 50 Hz, as on the device.
+ *
+ * Checks the steady tracking error on constant-speed, accelerating and
+ * weaving targets, step responses (no overshoot, speed and acceleration
+ * within their limits), that the camera's own motion is not taken for
+ * target motion, angle limits (braking before the stops), an inverted
+ * mount, losing the target (brake, then home), aim(), and measurements
+ * older than the history. One case runs the same scene with the capture
+ * times thrown away, to show the latency compensation is what keeps the
+ * error small.
+ */
+
+#include "pan_tilt_control.h"
+#include "test.h"
+#include <math.h>
+#include <string.h>
+#include <deque>
+
+#define TICK_US 20000       // 50 Hz, the rate_hz default
+
+static uint32_t rngState = 0x1B873593;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Roughly normal, unit variance
+static float gauss() {
+  float sum = 0;
+  for (int i = 0; i < 12; i++) sum += (float)(rnd() & 0xFFFF) / 65536.0f;
+  return sum - 6;
+}
+
+// The firmware's defaults (config_store.cpp), in loop units
+static PanTiltParams defaults() {
+  PanTiltParams params;
+  memset(&params, 0, sizeof(params));
+  params.axes[PAN_AXIS].fovDeg = 54;
+  params.axes[PAN_AXIS].direction = 1;
+  params.axes[PAN_AXIS].minAngle = 0;
+  params.axes[PAN_AXIS].maxAngle = 180;
+  params.axes[PAN_AXIS].homeAngle = 90;
+  params.axes[TILT_AXIS].fovDeg = 41;
+  params.axes[TILT_AXIS].direction = 1;
+  params.axes[TILT_AXIS].minAngle = 30;
+  params.axes[TILT_AXIS].maxAngle = 150;
+  params.axes[TILT_AXIS].homeAngle = 90;
+  params.kp = 4;
+  params.ki = 0.5f;
+  params.kd = 0;
+  params.maxSpeed = 120;
+  params.maxAccel = 600;
+  params.accelNoise = 80;
+  params.measureNoise = 0.5f;
+  params.servoLagUs = 50000;
+  params.lostUs = 1000000;
+  params.homeAfterUs = 5000000;
+  return params;
+}
+
+// Target bearing over time, in servo degrees along each axis
+typedef void (*TargetPath)(double t, double bearing[PAN_TILT_AXES]);
+
+struct Scene {
+  PanTiltParams params;
+  TargetPath path;
+  double seconds;
+  double settleS;             // error statistics start here
+  uint32_t frameUs;           // model interval
+  uint32_t inferenceUs;       // capture to detection
+  uint32_t deadUs;            // servo dead time
+  uint32_t servoTauUs;        // servo first-order lag
+  float noise;                // detection noise, fraction of the frame
+  bool mountInverted;         // the servo turns the camera the other way
+  bool ignoreCaptureTime;     // report detections as captured on arrival
+  double visibleUntil;        // detections stop here
+};
+
+static Scene scene(TargetPath path, double seconds) {
+  Scene s;
+  s.params = defaults();
+  s.path = path;
+  s.seconds = seconds;
+  s.settleS = 2;
+  s.frameUs = 100000;
+  s.inferenceUs = 120000;
+  s.deadUs = 20000;
+  s.servoTauUs = 30000;
+  s.noise = 0.004f;
+  s.mountInverted = false;
+  s.ignoreCaptureTime = false;
+  s.visibleUntil = 1e9;
+  return s;
+}
+
+struct Result {
+  double rmsError[PAN_TILT_AXES];     // target bearing - camera angle, after settleS
+  double maxError[PAN_TILT_AXES];
+  double maxSpeed;                     // commanded, deg/s
+  double maxAccel;                     // commanded speed change per tick, deg/s^2
+  double peakCommand[PAN_TILT_AXES];  // largest commanded angle
+  double finalAngle[PAN_TILT_AXES];   // camera
+  double finalRate[PAN_TILT_AXES];    // filter's target speed
+  double finalBearing[PAN_TILT_AXES]; // filter's estimate now
+  uint32_t detections;
+  uint32_t missed;                     // target outside the frame
+};
+
+struct Pending {
+  int64_t capturedUs;
+  int64_t readyUs;
+  float offset[PAN_TILT_AXES];
+};
+
+static Result run(const Scene &s, PanTiltLoop &loop) {
+  Result result;
+  memset(&result, 0, sizeof(result));
+  const PanTiltParams &params = s.params;
+  double camera[PAN_TILT_AXES] = {params.axes[PAN_AXIS].homeAngle, params.axes[TILT_AXIS].homeAngle};
+  loop.configure(params);
+  loop.reset(0, (float)camera[PAN_AXIS], (float)camera[TILT_AXIS]);
+
+  std::deque<std::pair<int64_t, float> > commands[PAN_TILT_AXES];   // for the dead time
+  float start[PAN_TILT_AXES] = {(float)camera[PAN_AXIS], (float)camera[TILT_AXIS]};
+  std::deque<Pending> pending;
+  double sumSq[PAN_TILT_AXES] = {0, 0};
+  uint32_t samples = 0;
+  float lastSpeed[PAN_TILT_AXES] = {0, 0};
+  int64_t endUs = (int64_t)(s.seconds * 1e6);
+
+  for (int64_t now = 0; now <= endUs; now += 1000) {
+    double t = now / 1e6;
+    double bearing[PAN_TILT_AXES];
+    s.path(t, bearing);
+
+    // Servo: the command from deadUs ago, through a first-order lag
+    for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+      std::deque<std::pair<int64_t, float> > &sent = commands[a];
+      while (sent.size() > 1 && sent[1].first <= now - (int64_t)s.deadUs) sent.pop_front();
+      float delayed = !sent.empty() && sent.front().first <= now - (int64_t)s.deadUs ? sent.front().second : start[a];
+      camera[a] += (delayed - camera[a]) * (1 - exp(-1000.0 / s.servoTauUs));
+    }
+
+    // Camera: a frame every frameUs; the detection is ready inferenceUs later
+    if (now % s.frameUs == 0 && t < s.visibleUntil) {
+      Pending frame;
+      frame.capturedUs = now;
+      frame.readyUs = now + s.inferenceUs;
+      bool visible = true;
+      for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+        double halfFov = params.axes[a].fovDeg * 0.5 * M_PI / 180;
+        // Normally a target at a larger servo angle shows at +x/+y
+        double seen = (bearing[a] - camera[a]) * (s.mountInverted ? -1 : 1);
+        double offset = tan(seen * M_PI / 180) / (2 * tan(halfFov));
+        if (fabs(seen) >= 89 || fabs(offset) > 0.5) visible = false;
+        frame.offset[a] = (float)offset + s.noise * gauss();
+      }
+      if (visible) {
+        pending.push_back(frame);
+      } else {
+        result.missed++;
+      }
+    }
+    while (!pending.empty() && pending.front().readyUs <= now) {
+      const Pending &frame = pending.front();
+      loop.measure(s.ignoreCaptureTime ? now : frame.capturedUs, frame.offset[PAN_AXIS], frame.offset[TILT_AXIS]);
+      result.detections++;
+      pending.pop_front();
+    }
+
+    if (now % TICK_US == 0) {
+      float pan, tilt;
+      loop.tick(now, pan, tilt);
+      float command[PAN_TILT_AXES] = {pan, tilt};
+      for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+        commands[a].push_back(std::make_pair(now, command[a]));
+        if (command[a] > result.peakCommand[a]) result.peakCommand[a] = command[a];
+        float speed = loop.speed(a);
+        if (fabs(speed) > result.maxSpeed) result.maxSpeed = fabs(speed);
+        double accel = fabs(speed - lastSpeed[a]) / (TICK_US / 1e6);
+        if (now > 0 && accel > result.maxAccel) result.maxAccel = accel;
+        lastSpeed[a] = speed;
+      }
+    }
+
+    if (t >= s.settleS && now % 1000 == 0) {
+      for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+        double error = fabs(bearing[a] - camera[a]);
+        sumSq[a] += error * error;
+        if (error > result.maxError[a]) result.maxError[a] = error;
+      }
+      samples++;
+    }
+  }
+
+  for (uint8_t a = 0; a < PAN_TILT_AXES; a++) {
+    result.rmsError[a] = samples ? sqrt(sumSq[a] / samples) : 0;
+    result.finalAngle[a] = camera[a];
+    result.finalRate[a] = loop.filter(a).rate();
+    result.finalBearing[a] = loop.filter(a).predict(endUs);
+  }
+  return result;
+}
+
+static Result run(const Scene &s) {
+  PanTiltLoop loop;
+  return run(s, loop);
+}
+
+static void report(const char *name, const Result &r) {
+  printf("    %-22s error rms %.2f/%.2f max %.2f/%.2f deg, peak %.2f deg, speed %.0f deg/s, accel %.0f deg/s^2\n",
+         name, r.rmsError[PAN_AXIS], r.rmsError[TILT_AXIS], r.maxError[PAN_AXIS], r.maxError[TILT_AXIS],
+         r.peakCommand[PAN_AXIS], r.maxSpeed, r.maxAccel);
+}
+
+// Limits hold on every tick: acceleration within one tick's rounding
+static void checkLimits(const Scene &s, const Result &r) {
+  CHECK(r.maxSpeed <= s.params.maxSpeed + 1e-3);
+  CHECK(r.maxAccel <= s.params.maxAccel * 1.001 + 1e-3);
+}
+
+// ---------------------------------------------------------------------------
+// Target paths
+
+static void crossing(double t, double bearing[PAN_TILT_AXES]) {
+  bearing[PAN_AXIS] = 70 + 20 * t;          // walks across at 20 deg/s
+  bearing[TILT_AXIS] = 95 - 3 * t;
+}
+
+static void still(double, double bearing[PAN_TILT_AXES]) {
+  bearing[PAN_AXIS] = 110;                   // 20 deg off centre, in the frame
+  bearing[TILT_AXIS] = 80;
+}
+
+static void weaving(double t, double bearing[PAN_TILT_AXES]) {
+  bearing[PAN_AXIS] = 90 + 20 * sin(2 * M_PI * 0.1 * t);     // walking to and fro
+  bearing[TILT_AXIS] = 90 + 5 * sin(2 * M_PI * 0.15 * t + 1);
+}
+
+static void speedingUp(double t, double bearing[PAN_TILT_AXES]) {
+  bearing[PAN_AXIS] = 80 + 2 * t + 2 * t * t;   // 2 deg/s, +4 deg/s every second
+  bearing[TILT_AXIS] = 90;
+}
+
+static void pastTheStop(double t, double bearing[PAN_TILT_AXES]) {
+  bearing[PAN_AXIS] = 110 + 30 * t;          // runs past pan 180
+  bearing[TILT_AXIS] = 90;
+}
+
+// ---------------------------------------------------------------------------
+
+static void testFilter() {
+  testCase("bearing filter");
+  BearingFilter filter;
+  filter.configure(80, 0.5f);
+  CHECK(!filter.active());
+  // Noiseless constant speed: position and speed converge
+  for (int i = 0; i <= 30; i++) filter.update(i * 100000, 40 + 12.0f * i * 0.1f, 1000000);
+  CHECK(filter.active());
+  CHECK(fabs(filter.rate() - 12) < 0.05);
+  CHECK(fabs(filter.predict(3000000) - 76) < 0.05);
+  CHECK(fabs(filter.predict(3500000) - 82) < 0.1);
+  // Out of order: ignored
+  filter.update(2000000, 0, 1000000);
+  CHECK(fabs(filter.predict(3000000) - 76) < 0.05);
+  CHECK_EQ(filter.lastUpdate(), 3000000);
+  // A gap over the restart time starts afresh at the new bearing
+  filter.update(5000000, 10, 1000000);
+  CHECK_EQ(filter.rate(), 0);
+  CHECK(fabs(filter.predict(5000000) - 10) < 1e-4);
+  filter.reset();
+  CHECK(!filter.active());
+
+  // Noisy: the speed estimate settles near the truth
+  filter.configure(10, 0.5f);
+  double sumSq = 0;
+  int n = 0;
+  for (int i = 0; i <= 100; i++) {
+    filter.update(i * 100000, 100 - 8.0f * i * 0.1f + 0.5f * gauss(), 1000000);
+    if (i > 30) {
+      sumSq += (filter.rate() + 8) * (filter.rate() + 8);
+      n++;
+    }
+  }
+  CHECK(sqrt(sumSq / n) < 4);
+}
+
+static void testCrossing() {
+  testCase("constant speed");
+  Scene s = scene(crossing, 5);
+  Result r = run(s);
+  report("20 deg/s crossing", r);
+  CHECK_EQ(r.missed, 0);
+  CHECK(r.rmsError[PAN_AXIS] < 0.5);
+  CHECK(r.maxError[PAN_AXIS] < 1.0);
+  CHECK(r.rmsError[TILT_AXIS] < 0.5);
+  CHECK(fabs(r.finalRate[PAN_AXIS] - 20) < 2);
+  checkLimits(s, r);
+
+  // The same scene with detections stamped on arrival: the inference time
+  // and the servo lag then read as bearing error and the camera trails
+  Scene naive = s;
+  naive.ignoreCaptureTime = true;
+  naive.params.servoLagUs = 0;
+  Result late = run(naive);
+  report("  without capture times", late);
+  CHECK(late.rmsError[PAN_AXIS] > 2 * r.rmsError[PAN_AXIS]);
+}
+
+static void testWeaving() {
+  testCase("weaving and accelerating");
+  Scene s = scene(weaving, 12);
+  Result r = run(s);
+  report("weaving", r);
+  CHECK_EQ(r.missed, 0);
+  CHECK(r.rmsError[PAN_AXIS] < 2.0);
+  CHECK(r.maxError[PAN_AXIS] < 4.5);
+  CHECK(r.rmsError[TILT_AXIS] < 1.0);
+  checkLimits(s, r);
+
+  s = scene(speedingUp, 5);
+  r = run(s);
+  report("accelerating", r);
+  CHECK_EQ(r.missed, 0);
+  CHECK(r.rmsError[PAN_AXIS] < 2.0);
+  CHECK(r.maxError[PAN_AXIS] < 4.0);
+  checkLimits(s, r);
+
+  // Slower model (5 fps) and a slower servo still track, less tightly
+  s = scene(crossing, 5);
+  s.frameUs = 200000;
+  s.inferenceUs = 180000;
+  s.servoTauUs = 60000;
+  s.params.servoLagUs = 80000;
+  r = run(s);
+  report("5 fps, slow servo", r);
+  CHECK(r.rmsError[PAN_AXIS] < 2.0);
+  checkLimits(s, r);
+}
+
+// A still target 20 degrees off: the camera swings over without
+// overshooting, and its own motion does not become target speed
+static void testStep() {
+  testCase("step");
+  Scene s = scene(still, 4);
+  s.settleS = 2.5;
+  s.noise = 0;
+  Result r = run(s);
+  report("20 deg step", r);
+  CHECK(r.peakCommand[PAN_AXIS] < 110.1);
+  CHECK(r.maxError[PAN_AXIS] < 0.1);
+  CHECK(r.maxError[TILT_AXIS] < 0.1);
+  CHECK(fabs(r.finalRate[PAN_AXIS]) < 0.5);
+  checkLimits(s, r);
+
+  // With detection noise the camera stays within a few sigma, and the
+  // filter's speed and bearing average out at the still target
+  s.noise = 0.004f;
+  double worstRms = 0, worstMax = 0, rate = 0, bearing = 0;
+  const int runs = 20;
+  for (int i = 0; i < runs; i++) {
+    r = run(s);
+    if (i == 0) report("  with noise", r);
+    worstRms = fmax(worstRms, r.rmsError[PAN_AXIS]);
+    worstMax = fmax(worstMax, r.maxError[PAN_AXIS]);
+    rate += r.finalRate[PAN_AXIS] / runs;
+    bearing += r.finalBearing[PAN_AXIS] / runs;
+  }
+  printf("      %d runs: worst rms %.2f max %.2f deg, mean rate %.2f deg/s, bearing %.2f deg\n", runs, worstRms,
+         worstMax, rate, bearing);
+  CHECK(worstRms < 0.5);
+  CHECK(worstMax < 1.2);
+  CHECK(fabs(rate) < 1.0);
+  CHECK(fabs(bearing - 110) < 0.3);
+
+  // Fast gains on a servo that lags exactly servoLagUs: no overshoot, and
+  // within the limits
+  s.noise = 0;
+  s.params.kp = 20;
+  s.params.ki = 5;
+  s.params.kd = 0.2f;
+  s.deadUs = s.params.servoLagUs;
+  s.servoTauUs = 100;
+  r = run(s);
+  report("20 deg step, kp 20", r);
+  CHECK(r.peakCommand[PAN_AXIS] < 110.1);
+  CHECK(r.maxError[PAN_AXIS] < 0.1);
+  checkLimits(s, r);
+
+  // On the usual servo, detections taken mid-swing at 100 deg/s are placed
+  // by the lag model only to within a degree or so
+  Scene usual = scene(still, 4);
+  s.deadUs = usual.deadUs;
+  s.servoTauUs = usual.servoTauUs;
+  r = run(s);
+  report("  usual servo", r);
+  CHECK(r.peakCommand[PAN_AXIS] < 111);
+  CHECK(r.maxError[PAN_AXIS] < 0.1);
+  checkLimits(s, r);
+}
+
+static void testLimitsAndMounts() {
+  testCase("angle limits, inverted mount");
+  Scene s = scene(pastTheStop, 4);
+  PanTiltLoop loop;
+  Result r = run(s, loop);
+  CHECK(loop.angle(PAN_AXIS) <= 180 && loop.angle(PAN_AXIS) >= 179.5);
+  CHECK(loop.aimAngle(PAN_AXIS) <= 180);
+  CHECK(r.finalAngle[PAN_AXIS] <= 180 + 1e-6);
+  checkLimits(s, r);
+
+  // A camera mounted the other way round, with invert set to match
+  s = scene(crossing, 5);
+  s.mountInverted = true;
+  s.params.axes[PAN_AXIS].direction = -1;
+  s.params.axes[TILT_AXIS].direction = -1;
+  r = run(s);
+  report("inverted mount", r);
+  CHECK(r.rmsError[PAN_AXIS] < 1.0);
+  CHECK(r.rmsError[TILT_AXIS] < 0.5);
+}
+
+// Target gone at 3 s: the loop keeps following its prediction until
+// lostUs, brakes to a stop within the acceleration limit, holds, and goes
+// home after homeAfterUs
+static void testLost() {
+  testCase("lost target");
+  Scene s = scene(crossing, 3.5);
+  s.visibleUntil = 3;
+  PanTiltLoop loop;
+  Result r = run(s, loop);
+  (void)r;
+
+  float pan, tilt;
+  int64_t lastCapture = 2900000;
+  int64_t now = 3500000 + TICK_US;
+  float held = 0;
+  float lastSpeed = loop.speed(PAN_AXIS);
+  bool limited = true;
+  for (; now < lastCapture + (int64_t)s.params.lostUs + 1000000; now += TICK_US) {
+    loop.tick(now, pan, tilt);
+    float speed = loop.speed(PAN_AXIS);
+    limited = limited && fabs(speed - lastSpeed) <= s.params.maxAccel * TICK_US / 1e6 + 1e-3;
+    lastSpeed = speed;
+    held = pan;
+  }
+  CHECK(!loop.tracking(now));
+  CHECK(limited);
+  CHECK(loop.speed(PAN_AXIS) == 0);
+  // Held until homeAfterUs
+  for (; now < lastCapture + (int64_t)s.params.homeAfterUs - TICK_US; now += TICK_US) loop.tick(now, pan, tilt);
+  CHECK(fabs(pan - held) < 1e-4);
+  for (; now < lastCapture + (int64_t)s.params.homeAfterUs + 3000000; now += TICK_US) loop.tick(now, pan, tilt);
+  CHECK(fabs(pan - 90) < 0.1 && fabs(tilt - 90) < 0.1);
+
+  // aim(): a new rest position, taken at once while nothing is followed
+  loop.aim(40, 200);
+  for (int i = 0; i < 200; i++, now += TICK_US) loop.tick(now, pan, tilt);
+  CHECK(fabs(pan - 40) < 0.1);
+  CHECK(fabs(tilt - 150) < 0.1);   // clamped to tilt_max
+  // A detection ends the rest
+  loop.measure(now, 0.25f, 0);
+  for (int i = 0; i < 100; i++, now += TICK_US) loop.tick(now, pan, tilt);
+  CHECK(pan > 45);
+}
+
+// A detection captured before the oldest commanded angle kept is counted
+// as stale (the bearing uses the oldest angle known)
+static void testStale() {
+  testCase("stale detections");
+  PanTiltLoop loop;
+  loop.configure(defaults());
+  loop.reset(0, 90, 90);
+  float pan, tilt;
+  int64_t now = 0;
+  for (int i = 0; i < PAN_TILT_HISTORY + 10; i++, now += TICK_US) loop.tick(now, pan, tilt);
+  loop.measure(now - 1000000, 0, 0);
+  CHECK_EQ(loop.staleMeasurements(), 0);
+  loop.measure(now - (int64_t)(PAN_TILT_HISTORY + 5) * TICK_US, 0, 0);
+  CHECK_EQ(loop.staleMeasurements(), 1);
+  CHECK_EQ(loop.measurements(), 2);
+
+  // Before the first tick the current angle is known
+  loop.reset(now, 90, 90);
+  loop.measure(now - 5000000, 0, 0);
+  CHECK_EQ(loop.staleMeasurements(), 1);
+}
+
+int main() {
+  testFilter();
+  testCrossing();
+  testWeaving();
+  testStep();
+  testLimitsAndMounts();
+  testLost();
+  testStale();
+  return testSummary("test_pan_tilt_control");
+}
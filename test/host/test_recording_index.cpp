@@ -0,0 +1,451 @@
+/**
+ * RecordingIndex host test
+ *
+ * Runs src/recording_index.cpp over an index file kept in memory, where a
+ * test can tear an append or damage a record the way a reset during a
+ * write leaves them, then loads the file into a fresh index as the boot
+ * does and compares the entries with a model:
+ *
+ * - load() keeps the records before a torn or damaged one and rewrites the
+ *   file without the tail;
+ * - deletion marks accumulate until RECORDING_REWRITE_MIN deleted records
+ *   outnumber the live ones, then the file is rewritten with the live ones;
+ * - a rebuild merges the directory walk with the entries added meanwhile,
+ *   the added entry winning for a name both have;
+ * - evictOldest() removes recordings oldest first (in add order for equal
+ *   start times);
+ * - random adds, forgets, evictions and reloads against the model.
+ */
+
+#include "recording_index.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static uint32_t rngState = 0x6C8E9CF5u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+class MemoryIndexStorage : public RecordingIndexStorage {
+public:
+  std::vector<uint8_t> index;
+  std::vector<uint8_t> temporary;
+  std::vector<std::string> removed;
+  size_t appendLimit;        // bytes the next append writes (tear), SIZE_MAX = all
+
+  MemoryIndexStorage() : appendLimit((size_t)-1) {}
+
+  uint32_t indexSize() override { return (uint32_t)index.size(); }
+
+  size_t indexRead(uint32_t offset, uint8_t *dst, size_t len) override {
+    if (offset >= index.size()) return 0;
+    if (len > index.size() - offset) len = index.size() - offset;
+    memcpy(dst, index.data() + offset, len);
+    return len;
+  }
+
+  size_t indexAppend(const uint8_t *data, size_t len) override {
+    if (len > appendLimit) {
+      len = appendLimit;
+      appendLimit = (size_t)-1;
+    }
+    index.insert(index.end(), data, data + len);
+    return len;
+  }
+
+  bool indexWrite(uint32_t offset, const uint8_t *data, size_t len) override {
+    if (offset + len > index.size()) return false;
+    memcpy(index.data() + offset, data, len);
+    return true;
+  }
+
+  size_t rewriteAppend(const uint8_t *data, size_t len) override {
+    temporary.insert(temporary.end(), data, data + len);
+    return len;
+  }
+
+  bool rewriteCommit() override {
+    index.swap(temporary);
+    temporary.clear();
+    return true;
+  }
+
+  void rewriteAbort() override { temporary.clear(); }
+
+  bool removeRecording(const char *name) override {
+    removed.push_back(name);
+    return true;
+  }
+};
+
+static RecordingEntry entry(uint32_t start, const char *name, uint32_t size) {
+  RecordingEntry e;
+  memset(&e, 0, sizeof(e));
+  e.start = start;
+  e.durationMs = size / 10;
+  e.size = size;
+  e.kind = size % 3 ? RECORDING_CLIP : RECORDING_SNAPSHOT;
+  e.trigger = (uint8_t)(size % RECORDING_TRIGGER_COUNT);
+  snprintf(e.name, sizeof(e.name), "%s", name);
+  return e;
+}
+
+static RecordingEntry numbered(uint32_t start, uint32_t n) {
+  char name[RECORDING_NAME_LEN];
+  snprintf(name, sizeof(name), "2024/05/01/clip_%06u.mjpeg", n);
+  return entry(start, name, 1000 + n);
+}
+
+// The index lists exactly model, in order, and counts its bytes; prints the
+// first difference
+static bool sameEntries(const RecordingIndex &index, const std::vector<RecordingEntry> &model, const char *name) {
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < model.size(); i++) bytes += model[i].size;
+  if (index.count() != model.size() || index.totalBytes() != bytes) {
+    fprintf(stderr, "%s: %u entries, %llu bytes, expected %zu, %llu\n", name, index.count(),
+            (unsigned long long)index.totalBytes(), model.size(), (unsigned long long)bytes);
+    return false;
+  }
+  for (uint32_t i = 0; i < index.count(); i++) {
+    const RecordingEntry &got = index.at(i);
+    const RecordingEntry &want = model[i];
+    if (got.start != want.start || got.size != want.size || got.durationMs != want.durationMs ||
+        got.kind != want.kind || got.trigger != want.trigger || strcmp(got.name, want.name) != 0) {
+      fprintf(stderr, "%s: entry %u is %s at %u, expected %s at %u\n", name, i, got.name, got.start, want.name,
+              want.start);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Where add() puts an entry: after the entries with the same start
+static void modelInsert(std::vector<RecordingEntry> &model, const RecordingEntry &e) {
+  size_t position = model.size();
+  while (position > 0 && model[position - 1].start > e.start) position--;
+  model.insert(model.begin() + position, e);
+}
+
+static uint32_t fileRecordsOnDisk(const MemoryIndexStorage &storage) {
+  return (uint32_t)((storage.index.size() - RECORDING_HEADER_SIZE) / RECORDING_RECORD_SIZE);
+}
+
+static void testTornLoad() {
+  testCase("load stops at a torn or damaged record");
+  MemoryIndexStorage storage;
+  std::vector<RecordingEntry> model;
+  {
+    RecordingIndex index;
+    CHECK(index.begin(&storage, 1000));
+    CHECK(!index.load());   // no file yet
+    for (uint32_t i = 0; i < 10; i++) {
+      model.push_back(numbered(1000 + i * 60, i));
+      CHECK(index.add(model.back()));
+    }
+    CHECK_EQ(index.fileRecords(), 10);
+  }
+  CHECK_EQ(storage.index.size(), RECORDING_HEADER_SIZE + 10 * RECORDING_RECORD_SIZE);
+  const std::vector<uint8_t> intact = storage.index;
+
+  // A reset part way through the 11th append leaves a partial record
+  RecordingIndex index;
+  CHECK(index.begin(&storage, 1000));
+  CHECK(index.load());
+  CHECK(index.add(numbered(2000, 10)));
+  storage.index.resize(intact.size() + 30);
+  CHECK(index.load());
+  CHECK(sameEntries(index, model, "torn append"));
+  CHECK_EQ(index.stats().damaged, 1);
+  // ... and the rewrite dropped it, so the next append lands on a clean record
+  CHECK(storage.index == intact);
+  model.push_back(numbered(2000, 11));
+  CHECK(index.add(model.back()));
+  CHECK(index.load());
+  CHECK(sameEntries(index, model, "append after the torn record"));
+
+  // A short append that reports itself is repaired at once by a rewrite
+  storage.appendLimit = 30;
+  model.push_back(numbered(2100, 12));
+  CHECK(index.add(model.back()));
+  CHECK_EQ(index.stats().writeErrors, 1);
+  CHECK_EQ(fileRecordsOnDisk(storage), model.size());
+  CHECK_EQ(storage.index.size() % RECORDING_RECORD_SIZE, RECORDING_HEADER_SIZE);
+  CHECK(index.load());
+  CHECK(sameEntries(index, model, "short append"));
+
+  // A record with a bad CRC ends the file there: the records after it go
+  storage.index[RECORDING_HEADER_SIZE + 6 * RECORDING_RECORD_SIZE + 20] ^= 0x10;
+  model.resize(6);
+  CHECK(index.load());
+  CHECK(sameEntries(index, model, "bad CRC"));
+  CHECK_EQ(fileRecordsOnDisk(storage), 6);
+  CHECK(index.load());
+  CHECK(sameEntries(index, model, "reload after bad CRC"));
+
+  // Zeros where records should be (a block allocated but never written)
+  storage.index.resize(storage.index.size() + 3 * RECORDING_RECORD_SIZE, 0);
+  CHECK(index.load());
+  CHECK(sameEntries(index, model, "zero-filled tail"));
+  CHECK_EQ(fileRecordsOnDisk(storage), 6);
+
+  // A damaged header makes the file unusable: a rebuild is needed
+  storage.index[0] ^= 0xFF;
+  CHECK(!index.load());
+  CHECK_EQ(index.count(), 0);
+}
+
+static void testRewrite() {
+  testCase("rewrite after RECORDING_REWRITE_MIN deletes");
+  MemoryIndexStorage storage;
+  RecordingIndex index;
+  std::vector<RecordingEntry> model;
+  CHECK(index.begin(&storage, 1000));
+  CHECK(!index.load());
+  const uint32_t total = 100;
+  for (uint32_t i = 0; i < total; i++) {
+    model.push_back(numbered(5000 + i, i));
+    index.add(model.back());
+  }
+
+  // Deleted records at RECORDING_REWRITE_MIN - 1: only marked in place
+  const uint32_t marked = RECORDING_REWRITE_MIN - 1;
+  for (uint32_t i = 0; i < marked; i++) {
+    CHECK(index.evictOldest());
+  }
+  model.erase(model.begin(), model.begin() + marked);
+  CHECK_EQ(index.stats().rewrites, 0);
+  CHECK_EQ(fileRecordsOnDisk(storage), total);
+  {
+    RecordingIndex reloaded;
+    reloaded.begin(&storage, 1000);
+    CHECK(reloaded.load());
+    CHECK(sameEntries(reloaded, model, "deletion marks"));
+    CHECK_EQ(reloaded.stats().rewrites, 0);
+  }
+
+  // One more, and deleted records both reach the minimum and outnumber the
+  // live ones: the file now holds only the live entries
+  CHECK(index.evictOldest());
+  model.erase(model.begin());
+  CHECK_EQ(index.stats().rewrites, 1);
+  CHECK_EQ(index.fileRecords(), total - RECORDING_REWRITE_MIN);
+  CHECK_EQ(fileRecordsOnDisk(storage), total - RECORDING_REWRITE_MIN);
+  RecordingIndex reloaded;
+  reloaded.begin(&storage, 1000);
+  CHECK(reloaded.load());
+  CHECK(sameEntries(reloaded, model, "after rewrite"));
+
+  // Past the minimum but still fewer deleted than live: no rewrite
+  MemoryIndexStorage storage2;
+  RecordingIndex big;
+  big.begin(&storage2, 1000);
+  for (uint32_t i = 0; i < 200; i++) big.add(numbered(i, i));
+  for (uint32_t i = 0; i < RECORDING_REWRITE_MIN + 10; i++) {
+    char name[RECORDING_NAME_LEN];
+    snprintf(name, sizeof(name), "2024/05/01/clip_%06u.mjpeg", 199 - i);
+    CHECK(big.forget(name));
+  }
+  CHECK_EQ(big.stats().rewrites, 0);
+  CHECK_EQ(fileRecordsOnDisk(storage2), 200);
+  CHECK(storage2.removed.empty());   // forget() leaves the files alone
+}
+
+static void testRebuildMerge() {
+  testCase("rebuild merges the walk with entries added meanwhile");
+  MemoryIndexStorage storage;
+  RecordingIndex index;
+  CHECK(index.begin(&storage, 1000));
+  CHECK(!index.load());
+
+  index.beginRebuild();
+  CHECK(index.rebuilding());
+  // Recorded while the walk runs: one is new, one the walk also finds
+  RecordingEntry fresh = entry(900, "2024/05/01/clip_new.mjpeg", 77);
+  RecordingEntry rewritten = entry(300, "2024/05/01/clip_b.mjpeg", 5555);
+  rewritten.trigger = RECORDING_TRIGGER_DETECTION;
+  CHECK(index.add(fresh));
+  CHECK(index.add(rewritten));
+  CHECK(storage.index.empty());   // nothing is written until the merge
+
+  // The walk finds files in directory order, not time order
+  CHECK(index.rebuildAdd(entry(500, "2024/05/01/clip_c.mjpeg", 30)));
+  CHECK(index.rebuildAdd(entry(100, "2024/05/01/clip_a.mjpeg", 10)));
+  CHECK(index.rebuildAdd(entry(300, "2024/05/01/clip_b.mjpeg", 20)));
+  CHECK(index.rebuildAdd(entry(700, "2024/05/01/snap_d.jpg", 40)));
+  CHECK(index.finishRebuild());
+  CHECK(!index.rebuilding());
+
+  std::vector<RecordingEntry> model;
+  model.push_back(entry(100, "2024/05/01/clip_a.mjpeg", 10));
+  model.push_back(rewritten);
+  model.push_back(entry(500, "2024/05/01/clip_c.mjpeg", 30));
+  model.push_back(entry(700, "2024/05/01/snap_d.jpg", 40));
+  model.push_back(fresh);
+  CHECK(sameEntries(index, model, "merge"));
+  CHECK(!index.rebuildAdd(entry(1, "late", 1)));
+
+  RecordingIndex reloaded;
+  reloaded.begin(&storage, 1000);
+  CHECK(reloaded.load());
+  CHECK(sameEntries(reloaded, model, "merge reloaded"));
+
+  // Random walks and adds with shared names, over the entry limit
+  uint32_t failures = 0;
+  for (int round = 0; round < 200; round++) {
+    MemoryIndexStorage roundStorage;
+    RecordingIndex rebuilt;
+    uint32_t limit = 20 + rnd() % 60;
+    rebuilt.begin(&roundStorage, limit);
+    rebuilt.load();
+    rebuilt.beginRebuild();
+
+    // Names 0..n-1; each is walked, added, or both (added wins). The walk
+    // itself holds at most maxEntries entries
+    uint32_t n = 1 + rnd() % 80;
+    std::vector<RecordingEntry> walkedOnly;
+    std::vector<RecordingEntry> added;
+    uint32_t walkedCount = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t how = rnd() % 3;
+      bool walk = how != 0 && walkedCount < limit;
+      bool add = how != 1 && added.size() < limit;
+      RecordingEntry walkedEntry = numbered(rnd() % 50, i);
+      RecordingEntry addedEntry = numbered(rnd() % 50, i);
+      addedEntry.size += 100000;
+      if (add) {
+        rebuilt.add(addedEntry);
+        added.push_back(addedEntry);
+      }
+      if (walk) {
+        rebuilt.rebuildAdd(walkedEntry);
+        walkedCount++;
+        if (!add) walkedOnly.push_back(walkedEntry);
+      }
+    }
+    // Added entries in add order after equal starts; walked ones before
+    // them, in walk order
+    std::vector<RecordingEntry> expected;
+    for (size_t i = 0; i < added.size(); i++) modelInsert(expected, added[i]);
+    for (size_t i = 0; i < walkedOnly.size(); i++) {
+      size_t position = 0;
+      while (position < expected.size() && (expected[position].start < walkedOnly[i].start ||
+             (expected[position].start == walkedOnly[i].start && expected[position].size < 100000))) {
+        position++;
+      }
+      expected.insert(expected.begin() + position, walkedOnly[i]);
+    }
+    if (expected.size() > limit) expected.erase(expected.begin(), expected.begin() + (expected.size() - limit));
+    rebuilt.finishRebuild();
+
+    bool ok = sameEntries(rebuilt, expected, "random rebuild");
+    RecordingIndex again;
+    again.begin(&roundStorage, limit);
+    ok = ok && again.load() && sameEntries(again, expected, "random rebuild reloaded");
+    if (!ok) {
+      fprintf(stderr, "  in round %d\n", round);
+      failures++;
+      break;
+    }
+  }
+  CHECK_EQ(failures, 0);
+}
+
+static void testEvictOrder() {
+  testCase("evictOldest order");
+  MemoryIndexStorage storage;
+  RecordingIndex index;
+  std::vector<RecordingEntry> model;
+  CHECK(index.begin(&storage, 1000));
+  CHECK(!index.load());
+  // Mostly in time order, some late arrivals and equal start times
+  for (uint32_t i = 0; i < 300; i++) {
+    uint32_t start = rnd() % 4 == 0 ? rnd() % (i * 10 + 1) : i * 10;
+    RecordingEntry e = numbered(start, i);
+    CHECK(index.add(e));
+    modelInsert(model, e);
+  }
+  CHECK(sameEntries(index, model, "before eviction"));
+
+  uint32_t failures = 0;
+  uint64_t bytes = index.totalBytes();
+  for (size_t i = 0; i < model.size(); i++) {
+    RecordingEntry evicted;
+    if (!index.evictOldest(&evicted) || strcmp(evicted.name, model[i].name) != 0 ||
+        storage.removed.size() != i + 1 || storage.removed[i] != model[i].name) {
+      if (!failures) fprintf(stderr, "eviction %zu: got %s, expected %s\n", i, evicted.name, model[i].name);
+      failures++;
+    }
+    bytes -= model[i].size;
+    if (index.totalBytes() != bytes) failures++;
+  }
+  CHECK_EQ(failures, 0);
+  CHECK_EQ(index.count(), 0);
+  CHECK(!index.evictOldest());
+  CHECK_EQ(index.stats().evicted, model.size());
+}
+
+static void testRandom() {
+  testCase("random adds, forgets, evictions and reloads");
+  MemoryIndexStorage storage;
+  RecordingIndex *index = new RecordingIndex();
+  std::vector<RecordingEntry> model;
+  const uint32_t limit = 150;
+  index->begin(&storage, limit);
+  index->load();
+
+  uint32_t failures = 0;
+  uint32_t next = 0;
+  uint32_t clock = 0;
+  for (int step = 0; step < 20000; step++) {
+    uint32_t action = rnd() % 20;
+    if (action < 10) {
+      clock += rnd() % 30;
+      RecordingEntry e = numbered(rnd() % 8 == 0 ? clock - rnd() % (clock + 1) : clock, next++);
+      bool added = index->add(e);
+      if (added != (model.size() < limit)) failures++;
+      if (added) modelInsert(model, e);
+    } else if (action < 13 && !model.empty()) {
+      size_t victim = rnd() % model.size();
+      if (!index->forget(model[victim].name)) failures++;
+      model.erase(model.begin() + victim);
+    } else if (action < 18) {
+      RecordingEntry evicted;
+      bool any = index->evictOldest(&evicted);
+      if (any != !model.empty() || (any && strcmp(evicted.name, model[0].name) != 0)) failures++;
+      if (any) model.erase(model.begin());
+    } else if (action == 18) {
+      // Reboot: a new index loads the file
+      delete index;
+      index = new RecordingIndex();
+      index->begin(&storage, limit);
+      if (!index->load() && !model.empty()) failures++;
+    }
+    if (!sameEntries(*index, model, "random")) {
+      fprintf(stderr, "  at step %d\n", step);
+      failures++;
+      break;
+    }
+    // The file never holds more than the rewrite rule allows
+    uint32_t deleted = index->fileRecords() - index->count();
+    if (deleted > index->count() && deleted >= RECORDING_REWRITE_MIN) failures++;
+  }
+  CHECK_EQ(failures, 0);
+  CHECK(index->stats().rewrites > 0);
+  delete index;
+}
+
+int main() {
+  testTornLoad();
+  testRewrite();
+  testRebuildMerge();
+  testEvictOrder();
+  testRandom();
+  return testSummary("test_recording_index");
+}
@@ -0,0 +1,640 @@
+/**
+ * RTP/JPEG packetizer host test
+ *
+ * Frames are encoded in-process with libjpeg (4:2:2 like the OV2640, and
+ * 4:2:0, with and without restart intervals, one or two quantization
+ * tables, padding after the EOI like a camera buffer), packetized with
+ * src/rtp_jpeg.cpp and handed to a receiver written here from RFC 2435
+ * (section 3.1 and appendix B): it puts the fragments back together by
+ * offset, in whatever order they arrive, and rebuilds SOI, DQT, DRI, SOF
+ * and SOS from the per-packet headers. The rebuilt frame carries no DHT,
+ * so libjpeg decodes it with its own Annex K tables rather than the copy
+ * in src/; its pixels must equal the original's, with no libjpeg warning.
+ *
+ * Also checks every RTP and JPEG header field, packet sizes, sequence
+ * numbers across frames and their wrap, the frames rtpJpegParse() must
+ * refuse, and the buffer and packet-count limits of packetize().
+ */
+
+#include "rtp_jpeg.h"
+#include "test.h"
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <jpeglib.h>
+
+typedef std::vector<uint8_t> Bytes;
+
+#define SSRC 0x1234ABCDu
+
+static uint32_t rngState = 0x2545F491u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static uint16_t readU16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t readU32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// ---------------------------------------------------------------------------
+// libjpeg glue: errors longjmp back instead of exiting
+
+struct ErrorTrap {
+  jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void trapError(j_common_ptr cinfo) {
+  longjmp(((ErrorTrap *)cinfo->err)->jump, 1);
+}
+
+static void quietMessage(j_common_ptr) {}
+
+static void installTrap(ErrorTrap &trap, j_common_ptr cinfo) {
+  cinfo->err = jpeg_std_error(&trap.mgr);
+  trap.mgr.error_exit = trapError;
+  trap.mgr.output_message = quietMessage;
+}
+
+struct Options {
+  int width;
+  int height;
+  int components;        // 1 or 3
+  int h;                 // luma sampling factors
+  int v;
+  int quality;
+  int restartMcus;
+  bool oneTable;         // chroma quantized with the luma table
+  bool optimize;         // per-image Huffman tables
+  bool progressive;
+};
+
+static Options options(int width, int height, int h, int v) {
+  Options o;
+  memset(&o, 0, sizeof(o));
+  o.width = width;
+  o.height = height;
+  o.components = 3;
+  o.h = h;
+  o.v = v;
+  o.quality = 80;
+  return o;
+}
+
+// Textured test card: gradients, a few hard edges and noise
+static Bytes makePixels(int width, int height, int components, uint32_t seed) {
+  Bytes pixels((size_t)width * height * components);
+  rngState = seed | 1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < components; c++) {
+        int value = (x * (3 + c) + y * (2 + 2 * c)) % 200 + 20;
+        if (((x / 24) + (y / 16)) % 3 == c % 3) value = 255 - value;
+        value += (int)(rnd() % 17) - 8;
+        pixels[((size_t)y * width + x) * components + c] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+      }
+    }
+  }
+  return pixels;
+}
+
+static Bytes encode(const Options &o, uint32_t seed) {
+  Bytes pixels = makePixels(o.width, o.height, o.components, seed);
+  jpeg_compress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  unsigned char *buffer = NULL;
+  unsigned long size = 0;
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return Bytes();
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = o.width;
+  cinfo.image_height = o.height;
+  cinfo.input_components = o.components;
+  cinfo.in_color_space = o.components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, o.quality, TRUE);
+  if (o.components == 3) {
+    cinfo.comp_info[0].h_samp_factor = o.h;
+    cinfo.comp_info[0].v_samp_factor = o.v;
+    if (o.oneTable) cinfo.comp_info[1].quant_tbl_no = cinfo.comp_info[2].quant_tbl_no = 0;
+  }
+  cinfo.restart_interval = o.restartMcus;
+  cinfo.optimize_coding = o.optimize;
+  if (o.progressive) jpeg_simple_progression(&cinfo);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = (JSAMPROW)&pixels[(size_t)cinfo.next_scanline * o.width * o.components];
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  Bytes jpeg(buffer, buffer + size);
+  free(buffer);
+  return jpeg;
+}
+
+struct Decoded {
+  bool ok;
+  int width;
+  int height;
+  long warnings;         // corrupt entropy data shows up here
+  Bytes pixels;          // RGB
+};
+
+static Decoded decode(const Bytes &jpeg) {
+  Decoded d;
+  d.ok = false;
+  d.width = d.height = 0;
+  d.warnings = 0;
+  jpeg_decompress_struct cinfo;
+  ErrorTrap trap;
+  installTrap(trap, (j_common_ptr)&cinfo);
+  if (setjmp(trap.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return d;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *)jpeg.data(), jpeg.size());
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.dct_method = JDCT_ISLOW;
+  jpeg_start_decompress(&cinfo);
+  d.width = cinfo.output_width;
+  d.height = cinfo.output_height;
+  d.pixels.resize((size_t)d.width * d.height * 3);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = &d.pixels[(size_t)cinfo.output_scanline * d.width * 3];
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  d.warnings = trap.mgr.num_warnings;
+  jpeg_destroy_decompress(&cinfo);
+  d.ok = true;
+  return d;
+}
+
+// ---------------------------------------------------------------------------
+// Receiver, after RFC 2435 section 3.1 and appendix B
+
+struct Packet {
+  Bytes data;
+};
+
+struct Received {
+  const char *error;     // NULL when the frame was rebuilt
+  Bytes jpeg;
+  uint8_t type;
+  uint16_t width;        // pixels, from the 8-pixel units
+  uint16_t height;
+  uint16_t restartInterval;
+  uint8_t tableCount;
+  uint8_t tables[2][64];
+};
+
+static void putMarker(Bytes &out, uint8_t marker) {
+  out.push_back(0xFF);
+  out.push_back(marker);
+}
+
+static void putU16(Bytes &out, uint16_t value) {
+  out.push_back((uint8_t)(value >> 8));
+  out.push_back((uint8_t)value);
+}
+
+static Received failed(Received &r, const char *why) {
+  r.error = why;
+  return r;
+}
+
+// Packets of one frame, in any order: the fragment offset places each one
+static Received receive(std::vector<Packet> packets) {
+  Received r;
+  r.error = "no packets";
+  r.type = r.tableCount = 0;
+  r.width = r.height = r.restartInterval = 0;
+  if (packets.empty()) return r;
+
+  std::sort(packets.begin(), packets.end(), [](const Packet &a, const Packet &b) {
+    return readU32(&a.data[RTP_HEADER_SIZE]) < readU32(&b.data[RTP_HEADER_SIZE]);
+  });
+  Bytes scan;
+  bool sawMarker = false;
+  for (size_t i = 0; i < packets.size(); i++) {
+    const Bytes &p = packets[i].data;
+    if (p.size() < RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE) return failed(r, "short packet");
+    if (sawMarker) return failed(r, "data after the marker");
+    sawMarker = (p[1] & 0x80) != 0;
+    const uint8_t *jh = &p[RTP_HEADER_SIZE];
+    uint32_t offset = readU32(jh) & 0xFFFFFF;
+    if (offset != scan.size()) return failed(r, "gap or overlap");
+    uint8_t type = jh[4], q = jh[5];
+    if (i == 0) {
+      r.type = type;
+      r.width = (uint16_t)(jh[6] * 8);
+      r.height = (uint16_t)(jh[7] * 8);
+    } else if (type != r.type || jh[6] * 8 != r.width || jh[7] * 8 != r.height) {
+      return failed(r, "main header changed within the frame");
+    }
+    size_t pos = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+    if (type >= 64) {
+      if (pos + RTP_JPEG_RESTART_SIZE > p.size()) return failed(r, "short packet");
+      r.restartInterval = readU16(&p[pos]);
+      pos += RTP_JPEG_RESTART_SIZE;
+    }
+    if (q >= 128 && offset == 0) {
+      if (pos + RTP_JPEG_QTABLE_SIZE > p.size() || p[pos + 1] != 0) return failed(r, "bad table header");
+      uint16_t length = readU16(&p[pos + 2]);
+      pos += RTP_JPEG_QTABLE_SIZE;
+      if ((length != 64 && length != 128) || pos + length > p.size()) return failed(r, "bad table length");
+      r.tableCount = (uint8_t)(length / 64);
+      for (uint8_t t = 0; t < r.tableCount; t++) memcpy(r.tables[t], &p[pos + 64 * t], 64);
+      pos += length;
+    }
+    scan.insert(scan.end(), p.begin() + pos, p.end());
+  }
+  if (!sawMarker) return failed(r, "no marker");
+  if (r.tableCount == 0) return failed(r, "no tables");
+  uint8_t base = r.type & 63;
+  if (base > 1) return failed(r, "unknown type");
+
+  Bytes &out = r.jpeg;
+  putMarker(out, 0xD8);
+  for (uint8_t t = 0; t < r.tableCount; t++) {
+    putMarker(out, 0xDB);
+    putU16(out, 67);
+    out.push_back(t);
+    out.insert(out.end(), r.tables[t], r.tables[t] + 64);
+  }
+  if (r.type >= 64) {
+    putMarker(out, 0xDD);
+    putU16(out, 4);
+    putU16(out, r.restartInterval);
+  }
+  putMarker(out, 0xC0);
+  putU16(out, 17);
+  out.push_back(8);
+  putU16(out, r.height);
+  putU16(out, r.width);
+  out.push_back(3);
+  uint8_t chromaTable = (uint8_t)(r.tableCount - 1);
+  uint8_t components[3][3] = {{0, (uint8_t)(base == 0 ? 0x21 : 0x22), 0}, {1, 0x11, chromaTable}, {2, 0x11, chromaTable}};
+  for (int c = 0; c < 3; c++) out.insert(out.end(), components[c], components[c] + 3);
+  putMarker(out, 0xDA);
+  putU16(out, 12);
+  out.push_back(3);
+  uint8_t selectors[3][2] = {{0, 0x00}, {1, 0x11}, {2, 0x11}};
+  for (int c = 0; c < 3; c++) out.insert(out.end(), selectors[c], selectors[c] + 2);
+  out.push_back(0);
+  out.push_back(63);
+  out.push_back(0);
+  out.insert(out.end(), scan.begin(), scan.end());
+  putMarker(out, 0xD9);
+  r.error = NULL;
+  return r;
+}
+
+// ---------------------------------------------------------------------------
+// Helpers
+
+struct Sent {
+  uint16_t count;
+  std::vector<Packet> packets;
+};
+
+static Sent send(RtpJpegPacketizer &packetizer, const RtpJpegFrame &frame, uint32_t timestamp, size_t maxPacket) {
+  size_t capacity = RtpJpegPacketizer::bufferSize(frame.scanLength, maxPacket);
+  Bytes out(capacity);
+  std::vector<uint16_t> sizes(capacity / RTP_JPEG_MIN_PACKET + 2);
+  Sent s;
+  s.count = packetizer.packetize(frame, timestamp, maxPacket, out.data(), out.size(), sizes.data(),
+                                 (uint16_t)sizes.size());
+  size_t pos = 0;
+  for (uint16_t i = 0; i < s.count; i++) {
+    Packet p;
+    p.data.assign(out.begin() + pos, out.begin() + pos + sizes[i]);
+    s.packets.push_back(p);
+    pos += sizes[i];
+  }
+  return s;
+}
+
+// Offset of the scan (after SOS) and of the EOI in a libjpeg frame
+static void findScan(const Bytes &jpeg, size_t &start, size_t &end) {
+  size_t pos = 2;
+  while (jpeg[pos + 1] != 0xDA) pos += 2 + readU16(&jpeg[pos + 2]);
+  start = pos + 2 + readU16(&jpeg[pos + 2]);
+  end = jpeg.size() - 2;
+}
+
+// The table with the given id from the DQT segments, in their zigzag order
+static const uint8_t *findTable(const Bytes &jpeg, uint8_t id) {
+  size_t pos = 2;
+  while (jpeg[pos + 1] != 0xDA) {
+    uint16_t length = readU16(&jpeg[pos + 2]);
+    if (jpeg[pos + 1] == 0xDB) {
+      for (size_t i = pos + 4; i < pos + 2 + length; i += 65) {
+        if (jpeg[i] == id) return &jpeg[i + 1];
+      }
+    }
+    pos += 2 + length;
+  }
+  return NULL;
+}
+
+static bool fail(const char *&why, const char *what) {
+  why = what;
+  return false;
+}
+
+// Packetizes, shuffles, receives and decodes one frame; true when the
+// pixels equal libjpeg's decode of the original
+static bool roundTrip(const Bytes &jpeg, size_t maxPacket, bool shuffle, const char *&why) {
+  RtpJpegFrame frame;
+  why = rtpJpegParse(jpeg.data(), jpeg.size(), frame);
+  if (why) return false;
+  RtpJpegPacketizer packetizer;
+  packetizer.begin(SSRC, (uint16_t)rnd());
+  Sent s = send(packetizer, frame, rnd(), maxPacket);
+  if (s.count == 0) return fail(why, "packetize failed");
+  for (uint16_t i = 0; i + 1 < s.count; i++) {
+    if (s.packets[i].data.size() != maxPacket) return fail(why, "packet not filled");
+  }
+  if (s.packets.back().data.size() > maxPacket) return fail(why, "packet too large");
+  if (shuffle) {
+    for (size_t i = s.packets.size(); i > 1; i--) std::swap(s.packets[i - 1], s.packets[rnd() % i]);
+  }
+  Received r = receive(s.packets);
+  if (r.error) return fail(why, r.error);
+  Decoded original = decode(jpeg), rebuilt = decode(r.jpeg);
+  if (!rebuilt.ok) return fail(why, "rebuilt frame does not decode");
+  if (rebuilt.warnings) return fail(why, "libjpeg warned about the rebuilt frame");
+  if (rebuilt.width != original.width || rebuilt.height != original.height) return fail(why, "size differs");
+  if (rebuilt.pixels != original.pixels) return fail(why, "pixels differ");
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Tests
+
+// One VGA 4:2:2 frame, field by field
+static void testHeaders() {
+  testCase("headers");
+  Bytes jpeg = encode(options(640, 480, 2, 1), 1);
+  RtpJpegFrame frame;
+  CHECK(rtpJpegParse(jpeg.data(), jpeg.size(), frame) == NULL);
+  CHECK_EQ(frame.type, 0);
+  CHECK_EQ(frame.width, 640);
+  CHECK_EQ(frame.height, 480);
+  CHECK_EQ(frame.restartInterval, 0);
+  CHECK_EQ(frame.tableCount, 2);
+  CHECK(frame.tables[0] == findTable(jpeg, 0));
+  CHECK(frame.tables[1] == findTable(jpeg, 1));
+  size_t start, end;
+  findScan(jpeg, start, end);
+  CHECK(frame.scan == jpeg.data() + start);
+  CHECK_EQ(frame.scanLength, end - start);
+
+  const size_t maxPacket = 1400;
+  RtpJpegPacketizer packetizer;
+  packetizer.begin(SSRC, 1000);
+  Sent s = send(packetizer, frame, 3000, maxPacket);
+  CHECK(s.count > 1);
+  CHECK_EQ(s.count, s.packets.size());
+  CHECK_EQ(packetizer.sequence(), 1000 + s.count);
+  uint32_t offset = 0;
+  for (uint16_t i = 0; i < s.count; i++) {
+    const Bytes &p = s.packets[i].data;
+    bool first = i == 0, last = i + 1 == s.count;
+    CHECK(p.size() <= maxPacket);
+    CHECK_EQ(p[0], 0x80);                                  // V = 2, no padding, extension or CSRC
+    CHECK_EQ(p[1], (last ? 0x80 : 0) | RTP_JPEG_PAYLOAD_TYPE);
+    CHECK_EQ(readU16(&p[2]), 1000 + i);
+    CHECK_EQ(readU32(&p[4]), 3000);
+    CHECK_EQ(readU32(&p[8]), SSRC);
+    const uint8_t *jh = &p[RTP_HEADER_SIZE];
+    CHECK_EQ(jh[0], 0);                                    // type-specific
+    CHECK_EQ(readU32(jh) & 0xFFFFFF, offset);
+    CHECK_EQ(jh[4], 0);
+    CHECK_EQ(jh[5], 255);                                  // tables in-band
+    CHECK_EQ(jh[6], 640 / 8);
+    CHECK_EQ(jh[7], 480 / 8);
+    size_t pos = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+    if (first) {
+      CHECK_EQ(p[pos], 0);                                 // MBZ
+      CHECK_EQ(p[pos + 1], 0);                             // 8-bit precision
+      CHECK_EQ(readU16(&p[pos + 2]), 128);
+      CHECK(memcmp(&p[pos + 4], findTable(jpeg, 0), 64) == 0);
+      CHECK(memcmp(&p[pos + 4 + 64], findTable(jpeg, 1), 64) == 0);
+      pos += RTP_JPEG_QTABLE_SIZE + 128;
+    }
+    size_t payload = p.size() - pos;
+    CHECK(memcmp(&p[pos], &jpeg[start + offset], payload) == 0);
+    offset += (uint32_t)payload;
+  }
+  CHECK_EQ(offset, frame.scanLength);
+
+  // The next frame carries on the sequence, with its own timestamp
+  Sent next = send(packetizer, frame, 6000, maxPacket);
+  CHECK_EQ(readU16(&next.packets[0].data[2]), 1000 + s.count);
+  CHECK_EQ(readU32(&next.packets[0].data[4]), 6000);
+
+  // Sequence numbers wrap
+  packetizer.begin(SSRC, 65535 - 2);
+  s = send(packetizer, frame, 0, maxPacket);
+  bool continuous = true;
+  for (uint16_t i = 0; i < s.count; i++) continuous &= readU16(&s.packets[i].data[2]) == (uint16_t)(65533 + i);
+  CHECK(continuous);
+  CHECK_EQ(packetizer.sequence(), (uint16_t)(65533 + s.count));
+
+  // Width and height travel in units of 8: a size off the grid rounds up
+  jpeg = encode(options(204, 100, 2, 1), 2);
+  CHECK(rtpJpegParse(jpeg.data(), jpeg.size(), frame) == NULL);
+  s = send(packetizer, frame, 0, maxPacket);
+  CHECK_EQ(s.packets[0].data[RTP_HEADER_SIZE + 6], 26);
+  CHECK_EQ(s.packets[0].data[RTP_HEADER_SIZE + 7], 13);
+}
+
+// Every format the camera can send survives the trip, pixel for pixel
+static void testFormats() {
+  testCase("formats");
+  struct {
+    const char *name;
+    int h, v, restart;
+    bool oneTable;
+    int padding;
+    uint8_t type;
+  } cases[] = {
+    {"4:2:2", 2, 1, 0, false, 0, 0},
+    {"4:2:0", 2, 2, 0, false, 0, 1},
+    {"4:2:2, restart 4", 2, 1, 4, false, 0, 64},
+    {"4:2:0, restart 1", 2, 2, 1, false, 0, 65},
+    {"4:2:2, one table", 2, 1, 0, true, 0, 0},
+    {"4:2:0, one table, restart 10", 2, 2, 10, true, 0, 65},
+    {"4:2:2, padded buffer", 2, 1, 0, false, 700, 0},
+  };
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    Options o = options(320, 240, cases[c].h, cases[c].v);
+    o.restartMcus = cases[c].restart;
+    o.oneTable = cases[c].oneTable;
+    Bytes jpeg = encode(o, 10 + (uint32_t)c);
+    jpeg.insert(jpeg.end(), cases[c].padding, 0);
+    RtpJpegFrame frame;
+    CHECK(rtpJpegParse(jpeg.data(), jpeg.size(), frame) == NULL);
+    CHECK_EQ(frame.type, cases[c].type);
+    CHECK_EQ(frame.restartInterval, cases[c].restart);
+    CHECK_EQ(frame.tableCount, cases[c].oneTable ? 1 : 2);
+    size_t start, end;
+    findScan(jpeg, start, end);
+    CHECK_EQ(frame.scanLength, end - cases[c].padding - start);
+
+    RtpJpegPacketizer packetizer;
+    packetizer.begin(SSRC, 0);
+    Sent s = send(packetizer, frame, 0, 1000);
+    bool restartHeaders = true;
+    for (uint16_t i = 0; i < s.count; i++) {
+      const Bytes &p = s.packets[i].data;
+      size_t pos = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+      if (cases[c].restart) {
+        restartHeaders &= readU16(&p[pos]) == cases[c].restart && readU16(&p[pos + 2]) == 0xFFFF;
+        pos += RTP_JPEG_RESTART_SIZE;
+      }
+      if (i == 0) CHECK_EQ(readU16(&p[pos + 2]), cases[c].oneTable ? 64 : 128);
+    }
+    CHECK(restartHeaders);
+
+    const char *why = NULL;
+    bool same = roundTrip(jpeg, 1000, false, why);
+    if (!same) fprintf(stderr, "    %s: %s\n", cases[c].name, why);
+    CHECK(same);
+  }
+}
+
+// What RFC 2435 cannot describe is refused with a reason
+static void testRejected() {
+  testCase("rejected frames");
+  struct {
+    const char *name;
+    Options o;
+  } cases[] = {
+    {"grayscale", options(64, 64, 1, 1)},
+    {"4:4:4", options(64, 64, 1, 1)},
+    {"4:4:0", options(64, 64, 1, 2)},
+    {"optimized Huffman tables", options(64, 64, 2, 1)},
+    {"progressive", options(64, 64, 2, 1)},
+    {"wider than 2040", options(2048, 16, 2, 1)},
+  };
+  cases[0].o.components = 1;
+  cases[3].o.optimize = true;
+  cases[4].o.progressive = true;
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    Bytes jpeg = encode(cases[c].o, 20 + (uint32_t)c);
+    RtpJpegFrame frame;
+    const char *why = rtpJpegParse(jpeg.data(), jpeg.size(), frame);
+    if (why == NULL) fprintf(stderr, "    %s accepted\n", cases[c].name);
+    CHECK(why != NULL);
+  }
+
+  Bytes jpeg = encode(options(64, 64, 2, 1), 30);
+  RtpJpegFrame frame;
+  CHECK(rtpJpegParse(jpeg.data(), 3, frame) != NULL);
+  CHECK(rtpJpegParse(jpeg.data() + 1, jpeg.size() - 1, frame) != NULL);
+  size_t start, end;
+  findScan(jpeg, start, end);
+  CHECK(rtpJpegParse(jpeg.data(), start - 10, frame) != NULL);   // cut inside the headers
+}
+
+// packetize() fails whole, without advancing the sequence, when a buffer
+// is short; bufferSize() is always enough
+static void testBuffers() {
+  testCase("buffers");
+  Bytes jpeg = encode(options(320, 240, 2, 1), 40);
+  RtpJpegFrame frame;
+  rtpJpegParse(jpeg.data(), jpeg.size(), frame);
+  RtpJpegPacketizer packetizer;
+  packetizer.begin(SSRC, 500);
+  size_t capacity = RtpJpegPacketizer::bufferSize(frame.scanLength, 1400);
+  Bytes out(capacity);
+  uint16_t sizes[64];
+  uint16_t count = packetizer.packetize(frame, 0, 1400, out.data(), capacity, sizes, 64);
+  CHECK(count > 0);
+  size_t used = 0;
+  for (uint16_t i = 0; i < count; i++) used += sizes[i];
+  uint16_t sequence = packetizer.sequence();
+
+  CHECK_EQ(packetizer.packetize(frame, 0, 1400, out.data(), used - 1, sizes, 64), 0);
+  CHECK_EQ(packetizer.packetize(frame, 0, 1400, out.data(), capacity, sizes, count - 1), 0);
+  CHECK_EQ(packetizer.packetize(frame, 0, RTP_JPEG_MIN_PACKET - 1, out.data(), capacity, sizes, 64), 0);
+  CHECK_EQ(packetizer.sequence(), sequence);
+  CHECK_EQ(packetizer.packetize(frame, 0, 1400, out.data(), used, sizes, count), count);
+
+  // Any scan length and packet size fits in bufferSize()
+  int failures = 0;
+  for (int i = 0; i < 2000; i++) {
+    RtpJpegFrame f = frame;
+    f.scanLength = rnd() % (frame.scanLength + 1);
+    f.restartInterval = rnd() % 2 ? 0 : 8;
+    f.tableCount = (uint8_t)(1 + rnd() % 2);
+    size_t maxPacket = RTP_JPEG_MIN_PACKET + rnd() % 1300;
+    Sent s = send(packetizer, f, 0, maxPacket);
+    uint32_t total = 0;
+    for (uint16_t k = 0; k < s.count; k++) {
+      size_t header = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE + (f.restartInterval ? RTP_JPEG_RESTART_SIZE : 0) +
+                      (k == 0 ? RTP_JPEG_QTABLE_SIZE + 64 * f.tableCount : 0);
+      total += (uint32_t)(s.packets[k].data.size() - header);
+    }
+    if (s.count == 0 || total != f.scanLength) {
+      if (!failures) fprintf(stderr, "    scan %u, packets of %zu: %u packets\n", f.scanLength, maxPacket, s.count);
+      failures++;
+    }
+  }
+  CHECK_EQ(failures, 0);
+}
+
+// Random sizes, formats and packet sizes, delivered out of order
+static void testSweep() {
+  testCase("random sweep");
+  int failures = 0;
+  for (int i = 0; i < 150; i++) {
+    uint32_t seed = rnd();
+    int v = 1 + (int)(rnd() % 2);
+    Options o = options(16 * (1 + (int)(rnd() % 40)), 8 * v * (1 + (int)(rnd() % 30)), 2, v);
+    o.quality = 10 + (int)(rnd() % 90);
+    o.restartMcus = rnd() % 3 ? 0 : 1 + (int)(rnd() % 20);
+    o.oneTable = rnd() % 4 == 0;
+    size_t maxPacket = RTP_JPEG_MIN_PACKET + rnd() % 1300;
+    Bytes jpeg = encode(o, seed);
+    const char *why = NULL;
+    if (!roundTrip(jpeg, maxPacket, true, why)) {
+      if (!failures) {
+        fprintf(stderr, "    %dx%d v%d q%d restart %d, packets of %zu: %s\n", o.width, o.height, v, o.quality,
+                o.restartMcus, maxPacket, why);
+      }
+      failures++;
+    }
+  }
+  CHECK_EQ(failures, 0);
+}
+
+int main() {
+  testHeaders();
+  testFormats();
+  testRejected();
+  testBuffers();
+  testSweep();
+  return testSummary("test_rtp_jpeg");
+}
@@ -0,0 +1,352 @@
+/**
+ * WorkScheduler host test
+ *
+ * Runs src/work_scheduler.cpp on a simulated clock (shims/Arduino.h): the
+ * worker is a real thread, but it only wakes when the test moves the clock
+ * past its timeout or defer() notifies it, and the test waits for it to
+ * sleep again before checking anything. With the clock stepped 1 ms at a
+ * time every job must run in exactly the tick it was due:
+ *
+ * - jobs deferred out of order run in due order;
+ * - delays of one or more full wheel turns wait every turn;
+ * - cancelled jobs never run and free their entry once due;
+ * - a full table refuses the job, counts and logs it;
+ * - a slow job, or a worker that was not scheduled for seconds, delays the
+ *   jobs behind it without reordering them, and the lateness is reported;
+ * - random defers, cancels and clock steps against a model.
+ */
+
+#include "work_scheduler.h"
+#include "test.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static uint32_t rngState = 0x1F2E3D4Cu;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// The scheduler logs through the real logger header; these stand in for
+// logger.cpp and count warnings
+static uint32_t warnings = 0;
+
+Logger logger;
+
+Logger::Logger() : minLevel(LOG_LEVEL_DEBUG) {}
+
+void Logger::push(LogLevel level, LogTag, const char *, const char *, const uint32_t *, uint8_t) {
+  if (level == LOG_LEVEL_WARN) warnings++;
+}
+
+// One deferred job as the test expects it to behave
+struct Expected {
+  uint32_t id;
+  uint32_t dueTick;
+  uint32_t stallMs;          // the job moves the clock this far while it runs
+  bool cancelled;
+  uint32_t runs;
+  uint32_t ranTick;
+};
+
+static std::vector<Expected *> runOrder;   // written by the worker thread
+
+static uint32_t nowTick() {
+  return (uint32_t)(micros() / (SCHEDULER_TICK_MS * 1000));
+}
+
+static void recordRun(void *context) {
+  Expected *job = (Expected *)context;
+  job->runs++;
+  job->ranTick = nowTick();
+  runOrder.push_back(job);
+  if (job->stallMs) hostAdvanceMicros((uint64_t)job->stallMs * 1000);
+}
+
+// Defers job, filling in the tick it must run in. A delay of 0 runs in the
+// current tick unless the worker already visited it, then in the next one
+static uint32_t deferJob(Expected &job, uint32_t delayMs, uint32_t stallMs = 0) {
+  job.dueTick = nowTick() + (delayMs + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS;
+  job.stallMs = stallMs;
+  job.cancelled = false;
+  job.runs = 0;
+  job.ranTick = 0;
+  job.id = workScheduler.defer("test", recordRun, &job, delayMs);
+  hostSettle();
+  if (delayMs == 0 && job.runs == 0) job.dueTick++;
+  return job.id;
+}
+
+// Moves the clock 1 ms at a time, letting the worker run after each step
+static void advance(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i++) {
+    hostAdvanceMicros(1000);
+    hostSettle();
+  }
+}
+
+// Moves the clock in one step, as if the worker was not scheduled meanwhile
+static void jump(uint32_t ms) {
+  hostAdvanceMicros((uint64_t)ms * 1000);
+  hostSettle();
+}
+
+static uint32_t statusValue(const char *key) {
+  JsonDocument doc;
+  JsonObject status = doc.to<JsonObject>();
+  workScheduler.reportStatus(status);
+  return status[key].as<uint32_t>();
+}
+
+static void testBeforeBegin() {
+  testCase("defer before begin");
+  Expected job;
+  CHECK_EQ(workScheduler.defer("early", recordRun, &job, 10), 0);
+  CHECK_EQ(statusValue("running"), 0);
+}
+
+static void testDueOrder() {
+  testCase("jobs run in due order, each in its tick");
+  static const uint32_t DELAYS[] = {250, 0, 95, 10, 300, 1, 9, 11, 150, 20};
+  const size_t count = sizeof(DELAYS) / sizeof(DELAYS[0]);
+  Expected jobs[count];
+  runOrder.clear();
+  for (size_t i = 0; i < count; i++) {
+    CHECK(deferJob(jobs[i], DELAYS[i]) != 0);
+  }
+  CHECK_EQ(statusValue("pending"), count);
+  advance(320);
+
+  uint32_t failures = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (jobs[i].runs != 1 || jobs[i].ranTick != jobs[i].dueTick) {
+      if (!failures) {
+        fprintf(stderr, "delay %u: %u runs, tick %u, due %u\n", DELAYS[i], jobs[i].runs, jobs[i].ranTick,
+                jobs[i].dueTick);
+      }
+      failures++;
+    }
+  }
+  for (size_t i = 1; i < runOrder.size(); i++) {
+    if (runOrder[i]->dueTick < runOrder[i - 1]->dueTick) failures++;
+  }
+  CHECK_EQ(failures, 0);
+  CHECK_EQ(runOrder.size(), count);
+  CHECK_EQ(statusValue("pending"), 0);
+}
+
+static void testMultiTurn() {
+  testCase("delays past one wheel turn");
+  const uint32_t turnMs = SCHEDULER_WHEEL_SLOTS * SCHEDULER_TICK_MS;
+  const uint32_t delays[] = {turnMs - SCHEDULER_TICK_MS, turnMs, turnMs + 1, 2 * turnMs, 3 * turnMs + 70,
+                             5000, 5000 + turnMs};
+  const size_t count = sizeof(delays) / sizeof(delays[0]);
+  Expected jobs[count];
+  runOrder.clear();
+  for (size_t i = 0; i < count; i++) deferJob(jobs[i], delays[i]);
+
+  // Nothing may run a turn early: step to just before each due tick, then
+  // through it (the worker wakes a whole number of ticks after it last
+  // looked, so anywhere inside the tick)
+  uint32_t failures = 0;
+  for (size_t i = 0; i < count; i++) {
+    while (nowTick() + 1 < jobs[i].dueTick) advance(1);
+    if (jobs[i].runs != 0) failures++;
+    while (nowTick() <= jobs[i].dueTick) advance(1);
+    if (jobs[i].runs != 1 || jobs[i].ranTick != jobs[i].dueTick) {
+      if (!failures) {
+        fprintf(stderr, "delay %u: %u runs, tick %u, due %u\n", delays[i], jobs[i].runs, jobs[i].ranTick,
+                jobs[i].dueTick);
+      }
+      failures++;
+    }
+  }
+  CHECK_EQ(failures, 0);
+  CHECK_EQ(runOrder.size(), count);
+}
+
+static void testCancel() {
+  testCase("cancel");
+  Expected a, b, c;
+  runOrder.clear();
+  uint32_t cancelledBefore = statusValue("jobs_cancelled");
+  deferJob(a, 50);
+  deferJob(b, 50);
+  deferJob(c, 80);
+  CHECK(a.id != b.id && b.id != c.id);
+  CHECK(workScheduler.cancel(b.id));
+  CHECK(!workScheduler.cancel(b.id));
+  CHECK(!workScheduler.cancel(0));
+  CHECK_EQ(statusValue("pending"), 2);
+  advance(60);
+  CHECK_EQ(a.runs, 1);
+  CHECK_EQ(b.runs, 0);
+  CHECK(!workScheduler.cancel(a.id));   // already ran
+  CHECK(workScheduler.cancel(c.id));
+  advance(100);
+  CHECK_EQ(c.runs, 0);
+  CHECK_EQ(runOrder.size(), 1);
+  CHECK_EQ(statusValue("jobs_cancelled") - cancelledBefore, 2);
+
+  // Cancelled entries were freed when they came due: the whole table is free
+  Expected jobs[SCHEDULER_MAX_JOBS];
+  uint32_t refused = 0;
+  for (int i = 0; i < SCHEDULER_MAX_JOBS; i++) {
+    if (!deferJob(jobs[i], 30)) refused++;
+  }
+  CHECK_EQ(refused, 0);
+  advance(40);
+}
+
+static void testFullTable() {
+  testCase("full table");
+  Expected jobs[SCHEDULER_MAX_JOBS + 1];
+  runOrder.clear();
+  uint32_t fullBefore = statusValue("table_full");
+  uint32_t warningsBefore = warnings;
+  for (int i = 0; i < SCHEDULER_MAX_JOBS; i++) {
+    CHECK(deferJob(jobs[i], 100 + i) != 0);
+  }
+  CHECK_EQ(deferJob(jobs[SCHEDULER_MAX_JOBS], 10), 0);
+  CHECK_EQ(statusValue("table_full") - fullBefore, 1);
+  CHECK_EQ(warnings - warningsBefore, 1);
+  CHECK_EQ(statusValue("pending"), SCHEDULER_MAX_JOBS);
+
+  // The first job to run frees an entry
+  advance(100);
+  CHECK_EQ(jobs[0].runs, 1);
+  CHECK(deferJob(jobs[SCHEDULER_MAX_JOBS], 10) != 0);
+  advance(30);
+  CHECK_EQ(runOrder.size(), SCHEDULER_MAX_JOBS + 1);
+}
+
+static void testStall() {
+  testCase("a slow job and a worker held off for seconds");
+  Expected slow, after[3];
+  runOrder.clear();
+  deferJob(slow, 100, 250);
+  deferJob(after[0], 300);
+  deferJob(after[1], 200);
+  deferJob(after[2], 150);
+  advance(400);
+
+  // The three ran straight after the slow job, in due order; the one due
+  // 50 ms after it started is the latest
+  CHECK_EQ(runOrder.size(), 4);
+  CHECK(runOrder.size() == 4 && runOrder[0] == &slow && runOrder[1] == &after[2] && runOrder[2] == &after[1] &&
+        runOrder[3] == &after[0]);
+  CHECK_EQ(after[2].ranTick, slow.dueTick + 25);
+  CHECK_EQ(statusValue("max_job_ms"), 250);
+  CHECK_EQ(statusValue("max_late_ms"), (after[2].ranTick - after[2].dueTick) * SCHEDULER_TICK_MS);
+
+  // The clock moves 3 s in one step: every job due meanwhile runs in due
+  // order, including those more than a wheel turn apart
+  Expected held[6];
+  const uint32_t delays[] = {2900, 40, 700, 1200, 330, 3100};
+  runOrder.clear();
+  for (int i = 0; i < 6; i++) deferJob(held[i], delays[i]);
+  jump(3000);
+  CHECK_EQ(runOrder.size(), 5);
+  uint32_t failures = 0;
+  for (size_t i = 1; i < runOrder.size(); i++) {
+    if (runOrder[i]->dueTick < runOrder[i - 1]->dueTick) failures++;
+  }
+  CHECK_EQ(failures, 0);
+  CHECK_EQ(held[5].runs, 0);
+  advance(100);
+  CHECK_EQ(held[5].runs, 1);
+  CHECK_EQ(held[5].ranTick, held[5].dueTick);
+}
+
+static void testRandom() {
+  testCase("random defers, cancels and steps against a model");
+  const int ROUNDS = 3000;
+  std::vector<Expected> jobs(ROUNDS);
+  std::vector<Expected *> live;
+  uint32_t failures = 0;
+  uint32_t deferred = 0;
+  bool jumped = false;
+  runOrder.clear();
+
+  for (int round = 0; round < ROUNDS; round++) {
+    uint32_t action = rnd() % 10;
+    if (action < 5) {
+      Expected &job = jobs[deferred];
+      uint32_t delay = rnd() % 4 == 0 ? rnd() % 3000 : rnd() % 120;
+      bool room = live.size() < SCHEDULER_MAX_JOBS;
+      bool accepted = deferJob(job, delay) != 0;
+      if (accepted != room) {
+        if (!failures) fprintf(stderr, "round %d: defer %s with %zu live\n", round, accepted ? "accepted" : "refused",
+                               live.size());
+        failures++;
+      }
+      if (accepted) {
+        live.push_back(&job);
+        deferred++;
+      }
+    } else if (action < 6 && !live.empty()) {
+      Expected *job = live[rnd() % live.size()];
+      bool expected = !job->cancelled && job->runs == 0;
+      if (workScheduler.cancel(job->id) != expected) failures++;
+      job->cancelled = true;
+    } else if (action < 7) {
+      jump(rnd() % 700);
+      jumped = true;
+    } else {
+      advance(1 + rnd() % 40);
+    }
+
+    // Entries leave the table once they ran, or once a cancelled one is due
+    for (size_t i = 0; i < live.size();) {
+      Expected *job = live[i];
+      bool gone = job->runs || (job->cancelled && nowTick() >= job->dueTick);
+      if (gone) {
+        live[i] = live.back();
+        live.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+  advance(3100);
+
+  for (uint32_t i = 0; i < deferred; i++) {
+    const Expected &job = jobs[i];
+    bool ok = job.cancelled ? job.runs == 0 : job.runs == 1 && job.ranTick >= job.dueTick;
+    if (!ok) {
+      if (!failures) fprintf(stderr, "job %u: %u runs, tick %u, due %u\n", i, job.runs, job.ranTick, job.dueTick);
+      failures++;
+    }
+  }
+  uint32_t late = 0;
+  for (size_t i = 0; i < runOrder.size(); i++) {
+    if (i && runOrder[i]->dueTick < runOrder[i - 1]->dueTick) failures++;
+    if (runOrder[i]->ranTick != runOrder[i]->dueTick) late++;
+  }
+  CHECK_EQ(failures, 0);
+  // Only the clock jumps make jobs late
+  CHECK(jumped || late == 0);
+  printf("    %u jobs, %zu ran, %u late after clock jumps\n", deferred, runOrder.size(), late);
+}
+
+int main() {
+  // Start off a tick boundary, like a clock that has run since boot
+  hostAdvanceMicros(12345678);
+  testBeforeBegin();
+  CHECK(workScheduler.begin());
+  hostSettle();
+  CHECK_EQ(statusValue("running"), 1);
+
+  testDueOrder();
+  testMultiTurn();
+  testCancel();
+  testFullTable();
+  testStall();
+  testRandom();
+  return testSummary("test_work_scheduler");
+}
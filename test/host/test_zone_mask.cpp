@@ -0,0 +1,253 @@
+/**
+ * Zone mask host test
+ *
+ * Rasterizes zone sets with ZoneMask::compile() and compares every form of
+ * the mask with a brute-force even-odd test at each pixel centre:
+ *
+ * - hand-made sets: no zones, one include rectangle, an exclude hole in it,
+ *   a frame wholly excluded, polygons with fewer than 3 points;
+ * - 500 random sets (up to 4 polygons of 3-12 points, some of them
+ *   self-intersecting, at sizes up to 120x90), where the bitmap, the
+ *   per-row spans and the active count must all agree with the brute force;
+ * - zoneContains() at random per-mille points.
+ */
+
+#include "zone_mask.h"
+#include "test.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t rngState = 0x2545F491u;
+
+static uint32_t rnd() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static ZonePolygon rectangle(bool exclude, uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
+  ZonePolygon zone;
+  memset(&zone, 0, sizeof(zone));
+  zone.exclude = exclude;
+  zone.pointCount = 4;
+  ZonePoint points[4] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+  memcpy(zone.points, points, sizeof(points));
+  return zone;
+}
+
+// Even-odd test of a point given in per-mille floats, written out apart
+// from the rasterizer: a crossing counts when the edge straddles y (one end
+// at or below it) and meets the row right of x
+static bool bruteContains(const ZonePolygon &zone, float x, float y) {
+  bool inside = false;
+  for (int i = 0; i < zone.pointCount; i++) {
+    const ZonePoint &p = zone.points[i];
+    const ZonePoint &q = zone.points[(i + zone.pointCount - 1) % zone.pointCount];
+    if ((p.y <= y) == (q.y <= y)) continue;
+    float crossX = p.x + (y - p.y) * ((float)q.x - p.x) / ((float)q.y - p.y);
+    if (x < crossX) inside = !inside;
+  }
+  return inside;
+}
+
+static bool bruteActive(const ZonePolygon *zones, uint8_t count, uint16_t width, uint16_t height,
+                        uint16_t x, uint16_t y) {
+  float cx = (x + 0.5f) * ZONE_COORD_MAX / width;
+  float cy = (y + 0.5f) * ZONE_COORD_MAX / height;
+  bool anyInclude = false;
+  bool included = false;
+  for (uint8_t z = 0; z < count; z++) {
+    if (zones[z].pointCount < 3) continue;
+    if (zones[z].exclude) {
+      if (bruteContains(zones[z], cx, cy)) return false;
+    } else {
+      anyInclude = true;
+      if (bruteContains(zones[z], cx, cy)) included = true;
+    }
+  }
+  return !anyInclude || included;
+}
+
+// Compares bitmap, spans and count with the brute force; prints the first
+// mismatch and returns the number of differing pixels
+static uint32_t compare(const ZoneMask &mask, const ZonePolygon *zones, uint8_t count, const char *name) {
+  uint16_t width = mask.width();
+  uint16_t height = mask.height();
+  uint32_t wrong = 0;
+  uint32_t active = 0;
+  for (uint16_t y = 0; y < height; y++) {
+    // Spans must be non-empty, in order and separated by at least one
+    // inactive pixel, and cover exactly the set bits
+    uint16_t spanCount;
+    const ZoneSpan *spans = mask.rowSpans(y, spanCount);
+    bool fromSpans[1024] = {false};
+    for (uint16_t s = 0; s < spanCount; s++) {
+      bool ordered = spans[s].x0 < spans[s].x1 && spans[s].x1 <= width &&
+                     (s == 0 || spans[s - 1].x1 < spans[s].x0);
+      if (!ordered) {
+        if (!wrong) fprintf(stderr, "%s: row %u span %u [%u, %u) out of order\n", name, y, s, spans[s].x0, spans[s].x1);
+        wrong++;
+        continue;
+      }
+      for (uint16_t x = spans[s].x0; x < spans[s].x1; x++) fromSpans[x] = true;
+    }
+
+    // Padding bits past the width stay clear
+    const uint32_t *row = mask.row(y);
+    for (uint16_t x = width; x < (width + 31) / 32 * 32; x++) {
+      if ((row[x >> 5] >> (x & 31)) & 1) {
+        if (!wrong) fprintf(stderr, "%s: padding bit %u of row %u set\n", name, x, y);
+        wrong++;
+      }
+    }
+
+    for (uint16_t x = 0; x < width; x++) {
+      bool expected = bruteActive(zones, count, width, height, x, y);
+      if (expected) active++;
+      if (mask.test(x, y) != expected || fromSpans[x] != expected) {
+        if (!wrong) {
+          fprintf(stderr, "%s: pixel (%u, %u) of %ux%u: bit %d, spans %d, expected %d\n", name, x, y, width, height,
+                  mask.test(x, y), fromSpans[x], expected);
+        }
+        wrong++;
+      }
+    }
+  }
+  if (mask.activePixels() != active) {
+    fprintf(stderr, "%s: %u active pixels, expected %u\n", name, mask.activePixels(), active);
+    wrong++;
+  }
+  return wrong;
+}
+
+static void testHandMade() {
+  testCase("hand-made zone sets");
+  ZoneMask mask;
+
+  CHECK(!mask.compile(NULL, 0, 0, 10));
+  CHECK(!mask.compiled());
+
+  // No zones: every pixel is active and each row is one span
+  CHECK(mask.compile(NULL, 0, 37, 5));
+  CHECK(mask.full());
+  CHECK_EQ(mask.activePixels(), 37 * 5);
+  uint16_t spanCount;
+  const ZoneSpan *spans = mask.rowSpans(4, spanCount);
+  CHECK_EQ(spanCount, 1);
+  CHECK_EQ(spans[0].x0, 0);
+  CHECK_EQ(spans[0].x1, 37);
+
+  // Centres of an 8x8 mask sit at 62.5 + 125k per mille, so [250, 750]
+  // covers pixels 2..5 on both axes
+  ZonePolygon zones[3];
+  zones[0] = rectangle(false, 250, 250, 750, 750);
+  CHECK(mask.compile(zones, 1, 8, 8));
+  CHECK(!mask.full());
+  CHECK_EQ(mask.activePixels(), 16);
+  CHECK(mask.test(2, 2) && mask.test(5, 5));
+  CHECK(!mask.test(1, 2) && !mask.test(6, 5) && !mask.test(3, 1) && !mask.test(3, 6));
+  CHECK_EQ(compare(mask, zones, 1, "include rectangle"), 0);
+
+  // An exclude hole over pixels 3..4 of rows 3..4 splits those rows in two
+  zones[1] = rectangle(true, 375, 375, 625, 625);
+  CHECK(mask.compile(zones, 2, 8, 8));
+  CHECK_EQ(mask.activePixels(), 12);
+  spans = mask.rowSpans(3, spanCount);
+  CHECK_EQ(spanCount, 2);
+  CHECK_EQ(spans[0].x0, 2);
+  CHECK_EQ(spans[0].x1, 3);
+  CHECK_EQ(spans[1].x0, 5);
+  CHECK_EQ(spans[1].x1, 6);
+  CHECK_EQ(compare(mask, zones, 2, "exclude hole"), 0);
+
+  // A frame wholly excluded has no active pixel and no spans
+  zones[2] = rectangle(true, 0, 0, 1000, 1000);
+  CHECK(mask.compile(zones, 3, 50, 20));
+  CHECK_EQ(mask.activePixels(), 0);
+  mask.rowSpans(10, spanCount);
+  CHECK_EQ(spanCount, 0);
+
+  // Polygons with fewer than 3 points are ignored, include or exclude
+  zones[0].pointCount = 2;
+  zones[1].pointCount = 2;
+  CHECK(mask.compile(zones, 2, 16, 16));
+  CHECK(mask.full());
+
+  mask.clear();
+  CHECK(!mask.compiled());
+}
+
+static ZonePolygon randomZone() {
+  ZonePolygon zone;
+  memset(&zone, 0, sizeof(zone));
+  zone.exclude = rnd() % 3 == 0;
+  zone.pointCount = 3 + rnd() % (ZONE_MAX_POINTS - 2);
+  // Half the polygons are star-shaped around a centre (simple), the rest
+  // are random points (mostly self-intersecting)
+  bool star = rnd() & 1;
+  uint16_t cx = rnd() % (ZONE_COORD_MAX + 1);
+  uint16_t cy = rnd() % (ZONE_COORD_MAX + 1);
+  for (uint8_t i = 0; i < zone.pointCount; i++) {
+    if (star) {
+      float angle = 6.2831853f * (i + (rnd() % 100) / 100.0f) / zone.pointCount;
+      float radius = 50 + rnd() % 500;
+      int32_t x = cx + (int32_t)(radius * cosf(angle));
+      int32_t y = cy + (int32_t)(radius * sinf(angle));
+      zone.points[i].x = x < 0 ? 0 : (x > ZONE_COORD_MAX ? ZONE_COORD_MAX : x);
+      zone.points[i].y = y < 0 ? 0 : (y > ZONE_COORD_MAX ? ZONE_COORD_MAX : y);
+    } else {
+      zone.points[i].x = rnd() % (ZONE_COORD_MAX + 1);
+      zone.points[i].y = rnd() % (ZONE_COORD_MAX + 1);
+    }
+  }
+  return zone;
+}
+
+static void testRandomSets() {
+  testCase("500 random zone sets against the brute force");
+  uint32_t failures = 0;
+  uint64_t pixels = 0;
+  ZoneMask mask;
+  for (int set = 0; set < 500; set++) {
+    ZonePolygon zones[4];
+    uint8_t count = rnd() % 5;
+    for (uint8_t z = 0; z < count; z++) zones[z] = randomZone();
+    uint16_t width = 1 + rnd() % 120;
+    uint16_t height = 1 + rnd() % 90;
+    if (!mask.compile(zones, count, width, height)) {
+      fprintf(stderr, "set %d: compile failed\n", set);
+      failures++;
+      continue;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "set %d", set);
+    if (compare(mask, zones, count, name)) failures++;
+    pixels += (uint64_t)width * height;
+  }
+  CHECK_EQ(failures, 0);
+  printf("    %llu pixels compared\n", (unsigned long long)pixels);
+}
+
+static void testContains() {
+  testCase("zoneContains at random points");
+  uint32_t failures = 0;
+  for (int i = 0; i < 20000; i++) {
+    ZonePolygon zone = randomZone();
+    uint16_t x = rnd() % (ZONE_COORD_MAX + 1);
+    uint16_t y = rnd() % (ZONE_COORD_MAX + 1);
+    if (zoneContains(zone, x, y) != bruteContains(zone, x, y)) {
+      if (!failures) fprintf(stderr, "point (%u, %u): zoneContains %d\n", x, y, zoneContains(zone, x, y));
+      failures++;
+    }
+  }
+  CHECK_EQ(failures, 0);
+}
+
+int main() {
+  testHandMade();
+  testRandomSets();
+  testContains();
+  return testSummary("test_zone_mask");
+}
@@ -0,0 +1,457 @@
+#!/usr/bin/env python3
+"""
+Builds compressed and delta OTA images for the ESP32-CAM firmware.
+
+The device (src/ota_decoder.cpp) accepts, on both /api/firmware/upload and
+/api/firmware/stage:
+
+  raw         plain ESP32 image (.pio/build/<env>/firmware.bin)
+  gzip        RFC 1952 gzip of a raw image or delta
+  heatshrink  "HSHK" header + heatshrink LZSS stream
+  delta       "ODLT" header + bsdiff-style records against the running image
+
+Usage:
+  ota_image.py gzip NEW.bin OUT
+  ota_image.py heatshrink NEW.bin OUT [--window 10] [--lookahead 4]
+  ota_image.py delta OLD.bin NEW.bin OUT [--compress gzip|heatshrink|none]
+  ota_image.py apply IMAGE OUT [--old OLD.bin]
+  ota_image.py roundtrip NEW.bin [--old OLD.bin]
+  ota_image.py sign IMAGE KEY.pem OUT
+  ota_image.py verify IMAGE [--pubkey PUB.pem]
+
+"roundtrip" builds every applicable format, decodes it again with the
+reference decoder below and prints size, ratio and timing for each.
+
+"sign" appends a detached signature trailer (src/ota_verifier.h) to any of
+the formats above; signing and verification use the openssl command line:
+
+  openssl ecparam -name prime256v1 -genkey -noout -out ota_key.pem
+  openssl ec -in ota_key.pem -pubout -out ota_pub.pem
+"""
+
+import argparse
+import gzip
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+HEATSHRINK_MAGIC = b"HSHK"
+DELTA_MAGIC = b"ODLT"
+DELTA_VERSION = 1
+ESP32_IMAGE_MAGIC = 0xE9
+SIGNATURE_MAGIC = b"OSIG"
+SIGNATURE_MAX = 512
+
+DELTA_KEY = 8            # bytes hashed to find match candidates in OLD
+DELTA_MIN_MATCH = 32     # shorter approximate matches are emitted as extra
+DELTA_FUZZ = 256         # stop extending after this many bytes without gain
+
+
+def crc32(data):
+    return zlib.crc32(data) & 0xFFFFFFFF
+
+
+# ---------------------------------------------------------------------------
+# heatshrink
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.bits = 0
+
+    def put(self, value, count):
+        self.acc = (self.acc << count) | value
+        self.bits += count
+        while self.bits >= 8:
+            self.bits -= 8
+            self.out.append((self.acc >> self.bits) & 0xFF)
+        self.acc &= (1 << self.bits) - 1
+
+    def finish(self):
+        if self.bits:
+            self.out.append((self.acc << (8 - self.bits)) & 0xFF)
+        return bytes(self.out)
+
+
+def heatshrink_compress(data, window_bits=10, lookahead_bits=4):
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    chains = {}
+    writer = BitWriter()
+    i = 0
+    n = len(data)
+    # a backref costs 1 + W + L bits against 9 per literal
+    min_len = (1 + window_bits + lookahead_bits) // 9 + 1
+
+    while i < n:
+        best_len = 0
+        best_dist = 0
+        if i + 3 <= n:
+            key = data[i:i + 3]
+            for cand in reversed(chains.get(key, ())[-16:]):
+                dist = i - cand
+                if dist > window:
+                    break
+                length = 0
+                while length < max_len and i + length < n and data[cand + length] == data[i + length]:
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, dist
+                    if length == max_len:
+                        break
+
+        step = best_len if best_len >= min_len else 1
+        for k in range(i, min(i + step, n - 2)):
+            chains.setdefault(data[k:k + 3], []).append(k)
+
+        if best_len >= min_len:
+            writer.put(0, 1)
+            writer.put(best_dist - 1, window_bits)
+            writer.put(best_len - 1, lookahead_bits)
+        else:
+            writer.put(1, 1)
+            writer.put(data[i], 8)
+        i += step
+
+    header = HEATSHRINK_MAGIC + struct.pack("<BBHII", window_bits, lookahead_bits, 0, len(data), crc32(data))
+    return header + writer.finish()
+
+
+def heatshrink_expand(image):
+    window_bits, lookahead_bits, _, size, crc = struct.unpack_from("<BBHII", image, 4)
+    out = bytearray()
+    acc = 0
+    bits = 0
+    pos = 16
+
+    def get(count):
+        nonlocal acc, bits, pos
+        while bits < count:
+            if pos >= len(image):
+                raise ValueError("truncated heatshrink stream")
+            acc = (acc << 8) | image[pos]
+            pos += 1
+            bits += 8
+        bits -= count
+        value = (acc >> bits) & ((1 << count) - 1)
+        acc &= (1 << bits) - 1
+        return value
+
+    while len(out) < size:
+        if get(1):
+            out.append(get(8))
+        else:
+            dist = get(window_bits) + 1
+            length = get(lookahead_bits) + 1
+            for _ in range(min(length, size - len(out))):
+                out.append(out[-dist] if dist <= len(out) else 0)
+    if crc32(out) != crc:
+        raise ValueError("heatshrink CRC mismatch")
+    return bytes(out)
+
+
+# ---------------------------------------------------------------------------
+# delta
+
+
+def extend(old, new, j, i):
+    """Approximate match length at new[i]/old[j], scored as 2*equal - length."""
+    limit = min(len(old) - j, len(new) - i)
+    best_len = 0
+    best_score = 0
+    score = 0
+    since_best = 0
+    for k in range(limit):
+        score += 1 if old[j + k] == new[i + k] else -1
+        if score > best_score:
+            best_score, best_len = score, k + 1
+            since_best = 0
+        else:
+            since_best += 1
+            if since_best > DELTA_FUZZ:
+                break
+    return best_len
+
+
+def delta_encode(old, new):
+    index = {}
+    for j in range(len(old) - DELTA_KEY, -1, -1):
+        index[old[j:j + DELTA_KEY]] = j
+
+    records = []
+    diff_old, diff_len = 0, 0
+    lit_start = 0
+    i = 0
+    while i < len(new):
+        candidates = []
+        # keep the previous alignment: code moved by a constant offset
+        follow = diff_old + diff_len + (i - lit_start)
+        if diff_len and follow < len(old):
+            same = sum(1 for k in range(min(16, len(old) - follow, len(new) - i)) if old[follow + k] == new[i + k])
+            if same >= 8:
+                candidates.append(follow)
+        hit = index.get(new[i:i + DELTA_KEY])
+        if hit is not None and hit not in candidates:
+            candidates.append(hit)
+
+        best_j, best_len = 0, 0
+        for j in candidates:
+            length = extend(old, new, j, i)
+            if length > best_len:
+                best_j, best_len = j, length
+
+        if best_len >= DELTA_MIN_MATCH:
+            extra = new[lit_start:i]
+            seek = best_j - (diff_old + diff_len)
+            records.append((diff_old, diff_len, extra, seek))
+            diff_old, diff_len = best_j, best_len
+            i += best_len
+            lit_start = i
+        else:
+            i += 1
+    records.append((diff_old, diff_len, new[lit_start:], 0))
+
+    out = bytearray(DELTA_MAGIC)
+    out += struct.pack("<B3xIIII", DELTA_VERSION, len(old), crc32(old), len(new), crc32(new))
+    new_pos = 0
+    for old_pos, length, extra, seek in records:
+        if length == 0 and not extra and seek == 0:
+            continue
+        out += struct.pack("<IIi", length, len(extra), seek)
+        out += bytes((new[new_pos + k] - old[old_pos + k]) & 0xFF for k in range(length))
+        out += extra
+        new_pos += length + len(extra)
+    return bytes(out)
+
+
+def delta_apply(patch, old):
+    _, version, old_size, old_crc, new_size, new_crc = struct.unpack_from("<4sB3xIIII", patch, 0)
+    if version != DELTA_VERSION:
+        raise ValueError("unsupported delta version")
+    if old is None:
+        raise ValueError("delta image needs --old")
+    if len(old) != old_size or crc32(old) != old_crc:
+        raise ValueError("delta was built for a different base image")
+
+    out = bytearray()
+    pos = 24
+    old_pos = 0
+    while pos < len(patch):
+        diff_len, extra_len, seek = struct.unpack_from("<IIi", patch, pos)
+        pos += 12
+        out += bytes((patch[pos + k] + old[old_pos + k]) & 0xFF for k in range(diff_len))
+        pos += diff_len
+        old_pos += diff_len
+        out += patch[pos:pos + extra_len]
+        pos += extra_len
+        old_pos += seek
+    if len(out) != new_size or crc32(out) != new_crc:
+        raise ValueError("patched image CRC mismatch")
+    return bytes(out)
+
+
+# ---------------------------------------------------------------------------
+# container handling
+
+
+def compress(data, method, window_bits=10, lookahead_bits=4):
+    if method == "gzip":
+        return gzip.compress(data, compresslevel=9, mtime=0)
+    if method == "heatshrink":
+        return heatshrink_compress(data, window_bits, lookahead_bits)
+    return data
+
+
+# ---------------------------------------------------------------------------
+# signatures
+
+
+def split_signature(image):
+    """Returns (payload, signature or None), mirroring OtaVerifier::finish()."""
+    if len(image) >= 6 and image[-4:] == SIGNATURE_MAGIC:
+        length = struct.unpack_from("<H", image, len(image) - 6)[0]
+        if 0 < length <= SIGNATURE_MAX and length + 6 <= len(image):
+            return image[:-6 - length], image[-6 - length:-6]
+    return image, None
+
+
+def openssl(args, data):
+    with tempfile.NamedTemporaryFile(delete=False) as f:
+        f.write(data)
+        path = f.name
+    try:
+        return subprocess.run(["openssl"] + args + [path], capture_output=True)
+    finally:
+        os.unlink(path)
+
+
+def sign(image, key):
+    if split_signature(image)[1] is not None:
+        sys.exit("image is already signed")
+    result = openssl(["dgst", "-sha256", "-sign", key], image)
+    if result.returncode != 0:
+        sys.exit(result.stderr.decode(errors="replace"))
+    signature = result.stdout
+    if len(signature) > SIGNATURE_MAX:
+        sys.exit("signature too long (%d bytes)" % len(signature))
+    return image + signature + struct.pack("<H", len(signature)) + SIGNATURE_MAGIC
+
+
+def verify_signature(payload, signature, pubkey):
+    with tempfile.NamedTemporaryFile(delete=False) as f:
+        f.write(signature)
+        sig_path = f.name
+    try:
+        result = openssl(["dgst", "-sha256", "-verify", pubkey, "-signature", sig_path], payload)
+    finally:
+        os.unlink(sig_path)
+    return result.returncode == 0
+
+
+def decode(image, old=None):
+    """Reference decoder mirroring OtaDecoder; returns the final raw image."""
+    image = split_signature(image)[0]
+    if image[:2] == b"\x1f\x8b":
+        image = gzip.decompress(image)
+    elif image[:4] == HEATSHRINK_MAGIC:
+        image = heatshrink_expand(image)
+
+    if image[:4] == DELTA_MAGIC:
+        image = delta_apply(image, old)
+    if not image or image[0] != ESP32_IMAGE_MAGIC:
+        raise ValueError("decoded payload is not an ESP32 image")
+    return image
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def check_image(data, path):
+    if not data or data[0] != ESP32_IMAGE_MAGIC:
+        sys.exit("%s is not an ESP32 image (expected magic 0xE9)" % path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("gzip", help="gzip a raw image")
+    p.add_argument("new")
+    p.add_argument("out")
+
+    p = sub.add_parser("heatshrink", help="heatshrink a raw image")
+    p.add_argument("new")
+    p.add_argument("out")
+    p.add_argument("--window", type=int, default=10)
+    p.add_argument("--lookahead", type=int, default=4)
+
+    p = sub.add_parser("delta", help="build a delta from OLD to NEW")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("out")
+    p.add_argument("--compress", choices=("gzip", "heatshrink", "none"), default="gzip")
+
+    p = sub.add_parser("apply", help="decode any image with the reference decoder")
+    p.add_argument("image")
+    p.add_argument("out")
+    p.add_argument("--old")
+
+    p = sub.add_parser("roundtrip", help="build and verify every format, print stats")
+    p.add_argument("new")
+    p.add_argument("--old")
+
+    p = sub.add_parser("sign", help="append a signature trailer to an image")
+    p.add_argument("image")
+    p.add_argument("key")
+    p.add_argument("out")
+
+    p = sub.add_parser("verify", help="print the SHA-256 the device reports and check the signature")
+    p.add_argument("image")
+    p.add_argument("--pubkey")
+
+    args = parser.parse_args()
+
+    if args.command in ("gzip", "heatshrink"):
+        new = read(args.new)
+        check_image(new, args.new)
+        if args.command == "gzip":
+            image = compress(new, "gzip")
+        else:
+            image = compress(new, "heatshrink", args.window, args.lookahead)
+        write(args.out, image)
+        print("%s: %d -> %d bytes (%.1f%%)" % (args.command, len(new), len(image), 100.0 * len(image) / len(new)))
+
+    elif args.command == "delta":
+        old, new = read(args.old), read(args.new)
+        check_image(old, args.old)
+        check_image(new, args.new)
+        patch = delta_encode(old, new)
+        image = compress(patch, args.compress)
+        write(args.out, image)
+        print("delta: %d -> %d bytes (%.1f%%), uncompressed patch %d bytes"
+              % (len(new), len(image), 100.0 * len(image) / len(new), len(patch)))
+
+    elif args.command == "apply":
+        old = read(args.old) if args.old else None
+        raw = decode(read(args.image), old)
+        write(args.out, raw)
+        print("decoded %d bytes, crc32 %08x" % (len(raw), crc32(raw)))
+
+    elif args.command == "roundtrip":
+        new = read(args.new)
+        check_image(new, args.new)
+        old = read(args.old) if args.old else None
+        builds = [("gzip", lambda: compress(new, "gzip")),
+                  ("heatshrink", lambda: compress(new, "heatshrink"))]
+        if old is not None:
+            builds += [("delta+%s" % m, lambda m=m: compress(delta_encode(old, new), m))
+                       for m in ("none", "gzip", "heatshrink")]
+
+        print("%-16s %10s %8s %10s %10s" % ("format", "bytes", "ratio", "build ms", "decode ms"))
+        print("%-16s %10d %7.1f%% %10s %10s" % ("raw", len(new), 100.0, "-", "-"))
+        for name, build in builds:
+            t0 = time.time()
+            image = build()
+            t1 = time.time()
+            if decode(image, old) != new:
+                sys.exit("%s: roundtrip mismatch" % name)
+            t2 = time.time()
+            print("%-16s %10d %7.1f%% %10d %10d"
+                  % (name, len(image), 100.0 * len(image) / len(new), (t1 - t0) * 1000, (t2 - t1) * 1000))
+
+    elif args.command == "sign":
+        image = sign(read(args.image), args.key)
+        write(args.out, image)
+        print("signed: %d bytes, sha256 %s" % (len(image), hashlib.sha256(split_signature(image)[0]).hexdigest()))
+
+    elif args.command == "verify":
+        payload, signature = split_signature(read(args.image))
+        print("sha256 %s (%d bytes)" % (hashlib.sha256(payload).hexdigest(), len(payload)))
+        if signature is None:
+            print("signature: none")
+            sys.exit(1 if args.pubkey else 0)
+        if not args.pubkey:
+            print("signature: present (%d bytes), not checked" % len(signature))
+        elif verify_signature(payload, signature, args.pubkey):
+            print("signature: valid")
+        else:
+            print("signature: INVALID")
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
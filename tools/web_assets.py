@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+"""
+Generates src/web_manifest.h, the table of web assets served by the
+firmware (src/web_assets.cpp), from the files in data/web.
+
+Each file becomes one entry: URL "/<name>", path "/web/<name>" on the SD
+card, and MIME type and Cache-Control by extension. (The ETag is not part
+of the table: the firmware derives it from the size and modification time
+of the file it actually serves from the card.) The entries are placed in
+a perfect-hash table: the seed of a 32-bit FNV-1a hash is searched until
+every URL lands in a slot of its own, so the firmware resolves a URL with
+one hash and one string compare. The firmware recomputes the placement at
+compile time and refuses to build if the table was edited by hand or
+generated with a different hash.
+
+Usage:
+  web_assets.py [--web data/web] [--out src/web_manifest.h] [--check]
+
+"--check" exits with status 1 if the header is out of date instead of
+writing it. The script also runs as a PlatformIO pre-build script
+(extra_scripts in platformio.ini), so the header follows data/web on every
+build; the file is rewritten only when its content changes.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+FNV_PRIME = 16777619
+MAX_ASSETS = 127         # slot indices are int8_t
+MAX_SEEDS = 1 << 20      # per table size, before trying a larger one
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".ico": "image/x-icon",
+    ".txt": "text/plain",
+}
+
+# Pages revalidate on every load so a new copy on the SD card shows up at
+# once; scripts and styles are reused for an hour without asking.
+CACHE_CONTROL = {
+    ".html": "no-cache",
+    ".css": "public, max-age=3600",
+    ".js": "public, max-age=3600",
+}
+DEFAULT_CACHE_CONTROL = "no-cache"
+
+NAME_PATTERN = re.compile(r"^[A-Za-z0-9_.-]+$")
+
+
+def fnv1a(text, seed):
+    h = seed
+    for byte in text.encode("ascii"):
+        h = ((h ^ byte) * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def scan(web_dir):
+    assets = []
+    for name in sorted(os.listdir(web_dir)):
+        path = os.path.join(web_dir, name)
+        if name.startswith(".") or not os.path.isfile(path):
+            continue
+        if not NAME_PATTERN.match(name):
+            raise ValueError("unsupported file name: %s" % name)
+        ext = os.path.splitext(name)[1].lower()
+        if ext not in MIME_TYPES:
+            raise ValueError("no MIME type for %s (add it to MIME_TYPES)" % name)
+        assets.append({
+            "url": "/" + name,
+            "path": "/web/" + name,
+            "mime": MIME_TYPES[ext],
+            "cache": CACHE_CONTROL.get(ext, DEFAULT_CACHE_CONTROL),
+        })
+    if not assets:
+        raise ValueError("no assets in %s" % web_dir)
+    if len(assets) > MAX_ASSETS:
+        raise ValueError("%d assets, at most %d" % (len(assets), MAX_ASSETS))
+    return assets
+
+
+def place(urls):
+    """Returns (seed, slot bits, slots) with every URL in its own slot.
+
+    The slot is the top bits of the hash: the low bits of FNV-1a depend only
+    on the low bits of the seed and of each character, so they barely change
+    from one seed to the next.
+    """
+    bits = 1
+    while (1 << bits) < len(urls):
+        bits += 1
+    while True:
+        for seed in range(1, MAX_SEEDS):
+            table = [-1] * (1 << bits)
+            for index, url in enumerate(urls):
+                slot = fnv1a(url, seed) >> (32 - bits)
+                if table[slot] >= 0:
+                    break
+                table[slot] = index
+            else:
+                return seed, bits, table
+        bits += 1
+
+
+def render(assets):
+    urls = [a["url"] for a in assets]
+    seed, bits, table = place(urls)
+    slots = len(table)
+    lines = [
+        "// Generated by tools/web_assets.py from data/web - do not edit.",
+        "// Checked against web_assets.h at compile time.",
+        "",
+        "#ifndef WEB_MANIFEST_H",
+        "#define WEB_MANIFEST_H",
+        "",
+        "#define WEB_ASSET_COUNT     %d" % len(assets),
+        "#define WEB_ASSET_SLOT_BITS %d" % bits,
+        "#define WEB_ASSET_SLOTS     %d" % slots,
+        "#define WEB_ASSET_SEED      0x%08Xu" % seed,
+        "#define WEB_ASSET_MAX_URL   %d" % max(len(u) for u in urls),
+        "",
+        "static constexpr WebAsset WEB_ASSETS[WEB_ASSET_COUNT] = {",
+    ]
+    for a in assets:
+        lines.append('  {"%s", "%s", "%s", "%s"},' % (a["url"], a["path"], a["mime"], a["cache"]))
+    lines.append("};")
+    lines.append("")
+    lines.append("// Index into WEB_ASSETS by hash slot, -1 = empty")
+    lines.append("static constexpr int8_t WEB_ASSET_SLOT[WEB_ASSET_SLOTS] = {")
+    for start in range(0, slots, 16):
+        row = ", ".join("%d" % i for i in table[start:start + 16])
+        lines.append("  %s," % row)
+    lines.append("};")
+    lines.append("")
+    lines.append("#endif // WEB_MANIFEST_H")
+    return "\n".join(lines) + "\n"
+
+
+def generate(web_dir, out_path, check=False):
+    text = render(scan(web_dir))
+    current = None
+    if os.path.exists(out_path):
+        with open(out_path) as f:
+            current = f.read()
+    if current == text:
+        return True
+    if check:
+        return False
+    with open(out_path, "w") as f:
+        f.write(text)
+    print("web_assets: wrote %s" % out_path)
+    return True
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--web", default=os.path.join(root, "data", "web"))
+    parser.add_argument("--out", default=os.path.join(root, "src", "web_manifest.h"))
+    parser.add_argument("--check", action="store_true")
+    args = parser.parse_args()
+    try:
+        ok = generate(args.web, args.out, args.check)
+    except ValueError as e:
+        print("web_assets: %s" % e, file=sys.stderr)
+        return 2
+    if not ok:
+        print("web_assets: %s is out of date" % args.out, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
+else:
+    # PlatformIO pre-build script
+    Import("env")  # noqa: F821
+    project = env.subst("$PROJECT_DIR")  # noqa: F821
+    generate(os.path.join(project, "data", "web"), os.path.join(project, "src", "web_manifest.h"))